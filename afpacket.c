@@ -0,0 +1,502 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+#ifdef HAVE_AF_PACKET
+
+#include <poll.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+static u_int8_t skipOutgoing;
+
+/* ****************************************************** */
+
+/* The ring layout is shared with the kernel: order our stores/loads with its own */
+static __inline__ void afPacketBarrier(void) {
+  __sync_synchronize();
+}
+
+/* ****************************************************** */
+
+static void releaseAfPacketBlock(void *arg) {
+  AfPacketBlock *blk = (AfPacketBlock*)arg;
+  u_int32_t refcnt;
+
+#ifdef HAVE_BUILTIN_ATOMIC
+  refcnt = __sync_sub_and_fetch(&blk->refcnt, 1);
+#else
+  pthread_rwlock_wrlock(&blk->sock->lock);
+  refcnt = --blk->refcnt;
+  pthread_rwlock_unlock(&blk->sock->lock);
+#endif
+
+  if(refcnt == 0) {
+    /* Every packet of the block has been processed: hand it back to the kernel */
+    afPacketBarrier();
+    blk->desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+  }
+}
+
+/* ****************************************************** */
+
+static __inline__ void holdAfPacketBlock(AfPacketBlock *blk) {
+#ifdef HAVE_BUILTIN_ATOMIC
+  __sync_add_and_fetch(&blk->refcnt, 1);
+#else
+  pthread_rwlock_wrlock(&blk->sock->lock);
+  blk->refcnt++;
+  pthread_rwlock_unlock(&blk->sock->lock);
+#endif
+}
+
+/* ****************************************************** */
+
+static int setAfPacketFilter(AfPacketSocket *s, int datalink) {
+  struct bpf_program fcode;
+  struct sock_fprog fprog;
+  pcap_t *dead;
+  int rc = 0;
+
+  if(readOnlyGlobals.netFilter == NULL) return(0);
+
+  /* libpcap is used as a compiler only: the kernel runs the filter on the socket */
+  if((dead = pcap_open_dead(datalink, readOnlyGlobals.snaplen)) == NULL)
+    return(-1);
+
+  if(pcap_compile(dead, &fcode, readOnlyGlobals.netFilter, 1, htonl(0xFFFFFF00)) < 0) {
+    pcap_close(dead);
+    return(-1);
+  }
+
+  fprog.len = fcode.bf_len, fprog.filter = (struct sock_filter*)fcode.bf_insns;
+
+  if(setsockopt(s->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+    rc = -1;
+
+  pcap_freecode(&fcode);
+  pcap_close(dead);
+
+  return(rc);
+}
+
+/* ****************************************************** */
+
+static int openAfPacketSocket(AfPacketSocket *s, int ifindex, int datalink,
+			      u_int16_t fanout_id, u_int8_t join_fanout, char *ebuf) {
+  int version = TPACKET_V3, reserve = AFPACKET_VLAN_TAG_LEN, fanout_arg;
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  u_int32_t i;
+
+  memset(s, 0, sizeof(AfPacketSocket));
+
+  if((s->fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "socket(PF_PACKET): %s", strerror(errno));
+    return(-1);
+  }
+
+  /* The headroom is used to put back the VLAN tag stripped by the kernel */
+  if((setsockopt(s->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+     || (setsockopt(s->fd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof(reserve)) < 0)) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "TPACKET_V3 not supported: %s", strerror(errno));
+    return(-1);
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = AFPACKET_BLOCK_SIZE, req.tp_block_nr = AFPACKET_NUM_BLOCKS;
+  req.tp_frame_size = AFPACKET_FRAME_SIZE;
+  req.tp_frame_nr = (AFPACKET_BLOCK_SIZE / AFPACKET_FRAME_SIZE) * AFPACKET_NUM_BLOCKS;
+  req.tp_retire_blk_tov = AFPACKET_BLOCK_TIMEOUT;
+
+  if(setsockopt(s->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "PACKET_RX_RING: %s", strerror(errno));
+    return(-1);
+  }
+
+  s->ring_len = req.tp_block_size * req.tp_block_nr, s->num_blocks = req.tp_block_nr;
+  s->ring = (u_char*)mmap(NULL, s->ring_len, PROT_READ|PROT_WRITE, MAP_SHARED, s->fd, 0);
+
+  if(s->ring == (u_char*)MAP_FAILED) {
+    s->ring = NULL;
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "mmap(%u bytes): %s", s->ring_len, strerror(errno));
+    return(-1);
+  }
+
+  if((s->blocks = (AfPacketBlock*)calloc(s->num_blocks, sizeof(AfPacketBlock))) == NULL) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Not enough memory");
+    return(-1);
+  }
+
+  for(i=0; i<s->num_blocks; i++) {
+    s->blocks[i].desc = (struct tpacket_block_desc*)&s->ring[i * req.tp_block_size];
+    s->blocks[i].sock = s;
+  }
+
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_init(&s->lock, NULL);
+#endif
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET, sll.sll_protocol = htons(ETH_P_ALL), sll.sll_ifindex = ifindex;
+
+  if(bind(s->fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "bind(): %s", strerror(errno));
+    return(-1);
+  }
+
+  if(readOnlyGlobals.promisc_mode) {
+    struct packet_mreq mreq;
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex, mreq.mr_type = PACKET_MR_PROMISC;
+
+    if(setsockopt(s->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+      traceEvent(TRACE_WARNING, "Unable to set promiscuous mode: %s", strerror(errno));
+  }
+
+  if(setAfPacketFilter(s, datalink) < 0)
+    traceEvent(TRACE_ERROR, "Unable to set filter %s. Filter ignored.", readOnlyGlobals.netFilter);
+
+  if(join_fanout) {
+    /* Flows are steered again by decodePacket(): the kernel hash only spreads the load */
+    fanout_arg = fanout_id | (PACKET_FANOUT_HASH << 16);
+
+    if(setsockopt(s->fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) < 0) {
+      snprintf(ebuf, PCAP_ERRBUF_SIZE, "PACKET_FANOUT: %s", strerror(errno));
+      return(-1);
+    }
+  }
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+static void freeAfPacketSocket(AfPacketSocket *s) {
+  if(s->ring != NULL) munmap(s->ring, s->ring_len);
+  if(s->blocks != NULL) free(s->blocks);
+  if(s->fd > 0) close(s->fd);
+
+  memset(s, 0, sizeof(AfPacketSocket));
+}
+
+/* ****************************************************** */
+
+int openAfPacketSockets(char *device, char *ebuf) {
+  u_int32_t num_sockets = readOnlyGlobals.afPacketThreads, i;
+  u_int16_t fanout_id = getpid() & 0xFFFF;
+  int ifindex, datalink, fd;
+  struct ifreq ifr;
+
+  if(device == NULL) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "--afpacket-threads requires -i <device>");
+    return(-1);
+  }
+
+  if((ifindex = if_nametoindex(device)) == 0) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unknown interface %s", device);
+    return(-1);
+  }
+
+  if((fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "socket(PF_PACKET): %s", strerror(errno));
+    return(-1);
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, device, sizeof(ifr.ifr_name)-1);
+
+  if(ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "SIOCGIFHWADDR(%s): %s", device, strerror(errno));
+    close(fd);
+    return(-1);
+  }
+
+  close(fd);
+
+  switch(ifr.ifr_hwaddr.sa_family) {
+  case ARPHRD_ETHER:
+    datalink = DLT_EN10MB;
+    break;
+  case ARPHRD_LOOPBACK:
+    /* Every packet is seen both leaving and entering lo: keep one copy as libpcap does */
+    datalink = DLT_EN10MB, skipOutgoing = 1;
+    break;
+  case ARPHRD_NONE:
+  case ARPHRD_PPP:
+    datalink = DLT_RAW;
+    break;
+  default:
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unsupported link type %u on %s",
+	     ifr.ifr_hwaddr.sa_family, device);
+    return(-1);
+  }
+
+  /* Capture thread i queues packets from the packet pool i */
+  if(num_sockets > readOnlyGlobals.numProcessThreads) {
+    traceEvent(TRACE_WARNING, "AF_PACKET: using %u capture threads (as many as processing threads)",
+	       readOnlyGlobals.numProcessThreads);
+    num_sockets = readOnlyGlobals.afPacketThreads = readOnlyGlobals.numProcessThreads;
+  }
+
+  for(i=0; i<num_sockets; i++) {
+    if(openAfPacketSocket(&readWriteGlobals->afPacket[i], ifindex, datalink,
+			  fanout_id, (num_sockets > 1) ? 1 : 0, ebuf) < 0) {
+      while(1) {
+	freeAfPacketSocket(&readWriteGlobals->afPacket[i]);
+	if(i-- == 0) break;
+      }
+
+      return(-1);
+    }
+  }
+
+  readOnlyGlobals.datalink = datalink;
+
+  traceEvent(TRACE_NORMAL, "AF_PACKET: capturing from %s with %u TPACKET_V3 socket(s) [%u x %u KB blocks each]",
+	     device, num_sockets, AFPACKET_NUM_BLOCKS, AFPACKET_BLOCK_SIZE / 1024);
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+/* With a single processing thread the capture thread decodes the packets of a block in bursts */
+static void decodeAfPacketBatch(unsigned long thread_id, QueuedPacket **pkts, u_int32_t num) {
+  u_int32_t i;
+
+  decodePacketBatch(thread_id, pkts, num);
+
+  for(i=0; i<num; i++)
+    releaseAfPacketBlock((AfPacketBlock*)pkts[i]->release_arg);
+}
+
+/* ****************************************************** */
+
+static void walkAfPacketBlock(unsigned long thread_id, AfPacketBlock *blk, u_short *packetToGo) {
+  struct tpacket_block_desc *desc = blk->desc;
+  struct tpacket3_hdr *hdr = (struct tpacket3_hdr*)((u_char*)desc + desc->hdr.bh1.offset_to_first_pkt);
+  u_int32_t num_pkts = desc->hdr.bh1.num_pkts, num_batched = 0, i;
+  QueuedPacket batch[PACKET_BATCH_MAX], *pkts[PACKET_BATCH_MAX];
+  struct pcap_pkthdr h;
+  /* Packets handed to the processing threads are batched by them */
+  u_int8_t batching = ((readOnlyGlobals.packetBatchSize > 1)
+		       && (!(readOnlyGlobals.useLocks && (readOnlyGlobals.numProcessThreads > 1)))
+		       && (!readOnlyGlobals.checkMemoryBoundaries)) ? 1 : 0;
+
+  /* Held until the whole block has been walked */
+  blk->refcnt = 1;
+
+  for(i=0; i<num_pkts; i++, hdr = (struct tpacket3_hdr*)((u_char*)hdr + hdr->tp_next_offset)) {
+    u_char *p = (u_char*)hdr + hdr->tp_mac;
+
+    if(skipOutgoing) {
+      struct sockaddr_ll *sll = (struct sockaddr_ll*)((u_char*)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+      if(sll->sll_pkttype == PACKET_OUTGOING) continue;
+    }
+
+    if((!readOnlyGlobals.fakePktSampling) && (readOnlyGlobals.pktSampleRate > 1)) {
+      if(--(*packetToGo) > 0) continue;
+      *packetToGo = readOnlyGlobals.pktSampleRate;
+    }
+
+    h.ts.tv_sec = hdr->tp_sec, h.ts.tv_usec = hdr->tp_nsec / 1000;
+    h.caplen = hdr->tp_snaplen, h.len = hdr->tp_len;
+
+    if((hdr->tp_status & TP_STATUS_VLAN_VALID) && (readOnlyGlobals.datalink == DLT_EN10MB)) {
+      u_int16_t tpid = (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) ? hdr->hv1.tp_vlan_tpid : 0x8100;
+
+      /* Rebuild the 802.1Q header in the PACKET_RESERVE headroom */
+      p -= AFPACKET_VLAN_TAG_LEN;
+      memmove(p, &p[AFPACKET_VLAN_TAG_LEN], 12 /* MAC addresses */);
+      p[12] = (tpid >> 8) & 0xFF, p[13] = tpid & 0xFF;
+      p[14] = (hdr->hv1.tp_vlan_tci >> 8) & 0xFF, p[15] = hdr->hv1.tp_vlan_tci & 0xFF;
+      h.caplen += AFPACKET_VLAN_TAG_LEN, h.len += AFPACKET_VLAN_TAG_LEN;
+    }
+
+    h.caplen = min(h.caplen, readOnlyGlobals.snaplen);
+
+    /* decodePacketRef() checks the frames it gets, the batch path does not */
+    if(batching && (!checkPacketHeader(&h)))
+      continue;
+
+    holdAfPacketBlock(blk);
+
+    if(batching) {
+      QueuedPacket *pkt = &batch[num_batched];
+
+      memcpy(&pkt->h, &h, sizeof(h));
+      pkt->p = p, pkt->packet_if_idx = -1 /* input interface id */;
+      pkt->sampledPacket = readOnlyGlobals.fakePktSampling, pkt->rx_direction = 1 /* RX */;
+      pkt->numPkts = 1, pkt->input_index = NO_INTERFACE_INDEX, pkt->output_index = NO_INTERFACE_INDEX;
+      pkt->flow_sender_ip = 0, pkt->packet_hash = 0;
+      pkt->release = releaseAfPacketBlock, pkt->release_arg = blk;
+      pkts[num_batched] = pkt;
+
+      if(++num_batched == readOnlyGlobals.packetBatchSize)
+	decodeAfPacketBatch(thread_id, pkts, num_batched), num_batched = 0;
+    } else
+      decodePacketRef(thread_id, -1 /* input interface id */,
+		      &h, p, readOnlyGlobals.fakePktSampling, 1 /* RX */,
+		      0 /* packet hash */,
+		      releaseAfPacketBlock, blk);
+
+    if(readOnlyGlobals.capture_num_packet_and_quit > 1)
+      readOnlyGlobals.capture_num_packet_and_quit--;
+    else if(readOnlyGlobals.capture_num_packet_and_quit == 1)
+      readWriteGlobals->shutdownInProgress = 1;
+  }
+
+  if(num_batched > 0)
+    decodeAfPacketBatch(thread_id, pkts, num_batched);
+
+  releaseAfPacketBlock(blk);
+}
+
+/* ****************************************************** */
+
+void* fetchAfPacketPackets(void *_thid) {
+  unsigned long thread_id = (unsigned long)_thid;
+  AfPacketSocket *s = &readWriteGlobals->afPacket[thread_id];
+  u_short packetToGo = readOnlyGlobals.pktSampleRate;
+  struct pollfd pfd;
+
+  traceEvent(TRACE_INFO, "AF_PACKET capture thread started [thread %lu]", thread_id);
+
+  s->running = 1;
+  pfd.fd = s->fd, pfd.events = POLLIN | POLLERR;
+
+  while(!readWriteGlobals->shutdownInProgress) {
+    AfPacketBlock *blk = &s->blocks[s->next_block];
+
+    if(blk->desc->hdr.bh1.block_status & TP_STATUS_USER) {
+      afPacketBarrier();
+
+      if(blk->desc->hdr.bh1.seq_num != blk->seq_num) {
+	blk->seq_num = blk->desc->hdr.bh1.seq_num;
+	walkAfPacketBlock(thread_id, blk, &packetToGo);
+	s->next_block = (s->next_block + 1) % s->num_blocks;
+      } else {
+	/* Walked on the previous lap: queued packets still hold it */
+	s->num_held_waits++;
+	usleep(100);
+      }
+    } else {
+      pfd.revents = 0;
+      if((poll(&pfd, 1, AFPACKET_POLL_TIMEOUT) < 0) && (errno != EINTR)) {
+	traceEvent(TRACE_ERROR, "AF_PACKET poll() failed: %s", strerror(errno));
+	break;
+      }
+    }
+
+    if(thread_id == 0) idleThreadTask(thread_id, 5);
+  }
+
+  s->running = 0;
+  traceEvent(TRACE_INFO, "%s(threadId=%lu) terminated", __FUNCTION__, thread_id);
+
+  return(NULL);
+}
+
+/* ****************************************************** */
+
+/* Stats thread only: the kernel resets the counters at each read */
+u_int32_t printAfPacketStats(u_int8_t dump_stats_on_screen) {
+  u_int64_t tot_pkts = 0, tot_drops = 0;
+  u_int32_t drop_diff = 0, i;
+
+  for(i=0; i<readOnlyGlobals.afPacketThreads; i++) {
+    AfPacketSocket *s = &readWriteGlobals->afPacket[i];
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    if(s->fd <= 0) continue;
+
+    if(getsockopt(s->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == 0) {
+      /* tp_packets includes the drops */
+      s->num_pkts += stats.tp_packets, s->num_drops += stats.tp_drops;
+      s->num_freezes += stats.tp_freeze_q_cnt;
+    }
+
+    drop_diff += (u_int32_t)(s->num_drops - s->last_drops);
+    s->last_pkts = s->num_pkts, s->last_drops = s->num_drops;
+    tot_pkts += s->num_pkts, tot_drops += s->num_drops;
+  }
+
+  if(readWriteGlobals->shutdownInProgress && (tot_drops > 0)) {
+    char msg[256];
+
+    snprintf(msg, sizeof(msg), "Final capture stats (AF_PACKET): "
+	     "%llu/%llu pkts rcvd/dropped [%.1f%%]",
+	     (long long unsigned)tot_pkts, (long long unsigned)tot_drops,
+	     (tot_pkts > 0) ? ((float)(tot_drops*100)/(float)tot_pkts) : 0);
+    dumpLogEvent(packet_drop, severity_warning, msg);
+  }
+
+  return(drop_diff);
+}
+
+/* ****************************************************** */
+
+void dumpAfPacketStats(void) {
+  u_int32_t i;
+
+  for(i=0; i<readOnlyGlobals.afPacketThreads; i++) {
+    AfPacketSocket *s = &readWriteGlobals->afPacket[i];
+
+    if(s->fd <= 0) continue;
+
+    traceEvent(TRACE_NORMAL, "AF_PACKET [thread %u]: [%llu pkts][%llu ring drops][%.1f %%][queue freezes=%llu]",
+	       i, (long long unsigned)s->num_pkts, (long long unsigned)s->num_drops,
+	       (s->num_pkts > 0) ? ((float)(s->num_drops*100)/(float)s->num_pkts) : 0,
+	       (long long unsigned)s->num_freezes);
+  }
+}
+
+/* ****************************************************** */
+
+void closeAfPacketSockets(void) {
+  u_int32_t i, j;
+
+  for(i=0; i<readOnlyGlobals.afPacketThreads; i++) {
+    AfPacketSocket *s = &readWriteGlobals->afPacket[i];
+
+    if(s->fd <= 0) continue;
+
+    /* Capture threads leave within AFPACKET_POLL_TIMEOUT */
+    for(j=0; s->running && (j < 2*AFPACKET_POLL_TIMEOUT); j += 10)
+      usleep(10000);
+
+    /*
+      The ring is not unmapped: processing threads may still
+      reference queued packets until the process exits
+    */
+    close(s->fd);
+    s->fd = -1;
+  }
+}
+
+#endif /* HAVE_AF_PACKET */
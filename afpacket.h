@@ -0,0 +1,86 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _AFPACKET_H_
+#define _AFPACKET_H_
+
+#if defined(linux) && defined(TPACKET3_HDRLEN)
+#define HAVE_AF_PACKET
+#endif
+
+#ifdef HAVE_AF_PACKET
+
+/* ********************************** */
+
+#define AFPACKET_BLOCK_SIZE   (1 << 20)
+#define AFPACKET_NUM_BLOCKS         64 /* Per socket */
+#define AFPACKET_FRAME_SIZE       2048
+#define AFPACKET_BLOCK_TIMEOUT      10 /* msec: the kernel hands over blocks not yet full */
+#define AFPACKET_POLL_TIMEOUT     1000 /* msec */
+#define AFPACKET_VLAN_TAG_LEN        4
+
+typedef struct {
+  struct tpacket_block_desc *desc;
+  volatile u_int32_t refcnt; /* Packets not yet processed, +1 while the block is walked */
+  u_int64_t seq_num;         /* Kernel sequence number of the last walk */
+  struct afPacketSocket *sock;
+} AfPacketBlock;
+
+/*
+  One TPACKET_V3 socket/ring per capture thread, all of them joined to
+  the same PACKET_FANOUT_HASH group so the kernel spreads the traffic.
+
+  The kernel fills whole blocks of packets. A capture thread walks a
+  block handing every packet to the engine with decodePacketRef(), so
+  packets are not copied when queued to the processing threads. Each
+  packet holds a reference on its block: when the last one is released
+  the block goes back to the kernel. Blocks may be returned out of
+  order, the kernel drops packets (tp_drops) only when it finds the
+  next block still owned by user space. The block sequence number tells
+  a new block from one walked on the previous lap and still held.
+*/
+typedef struct afPacketSocket {
+  int fd;
+  volatile u_int8_t running;
+  u_char *ring;
+  u_int32_t ring_len, num_blocks, next_block, num_held_waits;
+  AfPacketBlock *blocks;
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_t lock;
+#endif
+
+  /* Updated by the stats thread only */
+  u_int64_t num_pkts, num_drops, num_freezes;
+  u_int64_t last_pkts, last_drops;
+} AfPacketSocket;
+
+/* ********************************** */
+
+extern int openAfPacketSockets(char *device, char *ebuf);
+extern void* fetchAfPacketPackets(void *_thid);
+extern u_int32_t printAfPacketStats(u_int8_t dump_stats_on_screen);
+extern void dumpAfPacketStats(void);
+extern void closeAfPacketSockets(void);
+
+#endif /* HAVE_AF_PACKET */
+
+#endif /* _AFPACKET_H_ */
@@ -198,6 +198,7 @@ typedef struct pluginInformation {
 typedef struct hostInfo {
   u_char macAddress[6];
   u_int8_t mask;
+  u_int8_t asnResolved; /* asn is valid even if 0 (unknown) */
   u_int16_t ifIdx;
   u_int32_t ifHost, asn;
 #ifdef HAVE_GEOIP
@@ -319,23 +320,58 @@ typedef struct flowHashBucketKeyFields {
 
 /* *************************************** */
 
-typedef struct flowHashBucketCoreFields {
-  u_int32_t flow_idx, flow_hash, flow_serial;
-  u_int8_t do_not_expire_for_max_duration; /* Flags */
+#define FLOW_KEY_NONE            0 /* Never matches a packet (e.g. GTP TEID flows) */
+#define FLOW_KEY_IPV4            1
+#define FLOW_KEY_IPV6            2
+#define FLOW_KEY_MAC             3 /* Non-IP flows */
+#define FLOW_KEY_GTP             4 /* GTP signalling: addresses only */
 
-  /* Key */
-  FlowHashBucketKeyFields key;
+#define FLOW_KEY_SHORT_LEN      16 /* Bytes that identify IPv4 and GTP flows */
+
+/*
+  Lookup key of a flow: everything the hash walk compares but the
+  subflow_id and the TOS, that are kept next to it. IP endpoints are
+  stored ordered (lower address first, lower port on ties) so both
+  directions of a flow build the same key. IPv4 and GTP keys fit the
+  first 16 bytes, the others use all the 40 bytes.
+*/
+typedef struct flowKey {
+  u_int16_t lo_port, hi_port;
+  u_int16_t vlanId;
+  u_int8_t proto, untunneled_proto;
+
+  union {
+    struct {
+      u_int32_t lo, hi; /* Host byte order */
+    } v4;
+
+    struct {
+      u_int32_t lo[4], hi[4];
+    } v6;
+
+    struct {
+      u_int8_t lo[6], hi[6]; /* Source and destination: not ordered */
+    } mac;
+  } addr;
+} FlowKey;
+
+/* *************************************** */
 
-  /* Value */
+/* Flow identity and timers: kept out of line, in the extended bucket */
+typedef struct flowHashBucketCoreFields {
+  /* Written on every packet, read by the idle checks */
   struct {
-    struct timeval firstSeenSent, lastSeenSent;
-    struct timeval firstSeenRcvd, lastSeenRcvd;
+    struct timeval lastSeenSent, lastSeenRcvd;
+    struct timeval firstSeenSent, firstSeenRcvd;
   } flowTimers;
 
-  struct {
-    u_int32_t bytesSent, pktSent;
-    u_int32_t bytesRcvd, pktRcvd;
-  } flowCounters;
+  u_int32_t flow_idx, flow_serial;
+  u_int8_t do_not_expire_for_max_duration; /* Flags */
+
+  FlowKey lookup;                /* Whole lookup key: the bucket holds its first FLOW_KEY_SHORT_LEN bytes */
+
+  /* Key */
+  FlowHashBucketKeyFields key;
 
 } FlowHashBucketCoreFields;
 
@@ -346,18 +382,51 @@ typedef struct flowHashBucketCoreFields {
 #define NBAR2_PROTO_TYPE     2
 #define IXIA_PROTO_TYPE      3
 
+#define FLOW_BUCKET_LEN         64 /* One cache line */
+
+/*
+  Hot part of the bucket: the hash walk, the key compare of IPv4 and
+  GTP flows (IPv6 and MAC keys go on in ext->tuple.lookup) and the
+  counter update of a matching flow read or write only these fields,
+  that together with the hash successor and the ext pointer fill the
+  single cache line of a FlowHashBucket.
+*/
 typedef struct flowHashMicroBucket {
-  FlowHashBucketCoreFields tuple; /* Flow core fields */
+  u_int8_t magic;
+  u_int8_t bucket_expired; /* Force bucket to expire */
+
+  struct direction {
+    u_int8_t src2dst, dst2src; /* 1=RX [receive], 0=TX [transmit] (packet direction) */
+  } rx_direction;
+
+  u_int8_t key_type;             /* FLOW_KEY_XXX */
+  u_int8_t key_swapped;          /* 1 = the first packet went from the hi to the lo endpoint */
+  u_int8_t src2dstTos, dst2srcTos;
+  u_int32_t flow_hash;
+  u_int32_t subflow_id;          /*
+				   Usually is 0: user for subflows on UDP-based proto such as DNS
+				   or sequence number in GTP
+				 */
+
+  struct {
+    u_int32_t bytesSent, pktSent;
+    u_int32_t bytesRcvd, pktRcvd;
+  } flowCounters;
+
+  u_int8_t lookup[FLOW_KEY_SHORT_LEN]; /* First bytes of ext->tuple.lookup */
+  struct flowHashBucket *hash_next;    /* Hash collision list (prev is ext->hash_prev) */
+} FlowHashMicroBucket;
+
+/* *************************************** */
+
+/* Cold part of the bucket: set up once per flow or read at export time */
+typedef struct flowHashColdBucket {
   u_int8_t dont_export_flow; /*
 			       Set it to 1 if when the flow has to be exported, its memory
 			       will be freed but the flow will not be exported
 			     */
   u_int8_t engine_type, engine_id; /* 0=use default */
 
-  struct direction {
-    u_int8_t src2dst, dst2src; /* 1=RX [receive], 0=TX [transmit] (packet direction) */
-  } rx_direction;
-
   /* L7 protocol */
   struct {
     u_int8_t proto_type /* ***_PROTO_TYPE */;
@@ -389,33 +458,28 @@ typedef struct flowHashMicroBucket {
     u_int8_t server_searched;
     char *name;
   } server;
+} FlowHashColdBucket;
 
-  u_int8_t bucket_expired; /* Force bucket to expire */
-  u_int8_t purge_at_next_loop;
-
-  CircularList hash; /* Hash collision list pointers */
+/* *************************************** */
 
-  /* Expire List (max flow duration) */
-  CircularList max_duration;
+typedef struct {
+  FlowHashBucketCoreFields tuple; /* Flow core fields */
+  FlowHashColdBucket cold;
 
-  /* Idle flows (no traffic [idle]) */
-  CircularList no_traffic;
-} FlowHashMicroBucket;
+  struct flowHashBucket *hash_prev; /* Hash collision list */
 
-/* *************************************** */
+  /* Timer wheel slot list (see flowtimer.h) */
+  CircularList timer;
+  u_int32_t timer_tick;  /* Tick the bucket is armed for */
+  u_int16_t timer_slot;  /* Wheel slot, FLOW_TIMER_NOT_ARMED if none */
 
-typedef struct {
+  u_int8_t pool_id;        /* 0 = heap, thread_id+1 = block of that thread flow bucket pool */
   u_int8_t thread_id;      /* Thread on which the bucket was allocated */
-  u_int32_t subflow_id;    /*
-			     Usually is 0: user for subflows on UDP-based proto such as DNS
-			     or sequence number in GTP
-			   */
   u_int8_t swap_flow;      /* 0= don't swap, 1=in case of bidirectional flow send the reverse only */
   u_int8_t sampled_flow;   /* 0=normal flow, 1=sampled flow (i.e. to discard) */
   u_int32_t src2dst_tunnel_id, dst2src_tunnel_id;     /* E.g. GTP tunnel */
 
   u_int32_t if_input, if_output;
-  u_int8_t src2dstTos, dst2srcTos;
   u_int8_t src2dstMinTTL, dst2srcMinTTL, src2dstMaxTTL, dst2srcMaxTTL;
   IpAddress nextHop;
   HostInfo srcInfo, dstInfo; /* src and dst host metadata information */
@@ -458,11 +522,18 @@ typedef struct {
 
 /* *************************************** */
 
+/*
+  A flow: one cache line aligned record, everything else is behind
+  ext (see pool.h for the blocks that hold both).
+*/
 typedef struct flowHashBucket {
-  u_int8_t magic;
-
-  FlowHashMicroBucket core;
+  FlowHashMicroBucket core; /* Hot */
   FlowHashExtendedBucket *ext;
-} FlowHashBucket;
+} __attribute__((aligned(FLOW_BUCKET_LEN))) FlowHashBucket;
+
+/* Build time checks of the single cache line layout */
+typedef char flowHashBucketLenCheck[(sizeof(FlowHashBucket) == FLOW_BUCKET_LEN) ? 1 : -1];
+typedef char flowHashBucketExtCheck[((offsetof(FlowHashBucket, ext) + sizeof(void*)) <= FLOW_BUCKET_LEN) ? 1 : -1];
+typedef char flowHashBucketLookupCheck[(offsetof(FlowHashBucket, core.lookup) + FLOW_KEY_SHORT_LEN <= FLOW_BUCKET_LEN) ? 1 : -1];
 
 #endif /* _BUCKET_H_ */
@@ -85,17 +85,209 @@ static redisContext* connectToRedis(u_int8_t logging_redis) {
 
 /* ************************************ */
 
-void logCacheKeyValueString(const char *prefix, u_int16_t id, const char *value) {
 #ifdef HAVE_REDIS
-  if(readOnlyGlobals.redis.logging_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_logging[id]);
-    if(readOnlyGlobals.redis.logging_context[id] == NULL) readOnlyGlobals.redis.logging_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.logging_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] RPUSH log.%s %s", prefix, value);
-      redisAppendCommand(readOnlyGlobals.redis.logging_context[id], "RPUSH log.%s %s", prefix, value);
+static void initRedisQueue(RedisQueue *q, u_int8_t in_use) {
+  pthread_rwlock_init(&q->lock, NULL);
+
+  if(in_use
+     && ((q->ring = (RedisCommand*)calloc(REDIS_QUEUE_MAX_COMMANDS, sizeof(RedisCommand))) == NULL)) {
+    traceEvent(TRACE_ERROR, "Not enough memory?");
+    exit(-1);
+  }
+}
+
+/* ************************************ */
+
+static void termRedisQueue(RedisQueue *q) {
+  if(q->ring != NULL) {
+    for(; q->num_queued > 0; q->num_queued--) {
+      free(q->ring[q->head].cmd);
+      q->head = (q->head + 1) % REDIS_QUEUE_MAX_COMMANDS;
+    }
+
+    free(q->ring);
+    q->ring = NULL;
+  }
+
+  pthread_rwlock_destroy(&q->lock);
+}
+
+/* ************************************ */
+
+/* Returns -1 when the command has been dropped */
+static int queueRedisCommand(u_int16_t id, u_int8_t logging, const char *format, va_list ap) {
+  RedisQueue *q = logging ? &readWriteGlobals->redis.loggingQueue[id] : &readWriteGlobals->redis.writeQueue[id];
+  char *cmd;
+  int len, rc = 0;
+  u_int8_t wakeup = 0;
+
+  /* Formatted here so that the queue lock is held only to link it */
+  if((len = redisvFormatCommand(&cmd, format, ap)) < 0) {
+    traceEvent(TRACE_WARNING, "[Redis] Unable to format command %s", format);
+    return(-1);
+  }
+
+  pthread_rwlock_wrlock(&q->lock);
+  if((q->ring == NULL)
+     || (q->num_queued == REDIS_QUEUE_MAX_COMMANDS)
+     || ((q->num_bytes + len) > REDIS_QUEUE_MAX_BYTES)) {
+    q->num_dropped++, rc = -1;
+  } else {
+    RedisCommand *c = &q->ring[(q->head + q->num_queued) % REDIS_QUEUE_MAX_COMMANDS];
+
+    if(q->num_queued == 0) gettimeofday(&q->oldest, NULL);
+    c->cmd = cmd, c->len = len;
+    q->num_queued++, q->num_bytes += len;
+
+    /* The first command sets the flush deadline, a full pipeline is sent at once */
+    if((q->num_queued == 1) || (q->num_queued == REDIS_PIPELINE_DEPTH))
+      wakeup = 1;
+
+    if(logging)
       incrementLoggingQueueStats(id);
+    else
+      incrementSetDeleteQueueStats(id);
+  }
+  pthread_rwlock_unlock(&q->lock);
+
+  if(wakeup)
+    signalCondvar(&readWriteGlobals->redis.queueCondvar[id], 0);
+
+  if(rc == -1) free(cmd);
+  return(rc);
+}
+
+/* ************************************ */
+
+static void queueSetDeleteCommand(u_int16_t id, const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  queueRedisCommand(id, 0, format, ap);
+  va_end(ap);
+}
+
+/* ************************************ */
+
+static void queueLoggingCommand(u_int16_t id, const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  queueRedisCommand(id, 1, format, ap);
+  va_end(ap);
+}
+
+/* ************************************ */
+
+/*
+  Sends up to REDIS_PIPELINE_DEPTH queued commands of a connection back
+  to back and then reads their replies, so they cost one round trip.
+  Unless force is set, a queue shorter than that is left alone until its
+  oldest command has waited REDIS_PIPELINE_FLUSH_MSEC. Returns the number
+  of commands taken off the queue.
+*/
+static u_int32_t flushRedisQueue(u_int16_t id, u_int8_t logging, u_int8_t force) {
+  RedisQueue *q = logging ? &readWriteGlobals->redis.loggingQueue[id] : &readWriteGlobals->redis.writeQueue[id];
+  redisContext **context = logging ? &readOnlyGlobals.redis.logging_context[id] : &readOnlyGlobals.redis.write_context[id];
+  pthread_rwlock_t *context_lock = logging ? &readOnlyGlobals.redis.lock_logging[id] : &readOnlyGlobals.redis.lock_set_delete[id];
+  RedisCommand batch[REDIS_PIPELINE_DEPTH];
+  u_int32_t num, num_replies = 0, num_errors = 0, i;
+  struct timeval now;
+
+  if(q->ring == NULL) return(0);
+
+  gettimeofday(&now, NULL);
+
+  pthread_rwlock_wrlock(&q->lock);
+  if((q->num_queued == 0)
+     || ((!force) && (q->num_queued < REDIS_PIPELINE_DEPTH)
+	 && (msTimeDiff(&now, &q->oldest) < REDIS_PIPELINE_FLUSH_MSEC))) {
+    pthread_rwlock_unlock(&q->lock);
+    return(0);
+  }
+
+  num = min(q->num_queued, REDIS_PIPELINE_DEPTH);
+  for(i=0; i<num; i++) {
+    batch[i] = q->ring[q->head];
+    q->num_bytes -= batch[i].len;
+    q->head = (q->head + 1) % REDIS_QUEUE_MAX_COMMANDS;
+  }
+  q->num_queued -= num; /* The rest (if any) is older than oldest: flushed at the next call */
+  pthread_rwlock_unlock(&q->lock);
+
+  /* The context lock serializes this thread with pingRedisConnections() */
+  pthread_rwlock_wrlock(context_lock);
+  if(*context == NULL) *context = connectToRedis(logging);
+
+  if(*context != NULL) {
+    for(i=0; i<num; i++)
+      redisAppendFormattedCommand(*context, batch[i].cmd, batch[i].len);
+
+    for(i=0; i<num; i++) {
+      redisReply *reply;
+
+      if((redisGetReply(*context, (void**)&reply) != REDIS_OK) || (reply == NULL)) {
+	traceEvent(TRACE_WARNING, "It looks redis has been restarted (id: %u)", id);
+	redisFree(*context);
+	*context = connectToRedis(logging);
+	break;
+      }
+
+      if(reply->type == REDIS_REPLY_ERROR) num_errors++;
+      freeReplyObject(reply);
+      num_replies++;
     }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_logging[id]);
+  }
+  pthread_rwlock_unlock(context_lock);
+
+  for(i=0; i<num; i++) free(batch[i].cmd);
+
+  pthread_rwlock_wrlock(&q->lock);
+  /*
+    Commands without a reply (connection lost mid batch, or no connection
+    at all) are not sent again: they may have been executed already, and
+    RPUSH/HINCRBY are not idempotent. They are reported as lost.
+  */
+  q->num_sent += num_replies, q->num_errors += num_errors, q->num_lost += num - num_replies, q->num_pipelines++;
+
+  if(logging)
+    readWriteGlobals->redis.queuedLoggingCommands[id] -= num;
+  else
+    readWriteGlobals->redis.queuedSetDeleteCommands[id] -= num;
+  pthread_rwlock_unlock(&q->lock);
+
+  return(num);
+}
+
+/* ************************************ */
+
+static void dumpRedisQueueStats(const char *what, u_int16_t id, RedisQueue *q, u_int timeDifference) {
+  u_int64_t sent = q->num_sent, pipelines = q->num_pipelines;
+  u_int64_t diff_sent = sent - q->last_sent, diff_pipelines = pipelines - q->last_pipelines;
+
+  q->last_sent = sent, q->last_pipelines = pipelines;
+
+  if((q->ring == NULL)
+     || ((diff_sent == 0) && (q->num_dropped == 0) && (q->num_errors == 0) && (q->num_lost == 0)))
+    return;
+
+  traceEvent(TRACE_NORMAL, "Redis %s Pipeline [%d][%.1f commands/sec][%.1f avg depth]"
+	     "[%u queued][%llu dropped][%llu errors][%llu lost]",
+	     what, id,
+	     (timeDifference > 0) ? ((float)diff_sent / (float)timeDifference) : 0,
+	     (diff_pipelines > 0) ? ((float)diff_sent / (float)diff_pipelines) : 0,
+	     q->num_queued, (long long unsigned)q->num_dropped, (long long unsigned)q->num_errors,
+	     (long long unsigned)q->num_lost);
+}
+#endif
+
+/* ************************************ */
+
+void logCacheKeyValueString(const char *prefix, u_int16_t id, const char *value) {
+#ifdef HAVE_REDIS
+  if(readOnlyGlobals.redis.logging_context[id]) {
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] RPUSH log.%s %s", prefix, value);
+    queueLoggingCommand(id, "RPUSH log.%s %s", prefix, value);
   }
 #endif
 }
@@ -105,14 +297,8 @@ void logCacheKeyValueString(const char *prefix, u_int16_t id, const char *value)
 void queueCacheKeyValueString(const char *prefix, u_int16_t id, const char *queue_name, const char *value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] RPUSH %s%s %s", prefix, queue_name, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "RPUSH %s%s %s", prefix, queue_name, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] RPUSH %s%s %s", prefix, queue_name, value);
+    queueSetDeleteCommand(id, "RPUSH %s%s %s", prefix, queue_name, value);
   }
 #endif
 }
@@ -122,14 +308,8 @@ void queueCacheKeyValueString(const char *prefix, u_int16_t id, const char *queu
 void setCacheKeyValueString(const char *prefix, u_int16_t id, const char *key, const char *value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] SET %s%s %s", prefix, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "SET %s%s %s", prefix, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] SET %s%s %s", prefix, key, value);
+    queueSetDeleteCommand(id, "SET %s%s %s", prefix, key, value);
   }
 #endif
 }
@@ -140,14 +320,8 @@ void publishKeyValueString(const char *prefix, u_int16_t id, const char *key, co
 #ifdef HAVE_REDIS
   if(!readOnlyGlobals.redis.use_nutcracker) {
     if(readOnlyGlobals.redis.write_context[id]) {
-      pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-      if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-      if(readOnlyGlobals.redis.write_context[id]) {
-	if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] PUBLISH %s%s %s", prefix, key, value);
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id], "PUBLISH %s%s %s", prefix, key, value);
-	incrementSetDeleteQueueStats(id);
-      }
-      pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] PUBLISH %s%s %s", prefix, key, value);
+      queueSetDeleteCommand(id, "PUBLISH %s%s %s", prefix, key, value);
     }
   }
 #endif
@@ -158,14 +332,8 @@ void publishKeyValueString(const char *prefix, u_int16_t id, const char *key, co
 void setCacheKeyValueNumber(const char *prefix, u_int16_t id, const char *key, u_int64_t value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {      
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] SET %s%s %llu", prefix, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "SET %s%s %llu", prefix, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] SET %s%s %llu", prefix, key, value);
+    queueSetDeleteCommand(id, "SET %s%s %llu", prefix, key, value);
   }
 #endif
 }
@@ -175,14 +343,8 @@ void setCacheKeyValueNumber(const char *prefix, u_int16_t id, const char *key, u
 void setCacheKeyValueNumberNumber(const char *prefix, u_int16_t id, const u_int32_t key, const u_int32_t value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {      
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] SET %s%u %u", prefix, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "SET %s%u %u", prefix, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] SET %s%u %u", prefix, key, value);
+    queueSetDeleteCommand(id, "SET %s%u %u", prefix, key, value);
   }
 #endif
 }
@@ -192,14 +354,8 @@ void setCacheKeyValueNumberNumber(const char *prefix, u_int16_t id, const u_int3
 void setCacheKeyValueNumberString(const char *prefix, u_int16_t id, const u_int32_t key, const char *value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] SET %s%u %s", prefix, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "SET %s%u %s", prefix, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] SET %s%u %s", prefix, key, value);
+    queueSetDeleteCommand(id, "SET %s%u %s", prefix, key, value);
   }
 #endif
 }
@@ -209,14 +365,8 @@ void setCacheKeyValueNumberString(const char *prefix, u_int16_t id, const u_int3
 void incrCacheKeyValueNumber(const char *prefix, u_int16_t id, const char *key, u_int64_t value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] INCRBY %s%s %llu", prefix, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "INCRBY %s%s %llu", prefix, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] INCRBY %s%s %llu", prefix, key, value);
+    queueSetDeleteCommand(id, "INCRBY %s%s %llu", prefix, key, value);
   }
 #endif
 }
@@ -226,14 +376,8 @@ void incrCacheKeyValueNumber(const char *prefix, u_int16_t id, const char *key,
 void incrHashCacheKeyValueNumber(const char *element, u_int16_t id, const char *key, u_int64_t value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] HINCRBY %s %s %llu", element, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "HINCRBY %s %s %llu", element, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] HINCRBY %s %s %llu", element, key, value);
+    queueSetDeleteCommand(id, "HINCRBY %s %s %llu", element, key, value);
   }
 #endif
 }
@@ -243,14 +387,8 @@ void incrHashCacheKeyValueNumber(const char *element, u_int16_t id, const char *
 void expireCacheKey(const char *prefix, u_int16_t id, const char *key, u_int32_t duration_sec) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] EXPIRE %s%s %u", prefix, key, duration_sec);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "EXPIRE %s%s %u", prefix, key, duration_sec);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] EXPIRE %s%s %u", prefix, key, duration_sec);
+    queueSetDeleteCommand(id, "EXPIRE %s%s %u", prefix, key, duration_sec);
   }
 #endif
 }
@@ -260,14 +398,8 @@ void expireCacheKey(const char *prefix, u_int16_t id, const char *key, u_int32_t
 void setCacheHashKeyValueString(const char *element, u_int16_t id, const char *key, const char *value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] HSET %s %s %s", element, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "HSET %s %s %s", element, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] HSET %s %s %s", element, key, value);
+    queueSetDeleteCommand(id, "HSET %s %s %s", element, key, value);
   }
 #endif
 }
@@ -277,14 +409,8 @@ void setCacheHashKeyValueString(const char *element, u_int16_t id, const char *k
 void setCacheHashKeyValueNumber(const char *element, u_int16_t id, const char *key, u_int64_t value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] HSET %s %s %llu", element, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "HSET %s %s %llu", element, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] HSET %s %s %llu", element, key, value);
+    queueSetDeleteCommand(id, "HSET %s %s %llu", element, key, value);
   }
 #endif
 }
@@ -295,14 +421,8 @@ void incrCacheHashKeyValueNumber(const char *element,
 				 u_int16_t id, const char *key, const u_int64_t value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id] && (value > 0)) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] HINCRBY %s %s %llu", element, key, value);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "HINCRBY %s %s %llu", element, key, value);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] HINCRBY %s %s %llu", element, key, value);
+    queueSetDeleteCommand(id, "HINCRBY %s %s %llu", element, key, value);
   }
 #endif
 }
@@ -313,14 +433,8 @@ void zIncrCacheHashKeyValueNumber(const char *set_name,
 				  u_int16_t id, const char *key, const u_int64_t value) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id] && (value > 0)) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] ZINCRBY %s %llu %s", set_name, value, key);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "ZINCRBY %s %llu %s", set_name, value, key);
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] ZINCRBY %s %llu %s", set_name, value, key);
+    queueSetDeleteCommand(id, "ZINCRBY %s %llu %s", set_name, value, key);
   }
 #endif
 }
@@ -337,18 +451,12 @@ void setCacheNumKeyMixedValueDual(const char *prefix,
     setCacheKeyValueNumberString(prefix, id, key1, value1);
   } else {
     if(readOnlyGlobals.redis.write_context[id]) {
-      pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-      if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-      if(readOnlyGlobals.redis.write_context[id]) {
-	if(unlikely(readOnlyGlobals.enable_debug))
-	  traceEvent(TRACE_NORMAL, "[Redis] MSET %s%u %s %s%u %s",
-		     prefix, key0, value0, prefix, key1, value1);
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id],
-			   "MSET %s%u \"%s\" %s%u \"%s\"",
-			   prefix, key0, value0, prefix, key1, value1);
-	incrementSetDeleteQueueStats(id);
-      }
-      pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+      if(unlikely(readOnlyGlobals.enable_debug))
+	traceEvent(TRACE_NORMAL, "[Redis] MSET %s%u %s %s%u %s",
+		   prefix, key0, value0, prefix, key1, value1);
+      queueSetDeleteCommand(id,
+			    "MSET %s%u \"%s\" %s%u \"%s\"",
+			    prefix, key0, value0, prefix, key1, value1);
     }
   }
 #endif
@@ -366,23 +474,16 @@ void setCacheHashNumKeyMixedValueDual(const char *master_key,
     setCacheKeyValueNumberString(master_key, id, key1, value1);
   } else {
     if(readOnlyGlobals.redis.write_context[id]) {
-      pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-      if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-      if(readOnlyGlobals.redis.write_context[id]) {
-	if(unlikely(readOnlyGlobals.enable_debug))
-	  traceEvent(TRACE_NORMAL, "[Redis] HMSET %s %u %s %u %s",
-		     master_key,
-		     key0, value0,
-		     key1, value1);
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id],
-			   "HMSET %s %u %s %u %s",
-			   master_key,
-			   key0, value0,
-			   key1, value1);
-	
-	incrementSetDeleteQueueStats(id);
-      }
-      pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+      if(unlikely(readOnlyGlobals.enable_debug))
+	traceEvent(TRACE_NORMAL, "[Redis] HMSET %s %u %s %u %s",
+		   master_key,
+		   key0, value0,
+		   key1, value1);
+      queueSetDeleteCommand(id,
+			    "HMSET %s %u %s %u %s",
+			    master_key,
+			    key0, value0,
+			    key1, value1);
     }
   }
 #endif
@@ -417,20 +518,14 @@ void setCacheNumKeyMixedValueQuad(const char *prefix,
     setCacheKeyValueNumberNumber(prefix, id, key3, value3);
   } else {
     if(readOnlyGlobals.redis.write_context[id]) {
-      pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-      if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-      if(readOnlyGlobals.redis.write_context[id]) {
-	if(unlikely(readOnlyGlobals.enable_debug))
-	  traceEvent(TRACE_NORMAL, "[Redis] MSET %s%u %s %s%u %s %s%u %u %s%u %u",
-		     prefix, key0, value0, prefix, key1, value1,
-		     prefix, key2, value2, prefix, key3, value3);
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id],
-			   "MSET %s%u \"%s\" %s%u \"%s\" %s%u %u %s%u %u",
-			   prefix, key0, value0, prefix, key1, value1,
-			   prefix, key2, value2, prefix, key3, value3);
-	incrementSetDeleteQueueStats(id);
-      }
-      pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+      if(unlikely(readOnlyGlobals.enable_debug))
+	traceEvent(TRACE_NORMAL, "[Redis] MSET %s%u %s %s%u %s %s%u %u %s%u %u",
+		   prefix, key0, value0, prefix, key1, value1,
+		   prefix, key2, value2, prefix, key3, value3);
+      queueSetDeleteCommand(id,
+			    "MSET %s%u \"%s\" %s%u \"%s\" %s%u %u %s%u %u",
+			    prefix, key0, value0, prefix, key1, value1,
+			    prefix, key2, value2, prefix, key3, value3);
     }
   }
 #endif
@@ -452,27 +547,20 @@ void setCacheHashNumKeyMixedValueQuad(const char *master_key,
     setCacheKeyValueNumberNumber(master_key, id, key3, value3);
   } else {
     if(readOnlyGlobals.redis.write_context[id]) {
-      pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-      if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-      if(readOnlyGlobals.redis.write_context[id]) {
-	if(unlikely(readOnlyGlobals.enable_debug))
-	  traceEvent(TRACE_NORMAL, "[Redis] HMSET %s %u %s %u %s %u %u %u %u",
-		     master_key,
-		     key0, value0,
-		     key1, value1,
-		     key2, value2,
-		     key3, value3);
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id],
-			   "HMSET %s %u %s %u %s %u %u %u %u",
-			   master_key,
-			   key0, value0,
-			   key1, value1,
-			   key2, value2,
-			   key3, value3);
-	
-	incrementSetDeleteQueueStats(id);
-      }
-      pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+      if(unlikely(readOnlyGlobals.enable_debug))
+	traceEvent(TRACE_NORMAL, "[Redis] HMSET %s %u %s %u %s %u %u %u %u",
+		   master_key,
+		   key0, value0,
+		   key1, value1,
+		   key2, value2,
+		   key3, value3);
+      queueSetDeleteCommand(id,
+			    "HMSET %s %u %s %u %s %u %u %u %u",
+			    master_key,
+			    key0, value0,
+			    key1, value1,
+			    key2, value2,
+			    key3, value3);
     }
   }
 #endif
@@ -635,17 +723,10 @@ int deleteCacheStrKey(const char *prefix, u_int16_t id, const char *key, const u
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
     if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] EXPIRE %s%s %d", prefix, key, delete_delay_sec);
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(delete_delay_sec > 0)
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id], "EXPIRE %s%s %d", prefix, key, delete_delay_sec);
-      else
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id], "DEL %s%s", prefix, key);
-      
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(delete_delay_sec > 0)
+      queueSetDeleteCommand(id, "EXPIRE %s%s %d", prefix, key, delete_delay_sec);
+    else
+      queueSetDeleteCommand(id, "DEL %s%s", prefix, key);
   }
 #endif
 
@@ -657,19 +738,11 @@ int deleteCacheStrKey(const char *prefix, u_int16_t id, const char *key, const u
 int deleteCacheNumKey(const char *prefix, u_int16_t id, const u_int32_t key, const u_int32_t delete_delay_sec) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] EXPIRE %s%u %d", prefix, key, delete_delay_sec);
-      if(delete_delay_sec > 0)
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id], "EXPIRE %s%u %d", prefix, key, delete_delay_sec);
-      else
-	redisAppendCommand(readOnlyGlobals.redis.write_context[id], "DEL %s%u", prefix, key);
-      
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] EXPIRE %s%u %d", prefix, key, delete_delay_sec);
+    if(delete_delay_sec > 0)
+      queueSetDeleteCommand(id, "EXPIRE %s%u %d", prefix, key, delete_delay_sec);
+    else
+      queueSetDeleteCommand(id, "DEL %s%u", prefix, key);
   }
 #endif
 
@@ -682,16 +755,8 @@ int deleteCacheNumKey(const char *prefix, u_int16_t id, const u_int32_t key, con
 int deleteCacheNumKeyTwin(const char *prefix, u_int16_t id, const u_int32_t key1, const u_int32_t key2) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] DEL %s%u %s%u", prefix, key1, prefix, key2);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "DEL %s%u %s%u", prefix, key1, prefix, key2);
-
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] DEL %s%u %s%u", prefix, key1, prefix, key2);
+    queueSetDeleteCommand(id, "DEL %s%u %s%u", prefix, key1, prefix, key2);
   }
 #endif
 
@@ -704,16 +769,8 @@ int deleteCacheNumKeyTwin(const char *prefix, u_int16_t id, const u_int32_t key1
 int deleteCacheStrKeyTwin(const char *prefix, u_int16_t id, const char *key1, const char *key2) {
 #ifdef HAVE_REDIS
   if(readOnlyGlobals.redis.write_context[id]) {
-    pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-
-    if(readOnlyGlobals.redis.write_context[id] == NULL) readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    if(readOnlyGlobals.redis.write_context[id]) {
-      if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] DEL %s%s %s%s", prefix, key1, prefix, key2);
-      redisAppendCommand(readOnlyGlobals.redis.write_context[id], "DEL %s%s %s%s", prefix, key1, prefix, key2);
-
-      incrementSetDeleteQueueStats(id);
-    }
-    pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
+    if(unlikely(readOnlyGlobals.enable_debug)) traceEvent(TRACE_NORMAL, "[Redis] DEL %s%s %s%s", prefix, key1, prefix, key2);
+    queueSetDeleteCommand(id, "DEL %s%s %s%s", prefix, key1, prefix, key2);
   }
 #endif
 
@@ -760,67 +817,6 @@ char* getHashCacheDataStrKey(const char *prefix, u_int16_t id, const char *eleme
 
 /* ************************************ */
 
-#ifdef HAVE_REDIS
-
-static void processQueuedRedisCommand(u_int id) {
-  redisReply *reply;
-
-  pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-
-  if(readOnlyGlobals.redis.write_context[id]) {
-    redisGetReply(readOnlyGlobals.redis.write_context[id], (void**)&reply);
-    if(reply && (readOnlyGlobals.redis.write_context[id]->err == REDIS_OK))
-      freeReplyObject(reply);
-    else {
-      traceEvent(TRACE_WARNING, "It looks redis has been restarted (id: %u)", id);
-      // redisFree(readOnlyGlobals.redis.write_context[id]);
-      readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-    }
-  } else
-    readOnlyGlobals.redis.write_context[id] = connectToRedis(0);
-
-  readWriteGlobals->redis.queuedSetDeleteCommands[id]--;
-
-#if 0
-  if(unlikely(readOnlyGlobals.enable_debug))
-    traceEvent(TRACE_NORMAL, "[Redis] %s(): got reply [queue=%d]",
-	       __FUNCTION__, readWriteGlobals->redis.queuedSetDeleteCommands[id]);
-#endif
-
-  pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_set_delete[id]);
-}
-#endif
-
-/* ************************************ */
-
-#ifdef HAVE_REDIS
-
-static void processQueuedLoggingRedisCommand(u_int id) {
-  redisReply *reply;
-
-  
-  pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_logging[id]);
-
-  if(readOnlyGlobals.redis.logging_context[id]) {
-    redisGetReply(readOnlyGlobals.redis.logging_context[id], (void**)&reply);
-    if(reply && (readOnlyGlobals.redis.logging_context[id]->err == REDIS_OK))
-      freeReplyObject(reply);
-    else {
-      traceEvent(TRACE_WARNING, "It looks redis has been restarted (id: %u)", id);
-      // redisFree(readOnlyGlobals.redis.logging_context[id]);
-      readOnlyGlobals.redis.logging_context[id] = connectToRedis(0);
-    }
-  } else
-    readOnlyGlobals.redis.logging_context[id] = connectToRedis(0);
-
-  readWriteGlobals->redis.queuedLoggingCommands[id]--;
-
-  pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_logging[id]);
-}
-#endif
-
-/* ************************************ */
-
 #define MAX_NUM_ARGUMENTS   32
 #define MAX_ARGUMENT_LEN   256
 
@@ -915,30 +911,47 @@ static void* redisLocalServerLoop(void* notUsed) {
 /* ************************************ */
 
 #ifdef HAVE_REDIS
+/* How long the oldest command of q can still wait for a fuller pipeline */
+static u_int32_t redisQueueWaitMsec(RedisQueue *q) {
+  u_int32_t msec = REDIS_IDLE_WAIT_MSEC, age;
+  struct timeval now;
+
+  if(q->ring == NULL) return(msec);
+
+  gettimeofday(&now, NULL);
+
+  pthread_rwlock_wrlock(&q->lock);
+  if(q->num_queued > 0) {
+    age = msTimeDiff(&now, &q->oldest);
+    msec = (age < REDIS_PIPELINE_FLUSH_MSEC) ? (REDIS_PIPELINE_FLUSH_MSEC - age) : 1;
+  }
+  pthread_rwlock_unlock(&q->lock);
+
+  return(msec);
+}
+
+/* ************************************ */
+
 static void* redisAsyncLoop(void* _thid) {
   unsigned long id = (unsigned long)_thid;
 
   traceEvent(TRACE_INFO, "[Redis] %s(%d) started", __FUNCTION__, id);
 
-  readOnlyGlobals.redis.queue_thread_running[id] = 1;
-
   while(!readWriteGlobals->shutdownInProgress) {
-    if(readWriteGlobals->redis.queuedSetDeleteCommands[id] > 0)
-      processQueuedRedisCommand(id);
-    else if(readWriteGlobals->redis.queuedLoggingCommands[id] > 0)
-      processQueuedLoggingRedisCommand(id);
-    else
-      usleep(10000); /* 10 ms */
+    if((flushRedisQueue(id, 0, 0) + flushRedisQueue(id, 1, 0)) == 0) {
+      /* Sleep until a queue gets its first command or fills a pipeline, or its oldest one is due */
+      timedWaitCondvar(&readWriteGlobals->redis.queueCondvar[id],
+		       min(redisQueueWaitMsec(&readWriteGlobals->redis.writeQueue[id]),
+			   redisQueueWaitMsec(&readWriteGlobals->redis.loggingQueue[id])));
+    }
   }
 
   /* Flush pending commands */
-  while(readWriteGlobals->redis.queuedSetDeleteCommands[id] > 0)
-    processQueuedRedisCommand(id);
+  while(flushRedisQueue(id, 0, 1) > 0)
+    ;
 
-  while(readWriteGlobals->redis.queuedLoggingCommands[id] > 0)
-    processQueuedLoggingRedisCommand(id);
-
-  readOnlyGlobals.redis.queue_thread_running[id] = 0;
+  while(flushRedisQueue(id, 1, 1) > 0)
+    ;
 
   traceEvent(TRACE_INFO, "[Redis] %s() completed [queue=%d]", __FUNCTION__, id);
   return(NULL);
@@ -1023,7 +1036,13 @@ int connectToRemoteCache(void) {
     unsigned long id = i;
 
     pthread_rwlock_init(&readOnlyGlobals.redis.lock_set_delete[i], NULL);
-    pthread_create(&readOnlyGlobals.redis.reply_loop, NULL, redisAsyncLoop, (void*)id);
+    pthread_rwlock_init(&readOnlyGlobals.redis.lock_logging[i], NULL);
+    createCondvar(&readWriteGlobals->redis.queueCondvar[i]); /* Before the queues accept commands */
+    initRedisQueue(&readWriteGlobals->redis.writeQueue[i], readOnlyGlobals.redis.write_context[i] != NULL);
+    initRedisQueue(&readWriteGlobals->redis.loggingQueue[i], readOnlyGlobals.redis.logging_context[i] != NULL);
+
+    readOnlyGlobals.redis.queue_thread_running[i] = 1; /* Reset only once joined */
+    pthread_create(&readOnlyGlobals.redis.reply_loop[i], NULL, redisAsyncLoop, (void*)id);
   }
 
   createLocalCacheServer();
@@ -1042,12 +1061,18 @@ void disconnectFromRemoteCache(void) {
     traceEvent(TRACE_NORMAL, "[Redis] %s()", __FUNCTION__);
 
   for(i=0; i<MAX_NUM_REDIS_CONNECTIONS; i++) {
-    while(readWriteGlobals->redis.queuedSetDeleteCommands[i] > 0) {
-      if(!readOnlyGlobals.redis.queue_thread_running[i])
-	processQueuedRedisCommand(i);
-      else
-	sleep(1);
+    /* The thread flushes its queues before leaving */
+    if(readWriteGlobals->shutdownInProgress && readOnlyGlobals.redis.queue_thread_running[i]) {
+      signalCondvar(&readWriteGlobals->redis.queueCondvar[i], 0);
+      pthread_join(readOnlyGlobals.redis.reply_loop[i], NULL);
+      readOnlyGlobals.redis.queue_thread_running[i] = 0;
     }
+
+    while(flushRedisQueue(i, 0, 1) > 0)
+      ;
+
+    while(flushRedisQueue(i, 1, 1) > 0)
+      ;
   }
 
   if(readOnlyGlobals.redis.read_context)
@@ -1058,6 +1083,8 @@ void disconnectFromRemoteCache(void) {
       redisFree(readOnlyGlobals.redis.write_context[i]);
 
     pthread_rwlock_destroy(&readOnlyGlobals.redis.lock_set_delete[i]);
+    termRedisQueue(&readWriteGlobals->redis.writeQueue[i]);
+    deleteCondvar(&readWriteGlobals->redis.queueCondvar[i]);
   }
 
   for(i=0; i<MAX_NUM_REDIS_CONNECTIONS; i++) {
@@ -1065,6 +1092,7 @@ void disconnectFromRemoteCache(void) {
       redisFree(readOnlyGlobals.redis.logging_context[i]);
 
     pthread_rwlock_destroy(&readOnlyGlobals.redis.lock_logging[i]);
+    termRedisQueue(&readWriteGlobals->redis.loggingQueue[i]);
   }
 
   pthread_rwlock_destroy(&readOnlyGlobals.redis.lock_get);
@@ -1130,7 +1158,7 @@ void pingRedisConnections() {
 	pthread_rwlock_wrlock(&readOnlyGlobals.redis.lock_logging[id]);
 	if(pingRedisConnection(readOnlyGlobals.redis.logging_context[id]) == -1) {
 	  // redisFree(readOnlyGlobals.redis.read_context);
-	  readOnlyGlobals.redis.logging_context[id] = connectToRedis(0);
+	  readOnlyGlobals.redis.logging_context[id] = connectToRedis(1);
 	}
 	
 	pthread_rwlock_unlock(&readOnlyGlobals.redis.lock_logging[id]);
@@ -1142,6 +1170,89 @@ void pingRedisConnections() {
 
 /* ************************************ */
 
+/*
+  --redis-bench: HINCRBY to the --redis server, first one round trip per
+  command and then through the pipelined queues of all the connections.
+*/
+void redisBenchmark(u_int32_t num_commands) {
+#ifdef HAVE_REDIS
+  struct timeval begin, end;
+  u_int64_t sent = 0, pipelines = 0, dropped = 0, errors = 0;
+  u_int32_t num_sync = max(num_commands / 100, 1), i;
+  redisReply *reply;
+  float sec;
+  int id;
+
+  if(readOnlyGlobals.redis.read_context == NULL) {
+    traceEvent(TRACE_ERROR, "--redis-bench requires --redis <host>[:<port>]");
+    return;
+  }
+
+  traceEvent(TRACE_NORMAL, "Redis benchmark on %s:%u [%u commands][%d connections]",
+	     readOnlyGlobals.redis.remote_redis_host, readOnlyGlobals.redis.remote_redis_port,
+	     num_commands, MAX_NUM_REDIS_CONNECTIONS);
+
+  gettimeofday(&begin, NULL);
+  for(i=0; i<num_sync; i++) {
+    if((reply = redisCommand(readOnlyGlobals.redis.read_context, "HINCRBY nprobe.bench %u 1", i % 1024)) == NULL) {
+      traceEvent(TRACE_ERROR, "Redis error: %s", readOnlyGlobals.redis.read_context->errstr);
+      return;
+    }
+
+    freeReplyObject(reply);
+  }
+  gettimeofday(&end, NULL);
+
+  sec = (float)msTimeDiff(&end, &begin) / 1000;
+  traceEvent(TRACE_NORMAL, "Unpipelined: %u commands in %.2f sec [%.1f commands/sec]",
+	     num_sync, sec, (sec > 0) ? ((float)num_sync / sec) : 0);
+
+  for(id=0; id<MAX_NUM_REDIS_CONNECTIONS; id++) {
+    RedisQueue *q = &readWriteGlobals->redis.writeQueue[id];
+
+    sent -= q->num_sent, pipelines -= q->num_pipelines, dropped -= q->num_dropped, errors -= q->num_errors + q->num_lost;
+  }
+
+  gettimeofday(&begin, NULL);
+  for(i=0; i<num_commands; i++) {
+    char key[16];
+
+    id = i % MAX_NUM_REDIS_CONNECTIONS;
+
+    /* Measure the pipeline, not the drops */
+    while(readWriteGlobals->redis.writeQueue[id].num_queued >= (REDIS_QUEUE_MAX_COMMANDS - 1))
+      usleep(100);
+
+    snprintf(key, sizeof(key), "%u", i % 1024);
+    incrCacheHashKeyValueNumber("nprobe.bench", id, key, 1);
+  }
+
+  /* Wait for the replies */
+  for(id=0; id<MAX_NUM_REDIS_CONNECTIONS; id++)
+    while(readWriteGlobals->redis.queuedSetDeleteCommands[id] > 0)
+      usleep(100);
+  gettimeofday(&end, NULL);
+
+  for(id=0; id<MAX_NUM_REDIS_CONNECTIONS; id++) {
+    RedisQueue *q = &readWriteGlobals->redis.writeQueue[id];
+
+    sent += q->num_sent, pipelines += q->num_pipelines, dropped += q->num_dropped, errors += q->num_errors + q->num_lost;
+  }
+
+  sec = (float)msTimeDiff(&end, &begin) / 1000;
+  traceEvent(TRACE_NORMAL, "Pipelined: %llu commands in %.2f sec [%.1f commands/sec]"
+	     "[%.1f avg depth][%llu dropped][%llu errors]",
+	     (long long unsigned)sent, sec, (sec > 0) ? ((float)sent / sec) : 0,
+	     (pipelines > 0) ? ((float)sent / (float)pipelines) : 0,
+	     (long long unsigned)dropped, (long long unsigned)errors);
+
+  if((reply = redisCommand(readOnlyGlobals.redis.read_context, "DEL nprobe.bench")) != NULL)
+    freeReplyObject(reply);
+#endif
+}
+
+/* ************************************ */
+
 void dumpCacheStats(u_int timeDifference) {
 #ifdef HAVE_REDIS
   int id;
@@ -1168,6 +1279,9 @@ void dumpCacheStats(u_int timeDifference) {
 		 numGets, g, numSets, s, numLogs, l);
 #endif
 
+    dumpRedisQueueStats("Write", id, &readWriteGlobals->redis.writeQueue[id], timeDifference);
+    dumpRedisQueueStats("Logging", id, &readWriteGlobals->redis.loggingQueue[id], timeDifference);
+
     readWriteGlobals->redis.numLastGetCommands[id] = readWriteGlobals->redis.numGetCommands[id];
     readWriteGlobals->redis.numLastSetCommands[id] = readWriteGlobals->redis.numSetCommands[id];
     readWriteGlobals->redis.numLastLoggingCommands[id] = readWriteGlobals->redis.numLoggingCommands[id];
@@ -1186,278 +1300,240 @@ void dumpCacheStats(u_int timeDifference) {
 	     (unsigned int)totNumLogs, (float)l);
 #endif
 
+#ifdef HAVE_GEOIP
+  dumpGeoCacheStats(timeDifference);
+#endif
+
   dumpLruCacheStats(timeDifference);
 }
 
 /* ************************************ */
 
 int init_lru_cache(struct LruCache *cache, u_int32_t max_size) {
+  u_int32_t i, num_sets;
+
   traceLRU = readOnlyGlobals.enable_debug;
 
   if(unlikely(traceLRU))
     traceEvent(TRACE_NORMAL, "%s(max_size=%u)", __FUNCTION__, max_size);
 
-  cache->max_cache_node_len = 4;
-  cache->hash_size = max_size/cache->max_cache_node_len;
+  memset(cache, 0, sizeof(struct LruCache));
+  if(max_size == 0) return(0);
 
-#ifdef FULL_STATS
-  cache->mem_size += cache->hash_size*sizeof(struct LruCacheEntry*);
-#endif
-  if((cache->hash = (struct LruCacheEntry**)calloc(cache->hash_size, sizeof(struct LruCacheEntry*))) == NULL) {
+  num_sets = (max_size + (LRU_CACHE_SHARDS * LRU_CACHE_WAYS) - 1) / (LRU_CACHE_SHARDS * LRU_CACHE_WAYS);
+
+  if((cache->mem = calloc(LRU_CACHE_SHARDS + 1, sizeof(LruCacheShard))) == NULL) {
     traceEvent(TRACE_ERROR, "Not enough memory?");
     return(-1);
   }
 
-#ifdef FULL_STATS
-  cache->mem_size += cache->hash_size*sizeof(u_int32_t);
-#endif
-  if((cache->current_hash_size = (u_int32_t*)calloc(cache->hash_size, sizeof(u_int32_t))) == NULL) {
-    traceEvent(TRACE_ERROR, "Not enough memory?");
-    return(-1);
+  cache->shards = (LruCacheShard*)(((size_t)cache->mem + sizeof(LruCacheShard) - 1)
+				   & ~(sizeof(LruCacheShard) - 1));
+
+  for(i=0; i<LRU_CACHE_SHARDS; i++) {
+    LruCacheShard *shard = &cache->shards[i];
+
+    pthread_rwlock_init(&shard->lock, NULL);
+
+    if(((shard->entries = (struct LruCacheEntry*)calloc(num_sets * LRU_CACHE_WAYS, sizeof(struct LruCacheEntry))) == NULL)
+       || ((shard->hands = (u_int8_t*)calloc(num_sets, sizeof(u_int8_t))) == NULL)) {
+      traceEvent(TRACE_ERROR, "Not enough memory?");
+      cache->num_sets = num_sets; /* So that free_lru_cache() frees the shards */
+      free_lru_cache(cache);
+      return(-1);
+    }
   }
 
-  pthread_rwlock_init(&cache->lruLock, NULL);
+  cache->num_sets = num_sets;
   return(0);
 }
 
 /* ************************************ */
 
-static void free_lru_cache_entry(struct LruCache *cache, struct LruCacheEntry *entry) {
+static void free_lru_cache_entry(LruCacheShard *shard, struct LruCacheEntry *entry) {
   if(entry->numeric_node) {
     ; /* Nothing to do */
   } else {
-#ifdef FULL_STATS
-    cache->mem_size -= strlen(entry->u.str.key);
-    cache->mem_size -= strlen(entry->u.str.value);
-#endif
-    free(entry->u.str.key);
-    free(entry->u.str.value);
+    if(entry->u.str.key != entry->u.str.inline_key) {
+      shard->mem_size -= strlen(entry->u.str.key) + 1;
+      free(entry->u.str.key);
+    }
+
+    if(entry->u.str.value != entry->u.str.inline_value) {
+      shard->mem_size -= strlen(entry->u.str.value) + 1;
+      free(entry->u.str.value);
+    }
   }
+
+  entry->hash = 0;
+  shard->num_entries--;
 }
 
 /* ************************************ */
 
 void free_lru_cache(struct LruCache *cache) {
-  int i;
+  u_int32_t i, j;
 
   if(unlikely(traceLRU)) traceEvent(TRACE_NORMAL, "%s()", __FUNCTION__);
 
-  for(i=0; i<cache->hash_size; i++) {
-    struct LruCacheEntry *head = cache->hash[i];
+  if(cache->shards == NULL) return;
 
-    while(head != NULL) {
-      struct LruCacheEntry *next = head->next;
+  for(i=0; i<LRU_CACHE_SHARDS; i++) {
+    LruCacheShard *shard = &cache->shards[i];
 
-      free_lru_cache_entry(cache, head);
-      free(head);
-#ifdef FULL_STATS
-      cache->mem_size -= sizeof(struct LruCacheEntry);
-#endif
-      head = next;
+    if(shard->entries != NULL) {
+      for(j=0; j<cache->num_sets * LRU_CACHE_WAYS; j++)
+	if(shard->entries[j].hash != 0)
+	  free_lru_cache_entry(shard, &shard->entries[j]);
+
+      free(shard->entries);
     }
-  }
 
-  free(cache->hash);
-#ifdef FULL_STATS
-  cache->mem_size -= cache->hash_size*sizeof(struct LruCacheEntry*);
-#endif
-  free(cache->current_hash_size);
-#ifdef FULL_STATS
-  cache->mem_size -= cache->hash_size*sizeof(u_int32_t);
-#endif
+    if(shard->hands != NULL) free(shard->hands);
+    pthread_rwlock_destroy(&shard->lock);
+  }
 
-  pthread_rwlock_destroy(&cache->lruLock);
+  free(cache->mem);
+  cache->mem = NULL, cache->shards = NULL, cache->num_sets = 0;
 }
 
 /* ************************************ */
 
-static u_int32_t hash_string(char *a) {
-  u_int32_t h = 0, i;
-
-  for(i=0; a[i] != 0; i++) h += ((u_int32_t)a[i])*(i+1);
-  return(h);
-}
+/* Never 0 (empty entry) */
+static __inline__ u_int32_t lru_hash_num(u_int64_t key) {
+  u_int32_t h;
 
-/* ************************************ */
+  /* MurmurHash3 finalizer */
+  key ^= key >> 33, key *= 0xFF51AFD7ED558CCDULL;
+  key ^= key >> 33, key *= 0xC4CEB9FE1A85EC53ULL;
+  key ^= key >> 33;
 
-u_int32_t lru_node_key_hash(struct LruCacheEntry *a) {
-  if(a->numeric_node)
-    return((u_int32_t)a->u.num.key);
-  else
-    return(hash_string(a->u.str.key));
+  h = (u_int32_t)key;
+  return((h == 0) ? 1 : h);
 }
 
 /* ************************************ */
-/*
-  Return codes
-  0  Items are the same
-  -1 a < b
-  1  a > b
-*/
-int lru_node_key_entry_compare(struct LruCacheEntry *a, struct LruCacheEntry *b) {
-  if(a->numeric_node) {
-    if(a->u.num.key == b->u.num.key)
-      return(0);
-    else if(a->u.num.key < b->u.num.key)
-      return(-1);
-    else
-      return(1);
-  } else
-    return(strcmp(a->u.str.key, b->u.str.key));
-}
 
-/* ********************************************* */
+/* Never 0 (empty entry) */
+static __inline__ u_int32_t lru_hash_str(char *a) {
+  u_int32_t h = 0x811C9DC5; /* FNV-1a */
 
-struct LruCacheEntry* allocCacheNumericNode(struct LruCache *cache, u_int64_t key, u_int32_t value) {
-  struct LruCacheEntry *node = (struct LruCacheEntry*)calloc(1, sizeof(struct LruCacheEntry));
+  while(*a != '\0') h = (h ^ (u_int8_t)*a++) * 0x01000193;
 
-  if(unlikely(traceLRU))
-    traceEvent(TRACE_NORMAL, "%s(key=%lu, value=%u)", __FUNCTION__, key, value);
-
-  if(node == NULL)
-    traceEvent(TRACE_ERROR, "Not enough memory?");
-  else {
-    node->numeric_node = 1;
-    node->u.num.key = key, node->u.num.value = value;
-  }
+  h ^= h >> 16, h *= 0x85EBCA6B, h ^= h >> 13;
+  return((h == 0) ? 1 : h);
+}
 
-#ifdef FULL_STATS
-  cache->mem_size += sizeof(struct LruCacheEntry);
-  //traceEvent(TRACE_NORMAL, "%s(key=%lu, value=%u) [memory: %u]", __FUNCTION__, key, value, cache->mem_size);
-#endif
+/* ************************************ */
 
-  return(node);
+static __inline__ LruCacheShard* lru_shard(struct LruCache *cache, u_int32_t hash) {
+  return(&cache->shards[hash >> 28]);
 }
 
 /* ************************************ */
 
-struct LruCacheEntry* allocCacheStringNode(struct LruCache *cache, char *key, char *value, u_int32_t timeout) {
-  struct LruCacheEntry *node = (struct LruCacheEntry*)calloc(1, sizeof(struct LruCacheEntry));
+static __inline__ struct LruCacheEntry* lru_set(struct LruCache *cache, LruCacheShard *shard, u_int32_t hash) {
+  return(&shard->entries[((hash & 0x0FFFFFFF) % cache->num_sets) * LRU_CACHE_WAYS]);
+}
 
-  if(unlikely(traceLRU))
-    traceEvent(TRACE_NORMAL, "%s(key=%s, value=%s)", __FUNCTION__, key, value);
+/* ************************************ */
 
-  if(node == NULL)
-    traceEvent(TRACE_ERROR, "Not enough memory?");
-  else {
-    node->numeric_node = 0;
-    node->u.str.key = strdup(key), node->u.str.value = strdup(value);
-    node->u.str.expire_time = (timeout == 0) ? 0 : (timeout + readWriteGlobals->now);
+static struct LruCacheEntry* find_lru_cache_entry(struct LruCacheEntry *set, u_int32_t hash,
+						  u_int8_t numeric_node, u_int64_t num_key, char *str_key) {
+  int i;
 
-#ifdef FULL_STATS
-    cache->mem_size += sizeof(struct LruCacheEntry) + strlen(key) + strlen(value);
-    //traceEvent(TRACE_NORMAL, "%s(key=%s, value=%s) [memory: %u]", __FUNCTION__, key, value, cache->mem_size);
-#endif
+  for(i=0; i<LRU_CACHE_WAYS; i++) {
+    struct LruCacheEntry *entry = &set[i];
+
+    if((entry->hash == hash) && (entry->numeric_node == numeric_node)
+       && (numeric_node ? (entry->u.num.key == num_key) : (strcmp(entry->u.str.key, str_key) == 0)))
+      return(entry);
   }
 
-  return(node);
+  return(NULL);
 }
 
 /* ************************************ */
 
-static void trim_subhash(struct LruCache *cache, u_int32_t hash_id) {
-  if(unlikely(traceLRU))
-    traceEvent(TRACE_NORMAL, "%s()", __FUNCTION__);
+/*
+  The entry of the set to (re)use for a new key: an empty or expired
+  one if any, else the first one not referenced since the CLOCK hand
+  of the set last passed it.
+*/
+static struct LruCacheEntry* evict_lru_cache_entry(struct LruCache *cache, LruCacheShard *shard,
+						   struct LruCacheEntry *set) {
+  u_int32_t set_id = (set - shard->entries) / LRU_CACHE_WAYS;
+  u_int8_t hand = shard->hands[set_id];
+  struct LruCacheEntry *entry;
+  int i;
 
-  if(cache->current_hash_size[hash_id] >= cache->max_cache_node_len) {
-    struct LruCacheEntry *head = cache->hash[hash_id], *prev = NULL;
+  for(i=0; i<LRU_CACHE_WAYS; i++) {
+    entry = &set[i];
 
-    /* Find the last entry and remove it */
-    while(head->next != NULL) {
-      prev = head;
-      head = head->next;
+    if(entry->hash == 0)
+      return(entry);
+    else if((entry->expire_time > 0) && (entry->expire_time < readWriteGlobals->now)) {
+      free_lru_cache_entry(shard, entry);
+      return(entry);
     }
-
-    if(prev) {
-      prev->next = head->next;
-      free_lru_cache_entry(cache, head);
-      free(head);
-#ifdef FULL_STATS
-      cache->mem_size -= sizeof(struct LruCacheEntry);
-#endif
-      cache->current_hash_size[hash_id]--;
-    } else
-      traceEvent(TRACE_ERROR, "Internal error in %s()", __FUNCTION__);
   }
+
+  while(set[hand].referenced)
+    set[hand].referenced = 0, hand = (hand + 1) % LRU_CACHE_WAYS;
+
+  entry = &set[hand];
+  shard->hands[set_id] = (hand + 1) % LRU_CACHE_WAYS;
+  shard->num_cache_evictions++;
+  free_lru_cache_entry(shard, entry);
+
+  return(entry);
 }
 
 /* ************************************ */
 
-static void validate_unit_len(struct LruCache *cache, u_int32_t hash_id) {
-  struct LruCacheEntry *head = cache->hash[hash_id];
-  u_int num = 0;
+static void set_lru_cache_string(LruCacheShard *shard, char **where, char *inline_buf, char *str) {
+  u_int len = strlen(str) + 1;
 
-  while(head != NULL) {
-    head = head->next, num++;
+  if(len <= LRU_CACHE_INLINE_LEN) {
+    memcpy(inline_buf, str, len);
+    *where = inline_buf;
+  } else if((*where = strdup(str)) != NULL)
+    shard->mem_size += len;
+  else {
+    traceEvent(TRACE_ERROR, "Not enough memory?");
+    inline_buf[0] = '\0', *where = inline_buf;
   }
-
-  if(num != cache->current_hash_size[hash_id])
-    traceEvent(TRACE_ERROR, "Invalid length [expected: %u][read: %u][hash_id: %u]",
-	       cache->current_hash_size[hash_id], num, hash_id);
 }
 
 /* ************************************ */
 
 int add_to_lru_cache_num(struct LruCache *cache,
 			 u_int64_t key, u_int32_t value) {
-  if(cache->hash_size == 0)
+  if(cache->num_sets == 0)
     return(0);
   else {
-    u_int32_t hash_id = key % cache->hash_size;
-    struct LruCacheEntry *node;
-    u_int8_t node_already_existing = 0;
-    int rc = 0;
+    u_int32_t hash = lru_hash_num(key);
+    LruCacheShard *shard = lru_shard(cache, hash);
+    struct LruCacheEntry *set, *entry;
 
     if(unlikely(traceLRU))
       traceEvent(TRACE_NORMAL, "%s(key=%lu, value=%u)", __FUNCTION__, key, value);
 
-    pthread_rwlock_wrlock(&cache->lruLock);
-    // validate_unit_len(cache, hash_id);
-    cache->num_cache_add++;
-
-    /* [1] Add to hash */
-    if(cache->hash[hash_id] == NULL) {
-      if((node = allocCacheNumericNode(cache, key, value)) == NULL) {
-	rc = -1;
-	goto ret_add_to_lru_cache;
-      }
-
-      cache->hash[hash_id] = node;
-      cache->current_hash_size[hash_id]++;
-    } else {
-      /* Check if the element exists */
-      struct LruCacheEntry *head = cache->hash[hash_id];
-
-      while(head != NULL) {
-	if(head->u.num.key == key) {
-	  /* Duplicated key found */
-	  node = head;
-	  node->u.num.value = value; /* Overwrite old value */
-	  node_already_existing = 1;
-	  break;
-	} else
-	  head = head->next;
-      }
-
-      if(!node_already_existing) {
-	if((node = allocCacheNumericNode(cache, key, value)) == NULL) {
-	  rc = -2;
-	  goto ret_add_to_lru_cache;
-	}
+    pthread_rwlock_wrlock(&shard->lock);
+    shard->num_cache_add++;
+    set = lru_set(cache, shard, hash);
 
-	node->next = cache->hash[hash_id];
-	cache->hash[hash_id] = node;
-	cache->current_hash_size[hash_id]++;
-      }
+    if((entry = find_lru_cache_entry(set, hash, 1, key, NULL)) == NULL) {
+      entry = evict_lru_cache_entry(cache, shard, set);
+      entry->hash = hash, entry->numeric_node = 1, entry->referenced = 0, entry->expire_time = 0;
+      entry->u.num.key = key;
+      shard->num_entries++;
     }
 
-    trim_subhash(cache, hash_id);
+    entry->u.num.value = value; /* Overwrite old value */
+    pthread_rwlock_unlock(&shard->lock);
 
-    // validate_unit_len(cache, hash_id);
-
-  ret_add_to_lru_cache:
-    pthread_rwlock_unlock(&cache->lruLock);
-    return(rc);
+    return(0);
   }
 }
 
@@ -1466,77 +1542,38 @@ int add_to_lru_cache_num(struct LruCache *cache,
 int add_to_lru_cache_str_timeout(struct LruCache *cache,
 				 char *key, char *value,
 				 u_int32_t timeout) {
-  if(cache->hash_size == 0)
+  if(cache->num_sets == 0)
     return(0);
   else {
-    u_int32_t hash_val =  hash_string(key);
-    u_int32_t hash_id = hash_val % cache->hash_size;
-    struct LruCacheEntry *node;
-    u_int8_t node_already_existing = 0;
-    int rc = 0;
+    u_int32_t hash = lru_hash_str(key);
+    LruCacheShard *shard = lru_shard(cache, hash);
+    struct LruCacheEntry *set, *entry;
 
     if(unlikely(traceLRU))
       traceEvent(TRACE_NORMAL, "%s(key=%s, value=%s)", __FUNCTION__, key, value);
 
-    pthread_rwlock_wrlock(&cache->lruLock);
-    // validate_unit_len(cache, hash_id);
-    cache->num_cache_add++;
+    pthread_rwlock_wrlock(&shard->lock);
+    shard->num_cache_add++;
+    set = lru_set(cache, shard, hash);
 
-    /* [1] Add to hash */
-    if(cache->hash[hash_id] == NULL) {
-      if((node = allocCacheStringNode(cache, key, value, timeout)) == NULL) {
-	rc = -1;
-	goto ret_add_to_lru_cache;
+    if((entry = find_lru_cache_entry(set, hash, 0, 0, key)) != NULL) {
+      /* Duplicated key found: overwrite old value */
+      if(entry->u.str.value != entry->u.str.inline_value) {
+	shard->mem_size -= strlen(entry->u.str.value) + 1;
+	free(entry->u.str.value);
       }
-
-      cache->hash[hash_id] = node;
-      cache->current_hash_size[hash_id]++;
     } else {
-      /* Check if the element exists */
-      struct LruCacheEntry *head = cache->hash[hash_id];
-
-      while(head != NULL) {
-	if(strcmp(head->u.str.key, key) == 0) {
-	  /* Duplicated key found */
-	  node = head;
-	  if(node->u.str.value) {
-#ifdef FULL_STATS
-	    cache->mem_size -= strlen(node->u.str.value);
-#endif
-	    free(node->u.str.value);
-	  }
-
-	  node->u.str.value = strdup(value); /* Overwrite old value */
-#ifdef FULL_STATS
-	  cache->mem_size += strlen(value);
-#endif
-
-	  node->u.str.expire_time = (timeout == 0) ? 0 : (timeout + readWriteGlobals->now);
-	  node_already_existing = 1;
-	  break;
-	} else
-	  head = head->next;
-      }
-
-      if(!node_already_existing) {
-	if((node = allocCacheStringNode(cache, key, value, timeout)) == NULL) {
-	  rc = -2;
-	  goto ret_add_to_lru_cache;
-	}
-
-	node->next = cache->hash[hash_id];
-	cache->hash[hash_id] = node;
-	cache->current_hash_size[hash_id]++;
-      }
+      entry = evict_lru_cache_entry(cache, shard, set);
+      entry->hash = hash, entry->numeric_node = 0, entry->referenced = 0;
+      set_lru_cache_string(shard, &entry->u.str.key, entry->u.str.inline_key, key);
+      shard->num_entries++;
     }
 
-    trim_subhash(cache, hash_id);
-
-    // validate_unit_len(cache, hash_id);
+    set_lru_cache_string(shard, &entry->u.str.value, entry->u.str.inline_value, value);
+    entry->expire_time = (timeout == 0) ? 0 : (timeout + readWriteGlobals->now);
+    pthread_rwlock_unlock(&shard->lock);
 
-  ret_add_to_lru_cache:
-    pthread_rwlock_unlock(&cache->lruLock);
-    return(rc);
+    return(0);
   }
 }
 
@@ -1548,42 +1585,42 @@ int add_to_lru_cache_str(struct LruCache *cache, char *key, char *value) {
 
 /* ************************************ */
 
+/*
+  Lookups only hold the shard read lock, so concurrent readers
+  bump the find/miss counters without mutual exclusion.
+*/
+static inline void countLruCacheOp(u_int32_t *counter) {
+#ifdef HAVE_BUILTIN_ATOMIC
+  __sync_fetch_and_add(counter, 1);
+#else
+  (*counter)++; /* Approximate: the stats are informative only */
+#endif
+}
+
+/* ************************************ */
+
 u_int32_t find_lru_cache_num(struct LruCache *cache, u_int64_t key) {
-  if(cache->hash_size == 0)
+  if(cache->num_sets == 0)
     return(0);
   else {
-    u_int32_t hash_id = key % cache->hash_size;
-    struct LruCacheEntry *head, *prev = NULL;
+    u_int32_t hash = lru_hash_num(key);
+    LruCacheShard *shard = lru_shard(cache, hash);
+    struct LruCacheEntry *entry;
     u_int32_t ret_val = NDPI_PROTOCOL_UNKNOWN;
 
     if(unlikely(traceLRU))
       traceEvent(TRACE_NORMAL, "%s(%lu)", __FUNCTION__, key);
 
-    pthread_rwlock_rdlock(&cache->lruLock);
-    head = cache->hash[hash_id];
-    // validate_unit_len(cache, hash_id);
-    cache->num_cache_find++;
-
-    while(head != NULL) {
-      if(head->u.num.key == key) {
-	ret_val = head->u.num.value;
-
-	/* We now need to move it in front */
-	if(prev != NULL) {
-	  /* We're not the first element yet */
-	  prev->next = head->next;
-	  head->next = cache->hash[hash_id];
-	  cache->hash[hash_id] = head;
-	}
-	break;
-      } else {
-	prev = head;
-	head = head->next;
-      }
+    pthread_rwlock_rdlock(&shard->lock);
+    countLruCacheOp(&shard->num_cache_find);
+
+    if((entry = find_lru_cache_entry(lru_set(cache, shard, hash), hash, 1, key, NULL)) != NULL) {
+      ret_val = entry->u.num.value;
+      if(!entry->referenced) entry->referenced = 1;
     }
 
-    if(ret_val == NDPI_PROTOCOL_UNKNOWN) cache->num_cache_misses++;
-    pthread_rwlock_unlock(&cache->lruLock);
+    if(ret_val == NDPI_PROTOCOL_UNKNOWN) countLruCacheOp(&shard->num_cache_misses);
+    pthread_rwlock_unlock(&shard->lock);
 
     return(ret_val);
   }
@@ -1591,55 +1628,40 @@ u_int32_t find_lru_cache_num(struct LruCache *cache, u_int64_t key) {
 
 /* ************************************ */
 
-char* find_lru_cache_str(struct LruCache *cache, char *key) {
-  if(cache->hash_size == 0)
-    return(0);
+/*
+  Copies the value of key into buf (buf_len bytes at most) under the
+  shard lock: unlike the pointer returned by find_lru_cache_str() it
+  stays valid whatever other threads add to the cache.
+*/
+char* find_lru_cache_str_copy(struct LruCache *cache, char *key, char *buf, u_int buf_len) {
+  if(cache->num_sets == 0)
+    return(NULL);
   else {
-    u_int32_t hash_val =  hash_string(key);
-    u_int32_t hash_id = hash_val % cache->hash_size;
-    struct LruCacheEntry *head, *prev = NULL;
+    u_int32_t hash = lru_hash_str(key);
+    LruCacheShard *shard = lru_shard(cache, hash);
+    struct LruCacheEntry *entry;
     char *ret_val = NULL;
 
     if(unlikely(traceLRU))
       traceEvent(TRACE_NORMAL, "%s(%s)", __FUNCTION__, key);
 
-    /*
-      We need wrlock and not rdlock as if an entry is expired we will
-      manipulate the list
-    */
-    pthread_rwlock_wrlock(&cache->lruLock);
-    // validate_unit_len(cache, hash_id);
-    cache->num_cache_find++;
-    head = cache->hash[hash_id];
-
-    while(head != NULL) {
-      if(strcmp(head->u.str.key, key) == 0) {
-	if((head->u.str.expire_time > 0) && (head->u.str.expire_time < readWriteGlobals->now)) {
-	  /* The node has expired */
-	  if(prev == NULL)
-	    cache->hash[hash_id] = head->next;
-	  else
-	    prev->next = head->next;
-
-	  free_lru_cache_entry(cache, head);
-	  free(head);
-#ifdef FULL_STATS
-	  cache->mem_size -= sizeof(struct LruCacheEntry);
-#endif
-	  ret_val = NULL;
-	  cache->current_hash_size[hash_id]--;
-	} else
-	  ret_val = head->u.str.value;
-	break;
-      } else {
-	prev = head;
-	head = head->next;
-      }
+    pthread_rwlock_rdlock(&shard->lock);
+    countLruCacheOp(&shard->num_cache_find);
+
+    if(((entry = find_lru_cache_entry(lru_set(cache, shard, hash), hash, 0, 0, key)) != NULL)
+       /* Expired entries are left to the next add */
+       && ((entry->expire_time == 0) || (entry->expire_time >= readWriteGlobals->now))) {
+      if(buf != NULL) {
+	snprintf(buf, buf_len, "%s", entry->u.str.value);
+	ret_val = buf;
+      } else
+	ret_val = entry->u.str.value;
+
+      if(!entry->referenced) entry->referenced = 1;
     }
 
-    if(ret_val == NULL) cache->num_cache_misses++;
-    // validate_unit_len(cache, hash_id);
-    pthread_rwlock_unlock(&cache->lruLock);
+    if(ret_val == NULL) countLruCacheOp(&shard->num_cache_misses);
+    pthread_rwlock_unlock(&shard->lock);
 
     return(ret_val);
   }
@@ -1647,47 +1669,53 @@ char* find_lru_cache_str(struct LruCache *cache, char *key) {
 
 /* ************************************ */
 
+/* The value stays valid until the entry is replaced or evicted */
+char* find_lru_cache_str(struct LruCache *cache, char *key) {
+  return(find_lru_cache_str_copy(cache, key, NULL, 0));
+}
+
+/* ************************************ */
+
 static void dumpLruCacheStat(struct LruCache *cache,
 			     char* cacheName, u_int timeDifference) {
-  u_int32_t tot_cache_add = 0, tot_cache_find = 0;
-  u_int32_t tot_mem = 0, grand_total_mem = 0;
-  u_int32_t num_cache_add = 0, num_cache_find = 0;
-  u_int32_t num_cache_misses = 0, grand_total = 0;
+  u_int32_t tot_cache_add = 0, tot_cache_find = 0, tot_cache_misses = 0, tot_evictions = 0;
+  u_int32_t num_cache_add, num_cache_find, num_cache_misses;
+  u_int32_t tot = 0, tot_mem = 0;
   float a, f, m;
-  int j, tot;
+  int j;
 
-  tot_cache_add += cache->num_cache_add;
-  num_cache_add += cache->num_cache_add - cache->last_num_cache_add;
-  cache->last_num_cache_add = cache->num_cache_add;
+  if(cache->num_sets == 0) return;
 
-  tot_cache_find += cache->num_cache_find;
-  num_cache_find += cache->num_cache_find - cache->last_num_cache_find;
-  cache->last_num_cache_find = cache->num_cache_find;
+  for(j=0; j<LRU_CACHE_SHARDS; j++) {
+    LruCacheShard *shard = &cache->shards[j];
 
-  num_cache_misses += cache->num_cache_misses - cache->last_num_cache_misses;
-  cache->last_num_cache_misses = cache->num_cache_misses;
+    tot_cache_add += shard->num_cache_add, tot_cache_find += shard->num_cache_find;
+    tot_cache_misses += shard->num_cache_misses, tot_evictions += shard->num_cache_evictions;
+    tot += shard->num_entries, tot_mem += shard->mem_size;
+  }
 
-  for(tot=0, tot_mem=0, j=0; j<cache->hash_size; j++)
-    tot += cache->current_hash_size[j], tot_mem += (cache->mem_size+sizeof(struct LruCache));
+  tot_mem += sizeof(struct LruCache) + LRU_CACHE_SHARDS * (sizeof(LruCacheShard)
+							    + cache->num_sets * (LRU_CACHE_WAYS * sizeof(struct LruCacheEntry) + 1));
 
-  grand_total += tot;
-  grand_total_mem += tot_mem;
+  num_cache_add = tot_cache_add - cache->last_num_cache_add, cache->last_num_cache_add = tot_cache_add;
+  num_cache_find = tot_cache_find - cache->last_num_cache_find, cache->last_num_cache_find = tot_cache_find;
+  num_cache_misses = tot_cache_misses - cache->last_num_cache_misses, cache->last_num_cache_misses = tot_cache_misses;
 
 #ifdef FULL_STATS
-  if(tot > 0)
-    traceEvent(TRACE_NORMAL, "LRUCacheUnit %s [current_hash_size: %u][max_cache_node_len: %u][mem_size: %.1f MB/%.1f MB]",
-	       cacheName, tot, cache->max_cache_node_len, (float)tot_mem/(float)(1024*1024), (float)grand_total_mem/(float)(1024*1024));
+  traceEvent(TRACE_NORMAL, "LRUCacheUnit %s [entries: %u/%u][evictions: %u][mem_size: %.1f MB]",
+	     cacheName, tot, LRU_CACHE_SHARDS * LRU_CACHE_WAYS * cache->num_sets, tot_evictions,
+	     (float)tot_mem/(float)(1024*1024));
 #endif
 
   a = (timeDifference > 0) ? ((float)num_cache_add)/(float)timeDifference : 0;
   f = (timeDifference > 0) ? ((float)num_cache_find)/(float)timeDifference : 0;
-  m = (num_cache_add > 0) ? ((float)(num_cache_misses*100))/((float)num_cache_find) : 0;
+  m = (num_cache_find > 0) ? ((float)num_cache_misses*100)/((float)num_cache_find) : 0;
 
   if(tot_cache_find || tot_cache_add)
     traceEvent(TRACE_NORMAL, "LRUCache %s [find: %u operations/%.1f find/sec]"
 	       "[cache miss %u/%.1f %%][add: %u operations/%.1f add/sec][tot: %u][mem_size: %.1f MB]",
-	       cacheName, tot_cache_find, f, num_cache_misses, m, tot_cache_add, a, grand_total,
-	       (float)grand_total_mem/(float)(1024*1024));
+	       cacheName, tot_cache_find, f, num_cache_misses, m, tot_cache_add, a, tot,
+	       (float)tot_mem/(float)(1024*1024));
 }
 
 /* ************************************ */
@@ -1699,18 +1727,87 @@ void dumpLruCacheStats(u_int timeDifference) {
 
 /* ************************************ */
 
-void testLRU() {
+typedef struct {
+  pthread_t thread;
+  struct LruCache *cache;
+  u_int64_t seed, num_ops, num_finds, num_hits;
+  volatile u_int8_t *stop;
+} LruBenchThread;
+
+/* ************************************ */
+
+/* 90% finds, 10% adds over twice as many keys as the cache holds */
+static void* lruBenchThread(void *_t) {
+  LruBenchThread *t = (LruBenchThread*)_t;
+  char key[32], value[32];
+
+  while(!*t->stop) {
+    int i;
+
+    for(i=0; i<1024; i++) {
+      u_int32_t r;
+
+      t->seed = t->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      r = (u_int32_t)(t->seed >> 32);
+      snprintf(key, sizeof(key), "username.%u", (r >> 8) % (2 * LRU_BENCH_SIZE));
+
+      if((r & 0xFF) < 26)
+	add_to_lru_cache_str(t->cache, key, key);
+      else {
+	t->num_finds++;
+	if(find_lru_cache_str_copy(t->cache, key, value, sizeof(value)) != NULL)
+	  t->num_hits++;
+      }
+    }
+
+    t->num_ops += 1024;
+  }
+
+  return(NULL);
+}
+
+/* ************************************ */
+
+/*
+  --lru-bench: string adds and finds on a LRU_BENCH_SIZE cache from 1,
+  2, 4... num_threads threads, LRU_BENCH_DURATION sec each.
+*/
+void testLRU(u_int8_t num_threads) {
+  LruBenchThread threads[MAX_NUM_PCAP_THREADS];
+  u_int8_t n = 1, i;
+
+  if(num_threads > MAX_NUM_PCAP_THREADS) num_threads = MAX_NUM_PCAP_THREADS;
+
   while(1) {
-    unsigned int i;
+    volatile u_int8_t stop = 0;
+    u_int64_t num_ops = 0, num_finds = 0, num_hits = 0;
+    struct LruCache cache;
+
+    if(n > num_threads) n = num_threads;
+    if(init_lru_cache(&cache, LRU_BENCH_SIZE) != 0) return;
+
+    for(i=0; i<n; i++) {
+      memset(&threads[i], 0, sizeof(LruBenchThread));
+      threads[i].cache = &cache, threads[i].seed = i + 1, threads[i].stop = &stop;
+      pthread_create(&threads[i].thread, NULL, lruBenchThread, &threads[i]);
+    }
 
-    for(i = 0; i<100000; i++) {
-      char str[256];
+    ntop_sleep(LRU_BENCH_DURATION);
+    stop = 1;
 
-      snprintf(str, sizeof(str), "%u", i);
-      add_to_lru_cache_str(&readWriteGlobals->flowUsersCache, str, str);
-      find_lru_cache_str(&readWriteGlobals->flowUsersCache, str);
+    for(i=0; i<n; i++) {
+      pthread_join(threads[i].thread, NULL);
+      num_ops += threads[i].num_ops, num_finds += threads[i].num_finds, num_hits += threads[i].num_hits;
     }
 
-    dumpLruCacheStats(1);
+    traceEvent(TRACE_NORMAL, "LRU benchmark: [%u thread(s)][%.2f M ops/sec][%.1f %% find hits]",
+	       n, (float)num_ops / (LRU_BENCH_DURATION * 1000000.0),
+	       (num_finds > 0) ? ((float)num_hits * 100) / (float)num_finds : 0);
+
+    dumpLruCacheStat(&cache, "LRUBench", LRU_BENCH_DURATION);
+    free_lru_cache(&cache);
+
+    if(n == num_threads) break;
+    n *= 2;
   }
 }
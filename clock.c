@@ -0,0 +1,72 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "nprobe.h"
+
+/* ****************************************************** */
+
+/* Reads the system clock and publishes it (ticker thread, and once at startup) */
+void updateCoarseClock(void) {
+  struct timeval tv;
+  u_int64_t msec;
+
+  gettimeofday(&tv, NULL);
+  msec = (u_int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+  /* Readers pick either value: msec first so that sec never runs ahead of it */
+  readWriteGlobals->clock.msec = msec;
+  readWriteGlobals->clock.sec = tv.tv_sec;
+
+  /* Live captures set it from the packet timestamps: the export threads only read it */
+  if(readOnlyGlobals.pcapFile != NULL)
+    readWriteGlobals->actTime = tv;
+}
+
+/* ****************************************************** */
+
+static void* coarseClockTicker(void *notUsed) {
+  while(!readWriteGlobals->shutdownInProgress) {
+    usleep(CLOCK_TICK_USEC);
+    updateCoarseClock();
+  }
+
+  return(NULL);
+}
+
+/* ****************************************************** */
+
+void initCoarseClock(void) {
+  updateCoarseClock();
+
+  if(pthread_create(&readWriteGlobals->clock.ticker, NULL, coarseClockTicker, NULL) != 0) {
+    traceEvent(TRACE_ERROR, "Unable to start the clock thread");
+    exit(-1);
+  }
+}
+
+/* ****************************************************** */
+
+/* The ticker writes readWriteGlobals: call it (after shutdownInProgress is set) before freeing them */
+void termCoarseClock(void) {
+  pthread_join(readWriteGlobals->clock.ticker, NULL);
+}
@@ -0,0 +1,64 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+/* ********************************** */
+
+#define CLOCK_CACHE_LINE_LEN       64
+#define CLOCK_TICK_USEC          1000 /* Resolution of the coarse clock */
+
+/*
+  Coarse wall clock shared by all threads. A ticker thread reads the
+  system time every CLOCK_TICK_USEC and publishes it, so the per packet
+  and per datagram paths read a variable instead of calling time() or
+  gettimeofday(). The clock sits in a cache line of its own: readers do
+  not share it with data other threads write to.
+
+  This is wall clock time and is not driven by packet timestamps: the
+  processing time when reading pcap files is readWriteGlobals->now.
+*/
+typedef struct {
+  char pad0[CLOCK_CACHE_LINE_LEN];
+  volatile u_int64_t msec; /* msec since the epoch */
+  volatile time_t sec;
+  char pad1[CLOCK_CACHE_LINE_LEN];
+  pthread_t ticker;
+} CoarseClock;
+
+/* ********************************** */
+
+extern void initCoarseClock(void);
+extern void updateCoarseClock(void);
+extern void termCoarseClock(void);
+
+/* Defined as macros: readWriteGlobals is not declared yet */
+#define coarseTime()     ((time_t)readWriteGlobals->clock.sec)
+#define coarseMsec()     ((u_int64_t)readWriteGlobals->clock.msec)
+#define coarseTimeval(tv) do {						\
+    u_int64_t _msec = coarseMsec();					\
+    (tv)->tv_sec = (time_t)(_msec / 1000), (tv)->tv_usec = (_msec % 1000) * 1000; \
+  } while(0)
+
+#endif /* _CLOCK_H_ */
@@ -22,6 +22,10 @@
 
 #include "nprobe.h"
 
+#ifdef HAVE_COLLECTOR_REUSEPORT
+#include <poll.h>
+#endif
+
 #define DEBUG_FLOWS
 //#define CISCO_DEBUG
 #define LEN_SMALL_WORK_BUFFER 2048
@@ -29,6 +33,9 @@
 
 /* forward */
 void* netFlowCollectLoop(void* notUsed);
+#ifdef HAVE_COLLECTOR_REUSEPORT
+static int createReusePortListeners(u_int16_t collectorInPort);
+#endif
 
 /* ********************************************************* */
 
@@ -44,9 +51,8 @@ int createNetFlowListener(u_int16_t collectorInPort) {
   struct sockaddr_in sockInV4;
   struct sockaddr_in6 sockInV6;
 
-  readWriteGlobals->collectionStats.num_dissected_flow_packets = 0;
   readOnlyGlobals.collectorInSocketv4 = readOnlyGlobals.collectorInSocketv6 = readOnlyGlobals.collectorInSctpSocket = -1;
-  readWriteGlobals->v9_ipfix_templates = NULL;
+  initTemplateCache();
 
   if(collectorInPort > 0) {
     int i;
@@ -65,6 +71,11 @@ int createNetFlowListener(u_int16_t collectorInPort) {
       }
     }
 
+#ifdef HAVE_COLLECTOR_REUSEPORT
+    if(readOnlyGlobals.collectorReusePort)
+      return(createReusePortListeners(collectorInPort));
+#endif
+
     errno = 0;
     readOnlyGlobals.collectorInSocketv4 = socket(AF_INET, SOCK_DGRAM, 0);
     if((readOnlyGlobals.collectorInSocketv4 < 0) || (errno != 0) ) {
@@ -169,6 +180,18 @@ int createNetFlowListener(u_int16_t collectorInPort) {
 void closeNetFlowListener() {
   if(readOnlyGlobals.collectorInSocketv4 != -1)   close(readOnlyGlobals.collectorInSocketv4);
   if(readOnlyGlobals.collectorInSctpSocket != -1) close(readOnlyGlobals.collectorInSctpSocket);
+
+  if(readOnlyGlobals.collectorReusePort) {
+    int i;
+
+    for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+      CollectorSocket *s = &readWriteGlobals->collectorSockets[i];
+
+      if(s->socketv4 >= 0) close(s->socketv4);
+      if(s->socketv6 >= 0) close(s->socketv6);
+      s->socketv4 = s->socketv6 = -1;
+    }
+  }
 }
 
 /* ********************************************************* */
@@ -207,23 +230,41 @@ static u_int8_t matchAS(struct generic_netflow_record *record, ASlist *l) {
 
 /* *************************** */
 
-static u_int8_t _matchPrefix(IpAddress *addr, NetList *l) {
-  if(addr->ipVersion != 4) return(0); /* IPv4 only so far */
-
-  while(l != NULL) {
-    if(l->net == (addr->ipType.ipv4 & l->mask))
-      return(1);
-    else
-      l = l->next;
-  }
-
-  return(0);
+static u_int8_t matchPrefix(struct generic_netflow_record *record, LpmTable *l) {
+  return((lpmLookup(l, &record->srcaddr) != LPM_NO_MATCH)
+	 || (lpmLookup(l, &record->dstaddr) != LPM_NO_MATCH));
 }
 
 /* *************************** */
 
-static u_int8_t matchPrefix(struct generic_netflow_record *record, NetList *l) {
-  return(_matchPrefix(&record->srcaddr, l) || _matchPrefix(&record->dstaddr, l));
+/* One direction of a collected flow: reverse = 1 for the dst -> src packets */
+static void initCollectedPacket(DecodedPacket *pkt, struct generic_netflow_record *record,
+				u_int8_t reverse, u_int32_t subflow_id, struct pcap_pkthdr *h,
+				u_int32_t firstSeen, u_int32_t netflow_device_ip) {
+  memset(pkt, 0, sizeof(DecodedPacket));
+
+  pkt->packet_if_idx = -1 /* Unknown input interface */, pkt->rx_packet = 1 /* RX packet */;
+  pkt->subflow_id = subflow_id, pkt->proto = record->proto, pkt->tos = record->tos;
+  pkt->vlanId = record->vlanId, pkt->tcpFlags = record->tcp_flags, pkt->icmpType = record->icmpType;
+  pkt->h = h, pkt->firstSeen = firstSeen, pkt->flow_sender_ip = netflow_device_ip;
+  pkt->engine_type = record->engine_type, pkt->engine_id = record->engine_id;
+  pkt->record = record;
+
+  if(!reverse) {
+    pkt->numPkts = record->sentPkts, pkt->len = record->sentOctets, pkt->ttl = record->maxTTL;
+    pkt->src = &record->srcaddr, pkt->sport = record->srcport;
+    pkt->dst = &record->dstaddr, pkt->dport = record->dstport;
+    pkt->if_input = record->input, pkt->if_output = record->output;
+    pkt->src_as = record->src_as, pkt->dst_as = record->dst_as;
+    pkt->src_mask = record->src_mask, pkt->dst_mask = record->dst_mask;
+  } else {
+    pkt->numPkts = record->rcvdPkts, pkt->len = record->rcvdOctets;
+    pkt->src = &record->dstaddr, pkt->sport = record->dstport;
+    pkt->dst = &record->srcaddr, pkt->dport = record->srcport;
+    pkt->if_input = record->output, pkt->if_output = record->input;
+    pkt->src_as = record->dst_as, pkt->dst_as = record->src_as;
+    pkt->src_mask = record->dst_mask, pkt->dst_mask = record->src_mask;
+  }
 }
 
 /* *************************** */
@@ -232,6 +273,7 @@ static void handleGenericFlow(u_int16_t thread_id, u_int32_t netflow_device_ip,
 			      u_int32_t recordActTime, u_int32_t recordSysUpTime,
 			      struct generic_netflow_record *record) {
   struct pcap_pkthdr h;
+  DecodedPacket pkt;
   u_int32_t firstSeen, lastSeen;
   u_int32_t initTime, subflow_id;
   u_int8_t found;
@@ -271,14 +313,12 @@ static void handleGenericFlow(u_int16_t thread_id, u_int32_t netflow_device_ip,
     }
   }
 
-  pthread_rwlock_wrlock(&readWriteGlobals->collectorCounterLock);
-  readWriteGlobals->collectionStats.num_flows_processed++;
-  pthread_rwlock_unlock(&readWriteGlobals->collectorCounterLock);
+  addSharedThreadStat(readWriteGlobals->threadStats[thread_id].collectedFlows, 1);
 
   if((record->firstEpoch > 0) && (record->lastEpoch > 0)) {
     firstSeen = ntohl(record->firstEpoch), lastSeen = ntohl(record->lastEpoch);
     if(((firstSeen < 1300618407 /* Dummy date */) || (lastSeen < 1300618407 /* Dummy date */))){
-      time_t now = time(NULL);
+      time_t now = coarseTime();
 
       firstSeen = now - (lastSeen - firstSeen);
       lastSeen = now;
@@ -329,85 +369,21 @@ static void handleGenericFlow(u_int16_t thread_id, u_int32_t netflow_device_ip,
   if((record->rcvdPkts == 0) && (record->rcvdOctets > 0))
     record->rcvdPkts = max(1, record->rcvdOctets / 512); /* We assume packet size ~512 bytes */
 
-  if(record->sentPkts && record->sentOctets)
-    bkt = processFlowPacket(thread_id,
-			    -1 /* Unknown input interface */,
-			    1 /* RX packet */,
-			    subflow_id, record->proto,
-			    0 /* no fragments */,
-			    0 /* unknown ip_offset */,
-			    0 /* no sample */,
-			    record->sentPkts,
-			    record->tos,
-			    record->maxTTL,
-			    record->vlanId,
-			    0, /* tunnel_id */
-			    0, /* gtp offset */
-			    NULL, /* Ethernet */
-			    &record->srcaddr,
-			    record->srcport,
-			    &record->dstaddr,
-			    record->dstport,
-			    0, NULL, 0, NULL, 0, /* Tunnel info */
-			    record->sentOctets,
-			    record->tcp_flags,
-			    0 /* TCP Win */, 0, /* TCP seq num */ 0 /* TCP ack num */,
-			    0 /* TCP MSS */, 0 /* TCP win scale */,
-			    record->icmpType,
-			    0,
-			    0, NULL, /* MPLS */
-			    record->input, record->output,
-			    &h, NULL, 0, 0, 0, /* payload */
-			    firstSeen,
-			    record->src_as, record->dst_as,
-			    record->src_mask, record->dst_mask,
-			    netflow_device_ip, 0,
-			    record->engine_type, record->engine_id,
-			    NULL, NULL, record);
-  else if(!(record->rcvdPkts && record->rcvdOctets))
+  if(record->sentPkts && record->sentOctets) {
+    initCollectedPacket(&pkt, record, 0, subflow_id, &h, firstSeen, netflow_device_ip);
+    bkt = processFlowPacket(thread_id, &pkt);
+  } else if(!(record->rcvdPkts && record->rcvdOctets))
     traceEvent(TRACE_INFO, "Received flow with invalid count [sentPkts: %u][sentOctets: %u]: discarded [num_flows: %u]",
 	       record->sentPkts, record->sentOctets,
-	       readWriteGlobals->collectionStats.num_dissected_flow_packets);
+	       readWriteGlobals->threadStats[thread_id].dissectedFlowPkts);
 
   if(record->rcvdPkts && record->rcvdOctets) {
-    bkt = processFlowPacket(thread_id,
-			    -1 /* Unknown input interface */,
-			    1 /* RX packet */,
-			    subflow_id, record->proto,
-			    0 /* no fragments */,
-			    0 /* unknown ip_offset */,
-			    0 /* no sample */,
-			    record->rcvdPkts,
-			    record->tos,
-			    0, /* ttl */
-			    record->vlanId,
-			    0, /* tunnel_id */
-			    0, /* gtp offset */
-			    NULL, /* Ethernet */
-			    &record->dstaddr,
-			    record->dstport,
-			    &record->srcaddr,
-			    record->srcport,
-			    0, NULL, 0, NULL, 0, /* Tunnel info */
-			    record->rcvdOctets,
-			    record->tcp_flags,
-			    0 /* TCP Win */, 0, /* TCP seq num */ 0, /* TCP ack num */
-			    0 /* TCP MSS */, 0 /* TCP win scale */,
-			    record->icmpType,
-			    0,
-			    0, NULL, /* MPLS */
-			    record->output, record->input,
-			    &h, NULL, 0, 0, 0, /* payload */
-			    firstSeen,
-			    record->dst_as, record->src_as,
-			    record->dst_mask, record->src_mask,
-			    netflow_device_ip, 0,
-			    record->engine_type, record->engine_id,
-			    NULL, NULL, record);
+    initCollectedPacket(&pkt, record, 1, subflow_id, &h, firstSeen, netflow_device_ip);
+    bkt = processFlowPacket(thread_id, &pkt);
   } else if(record->rcvdPkts || record->rcvdOctets)
     traceEvent(TRACE_INFO, "Received flow with invalid count [rcvdPkts: %u][rcvdOctets: %u]: discarded [num_flows: %u]",
 	       record->rcvdPkts, record->rcvdOctets,
-	       readWriteGlobals->collectionStats.num_dissected_flow_packets);
+	       readWriteGlobals->threadStats[thread_id].dissectedFlowPkts);
 
   if(bkt && bkt->ext && record->nexthop.ipVersion) {
     if(bkt->ext->nextHop.ipVersion == 0) /* Not yet set */
@@ -658,16 +634,98 @@ u_int8_t dissectCustomField(struct generic_netflow_record *record,
 
 /* ********************************************************* */
 
-void dissectNetFlow(u_int32_t netflow_device_ip,
-		    char *buffer, int bufferLen) {
+static void handleCollectedRecord(u_short thread_id, u_int32_t netflow_device_ip,
+				  u_int32_t recordActTime, u_int32_t recordSysUpTime,
+				  struct generic_netflow_record *record,
+				  u_int32_t multiplier, u_int32_t packet_offset,
+				  u_int8_t host_order) {
+  if(record->cisco.packet_len > 0) {
+    struct pcap_pkthdr pkthdr;
+    u_int16_t input = host_order ? record->input : ntohs(record->input);
+    u_int16_t output = host_order ? record->output : ntohs(record->output);
+
+    pkthdr.ts.tv_sec = coarseTime();
+    pkthdr.ts.tv_usec = 0;
+    pkthdr.caplen = record->cisco.packet_len;
+    pkthdr.len = max(record->cisco.packet_len, record->cisco.original_packet_len);
+
+#ifdef CISCO_DEBUG
+    traceEvent(TRACE_NORMAL,
+	       "[CISCO] Received pkt %d [len: caplen=%d/len=%d][offset: %d][multiplier=%d][observationPointId: %d][selectorId: %d][interfaces: %d->%d]",
+	       readWriteGlobals->threadStats[thread_id].dissectedFlowPkts,
+	       pkthdr.caplen, pkthdr.len, packet_offset,
+	       multiplier, record->cisco.observationPointId, record->cisco.selectorId,
+	       input, output);
+#endif
+
+    decodePacket(thread_id,
+		 -1 /* unknown input idx */,
+		 &pkthdr, record->cisco.packet, 1 /* RX packet */,
+		 1 /* sampledPacket */, (multiplier == 0) ? 1 : multiplier,
+		 input, output,
+		 ntohl(netflow_device_ip), 0); /* Pass the packet to nProbe */
+  } else {
+    /*
+      IMPORTANT NOTE
+
+      handleGenericFlow handles monodirectional flows, whereas
+      v9 flows and bidirectional. This means that if there's some
+      bidirectional traffic, handleGenericFlow is called twice.
+    */
+    if(!host_order)
+      deEndianRecord(record); /* This must be called once per handleGenericFlow() call */
+
+    /* handleGenericFlow handles both directions so there's no need to revert
+       this flow and call handleGenericFlow() again */
+    handleGenericFlow(thread_id, netflow_device_ip, recordActTime, recordSysUpTime, record);
+  }
+}
+
+/* ********************************************************* */
+
+/*
+  Runs a data flowset through the decoder of its template. The templates
+  with a decoder have fixed length records, so the records are counted
+  upfront and a trailing partial record is padding. The record is reset
+  only where the decoder writes when it leaves the rest untouched.
+*/
+static void decodeFlowSet(u_short thread_id, FlowSetV9Ipfix *template,
+			  char *buffer, int bufferLen, u_int32_t displ, u_int16_t flowsetLen,
+			  u_int32_t netflow_device_ip, u_int32_t recordActTime, u_int32_t recordSysUpTime,
+			  u_int8_t engine_type, u_int8_t engine_id) {
+  TemplateDecoder *decoder = template->decoder;
+  struct generic_netflow_record record;
+  u_int32_t end = min(displ + flowsetLen, (u_int32_t)bufferLen), multiplier = 1, packet_offset = 0;
+  u_int32_t reset_len = (decoder->flags & TEMPLATE_DECODER_FULL_RESET) ? sizeof(record) : offsetof(struct generic_netflow_record, ntop);
+
+  memset(&record, 0, sizeof(record));
+
+  for(displ += sizeof(V9FlowSet); (displ + decoder->recordLen) <= end; displ += decoder->recordLen) {
+    u_int8_t skip_flow = 0;
+
+    memset(&record, 0, reset_len);
+    record.vlanId = NO_VLAN; /* No VLAN */
+    record.engine_type = engine_type, record.engine_id = engine_id;
+
+    decodeTemplateRecord(decoder, template->fields, buffer, bufferLen, displ, netflow_device_ip,
+			 &record, &multiplier, &packet_offset, &skip_flow);
+
+    if(!skip_flow)
+      handleCollectedRecord(thread_id, netflow_device_ip, recordActTime, recordSysUpTime,
+			    &record, multiplier, packet_offset, 1 /* host order */);
+  }
+}
+
+/* ********************************************************* */
+
+void dissectNetFlow(u_short thread_id, u_int32_t netflow_device_ip,
+		    char *buffer, int bufferLen, u_int8_t transport) {
   NetFlow5Record the5Record;
   int flowVersion;
   u_int32_t recordActTime = 0, recordSysUpTime = 0;
   struct generic_netflow_record record;
 
-  pthread_rwlock_wrlock(&readWriteGlobals->collectorCounterLock);
-  readWriteGlobals->collectionStats.num_dissected_flow_packets++;
-  pthread_rwlock_unlock(&readWriteGlobals->collectorCounterLock);
+  addSharedThreadStat(readWriteGlobals->threadStats[thread_id].dissectedFlowPkts, 1);
 
   memcpy(&the5Record, buffer, bufferLen > sizeof(the5Record) ? sizeof(the5Record): bufferLen);
   flowVersion = ntohs(the5Record.flowHeader.version);
@@ -675,7 +733,7 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 #ifdef DEBUG_FLOWS
   if(readOnlyGlobals.enable_debug)
     traceEvent(TRACE_INFO, "NETFLOW: dissectNetFlow(len=%d) [tot flow packets=%u]", bufferLen,
-	       readWriteGlobals->collectionStats.num_dissected_flow_packets);
+	       readWriteGlobals->threadStats[thread_id].dissectedFlowPkts);
 #endif
 
 #ifdef DEBUG_FLOWS
@@ -857,10 +915,9 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 	  displ += sizeof(V9TemplateHeader);
 
 	  while((bufferLen >= (displ+stillToProcess)) && (!templateDone)) {
-	    FlowSetV9Ipfix *cursor = NULL;
 	    u_int16_t len = 0;
 	    int fieldId;
-	    u_char goodTemplate = 0;
+	    u_char goodTemplate = 0, withdrawal = 0;
 	    u_int accumulatedLen = 0;
 
 	    memset(&template, 0, sizeof(template));
@@ -880,7 +937,11 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 		displ += 2, stillToProcess -= 2 /* , len += 2 */;
 		template.scopeFieldCount = tot_scope_field_count;
 
-		if(tot_field_count >= tot_scope_field_count) {
+		if(tot_field_count == 0) {
+		  /* Options template withdrawal (RFC 7011 8.1): it has no scope field count */
+		  displ -= 2, stillToProcess += 2;
+		  template.fieldCount = 0, withdrawal = 1;
+		} else if(tot_field_count >= tot_scope_field_count) {
 		  u_int num = tot_scope_field_count * 4; /* FIX: check PEN here */
 		  u_int field_num = (tot_field_count-tot_scope_field_count) * 4;
 		  u_int delta = num + field_num;
@@ -891,7 +952,7 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 			     "It looks looks like the template is broken (tot_field_count=%d, tot_scope_field_count=%d) "
 			     "[num_dissected_flows=%u][templateType=%d]",
 			     tot_field_count, tot_scope_field_count,
-			     readWriteGlobals->collectionStats.num_dissected_flow_packets, isOptionTemplate);
+			     readWriteGlobals->threadStats[thread_id].dissectedFlowPkts, isOptionTemplate);
 		  displ += 4 /* , len += 4 */; /* Using default skip */
 		}
 	      } else {
@@ -911,13 +972,18 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 	    if(template.fieldCount > 128) {
 	      traceEvent(TRACE_WARNING, "Too many template fields (%d): skept [pktId: %u]",
 			 template.fieldCount,
-			 readWriteGlobals->collectionStats.num_dissected_flow_packets);
+			 readWriteGlobals->threadStats[thread_id].dissectedFlowPkts);
 	      goodTemplate = 0;
 	    } else if(template.fieldCount == 0) {
-              traceEvent(TRACE_WARNING, "No fields defined on template %d: skept [pktId: %u]",
-			 template.templateId,
-			 readWriteGlobals->collectionStats.num_dissected_flow_packets);
-              goodTemplate = 0;
+	      if(handle_ipfix) {
+		/* Template withdrawal: the set id withdraws all the templates of the set */
+		withdrawal = 1;
+		if(template.templateId == header.templateFlowset) template.templateId = TEMPLATE_WITHDRAW_ALL;
+	      } else
+		traceEvent(TRACE_WARNING, "No fields defined on template %d: skept [pktId: %u]",
+			   template.templateId,
+			   readWriteGlobals->threadStats[thread_id].dissectedFlowPkts);
+	      goodTemplate = 0;
   	    } else {
 	      if(handle_ipfix) {
 		fields = (V9V10TemplateField*)malloc(template.fieldCount * sizeof(V9V10TemplateField));
@@ -1014,59 +1080,36 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 
 	    pthread_rwlock_wrlock(&readWriteGlobals->collectorRwLock);
 
-	    if(goodTemplate) {
-	      readWriteGlobals->collectionStats.num_good_templates_received++;
-
-	      /* Sequential list access */
-	      cursor = readWriteGlobals->v9_ipfix_templates;
-
-	      while(cursor != NULL) {
-		if((cursor->templateInfo.templateId == template.templateId)
-		   && (cursor->templateInfo.flowVersion == flowVersion)
-		   && (cursor->templateInfo.netflow_device_ip == netflow_device_ip)
-		   && (cursor->templateInfo.observation_domain_id_source_id == observation_domain_id))
-		  break;
-		else
-		  cursor = cursor->next;
-	      }
+	    if(withdrawal) {
+	      u_int32_t num = withdrawTemplates(flowVersion, netflow_device_ip, observation_domain_id,
+						template.templateId, isOptionTemplate);
 
-	      if(cursor != NULL) {
-		if(readOnlyGlobals.enable_debug)
-		  traceEvent(TRACE_INFO, ">>>>> Redefined existing template [id=%d]",
-			     template.templateId);
+	      if(readOnlyGlobals.enable_debug)
+		traceEvent(TRACE_INFO, ">>>>> Withdrawn %u template(s) [id=%d]", num, template.templateId);
+	    } else if(goodTemplate) {
+	      int rc;
 
-		free(cursor->fields);
-	      } else {
-		if(readOnlyGlobals.enable_debug)
-		  traceEvent(TRACE_INFO, ">>>>> Found new flow template definition [id=%d]", template.templateId);
+	      readWriteGlobals->collectionStats.num_good_templates_received++;
 
-		cursor = (FlowSetV9Ipfix*)malloc(sizeof(FlowSetV9Ipfix));
-		cursor->next = readWriteGlobals->v9_ipfix_templates;
-		readWriteGlobals->v9_ipfix_templates = cursor;
-	      }
+	      template.flowVersion = flowVersion;
+	      template.flowsetLen = len + sizeof(header);
+	      template.observation_domain_id_source_id = observation_domain_id;
 
-	      cursor->templateInfo.flowVersion = flowVersion;
-	      cursor->templateInfo.flowsetLen = len + sizeof(header);
-	      cursor->templateInfo.templateId = template.templateId;
-	      cursor->templateInfo.fieldCount = template.fieldCount;
-	      cursor->templateInfo.v9ScopeLen = template.v9ScopeLen;
-	      cursor->templateInfo.scopeFieldCount  = template.scopeFieldCount;
-	      cursor->templateInfo.isOptionTemplate = template.isOptionTemplate;
-	      cursor->templateInfo.netflow_device_ip = netflow_device_ip;
-	      cursor->templateInfo.observation_domain_id_source_id = observation_domain_id;
-	      cursor->flowLen                 = accumulatedLen;
-	      cursor->fields                  = fields;
+	      rc = addTemplate(&template, accumulatedLen, fields, transport, readWriteGlobals->now);
+	      fields = NULL; /* Owned by the template cache */
 
 	      if(readOnlyGlobals.enable_debug)
-		traceEvent(TRACE_INFO, ">>>>> Defined flow template [id=%d][flowLen=%d][fieldCount=%d]",
-			   cursor->templateInfo.templateId,
-			   cursor->flowLen, cursor->templateInfo.fieldCount);
+		traceEvent(TRACE_INFO, ">>>>> %s flow template [id=%d][flowLen=%d][fieldCount=%d]",
+			   (rc == 0) ? "Defined" : ((rc == 1) ? "Received again" : "Redefined"),
+			   template.templateId, accumulatedLen, template.fieldCount);
 
-	      readWriteGlobals->collectionStats.num_known_templates++;
+	      if(rc == 0) readWriteGlobals->collectionStats.num_known_templates++;
 	    } else {
 	      if(readOnlyGlobals.enable_debug)
 		traceEvent(TRACE_INFO, ">>>>> Skipping bad template [id=%d]", template.templateId);
 	      readWriteGlobals->collectionStats.num_bad_templates_received++;
+
+	      if(fields != NULL) free(fields), fields = NULL;
 	    }
 	    pthread_rwlock_unlock(&readWriteGlobals->collectorRwLock);
 
@@ -1102,25 +1145,19 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 	  fs.flowsetLen = ntohs(fs.flowsetLen);
 	  fs.templateId = ntohs(fs.templateId);
 
-	  pthread_rwlock_rdlock(&readWriteGlobals->collectorRwLock);
-
-	  /* Sequential list access */
-	  cursor = readWriteGlobals->v9_ipfix_templates;
-
-	  while(cursor != NULL) {
-	    if((cursor->templateInfo.templateId == fs.templateId)
-	       && (cursor->templateInfo.flowVersion == flowVersion)
-	       && (cursor->templateInfo.netflow_device_ip == netflow_device_ip)
-	       && (cursor->templateInfo.observation_domain_id_source_id == observation_domain_id)) {
-	      break;
-	    } else
-	      cursor = cursor->next;
-	  }
+	  templateCacheReadLock(thread_id);
+	  cursor = lookupTemplate(flowVersion, netflow_device_ip, observation_domain_id, fs.templateId);
 
 	  if(cursor != NULL) {
 	    /* We process only flows, not option templates */
 
-	    if(cursor->templateInfo.isOptionTemplate == 0) {
+	    if((cursor->templateInfo.isOptionTemplate == 0)
+	       && (cursor->decoder != NULL) && (!readOnlyGlobals.interpretTemplates)) {
+	      /* Fixed length template: compiled when it was received */
+	      decodeFlowSet(thread_id, cursor, buffer, bufferLen, displ, fs.flowsetLen,
+			    netflow_device_ip, recordActTime, recordSysUpTime, engine_type, engine_id);
+	      displ += fs.flowsetLen;
+	    } else if(cursor->templateInfo.isOptionTemplate == 0) {
 	      /* Template found */
 	      int fieldId, init_displ, scopeOffset = (4 * cursor->templateInfo.scopeFieldCount) + cursor->templateInfo.v9ScopeLen;
 	      int end_flow;
@@ -1209,11 +1246,11 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 		    case 1: /* IN_BYTES Incoming flow bytes (src->dst) */
 		    case 231: /* Initiator octets */
 		      record.sentOctets = getField3264to32(&fields[fieldId], &buffer[displ], 1);
-		      record.sentOctets *= readOnlyGlobals.flowCollection.sampleRate;
+		      record.sentOctets = htonl(ntohl(record.sentOctets) * readOnlyGlobals.flowCollection.sampleRate);
 		      break;
 		    case 2: /* IN_PKTS */
 		      record.sentPkts = getField3264to32(&fields[fieldId], &buffer[displ], 1);
-		      record.sentPkts *= readOnlyGlobals.flowCollection.sampleRate;
+		      record.sentPkts = htonl(ntohl(record.sentPkts) * readOnlyGlobals.flowCollection.sampleRate);
 		      break;
 		    case 4: /* PROT */
 		      memcpy(&record.proto, &buffer[displ], 1);
@@ -1296,7 +1333,7 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 
 			memcpy(&sixteen, &buffer[displ], 2);
 			thirtytwo = ntohs(sixteen);
-			record.src_as = htonl(thirtytwo);
+			record.dst_as = htonl(thirtytwo);
 		      } else
 			memcpy(&record.dst_as, &buffer[displ], 4);
 		      break;
@@ -1309,11 +1346,11 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 		    case 23: /* OUT_BYTES Outgoing flow bytes (dst->src) */
 		    case 232: /* Responder octets */
 		      record.rcvdOctets = getField3264to32(&fields[fieldId], &buffer[displ], 1);
-		      record.rcvdOctets *= readOnlyGlobals.flowCollection.sampleRate;
+		      record.rcvdOctets = htonl(ntohl(record.rcvdOctets) * readOnlyGlobals.flowCollection.sampleRate);
 		      break;
 		    case 24: /* OUT_PKTS */
 		      record.rcvdPkts = getField3264to32(&fields[fieldId], &buffer[displ], 1);
-		      record.rcvdPkts *= readOnlyGlobals.flowCollection.sampleRate;
+		      record.rcvdPkts = htonl(ntohl(record.rcvdPkts) * readOnlyGlobals.flowCollection.sampleRate);
 		      break;
 		    case 27: /* IPV6_SRC_ADDR */
 		      if(record.dstaddr.ipVersion != 4)
@@ -1520,54 +1557,9 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 		  }
 #endif
 
-		  if(!skip_flow) {
-		    if(record.cisco.packet_len > 0) {
-		      struct pcap_pkthdr pkthdr;
-
-		      pkthdr.ts.tv_sec = time(NULL);
-		      pkthdr.ts.tv_usec = 0;
-		      pkthdr.caplen = record.cisco.packet_len;
-		      pkthdr.len = max(record.cisco.packet_len, record.cisco.original_packet_len);
-
-#ifdef CISCO_DEBUG
-		      traceEvent(TRACE_NORMAL,
-				 "[CISCO] Received pkt %d [len: caplen=%d/len=%d][offset: %d][multiplier=%d][observationPointId: %d][selectorId: %d][interfaces: %d->%d]",
-				 readWriteGlobals->collectionStats.num_dissected_flow_packets,
-				 pkthdr.caplen, pkthdr.len, packet_offset,
-				 multiplier, record.cisco.observationPointId, record.cisco.selectorId,
-				 ntohs(record.input), ntohs(record.output));
-#endif
-
-		      // traceEvent(TRACE_INFO, "Packet len: %u", record.cisco.packet_len);
-
-		      decodePacket(0 /* dummy threadId */,
-				   -1 /* unknown input idx */,
-				   &pkthdr, record.cisco.packet, 1 /* RX packet */,
-				   1 /* sampledPacket */, (multiplier == 0) ? 1 : multiplier,
-				   ntohs(record.input), ntohs(record.output),
-				   ntohl(netflow_device_ip), 0); /* Pass the packet to nProbe */
-		    } else {
-		      /*
-			IMPORTANT NOTE
-
-			handleGenericFlow handles monodirectional flows, whereas
-			v9 flows and bidirectional. This means that if there's some
-			bidirectional traffic, handleGenericFlow is called twice.
-		      */
-		      deEndianRecord(&record); /* This must be called once per handleGenericFlow() call */
-
-		      /* handleGenericFlow handles both directions so there's no need to revert
-			 this flow and call handleGenericFlow() again */
-		      handleGenericFlow(0 /* fake threadId */, netflow_device_ip, recordActTime, recordSysUpTime, &record);
-
-#ifdef DEBUG_FLOWS
-		      if(readOnlyGlobals.enable_debug)
-			traceEvent(TRACE_INFO,
-				   ">>>> NETFLOW: Calling insert_flow_record() [accum_len=%d]",
-				   accum_len);
-#endif
-		    }
-		  }
+		  if(!skip_flow)
+		    handleCollectedRecord(thread_id, netflow_device_ip, recordActTime, recordSysUpTime,
+					  &record, multiplier, packet_offset, 0 /* network order */);
 
 		  tot_len += accum_len;
 		}
@@ -1589,7 +1581,7 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 		if(padding > 4) {
 		  traceEvent(TRACE_WARNING,
 			     "Template len mismatch [tot_len=%d][flow_len=%d][padding=%d][num_dissected_flow_packets=%d]",
-			     tot_len, fs.flowsetLen, padding, readWriteGlobals->collectionStats.num_dissected_flow_packets);
+			     tot_len, fs.flowsetLen, padding, readWriteGlobals->threadStats[thread_id].dissectedFlowPkts);
 		} else {
 #ifdef DEBUG_FLOWS
 		  if(readOnlyGlobals.enable_debug)
@@ -1613,7 +1605,7 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 	    displ += fs.flowsetLen;
 	  }
 
-	  pthread_rwlock_unlock(&readWriteGlobals->collectorRwLock);
+	  templateCacheReadUnlock(thread_id);
 	}
       }
     } /* for */
@@ -1664,7 +1656,7 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
       record.sentPkts   *= readOnlyGlobals.flowCollection.sampleRate;
       record.sentOctets *= readOnlyGlobals.flowCollection.sampleRate;
 
-      handleGenericFlow(0 /* fake threadId */,
+      handleGenericFlow(thread_id,
 			netflow_device_ip, recordActTime,
 			recordSysUpTime, &record);
     }
@@ -1673,13 +1665,29 @@ void dissectNetFlow(u_int32_t netflow_device_ip,
 
 /* ********************************************************* */
 
+/* fromHostV4 holds the exporter address in host byte order */
+static void dissectCollectedDatagram(u_short thread_id, u_char *buffer, int len,
+				     struct sockaddr_in *fromHostV4, u_int8_t transport) {
+  if((buffer[0] == '\0')
+     && (buffer[1] == '\0')
+     && (buffer[2] == '\0')
+     && ((buffer[3] == 2)    /* sFlow v2 */
+	 || (buffer[3] == 5) /* sFlow v5 */)
+     )
+    dissectSflow(thread_id, buffer, len, fromHostV4); /* sFlow */
+  else
+    dissectNetFlow(thread_id, fromHostV4->sin_addr.s_addr, (char*)buffer, len, transport);
+}
+
+/* ********************************************************* */
+
 void* netFlowCollectLoop(void* notUsed) {
   fd_set netflowMask;
   int len;
 #ifdef DEBUG_FLOWS
   int deviceId = 0;
 #endif
-  u_char buffer[2048];
+  u_char buffer[COLLECTOR_MAX_DATAGRAM_LEN];
   /* Run idle task if this is the only ingress interface */
   u_int8_t runIdleTask = ((readOnlyGlobals.captureDev != NULL) && (strcmp(readOnlyGlobals.captureDev, "none") == 0)) ? 1 : 0;
   struct sockaddr_in fromHostV4;
@@ -1717,6 +1725,8 @@ void* netFlowCollectLoop(void* notUsed) {
     if(readWriteGlobals->shutdownInProgress) break;
 
     if(rc > 0) {
+      u_int8_t transport = IPPROTO_UDP;
+
       if(FD_ISSET(readOnlyGlobals.collectorInSocketv4, &netflowMask)){
 	len = sizeof(fromHostV4);
 	rc = recvfrom(readOnlyGlobals.collectorInSocketv4,
@@ -1752,6 +1762,7 @@ void* netFlowCollectLoop(void* notUsed) {
 	msg.msg_controllen = sizeof(controlVector);
 #endif
 	rc = recvmsg(readOnlyGlobals.collectorInSctpSocket, &msg, 0);
+	transport = IPPROTO_SCTP;
       }
 #endif
 
@@ -1767,17 +1778,10 @@ void* netFlowCollectLoop(void* notUsed) {
 #endif
 
 	fromHostV4.sin_addr.s_addr = ntohl(fromHostV4.sin_addr.s_addr);
-	readWriteGlobals->now = time(NULL), readWriteGlobals->collectedPkts[thread_id]++;
-
-	if((buffer[0] == '\0')
-	   && (buffer[1] == '\0')
-	   && (buffer[2] == '\0')
-	   && ((buffer[3] == 2)    /* sFlow v2 */
-	       || (buffer[3] == 5) /* sFlow v5 */)
-	   )
-	  dissectSflow(buffer, rc, &fromHostV4); /* sFlow */
-	else
-	  dissectNetFlow(fromHostV4.sin_addr.s_addr, (char*)buffer, rc);
+	readWriteGlobals->now = coarseTime();
+	addSharedThreadStat(readWriteGlobals->threadStats[thread_id].collectedPkts, 1);
+
+	dissectCollectedDatagram(thread_id, buffer, rc, &fromHostV4, transport);
 
 #ifdef DEBUG
 	traceEvent(TRACE_NORMAL, "Received %d flows", readOnlyGlobals.num_collected_pkts);
@@ -1798,6 +1802,523 @@ void* netFlowCollectLoop(void* notUsed) {
 
 /* ********************************************************* */
 
+#ifdef HAVE_COLLECTOR_REUSEPORT
+
+typedef struct {
+  struct mmsghdr msgs[COLLECTOR_RECV_BATCH];
+  struct iovec iov[COLLECTOR_RECV_BATCH];
+  struct sockaddr_storage from[COLLECTOR_RECV_BATCH];
+  char control[COLLECTOR_RECV_BATCH][CMSG_SPACE(sizeof(u_int32_t))];
+  u_char *buffers; /* COLLECTOR_RECV_BATCH x COLLECTOR_MAX_DATAGRAM_LEN */
+} CollectorRecvBatch;
+
+static time_t collectorStatsTime;
+
+/* ********************************************************* */
+
+static int openReusePortSocket(int family, u_int16_t port) {
+  int fd, sockopt = 1, rc, err;
+
+  if((fd = socket(family, SOCK_DGRAM, 0)) < 0)
+    return(-1);
+
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&sockopt, sizeof(sockopt)) < 0) {
+    err = errno, close(fd), errno = err;
+    return(-1);
+  }
+
+#ifdef SO_RXQ_OVFL
+  /* Each datagram tells how many the socket has dropped so far */
+  setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, (char *)&sockopt, sizeof(sockopt));
+#endif
+
+  maximize_socket_buffer(fd, SO_RCVBUF);
+
+  if(family == AF_INET) {
+    struct sockaddr_in sockInV4;
+
+    memset(&sockInV4, 0, sizeof(sockInV4));
+    sockInV4.sin_family = AF_INET, sockInV4.sin_port = htons(port), sockInV4.sin_addr.s_addr = INADDR_ANY;
+    rc = bind(fd, (struct sockaddr *)&sockInV4, sizeof(sockInV4));
+  } else {
+    struct sockaddr_in6 sockInV6;
+
+    /* IPv4 exporters are received by the IPv4 socket */
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&sockopt, sizeof(sockopt));
+
+    memset(&sockInV6, 0, sizeof(sockInV6));
+    sockInV6.sin6_family = AF_INET6, sockInV6.sin6_port = htons(port), sockInV6.sin6_addr = in6addr_any;
+    rc = bind(fd, (struct sockaddr *)&sockInV6, sizeof(sockInV6));
+  }
+
+  if(rc < 0) {
+    err = errno, close(fd), errno = err;
+    return(-1);
+  }
+
+  return(fd);
+}
+
+/* ********************************************************* */
+
+/* Drains the socket: returns as soon as a recvmmsg() does not fill the batch */
+static void receiveCollectorBatches(u_short thread_id, CollectorSocket *s, int fd,
+				    u_int8_t is_v6, CollectorRecvBatch *batch) {
+  while(!readWriteGlobals->shutdownInProgress) {
+    int num, i;
+
+    for(i=0; i<COLLECTOR_RECV_BATCH; i++) {
+      batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->from[i]);
+      batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->control[i]);
+    }
+
+    if((num = recvmmsg(fd, batch->msgs, COLLECTOR_RECV_BATCH, MSG_DONTWAIT, NULL)) <= 0) {
+      if((num < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+	traceEvent(TRACE_WARNING, "Collector thread %u: recvmmsg() failed [%s]", thread_id, strerror(errno));
+      return;
+    }
+
+    readWriteGlobals->now = coarseTime();
+    addSharedThreadStat(readWriteGlobals->threadStats[thread_id].collectedPkts, num);
+    s->num_dgrams += num, s->num_batches++;
+
+    for(i=0; i<num; i++) {
+      struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+      struct sockaddr_in fromHostV4;
+#ifdef SO_RXQ_OVFL
+      struct cmsghdr *cmsg;
+
+      for(cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg))
+	if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL))
+	  memcpy(&s->num_drops[is_v6], CMSG_DATA(cmsg), sizeof(u_int32_t));
+#endif
+
+      if(hdr->msg_flags & MSG_TRUNC) s->num_truncated++;
+      if(batch->msgs[i].msg_len == 0) continue;
+
+      /* As in netFlowCollectLoop(): IPv6 exporters have no device address */
+      memset(&fromHostV4, 0, sizeof(fromHostV4));
+      if(!is_v6) memcpy(&fromHostV4, &batch->from[i], sizeof(fromHostV4));
+      fromHostV4.sin_addr.s_addr = ntohl(fromHostV4.sin_addr.s_addr);
+
+      dissectCollectedDatagram(thread_id, (u_char*)batch->iov[i].iov_base,
+			       batch->msgs[i].msg_len, &fromHostV4, IPPROTO_UDP);
+    }
+
+    if(num < COLLECTOR_RECV_BATCH) return;
+  }
+}
+
+/* ********************************************************* */
+
+static void* netFlowReusePortLoop(void *_thid) {
+  unsigned long thread_id = (unsigned long)_thid;
+  CollectorSocket *s = &readWriteGlobals->collectorSockets[thread_id];
+  /* Run idle task if this is the only ingress interface */
+  u_int8_t runIdleTask = ((readOnlyGlobals.captureDev != NULL) && (strcmp(readOnlyGlobals.captureDev, "none") == 0)) ? 1 : 0;
+  CollectorRecvBatch batch;
+  struct pollfd pfd[2];
+  int num_fds = 0, i;
+
+  readOnlyGlobals.datalink = DLT_EN10MB;
+
+  memset(&batch, 0, sizeof(batch));
+  if((batch.buffers = (u_char*)malloc(COLLECTOR_RECV_BATCH * COLLECTOR_MAX_DATAGRAM_LEN)) == NULL) {
+    traceEvent(TRACE_ERROR, "Not enough memory for the buffers of collector thread %lu", thread_id);
+    return(NULL);
+  }
+
+  for(i=0; i<COLLECTOR_RECV_BATCH; i++) {
+    batch.iov[i].iov_base = &batch.buffers[i * COLLECTOR_MAX_DATAGRAM_LEN];
+    batch.iov[i].iov_len = COLLECTOR_MAX_DATAGRAM_LEN;
+    batch.msgs[i].msg_hdr.msg_iov = &batch.iov[i], batch.msgs[i].msg_hdr.msg_iovlen = 1;
+    batch.msgs[i].msg_hdr.msg_name = &batch.from[i];
+    batch.msgs[i].msg_hdr.msg_control = batch.control[i];
+  }
+
+  pfd[num_fds].fd = s->socketv4, pfd[num_fds].events = POLLIN, num_fds++;
+  if(s->socketv6 >= 0) pfd[num_fds].fd = s->socketv6, pfd[num_fds].events = POLLIN, num_fds++;
+
+  while(!readWriteGlobals->shutdownInProgress) {
+    int rc = poll(pfd, num_fds, COLLECTOR_POLL_TIMEOUT);
+
+    if(readWriteGlobals->shutdownInProgress) break;
+
+    if(rc > 0) {
+      for(i=0; i<num_fds; i++)
+	if(pfd[i].revents & POLLIN)
+	  receiveCollectorBatches(thread_id, s, pfd[i].fd, (pfd[i].fd == s->socketv6) ? 1 : 0, &batch);
+    } else {
+      if((rc < 0) && (errno != EINTR)) {
+	traceEvent(TRACE_ERROR, "Collector thread %lu: poll() failed [%s]", thread_id, strerror(errno));
+	break;
+      }
+
+      if(runIdleTask) idleThreadTask(thread_id, 4);
+    }
+  }
+
+  free(batch.buffers);
+  return(NULL);
+}
+
+/* ********************************************************* */
+
+static int createReusePortListeners(u_int16_t collectorInPort) {
+  int i;
+
+#ifdef HAVE_SCTP
+  traceEvent(TRACE_WARNING, "SCTP flow collection is not available with --collector-reuseport");
+#endif
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    CollectorSocket *s = &readWriteGlobals->collectorSockets[i];
+
+    memset(s, 0, sizeof(CollectorSocket));
+
+    if((s->socketv4 = openReusePortSocket(AF_INET, collectorInPort)) < 0) {
+      traceEvent(TRACE_ERROR, "Flow collector UDP port %d already in use ? [%s/%d]",
+		 collectorInPort, strerror(errno), errno);
+      exit(-1);
+    }
+
+    if((s->socketv6 = openReusePortSocket(AF_INET6, collectorInPort)) < 0)
+      traceEvent(TRACE_INFO, "Unable to create a UDPv6 socket for collector thread %d [%s]; IPv6 disabled",
+		 i, strerror(errno));
+  }
+
+  collectorStatsTime = time(NULL);
+
+  traceEvent(TRACE_NORMAL, "Flow collector listening on port %d (IPv4/v6) with %d SO_REUSEPORT sockets",
+	     collectorInPort, readOnlyGlobals.numProcessThreads);
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    unsigned long id = i;
+
+    pthread_create(&readOnlyGlobals.collectThread[i], NULL, netFlowReusePortLoop, (void*)id);
+  }
+
+  return(0);
+}
+
+#endif /* HAVE_COLLECTOR_REUSEPORT */
+
+/* ********************************************************* */
+
+void dumpCollectorSocketStats(void) {
+#ifdef HAVE_COLLECTOR_REUSEPORT
+  time_t now = time(NULL);
+  u_int32_t elapsed = (u_int32_t)(now - collectorStatsTime);
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    CollectorSocket *s = &readWriteGlobals->collectorSockets[i];
+    u_int64_t num_dgrams = s->num_dgrams, num_batches = s->num_batches; /* Snapshot */
+    u_int64_t num_drops = (u_int64_t)s->num_drops[0] + (u_int64_t)s->num_drops[1];
+
+    traceEvent(TRACE_NORMAL, "Collector thread %d: [%.1f datagrams/sec][%llu datagrams][%.1f datagrams/recvmmsg]"
+	       "[%llu socket drops, %llu new][%llu truncated]",
+	       i, (elapsed > 0) ? ((float)(num_dgrams - s->last_dgrams) / (float)elapsed) : 0,
+	       (long long unsigned)num_dgrams,
+	       (num_batches > 0) ? ((float)num_dgrams / (float)num_batches) : 0,
+	       (long long unsigned)num_drops, (long long unsigned)(num_drops - s->last_drops),
+	       (long long unsigned)s->num_truncated);
+
+    s->last_dgrams = num_dgrams, s->last_drops = num_drops;
+  }
+
+  collectorStatsTime = now;
+#endif
+}
+
+/* ********************************************************* */
+
+/* Offset and length of the payload of an unfragmented UDP packet, IPv4 sender (0 for IPv6) */
+static int getUdpPayload(int datalink, const u_char *p, u_int32_t caplen,
+			 u_int32_t *offset, u_int32_t *len, u_int32_t *src_ipv4) {
+  u_int32_t off = 0, l4, udp_len;
+  u_int16_t eth_type;
+
+  switch(datalink) {
+  case DLT_EN10MB:
+    if(caplen < 14) return(-1);
+
+    eth_type = (p[12] << 8) + p[13], off = 14;
+    while(((eth_type == 0x8100 /* 802.1Q */) || (eth_type == 0x88A8 /* QinQ */)) && ((off + 4) <= caplen))
+      eth_type = (p[off+2] << 8) + p[off+3], off += 4;
+
+    if((eth_type != 0x0800) && (eth_type != 0x86DD)) return(-1);
+    break;
+
+#ifdef DLT_LINUX_SLL
+  case DLT_LINUX_SLL:
+    off = 16;
+    break;
+#endif
+
+  case DLT_RAW:
+    break;
+
+  default:
+    return(-1);
+  }
+
+  if(off >= caplen) return(-1);
+
+  if(((p[off] >> 4) == 4) && ((off + 20) <= caplen)) {
+    if((p[off+9] != IPPROTO_UDP) || ((((p[off+6] << 8) + p[off+7]) & 0x3FFF) != 0 /* Fragment */))
+      return(-1);
+
+    l4 = off + (p[off] & 0x0F) * 4;
+    memcpy(src_ipv4, &p[off+12], 4);
+  } else if(((p[off] >> 4) == 6) && ((off + 40) <= caplen)) {
+    if(p[off+6] != IPPROTO_UDP) return(-1);
+
+    l4 = off + 40, *src_ipv4 = 0;
+  } else
+    return(-1);
+
+  if((l4 + 8) > caplen) return(-1);
+
+  udp_len = (p[l4+4] << 8) + p[l4+5];
+  if((udp_len <= 8) || ((l4 + udp_len) > caplen /* Truncated capture */)) return(-1);
+
+  *offset = l4 + 8, *len = udp_len - 8;
+  return(0);
+}
+
+/* ********************************************************* */
+
+typedef struct {
+  u_char *payload;
+  u_int32_t len, src_ipv4;
+} PcapDatagram;
+
+/* Loads the UDP payloads of a pcap file in memory */
+static int loadPcapDatagrams(char *pcap_path, PcapDatagram **_dgrams,
+			     u_int32_t *_num_dgrams, u_int32_t *num_skipped) {
+  PcapDatagram *dgrams = NULL;
+  u_int32_t num_dgrams = 0, max_dgrams = 0;
+  char ebuf[PCAP_ERRBUF_SIZE];
+  struct pcap_pkthdr *h;
+  const u_char *p;
+  pcap_t *pcap;
+  int datalink;
+
+  *num_skipped = 0;
+
+  if((pcap = pcap_open_offline(pcap_path, ebuf)) == NULL) {
+    traceEvent(TRACE_ERROR, "Unable to open %s: %s", pcap_path, ebuf);
+    return(-1);
+  }
+
+  datalink = pcap_datalink(pcap);
+
+  while(pcap_next_ex(pcap, &h, &p) > 0) {
+    u_int32_t offset, len, src_ipv4;
+
+    if(getUdpPayload(datalink, p, h->caplen, &offset, &len, &src_ipv4) != 0) {
+      (*num_skipped)++;
+      continue;
+    }
+
+    if(num_dgrams == max_dgrams) {
+      PcapDatagram *d = (PcapDatagram*)realloc(dgrams, sizeof(PcapDatagram) * (max_dgrams + 4096));
+
+      if(d == NULL) break;
+      dgrams = d, max_dgrams += 4096;
+    }
+
+    if((dgrams[num_dgrams].payload = (u_char*)malloc(len)) == NULL) break;
+    memcpy(dgrams[num_dgrams].payload, &p[offset], len);
+    dgrams[num_dgrams].len = len, dgrams[num_dgrams].src_ipv4 = src_ipv4, num_dgrams++;
+  }
+
+  pcap_close(pcap);
+
+  *_dgrams = dgrams, *_num_dgrams = num_dgrams;
+  return(0);
+}
+
+/* ********************************************************* */
+
+static void freePcapDatagrams(PcapDatagram *dgrams, u_int32_t num_dgrams) {
+  u_int32_t i;
+
+  for(i=0; i<num_dgrams; i++) free(dgrams[i].payload);
+  if(dgrams != NULL) free(dgrams);
+}
+
+/* ********************************************************* */
+
+/*
+  --collector-blast: sends the UDP payloads of a pcap file (NetFlow,
+  IPFIX or sFlow recorded on the wire) in a loop to a collector running
+  on this host. The datagrams leave from COLLECTOR_BLAST_SOCKETS source
+  ports so the kernel spreads them over the --collector-reuseport
+  sockets; the collector reports what it received and dropped.
+*/
+void collectorBlast(char *pcap_path, u_int16_t port) {
+#ifdef HAVE_COLLECTOR_REUSEPORT
+  PcapDatagram *dgrams = NULL;
+  u_int32_t num_dgrams = 0, num_skipped = 0, next = 0, n, i;
+  int fds[COLLECTOR_BLAST_SOCKETS], num_fds = 0;
+  struct mmsghdr msgs[COLLECTOR_RECV_BATCH];
+  struct iovec iov[COLLECTOR_RECV_BATCH];
+  u_int64_t num_sent = 0, num_short = 0, last_sent = 0;
+  struct sockaddr_in dst;
+  time_t begin, last;
+
+  if(port == 0) {
+    traceEvent(TRACE_ERROR, "--collector-blast needs the collector port (-3 <port>)");
+    return;
+  }
+
+  if(loadPcapDatagrams(pcap_path, &dgrams, &num_dgrams, &num_skipped) != 0)
+    return;
+
+  memset(&dst, 0, sizeof(dst));
+  dst.sin_family = AF_INET, dst.sin_port = htons(port), dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  /* A connected socket per source port */
+  while(num_fds < COLLECTOR_BLAST_SOCKETS) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if(fd < 0) break;
+
+    if(connect(fd, (struct sockaddr*)&dst, sizeof(dst)) < 0) {
+      close(fd);
+      break;
+    }
+
+    maximize_socket_buffer(fd, SO_SNDBUF);
+    fds[num_fds++] = fd;
+  }
+
+  if((num_dgrams == 0) || (num_fds == 0)) {
+    traceEvent(TRACE_ERROR, "Collector blast [%s]: nothing to send [%u UDP datagrams][%u packets skipped][%d sockets]",
+	       pcap_path, num_dgrams, num_skipped, num_fds);
+    goto blast_cleanup;
+  }
+
+  traceEvent(TRACE_NORMAL, "Collector blast [%s]: sending %u datagrams (%u packets skipped) to 127.0.0.1:%u from %d ports for %d sec",
+	     pcap_path, num_dgrams, num_skipped, port, num_fds, COLLECTOR_BLAST_DURATION);
+
+  memset(msgs, 0, sizeof(msgs));
+  begin = last = time(NULL);
+
+  for(n=0; ; n++) {
+    int rc;
+
+    for(i=0; i<COLLECTOR_RECV_BATCH; i++) {
+      iov[i].iov_base = dgrams[next].payload, iov[i].iov_len = dgrams[next].len;
+      msgs[i].msg_hdr.msg_iov = &iov[i], msgs[i].msg_hdr.msg_iovlen = 1;
+      if(++next == num_dgrams) next = 0;
+    }
+
+    /* The datagrams not sent are skipped */
+    if((rc = sendmmsg(fds[n % num_fds], msgs, COLLECTOR_RECV_BATCH, 0)) > 0)
+      num_sent += rc;
+
+    if(rc < COLLECTOR_RECV_BATCH) num_short++;
+
+    if((n & 0x3F) == 0) {
+      time_t now = time(NULL);
+
+      if(now != last) {
+	traceEvent(TRACE_NORMAL, "Collector blast: [%.1f datagrams/sec][%llu short sends]",
+		   (float)(num_sent - last_sent) / (float)(now - last), (long long unsigned)num_short);
+	last = now, last_sent = num_sent;
+
+	if((now - begin) >= COLLECTOR_BLAST_DURATION) break;
+      }
+    }
+  }
+
+  traceEvent(TRACE_NORMAL, "Collector blast [%s]: [%llu datagrams sent][%.1f datagrams/sec][%llu short sends]",
+	     pcap_path, (long long unsigned)num_sent, (float)num_sent / (float)(last - begin),
+	     (long long unsigned)num_short);
+
+ blast_cleanup:
+  for(i=0; i<num_fds; i++) close(fds[i]);
+  freePcapDatagrams(dgrams, num_dgrams);
+#else
+  traceEvent(TRACE_ERROR, "--collector-blast is not supported on this platform");
+#endif
+}
+
+/* ********************************************************* */
+
+/*
+  --collector-bench: dissects the NetFlow/IPFIX UDP payloads of a pcap
+  file from memory on thread 0, for COLLECTOR_BENCH_DURATION sec with
+  the templates interpreted field by field and as long with their
+  compiled decoders, and reports the records/sec of both. The capture
+  has to contain the templates: they are learnt by a first lap.
+*/
+void collectorBenchmark(char *pcap_path) {
+  PcapDatagram *dgrams = NULL;
+  u_int32_t num_dgrams = 0, num_skipped = 0, mode, i;
+  float rate[2];
+
+  if(loadPcapDatagrams(pcap_path, &dgrams, &num_dgrams, &num_skipped) != 0)
+    return;
+
+  if(num_dgrams == 0) {
+    traceEvent(TRACE_ERROR, "Collector benchmark [%s]: no UDP datagrams [%u packets skipped]",
+	       pcap_path, num_skipped);
+    freePcapDatagrams(dgrams, num_dgrams);
+    return;
+  }
+
+  initTemplateCache();
+  readWriteGlobals->now = coarseTime();
+
+  for(i=0; i<num_dgrams; i++)
+    dissectNetFlow(0, dgrams[i].src_ipv4, (char*)dgrams[i].payload, dgrams[i].len, IPPROTO_UDP);
+
+  traceEvent(TRACE_NORMAL, "Collector benchmark [%s]: [%u datagrams][%u packets skipped][%u templates][%u compiled]",
+	     pcap_path, num_dgrams, num_skipped, readWriteGlobals->templateCache.num_templates,
+	     readWriteGlobals->templateCache.num_compiled);
+
+  for(mode=0; mode<2; mode++) {
+    u_int64_t begin_flows = readWriteGlobals->threadStats[0].collectedFlows, num_records, num_laps = 0;
+    struct timeval begin, now;
+    float elapsed;
+
+    readOnlyGlobals.interpretTemplates = (mode == 0) ? 1 : 0;
+    gettimeofday(&begin, NULL);
+
+    do {
+      readWriteGlobals->now = coarseTime();
+
+      for(i=0; i<num_dgrams; i++)
+	dissectNetFlow(0, dgrams[i].src_ipv4, (char*)dgrams[i].payload, dgrams[i].len, IPPROTO_UDP);
+
+      num_laps++;
+      gettimeofday(&now, NULL);
+      elapsed = (now.tv_sec - begin.tv_sec) + ((float)now.tv_usec - (float)begin.tv_usec) / 1000000;
+    } while(elapsed < COLLECTOR_BENCH_DURATION);
+
+    num_records = readWriteGlobals->threadStats[0].collectedFlows - begin_flows;
+    rate[mode] = (float)num_records / elapsed;
+
+    traceEvent(TRACE_NORMAL, "Collector benchmark [%s]: [%llu records][%.1f records/sec][%.1f datagrams/sec]",
+	       (mode == 0) ? "interpreted" : "compiled", (long long unsigned)num_records,
+	       rate[mode], (float)(num_laps * num_dgrams) / elapsed);
+  }
+
+  readOnlyGlobals.interpretTemplates = 0;
+
+  if(rate[0] > 0)
+    traceEvent(TRACE_NORMAL, "Collector benchmark: compiled decoders are %.2fx the interpreter", rate[1] / rate[0]);
+
+  termTemplateCache();
+  freePcapDatagrams(dgrams, num_dgrams);
+}
+
+/* ********************************************************* */
+
 void handleCollectionFilter(char *_filter) {
   /*
     Format
@@ -1840,37 +2361,27 @@ void handleCollectionFilter(char *_filter) {
 	readOnlyGlobals.flowCollection.as_list = el;
     }
   } else {
-    /* 192.168.0.0/24 */
+    /* 192.168.0.0/24 or 2001:db8::/32 */
     char *mask = strchr(filter, '/');
-    u_int bits;
-    in_addr_t addr;
-    NetList *el;
+    LpmTable **list = not_filter ? &readOnlyGlobals.flowCollection.not_prefix_list : &readOnlyGlobals.flowCollection.prefix_list;
+    LpmTable *t;
 
-    if(mask == NULL) {
+    if((mask == NULL) || (atoi(&mask[1]) == 0)) {
     invalid_filter:
       traceEvent(TRACE_WARNING, "Invalid filter %s specified", _filter);
       return;
-    } else
-      bits = atol(&mask[1]), mask[0] = '\0';
+    }
 
-    addr = inet_addr(filter);
+    /* The filters are looked up by the collector threads: add to a copy */
+    if((t = createLpmTable(*list)) == NULL)
+      return;
 
-    if((bits == 0) || (addr == 0))
+    if((lpmParsePrefix(t, filter, 0) != 0) || (lpmBuild(t) != 0)) {
+      freeLpmTable(t);
       goto invalid_filter;
-
-    el = (NetList*)malloc(sizeof(NetList));
-
-    if(el == NULL) {
-      traceEvent(TRACE_WARNING, "Not enough memory");
-    } else {
-      el->net = ntohl(addr), el->mask = 0xffffffff << (32 - bits);
-      el->next = not_filter ? readOnlyGlobals.flowCollection.not_prefix_list : readOnlyGlobals.flowCollection.prefix_list;
-
-      if(not_filter)
-	readOnlyGlobals.flowCollection.not_prefix_list = el;
-      else
-	readOnlyGlobals.flowCollection.prefix_list = el;
     }
+
+    publishLpmTable(list, t);
   }
 }
 
@@ -1886,20 +2397,10 @@ static void freeASlist(ASlist *l) {
 
 /* ********************************************************* */
 
-static void freeNetList(NetList *l) {
-  while(l) {
-    NetList *next = l->next;
-    free(l);
-    l = next;
-  }
-}
-
-/* ********************************************************* */
-
 void freeCollectionFilters() {
   freeASlist(readOnlyGlobals.flowCollection.not_as_list);
   freeASlist(readOnlyGlobals.flowCollection.as_list);
 
-  freeNetList(readOnlyGlobals.flowCollection.not_prefix_list);
-  freeNetList(readOnlyGlobals.flowCollection.prefix_list);
+  freeLpmTable(readOnlyGlobals.flowCollection.not_prefix_list);
+  freeLpmTable(readOnlyGlobals.flowCollection.prefix_list);
 }
@@ -27,19 +27,29 @@
 /* ****************************************************** */
 
 void freenDPI(FlowHashBucket *myBucket) {
-  if(myBucket->core.l7.proto.ndpi.flow) {
-    free(myBucket->core.l7.proto.ndpi.flow);
-    myBucket->core.l7.proto.ndpi.flow = NULL;
+  if(myBucket->ext == NULL)
+    return;
+
+  if(myBucket->ext->pool_id != 0) {
+    /* nDPI data lives in the pool block: it goes away with the bucket */
+    myBucket->ext->cold.l7.proto.ndpi.flow = NULL;
+    myBucket->ext->cold.l7.proto.ndpi.src = NULL, myBucket->ext->cold.l7.proto.ndpi.dst = NULL;
+    return;
   }
 
-  if(myBucket->core.l7.proto.ndpi.src) {
-    free(myBucket->core.l7.proto.ndpi.src);
-    myBucket->core.l7.proto.ndpi.src = NULL;
+  if(myBucket->ext->cold.l7.proto.ndpi.flow) {
+    free(myBucket->ext->cold.l7.proto.ndpi.flow);
+    myBucket->ext->cold.l7.proto.ndpi.flow = NULL;
   }
 
-  if(myBucket->core.l7.proto.ndpi.dst) {
-    free(myBucket->core.l7.proto.ndpi.dst);
-    myBucket->core.l7.proto.ndpi.dst = NULL;
+  if(myBucket->ext->cold.l7.proto.ndpi.src) {
+    free(myBucket->ext->cold.l7.proto.ndpi.src);
+    myBucket->ext->cold.l7.proto.ndpi.src = NULL;
+  }
+
+  if(myBucket->ext->cold.l7.proto.ndpi.dst) {
+    free(myBucket->ext->cold.l7.proto.ndpi.dst);
+    myBucket->ext->cold.l7.proto.ndpi.dst = NULL;
   }
 }
 
@@ -48,14 +58,31 @@ void freenDPI(FlowHashBucket *myBucket) {
 void allocateFlowHash(int thread_id) {
   u_int mallocSize = sizeof(FlowHashBucket*)*readOnlyGlobals.flowHashSize;
 
-  readWriteGlobals->theFlowHash[thread_id] = (FlowHashBucket**)calloc(1, mallocSize);
-  if(readWriteGlobals->theFlowHash[thread_id] == NULL) {
-    traceEvent(TRACE_ERROR, "Not enough memory");
-    exit(-1);
+  if(readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED) {
+    u_int64_t num_flows = readOnlyGlobals.maxNumActiveFlows;
+
+    if((num_flows == 0) || (num_flows == (u_int)-1))
+      num_flows = (u_int64_t)readOnlyGlobals.flowHashSize * 4;
+
+    /* Leave room for unbalanced threads as -M is a global limit */
+    if(readOnlyGlobals.numProcessThreads > 1)
+      num_flows = (2 * num_flows) / readOnlyGlobals.numProcessThreads;
+
+    if(num_flows < readOnlyGlobals.flowHashSize) num_flows = readOnlyGlobals.flowHashSize;
+
+    if(allocFlowTable(&readWriteGlobals->flowTable[thread_id], (u_int32_t)min(num_flows, 0x7FFFFFFF)) != 0) {
+      traceEvent(TRACE_ERROR, "Not enough memory");
+      exit(-1);
+    }
+  } else {
+    readWriteGlobals->theFlowHash[thread_id] = (FlowHashBucket**)calloc(1, mallocSize);
+    if(readWriteGlobals->theFlowHash[thread_id] == NULL) {
+      traceEvent(TRACE_ERROR, "Not enough memory");
+      exit(-1);
+    }
   }
 
-  readWriteGlobals->expireFlowListHead[thread_id] = NULL, readWriteGlobals->expireFlowListTail[thread_id] = NULL;
-  readWriteGlobals->idleFlowListHead[thread_id] = NULL, readWriteGlobals->idleFlowListTail[thread_id] = NULL;
+  initFlowTimerWheel(&readWriteGlobals->flowTimers[thread_id]);
 }
 
 /* ****************************** */
@@ -181,10 +208,10 @@ char* formatPackets(float numPkts, char *buf) {
 */
 u_int64_t getLRUCacheKey(FlowHashBucket *bkt) {
   u_int64_t key =
-    (bkt->core.tuple.flow_hash /* << 32 */)
-    + (bkt->core.tuple.key.k.ipKey.proto << 24)
-    + (bkt->core.tuple.key.vlanId << 16)
-    + (bkt->core.tuple.key.k.ipKey.sport * bkt->core.tuple.key.k.ipKey.dport);
+    (bkt->core.flow_hash /* << 32 */)
+    + (bkt->ext->tuple.key.k.ipKey.proto << 24)
+    + (bkt->ext->tuple.key.vlanId << 16)
+    + (bkt->ext->tuple.key.k.ipKey.sport * bkt->ext->tuple.key.k.ipKey.dport);
 
   return(key);
 }
@@ -193,9 +220,9 @@ u_int64_t getLRUCacheKey(FlowHashBucket *bkt) {
 
 void setnDPIProto(FlowHashBucket *bkt, u_int16_t proto_id) {
   if(proto_id != NDPI_PROTOCOL_UNKNOWN) {
-    bkt->core.l7.proto.ndpi.ndpi_proto = proto_id,
-      bkt->core.l7.proto_type = NDPI_PROTO_TYPE,
-      bkt->core.l7.proto.ndpi.detection_completed = 1;
+    bkt->ext->cold.l7.proto.ndpi.ndpi_proto = proto_id,
+      bkt->ext->cold.l7.proto_type = NDPI_PROTO_TYPE,
+      bkt->ext->cold.l7.proto.ndpi.detection_completed = 1;
 
     if(!readOnlyGlobals.enableL7BridgePlugin)
       freenDPI(bkt);
@@ -210,30 +237,30 @@ void setPayload(FlowHashBucket *bkt,
 		const struct pcap_pkthdr *h, u_char *p,
 		u_int16_t ip_offset, u_char *payload,
 		int payloadLen, FlowDirection direction) {
-  if(bkt->core.l7.proto.ndpi.detection_completed
+  if(bkt->ext->cold.l7.proto.ndpi.detection_completed
      || (!readOnlyGlobals.enable_l7_protocol_discovery)
-     || (bkt->core.l7.proto_type != NO_PROTO_TYPE)
-     || (bkt->core.l7.proto.ndpi.ndpi_proto != NDPI_PROTOCOL_UNKNOWN))
+     || (bkt->ext->cold.l7.proto_type != NO_PROTO_TYPE)
+     || (bkt->ext->cold.l7.proto.ndpi.ndpi_proto != NDPI_PROTOCOL_UNKNOWN))
     return;
 
   /* Initial bytes only please */
-  if((bkt->core.tuple.flowCounters.pktSent < MAX_PKTS)
-     && (bkt->core.tuple.flowCounters.pktRcvd < MAX_PKTS)) {
+  if((bkt->core.flowCounters.pktSent < MAX_PKTS)
+     && (bkt->core.flowCounters.pktRcvd < MAX_PKTS)) {
     u_int16_t ndpi_proto;
 
-    if(!bkt->core.l7.proto.ndpi.searched_port_based_protocol) {
+    if(!bkt->ext->cold.l7.proto.ndpi.searched_port_based_protocol) {
       ndpi_proto = ndpi_find_port_based_protocol(readOnlyGlobals.l7.l7handler,
-						 bkt->core.tuple.key.k.ipKey.proto,
-						 bkt->core.tuple.key.k.ipKey.src.ipType.ipv4,
-						 bkt->core.tuple.key.k.ipKey.sport,
-						 bkt->core.tuple.key.k.ipKey.dst.ipType.ipv4,
-						 bkt->core.tuple.key.k.ipKey.dport);
+						 bkt->ext->tuple.key.k.ipKey.proto,
+						 bkt->ext->tuple.key.k.ipKey.src.ipType.ipv4,
+						 bkt->ext->tuple.key.k.ipKey.sport,
+						 bkt->ext->tuple.key.k.ipKey.dst.ipType.ipv4,
+						 bkt->ext->tuple.key.k.ipKey.dport);
       setnDPIProto(bkt, ndpi_proto);
-      bkt->core.l7.proto.ndpi.searched_port_based_protocol = 1;
+      bkt->ext->cold.l7.proto.ndpi.searched_port_based_protocol = 1;
     }
 
-    if((bkt->core.l7.proto.ndpi.ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
-       && bkt->core.l7.proto.ndpi.flow) {
+    if((bkt->ext->cold.l7.proto.ndpi.ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
+       && bkt->ext->cold.l7.proto.ndpi.flow) {
       u_int64_t when = ((u_int64_t) h->ts.tv_sec) * 1000 /* detection_tick_resolution */
 	+ h->ts.tv_usec / 1000 /* (1000000 / detection_tick_resolution) */;
 
@@ -241,16 +268,16 @@ void setPayload(FlowHashBucket *bkt,
 	 h->caplen, h->len, ip_offset, payloadLen, h->caplen-ip_offset);
       */
       ndpi_proto = ndpi_detection_process_packet(readOnlyGlobals.l7.l7handler,
-						 bkt->core.l7.proto.ndpi.flow,
+						 bkt->ext->cold.l7.proto.ndpi.flow,
 						 (u_int8_t *)&p[ip_offset],
 						 h->caplen-ip_offset, when,
-						 bkt->core.l7.proto.ndpi.src,
-						 bkt->core.l7.proto.ndpi.dst);
+						 bkt->ext->cold.l7.proto.ndpi.src,
+						 bkt->ext->cold.l7.proto.ndpi.dst);
 
       setnDPIProto(bkt, ndpi_proto);
     }
   } else {
-    bkt->core.l7.proto.ndpi.detection_completed = 1, bkt->core.l7.proto_type = NDPI_PROTO_TYPE;
+    bkt->ext->cold.l7.proto.ndpi.detection_completed = 1, bkt->ext->cold.l7.proto_type = NDPI_PROTO_TYPE;
     freenDPI(bkt);
   }
 }
@@ -375,17 +402,17 @@ static void updatePktLenStats(FlowHashBucket *bkt, FlowDirection direction,
     else ttl->num_pkts_224_255 += numPkts;
 
     if(direction == src2dst_direction) {
-      if(bkt->core.tuple.flowTimers.lastSeenSent.tv_sec == 0) {
+      if(bkt->ext->tuple.flowTimers.lastSeenSent.tv_sec == 0) {
 	// diff = 0;
     } else {
-	timeval_diff(&bkt->core.tuple.flowTimers.lastSeenSent, when, &delta, 0);
+	timeval_diff(&bkt->ext->tuple.flowTimers.lastSeenSent, when, &delta, 0);
 	// diff = toMs(&delta);
       }
     } else {
-      if(bkt->core.tuple.flowTimers.lastSeenRcvd.tv_sec == 0) {
+      if(bkt->ext->tuple.flowTimers.lastSeenRcvd.tv_sec == 0) {
 	// diff = 0;
       } else {
-	timeval_diff(&bkt->core.tuple.flowTimers.lastSeenRcvd, when, &delta, 0);
+	timeval_diff(&bkt->ext->tuple.flowTimers.lastSeenRcvd, when, &delta, 0);
 	// diff = toMs(&delta);
       }
     }
@@ -420,9 +447,9 @@ static void updateTTL(FlowHashBucket *bkt, FlowDirection direction, u_int8_t ttl
 
 static void updateTos(FlowHashBucket *bkt, FlowDirection direction, u_int8_t tos) {
   if(direction == src2dst_direction)
-    bkt->ext->src2dstTos |= tos;
+    bkt->core.src2dstTos |= tos;
   else
-    bkt->ext->dst2srcTos |= tos;
+    bkt->core.dst2srcTos |= tos;
 }
 
 /* ****************************************************** */
@@ -508,11 +535,11 @@ static u_int8_t updateTcpSeq(struct timeval *when,
 	  && ((bkt->ext->extensions->clientNwLatency.tv_sec == 0) && (bkt->ext->extensions->clientNwLatency.tv_usec == 0))) {
 	 /* This is what we waited for */
 
-	 msLatency = toMs(when) - toMs(&bkt->core.tuple.flowTimers.lastSeenRcvd);
+	 msLatency = toMs(when) - toMs(&bkt->ext->tuple.flowTimers.lastSeenRcvd);
 	 lastLatency = toMs(&bkt->ext->extensions->clientNwLatency);
 
 	 if((msLatency < lastLatency) || (lastLatency == 0)) {
-	   timeval_diff(&bkt->core.tuple.flowTimers.lastSeenRcvd, when, &bkt->ext->extensions->clientNwLatency, 1);
+	   timeval_diff(&bkt->ext->tuple.flowTimers.lastSeenRcvd, when, &bkt->ext->extensions->clientNwLatency, 1);
 
 	   if(0)
 	     traceEvent(TRACE_NORMAL, "Recomputed client latency [Client: %.2f ms]",
@@ -524,11 +551,11 @@ static u_int8_t updateTcpSeq(struct timeval *when,
 	  && (bkt->ext->extensions->tcpseq.src2dst.next == tcpAckNum)
 	  && ((bkt->ext->extensions->serverNwLatency.tv_sec == 0) && (bkt->ext->extensions->serverNwLatency.tv_usec == 0))) {
 	 /* This is what we waited for */
-	 msLatency = toMs(when) - toMs(&bkt->core.tuple.flowTimers.lastSeenSent);
+	 msLatency = toMs(when) - toMs(&bkt->ext->tuple.flowTimers.lastSeenSent);
 	 lastLatency = toMs(&bkt->ext->extensions->serverNwLatency);
 
 	 if((msLatency < lastLatency) || (lastLatency == 0)) {
-	   timeval_diff(&bkt->core.tuple.flowTimers.lastSeenSent, when, &bkt->ext->extensions->serverNwLatency, 1);
+	   timeval_diff(&bkt->ext->tuple.flowTimers.lastSeenSent, when, &bkt->ext->extensions->serverNwLatency, 1);
 
 	   if(0)
 	     traceEvent(TRACE_NORMAL, "Recomputed server latency [Server: %.2f ms]",
@@ -733,22 +760,90 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 
  /* ****************************************************** */
 
- u_int32_t get_flow_serial() {
-   if(unlikely(readOnlyGlobals.useLocks)) {
-     u_int32_t serial;
+ /*
+   Flow serials are handed out in blocks of FLOW_SERIAL_BLOCK: each export
+   worker touches the shared counter once per block, and the serials it
+   assigns are unique and increasing. 0 means no serial and is skipped.
+   The export workers run concurrently regardless of useLocks, so the
+   counter is always updated atomically.
+ */
+ static u_int32_t claimFlowSerials(u_int32_t num) {
+   u_int32_t serial;
 
  #ifdef HAVE_BUILTIN_ATOMIC
-     serial = __sync_add_and_fetch(&readWriteGlobals->flow_serial, 1);
+   serial = __sync_fetch_and_add(&readWriteGlobals->flow_serial, num);
  #else
-     pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-     serial = readWriteGlobals->flow_serial;
-     readWriteGlobals->flow_serial++;
-     pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
+   pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
+   serial = readWriteGlobals->flow_serial;
+   readWriteGlobals->flow_serial += num;
+   pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
  #endif
 
-     return(serial);
-   } else
-     return(readWriteGlobals->flow_serial++);
+   return(serial);
+ }
+
+ /* ****************************************************** */
+
+ /*
+   Blocks are not aligned (get_flow_serial() claims single serials), so
+   the counter can wrap anywhere in a block: 0 is checked on every serial.
+ */
+ u_int32_t getFlowSerial(FlowSerialBlock *block) {
+   u_int32_t serial;
+
+   do {
+     if(unlikely(block->next == block->end)) {
+       block->next = claimFlowSerials(FLOW_SERIAL_BLOCK);
+       block->end = block->next + FLOW_SERIAL_BLOCK; /* Wraps along with next */
+     }
+
+     serial = block->next++;
+   } while(unlikely(serial == 0));
+
+   return(serial);
+ }
+
+ /* ****************************************************** */
+
+ /* Flows encoded outside exportBucket() */
+ u_int32_t get_flow_serial() {
+   u_int32_t serial = claimFlowSerials(1);
+
+   return((serial == 0) ? claimFlowSerials(1) : serial);
+ }
+
+ /* ****************************************************** */
+
+ /* Buckets allocated and not yet purged, summed over the processing threads */
+ u_int32_t getNumActiveBuckets(void) {
+   u_int32_t i, num = 0;
+
+   for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+     ThreadStats *s = &readWriteGlobals->threadStats[i];
+     u_int32_t purged = getAtomic(&s->bucketsPurged); /* Read first: it never gets ahead of bucketsAllocated */
+
+     num += s->bucketsAllocated - purged;
+   }
+
+   return(num);
+ }
+
+ /* ****************************************************** */
+
+ /*
+   -M check on flow creation. The sum over the threads reads the counters
+   of all of them, so it is recomputed every ACTIVE_BUCKETS_REFRESH new
+   flows or when the estimate (that ignores purges) reaches the limit.
+ */
+ static __inline__ int tooManyActiveFlows(u_short thread_id) {
+   ThreadStats *s = &readWriteGlobals->threadStats[thread_id];
+
+   if((s->allocsSinceSnapshot < ACTIVE_BUCKETS_REFRESH)
+      && ((s->activeBucketsSnapshot + s->allocsSinceSnapshot) < readOnlyGlobals.maxNumActiveFlows))
+     return(0);
+
+   s->activeBucketsSnapshot = getNumActiveBuckets(), s->allocsSinceSnapshot = 0;
+   return((s->activeBucketsSnapshot >= readOnlyGlobals.maxNumActiveFlows) ? 1 : 0);
  }
 
  /* ****************************************************** */
@@ -761,7 +856,9 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 
    if(unlikely(readOnlyGlobals.tracePerformance)) when = getticks();
 
-   bkt = (FlowHashBucket*)calloc(1, sizeof(FlowHashBucket));
+   /* Co-located bucket+ext+extensions+nDPI block from the thread pool, heap otherwise */
+   if((bkt = poolAllocBucket(thread_id)) == NULL)
+     bkt = allocAlignedBucket();
 
    if(bkt == NULL)
      goto bkt_failure;
@@ -769,31 +866,38 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
    if(unlikely(readOnlyGlobals.tracePerformance)) {
      ticks diff = getticks() - when;
 
-     if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-     readOnlyGlobals.bucketMallocTicks += diff, readOnlyGlobals.num_malloced_buckets++;
-     if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
+     readWriteGlobals->threadStats[thread_id].perf.bucketMallocTicks += diff;
+     readWriteGlobals->threadStats[thread_id].perf.num_malloced_buckets++;
    }
 
+   if((bkt->ext != NULL) && (bkt->ext->pool_id != 0)) {
+     if(readOnlyGlobals.enable_l7_protocol_discovery)
+       bkt->ext->cold.l7.proto.ndpi.ndpi_proto = NDPI_PROTOCOL_UNKNOWN;
+
+     goto bkt_ready;
+   }
+
+   /* The cold part (nDPI included) lives in ext: allocate it first */
+   bkt->ext = (FlowHashExtendedBucket*)calloc(1, sizeof(FlowHashExtendedBucket));
+
+   if(bkt->ext == NULL)
+     goto bkt_failure;
+
    if(readOnlyGlobals.enable_l7_protocol_discovery) {
      // printf("--->>> %u\n", readOnlyGlobals.l7.proto.ndpi.flow_struct_size+2*readOnlyGlobals.l7.proto.ndpi.proto_size);
 
-     if((bkt->core.l7.proto.ndpi.flow = calloc(1, readOnlyGlobals.l7.flow_struct_size)) == NULL)
+     if((bkt->ext->cold.l7.proto.ndpi.flow = calloc(1, readOnlyGlobals.l7.flow_struct_size)) == NULL)
        goto bkt_failure;
 
-     bkt->core.l7.proto.ndpi.src = malloc(readOnlyGlobals.l7.proto_size);
-     bkt->core.l7.proto.ndpi.dst = malloc(readOnlyGlobals.l7.proto_size);
+     bkt->ext->cold.l7.proto.ndpi.src = malloc(readOnlyGlobals.l7.proto_size);
+     bkt->ext->cold.l7.proto.ndpi.dst = malloc(readOnlyGlobals.l7.proto_size);
 
-     if((bkt->core.l7.proto.ndpi.src == NULL) || (bkt->core.l7.proto.ndpi.dst == NULL))
+     if((bkt->ext->cold.l7.proto.ndpi.src == NULL) || (bkt->ext->cold.l7.proto.ndpi.dst == NULL))
        goto bkt_failure;
 
-     bkt->core.l7.proto.ndpi.ndpi_proto = NDPI_PROTOCOL_UNKNOWN;
+     bkt->ext->cold.l7.proto.ndpi.ndpi_proto = NDPI_PROTOCOL_UNKNOWN;
    }
 
-   bkt->ext = (FlowHashExtendedBucket*)calloc(1, sizeof(FlowHashExtendedBucket));
-
-   if(bkt->ext == NULL)
-     goto bkt_failure;
-
    if(readOnlyGlobals.enableExtBucket) {
      bkt->ext->extensions = (FlowHashBucketExtensions*)calloc(1, sizeof(FlowHashBucketExtensions));
 
@@ -801,67 +905,33 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
        goto bkt_failure;
    }
 
+  bkt_ready:
    if(bkt->ext)
      bkt->ext->thread_id = thread_id;
 
  #if 0
-   if(readWriteGlobals->exportBucketsLen < 16)
-     traceEvent(TRACE_NORMAL, "[+] bucketsAllocated=%u",
-		readWriteGlobals->bucketsAllocated);
+   if(getExportQueueLen() < 16)
+     traceEvent(TRACE_NORMAL, "[+] bucketsAllocated=%u", getNumActiveBuckets());
  #endif
 
-   bkt->core.tuple.flow_serial = 0;
-
-   if(proto == 1)       readWriteGlobals->accumulateStats[thread_id].icmpFlows++;
-   else if(proto == 6)  readWriteGlobals->accumulateStats[thread_id].tcpFlows++;
-   else if(proto == 17) readWriteGlobals->accumulateStats[thread_id].udpFlows++;
-
-   bkt->magic = MAGIC_NUMBER;
-
-   if(unlikely(readOnlyGlobals.tracePerformance)) {
-     ticks diff = getticks() - when;
+   bkt->ext->tuple.flow_serial = 0;
 
-     if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-     readOnlyGlobals.bucketAllocationTicks += diff, readOnlyGlobals.num_allocated_buckets++;
-     if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
-   }
+   if(proto == 1)       readWriteGlobals->threadStats[thread_id].stats.icmpFlows++;
+   else if(proto == 6)  readWriteGlobals->threadStats[thread_id].stats.tcpFlows++;
+   else if(proto == 17) readWriteGlobals->threadStats[thread_id].stats.udpFlows++;
 
-   if(unlikely(readOnlyGlobals.useLocks))
-     pthread_rwlock_wrlock(&readWriteGlobals->expireListLock);
-
-   if(readWriteGlobals->expireFlowListHead[thread_id] == NULL) {
-     /* The only entry of the list */
-     readWriteGlobals->expireFlowListHead[thread_id] = readWriteGlobals->expireFlowListTail[thread_id] = bkt;
-   } else {
-     /* The list is already populated: append at the end */
-     readWriteGlobals->expireFlowListTail[thread_id]->core.max_duration.next = bkt;
-     bkt->core.max_duration.prev = readWriteGlobals->expireFlowListTail[thread_id];
-     readWriteGlobals->expireFlowListTail[thread_id] = bkt;
-   }
-
-   /* Append it to the idle flow list */
-   if(readWriteGlobals->idleFlowListHead[thread_id] == NULL) {
-     /* The only entry of the list */
-     readWriteGlobals->idleFlowListHead[thread_id] = readWriteGlobals->idleFlowListTail[thread_id] = bkt;
-   } else {
-     /* The list is already populated: append */
-     readWriteGlobals->idleFlowListTail[thread_id]->core.no_traffic.next = bkt;
-     bkt->core.no_traffic.prev = readWriteGlobals->idleFlowListTail[thread_id];
-     readWriteGlobals->idleFlowListTail[thread_id] = bkt;
-   }
-
-   if(unlikely(readOnlyGlobals.useLocks))
-     pthread_rwlock_unlock(&readWriteGlobals->expireListLock);
+   bkt->core.magic = MAGIC_NUMBER;
+   bkt->ext->timer_slot = FLOW_TIMER_NOT_ARMED; /* Armed by the caller once the flow is set up */
 
    if(unlikely(readOnlyGlobals.tracePerformance)) {
      ticks diff = getticks() - when;
 
-     if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-     readOnlyGlobals.bucketAllocationTicks += diff, readOnlyGlobals.num_allocated_buckets++;
-     if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
+     readWriteGlobals->threadStats[thread_id].perf.bucketAllocationTicks += diff;
+     readWriteGlobals->threadStats[thread_id].perf.num_allocated_buckets++;
    }
 
-   incAtomic(&readWriteGlobals->bucketsAllocated, 1);
+   readWriteGlobals->threadStats[thread_id].bucketsAllocated++;
+   readWriteGlobals->threadStats[thread_id].allocsSinceSnapshot++;
 
    /* This is the return point in case of succefull allocation */
    return(bkt);
@@ -872,7 +942,7 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
      once = 1;
    }
 
-   purgeBucket(bkt);
+   if(bkt != NULL) purgeBucket(bkt);
    return(NULL);
  }
 
@@ -1092,206 +1162,326 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 
  /* ******************************************************** */
 
- /* We put the bucket as first on the idle list */
- void tellProbeToExportFlow(u_int32_t thread_id, FlowHashBucket *myBucket) {
-   if(readWriteGlobals->idleFlowListHead[thread_id] == myBucket) {
-     /* 1st Element of the list: nothing to do we just have to wait */
-   } else if(readWriteGlobals->idleFlowListTail[thread_id] == myBucket) {
-     /* Last element of the list */
-
-     /* 1 - Remove me from list */
-     readWriteGlobals->idleFlowListTail[thread_id] = myBucket->core.no_traffic.prev;
-     readWriteGlobals->idleFlowListTail[thread_id]->core.no_traffic.next = NULL;
-
-     /* 2 - Place me at the head of the list */
-     readWriteGlobals->idleFlowListHead[thread_id]->core.no_traffic.prev = myBucket;
-     myBucket->core.no_traffic.prev = NULL, myBucket->core.no_traffic.next = readWriteGlobals->idleFlowListHead[thread_id];
-     readWriteGlobals->idleFlowListHead[thread_id] = myBucket;
-   } else {
-     /* Middle */
+ /*
+   The helpers below hide whether the flows of a thread are kept on
+   theFlowHash[] collision lists or on the grouped flow table. With the
+   flow table idx is not used: candidates are selected by fingerprint.
+ */
+ static __inline__ FlowHashBucket* firstHashBucket(u_short thread_id, u_int32_t idx,
+						   u_int32_t fingerprint, FlowTableIterator *it) {
+   if(readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED)
+     return(flowTableFirstMatch(&readWriteGlobals->flowTable[thread_id], fingerprint, it));
+   else
+     return(readWriteGlobals->theFlowHash[thread_id][idx]);
+ }
+
+ /* ******************************************************** */
+
+ static __inline__ FlowHashBucket* nextHashBucket(FlowHashBucket *bkt, FlowTableIterator *it) {
+   if(readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED)
+     return(flowTableNextMatch(it));
+   else
+     return(bkt->core.hash_next);
+ }
+
+ /* ******************************************************** */
+
+ #ifdef __GNUC__
+ #define prefetchRead(addr)  __builtin_prefetch((addr), 0, 3)
+ #define prefetchWrite(addr) __builtin_prefetch((addr), 1, 3)
+ #else
+ #define prefetchRead(addr)
+ #define prefetchWrite(addr)
+ #endif
+
+ /*
+   Batched decoding (decodePacketBatch()): the first pass prefetches the
+   hash slot of each packet, the second one the first bucket found there,
+   so that processFlowPacket() finds both in cache. packet_hash is only a
+   hint: nothing is read past the slot, and a wrong guess costs a wasted
+   prefetch.
+ */
+ void prefetchFlowHashSlot(u_short thread_id, u_int32_t packet_hash) {
+   if(readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED) {
+     FlowTable *table = &readWriteGlobals->flowTable[thread_id];
+
+     prefetchRead(&table->groups[flowTableHomeGroup(table, packet_hash)]);
+   } else
+     prefetchRead(&readWriteGlobals->theFlowHash[thread_id][packet_hash % readOnlyGlobals.flowHashSize]);
+ }
+
+ /* ******************************************************** */
+
+ void prefetchFlowBucket(u_short thread_id, u_int32_t packet_hash) {
+   FlowHashBucket *bkt;
 
-     /* 1 - Remove me from list */
-     (myBucket->core.no_traffic.prev)->core.no_traffic.next = myBucket->core.no_traffic.next;
-     (myBucket->core.no_traffic.next)->core.no_traffic.prev = myBucket->core.no_traffic.prev;
+   if(readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED) {
+     FlowTable *table = &readWriteGlobals->flowTable[thread_id];
+     FlowTableGroup *group = &table->groups[flowTableHomeGroup(table, packet_hash)];
+     u_int32_t matches = flowTableGroupMatch(group, packet_hash);
 
-     /* 2 - Place me at the head of the list */
-     readWriteGlobals->idleFlowListHead[thread_id]->core.no_traffic.prev = myBucket;
-     myBucket->core.no_traffic.prev = NULL, myBucket->core.no_traffic.next = readWriteGlobals->idleFlowListHead[thread_id];
-     readWriteGlobals->idleFlowListHead[thread_id] = myBucket;
+     if(matches == 0) return;
+     bkt = group->bkt[flowTableFirstSlot(matches)];
+   } else
+     bkt = readWriteGlobals->theFlowHash[thread_id][packet_hash % readOnlyGlobals.flowHashSize];
+
+   if(bkt != NULL) {
+     /*
+       The lookup key and the per packet counters are in the single bucket
+       line, the per packet timestamps in ext->tuple. Reading bkt->ext waits
+       for the bucket line, but the loads of the batch still overlap.
+     */
+     prefetchWrite(bkt);
+     prefetchWrite(&bkt->ext->tuple.flowTimers);
    }
  }
 
  /* ******************************************************** */
 
- static void walkHashList(u_int32_t thread_id, int flushHash, time_t now) {
-   FlowHashBucket *myBucket, *myNextBucket;
-   u_int num_exported, num_runs;
+ static void addHashBucket(u_short thread_id, u_int32_t idx,
+			   u_int32_t fingerprint, FlowHashBucket *bkt) {
+   if(readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED) {
+     if(flowTableAdd(&readWriteGlobals->flowTable[thread_id], fingerprint, bkt) != 0)
+       setBucketExpired(bkt); /* Not searchable: export it as soon as possible */
+   } else
+     addToList(bkt, &readWriteGlobals->theFlowHash[thread_id][idx]);
+ }
 
-   num_exported = 0, num_runs = 0;
+ /* ******************************************************** */
 
-   /*
-     NOTE
+ static void removeHashBucket(u_int32_t thread_id, FlowHashBucket *myBucket) {
+   if(readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED) {
+     flowTableRemove(&readWriteGlobals->flowTable[thread_id], myBucket);
+     return;
+   }
 
-     We do not need to call hash_lock() as we are called
-     by the worker thread either when it is idle or when it
-     has processed a packet. So when we're called nobody else is
-     disturbing us
-   */
+   if(readWriteGlobals->theFlowHash[thread_id][myBucket->ext->tuple.flow_idx] == NULL) {
+     traceEvent(TRACE_WARNING, "Internal error: NULL head for index %u [thread_id: %u]",
+		myBucket->ext->tuple.flow_idx, thread_id);
+   } else if(readWriteGlobals->theFlowHash[thread_id][myBucket->ext->tuple.flow_idx] == myBucket) {
+     /* 1st Element of the list */
+     readWriteGlobals->theFlowHash[thread_id][myBucket->ext->tuple.flow_idx] = myBucket->core.hash_next;
+     if(readWriteGlobals->theFlowHash[thread_id][myBucket->ext->tuple.flow_idx] != NULL)
+       readWriteGlobals->theFlowHash[thread_id][myBucket->ext->tuple.flow_idx]->ext->hash_prev = NULL;
+   } else {
+     /* Middle or last */
+     (myBucket->ext->hash_prev)->core.hash_next = myBucket->core.hash_next;
+     if(myBucket->core.hash_next != NULL) /* We are not the last element */
+       (myBucket->core.hash_next)->ext->hash_prev = myBucket->ext->hash_prev;
+   }
+ }
 
-   for(num_runs = 0; num_runs < 2; num_runs++) {
-     if(num_runs == 0)
-       myBucket = readWriteGlobals->expireFlowListHead[thread_id];
-     else {
-       if(flushHash) break;
-       myBucket = readWriteGlobals->idleFlowListHead[thread_id];
+ /* ******************************************************** */
+
+ /* The grouped flow table has a fixed capacity */
+ static __inline__ u_int8_t isHashFull(u_short thread_id) {
+   return(((readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED)
+	   && (readWriteGlobals->flowTable[thread_id].num_entries
+	       >= readWriteGlobals->flowTable[thread_id].max_entries)) ? 1 : 0);
+ }
+
+ /* ******************************************************** */
+
+ /* The grouped flow table is not partitioned by idx: one lock per thread */
+ static __inline__ u_int32_t getHashMutexIdx(u_int32_t idx) {
+   return((readOnlyGlobals.flowTableMode == FLOW_TABLE_GROUPED) ? 0 : (idx % MAX_HASH_MUTEXES));
+ }
+
+ /* ******************************************************** */
+
+ /* Timer wheel clock (msec): packet time when reading a pcap file, wall clock otherwise */
+ static __inline__ u_int64_t flowTimerNow(void) {
+   if(readOnlyGlobals.pcapFile != NULL)
+     return((u_int64_t)readWriteGlobals->now * 1000);
+   else
+     return(coarseMsec());
+ }
+
+ /* ******************************************************** */
+
+ static __inline__ u_int8_t isTcpFlowClosed(FlowHashBucket *bkt) {
+   return(((bkt->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP)
+	   && endTcpFlow(bkt->ext->protoCounters.tcp.src2dstTcpFlags)
+	   && endTcpFlow(bkt->ext->protoCounters.tcp.dst2srcTcpFlags)) ? 1 : 0);
+ }
+
+ /* ******************************************************** */
+
+ /* Earliest time (msec) the flow expires: same conditions as isFlowExpired() */
+ static u_int64_t getFlowDeadline(FlowHashBucket *bkt, u_int64_t now) {
+   u_int64_t idle = (u_int64_t)readOnlyGlobals.idleTimeout * 1000;
+   u_int64_t lifetime = (u_int64_t)readOnlyGlobals.lifetimeTimeout * 1000;
+   u_int64_t deadline, t;
+
+   if(bkt->core.bucket_expired) return(now);
+
+   deadline = to_msec(&bkt->ext->tuple.flowTimers.lastSeenSent) + idle;
+
+   if(!bkt->ext->tuple.do_not_expire_for_max_duration) {
+     t = to_msec(&bkt->ext->tuple.flowTimers.firstSeenSent) + lifetime;
+     if(t < deadline) deadline = t;
+   }
+
+   if(bkt->core.flowCounters.pktRcvd > 0) {
+     t = to_msec(&bkt->ext->tuple.flowTimers.lastSeenRcvd) + idle;
+     if(t < deadline) deadline = t;
+
+     if(!bkt->ext->tuple.do_not_expire_for_max_duration) {
+       t = to_msec(&bkt->ext->tuple.flowTimers.firstSeenRcvd) + lifetime;
+       if(t < deadline) deadline = t;
      }
+   }
 
-     if(unlikely(readOnlyGlobals.useLocks))
-       pthread_rwlock_wrlock(&readWriteGlobals->expireListLock);
-
-     while(myBucket != NULL) {
-       myNextBucket = (num_runs == 0) ? myBucket->core.max_duration.next : myBucket->core.no_traffic.next;
-
-       /* Flush buckets marked during the previous cycle */
-       if(myBucket->core.purge_at_next_loop || flushHash) {
-	 /*
-	   We've updated the pointers, hence removed this bucket from the active bucket list,
-	   therefore we now invalidate the next pointer
-	 */
-	 /* 1 - Remove from hash */
-	 if(readWriteGlobals->theFlowHash[thread_id][myBucket->core.tuple.flow_idx] == NULL) {
-	   traceEvent(TRACE_WARNING, "Internal error: NULL head for index %u [num_runs: %u][thread_id: %u]",
-		      myBucket->core.tuple.flow_idx, num_runs, thread_id);
-	 } else if(readWriteGlobals->theFlowHash[thread_id][myBucket->core.tuple.flow_idx] == myBucket) {
-	   /* 1st Element of the list */
-	   readWriteGlobals->theFlowHash[thread_id][myBucket->core.tuple.flow_idx] = myBucket->core.hash.next;
-	   if(readWriteGlobals->theFlowHash[thread_id][myBucket->core.tuple.flow_idx] != NULL)
-	     readWriteGlobals->theFlowHash[thread_id][myBucket->core.tuple.flow_idx]->core.hash.prev = NULL;
-	 } else {
-	   /* Middle or last */
-	   (myBucket->core.hash.prev)->core.hash.next = myBucket->core.hash.next;
-	   if(myBucket->core.hash.next != NULL) /* We are not the last element */
-	     (myBucket->core.hash.next)->core.hash.prev = myBucket->core.hash.prev;
-	 }
+   /* Both sides sent a FIN: the flow is over once it has been quiet for a while */
+   if(isTcpFlowClosed(bkt)) {
+     t = to_msec(&bkt->ext->tuple.flowTimers.lastSeenSent) + FLOW_TIMER_TCP_CLOSE_SEC * 1000;
+     if(t < deadline) deadline = t;
+   }
 
-	 /* 2 - Max Duration */
-	 if(readWriteGlobals->expireFlowListHead[thread_id] == readWriteGlobals->expireFlowListTail[thread_id]) {
-	   /* The list has only one element: me */
-	   if(readWriteGlobals->expireFlowListHead[thread_id] != myBucket) {
-	     traceEvent(TRACE_WARNING, "Internal error: [Head: %p][Tail: %p][myBucket: %p][num_runs: %u][thread_id: %u]",
-			readWriteGlobals->expireFlowListHead[thread_id],
-			readWriteGlobals->expireFlowListTail[thread_id],
-			myBucket, num_runs, thread_id);
-	   }
-	   readWriteGlobals->expireFlowListHead[thread_id] = readWriteGlobals->expireFlowListTail[thread_id] = NULL;
-	 } else if(readWriteGlobals->expireFlowListHead[thread_id] == myBucket) {
-	   /* 1st Element of the list and more than one element on the list */
-	   readWriteGlobals->expireFlowListHead[thread_id] = myBucket->core.max_duration.next;
-	   readWriteGlobals->expireFlowListHead[thread_id]->core.max_duration.prev = NULL;
-	 } else if(readWriteGlobals->expireFlowListTail[thread_id] == myBucket) {
-	   /* Last element of the list */
-	   readWriteGlobals->expireFlowListTail[thread_id] = myBucket->core.max_duration.prev;
-	   readWriteGlobals->expireFlowListTail[thread_id]->core.max_duration.next = NULL;
-	 } else {
-	   /* Middle */
-	   (myBucket->core.max_duration.prev)->core.max_duration.next = myBucket->core.max_duration.next;
-	   (myBucket->core.max_duration.next)->core.max_duration.prev = myBucket->core.max_duration.prev;
-	 }
+   return(deadline);
+ }
 
-	 /* 3 - No Traffic */
-	 if(readWriteGlobals->idleFlowListHead[thread_id] == readWriteGlobals->idleFlowListTail[thread_id]) {
-	   /* The list has only one element: me */
-	   if(readWriteGlobals->idleFlowListHead[thread_id] != myBucket) {
-	     traceEvent(TRACE_WARNING, "Internal error: [Head: %p][Tail: %p][myBucket: %p][num_runs: %u]",
-			readWriteGlobals->idleFlowListHead[thread_id],
-			readWriteGlobals->idleFlowListTail[thread_id],
-			myBucket, num_runs);
-	   }
-	   readWriteGlobals->idleFlowListHead[thread_id] = readWriteGlobals->idleFlowListTail[thread_id] = NULL;
-	 } else if(readWriteGlobals->idleFlowListHead[thread_id] == myBucket) {
-	   /* 1st Element of the list */
-	   readWriteGlobals->idleFlowListHead[thread_id] = myBucket->core.no_traffic.next;
-	   readWriteGlobals->idleFlowListHead[thread_id]->core.no_traffic.prev = NULL;
-	 } else if(readWriteGlobals->idleFlowListTail[thread_id] == myBucket) {
-	   /* Last element of the list */
-	   readWriteGlobals->idleFlowListTail[thread_id] = myBucket->core.no_traffic.prev;
-	   readWriteGlobals->idleFlowListTail[thread_id]->core.no_traffic.next = NULL;
-	 } else {
-	   /* Middle */
-	   (myBucket->core.no_traffic.prev)->core.no_traffic.next = myBucket->core.no_traffic.next;
-	   (myBucket->core.no_traffic.next)->core.no_traffic.prev = myBucket->core.no_traffic.prev;
-	 }
+ /* ******************************************************** */
 
-	 if(!(myBucket->ext && myBucket->ext->sampled_flow)) {
-	   if(readWriteGlobals->exportBucketsLen < readOnlyGlobals.maxExportQueueLen) {
-	     /*
-	       The flow is both expired and we have room in the export
-	       queue to send it out, hence we can export it
-	     */
-	     queueBucketToExport(myBucket);
-	   } else {
-	     /* The export queue is full:
-
-		The flow is expired and in queue since too long. As there's
-		no room left in queue, the only thing we can do is to
-		drop it
-	     */
-	     discardBucket(myBucket);
-	     readWriteGlobals->probeStats.totFlowDropped++;
-
-	     /*
-	       Too much work to be done: let's decrease the export delay
-	       if this has been set!
-	     */
-	     if(readOnlyGlobals.flowExportDelay > 0)
-	       readOnlyGlobals.flowExportDelay--;
-	   }
-	 } else {
-	   /* Free bucket */
-	   discardBucket(myBucket);
-	 }
+ /* Arms the timer of a new flow: called once the flow has been set up */
+ static void armFlowTimer(u_int32_t thread_id, FlowHashBucket *bkt) {
+   FlowTimerWheel *w = &readWriteGlobals->flowTimers[thread_id];
+   u_int64_t now = flowTimerNow();
 
-	 num_exported++;
+   if(unlikely(readOnlyGlobals.useLocks))
+     pthread_rwlock_wrlock(&w->lock);
 
-	 myBucket = myNextBucket;
-       } else {
-	 u_int8_t bucket_found = 0;
+   if(!w->running) startFlowTimerWheel(w, now);
+   flowTimerAdd(w, bkt, getFlowDeadline(bkt, now));
 
-	 if(flushHash || isFlowExpired(myBucket, now)) {
-	   /* Remove it from bucket list at the next run */
-	   setBucketExpired(myBucket);
-	   myBucket->core.purge_at_next_loop = 1, bucket_found = 1;
-	 }
+   if(unlikely(readOnlyGlobals.useLocks))
+     pthread_rwlock_unlock(&w->lock);
+ }
 
-	 if(flushHash || bucket_found) {
-	   myBucket = myNextBucket;
-	   continue;
-	 } else
-	   break; /* Stop at the first flow thet is not expired */
+ /* ******************************************************** */
+
+ /* The flow is checked (and exported if expired) at the next timer tick */
+ void tellProbeToExportFlow(u_int32_t thread_id, FlowHashBucket *myBucket) {
+   FlowTimerWheel *w = &readWriteGlobals->flowTimers[thread_id];
+
+   if(unlikely(readOnlyGlobals.useLocks))
+     pthread_rwlock_wrlock(&w->lock);
+
+   if(myBucket->ext->timer_slot != FLOW_TIMER_NOT_ARMED)
+     flowTimerAdd(w, myBucket, flowTimerNow());
+
+   if(unlikely(readOnlyGlobals.useLocks))
+     pthread_rwlock_unlock(&w->lock);
+ }
+
+ /* ******************************************************** */
+
+ /*
+   Goes through the buckets whose timer fired. Timers are not moved
+   when packets arrive, so a flow with traffic since it was armed is
+   simply put back on the wheel at its new deadline. Expired flows are
+   removed from the hash and handed to the export threads in batches.
+ */
+ static void expireFlowList(u_int32_t thread_id, FlowHashBucket *due,
+			    u_int64_t now, int flushHash) {
+   FlowTimerWheel *w = &readWriteGlobals->flowTimers[thread_id];
+   FlowHashBucket *batch[FLOW_TIMER_EXPORT_BATCH];
+   u_int32_t num_batch = 0, queue_len = getExportQueueLen();
+
+   while(due != NULL) {
+     FlowHashBucket *myBucket = due;
+
+     due = myBucket->ext->timer.next, myBucket->ext->timer.next = NULL;
+
+     if(!flushHash) {
+       u_int64_t deadline = getFlowDeadline(myBucket, now);
+
+       if(deadline > now) {
+	 flowTimerAdd(w, myBucket, deadline);
+	 w->num_rearmed++;
+	 continue;
        }
-     } /* while */
+     }
 
-     if(unlikely(readOnlyGlobals.useLocks))
-       pthread_rwlock_unlock(&readWriteGlobals->expireListLock);
+     setBucketExpired(myBucket);
+     removeHashBucket(thread_id, myBucket);
+
+     if(myBucket->ext && myBucket->ext->sampled_flow) {
+       /* Free bucket */
+       discardBucket(myBucket);
+     } else if(queue_len < readOnlyGlobals.maxExportQueueLen) {
+       /*
+	 The flow is both expired and we have room in the export
+	 queue to send it out, hence we can export it
+       */
+       batch[num_batch++] = myBucket, queue_len++;
+
+       if(num_batch == FLOW_TIMER_EXPORT_BATCH)
+	 queueBucketsToExport(batch, num_batch), num_batch = 0;
+     } else {
+       /* The export queue is full:
+
+	  The flow is expired and in queue since too long. As there's
+	  no room left in queue, the only thing we can do is to
+	  drop it
+       */
+       discardBucket(myBucket);
+       readWriteGlobals->probeStats.totFlowDropped++;
+
+       /*
+	 Too much work to be done: let's decrease the export delay
+	 if this has been set!
+       */
+       if(readOnlyGlobals.flowExportDelay > 0)
+	 readOnlyGlobals.flowExportDelay--;
+     }
    }
 
-   /* Check idle flows */
+   if(num_batch > 0)
+     queueBucketsToExport(batch, num_batch);
+ }
+
+ /* ******************************************************** */
+
+ static void expireFlowTimers(u_int32_t thread_id, int flushHash) {
+   FlowTimerWheel *w = &readWriteGlobals->flowTimers[thread_id];
+   u_int64_t now = flowTimerNow();
+   FlowHashBucket *due;
 
-   if(num_exported > 0)
-     signalCondvar(&readWriteGlobals->exportQueueCondvar, 0);
+   /* Unlocked peek: nothing to do before the next tick */
+   if((!w->running) || ((!flushHash) && ((int32_t)(flowTimerTick(now) - w->now_tick) < 0)))
+     return;
+
+   /*
+     NOTE
+
+     We do not need to call hash_lock() as we are called
+     by the worker thread either when it is idle or when it
+     has processed a packet. So when we're called nobody else is
+     disturbing us
+   */
+   if(unlikely(readOnlyGlobals.useLocks))
+     pthread_rwlock_wrlock(&w->lock);
+
+   due = flushHash ? flowTimerDetachAll(w) : flowTimerAdvance(w, now);
+   expireFlowList(thread_id, due, now, flushHash);
+
+   if(unlikely(readOnlyGlobals.useLocks))
+     pthread_rwlock_unlock(&w->lock);
  }
 
  /* ****************************************************** */
 
  FlowHashBucket* getHashBucket(u_int32_t packet_hash, u_short thread_id) {
    u_int32_t idx = packet_hash % readOnlyGlobals.flowHashSize;
-   FlowHashBucket *bkt = readWriteGlobals->theFlowHash[thread_id][idx];
+   FlowTableIterator it;
+   FlowHashBucket *bkt = firstHashBucket(thread_id, idx, packet_hash, &it);
 
    while(bkt != NULL) {
-     if((!bkt->core.bucket_expired) && (bkt->core.tuple.flow_hash == packet_hash)) {
+     if((!bkt->core.bucket_expired) && (bkt->core.flow_hash == packet_hash)) {
        return(bkt);
      } else
-       bkt = bkt->core.hash.next;
+       bkt = nextHashBucket(bkt, &it);
    }
 
    return(NULL);
@@ -1299,50 +1489,24 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 
  /* ****************************************************** */
 
+ /*
+   Timers are pushed back lazily when they fire: per packet we only pull
+   the timer in when the flow has to go earlier than it is armed for
+ */
  void checkBucketExpire(FlowHashBucket *bkt, u_short thread_id) {
-   /* Let's move this flow at the end of the idle flow list */
-   if((readWriteGlobals->idleFlowListTail[thread_id] != bkt)
-      /* The list has only one element */
-      && (readWriteGlobals->idleFlowListHead[thread_id] != readWriteGlobals->idleFlowListTail[thread_id])
-      ) {
-     /* We're not the last/first one of the list */
+   if(bkt->core.bucket_expired || isTcpFlowClosed(bkt)) {
+     FlowTimerWheel *w = &readWriteGlobals->flowTimers[thread_id];
+     u_int64_t deadline = getFlowDeadline(bkt, flowTimerNow());
 
      if(unlikely(readOnlyGlobals.useLocks))
-       pthread_rwlock_wrlock(&readWriteGlobals->expireListLock);
-
-     /* Trick to avoid locking everytime checkBucketExpire is called */
-     if((readWriteGlobals->idleFlowListTail[thread_id] != bkt)
-	&& (readWriteGlobals->idleFlowListHead[thread_id] != readWriteGlobals->idleFlowListTail[thread_id])
-	) {
-       /* 1 - Remove bkt from the list */
-       if(readWriteGlobals->idleFlowListHead[thread_id] == readWriteGlobals->idleFlowListTail[thread_id]) {
-	 /* The list has only one element: me */
-	 readWriteGlobals->idleFlowListHead[thread_id] = readWriteGlobals->idleFlowListTail[thread_id] = NULL;
-       } else if(readWriteGlobals->idleFlowListHead[thread_id] == bkt) {
-	 /* 1st Element of the list */
-	 readWriteGlobals->idleFlowListHead[thread_id] = bkt->core.no_traffic.next;
-	 readWriteGlobals->idleFlowListHead[thread_id]->core.no_traffic.prev = NULL;
-       } else if(readWriteGlobals->idleFlowListTail[thread_id] == bkt) {
-	 /* Last element of the list */
-	 readWriteGlobals->idleFlowListTail[thread_id] = bkt->core.no_traffic.prev;
-	 readWriteGlobals->idleFlowListTail[thread_id]->core.no_traffic.next = NULL;
-       } else {
-	 /* Middle */
-	 (bkt->core.no_traffic.prev)->core.no_traffic.next = bkt->core.no_traffic.next;
-
-	 if(bkt->core.no_traffic.next)
-	   (bkt->core.no_traffic.next)->core.no_traffic.prev = bkt->core.no_traffic.prev;
-       }
+       pthread_rwlock_wrlock(&w->lock);
 
-       /* 2 - Append it at the end */
-       readWriteGlobals->idleFlowListTail[thread_id]->core.no_traffic.next = bkt;
-       bkt->core.no_traffic.prev = readWriteGlobals->idleFlowListTail[thread_id];
-       bkt->core.no_traffic.next = NULL;
-       readWriteGlobals->idleFlowListTail[thread_id] = bkt;
-     }
+     if((bkt->ext->timer_slot != FLOW_TIMER_NOT_ARMED)
+	&& ((int32_t)(flowTimerTick(deadline) - bkt->ext->timer_tick) < 0))
+       flowTimerAdd(w, bkt, deadline);
 
      if(unlikely(readOnlyGlobals.useLocks))
-       pthread_rwlock_unlock(&readWriteGlobals->expireListLock);
+       pthread_rwlock_unlock(&w->lock);
    }
  }
 
@@ -1354,19 +1518,21 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
    u_int16_t sport = 0, dport = 0, vlanId = 0;
 #endif
    u_int32_t idx = gtp_teid % readOnlyGlobals.flowHashSize;
-   u_int32_t mutex_idx = gtp_teid % MAX_HASH_MUTEXES;
+   u_int32_t mutex_idx = getHashMutexIdx(gtp_teid);
    u_int32_t n = 0;
    FlowHashBucket *bkt;
+   FlowTableIterator it;
 
    /* The statement below guarantees that packets are serialized */
    hash_lock(__FILE__, __LINE__, thread_id, mutex_idx);
 
-   bkt = readWriteGlobals->theFlowHash[thread_id][idx];
+   bkt = firstHashBucket(thread_id, idx, gtp_teid, &it);
 
    while(bkt != NULL) {
-     if(bkt->magic != MAGIC_NUMBER) {
-       traceEvent(TRACE_ERROR, "Magic error detected (magic=%d)", bkt->magic);
-       if(readWriteGlobals->theFlowHash[thread_id][idx] == bkt) {
+     if(bkt->core.magic != MAGIC_NUMBER) {
+       traceEvent(TRACE_ERROR, "Magic error detected (magic=%d)", bkt->core.magic);
+       if((readOnlyGlobals.flowTableMode == FLOW_TABLE_CHAINED)
+	  && (readWriteGlobals->theFlowHash[thread_id][idx] == bkt)) {
 	 readWriteGlobals->theFlowHash[thread_id][idx] = NULL;
        }
 
@@ -1374,13 +1540,13 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
        break;
      }
 
-     if(bkt->core.tuple.key.is_gtp_flow && (bkt->core.tuple.key.k.gtpKey.teid == gtp_teid)) {
-       bkt->core.tuple.flowCounters.bytesSent += gtp_pkt_len, bkt->core.tuple.flowCounters.pktSent += 1;
+     if(bkt->ext->tuple.key.is_gtp_flow && (bkt->ext->tuple.key.k.gtpKey.teid == gtp_teid)) {
+       bkt->core.flowCounters.bytesSent += gtp_pkt_len, bkt->core.flowCounters.pktSent += 1;
 
-       if(bkt->core.tuple.flowTimers.firstSeenSent.tv_sec == 0)
-	 bkt->core.tuple.flowTimers.firstSeenSent.tv_sec = h->ts.tv_sec, bkt->core.tuple.flowTimers.firstSeenSent.tv_usec = h->ts.tv_usec;
+       if(bkt->ext->tuple.flowTimers.firstSeenSent.tv_sec == 0)
+	 bkt->ext->tuple.flowTimers.firstSeenSent.tv_sec = h->ts.tv_sec, bkt->ext->tuple.flowTimers.firstSeenSent.tv_usec = h->ts.tv_usec;
 
-       bkt->core.tuple.flowTimers.lastSeenSent.tv_sec = h->ts.tv_sec, bkt->core.tuple.flowTimers.lastSeenSent.tv_usec = h->ts.tv_usec;
+       bkt->ext->tuple.flowTimers.lastSeenSent.tv_sec = h->ts.tv_sec, bkt->ext->tuple.flowTimers.lastSeenSent.tv_usec = h->ts.tv_usec;
 
        checkBucketExpire(bkt, thread_id);
        idleThreadTask(thread_id, 1);
@@ -1389,7 +1555,7 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
      }
 
      /* Bucket not found yet */
-     n++, bkt = bkt->core.hash.next;
+     n++, bkt = nextHashBucket(bkt, &it);
    } /* while */
 
    if(n > readWriteGlobals->maxBucketSearch) {
@@ -1408,13 +1574,13 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
        char buf[256], buf1[256], src_buf[32], dst_buf[32];
 
        traceEvent(TRACE_NORMAL, "(%u) [%s] %s:%d -> %s:%d [%s -> %s][vlan %d][subflowId: %u/0x%04x][idx=%u]",
-		  i, head->core.tuple.key.is_ip_flow ? proto2name(head->core.tuple.key.k.ipKey.proto) : "NonIP",
-		  _intoa(head->core.tuple.key.k.ipKey.src, buf, sizeof(buf)), sport,
-		  _intoa(head->core.tuple.key.k.ipKey.dst, buf1, sizeof(buf1)), dport,
+		  i, head->ext->tuple.key.is_ip_flow ? proto2name(head->ext->tuple.key.k.ipKey.proto) : "NonIP",
+		  _intoa(head->ext->tuple.key.k.ipKey.src, buf, sizeof(buf)), sport,
+		  _intoa(head->ext->tuple.key.k.ipKey.dst, buf1, sizeof(buf1)), dport,
 		  etheraddr_string(head->ext->srcInfo.macAddress, src_buf),
 		  etheraddr_string(head->ext->dstInfo.macAddress, dst_buf),
-		  vlanId, head->ext->subflow_id, head->ext->subflow_id, idx);
-       head = head->core.hash.next, i++;
+		  vlanId, head->core.subflow_id, head->core.subflow_id, idx);
+       head = head->core.hash_next, i++;
      }
 #endif
    }
@@ -1423,12 +1589,13 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
      traceEvent(TRACE_NORMAL, "Adding new bucket");
 
    if(bkt == NULL) {
-     if(getAtomic(&readWriteGlobals->bucketsAllocated) >= readOnlyGlobals.maxNumActiveFlows) {
+     if(tooManyActiveFlows(thread_id)
+	|| isHashFull(thread_id)) {
        static u_char msgSent = 0;
 
        if(!msgSent) {
 	 traceEvent(TRACE_WARNING, "Too many (%u) active flows [threadId=%u][limit=%u] (see -M)",
-		    getAtomic(&readWriteGlobals->bucketsAllocated),
+		    getNumActiveBuckets(),
 		    thread_id, readOnlyGlobals.maxNumActiveFlows);
 	 msgSent = 1;
        }
@@ -1453,47 +1620,27 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
      }
    }
 
-   bkt->core.tuple.flow_idx = idx, bkt->core.tuple.key.is_gtp_flow = 1, bkt->core.tuple.key.k.gtpKey.teid = gtp_teid;
+   bkt->ext->tuple.flow_idx = idx, bkt->ext->tuple.key.is_gtp_flow = 1, bkt->ext->tuple.key.k.gtpKey.teid = gtp_teid;
+   bkt->core.key_type = FLOW_KEY_NONE; /* Searched by TEID only */
 
-   bkt->core.tuple.flowTimers.firstSeenSent.tv_sec = bkt->core.tuple.flowTimers.lastSeenSent.tv_sec = h->ts.tv_sec,
-     bkt->core.tuple.flowTimers.firstSeenSent.tv_usec = bkt->core.tuple.flowTimers.lastSeenSent.tv_usec = h->ts.tv_usec;
-   bkt->core.tuple.flowCounters.bytesSent = gtp_pkt_len, bkt->core.tuple.flowCounters.pktSent = 1;
+   bkt->ext->tuple.flowTimers.firstSeenSent.tv_sec = bkt->ext->tuple.flowTimers.lastSeenSent.tv_sec = h->ts.tv_sec,
+     bkt->ext->tuple.flowTimers.firstSeenSent.tv_usec = bkt->ext->tuple.flowTimers.lastSeenSent.tv_usec = h->ts.tv_usec;
+   bkt->core.flowCounters.bytesSent = gtp_pkt_len, bkt->core.flowCounters.pktSent = 1;
 
- #if 1
    /* Access cache + redis */
    teid2user(bkt, gtp_teid);
- #else
-   /* Access only the local LRU cache */
-   snprintf(key, sizeof(key), "teid.%u", gtp_teid);
-   user = find_lru_cache_str(&readWriteGlobals->flowUsersCache, key);
-   //traceEvent(TRACE_ERROR, "==>>>> %s", key);
-
-   if(user && (user[0] != '\0')) {
-     /* cell_lac;cell_ci;sac;end_user_ip */
-     char *w, *cell_ci = strtok_r(user, ";", &w);
-
-     if(cell_ci) {
-       cell_ci = strtok_r(NULL, ";", &w);
-
-       if(cell_ci) {
-	 // FIX -
-	 bkt->core.tuple.key.k.gtpKey.cell_id = atoi(cell_ci);
-	 // traceEvent(TRACE_ERROR, "==>>>> %s", cell_ci);
-       }
-     }
-   }
- #endif
 
-   addToList(bkt, &readWriteGlobals->theFlowHash[thread_id][idx]);
+   addHashBucket(thread_id, idx, gtp_teid, bkt);
 
    idleThreadTask(thread_id, 2);
 
    if(readOnlyGlobals.traceMode == 2)
      traceEvent(TRACE_INFO, "New Flow: [teid=%04X][%s]", gtp_teid,
-		bkt->core.user.username ? bkt->core.user.username : "");
+		bkt->ext->cold.user.username ? bkt->ext->cold.user.username : "");
    if(readOnlyGlobals.disableFlowCache)
      setBucketExpired(bkt);
 
+   armFlowTimer(thread_id, bkt);
    hash_unlock(__FILE__, __LINE__, thread_id, mutex_idx);
 
    return(bkt);
@@ -1501,55 +1648,121 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 
  /* ****************************************************** */
 
- FlowHashBucket* processFlowPacket(u_short thread_id,
-				   int packet_if_idx /* -1 = unknown */,
-				   u_int8_t rx_packet, /* 1=RX, 0=TX */
-				   u_int32_t subflow_id, u_int8_t proto, u_short numFragments,
-				   u_int16_t ip_offset, u_int8_t sampledPacket,
-				   u_short numPkts, u_int8_t tos, u_int8_t ttl,
-				   u_short vlanId, u_int32_t tunnel_id, u_int16_t gtp_offset,
-				   struct eth_header *ehdr,
-				   IpAddress *src, u_short sport,
-				   IpAddress *dst, u_short dport,
-				   u_int8_t untunneled_proto,
-				   IpAddress *untunneled_src, u_short untunneled_sport,
-				   IpAddress *untunneled_dst, u_short untunneled_dport,
-				   u_int len, u_int16_t tcpWin, u_int8_t tcpFlags,
-				   u_int32_t tcpSeqNum, u_int32_t tcpAckNum,
-				   u_int16_t tcpMaxSegmentSize, u_int8_t tcpWinScale,
-				   u_int8_t icmpType, u_int8_t icmpCode,
-				   u_short numMplsLabels,
-				   u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN],
-				   u_int32_t if_input, u_int32_t if_output,
-				   struct pcap_pkthdr *h, u_char *p,
-				   u_int16_t payload_shift, u_int payloadLen,
-				   u_int originalPayloadLen,
-				   time_t _firstSeen, /* Always set to 0 unless numPkts > 0 */
-				   u_int32_t src_as, u_int32_t dst_as,
-				   u_int16_t src_mask, u_int16_t dst_mask,
-				   u_int32_t flow_sender_ip,
-				   u_int32_t packet_hash,
-				   u_int8_t engine_type, u_int8_t engine_id,
-				   char *osi_src, char *osi_dst,
-				   struct generic_netflow_record *record) {
-   u_char *payload = NULL;
-   u_int32_t n = 0, mutex_idx, realLen = sampledPacket ? (numPkts*len) : len;
+ /* GTP signalling is hashed on the endpoints and the sequence number only */
+ static __inline__ u_int32_t gtpFlowHash(IpAddress *src, IpAddress *dst, u_int32_t subflow_id) {
+   FlowHashKey hash_key;
+
+   initFlowHashKey(&hash_key, FLOW_HASH_KEY_GTP, &src->ipType.ipv4, &dst->ipType.ipv4,
+		   0, 0, 0, 0, 0, 0, subflow_id);
+   return(computeFlowHash(&hash_key));
+ }
+
+ /* ****************************************************** */
+
+ /*
+   Builds the lookup key of a packet. Returns 1 when the packet goes
+   from the hi to the lo endpoint of the key, i.e. the endpoints have
+   been swapped. MAC keys are not ordered: as the search did before,
+   each direction of a non-IP flow is a flow of its own.
+ */
+ static __inline__ u_int8_t initFlowKey(FlowKey *key, u_int8_t type,
+					const void *src, const void *dst,
+					u_int16_t sport, u_int16_t dport, u_int16_t vlanId,
+					u_int8_t proto, u_int8_t untunneled_proto) {
+   u_int8_t *lo, *hi, len, swapped = 0;
+   int cmp;
+
+   memset(key, 0, sizeof(FlowKey));
+
+   switch(type) {
+   case FLOW_KEY_IPV6:
+     lo = (u_int8_t*)key->addr.v6.lo, hi = (u_int8_t*)key->addr.v6.hi, len = 16;
+     break;
+   case FLOW_KEY_MAC:
+     lo = key->addr.mac.lo, hi = key->addr.mac.hi, len = 6;
+     sport = dport = 0, proto = 0;
+     break;
+   case FLOW_KEY_GTP:
+     sport = dport = 0, proto = 0, vlanId = 0;
+     /* Fall through */
+   default:
+     lo = (u_int8_t*)&key->addr.v4.lo, hi = (u_int8_t*)&key->addr.v4.hi, len = 4;
+     break;
+   }
+
+   if(type != FLOW_KEY_MAC) {
+     cmp = memcmp(src, dst, len);
+     swapped = ((cmp > 0) || ((cmp == 0) && (sport > dport))) ? 1 : 0;
+   }
+
+   if(swapped)
+     memcpy(lo, dst, len), memcpy(hi, src, len), key->lo_port = dport, key->hi_port = sport;
+   else
+     memcpy(lo, src, len), memcpy(hi, dst, len), key->lo_port = sport, key->hi_port = dport;
+
+   key->vlanId = vlanId, key->proto = proto, key->untunneled_proto = untunneled_proto;
+
+   return(swapped);
+ }
+
+ /* ****************************************************** */
+
+ /*
+   Keys are zero padded: the compare never depends on the field values.
+   The first FLOW_KEY_SHORT_LEN bytes are copied in the bucket so that IPv4
+   and GTP flows are matched without touching ext.
+ */
+ static __inline__ u_int8_t flowKeyEqual(const FlowHashBucket *bkt, const FlowKey *key, u_int8_t type) {
+   const u_int8_t *a = (const u_int8_t*)&bkt->ext->tuple.lookup, *b = (const u_int8_t*)key;
+ #ifdef __SSE2__
+   __m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i*)bkt->core.lookup), _mm_loadu_si128((const __m128i*)b));
+
+   if((type == FLOW_KEY_IPV4) || (type == FLOW_KEY_GTP))
+     return((_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF) ? 1 : 0);
+
+   if(_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF)
+     return(0);
+
+   /* Bytes 16-39 are in ext: the second load overlaps the first one */
+   diff = _mm_or_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i*)&a[16]), _mm_loadu_si128((const __m128i*)&b[16])),
+		       _mm_xor_si128(_mm_loadu_si128((const __m128i*)&a[24]), _mm_loadu_si128((const __m128i*)&b[24])));
+
+   return((_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF) ? 1 : 0);
+ #else
+   if(memcmp(bkt->core.lookup, b, FLOW_KEY_SHORT_LEN) != 0)
+     return(0);
+
+   if((type == FLOW_KEY_IPV4) || (type == FLOW_KEY_GTP))
+     return(1);
+
+   return((memcmp(&a[FLOW_KEY_SHORT_LEN], &b[FLOW_KEY_SHORT_LEN], sizeof(FlowKey) - FLOW_KEY_SHORT_LEN) == 0) ? 1 : 0);
+ #endif
+ }
+
+ /* ****************************************************** */
+
+ FlowHashBucket* processFlowPacket(u_short thread_id, DecodedPacket *pkt) {
+   u_int32_t n = 0, mutex_idx, realLen = pkt->sampledPacket ? (pkt->numPkts*pkt->len) : pkt->len;
    u_int32_t ndpi_proto = NDPI_PROTOCOL_UNKNOWN;
    FlowHashBucket *bkt;
+   FlowTableIterator it;
+   FlowKey key;
    struct timeval firstSeen;
    u_int32_t idx;
    FlowDirection direction;
    ticks when;
-   u_int8_t use_mac_search = 0, flow_found = 0, retransmitted_pkt = 0;
+   u_int8_t use_mac_search = 0, flow_found = 0;
+   u_int8_t key_type, key_swapped;
  #ifdef ACCURATE_HASH
    struct flow_index to_index;
  #endif
 
    if(unlikely(readOnlyGlobals.tracePerformance)) when = getticks();
-   if(unlikely(readOnlyGlobals.ignoreVlan))       vlanId = 0;
-   if(unlikely(readOnlyGlobals.ignoreProtocol))   proto = 0;
-   if(unlikely(readOnlyGlobals.ignoreIP))         src->ipVersion = 4, src->ipType.ipv4 = 0, dst->ipVersion = 4, dst->ipType.ipv4 = 0;
-   if(unlikely(readOnlyGlobals.ignorePorts))      sport = 0, dport = 0;
+   pkt->retransmitted_pkt = 0;
+   if(unlikely(readOnlyGlobals.ignoreVlan))       pkt->vlanId = 0;
+   if(unlikely(readOnlyGlobals.ignoreProtocol))   pkt->proto = 0;
+   if(unlikely(readOnlyGlobals.ignoreIP))         pkt->src->ipVersion = 4, pkt->src->ipType.ipv4 = 0, pkt->dst->ipVersion = 4, pkt->dst->ipType.ipv4 = 0;
+   if(unlikely(readOnlyGlobals.ignorePorts))      pkt->sport = 0, pkt->dport = 0;
    if(unlikely(readOnlyGlobals.ignoreTos
 	       || readOnlyGlobals.enableMySQLPlugin
 	       || readOnlyGlobals.enableHttpPlugin
@@ -1557,56 +1770,56 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 	       || readOnlyGlobals.enableOraclePlugin
 	       || readOnlyGlobals.enableWhoisPlugin
 	       ))
-     tos = 0;
+     pkt->tos = 0;
 
  #ifdef ACCURATE_HASH
-   if(src->ipVersion == 4) {
-     to_index.srcHost = src->ipType.ipv4, to_index.dstHost = dst->ipType.ipv4;
+   if(pkt->src->ipVersion == 4) {
+     to_index.srcHost = pkt->src->ipType.ipv4, to_index.dstHost = pkt->dst->ipType.ipv4;
    } else {
-     to_index.srcHost = src->ipType.ipv6.s6_addr32[0] + src->ipType.ipv6.s6_addr32[1]
-       + src->ipType.ipv6.s6_addr32[2] + src->ipType.ipv6.s6_addr32[3];
-     to_index.dstHost = dst->ipType.ipv6.s6_addr32[0] + dst->ipType.ipv6.s6_addr32[1]
-       + dst->ipType.ipv6.s6_addr32[2] + dst->ipType.ipv6.s6_addr32[3];
+     to_index.srcHost = pkt->src->ipType.ipv6.s6_addr32[0] + pkt->src->ipType.ipv6.s6_addr32[1]
+       + pkt->src->ipType.ipv6.s6_addr32[2] + pkt->src->ipType.ipv6.s6_addr32[3];
+     to_index.dstHost = pkt->dst->ipType.ipv6.s6_addr32[0] + pkt->dst->ipType.ipv6.s6_addr32[1]
+       + pkt->dst->ipType.ipv6.s6_addr32[2] + pkt->dst->ipType.ipv6.s6_addr32[3];
    }
-   to_index.vlanId = vlanId, to_index.sport = sport, to_index.dport = dport, to_index.tos = tos,
-     to_index.proto = proto, to_index.subflow_id = subflow_id;
+   to_index.vlanId = pkt->vlanId, to_index.sport = pkt->sport, to_index.dport = pkt->dport, to_index.tos = pkt->tos,
+     to_index.proto = pkt->proto, to_index.subflow_id = pkt->subflow_id;
  #endif
 
    if(unlikely(readOnlyGlobals.enableDnsPlugin)) {
-     if((proto == IPPROTO_UDP)
-	&& ((sport == 53) || (dport == 53))
-	&& (payloadLen > 2)) {
-       u_int16_t *transaction_id = (u_int16_t*)&p[payload_shift];
+     if((pkt->proto == IPPROTO_UDP)
+	&& ((pkt->sport == 53) || (pkt->dport == 53))
+	&& (pkt->payloadLen > 2)) {
+       u_int16_t *transaction_id = (u_int16_t*)&pkt->p[pkt->payload_shift];
 
-       subflow_id = ntohs(*transaction_id);
+       pkt->subflow_id = ntohs(*transaction_id);
      }
    }
 
    if(unlikely(readOnlyGlobals.enableDhcpPlugin)) {
-     if((proto == IPPROTO_UDP)
-	&& ((sport == 67) || (sport == 68))
-	&& (payloadLen > 2)) {
-       u_int32_t *transaction_id = (u_int32_t*)&p[payload_shift+4];
+     if((pkt->proto == IPPROTO_UDP)
+	&& ((pkt->sport == 67) || (pkt->sport == 68))
+	&& (pkt->payloadLen > 2)) {
+       u_int32_t *transaction_id = (u_int32_t*)&pkt->p[pkt->payload_shift+4];
 
-       subflow_id = ntohl(*transaction_id);
+       pkt->subflow_id = ntohl(*transaction_id);
      }
    }
 
    if(unlikely(readOnlyGlobals.enableRadiusPlugin)) {
-     if((proto == IPPROTO_UDP)
-	&& ((sport == 1812)    || (dport == 1812) /* Start/Stop */
-	    || (sport == 1813) || (dport == 1813) /* Accounting */
-	    || (sport == 1645) || (dport == 1645) /* Start/Stop */
-	    || (sport == 1646) || (dport == 1646) /* Accounting */
+     if((pkt->proto == IPPROTO_UDP)
+	&& ((pkt->sport == 1812)    || (pkt->dport == 1812) /* Start/Stop */
+	    || (pkt->sport == 1813) || (pkt->dport == 1813) /* Accounting */
+	    || (pkt->sport == 1645) || (pkt->dport == 1645) /* Start/Stop */
+	    || (pkt->sport == 1646) || (pkt->dport == 1646) /* Accounting */
 	    )
-	&& (payloadLen >= 20)) {
-       subflow_id = p[payload_shift+1] /* Packet Identifier */;
+	&& (pkt->payloadLen >= 20)) {
+       pkt->subflow_id = pkt->p[pkt->payload_shift+1] /* Packet Identifier */;
      }
    }
 
    if(unlikely(readOnlyGlobals.enableSipPlugin)) {
-     if((proto == IPPROTO_UDP) && ((sport == 5060) || (dport == 5060)) && (payloadLen > 9)) {
-       char *call_id = strstr((const char*)&p[payload_shift], "Call-ID: ");
+     if((pkt->proto == IPPROTO_UDP) && ((pkt->sport == 5060) || (pkt->dport == 5060)) && (pkt->payloadLen > 9)) {
+       char *call_id = strstr((const char*)&pkt->p[pkt->payload_shift], "Call-ID: ");
 
        if(call_id != NULL) {
 	 u_int32_t hash = 0, c;
@@ -1621,99 +1834,107 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 
 	 //traceEvent(TRACE_INFO, "Computing SIP HASH Call-ID=%s Hash=%u ", &row[9], hash);
 
-	 subflow_id = hash;
+	 pkt->subflow_id = hash;
        }
      }
    }
 
-   h->caplen = min(h->caplen, readOnlyGlobals.snaplen);
+   pkt->h->caplen = min(pkt->h->caplen, readOnlyGlobals.snaplen);
 
-   if(gtp_offset > 0) {
-     if((p[gtp_offset] & 0xE0 /* GTPv0 */) == 0) {
-       struct gtpv0_header *gtp = (struct gtpv0_header*)&p[gtp_offset];
+   if(pkt->gtp_offset > 0) {
+     if((pkt->p[pkt->gtp_offset] & 0xE0 /* GTPv0 */) == 0) {
+       struct gtpv0_header *gtp = (struct gtpv0_header*)&pkt->p[pkt->gtp_offset];
 
        if(readOnlyGlobals.enableGtpPlugin)
-	 subflow_id = ntohs(gtp->sequence_number);
+	 pkt->subflow_id = ntohs(gtp->sequence_number);
 
        if(gtp->message_type == 0xFF /* T-PDU */)
-	 gtp_offset = 0 /* unknown msg, we ignore GTP */, packet_hash = 0;
+	 pkt->gtp_offset = 0 /* unknown msg, we ignore GTP */, pkt->packet_hash = 0;
        else
-	 packet_hash = (subflow_id << 1) + subflow_id + src->ipType.ipv4 + dst->ipType.ipv4;
-     } else if(p[gtp_offset] & 0x20 /* GTPv1 */) {
-       struct gtpv1_header *gtp = (struct gtpv1_header*)&p[gtp_offset];
+	 pkt->packet_hash = gtpFlowHash(pkt->src, pkt->dst, pkt->subflow_id);
+     } else if(pkt->p[pkt->gtp_offset] & 0x20 /* GTPv1 */) {
+       struct gtpv1_header *gtp = (struct gtpv1_header*)&pkt->p[pkt->gtp_offset];
 
        if(readOnlyGlobals.enableGtpPlugin)
-	 subflow_id = ntohs(gtp->sequence_number);
+	 pkt->subflow_id = ntohs(gtp->sequence_number);
 
        if(gtp->message_type == 0xFF /* T-PDU */)
-	 gtp_offset = 0 /* unknown msg, we ignore GTP */, packet_hash = 0;
+	 pkt->gtp_offset = 0 /* unknown msg, we ignore GTP */, pkt->packet_hash = 0;
        else
-	 packet_hash = (subflow_id << 1) + subflow_id + src->ipType.ipv4 + dst->ipType.ipv4;
-     } else if(p[gtp_offset] & 0x40 /* GTPv2 */) {
-       struct gtpv2_header *gtp = (struct gtpv2_header*)&p[gtp_offset];
+	 pkt->packet_hash = gtpFlowHash(pkt->src, pkt->dst, pkt->subflow_id);
+     } else if(pkt->p[pkt->gtp_offset] & 0x40 /* GTPv2 */) {
+       struct gtpv2_header *gtp = (struct gtpv2_header*)&pkt->p[pkt->gtp_offset];
 
        if(readOnlyGlobals.enableGtpPlugin)
-	 subflow_id = (gtp->sequence_number[0] << 16)
+	 pkt->subflow_id = (gtp->sequence_number[0] << 16)
 	   + (gtp->sequence_number[1] << 8)
 	   + gtp->sequence_number[2];
 
        if(unlikely(readOnlyGlobals.enable_debug))
-	 traceEvent(TRACE_NORMAL, "[GTPv2] subflow_id=%u", subflow_id);
+	 traceEvent(TRACE_NORMAL, "[GTPv2] subflow_id=%u", pkt->subflow_id);
 
        if(gtp->message_type == 0xFF /* T-PDU */)
-	 gtp_offset = 0 /* unknown msg, we ignore GTP */, packet_hash = 0;
+	 pkt->gtp_offset = 0 /* unknown msg, we ignore GTP */, pkt->packet_hash = 0;
        else
-	 packet_hash = (subflow_id << 1) + subflow_id + src->ipType.ipv4 + dst->ipType.ipv4;
+	 pkt->packet_hash = gtpFlowHash(pkt->src, pkt->dst, pkt->subflow_id);
      }
    }
 
-   if(unlikely(packet_hash == 0)) {
+   if(unlikely(pkt->packet_hash == 0)) {
  #ifdef ACCURATE_HASH
      sortFlowIndex(&to_index); /* We need a symmetric hash value */
-     packet_hash = hashVal((const u_int8_t*)&to_index, sizeof(to_index), readOnlyGlobals.numProcessThreads /* seed */);
+     pkt->packet_hash = hashVal((const u_int8_t*)&to_index, sizeof(to_index), readOnlyGlobals.numProcessThreads /* seed */);
  #else
      {
-       u_int32_t srcHost, dstHost;
+       FlowHashKey hash_key;
 
-       if((src->ipVersion == 0) || (src->ipVersion == 4)) {
-	 if((src->ipType.ipv4 == 0) && (dst->ipType.ipv4 == 0) && (ehdr != NULL)) {
+       /* subflow_id is nice to differentiate across similar flows */
+       if((pkt->src->ipVersion == 0) || (pkt->src->ipVersion == 4)) {
+	 if((pkt->src->ipType.ipv4 == 0) && (pkt->dst->ipType.ipv4 == 0) && (pkt->ehdr != NULL)) {
 	   /* This is a fake IP thus we need to work at ethernet level */
-	   srcHost = ehdr->ether_shost[0] + ehdr->ether_shost[1] + ehdr->ether_shost[2]
-	     + ehdr->ether_shost[3] + ehdr->ether_shost[4] + ehdr->ether_shost[5];
-	   dstHost = ehdr->ether_dhost[0] + ehdr->ether_dhost[1] + ehdr->ether_dhost[2]
-	     + ehdr->ether_dhost[3] + ehdr->ether_dhost[4] + ehdr->ether_dhost[5];
+	   initFlowHashKey(&hash_key, FLOW_HASH_KEY_MAC, pkt->ehdr->ether_shost, pkt->ehdr->ether_dhost,
+			   pkt->sport, pkt->dport, pkt->vlanId, pkt->proto, pkt->tos, pkt->untunneled_proto, pkt->subflow_id);
 	   use_mac_search = 1;
 	 } else
-	   srcHost = src->ipType.ipv4, dstHost = dst->ipType.ipv4;
-       } else {
-	 srcHost = src->ipType.ipv6.s6_addr32[0]+src->ipType.ipv6.s6_addr32[1]
-	   +src->ipType.ipv6.s6_addr32[2]+src->ipType.ipv6.s6_addr32[3];
-	 dstHost = dst->ipType.ipv6.s6_addr32[0]+dst->ipType.ipv6.s6_addr32[1]
-	   +dst->ipType.ipv6.s6_addr32[2]+dst->ipType.ipv6.s6_addr32[3];
-       }
+	   initFlowHashKey(&hash_key, FLOW_HASH_KEY_IPV4, &pkt->src->ipType.ipv4, &pkt->dst->ipType.ipv4,
+			   pkt->sport, pkt->dport, pkt->vlanId, pkt->proto, pkt->tos, pkt->untunneled_proto, pkt->subflow_id);
+       } else
+	 initFlowHashKey(&hash_key, FLOW_HASH_KEY_IPV6, &pkt->src->ipType.ipv6, &pkt->dst->ipType.ipv6,
+			 pkt->sport, pkt->dport, pkt->vlanId, pkt->proto, pkt->tos, pkt->untunneled_proto, pkt->subflow_id);
 
-       packet_hash = vlanId+proto+srcHost+dstHost+3*(sport+dport)+tos+untunneled_proto
-	 + subflow_id /* Nice to differentiate across similar flows */;
+       pkt->packet_hash = computeFlowHash(&hash_key);
      }
  #endif
    }
 
-   idx = packet_hash % readOnlyGlobals.flowHashSize;
+   idx = pkt->packet_hash % readOnlyGlobals.flowHashSize;
 
-   if(_firstSeen == 0)
-     firstSeen.tv_sec = h->ts.tv_sec, firstSeen.tv_usec = h->ts.tv_usec;
+   if(use_mac_search)
+     key_type = FLOW_KEY_MAC;
+   else if((pkt->src->ipVersion == 0) || (pkt->src->ipVersion == 4))
+     key_type = (pkt->gtp_offset > 0) ? FLOW_KEY_GTP : FLOW_KEY_IPV4;
    else
-     firstSeen.tv_sec = _firstSeen, firstSeen.tv_usec = 0;
+     key_type = FLOW_KEY_IPV6;
+
+   key_swapped = initFlowKey(&key, key_type,
+			     use_mac_search ? (void*)pkt->ehdr->ether_shost : (void*)&pkt->src->ipType,
+			     use_mac_search ? (void*)pkt->ehdr->ether_dhost : (void*)&pkt->dst->ipType,
+			     pkt->sport, pkt->dport, pkt->vlanId, pkt->proto, pkt->untunneled_proto);
+
+   if(pkt->firstSeen == 0)
+     firstSeen.tv_sec = pkt->h->ts.tv_sec, firstSeen.tv_usec = pkt->h->ts.tv_usec;
+   else
+     firstSeen.tv_sec = pkt->firstSeen, firstSeen.tv_usec = 0;
 
    if(likely(readOnlyGlobals.pcapFile == NULL)) /* Live capture */
-     readWriteGlobals->actTime.tv_sec = h->ts.tv_sec, readWriteGlobals->actTime.tv_usec = h->ts.tv_usec;
+     readWriteGlobals->actTime.tv_sec = pkt->h->ts.tv_sec, readWriteGlobals->actTime.tv_usec = pkt->h->ts.tv_usec;
 
-   if(payload_shift > 0)
-     payload = &p[payload_shift];
+   if(pkt->payload_shift > 0)
+     pkt->payload = &pkt->p[pkt->payload_shift];
    else
-     payloadLen = 0; /* Sanity check */
+     pkt->payload = NULL, pkt->payloadLen = 0; /* Sanity check */
 
-   mutex_idx = idx % MAX_HASH_MUTEXES;
+   mutex_idx = getHashMutexIdx(idx);
 
    // traceEvent(TRACE_INFO, "mutex_idx=%d", mutex_idx);
    // traceEvent(TRACE_NORMAL, "packet_hash=%u/thread_id=%d/idx=%d", packet_hash, thread_id, idx);
@@ -1721,12 +1942,13 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
    /* The statement below guarantees that packets are serialized */
    hash_lock(__FILE__, __LINE__, thread_id, mutex_idx);
 
-   bkt = readWriteGlobals->theFlowHash[thread_id][idx];
+   bkt = firstHashBucket(thread_id, idx, pkt->packet_hash, &it);
 
    while(bkt != NULL) {
-     if(bkt->magic != MAGIC_NUMBER) {
-       traceEvent(TRACE_ERROR, "Magic error detected (magic=%d)", bkt->magic);
-       if(readWriteGlobals->theFlowHash[thread_id][idx] == bkt) {
+     if(bkt->core.magic != MAGIC_NUMBER) {
+       traceEvent(TRACE_ERROR, "Magic error detected (magic=%d)", bkt->core.magic);
+       if((readOnlyGlobals.flowTableMode == FLOW_TABLE_CHAINED)
+	  && (readWriteGlobals->theFlowHash[thread_id][idx] == bkt)) {
 	 readWriteGlobals->theFlowHash[thread_id][idx] = NULL;
        }
 
@@ -1734,151 +1956,105 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
        break;
      }
 
-     if(use_mac_search) {
-       if((bkt->core.tuple.flow_hash == packet_hash)
-	  && (bkt->core.tuple.key.vlanId == vlanId)
-	  && (memcmp(bkt->core.tuple.key.k.macKey.src, ehdr->ether_shost, 6) == 0)
-	  && (memcmp(bkt->core.tuple.key.k.macKey.dst, ehdr->ether_dhost, 6) == 0))
-	 flow_found = 1;
-     } else {
-       if(((bkt->core.tuple.flow_hash == packet_hash)
-	   && (bkt->core.tuple.key.k.ipKey.proto == proto)
-	   && (bkt->core.tuple.key.vlanId == vlanId)
-	   && (bkt->ext->subflow_id == subflow_id)
-	   && (((bkt->core.tuple.key.k.ipKey.sport == sport)
-		&& (bkt->core.tuple.key.k.ipKey.dport == dport)
-		/* Don't check TOS if we've not sent any packet (it can happen with resetBucketStats()) */
-		&& ((bkt->core.tuple.flowCounters.pktSent == 0) || (bkt->ext->src2dstTos == tos))
-		&& cmpIpAddress(&bkt->core.tuple.key.k.ipKey.src, src)
-		&& cmpIpAddress(&bkt->core.tuple.key.k.ipKey.dst, dst)
-		)
-	       ||
-	       ((bkt->core.tuple.key.k.ipKey.sport == dport)
-		&& (bkt->core.tuple.key.k.ipKey.dport == sport)
-		/* Don't check TOS if we've not seen any backward packet */
-		&& ((bkt->core.tuple.flowCounters.pktRcvd == 0) || (bkt->ext->dst2srcTos == tos))
-		&& cmpIpAddress(&bkt->core.tuple.key.k.ipKey.src, dst)
-		&& cmpIpAddress(&bkt->core.tuple.key.k.ipKey.dst, src)
-		)))
-	  || ((gtp_offset > 0)
-	      && (bkt->ext->subflow_id == subflow_id)
-	      && (((src->ipType.ipv4 == bkt->core.tuple.key.k.ipKey.src.ipType.ipv4) && (dst->ipType.ipv4 == bkt->core.tuple.key.k.ipKey.dst.ipType.ipv4))
-		  || ((src->ipType.ipv4 == bkt->core.tuple.key.k.ipKey.dst.ipType.ipv4) && (dst->ipType.ipv4 == bkt->core.tuple.key.k.ipKey.src.ipType.ipv4))))
-	  )
-	 flow_found = 1;
-     }
+     /* Everything compared below sits in the bucket: ext is read only for IPv6/MAC keys or once the flow matches */
+     if((bkt->core.flow_hash == pkt->packet_hash)
+	&& (bkt->core.key_type == key_type)
+	&& (bkt->core.subflow_id == pkt->subflow_id)
+	&& flowKeyEqual(bkt, &key, key_type)) {
+       direction = (bkt->core.key_swapped == key_swapped) ? src2dst_direction : dst2src_direction;
 
-     /*
-       Extra check to make sure that also the encapsulation matched with the flow
-     */
-     if(flow_found) {
-       if(untunneled_proto != 0) {
-	 if((bkt->ext->extensions == NULL) || (bkt->ext->extensions->untunneled.proto != untunneled_proto))
-	   flow_found = 0;
-       } else {
-	 /* untunneled_proto == 0 */
-
-	 if((bkt->ext->extensions != NULL) && (bkt->ext->extensions->untunneled.proto != untunneled_proto))
-	   flow_found = 0;
-       }
+       /* Don't check TOS if we've not seen any packet in this direction (it can happen with resetBucketStats()) */
+       if(direction == src2dst_direction)
+	 flow_found = ((bkt->core.flowCounters.pktSent == 0) || (bkt->core.src2dstTos == pkt->tos)) ? 1 : 0;
+       else
+	 flow_found = ((bkt->core.flowCounters.pktRcvd == 0) || (bkt->core.dst2srcTos == pkt->tos)) ? 1 : 0;
      }
 
      if(flow_found) {
        if(!bkt->core.bucket_expired) {
-	 if((bkt->core.tuple.key.k.ipKey.sport == sport)
-	    && cmpIpAddress(&bkt->core.tuple.key.k.ipKey.src, src)) {
-	   // traceEvent(TRACE_ERROR, "[%p][sport=%u]", bkt, sport);
-	   direction = src2dst_direction; /* , bkt->core.rx_direction.src2dst = rx_packet; [done at creation] */
-	 } else {
-	   direction = dst2src_direction, bkt->core.rx_direction.dst2src = rx_packet;
+	 if(direction == dst2src_direction) {
+	   bkt->core.rx_direction.dst2src = pkt->rx_packet;
 
 	   /* The opposite tunnel has been set already */
-	   bkt->ext->dst2src_tunnel_id = tunnel_id;
+	   bkt->ext->dst2src_tunnel_id = pkt->tunnel_id;
 	 }
 
 	 if(likely(!bkt->ext->sampled_flow)) {
 	   /* This flow has not been sampled */
 
-	   if(proto == IPPROTO_TCP) {
+	   if(pkt->proto == IPPROTO_TCP) {
 	     /* We must do this here before we update the flow timers */
-	     retransmitted_pkt = updateTcpSeq(&h->ts, bkt, direction, tcpFlags, tcpSeqNum, tcpAckNum,
-					      originalPayloadLen, tcpWin, h, p, len);
+	     pkt->retransmitted_pkt = updateTcpSeq(&pkt->h->ts, bkt, direction, pkt->tcpFlags, pkt->tcpSeqNum, pkt->tcpAckNum,
+					      pkt->originalPayloadLen, pkt->tcpWin, pkt->h, pkt->p, pkt->len);
 	  }
 
 	  if(direction == src2dst_direction) {
 	    /* src -> dst */
-	    bkt->core.tuple.flowCounters.bytesSent += realLen, bkt->core.tuple.flowCounters.pktSent += numPkts;
+	    bkt->core.flowCounters.bytesSent += realLen, bkt->core.flowCounters.pktSent += pkt->numPkts;
 
 	    /* NOTE: do not move the statement below after the time update below */
-	    updatePktLenStats(bkt, direction, &h->ts, h->len, ttl, numPkts);
+	    updatePktLenStats(bkt, direction, &pkt->h->ts, pkt->h->len, pkt->ttl, pkt->numPkts);
 
-	    if(bkt->core.tuple.flowTimers.firstSeenSent.tv_sec == 0)
-	      bkt->core.tuple.flowTimers.firstSeenSent.tv_sec = h->ts.tv_sec, bkt->core.tuple.flowTimers.firstSeenSent.tv_usec = h->ts.tv_usec;
+	    if(bkt->ext->tuple.flowTimers.firstSeenSent.tv_sec == 0)
+	      bkt->ext->tuple.flowTimers.firstSeenSent.tv_sec = pkt->h->ts.tv_sec, bkt->ext->tuple.flowTimers.firstSeenSent.tv_usec = pkt->h->ts.tv_usec;
 
-	    bkt->core.tuple.flowTimers.lastSeenSent.tv_sec = h->ts.tv_sec, bkt->core.tuple.flowTimers.lastSeenSent.tv_usec = h->ts.tv_usec;
-	    if(numFragments > 0) bkt->ext->flowCounters.sentFragPkts += numFragments;
+	    bkt->ext->tuple.flowTimers.lastSeenSent.tv_sec = pkt->h->ts.tv_sec, bkt->ext->tuple.flowTimers.lastSeenSent.tv_usec = pkt->h->ts.tv_usec;
+	    if(pkt->numFragments > 0) bkt->ext->flowCounters.sentFragPkts += pkt->numFragments;
 
-	    if(tos != 0) updateTos(bkt, 0, tos);
-	    updateTTL(bkt, 0, ttl);
+	    if(pkt->tos != 0) updateTos(bkt, 0, pkt->tos);
+	    updateTTL(bkt, 0, pkt->ttl);
 	    if(readOnlyGlobals.enable_l7_protocol_discovery)
-	      setPayload(bkt, h, p, ip_offset, payload, payloadLen, 0);
+	      setPayload(bkt, pkt->h, pkt->p, pkt->ip_offset, pkt->payload, pkt->payloadLen, 0);
 	  } else {
 	    /* dst -> src */
-	    bkt->core.tuple.flowCounters.bytesRcvd += realLen, bkt->core.tuple.flowCounters.pktRcvd += numPkts;
+	    bkt->core.flowCounters.bytesRcvd += realLen, bkt->core.flowCounters.pktRcvd += pkt->numPkts;
 
 	    /* NOTE: do not move the statement below after the time update below */
-	    updatePktLenStats(bkt, direction, &h->ts, h->len, ttl, numPkts);
+	    updatePktLenStats(bkt, direction, &pkt->h->ts, pkt->h->len, pkt->ttl, pkt->numPkts);
 
-	    if(((bkt->core.tuple.flowTimers.firstSeenRcvd.tv_sec == 0) && (bkt->core.tuple.flowTimers.firstSeenRcvd.tv_usec == 0))
-	       || (to_msec(&firstSeen) < to_msec(&bkt->core.tuple.flowTimers.firstSeenRcvd)))
-	      bkt->core.tuple.flowTimers.firstSeenRcvd.tv_sec = firstSeen.tv_sec, bkt->core.tuple.flowTimers.firstSeenRcvd.tv_usec = firstSeen.tv_usec;
+	    if(((bkt->ext->tuple.flowTimers.firstSeenRcvd.tv_sec == 0) && (bkt->ext->tuple.flowTimers.firstSeenRcvd.tv_usec == 0))
+	       || (to_msec(&firstSeen) < to_msec(&bkt->ext->tuple.flowTimers.firstSeenRcvd)))
+	      bkt->ext->tuple.flowTimers.firstSeenRcvd.tv_sec = firstSeen.tv_sec, bkt->ext->tuple.flowTimers.firstSeenRcvd.tv_usec = firstSeen.tv_usec;
 
-	    bkt->core.tuple.flowTimers.lastSeenRcvd.tv_sec = h->ts.tv_sec, bkt->core.tuple.flowTimers.lastSeenRcvd.tv_usec = h->ts.tv_usec;
-	    if(numFragments > 0) bkt->ext->flowCounters.rcvdFragPkts += numFragments;
+	    bkt->ext->tuple.flowTimers.lastSeenRcvd.tv_sec = pkt->h->ts.tv_sec, bkt->ext->tuple.flowTimers.lastSeenRcvd.tv_usec = pkt->h->ts.tv_usec;
+	    if(pkt->numFragments > 0) bkt->ext->flowCounters.rcvdFragPkts += pkt->numFragments;
 
-	    if(tos != 0) updateTos(bkt, 1, tos);
-	    updateTTL(bkt, 1, ttl);
+	    if(pkt->tos != 0) updateTos(bkt, 1, pkt->tos);
+	    updateTTL(bkt, 1, pkt->ttl);
 	    if(readOnlyGlobals.enable_l7_protocol_discovery)
-	      setPayload(bkt, h, p, ip_offset, payload, payloadLen, 1);
+	      setPayload(bkt, pkt->h, pkt->p, pkt->ip_offset, pkt->payload, pkt->payloadLen, 1);
 	  }
 
-	  // traceEvent(TRACE_NORMAL, "-> %u/%u [%u]\n", realLen, realLen+14, bkt->core.tuple.flowCounters.bytesRcvd+bkt->core.tuple.flowCounters.bytesSent);
+	  // traceEvent(TRACE_NORMAL, "-> %u/%u [%u]\n", realLen, realLen+14, bkt->core.flowCounters.bytesRcvd+bkt->core.flowCounters.bytesSent);
 
 	  if(unlikely(readOnlyGlobals.num_active_plugins > 0)) {
 
-	    if(payloadLen > 0) payload[payloadLen] = '\0';
-	    pluginCallback(PACKET_CALLBACK, packet_if_idx,
-			   bkt, direction,
-			   ip_offset, proto, (numFragments > 0) ? 1 : 0,
-			   numPkts, tos, retransmitted_pkt,
-			   vlanId, ehdr, src, sport,
-			   dst, dport, len,
-			   tcpFlags, tcpSeqNum, icmpType, numMplsLabels,
-			   mplsLabels, h, p, payload, payloadLen);
+	    if(pkt->payloadLen > 0) pkt->payload[pkt->payloadLen] = '\0';
+	    pluginCallback(PACKET_CALLBACK, bkt, direction, pkt);
 	  }
 	}
 
-	switch(proto) {
+	switch(pkt->proto) {
 	case IPPROTO_TCP:
 	  if(bkt->ext) {
-	    updateTcpFlags(bkt, direction, &h->ts, tcpFlags, tcpMaxSegmentSize, tcpWinScale);
+	    updateTcpFlags(bkt, direction, &pkt->h->ts, pkt->tcpFlags, pkt->tcpMaxSegmentSize, pkt->tcpWinScale);
 	    /* NOTE: updateTcpSeq() has been already called above */
 
 	    /* Do not move this line before updateTcpFlags(...) */
 	    if(direction == src2dst_direction)
-	      bkt->ext->protoCounters.tcp.src2dstTcpFlags |= tcpFlags, bkt->ext->protoCounters.tcp.src2dstLastWin = tcpWin;
+	      bkt->ext->protoCounters.tcp.src2dstTcpFlags |= pkt->tcpFlags, bkt->ext->protoCounters.tcp.src2dstLastWin = pkt->tcpWin;
 	    else
-	      bkt->ext->protoCounters.tcp.dst2srcTcpFlags |= tcpFlags, bkt->ext->protoCounters.tcp.dst2srcLastWin = tcpWin;
+	      bkt->ext->protoCounters.tcp.dst2srcTcpFlags |= pkt->tcpFlags, bkt->ext->protoCounters.tcp.dst2srcLastWin = pkt->tcpWin;
 	  }
 	  break;
 
 	case IPPROTO_UDP:
-	  updateApplLatency(proto, bkt, direction, &h->ts);
+	  updateApplLatency(pkt->proto, bkt, direction, &pkt->h->ts);
 	  break;
 	}
 
-	if(((direction == src2dst_direction) && (bkt->core.tuple.flowCounters.bytesSent > BYTES_WRAP_THRESHOLD))
-	   || ((direction == dst2src_direction) && (bkt->core.tuple.flowCounters.bytesRcvd > BYTES_WRAP_THRESHOLD))) {
+	if(((direction == src2dst_direction) && (bkt->core.flowCounters.bytesSent > BYTES_WRAP_THRESHOLD))
+	   || ((direction == dst2src_direction) && (bkt->core.flowCounters.bytesRcvd > BYTES_WRAP_THRESHOLD))) {
 	  /*
 	    The counter has a pretty high value: we better mark this flow as expired
 	    in order to avoid wrapping the counter.
@@ -1891,9 +2067,8 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 
 	if(unlikely(readOnlyGlobals.tracePerformance)) {
 	  ticks diff = getticks() - when;
-	  if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-	  readOnlyGlobals.processingWoFlowCreationTicks += diff, readOnlyGlobals.num_pkts_without_flow_creation++;
-	  if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
+	  readWriteGlobals->threadStats[thread_id].perf.processingWoFlowCreationTicks += diff;
+	  readWriteGlobals->threadStats[thread_id].perf.num_pkts_without_flow_creation++;
 	}
 
 	idleThreadTask(thread_id, 3);
@@ -1905,13 +2080,13 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 	  we better cache some info from it in order to use for the
 	  current flow we will have to create
 	*/
-	ndpi_proto = bkt->core.l7.proto.ndpi.ndpi_proto;
+	ndpi_proto = bkt->ext->cold.l7.proto.ndpi.ndpi_proto;
 	flow_found = 0; /* We need to search another bucket */
       }
     }
 
     /* Bucket not found yet */
-    n++, bkt = bkt->core.hash.next;
+    n++, bkt = nextHashBucket(bkt, &it);
   } /* while */
 
   if(n > readWriteGlobals->maxBucketSearch) {
@@ -1933,16 +2108,16 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 	char buf[256], buf1[256], src_buf[32], dst_buf[32];
 
 	traceEvent(TRACE_NORMAL, "(%u) [%s] %s:%d -> %s:%d [%s -> %s][vlan %d][tos %u/%u/%u][subflowId: %u/0x%04x][idx=%u][expired=%u][hash=%u]",
-		   i, head->core.tuple.key.is_ip_flow ? proto2name(head->core.tuple.key.k.ipKey.proto) : "NonIP",
-		   _intoa(head->core.tuple.key.k.ipKey.src, buf, sizeof(buf)), head->core.tuple.key.k.ipKey.sport,
-		   _intoa(head->core.tuple.key.k.ipKey.dst, buf1, sizeof(buf1)), head->core.tuple.key.k.ipKey.dport,
+		   i, head->ext->tuple.key.is_ip_flow ? proto2name(head->ext->tuple.key.k.ipKey.proto) : "NonIP",
+		   _intoa(head->ext->tuple.key.k.ipKey.src, buf, sizeof(buf)), head->ext->tuple.key.k.ipKey.sport,
+		   _intoa(head->ext->tuple.key.k.ipKey.dst, buf1, sizeof(buf1)), head->ext->tuple.key.k.ipKey.dport,
 		   etheraddr_string(head->ext->srcInfo.macAddress, src_buf),
-		   etheraddr_string(head->ext->dstInfo.macAddress, dst_buf), vlanId,
-		   head->ext->src2dstTos, head->ext->dst2srcTos, tos,
-		   head->ext->subflow_id, head->ext->subflow_id, idx,
+		   etheraddr_string(head->ext->dstInfo.macAddress, dst_buf), pkt->vlanId,
+		   head->core.src2dstTos, head->core.dst2srcTos, pkt->tos,
+		   head->core.subflow_id, head->core.subflow_id, idx,
 		   head->core.bucket_expired,
-		   head->core.tuple.flow_hash);
-	head = head->core.hash.next, i++;
+		   head->core.flow_hash);
+	head = head->core.hash_next, i++;
       }
 #endif
     }
@@ -1952,11 +2127,11 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
       char buf[256], buf1[256];
 
       traceEvent(TRACE_NORMAL, "[maxBucketSearch=%d][thread_id=%u][idx=%u][packet_hash=%u][vlan=%d][%s][%s:%d -> %s:%d][tos=%u]",
-		 readWriteGlobals->maxBucketSearch, thread_id, idx, packet_hash,
-		 vlanId, proto2name(proto),
-		 _intoa(*src, buf, sizeof(buf)), sport,
-		 _intoa(*dst, buf1, sizeof(buf1)), dport,
-		 tos);
+		 readWriteGlobals->maxBucketSearch, thread_id, idx, pkt->packet_hash,
+		 pkt->vlanId, proto2name(pkt->proto),
+		 _intoa(*pkt->src, buf, sizeof(buf)), pkt->sport,
+		 _intoa(*pkt->dst, buf1, sizeof(buf1)), pkt->dport,
+		 pkt->tos);
     }
   }
 
@@ -1966,12 +2141,13 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 #endif
 
   if(bkt == NULL) {
-    if(getAtomic(&readWriteGlobals->bucketsAllocated) >= readOnlyGlobals.maxNumActiveFlows) {
+    if(tooManyActiveFlows(thread_id)
+       || isHashFull(thread_id)) {
       static u_char msgSent = 0;
 
       if(!msgSent) {
 	traceEvent(TRACE_WARNING, "Too many (%u) active flows [threadId=%u][limit=%u] (see -M)",
-		   getAtomic(&readWriteGlobals->bucketsAllocated),
+		   getNumActiveBuckets(),
 		   thread_id, readOnlyGlobals.maxNumActiveFlows);
 	msgSent = 1;
       }
@@ -1981,7 +2157,7 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
       return(bkt);
     }
 
-    bkt = allocFlowBucket(proto, thread_id, mutex_idx, idx);
+    bkt = allocFlowBucket(pkt->proto, thread_id, mutex_idx, idx);
 
     if(bkt == NULL) {
       static u_int8_t once = 0;
@@ -1996,50 +2172,50 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
     }
   }
 
-  bkt->magic = MAGIC_NUMBER;
+  bkt->core.magic = MAGIC_NUMBER;
 
   if(readOnlyGlobals.disableFlowCache)
     setBucketExpired(bkt);
 
-  direction = src2dst_direction, bkt->core.tuple.flow_idx = idx, bkt->core.tuple.flow_hash = packet_hash;
+  direction = src2dst_direction, bkt->ext->tuple.flow_idx = idx, bkt->core.flow_hash = pkt->packet_hash;
 
   /* The settings below are done once per direction (we choosed src -> dst) */
-  if(record && (rx_packet == 1 /* src -> dst */)) {
-    if(record->cisco.nbar2_application_id > 0)
-      bkt->core.l7.proto.collected_application_id = record->cisco.nbar2_application_id, bkt->core.l7.proto_type = NBAR2_PROTO_TYPE;
+  if(pkt->record && (pkt->rx_packet == 1 /* src -> dst */)) {
+    if(pkt->record->cisco.nbar2_application_id > 0)
+      bkt->ext->cold.l7.proto.collected_application_id = pkt->record->cisco.nbar2_application_id, bkt->ext->cold.l7.proto_type = NBAR2_PROTO_TYPE;
 
-    if(record->ixia.l7_application_id > 0)
-      bkt->core.l7.proto.collected_application_id = record->ixia.l7_application_id, bkt->core.l7.proto_type = IXIA_PROTO_TYPE;
+    if(pkt->record->ixia.l7_application_id > 0)
+      bkt->ext->cold.l7.proto.collected_application_id = pkt->record->ixia.l7_application_id, bkt->ext->cold.l7.proto_type = IXIA_PROTO_TYPE;
 
-    if(record->ixia.src_ip_country[0] != '\0')
-      bkt->ext->srcInfo.collected_country_code = strdup(record->ixia.src_ip_country);
+    if(pkt->record->ixia.src_ip_country[0] != '\0')
+      bkt->ext->srcInfo.collected_country_code = strdup(pkt->record->ixia.src_ip_country);
 
-    if(record->ixia.src_ip_city[0] != '\0')
-      bkt->ext->srcInfo.collected_city = strdup(record->ixia.src_ip_city);
+    if(pkt->record->ixia.src_ip_city[0] != '\0')
+      bkt->ext->srcInfo.collected_city = strdup(pkt->record->ixia.src_ip_city);
 
-    if(record->ixia.dst_ip_country[0] != '\0')
-      bkt->ext->dstInfo.collected_country_code = strdup(record->ixia.dst_ip_country);
+    if(pkt->record->ixia.dst_ip_country[0] != '\0')
+      bkt->ext->dstInfo.collected_country_code = strdup(pkt->record->ixia.dst_ip_country);
 
-    if(record->ixia.dst_ip_city[0] != '\0')
-      bkt->ext->dstInfo.collected_city = strdup(record->ixia.dst_ip_city);
+    if(pkt->record->ixia.dst_ip_city[0] != '\0')
+      bkt->ext->dstInfo.collected_city = strdup(pkt->record->ixia.dst_ip_city);
   }
 
-  bkt->ext->lastPktDirection = direction, bkt->core.engine_type = engine_type, bkt->core.engine_id = engine_id;
-  bkt->core.tuple.key.is_gtp_flow = 0;
+  bkt->ext->lastPktDirection = direction, bkt->ext->cold.engine_type = pkt->engine_type, bkt->ext->cold.engine_id = pkt->engine_id;
+  bkt->ext->tuple.key.is_gtp_flow = 0;
 
   if(use_mac_search) {
-    bkt->core.tuple.key.is_ip_flow = 0; /* Mac Flow */
-    memcpy(bkt->core.tuple.key.k.macKey.src, ehdr->ether_shost, 6), memcpy(bkt->core.tuple.key.k.macKey.dst, ehdr->ether_dhost, 6);
+    bkt->ext->tuple.key.is_ip_flow = 0; /* Mac Flow */
+    memcpy(bkt->ext->tuple.key.k.macKey.src, pkt->ehdr->ether_shost, 6), memcpy(bkt->ext->tuple.key.k.macKey.dst, pkt->ehdr->ether_dhost, 6);
   } else {
-    bkt->core.tuple.key.is_ip_flow = 1; /* IP Flow */
-    memcpy(&bkt->core.tuple.key.k.ipKey.src, src, sizeof(HostInfo)), memcpy(&bkt->core.tuple.key.k.ipKey.dst, dst, sizeof(HostInfo));
-    updateHost(&bkt->ext->srcInfo, src, flow_sender_ip, if_input);
-    updateHost(&bkt->ext->dstInfo, dst, 0 /* unknown */, NO_INTERFACE_INDEX);
+    bkt->ext->tuple.key.is_ip_flow = 1; /* IP Flow */
+    memcpy(&bkt->ext->tuple.key.k.ipKey.src, pkt->src, sizeof(IpAddress)), memcpy(&bkt->ext->tuple.key.k.ipKey.dst, pkt->dst, sizeof(IpAddress));
+    updateHost(&bkt->ext->srcInfo, pkt->src, pkt->flow_sender_ip, pkt->if_input);
+    updateHost(&bkt->ext->dstInfo, pkt->dst, 0 /* unknown */, NO_INTERFACE_INDEX);
   }
 
-  if(osi_src && osi_dst && bkt->ext && readOnlyGlobals.enableExtBucket) {
-    bkt->ext->extensions->osi.ssap = strdup(osi_src);
-    bkt->ext->extensions->osi.dsap = strdup(osi_dst);
+  if(pkt->osi_src && pkt->osi_dst && bkt->ext && readOnlyGlobals.enableExtBucket) {
+    bkt->ext->extensions->osi.ssap = strdup(pkt->osi_src);
+    bkt->ext->extensions->osi.dsap = strdup(pkt->osi_dst);
   }
 
   if(readOnlyGlobals.flowSampleRate > 1) {
@@ -2055,100 +2231,96 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
     pthread_rwlock_unlock(&readWriteGlobals->rwGlobalsRwLock);
   }
 
-  bkt->ext->subflow_id = subflow_id, bkt->core.rx_direction.src2dst = rx_packet,
-    bkt->core.tuple.key.k.ipKey.proto = proto, bkt->core.tuple.key.vlanId = vlanId, bkt->ext->src2dst_tunnel_id = tunnel_id,
-    bkt->core.tuple.key.k.ipKey.sport = sport, bkt->core.tuple.key.k.ipKey.dport = dport,
-    bkt->ext->srcInfo.asn = src_as, bkt->ext->dstInfo.asn = dst_as,
-    bkt->ext->srcInfo.mask = src_mask, bkt->ext->dstInfo.mask = dst_mask;
+  memcpy(&bkt->ext->tuple.lookup, &key, sizeof(FlowKey));
+  memcpy(bkt->core.lookup, &key, FLOW_KEY_SHORT_LEN);
+  bkt->core.key_type = key_type, bkt->core.key_swapped = key_swapped;
+  bkt->core.src2dstTos = bkt->core.dst2srcTos = 0;
+
+  bkt->core.subflow_id = pkt->subflow_id, bkt->core.rx_direction.src2dst = pkt->rx_packet,
+    bkt->ext->tuple.key.k.ipKey.proto = pkt->proto, bkt->ext->tuple.key.vlanId = pkt->vlanId, bkt->ext->src2dst_tunnel_id = pkt->tunnel_id,
+    bkt->ext->tuple.key.k.ipKey.sport = pkt->sport, bkt->ext->tuple.key.k.ipKey.dport = pkt->dport,
+    bkt->ext->srcInfo.asn = pkt->src_as, bkt->ext->dstInfo.asn = pkt->dst_as,
+    bkt->ext->srcInfo.mask = pkt->src_mask, bkt->ext->dstInfo.mask = pkt->dst_mask;
 
   if(readOnlyGlobals.enable_l7_protocol_discovery
-     && (bkt->core.l7.proto_type == NO_PROTO_TYPE)) {
-    if(gtp_offset > 0)
+     && (bkt->ext->cold.l7.proto_type == NO_PROTO_TYPE)) {
+    if(pkt->gtp_offset > 0)
       ndpi_proto = NDPI_PROTOCOL_GTP;
     else if(ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
-      ndpi_proto = find_lru_cache_num(&readWriteGlobals->l7Cache, bkt->core.tuple.flow_hash);
+      ndpi_proto = find_lru_cache_num(&readWriteGlobals->l7Cache, bkt->core.flow_hash);
 
     setnDPIProto(bkt, ndpi_proto);
   }
 
   /* Tunnels */
   if(readOnlyGlobals.tunnel_mode) {
-    if(bkt->ext->extensions && untunneled_src && untunneled_dst) {
-      memcpy(&bkt->ext->extensions->untunneled.src, untunneled_src, sizeof(IpAddress));
-      memcpy(&bkt->ext->extensions->untunneled.dst, untunneled_dst, sizeof(IpAddress));
-      bkt->ext->extensions->untunneled.proto = untunneled_proto;
-      bkt->ext->extensions->untunneled.sport = untunneled_sport, bkt->ext->extensions->untunneled.dport = untunneled_dport;
+    if(bkt->ext->extensions && pkt->untunneled_src && pkt->untunneled_dst) {
+      memcpy(&bkt->ext->extensions->untunneled.src, pkt->untunneled_src, sizeof(IpAddress));
+      memcpy(&bkt->ext->extensions->untunneled.dst, pkt->untunneled_dst, sizeof(IpAddress));
+      bkt->ext->extensions->untunneled.proto = pkt->untunneled_proto;
+      bkt->ext->extensions->untunneled.sport = pkt->untunneled_sport, bkt->ext->extensions->untunneled.dport = pkt->untunneled_dport;
     }
   }
 
-  if(unlikely(readOnlyGlobals.handle_l2 && (ehdr != NULL))) {
-    memcpy(bkt->ext->srcInfo.macAddress, (char *)ESRC(ehdr), 6);
-    memcpy(bkt->ext->dstInfo.macAddress, (char *)EDST(ehdr), 6);
+  if(unlikely(readOnlyGlobals.handle_l2 && (pkt->ehdr != NULL))) {
+    memcpy(bkt->ext->srcInfo.macAddress, (char *)ESRC(pkt->ehdr), 6);
+    memcpy(bkt->ext->dstInfo.macAddress, (char *)EDST(pkt->ehdr), 6);
   }
 
-  bkt->ext->if_input = if_input, bkt->ext->if_output = if_output,
-    bkt->core.tuple.flowTimers.firstSeenSent.tv_sec = firstSeen.tv_sec, bkt->core.tuple.flowTimers.lastSeenSent.tv_sec = h->ts.tv_sec,
-    bkt->core.tuple.flowTimers.firstSeenSent.tv_usec = firstSeen.tv_usec, bkt->core.tuple.flowTimers.lastSeenSent.tv_usec = h->ts.tv_usec;
-  bkt->core.tuple.flowTimers.firstSeenRcvd.tv_sec = bkt->core.tuple.flowTimers.lastSeenRcvd.tv_sec = 0,
-    bkt->core.tuple.flowTimers.firstSeenRcvd.tv_usec = bkt->core.tuple.flowTimers.lastSeenRcvd.tv_usec = 0;
-  bkt->core.tuple.flowCounters.bytesSent += realLen, bkt->core.tuple.flowCounters.pktSent += numPkts;
-
-  // traceEvent(TRACE_NORMAL, "-> %u/%u [%u]\n", realLen, realLen+14, bkt->core.tuple.flowCounters.bytesRcvd+bkt->core.tuple.flowCounters.bytesSent);
-  if(numFragments > 0) bkt->ext->flowCounters.sentFragPkts += numFragments;
-
-  updatePktLenStats(bkt, direction, &h->ts, h->len, ttl, numPkts);
-  updateTTL(bkt, 0, ttl);
-  if(tos != 0) updateTos(bkt, 0, tos);
-  if(proto == IPPROTO_TCP) {
-    updateTcpFlags(bkt, src2dst_direction, &h->ts, tcpFlags, tcpMaxSegmentSize, tcpWinScale);
-    updateTcpSeq(&h->ts, bkt, src2dst_direction, tcpFlags, tcpSeqNum, tcpAckNum, originalPayloadLen, tcpWin, h, p, len);
-  } else if(proto == IPPROTO_UDP)
-    updateApplLatency(proto, bkt, src2dst_direction, &h->ts);
-  else if((proto == IPPROTO_ICMP) || (proto == IPPROTO_ICMPV6)) {
-    u_int16_t val = (256 * icmpType) + icmpCode;
+  bkt->ext->if_input = pkt->if_input, bkt->ext->if_output = pkt->if_output,
+    bkt->ext->tuple.flowTimers.firstSeenSent.tv_sec = firstSeen.tv_sec, bkt->ext->tuple.flowTimers.lastSeenSent.tv_sec = pkt->h->ts.tv_sec,
+    bkt->ext->tuple.flowTimers.firstSeenSent.tv_usec = firstSeen.tv_usec, bkt->ext->tuple.flowTimers.lastSeenSent.tv_usec = pkt->h->ts.tv_usec;
+  bkt->ext->tuple.flowTimers.firstSeenRcvd.tv_sec = bkt->ext->tuple.flowTimers.lastSeenRcvd.tv_sec = 0,
+    bkt->ext->tuple.flowTimers.firstSeenRcvd.tv_usec = bkt->ext->tuple.flowTimers.lastSeenRcvd.tv_usec = 0;
+  bkt->core.flowCounters.bytesSent += realLen, bkt->core.flowCounters.pktSent += pkt->numPkts;
+
+  // traceEvent(TRACE_NORMAL, "-> %u/%u [%u]\n", realLen, realLen+14, bkt->core.flowCounters.bytesRcvd+bkt->core.flowCounters.bytesSent);
+  if(pkt->numFragments > 0) bkt->ext->flowCounters.sentFragPkts += pkt->numFragments;
+
+  updatePktLenStats(bkt, direction, &pkt->h->ts, pkt->h->len, pkt->ttl, pkt->numPkts);
+  updateTTL(bkt, 0, pkt->ttl);
+  if(pkt->tos != 0) updateTos(bkt, 0, pkt->tos);
+  if(pkt->proto == IPPROTO_TCP) {
+    updateTcpFlags(bkt, src2dst_direction, &pkt->h->ts, pkt->tcpFlags, pkt->tcpMaxSegmentSize, pkt->tcpWinScale);
+    updateTcpSeq(&pkt->h->ts, bkt, src2dst_direction, pkt->tcpFlags, pkt->tcpSeqNum, pkt->tcpAckNum, pkt->originalPayloadLen, pkt->tcpWin, pkt->h, pkt->p, pkt->len);
+  } else if(pkt->proto == IPPROTO_UDP)
+    updateApplLatency(pkt->proto, bkt, src2dst_direction, &pkt->h->ts);
+  else if((pkt->proto == IPPROTO_ICMP) || (pkt->proto == IPPROTO_ICMPV6)) {
+    u_int16_t val = (256 * pkt->icmpType) + pkt->icmpCode;
 
     /* We "& 0x7F" as with IPv6 the codes will exceed the bitmask */
     if(direction == src2dst_direction) {
       bkt->ext->protoCounters.icmp.src2dstIcmpType = val;
-      NPROBE_FD_SET(icmpType & 0x7F, &bkt->ext->protoCounters.icmp.src2dstIcmpFlags);
+      NPROBE_FD_SET(pkt->icmpType & 0x7F, &bkt->ext->protoCounters.icmp.src2dstIcmpFlags);
     } else {
       bkt->ext->protoCounters.icmp.dst2srcIcmpType = val;
-      NPROBE_FD_SET(icmpType & 0x7F, &bkt->ext->protoCounters.icmp.dst2srcIcmpFlags);
+      NPROBE_FD_SET(pkt->icmpType & 0x7F, &bkt->ext->protoCounters.icmp.dst2srcIcmpFlags);
     }
   }
 
   if(readOnlyGlobals.enable_l7_protocol_discovery)
-    setPayload(bkt, h, p, ip_offset, payload, payloadLen, 0);
+    setPayload(bkt, pkt->h, pkt->p, pkt->ip_offset, pkt->payload, pkt->payloadLen, 0);
 
-  bkt->ext->protoCounters.tcp.src2dstTcpFlags |= tcpFlags;
+  bkt->ext->protoCounters.tcp.src2dstTcpFlags |= pkt->tcpFlags;
 
 #if 0
-  if(bkt->ext->extensions && (numMplsLabels > 0)) {
+  if(bkt->ext->extensions && (pkt->numMplsLabels > 0)) {
     bkt->ext->extensions->mplsInfo = malloc(sizeof(struct mpls_labels));
 
     if(bkt->ext->extensions->mplsInfo) {
-      bkt->ext->extensions->mplsInfo->numMplsLabels = numMplsLabels;
-      memcpy(bkt->ext->extensions->mplsInfo->mplsLabels, mplsLabels,
+      bkt->ext->extensions->mplsInfo->numMplsLabels = pkt->numMplsLabels;
+      memcpy(bkt->ext->extensions->mplsInfo->mplsLabels, pkt->mplsLabels,
 	     MAX_NUM_MPLS_LABELS*MPLS_LABEL_LEN);
     } else
       traceEvent(TRACE_ERROR, "NULL bkt (not enough memory?)");
   }
 #endif
 
-  if(unlikely((bkt->core.tuple.key.is_ip_flow == 1)
+  if(unlikely((bkt->ext->tuple.key.is_ip_flow == 1)
 	      && (readOnlyGlobals.num_active_plugins > 0)))
-    pluginCallback(CREATE_FLOW_CALLBACK, packet_if_idx,
-		   bkt, src2dst_direction /* direction */,
-		   ip_offset, proto, (numFragments > 0) ? 1 : 0,
-		   numPkts,  tos, 0,
-		   vlanId, ehdr,
-		   src,  sport,
-		   dst,  dport, len,
-		   tcpFlags, tcpSeqNum,
-		   icmpType, numMplsLabels,
-		   mplsLabels, h, p, payload, payloadLen);
-
-  addToList(bkt, &readWriteGlobals->theFlowHash[thread_id][idx]);
+    pluginCallback(CREATE_FLOW_CALLBACK, bkt, src2dst_direction /* direction */, pkt);
+
+  addHashBucket(thread_id, idx, pkt->packet_hash, bkt);
 
 #ifdef DEBUG_EXPORT
   traceEvent(TRACE_INFO, "Bucket added");
@@ -2164,24 +2336,24 @@ static void updateTcpFlags(FlowHashBucket *bkt, FlowDirection direction,
 	       "[idx=%u]"
 	       // "[packet_hash=%u]"
 	       ,
-	       bkt->core.tuple.key.is_ip_flow ? proto2name(proto) : "NonIP",
-	       _intoa(*src, buf, sizeof(buf)), sport,
-	       _intoa(*dst, buf1, sizeof(buf1)), dport,
+	       bkt->ext->tuple.key.is_ip_flow ? proto2name(pkt->proto) : "NonIP",
+	       _intoa(*pkt->src, buf, sizeof(buf)), pkt->sport,
+	       _intoa(*pkt->dst, buf1, sizeof(buf1)), pkt->dport,
 	       etheraddr_string(bkt->ext->srcInfo.macAddress, src_buf),
 	       etheraddr_string(bkt->ext->dstInfo.macAddress, dst_buf),
-	       vlanId, tos, bkt->ext->if_input, bkt->ext->if_output,
-	       bkt->ext->subflow_id, bkt->ext->subflow_id
+	       pkt->vlanId, pkt->tos, bkt->ext->if_input, bkt->ext->if_output,
+	       bkt->core.subflow_id, bkt->core.subflow_id
 	       , idx //, packet_hash
 	       );
   }
 
+  armFlowTimer(thread_id, bkt);
   hash_unlock(__FILE__, __LINE__, thread_id, mutex_idx);
 
   if(unlikely(readOnlyGlobals.tracePerformance)) {
     ticks diff = getticks() - when;
-    if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-    readOnlyGlobals.processingWithFlowCreationTicks += diff, readOnlyGlobals.num_pkts_with_flow_creation++;
-    if(unlikely(readOnlyGlobals.useLocks)) pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
+    readWriteGlobals->threadStats[thread_id].perf.processingWithFlowCreationTicks += diff;
+    readWriteGlobals->threadStats[thread_id].perf.num_pkts_with_flow_creation++;
   }
 
   return(bkt);
@@ -2273,11 +2445,11 @@ void printFlow(FlowHashBucket *theFlow, FlowDirection direction) {
 	         timeval2ms(&theFlow->ext->extensions->dst2srcApplLatency));
     }
 
-    if((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_ICMP) || (theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_ICMPV6)) {
+    if((theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_ICMP) || (theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_ICMPV6)) {
       if(direction == src2dst_direction)
-        printICMPflags(theFlow->core.tuple.key.k.ipKey.proto, theFlow->ext->protoCounters.icmp.src2dstIcmpFlags, icmpBuf, sizeof(icmpBuf));
+        printICMPflags(theFlow->ext->tuple.key.k.ipKey.proto, theFlow->ext->protoCounters.icmp.src2dstIcmpFlags, icmpBuf, sizeof(icmpBuf));
       else
-        printICMPflags(theFlow->core.tuple.key.k.ipKey.proto, theFlow->ext->protoCounters.icmp.dst2srcIcmpFlags, icmpBuf, sizeof(icmpBuf));
+        printICMPflags(theFlow->ext->tuple.key.k.ipKey.proto, theFlow->ext->protoCounters.icmp.dst2srcIcmpFlags, icmpBuf, sizeof(icmpBuf));
     }
 
     if(theFlow->ext->src2dst_tunnel_id == 0)
@@ -2286,37 +2458,37 @@ void printFlow(FlowHashBucket *theFlow, FlowDirection direction) {
       snprintf(tunnelStr, sizeof(tunnelStr), "[TunnelId 0x%08X/0x%08X]",
 	       theFlow->ext->src2dst_tunnel_id, theFlow->ext->dst2src_tunnel_id);
 
-    if(theFlow->ext->subflow_id == 0)
+    if(theFlow->core.subflow_id == 0)
       subflowStr[0] = '\0';
     else
       snprintf(subflowStr, sizeof(subflowStr), "[SubflowId %u]",
-	       theFlow->ext->subflow_id);
+	       theFlow->core.subflow_id);
   }
 
-  if((theFlow->core.tuple.key.vlanId == 0) || (theFlow->core.tuple.key.vlanId == NO_VLAN))
+  if((theFlow->ext->tuple.key.vlanId == 0) || (theFlow->ext->tuple.key.vlanId == NO_VLAN))
     vlanStr[0] = '\0';
   else
-    snprintf(vlanStr, sizeof(vlanStr), "[VLAN %u]", theFlow->core.tuple.key.vlanId);
+    snprintf(vlanStr, sizeof(vlanStr), "[VLAN %u]", theFlow->ext->tuple.key.vlanId);
 
   if(readOnlyGlobals.enable_l7_protocol_discovery)
     snprintf(l7proto, sizeof(l7proto), "[%s/%d]",
-	     getProtoName(theFlow->core.l7.proto.ndpi.ndpi_proto),
-	     theFlow->core.l7.proto.ndpi.ndpi_proto);
+	     getProtoName(theFlow->ext->cold.l7.proto.ndpi.ndpi_proto),
+	     theFlow->ext->cold.l7.proto.ndpi.ndpi_proto);
 
-  if(theFlow->core.tuple.key.is_ip_flow) {
-    buf  = _intoa(theFlow->core.tuple.key.k.ipKey.src, _buf, sizeof(_buf));
-    buf1 = _intoa(theFlow->core.tuple.key.k.ipKey.dst, _buf1, sizeof(_buf1));
+  if(theFlow->ext->tuple.key.is_ip_flow) {
+    buf  = _intoa(theFlow->ext->tuple.key.k.ipKey.src, _buf, sizeof(_buf));
+    buf1 = _intoa(theFlow->ext->tuple.key.k.ipKey.dst, _buf1, sizeof(_buf1));
   } else {
-    buf  = etheraddr_string(theFlow->core.tuple.key.k.macKey.src, _buf);
-    buf1 = etheraddr_string(theFlow->core.tuple.key.k.macKey.dst, _buf1);
+    buf  = etheraddr_string(theFlow->ext->tuple.key.k.macKey.src, _buf);
+    buf1 = etheraddr_string(theFlow->ext->tuple.key.k.macKey.dst, _buf1);
   }
 
-  proto_name = theFlow->core.tuple.key.is_ip_flow ? proto2name(theFlow->core.tuple.key.k.ipKey.proto) : "NonIP";
+  proto_name = theFlow->ext->tuple.key.is_ip_flow ? proto2name(theFlow->ext->tuple.key.k.ipKey.proto) : "NonIP";
 
   if(direction == src2dst_direction) {
     char *initiator = "Unknown";
 
-    if((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) && (theFlow->ext != NULL)) {
+    if(theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) {
       if(theFlow->ext->beginInitiator == src2dst_direction)
 	initiator = buf;
       else if(theFlow->ext->beginInitiator == dst2src_direction)
@@ -2324,42 +2496,42 @@ void printFlow(FlowHashBucket *theFlow, FlowDirection direction) {
     }
 
     time_diff = (readOnlyGlobals.flowCollection.collectorInPort > 0) ? 0 :
-      (float)msTimeDiff(&theFlow->core.tuple.flowTimers.lastSeenSent,
-			&theFlow->core.tuple.flowTimers.firstSeenSent)/1000;
+      (float)msTimeDiff(&theFlow->ext->tuple.flowTimers.lastSeenSent,
+			&theFlow->ext->tuple.flowTimers.firstSeenSent)/1000;
 
-    if(theFlow->core.tuple.key.is_gtp_flow) {
+    if(theFlow->ext->tuple.key.is_gtp_flow) {
       traceEvent(TRACE_INFO, "Emitting Flow: [->][gtp_teid=%04X][%u pkt/%u bytes]",
-		 theFlow->core.tuple.key.k.gtpKey.teid,
-		 (int)theFlow->core.tuple.flowCounters.pktSent, (int)theFlow->core.tuple.flowCounters.bytesSent);
+		 theFlow->ext->tuple.key.k.gtpKey.teid,
+		 (int)theFlow->core.flowCounters.pktSent, (int)theFlow->core.flowCounters.bytesSent);
     } else {
       if(!readOnlyGlobals.bidirectionalFlows)
 	traceEvent(TRACE_INFO, "Emitting Flow: [->][%s] %s:%d -> %s:%d %s[%u pkt/%u bytes][ifIdx %d->%d][%.1f sec]%s%s%s%s%s%s%s%s[init %s]",
-		   proto_name, buf, theFlow->core.tuple.key.k.ipKey.sport,
-		   buf1, theFlow->core.tuple.key.k.ipKey.dport,
+		   proto_name, buf, theFlow->ext->tuple.key.k.ipKey.sport,
+		   buf1, theFlow->ext->tuple.key.k.ipKey.dport,
 		   subflowStr,
-		   (int)theFlow->core.tuple.flowCounters.pktSent, (int)theFlow->core.tuple.flowCounters.bytesSent,
+		   (int)theFlow->core.flowCounters.pktSent, (int)theFlow->core.flowCounters.bytesSent,
 		   theFlow->ext ? theFlow->ext->if_input : 0,
 		   theFlow->ext ? theFlow->ext->if_output : 0, time_diff,
 		   latBuf, applLatBuf, jitterStr, icmpBuf, fragmented, vlanStr, tunnelStr, l7proto, initiator);
       else
 	traceEvent(TRACE_INFO, "Emitting Flow: [<->][%s] %s:%d -> %s:%d %s[%u/%u pkt][%u/%u bytes][ifIdx %d<->%d][%.1f sec]%s%s%s%s%s%s%s%s[init %s]",
-		   proto_name, buf, theFlow->core.tuple.key.k.ipKey.sport,
-		   buf1, theFlow->core.tuple.key.k.ipKey.dport,
+		   proto_name, buf, theFlow->ext->tuple.key.k.ipKey.sport,
+		   buf1, theFlow->ext->tuple.key.k.ipKey.dport,
 		   subflowStr,
-		   (int)theFlow->core.tuple.flowCounters.pktSent, (int)theFlow->core.tuple.flowCounters.pktRcvd,
-		   (int)theFlow->core.tuple.flowCounters.bytesSent, (int)theFlow->core.tuple.flowCounters.bytesRcvd,
+		   (int)theFlow->core.flowCounters.pktSent, (int)theFlow->core.flowCounters.pktRcvd,
+		   (int)theFlow->core.flowCounters.bytesSent, (int)theFlow->core.flowCounters.bytesRcvd,
 		   theFlow->ext ? theFlow->ext->if_input : 0,
 		   theFlow->ext ? theFlow->ext->if_output : 0, time_diff,
 		   latBuf, applLatBuf, jitterStr, icmpBuf, fragmented, vlanStr, tunnelStr, l7proto, initiator);
     }
   } else {
-    time_diff = (readOnlyGlobals.flowCollection.collectorInPort > 0) ? 0 : (float)msTimeDiff(&theFlow->core.tuple.flowTimers.lastSeenRcvd,
-									      &theFlow->core.tuple.flowTimers.firstSeenRcvd)/1000;
+    time_diff = (readOnlyGlobals.flowCollection.collectorInPort > 0) ? 0 : (float)msTimeDiff(&theFlow->ext->tuple.flowTimers.lastSeenRcvd,
+									      &theFlow->ext->tuple.flowTimers.firstSeenRcvd)/1000;
 
     traceEvent(TRACE_INFO, "Emitting Flow: [<-][%s] %s:%d -> %s:%d %s[%u pkt/%u bytes][ifIdx %d->%d][%.1f sec]%s%s%s%s%s%s%s%s",
-	       proto_name, buf1, theFlow->core.tuple.key.k.ipKey.dport,
-	       buf, theFlow->core.tuple.key.k.ipKey.sport, subflowStr,
-	       (int)theFlow->core.tuple.flowCounters.pktRcvd, (int)theFlow->core.tuple.flowCounters.bytesRcvd,
+	       proto_name, buf1, theFlow->ext->tuple.key.k.ipKey.dport,
+	       buf, theFlow->ext->tuple.key.k.ipKey.sport, subflowStr,
+	       (int)theFlow->core.flowCounters.pktRcvd, (int)theFlow->core.flowCounters.bytesRcvd,
 	       theFlow->ext ? theFlow->ext->if_output : 0,
 	       theFlow->ext ? theFlow->ext->if_input : 0, time_diff,
 	       latBuf, applLatBuf, jitterStr, icmpBuf, fragmented, vlanStr, tunnelStr, l7proto);
@@ -2380,32 +2552,32 @@ u_int8_t endTcpFlow(unsigned short flags) {
 
 int isFlowExpired(FlowHashBucket *myBucket, time_t theTime) {
   if(!myBucket->core.bucket_expired) {
-    if((theTime < myBucket->core.tuple.flowTimers.lastSeenSent.tv_sec)
-       || (theTime < myBucket->core.tuple.flowTimers.lastSeenRcvd.tv_sec))
+    if((theTime < myBucket->ext->tuple.flowTimers.lastSeenSent.tv_sec)
+       || (theTime < myBucket->ext->tuple.flowTimers.lastSeenRcvd.tv_sec))
       return(0); /* Too early */
   }
 
   if(myBucket->core.bucket_expired /* Forced expire */
-     || ((theTime-myBucket->core.tuple.flowTimers.lastSeenSent.tv_sec) >= readOnlyGlobals.idleTimeout)      /* flow expired: data not sent for a while */
-     || ((myBucket->core.tuple.do_not_expire_for_max_duration == 0)
-	 && ((theTime-myBucket->core.tuple.flowTimers.firstSeenSent.tv_sec) >= readOnlyGlobals.lifetimeTimeout)  /* flow expired: flow active but too old   */
+     || ((theTime-myBucket->ext->tuple.flowTimers.lastSeenSent.tv_sec) >= readOnlyGlobals.idleTimeout)      /* flow expired: data not sent for a while */
+     || ((myBucket->ext->tuple.do_not_expire_for_max_duration == 0)
+	 && ((theTime-myBucket->ext->tuple.flowTimers.firstSeenSent.tv_sec) >= readOnlyGlobals.lifetimeTimeout)  /* flow expired: flow active but too old   */
 	 )
-     || ((myBucket->core.tuple.flowCounters.pktRcvd > 0)
-	 && (((theTime-myBucket->core.tuple.flowTimers.lastSeenRcvd.tv_sec) >= readOnlyGlobals.idleTimeout)  /* flow expired: data not sent for a while */
-	     || ((myBucket->core.tuple.do_not_expire_for_max_duration == 0)
-		 && ((theTime-myBucket->core.tuple.flowTimers.firstSeenRcvd.tv_sec) >= readOnlyGlobals.lifetimeTimeout))
+     || ((myBucket->core.flowCounters.pktRcvd > 0)
+	 && (((theTime-myBucket->ext->tuple.flowTimers.lastSeenRcvd.tv_sec) >= readOnlyGlobals.idleTimeout)  /* flow expired: data not sent for a while */
+	     || ((myBucket->ext->tuple.do_not_expire_for_max_duration == 0)
+		 && ((theTime-myBucket->ext->tuple.flowTimers.firstSeenRcvd.tv_sec) >= readOnlyGlobals.lifetimeTimeout))
 	     ))  /* flow expired: flow active but too old   */
-     || ((myBucket->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) && (theTime-myBucket->core.tuple.flowTimers.lastSeenSent.tv_sec > 10 /* sec */)
-	 && (myBucket->ext && endTcpFlow(myBucket->ext->protoCounters.tcp.src2dstTcpFlags))
-	 && (myBucket->ext && endTcpFlow(myBucket->ext->protoCounters.tcp.dst2srcTcpFlags)))
+     || ((myBucket->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) && (theTime-myBucket->ext->tuple.flowTimers.lastSeenSent.tv_sec > 10 /* sec */)
+	 && endTcpFlow(myBucket->ext->protoCounters.tcp.src2dstTcpFlags)
+	 && endTcpFlow(myBucket->ext->protoCounters.tcp.dst2srcTcpFlags))
      /* Checks for avoiding that bad time on received flows
 	(e.g. via logs) can create problems with export */
-     || (theTime < myBucket->core.tuple.flowTimers.lastSeenSent.tv_sec)
-     || ((myBucket->core.tuple.flowCounters.pktRcvd > 0)
-	 && (theTime < myBucket->core.tuple.flowTimers.lastSeenRcvd.tv_sec))
+     || (theTime < myBucket->ext->tuple.flowTimers.lastSeenSent.tv_sec)
+     || ((myBucket->core.flowCounters.pktRcvd > 0)
+	 && (theTime < myBucket->ext->tuple.flowTimers.lastSeenRcvd.tv_sec))
      /* This should not happen but let's take into account */
-     || (theTime < myBucket->core.tuple.flowTimers.firstSeenSent.tv_sec)
-     || (theTime < myBucket->core.tuple.flowTimers.firstSeenRcvd.tv_sec)
+     || (theTime < myBucket->ext->tuple.flowTimers.firstSeenSent.tv_sec)
+     || (theTime < myBucket->ext->tuple.flowTimers.firstSeenRcvd.tv_sec)
      ) {
     return(1);
   } else {
@@ -2418,11 +2590,11 @@ int isFlowExpired(FlowHashBucket *myBucket, time_t theTime) {
 
 int isFlowExpiredSinceTooLong(FlowHashBucket *myBucket, time_t theTime) {
   if(myBucket->core.bucket_expired /* Forced expire */
-     || ((theTime-myBucket->core.tuple.flowTimers.lastSeenSent.tv_sec)  >= 2*readOnlyGlobals.idleTimeout)      /* flow expired: data not sent for a while */
-     || ((theTime-myBucket->core.tuple.flowTimers.firstSeenSent.tv_sec) >= 2*readOnlyGlobals.lifetimeTimeout)  /* flow expired: flow active but too old   */
-     || ((myBucket->core.tuple.flowCounters.pktRcvd > 0)
-	 && (((theTime-myBucket->core.tuple.flowTimers.lastSeenRcvd.tv_sec) >= 2*readOnlyGlobals.idleTimeout)  /* flow expired: data not sent for a while */
-	     || ((theTime-myBucket->core.tuple.flowTimers.firstSeenRcvd.tv_sec) >= 2*readOnlyGlobals.lifetimeTimeout)))  /* flow expired: flow active but too old   */
+     || ((theTime-myBucket->ext->tuple.flowTimers.lastSeenSent.tv_sec)  >= 2*readOnlyGlobals.idleTimeout)      /* flow expired: data not sent for a while */
+     || ((theTime-myBucket->ext->tuple.flowTimers.firstSeenSent.tv_sec) >= 2*readOnlyGlobals.lifetimeTimeout)  /* flow expired: flow active but too old   */
+     || ((myBucket->core.flowCounters.pktRcvd > 0)
+	 && (((theTime-myBucket->ext->tuple.flowTimers.lastSeenRcvd.tv_sec) >= 2*readOnlyGlobals.idleTimeout)  /* flow expired: data not sent for a while */
+	     || ((theTime-myBucket->ext->tuple.flowTimers.firstSeenRcvd.tv_sec) >= 2*readOnlyGlobals.lifetimeTimeout)))  /* flow expired: flow active but too old   */
      ) {
     return(1);
   } else {
@@ -2434,10 +2606,10 @@ int isFlowExpiredSinceTooLong(FlowHashBucket *myBucket, time_t theTime) {
 /* ****************************************************** */
 
 void printBucket(FlowHashBucket *myBucket) {
-  int a = time(NULL)-myBucket->core.tuple.flowTimers.firstSeenSent.tv_sec;
-  int b = time(NULL)-myBucket->core.tuple.flowTimers.lastSeenSent.tv_sec;
-  int c = myBucket->core.tuple.flowCounters.bytesRcvd ? time(NULL)-myBucket->core.tuple.flowTimers.firstSeenRcvd.tv_sec : 0;
-  int d = myBucket->core.tuple.flowCounters.bytesRcvd ? time(NULL)-myBucket->core.tuple.flowTimers.lastSeenRcvd.tv_sec : 0;
+  int a = time(NULL)-myBucket->ext->tuple.flowTimers.firstSeenSent.tv_sec;
+  int b = time(NULL)-myBucket->ext->tuple.flowTimers.lastSeenSent.tv_sec;
+  int c = myBucket->core.flowCounters.bytesRcvd ? time(NULL)-myBucket->ext->tuple.flowTimers.firstSeenRcvd.tv_sec : 0;
+  int d = myBucket->core.flowCounters.bytesRcvd ? time(NULL)-myBucket->ext->tuple.flowTimers.lastSeenRcvd.tv_sec : 0;
 
 #ifdef DEBUG
   if((a > 30) || (b>30) || (c>30) || (d>30))
@@ -2446,11 +2618,11 @@ void printBucket(FlowHashBucket *myBucket) {
       char str[128], str1[128];
 
       printf("[%4s] %s:%d [%u pkts] <-> %s:%d [%u pkts] [FsSent=%d][LsSent=%d][FsRcvd=%d][LsRcvd=%d]\n",
-	     proto2name(myBucket->core.tuple.key.k.ipKey.proto),
-	     _intoa(myBucket->core.tuple.key.k.ipKey.src, str, sizeof(str)),
-	     myBucket->core.tuple.key.k.ipKey.sport, myBucket->core.tuple.flowCounters.pktSent,
-	     _intoa(myBucket->core.tuple.key.k.ipKey.dst, str1, sizeof(str1)),
-	     myBucket->core.tuple.key.k.ipKey.dport, myBucket->core.tuple.flowCounters.pktRcvd,
+	     proto2name(myBucket->ext->tuple.key.k.ipKey.proto),
+	     _intoa(myBucket->ext->tuple.key.k.ipKey.src, str, sizeof(str)),
+	     myBucket->ext->tuple.key.k.ipKey.sport, myBucket->core.flowCounters.pktSent,
+	     _intoa(myBucket->ext->tuple.key.k.ipKey.dst, str1, sizeof(str1)),
+	     myBucket->ext->tuple.key.k.ipKey.dport, myBucket->core.flowCounters.pktRcvd,
 	     a, b, c, d);
     }
 }
@@ -2459,9 +2631,9 @@ void printBucket(FlowHashBucket *myBucket) {
 
 /* NOTE: this function should not be called by a separate thread */
 void walkHash(u_int32_t thread_id, int flushHash) {
-  if(readWriteGlobals->expireFlowListHead[thread_id] != NULL) {
+  if(readWriteGlobals->flowTimers[thread_id].num_timers > 0) {
     if(flushHash) traceEvent(TRACE_NORMAL, "About to flush hash (threadId %d)", thread_id);
-    walkHashList(thread_id, flushHash, readWriteGlobals->now);
+    expireFlowTimers(thread_id, flushHash);
     if(flushHash) traceEvent(TRACE_NORMAL, "Completed hash walk (thread %d)", thread_id);
   }
 }
@@ -2534,19 +2706,11 @@ void close_dump_file() {
 /* ****************************************************** */
 
 #ifdef HAVE_GEOIP
-void geoLocate(IpAddress *addr, HostInfo *bkt) {
+void geoLocate(struct geoCache *cache, IpAddress *addr, HostInfo *bkt) {
   if((readOnlyGlobals.geo_ip_city_db == NULL) || (bkt->geo != NULL))
     return;
 
-  pthread_rwlock_wrlock(&readWriteGlobals->geoipRwLock);
-  if(addr->ipVersion == 4)
-    bkt->geo = GeoIP_record_by_ipnum(readOnlyGlobals.geo_ip_city_db, addr->ipType.ipv4);
-#ifdef HAVE_GEOIP_IPv6
-  else if((addr->ipVersion == 6) && readOnlyGlobals.geo_ip_city_db_v6)
-    bkt->geo = GeoIP_record_by_ipnum_v6(readOnlyGlobals.geo_ip_city_db_v6, addr->ipType.ipv6);
-#endif
-
-  pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
+  bkt->geo = (cache != NULL) ? geoCacheGetRecord(cache, addr) : geoIpGetRecord(addr);
 }
 #endif
 
@@ -2567,22 +2731,22 @@ void dumpFlowToCache(FlowHashBucket *myBucket) {
   // traceEvent(TRACE_ERROR, "==>>> %s(%d)", __FUNCTION__, readOnlyGlobals.imsi_aggregation_enabled);
 
   if(readOnlyGlobals.imsi_aggregation_enabled) {
-    //if(myBucket->core.user.username) traceEvent(TRACE_ERROR, "==>>> %s", myBucket->core.user.username);
-    if(myBucket->core.user.username
-       && (myBucket->core.user.username[16] == ';' /* IMSI "284031100221392;1000;12373;0" */)) {
+    //if(myBucket->ext->cold.user.username) traceEvent(TRACE_ERROR, "==>>> %s", myBucket->ext->cold.user.username);
+    if(myBucket->ext->cold.user.username
+       && (myBucket->ext->cold.user.username[16] == ';' /* IMSI "284031100221392;1000;12373;0" */)) {
       char imsi[16], key[64];
       const u_int aggregation_time = 300 /* 5 min */;
       struct timeval *begin_time = getFlowBeginTime(myBucket, src2dst_direction);
 
-      strncpy(imsi, &myBucket->core.user.username[1], 15);
+      strncpy(imsi, &myBucket->ext->cold.user.username[1], 15);
       imsi[15] = '\0';
       snprintf(key, sizeof(key)-1, "%u.%s.%s",
 	       (unsigned int)(begin_time->tv_sec - (begin_time->tv_sec % aggregation_time)),
-	       imsi, getProtoName(myBucket->core.l7.proto.ndpi.ndpi_proto));
+	       imsi, getProtoName(myBucket->ext->cold.l7.proto.ndpi.ndpi_proto));
 
       incrCacheHashKeyValueNumber(key, id, "flows", 1);
-      incrCacheHashKeyValueNumber(key, id, "packets", myBucket->core.tuple.flowCounters.pktRcvd + myBucket->core.tuple.flowCounters.pktSent);
-      incrCacheHashKeyValueNumber(key, id, "bytes", myBucket->core.tuple.flowCounters.bytesRcvd + myBucket->core.tuple.flowCounters.bytesSent);
+      incrCacheHashKeyValueNumber(key, id, "packets", myBucket->core.flowCounters.pktRcvd + myBucket->core.flowCounters.pktSent);
+      incrCacheHashKeyValueNumber(key, id, "bytes", myBucket->core.flowCounters.bytesRcvd + myBucket->core.flowCounters.bytesSent);
       incrCacheHashKeyValueNumber(key, id, "duration", getFlowDurationSec(myBucket));
       //traceEvent(TRACE_ERROR, "==>>> %s", key);
     }
@@ -2591,13 +2755,13 @@ void dumpFlowToCache(FlowHashBucket *myBucket) {
   if(readOnlyGlobals.ucloud_enabled) {
     char src_buf[256], dst_buf[256], *src, *dst;
 
-    src = _intoa(myBucket->core.tuple.key.k.ipKey.src, src_buf, sizeof(src_buf)),
-      dst = _intoa(myBucket->core.tuple.key.k.ipKey.dst, dst_buf, sizeof(dst_buf));
+    src = _intoa(myBucket->ext->tuple.key.k.ipKey.src, src_buf, sizeof(src_buf)),
+      dst = _intoa(myBucket->ext->tuple.key.k.ipKey.dst, dst_buf, sizeof(dst_buf));
 
-    incrCacheHashKeyValueNumber(src, id, "bytes.sent", myBucket->core.tuple.flowCounters.bytesSent);
-    incrCacheHashKeyValueNumber(src, id, "bytes.rcvd", myBucket->core.tuple.flowCounters.bytesRcvd);
-    incrCacheHashKeyValueNumber(dst, id, "bytes.sent", myBucket->core.tuple.flowCounters.bytesRcvd);
-    incrCacheHashKeyValueNumber(dst, id, "bytes.rcvd", myBucket->core.tuple.flowCounters.bytesSent);
+    incrCacheHashKeyValueNumber(src, id, "bytes.sent", myBucket->core.flowCounters.bytesSent);
+    incrCacheHashKeyValueNumber(src, id, "bytes.rcvd", myBucket->core.flowCounters.bytesRcvd);
+    incrCacheHashKeyValueNumber(dst, id, "bytes.sent", myBucket->core.flowCounters.bytesRcvd);
+    incrCacheHashKeyValueNumber(dst, id, "bytes.rcvd", myBucket->core.flowCounters.bytesSent);
 
     /*
       Compute the top X hosts
@@ -2609,18 +2773,18 @@ void dumpFlowToCache(FlowHashBucket *myBucket) {
       redis 127.0.0.1:6379> zrange bytes.topSenders -5 -1 WITHSCORES
 
     */
-    zIncrCacheHashKeyValueNumber("bytes.topSenders",   id, src, myBucket->core.tuple.flowCounters.bytesSent);
-    zIncrCacheHashKeyValueNumber("bytes.topReceivers", id, dst, myBucket->core.tuple.flowCounters.bytesRcvd);
+    zIncrCacheHashKeyValueNumber("bytes.topSenders",   id, src, myBucket->core.flowCounters.bytesSent);
+    zIncrCacheHashKeyValueNumber("bytes.topReceivers", id, dst, myBucket->core.flowCounters.bytesRcvd);
 
-    if(myBucket->core.l7.proto.ndpi.ndpi_proto != NDPI_PROTOCOL_UNKNOWN) {
-      char *pname = getProtoName(myBucket->core.l7.proto.ndpi.ndpi_proto);
+    if(myBucket->ext->cold.l7.proto.ndpi.ndpi_proto != NDPI_PROTOCOL_UNKNOWN) {
+      char *pname = getProtoName(myBucket->ext->cold.l7.proto.ndpi.ndpi_proto);
       char sbuf[256], dbuf[256];
 
       snprintf(sbuf, sizeof(sbuf), "%s.sent", pname), snprintf(dbuf, sizeof(dbuf), "%s.rcvd", pname);
-      incrCacheHashKeyValueNumber(src, id, sbuf, myBucket->core.tuple.flowCounters.bytesSent);
-      incrCacheHashKeyValueNumber(src, id, dbuf, myBucket->core.tuple.flowCounters.bytesRcvd);
-      incrCacheHashKeyValueNumber(dst, id, sbuf, myBucket->core.tuple.flowCounters.bytesRcvd);
-      incrCacheHashKeyValueNumber(dst, id, dbuf, myBucket->core.tuple.flowCounters.bytesSent);
+      incrCacheHashKeyValueNumber(src, id, sbuf, myBucket->core.flowCounters.bytesSent);
+      incrCacheHashKeyValueNumber(src, id, dbuf, myBucket->core.flowCounters.bytesRcvd);
+      incrCacheHashKeyValueNumber(dst, id, sbuf, myBucket->core.flowCounters.bytesRcvd);
+      incrCacheHashKeyValueNumber(dst, id, dbuf, myBucket->core.flowCounters.bytesSent);
     }
 
     expireCacheKey("", id, src, 43200 /* 12h */), expireCacheKey("", id, dst, 43200 /* 12h */);
@@ -2634,7 +2798,7 @@ static void check_dump_file_open(void) {
     time_t theTime;
 
     if(readOnlyGlobals.reforgeTimestamps)
-      theTime = readWriteGlobals->now = time(NULL);
+      theTime = readWriteGlobals->now = coarseTime();
     else
       theTime = readWriteGlobals->now;
 
@@ -2780,33 +2944,33 @@ static void check_dump_file_open(void) {
   So before allocating memory into exportBucket() make sure that
   you're not allocating it several times
 */
-void exportBucket(FlowHashBucket *myBucket, u_char free_memory) {
+void exportBucket(ExportWorker *worker, FlowHashBucket *myBucket, u_char free_memory) {
   if(unlikely(readOnlyGlobals.demo_mode && readOnlyGlobals.demo_expired))
     return;
 
   if(readOnlyGlobals.enable_l7_protocol_discovery
      && readOnlyGlobals.l7.enable_l7_protocol_guess
-     && (myBucket->core.l7.proto.ndpi.ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
-     // && myBucket->core.l7.proto.ndpi.flow
+     && (myBucket->ext->cold.l7.proto.ndpi.ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
+     // && myBucket->ext->cold.l7.proto.ndpi.flow
      ) {
     u_int16_t ndpi_proto;
 
     ndpi_proto = ndpi_guess_undetected_protocol(readOnlyGlobals.l7.l7handler,
-						myBucket->core.tuple.key.k.ipKey.proto,
-						myBucket->core.tuple.key.k.ipKey.src.ipType.ipv4,
-						myBucket->core.tuple.key.k.ipKey.sport,
-						myBucket->core.tuple.key.k.ipKey.dst.ipType.ipv4,
-						myBucket->core.tuple.key.k.ipKey.dport);
+						myBucket->ext->tuple.key.k.ipKey.proto,
+						myBucket->ext->tuple.key.k.ipKey.src.ipType.ipv4,
+						myBucket->ext->tuple.key.k.ipKey.sport,
+						myBucket->ext->tuple.key.k.ipKey.dst.ipType.ipv4,
+						myBucket->ext->tuple.key.k.ipKey.dport);
     setnDPIProto(myBucket, ndpi_proto);
   }
 
   switch(readOnlyGlobals.l7.discard_unknown_flows) {
   case 1: /* Export only known flows */
-    if(myBucket->core.l7.proto.ndpi.ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
+    if(myBucket->ext->cold.l7.proto.ndpi.ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
       return;
     break;
   case 2: /* Export only unknown flows */
-    if(myBucket->core.l7.proto.ndpi.ndpi_proto != NDPI_PROTOCOL_UNKNOWN)
+    if(myBucket->ext->cold.l7.proto.ndpi.ndpi_proto != NDPI_PROTOCOL_UNKNOWN)
       return;
     break;
   }
@@ -2817,20 +2981,9 @@ void exportBucket(FlowHashBucket *myBucket, u_char free_memory) {
     if(myBucket->ext->if_output == NO_INTERFACE_INDEX) myBucket->ext->if_output = ifIdx(myBucket, 0);
   }
 
-  if((readOnlyGlobals.numLocalNetworks > 0) && myBucket->core.tuple.key.is_ip_flow) {
-    IpAddress *host;
-    struct in_addr addr;
-
-    host = &myBucket->core.tuple.key.k.ipKey.src;
-
-    if(host->ipVersion == 4) {
-      addr.s_addr = host->ipType.ipv4;
-      host->localHost = isLocalAddress(&addr);
-
-      host = &myBucket->core.tuple.key.k.ipKey.dst;
-      addr.s_addr = host->ipType.ipv4;
-      host->localHost = isLocalAddress(&addr);
-    }
+  if((readOnlyGlobals.numLocalNetworks > 0) && myBucket->ext->tuple.key.is_ip_flow) {
+    myBucket->ext->tuple.key.k.ipKey.src.localHost = isLocalIpAddress(&myBucket->ext->tuple.key.k.ipKey.src);
+    myBucket->ext->tuple.key.k.ipKey.dst.localHost = isLocalIpAddress(&myBucket->ext->tuple.key.k.ipKey.dst);
   }
 
 
@@ -2841,32 +2994,41 @@ void exportBucket(FlowHashBucket *myBucket, u_char free_memory) {
   }
 #endif
 
-  /*
-     It might happen that a plugin exports a bucket while we're exporting
-     and thus we need to lock
-  */
-  pthread_rwlock_wrlock(&readWriteGlobals->exportRwLock);
-
 #ifdef HAVE_GEOIP
   if(readOnlyGlobals.geo_ip_city_db != NULL) {
     /* We need to geo-locate this flow */
-    geoLocate(&myBucket->core.tuple.key.k.ipKey.src, &myBucket->ext->srcInfo);
-    geoLocate(&myBucket->core.tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo);
+    geoLocate(worker->geoCache, &myBucket->ext->tuple.key.k.ipKey.src, &myBucket->ext->srcInfo);
+    geoLocate(worker->geoCache, &myBucket->ext->tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo);
+  }
+
+  if((readOnlyGlobals.geo_ip_asn_db != NULL) && myBucket->ext) {
+    /* Resolved here through the thread cache, before the templates ask for them */
+    getCachedAS(worker->geoCache, &myBucket->ext->tuple.key.k.ipKey.src, &myBucket->ext->srcInfo);
+    getCachedAS(worker->geoCache, &myBucket->ext->tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo);
   }
 #endif
 
+  /*
+     Export threads encode flows in parallel: only what is shared
+     (dump files, plugins, database) is serialized by exportRwLock
+  */
+  pthread_rwlock_wrlock(&readWriteGlobals->exportRwLock);
   check_dump_file_open();
+  pthread_rwlock_unlock(&readWriteGlobals->exportRwLock);
 
-  if((myBucket->core.tuple.key.k.ipKey.proto != TCP_PROTOCOL)
-     || (myBucket->core.tuple.flowCounters.bytesSent >= readOnlyGlobals.minFlowSize)) {
-    exportBucketToNetflow(myBucket, src2dst_direction);
+  if(myBucket->ext->tuple.flow_serial == 0)
+    myBucket->ext->tuple.flow_serial = getFlowSerial(&worker->serials);
+
+  if((myBucket->ext->tuple.key.k.ipKey.proto != TCP_PROTOCOL)
+     || (myBucket->core.flowCounters.bytesSent >= readOnlyGlobals.minFlowSize)) {
+    exportBucketToNetflow(worker, myBucket, src2dst_direction);
   }
 
   /* *********************** */
 
   if((readOnlyGlobals.netFlowVersion == 5)
      || ((readOnlyGlobals.netFlowVersion != 5) && (!readOnlyGlobals.bidirectionalFlows))) {
-    if(myBucket->core.tuple.flowCounters.bytesRcvd > 0) {
+    if(myBucket->core.flowCounters.bytesRcvd > 0) {
       /*
 	v9 flows do not need to be exported twice, once per direction
 	as they are bi-directional. However if the flow format does not
@@ -2875,180 +3037,163 @@ void exportBucket(FlowHashBucket *myBucket, u_char free_memory) {
 	both flow directions
       */
 
-      if((myBucket->core.tuple.key.k.ipKey.proto != TCP_PROTOCOL)
-	 || (myBucket->core.tuple.flowCounters.bytesRcvd >= readOnlyGlobals.minFlowSize)) {
-	exportBucketToNetflow(myBucket, dst2src_direction);
+      if((myBucket->ext->tuple.key.k.ipKey.proto != TCP_PROTOCOL)
+	 || (myBucket->core.flowCounters.bytesRcvd >= readOnlyGlobals.minFlowSize)) {
+	exportBucketToNetflow(worker, myBucket, dst2src_direction);
       }
     }
   }
 
   if(free_memory) {
-    if(unlikely((myBucket->core.tuple.key.is_ip_flow == 1)
-		&& (readOnlyGlobals.num_active_plugins > 0)))
-      pluginCallback(DELETE_FLOW_CALLBACK,
-		     -1 /* packet_if_idx, -1 = unknown */,
-		     myBucket, 0,
-		     0, 0, 0,
-		     0, 0, 0,
-		     0, NULL,
-		     NULL, 0,
-		     NULL, 0,
-		     0,
-		     0, 0, 0, 0, NULL,
-		     NULL, NULL, NULL, 0);
+    if(unlikely((myBucket->ext->tuple.key.is_ip_flow == 1)
+		&& (readOnlyGlobals.num_active_plugins > 0))) {
+      /* It might happen that a plugin exports a bucket while we're exporting */
+      pthread_rwlock_wrlock(&readWriteGlobals->exportRwLock);
+      pluginCallback(DELETE_FLOW_CALLBACK, myBucket, 0, NULL);
+      pthread_rwlock_unlock(&readWriteGlobals->exportRwLock);
+    }
   }
 
-  pthread_rwlock_unlock(&readWriteGlobals->exportRwLock);
-
-  myBucket->core.tuple.flow_serial = 0; /* Reset it for future flows */
+  myBucket->ext->tuple.flow_serial = 0; /* Reset it for future flows */
 }
 
 /* ****************************************************** */
 
 void discardBucket(FlowHashBucket *myBucket) {
   readWriteGlobals->probeStats.totFlowBytesDropped +=
-    myBucket->core.tuple.flowCounters.bytesSent + myBucket->core.tuple.flowCounters.bytesRcvd;
+    myBucket->core.flowCounters.bytesSent + myBucket->core.flowCounters.bytesRcvd;
   readWriteGlobals->probeStats.totFlowPktsDropped +=
-    myBucket->core.tuple.flowCounters.pktSent + myBucket->core.tuple.flowCounters.pktRcvd;
+    myBucket->core.flowCounters.pktSent + myBucket->core.flowCounters.pktRcvd;
 
-  if(unlikely((myBucket->core.tuple.key.is_ip_flow == 1)
+  if(unlikely((myBucket->ext->tuple.key.is_ip_flow == 1)
 	      && (readOnlyGlobals.num_active_plugins > 0)))
-    pluginCallback(DELETE_FLOW_CALLBACK,
-		   -1 /* packet_if_idx, -1 = unknown */,
-		   myBucket, 0,
-		   0, 0, 0,
-		   0, 0, 0,
-		   0, NULL,
-		   NULL, 0,
-		   NULL, 0,
-		   0,
-		   0, 0, 0, 0, NULL,
-		   NULL, NULL, NULL, 0);
+    pluginCallback(DELETE_FLOW_CALLBACK, myBucket, 0, NULL);
 
   purgeBucket(myBucket);
 }
 
 /* ****************************************************** */
 
-void queueBucketToExport(FlowHashBucket *myBucket) {
-  if(readWriteGlobals->exportBucketsLen > MAX_EXPORT_QUEUE_LEN) {
-    static char show_message = 0;
-
-    if(!show_message) {
-      if(readOnlyGlobals.flowExportDelay > 0) {
-	traceEvent(TRACE_WARNING,
-		   "Too many (%u) queued buckets for export: bucket discarded.",
-		   readWriteGlobals->exportBucketsLen);
-	traceEvent(TRACE_WARNING, "Please check -e value and decrease it.");
-	show_message = 1;
-      }
+static void dropQueuedBucket(ExportWorker *worker, FlowHashBucket *myBucket) {
+  static char show_message = 0;
+
+  if(!show_message) {
+    if(readOnlyGlobals.flowExportDelay > 0) {
+      traceEvent(TRACE_WARNING,
+		 "Too many (%u) queued buckets for export: bucket discarded.",
+		 mpscRingLen(&worker->ring));
+      traceEvent(TRACE_WARNING, "Please check -e value and decrease it.");
+      show_message = 1;
     }
+  }
 
-    discardBucket(myBucket);
-  } else {
-    pthread_rwlock_wrlock(&readWriteGlobals->exportMutex);
-    addToList(myBucket, &readWriteGlobals->exportQueue);
-    readWriteGlobals->exportBucketsLen++;
+  discardBucket(myBucket);
+  readWriteGlobals->probeStats.totFlowDropped++;
+}
+
+/* ****************************************************** */
+
+/* Both directions of a flow hash the same: a flow always goes to the same export thread */
+void queueBucketToExport(FlowHashBucket *myBucket) {
+  ExportWorker *worker = &readWriteGlobals->exportWorkers[myBucket->core.flow_hash
+							   % readOnlyGlobals.numExportThreads];
+
+  if(mpscRingEnqueue(&worker->ring, myBucket) != 0)
+    dropQueuedBucket(worker, myBucket);
 #ifdef DEBUG
-    traceEvent(TRACE_NORMAL, "[+] [exportBucketsLen=%d][myBucket=%p]",
-	       readWriteGlobals->exportBucketsLen, myBucket);
+  else
+    traceEvent(TRACE_NORMAL, "[+] [worker=%u][exportQueueLen=%d][myBucket=%p]",
+	       worker->worker_id, mpscRingLen(&worker->ring), myBucket);
 #endif
-    pthread_rwlock_unlock(&readWriteGlobals->exportMutex);
+}
+
+/* ****************************************************** */
+
+/* Same as queueBucketToExport() with a single ring reservation per export thread */
+void queueBucketsToExport(FlowHashBucket **buckets, u_int32_t num) {
+  void *items[RING_MAX_DEQUEUE_BATCH];
+  u_int32_t worker_id, i, n, queued;
+
+  while(num > RING_MAX_DEQUEUE_BATCH) {
+    queueBucketsToExport(buckets, RING_MAX_DEQUEUE_BATCH);
+    buckets += RING_MAX_DEQUEUE_BATCH, num -= RING_MAX_DEQUEUE_BATCH;
+  }
+
+  for(worker_id=0; worker_id<readOnlyGlobals.numExportThreads; worker_id++) {
+    ExportWorker *worker = &readWriteGlobals->exportWorkers[worker_id];
+
+    for(i=0, n=0; i<num; i++)
+      if((buckets[i]->core.flow_hash % readOnlyGlobals.numExportThreads) == worker_id)
+	items[n++] = buckets[i];
+
+    if(n == 0) continue;
+
+    queued = mpscRingEnqueueBatch(&worker->ring, items, n);
+
+    for(i=queued; i<n; i++)
+      dropQueuedBucket(worker, (FlowHashBucket*)items[i]);
   }
 }
 
 /* ****************************************************** */
 
-void* dequeueBucketToExport(void* notUsed) {
-#if 0
-  u_int num_exported = 0;
-#endif
+void* dequeueBucketToExport(void* _worker) {
+  ExportWorker *worker = (ExportWorker*)_worker;
+  FlowHashBucket *buckets[RING_MAX_DEQUEUE_BATCH];
 
 #ifdef linux
   if(readOnlyGlobals.exportThreadAffinity >= 0)
     bindthread2core(pthread_self(), readOnlyGlobals.exportThreadAffinity);
 #endif
 
-  traceEvent(TRACE_INFO, "Starting bucket dequeue thread");
-
-  readOnlyGlobals.dequeueBucketToExport_up = 1;
+  traceEvent(TRACE_INFO, "Starting bucket dequeue thread %u", worker->worker_id);
 
   while(readWriteGlobals->shutdownInProgress < 2) {
-#if 0
-    if(unlikely(readOnlyGlobals.enable_debug))
-      traceEvent(TRACE_NORMAL, "dequeueBucketToExport()");
-#endif
+    u_int32_t num, i;
 
-    if(readWriteGlobals->exportQueue == NULL) {
-      if(readWriteGlobals->shutdownInProgress < 2) {
-	/* traceEvent(TRACE_INFO, "About to call waitCondvar()"); */
-	waitCondvar(&readWriteGlobals->exportQueueCondvar);
-	/* traceEvent(TRACE_INFO, "waitCondvar() called"); */
 #if 0
-	num_exported = 0;
-#endif
-      } else
-	break;
-    }
-
-    if(readWriteGlobals->exportQueue != NULL) {
-      FlowHashBucket *myBucket;
-
-#if 0
-      if(num_exported >= 100) {
-	usleep(2000);
-	num_exported = 0;
-      }
+    if(unlikely(readOnlyGlobals.enable_debug))
+      traceEvent(TRACE_NORMAL, "dequeueBucketToExport(%u)", worker->worker_id);
 #endif
 
-      /* Remove bucket from list */
-      pthread_rwlock_wrlock(&readWriteGlobals->exportMutex);
-      if(readWriteGlobals->exportQueue != NULL) {
-	myBucket = getListHead(&readWriteGlobals->exportQueue);
-	if(myBucket != NULL) {
-	  if(readWriteGlobals->exportBucketsLen == 0)
-	    traceEvent(TRACE_WARNING, "Internal error (exportBucketsLen == 0)");
-	  else
-	    readWriteGlobals->exportBucketsLen--;
-	}
-      } else
-	myBucket = NULL;
+    num = mpscRingDequeue(&worker->ring, (void**)buckets, RING_MAX_DEQUEUE_BATCH);
 
-      pthread_rwlock_unlock(&readWriteGlobals->exportMutex);
+    if(num == 0) {
+      if(readWriteGlobals->shutdownInProgress < 2)
+	mpscRingWait(&worker->ring);
+      continue;
+    }
 
-      if(myBucket != NULL) {
-	/* Export bucket */
-	ticks when, when1, diff;
+    /* Keep checkNetFlowExport() from flushing a half-built datagram */
+    pthread_rwlock_wrlock(&worker->lock);
 
-	// traceEvent(TRACE_NORMAL, "[-] [exportBucketsLen=%d][myBucket=%p][bucketsAllocated=%u]", readWriteGlobals->exportBucketsLen, myBucket, readWriteGlobals->bucketsAllocated);
+    for(i=0; i<num; i++) {
+      FlowHashBucket *myBucket = buckets[i];
+      /* Export bucket */
+      ticks when, when1, diff;
 
-	if(unlikely(readOnlyGlobals.tracePerformance)) when = getticks();
-	exportBucket(myBucket, 1);
+      if(unlikely(readOnlyGlobals.tracePerformance)) when = getticks();
+      exportBucket(worker, myBucket, 1);
 
-	if(unlikely(readOnlyGlobals.tracePerformance)) {
-	  when1 = getticks();
-	  diff = when1 - when;
-	  pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-	  readOnlyGlobals.bucketExportTicks += diff, readOnlyGlobals.num_exported_buckets++;
-	  pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
-	}
+      if(unlikely(readOnlyGlobals.tracePerformance)) {
+	when1 = getticks();
+	diff = when1 - when;
+	worker->perf.bucketExportTicks += diff, worker->perf.num_exported_buckets++;
+      }
 
-	purgeBucket(myBucket);
+      purgeBucket(myBucket);
 
-	if(unlikely(readOnlyGlobals.tracePerformance)) {
-	  diff = getticks() - when1;
-	  pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-	  readOnlyGlobals.bucketPurgeTicks += diff,  readOnlyGlobals.num_purged_buckets++;
-	  pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
-	}
+      if(unlikely(readOnlyGlobals.tracePerformance)) {
+	diff = getticks() - when1;
+	worker->perf.bucketPurgeTicks += diff, worker->perf.num_purged_buckets++;
       }
     }
-  }
 
-  readOnlyGlobals.dequeueBucketToExport_up = 0;
+    pthread_rwlock_unlock(&worker->lock);
+  }
 
-  traceEvent(TRACE_INFO, "Export thread terminated [exportQueue=%x]",
-	     readWriteGlobals->exportQueue);
+  traceEvent(TRACE_INFO, "Export thread %u terminated [export queue len=%u]",
+	     worker->worker_id, mpscRingLen(&worker->ring));
   signalCondvar(&readWriteGlobals->termCondvar, 0);
   return(NULL);
 }
@@ -3057,10 +3202,12 @@ void* dequeueBucketToExport(void* notUsed) {
 
 void purgeBucket(FlowHashBucket *myBucket) {
   PluginInformation *next_info, *info;
+  u_int8_t allocated = (myBucket->core.magic == MAGIC_NUMBER) ? 1 : 0; /* Not set if allocFlowBucket() failed */
+  u_int8_t pool_id = myBucket->ext ? myBucket->ext->pool_id : 0; /* ext can be freed below */
 
   info = myBucket->ext ? myBucket->ext->plugin : NULL;
 
-  myBucket->magic = 0;
+  myBucket->core.magic = 0;
 
   /* These pointers should have been already freed by plugins */
   while(info != NULL) {
@@ -3072,21 +3219,22 @@ void purgeBucket(FlowHashBucket *myBucket) {
 
   freenDPI(myBucket);
 
-  if(myBucket->core.user.username != NULL) {
-    free(myBucket->core.user.username);
-    myBucket->core.user.username = NULL;
+  if(myBucket->ext && (myBucket->ext->cold.user.username != NULL)) {
+    free(myBucket->ext->cold.user.username);
+    myBucket->ext->cold.user.username = NULL;
   }
 
-  if(myBucket->core.server.name != NULL) {
-    free(myBucket->core.server.name);
-    myBucket->core.server.name = NULL;
+  if(myBucket->ext && (myBucket->ext->cold.server.name != NULL)) {
+    free(myBucket->ext->cold.server.name);
+    myBucket->ext->cold.server.name = NULL;
   }
 
   /*
     Do not move this statement below as we will free
     myBucket->ext invalidating its value
   */
-  decAtomic(&readWriteGlobals->bucketsAllocated, 1);
+  if(allocated && myBucket->ext)
+    incAtomic(&readWriteGlobals->threadStats[myBucket->ext->thread_id].bucketsPurged, 1);
 
   if(myBucket->ext) {
     /*
@@ -3141,7 +3289,7 @@ void purgeBucket(FlowHashBucket *myBucket) {
       }
     }
 
-    if(myBucket->ext->extensions) {
+    if(myBucket->ext->extensions && (pool_id == 0)) {
 #if 0
       if(myBucket->ext->extensions->mplsInfo) free(myBucket->ext->extensions->mplsInfo);
 #endif
@@ -3149,15 +3297,17 @@ void purgeBucket(FlowHashBucket *myBucket) {
       myBucket->ext->extensions = NULL;
     }
 
-    free(myBucket->ext);
+    if(pool_id == 0) free(myBucket->ext);
   }
 
 #if 0
-  traceEvent(TRACE_NORMAL, "[-] bucketsAllocated=%u",
-	     readWriteGlobals->bucketsAllocated[myBucket->ext ? myBucket->ext->thread_id : 0]);
+  traceEvent(TRACE_NORMAL, "[-] bucketsAllocated=%u", getNumActiveBuckets());
 #endif
 
-  free(myBucket);
+  if(pool_id != 0)
+    poolReleaseBucket(myBucket); /* Back to the pool of the thread that allocated it */
+  else
+    freeAlignedBucket(myBucket);
 }
 
 /* ****************************************************** */
@@ -3169,7 +3319,15 @@ void idleThreadTask(u_int8_t thread_id, u_int8_t context_type) {
 
   /* We need to update in case no more packets are coming */
   if(readOnlyGlobals.pcapFile == NULL)
-    readWriteGlobals->now = time(NULL);
+    readWriteGlobals->now = coarseTime();
+
+  /* Flows expire at every timer tick, the tasks below run once a second */
+  if(!readWriteGlobals->shutdownInProgress)
+    expireFlowTimers(thread_id, 0);
+
+  /* Batched datagrams must not wait for more traffic to leave */
+  if(thread_id == 0)
+    flushExportBatches(0);
 
   if(unlikely(!readOnlyGlobals.disableFlowCache)) {
     if(likely((readWriteGlobals->idleTaskNextUpdate[thread_id] > 0)
@@ -3179,12 +3337,7 @@ void idleThreadTask(u_int8_t thread_id, u_int8_t context_type) {
 
   // traceEvent(TRACE_NORMAL, "idleThreadTask(%d) begin [context_type: %u]", thread_id, context_type);
 
-  /* We're not reading from a pcap file dump */
-  if(readOnlyGlobals.pcapFile == NULL)
-    readWriteGlobals->now = time(NULL);
-
   checkExportFileClose(); /* Close dump files if open since too long */
-  walkHashList(thread_id, 0, readWriteGlobals->now);
   readWriteGlobals->idleTaskNextUpdate[thread_id] = readWriteGlobals->now + 1 /* IDLE_TASK_UPDATE_FREQUENCY */;
 
   /* We call the idle task only for the first thread */
@@ -3200,13 +3353,13 @@ struct timeval* getFlowBeginTime(FlowHashBucket *theFlow, FlowDirection directio
   struct timeval *t;
 
   if(readOnlyGlobals.bidirectionalFlows) {
-    if((theFlow->core.tuple.flowTimers.firstSeenRcvd.tv_sec == 0)
-       || (toMs(&theFlow->core.tuple.flowTimers.firstSeenSent) < toMs(&theFlow->core.tuple.flowTimers.firstSeenRcvd)))
-      t = &theFlow->core.tuple.flowTimers.firstSeenSent;
+    if((theFlow->ext->tuple.flowTimers.firstSeenRcvd.tv_sec == 0)
+       || (toMs(&theFlow->ext->tuple.flowTimers.firstSeenSent) < toMs(&theFlow->ext->tuple.flowTimers.firstSeenRcvd)))
+      t = &theFlow->ext->tuple.flowTimers.firstSeenSent;
     else
-      t = &theFlow->core.tuple.flowTimers.firstSeenRcvd;
+      t = &theFlow->ext->tuple.flowTimers.firstSeenRcvd;
   } else {
-    t = (direction == src2dst_direction) ? &theFlow->core.tuple.flowTimers.firstSeenSent : &theFlow->core.tuple.flowTimers.firstSeenRcvd;
+    t = (direction == src2dst_direction) ? &theFlow->ext->tuple.flowTimers.firstSeenSent : &theFlow->ext->tuple.flowTimers.firstSeenRcvd;
   }
 
   // if(t->tv_sec == 0) traceEvent(TRACE_ERROR, "==> t->tv_sec=%u", t->tv_sec);
@@ -3220,13 +3373,13 @@ struct timeval* getFlowEndTime(FlowHashBucket *theFlow, FlowDirection direction)
   struct timeval *t;
 
   if(readOnlyGlobals.bidirectionalFlows) {
-    if((theFlow->core.tuple.flowTimers.lastSeenRcvd.tv_sec == 0)
-       || (toMs(&theFlow->core.tuple.flowTimers.lastSeenSent) > toMs(&theFlow->core.tuple.flowTimers.lastSeenRcvd)))
-      t = &theFlow->core.tuple.flowTimers.lastSeenSent;
+    if((theFlow->ext->tuple.flowTimers.lastSeenRcvd.tv_sec == 0)
+       || (toMs(&theFlow->ext->tuple.flowTimers.lastSeenSent) > toMs(&theFlow->ext->tuple.flowTimers.lastSeenRcvd)))
+      t = &theFlow->ext->tuple.flowTimers.lastSeenSent;
     else
-      t = &theFlow->core.tuple.flowTimers.lastSeenRcvd;
+      t = &theFlow->ext->tuple.flowTimers.lastSeenRcvd;
   } else {
-    t = (direction == src2dst_direction) ? &theFlow->core.tuple.flowTimers.lastSeenSent : &theFlow->core.tuple.flowTimers.lastSeenRcvd;
+    t = (direction == src2dst_direction) ? &theFlow->ext->tuple.flowTimers.lastSeenSent : &theFlow->ext->tuple.flowTimers.lastSeenRcvd;
   }
 
   // if(t->tv_sec == 0) traceEvent(TRACE_ERROR, "==> t->tv_sec=%u", t->tv_sec);
@@ -3238,7 +3391,7 @@ struct timeval* getFlowEndTime(FlowHashBucket *theFlow, FlowDirection direction)
 
 u_int32_t getFlowDurationSec(FlowHashBucket *theFlow) {
   u_int32_t first = getFlowBeginTime(theFlow, src2dst_direction)->tv_sec;
-  u_int32_t last  = max(theFlow->core.tuple.flowTimers.lastSeenSent.tv_sec, theFlow->core.tuple.flowTimers.lastSeenRcvd.tv_sec);
+  u_int32_t last  = max(theFlow->ext->tuple.flowTimers.lastSeenSent.tv_sec, theFlow->ext->tuple.flowTimers.lastSeenRcvd.tv_sec);
 
   return(last-first+1);
 }
@@ -39,6 +39,44 @@ extern int checkPluginPrint(V9V10TemplateElementId *theTemplate, FlowDirection d
 			    FlowHashBucket *bkt, char *line_buffer, uint line_buffer_len,
 			    u_int8_t json_mode);
 typedef V9V10TemplateElementId* (*PluginConf)(void);
+
+/*
+  Everything the flow engine and the plugins need to know about a
+  packet (or a collected flow), filled once by the decoder and passed
+  by pointer. Addresses, headers and payload point into the decoder
+  memory: nothing is copied. processFlowPacket() updates the descriptor
+  in place (e.g. fields ignored by the flow key are zeroed, payload and
+  retransmitted_pkt are set) so it has to be filled again before being
+  reused for another packet.
+*/
+typedef struct decodedPacket {
+  int packet_if_idx;            /* -1 = unknown */
+  u_int8_t rx_packet;           /* 1=RX, 0=TX */
+  u_int8_t sampledPacket, proto, tos, ttl;
+  u_int8_t untunneled_proto, tcpFlags, tcpWinScale;
+  u_int8_t icmpType, icmpCode, retransmitted_pkt;
+  u_int8_t engine_type, engine_id;
+  u_short numFragments, numPkts, vlanId, numMplsLabels;
+  u_int16_t ip_offset, gtp_offset, payload_shift;
+  u_int16_t tcpWin, tcpMaxSegmentSize;
+  u_int16_t src_mask, dst_mask;
+  u_short sport, dport, untunneled_sport, untunneled_dport;
+  u_int32_t subflow_id, tunnel_id, len;
+  u_int32_t tcpSeqNum, tcpAckNum;
+  u_int32_t if_input, if_output, src_as, dst_as;
+  u_int32_t flow_sender_ip, packet_hash; /* packet_hash 0 = computed by processFlowPacket() */
+  u_int payloadLen, originalPayloadLen;
+  time_t firstSeen;             /* Always set to 0 unless numPkts > 0 */
+  IpAddress *src, *dst;
+  IpAddress *untunneled_src, *untunneled_dst;
+  struct eth_header *ehdr;
+  u_char (*mplsLabels)[MPLS_LABEL_LEN];
+  struct pcap_pkthdr *h;
+  u_char *p, *payload;
+  char *osi_src, *osi_dst;
+  struct generic_netflow_record *record;
+} DecodedPacket;
+
 extern void discardBucket(FlowHashBucket *myBucket);
 extern void* dequeueBucketToExport(void*);
 typedef void (*PluginInitFctn)();
@@ -60,6 +98,13 @@ typedef void (*PluginPacketFctn)(u_char new_bucket,
 				 u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN],
 				 const struct pcap_pkthdr *h, const u_char *p,
 				 u_char *payload, int payloadLen);
+/*
+  Preferred to packetFlowFctn when registered with registerDecodedPacketFctn():
+  the plugin reads the packet from the descriptor
+*/
+typedef void (*PluginDecodedPacketFctn)(u_char new_bucket, void *pluginData,
+					FlowHashBucket *bkt, FlowDirection flow_direction,
+					DecodedPacket *pkt);
 typedef V9V10TemplateElementId* (*PluginGetTemplateFctn)(char* template_name);
 typedef int (*PluginExportFctn)(void*, V9V10TemplateElementId *theTemplate, FlowDirection direction,
 				FlowHashBucket *theFlow, char *outBuffer,
@@ -102,6 +147,8 @@ typedef struct pluginEntryPoint {
 
 extern PluginEntryPoint* PluginEntryFctn(void);
 
+#define hasPacketFlowFctn(plugin) (((plugin)->packetFlowFctn != NULL) || (getDecodedPacketFctn(plugin) != NULL))
+
 #define PLUGIN_DONT_NEED_LICENSE   0
 #define PLUGIN_NEED_LICENSE        1
 
@@ -126,6 +173,7 @@ extern u_int64_t getLRUCacheKey(FlowHashBucket *bkt);
 extern int cmpIpAddress(IpAddress *src, IpAddress *dst);
 extern void printICMPflags(u_int8_t proto, u_int32_t flags, char *icmpBuf, int icmpBufLen);
 extern void printFlow(FlowHashBucket *theFlow, FlowDirection direction);
+extern u_int8_t endTcpFlow(unsigned short flags);
 extern int isFlowExpired(FlowHashBucket *myBucket, time_t theTime);
 extern int isFlowExpiredSinceTooLong(FlowHashBucket *myBucket, time_t theTime);
 extern void printBucket(FlowHashBucket *myBucket);
@@ -133,37 +181,7 @@ extern void walkHash(u_int32_t hash_idx, int flushHash);
 extern void purgeBucket(FlowHashBucket *myBucket);
 extern FlowHashBucket* processGTPFlowPacket(u_short thread_id, u_int32_t gtp_teid,
 					    struct pcap_pkthdr *h, u_int gtp_pkt_len);
-extern FlowHashBucket* processFlowPacket(u_short thread_id,
-					 int packet_if_idx /* -1 = unknown */,
-					 u_int8_t rx_packet, /* 1=RX, 0=TX */
-					 u_int32_t subflow_id, u_int8_t proto, u_short numFragments,
-					 u_int16_t ip_offset, u_int8_t sampledPacket,
-					 u_short numPkts, u_int8_t tos, u_int8_t ttl,
-					 u_short vlanId, u_int32_t tunnel_id, u_int16_t gtp_offset,
-					 struct eth_header *ehdr,
-					 IpAddress *src, u_short sport,
-					 IpAddress *dst, u_short dport,
-					 u_int8_t untunneled_proto,
-					 IpAddress *untunneled_src, u_short untunneled_sport,
-					 IpAddress *untunneled_dst, u_short untunneled_dport,
-					 u_int len, u_int16_t tcpWin, u_int8_t tcpFlags,
-					 u_int32_t tcpSeqNum, u_int32_t tcpAckNum,
-					 u_int16_t tcpMaxSegmentSize, u_int8_t tcpWinScale,
-					 u_int8_t icmpType, u_int8_t icmpCode,
-					 u_short numMplsLabels,
-					 u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN],
-					 u_int32_t if_input, u_int32_t if_output,
-					 struct pcap_pkthdr *h, u_char *p,
-					 u_int16_t payload_shift, u_int payloadLen,
-					 u_int originalPayloadLen,
-					 time_t _firstSeen, /* Always set to 0 unless numPkts > 0 */
-					 u_int32_t src_as, u_int32_t dst_as,
-					 u_int16_t src_mask, u_int16_t dst_mask,
-					 u_int32_t flow_sender_ip,
-					 u_int32_t packet_hash,
-					 u_int8_t engine_type, u_int8_t engine_id,
-					 char *osi_src, char *osi_dst,
-					 struct generic_netflow_record *record);
+extern FlowHashBucket* processFlowPacket(u_short thread_id, DecodedPacket *pkt);
 
 extern struct timeval* getFlowBeginTime(FlowHashBucket *theFlow, FlowDirection direction);
 extern struct timeval* getFlowEndTime(FlowHashBucket *theFlow, FlowDirection direction);
@@ -173,31 +191,25 @@ extern char* expandPluginTemplate(char** template_name);
 
 /* nprobe.c or nprobe_mod.c */
 extern void queueBucketToExport(FlowHashBucket *myBucket);
+extern u_int32_t getNumActiveBuckets(void);
+extern void queueBucketsToExport(FlowHashBucket **buckets, u_int32_t num);
 
 /* plugin.c */
 extern u_short num_plugins_enabled;
 extern void initPlugins();
 extern PluginEntryPoint* get_plugin_info(char *short_name);
+extern int registerDecodedPacketFctn(PluginEntryPoint *plugin, PluginDecodedPacketFctn fctn);
+extern PluginDecodedPacketFctn getDecodedPacketFctn(PluginEntryPoint *plugin);
 extern void loadPlugins();
 extern const struct option* buildCLIOptions();
 extern void termPlugins(void);
-extern void pluginCallback(u_char callbackType, 
-			   int packet_if_idx /* -1 = unknown */,
-			   FlowHashBucket* bucket,
-			   FlowDirection direction,
-			   u_int16_t ip_offset, u_short proto, u_char isFragment,
-			   u_short numPkts, u_char tos,
-			   u_int8_t retransmitted_pkt,
-			   u_short vlanId, struct eth_header *ehdr,
-			   IpAddress *src, u_short sport,
-			   IpAddress *dst, u_short dport,
-			   u_int len, u_int8_t flags, u_int32_t tcpSeqNum, 
-			   u_int8_t icmpType, u_short numMplsLabels,
-			   u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN],
-			   const struct pcap_pkthdr *h, const u_char *p,
-			   u_char *payload, int payloadLen);
+extern void pluginCallback(u_char callbackType, FlowHashBucket* bucket,
+			   FlowDirection direction, DecodedPacket *pkt);
 extern void buildActivePluginsList(V9V10TemplateElementId *template_element_list[]);
 extern void printMetadata(FILE *file);
 extern void pluginIdleThreadTask(void);
+extern void callOverheadBenchmark(u_int32_t num_calls);
 extern void checkExportFileClose();
 extern u_int32_t get_flow_serial();
+extern void prefetchFlowHashSlot(u_short thread_id, u_int32_t packet_hash);
+extern void prefetchFlowBucket(u_short thread_id, u_int32_t packet_hash);
@@ -30,6 +30,9 @@
 #define MSG_DONTWAIT 0
 #endif
 
+static void checkWorkerExport(ExportWorker *worker, int forceExport);
+void reopenSocket(CollectorAddress *collector);
+
 /* ****************************************************** */
 
 static void checkDumpExport(FlowHashBucket *myBucket,
@@ -56,72 +59,73 @@ static void checkDumpExport(FlowHashBucket *myBucket,
 
 /* ****************************************************** */
 
-static int exportBucketToNetflowV5(FlowHashBucket *myBucket,
+static int exportBucketToNetflowV5(ExportWorker *worker,
+				   FlowHashBucket *myBucket,
 				   FlowDirection direction) {
 
   if(direction == src2dst_direction /* src -> dst */) {
-    if(myBucket->core.tuple.flowCounters.pktSent == 0) return(0); /* Nothing to export */
-
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].input     = htons(ifIdx(myBucket, 1));
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].output    = htons(ifIdx(myBucket, 0));
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].srcaddr   = htonl(myBucket->core.tuple.key.k.ipKey.src.ipType.ipv4);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dstaddr   = htonl(myBucket->core.tuple.key.k.ipKey.dst.ipType.ipv4);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].nexthop   = (myBucket->ext && (myBucket->ext->nextHop.ipVersion == 4)) ? htonl(myBucket->ext->nextHop.ipType.ipv4) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dPkts     = htonl(myBucket->core.tuple.flowCounters.pktSent);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dOctets   = htonl(myBucket->core.tuple.flowCounters.bytesSent);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].first     = htonl(msTimeDiff(&myBucket->core.tuple.flowTimers.firstSeenSent,
+    if(myBucket->core.flowCounters.pktSent == 0) return(0); /* Nothing to export */
+
+    worker->theV5Flow.flowRecord[worker->numFlows].input     = htons(ifIdx(myBucket, 1));
+    worker->theV5Flow.flowRecord[worker->numFlows].output    = htons(ifIdx(myBucket, 0));
+    worker->theV5Flow.flowRecord[worker->numFlows].srcaddr   = htonl(myBucket->ext->tuple.key.k.ipKey.src.ipType.ipv4);
+    worker->theV5Flow.flowRecord[worker->numFlows].dstaddr   = htonl(myBucket->ext->tuple.key.k.ipKey.dst.ipType.ipv4);
+    worker->theV5Flow.flowRecord[worker->numFlows].nexthop   = (myBucket->ext && (myBucket->ext->nextHop.ipVersion == 4)) ? htonl(myBucket->ext->nextHop.ipType.ipv4) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].dPkts     = htonl(myBucket->core.flowCounters.pktSent);
+    worker->theV5Flow.flowRecord[worker->numFlows].dOctets   = htonl(myBucket->core.flowCounters.bytesSent);
+    worker->theV5Flow.flowRecord[worker->numFlows].first     = htonl(msTimeDiff(&myBucket->ext->tuple.flowTimers.firstSeenSent,
 												    &readOnlyGlobals.initialSniffTime));
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].last      = htonl(msTimeDiff(&myBucket->core.tuple.flowTimers.lastSeenSent,
+    worker->theV5Flow.flowRecord[worker->numFlows].last      = htonl(msTimeDiff(&myBucket->ext->tuple.flowTimers.lastSeenSent,
 												    &readOnlyGlobals.initialSniffTime));
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].srcport   = htons(myBucket->core.tuple.key.k.ipKey.sport);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dstport   = htons(myBucket->core.tuple.key.k.ipKey.dport);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].tos       = myBucket->ext ? myBucket->ext->src2dstTos : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].src_as    = myBucket->ext ? htons(getAS(&myBucket->core.tuple.key.k.ipKey.src, &myBucket->ext->srcInfo)) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dst_as    = myBucket->ext ? htons(getAS(&myBucket->core.tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo)) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].src_mask  = myBucket->ext ? ip2mask(&myBucket->core.tuple.key.k.ipKey.src, &myBucket->ext->srcInfo) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dst_mask  = myBucket->ext ? ip2mask(&myBucket->core.tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].tcp_flags = myBucket->ext ? (u_int8_t)myBucket->ext->protoCounters.tcp.src2dstTcpFlags : 0;
-
-    readWriteGlobals->flowExportStats.totExportedFlowBytes += myBucket->core.tuple.flowCounters.bytesSent;
-    readWriteGlobals->flowExportStats.totExportedFlowPkts  += myBucket->core.tuple.flowCounters.pktSent;
+    worker->theV5Flow.flowRecord[worker->numFlows].srcport   = htons(myBucket->ext->tuple.key.k.ipKey.sport);
+    worker->theV5Flow.flowRecord[worker->numFlows].dstport   = htons(myBucket->ext->tuple.key.k.ipKey.dport);
+    worker->theV5Flow.flowRecord[worker->numFlows].tos       = myBucket->core.src2dstTos;
+    worker->theV5Flow.flowRecord[worker->numFlows].src_as    = myBucket->ext ? htons(getAS(&myBucket->ext->tuple.key.k.ipKey.src, &myBucket->ext->srcInfo)) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].dst_as    = myBucket->ext ? htons(getAS(&myBucket->ext->tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo)) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].src_mask  = myBucket->ext ? ip2mask(&myBucket->ext->tuple.key.k.ipKey.src, &myBucket->ext->srcInfo) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].dst_mask  = myBucket->ext ? ip2mask(&myBucket->ext->tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].tcp_flags = myBucket->ext ? (u_int8_t)myBucket->ext->protoCounters.tcp.src2dstTcpFlags : 0;
+
+    worker->pendingFlowBytes += myBucket->core.flowCounters.bytesSent;
+    worker->pendingFlowPkts  += myBucket->core.flowCounters.pktSent;
   } else {
-    if(myBucket->core.tuple.flowCounters.pktRcvd == 0) return(0); /* Nothing to export */
-
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].input     = htons(ifIdx(myBucket, 0));
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].output    = htons(ifIdx(myBucket, 1));
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].srcaddr   = htonl(myBucket->core.tuple.key.k.ipKey.dst.ipType.ipv4);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dstaddr   = htonl(myBucket->core.tuple.key.k.ipKey.src.ipType.ipv4);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].nexthop   = (myBucket->ext && (myBucket->ext->nextHop.ipVersion == 4)) ? htonl(myBucket->ext->nextHop.ipType.ipv4) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dPkts     = htonl(myBucket->core.tuple.flowCounters.pktRcvd);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dOctets   = htonl(myBucket->core.tuple.flowCounters.bytesRcvd);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].first     = htonl(msTimeDiff(&myBucket->core.tuple.flowTimers.firstSeenRcvd,
+    if(myBucket->core.flowCounters.pktRcvd == 0) return(0); /* Nothing to export */
+
+    worker->theV5Flow.flowRecord[worker->numFlows].input     = htons(ifIdx(myBucket, 0));
+    worker->theV5Flow.flowRecord[worker->numFlows].output    = htons(ifIdx(myBucket, 1));
+    worker->theV5Flow.flowRecord[worker->numFlows].srcaddr   = htonl(myBucket->ext->tuple.key.k.ipKey.dst.ipType.ipv4);
+    worker->theV5Flow.flowRecord[worker->numFlows].dstaddr   = htonl(myBucket->ext->tuple.key.k.ipKey.src.ipType.ipv4);
+    worker->theV5Flow.flowRecord[worker->numFlows].nexthop   = (myBucket->ext && (myBucket->ext->nextHop.ipVersion == 4)) ? htonl(myBucket->ext->nextHop.ipType.ipv4) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].dPkts     = htonl(myBucket->core.flowCounters.pktRcvd);
+    worker->theV5Flow.flowRecord[worker->numFlows].dOctets   = htonl(myBucket->core.flowCounters.bytesRcvd);
+    worker->theV5Flow.flowRecord[worker->numFlows].first     = htonl(msTimeDiff(&myBucket->ext->tuple.flowTimers.firstSeenRcvd,
 												    &readOnlyGlobals.initialSniffTime));
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].last      = htonl(msTimeDiff(&myBucket->core.tuple.flowTimers.lastSeenRcvd,
+    worker->theV5Flow.flowRecord[worker->numFlows].last      = htonl(msTimeDiff(&myBucket->ext->tuple.flowTimers.lastSeenRcvd,
 												    &readOnlyGlobals.initialSniffTime));
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].srcport   = htons(myBucket->core.tuple.key.k.ipKey.dport);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dstport   = htons(myBucket->core.tuple.key.k.ipKey.sport);
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].tos       = myBucket->ext ? myBucket->ext->dst2srcTos : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].src_as    = myBucket->ext ? htons(getAS(&myBucket->core.tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo)) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dst_as    = myBucket->ext ? htons(getAS(&myBucket->core.tuple.key.k.ipKey.src, &myBucket->ext->srcInfo)) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].src_mask  = myBucket->ext ? ip2mask(&myBucket->core.tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dst_mask  = myBucket->ext ? ip2mask(&myBucket->core.tuple.key.k.ipKey.src, &myBucket->ext->srcInfo) : 0;
-    readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].tcp_flags = myBucket->ext ? (u_int8_t)myBucket->ext->protoCounters.tcp.dst2srcTcpFlags : 0;
-
-    readWriteGlobals->flowExportStats.totExportedFlowBytes += myBucket->core.tuple.flowCounters.bytesRcvd;
-    readWriteGlobals->flowExportStats.totExportedFlowPkts  += myBucket->core.tuple.flowCounters.pktRcvd;
+    worker->theV5Flow.flowRecord[worker->numFlows].srcport   = htons(myBucket->ext->tuple.key.k.ipKey.dport);
+    worker->theV5Flow.flowRecord[worker->numFlows].dstport   = htons(myBucket->ext->tuple.key.k.ipKey.sport);
+    worker->theV5Flow.flowRecord[worker->numFlows].tos       = myBucket->core.dst2srcTos;
+    worker->theV5Flow.flowRecord[worker->numFlows].src_as    = myBucket->ext ? htons(getAS(&myBucket->ext->tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo)) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].dst_as    = myBucket->ext ? htons(getAS(&myBucket->ext->tuple.key.k.ipKey.src, &myBucket->ext->srcInfo)) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].src_mask  = myBucket->ext ? ip2mask(&myBucket->ext->tuple.key.k.ipKey.dst, &myBucket->ext->dstInfo) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].dst_mask  = myBucket->ext ? ip2mask(&myBucket->ext->tuple.key.k.ipKey.src, &myBucket->ext->srcInfo) : 0;
+    worker->theV5Flow.flowRecord[worker->numFlows].tcp_flags = myBucket->ext ? (u_int8_t)myBucket->ext->protoCounters.tcp.dst2srcTcpFlags : 0;
+
+    worker->pendingFlowBytes += myBucket->core.flowCounters.bytesRcvd;
+    worker->pendingFlowPkts  += myBucket->core.flowCounters.pktRcvd;
   }
 
-  readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].proto = (u_int8_t)myBucket->core.tuple.key.k.ipKey.proto;
+  worker->theV5Flow.flowRecord[worker->numFlows].proto = (u_int8_t)myBucket->ext->tuple.key.k.ipKey.proto;
 
-  readWriteGlobals->flowExportStats.totExportedFlows++;
+  worker->pendingFlows++;
 
 #ifdef HAVE_MYSQL
   if(readOnlyGlobals.db_initialized) {
     char sql[2048];
     unsigned int first, last;
 
-    first = (ntohl(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].first) / 1000) + readOnlyGlobals.initialSniffTime.tv_sec;
-    last  = (ntohl(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].last) / 1000) + readOnlyGlobals.initialSniffTime.tv_sec;
+    first = (ntohl(worker->theV5Flow.flowRecord[worker->numFlows].first) / 1000) + readOnlyGlobals.initialSniffTime.tv_sec;
+    last  = (ntohl(worker->theV5Flow.flowRecord[worker->numFlows].last) / 1000) + readOnlyGlobals.initialSniffTime.tv_sec;
 
     // traceEvent(TRACE_ERROR, "====> %u / %u [num_collectors=%u]", first, last, readOnlyGlobals.numCollectors);
 
@@ -131,23 +135,26 @@ static int exportBucketToNetflowV5(FlowHashBucket *myBucket,
 	     "IN_BYTES, FIRST_SWITCHED, LAST_SWITCHED, L4_SRC_PORT, L4_DST_PORT, SRC_TOS, SRC_AS, DST_AS, TCP_FLAGS) "
 	     "VALUES ('%u', '%u', '%u', '%u', '%u', '%u', '%u', '%u', '%u', '%u', '%u', '%u', '%u', '%u', '%u')",
 	     get_db_table_prefix(),
-	     readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].proto,
-	     ntohl(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].srcaddr),
-	     ntohl(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dstaddr),
-	     ntohs(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].input),
-	     ntohs(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].output),
-	     ntohl(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dPkts),
-	     ntohl(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dOctets),
+	     worker->theV5Flow.flowRecord[worker->numFlows].proto,
+	     ntohl(worker->theV5Flow.flowRecord[worker->numFlows].srcaddr),
+	     ntohl(worker->theV5Flow.flowRecord[worker->numFlows].dstaddr),
+	     ntohs(worker->theV5Flow.flowRecord[worker->numFlows].input),
+	     ntohs(worker->theV5Flow.flowRecord[worker->numFlows].output),
+	     ntohl(worker->theV5Flow.flowRecord[worker->numFlows].dPkts),
+	     ntohl(worker->theV5Flow.flowRecord[worker->numFlows].dOctets),
 	     first,
 	     last,
-	     ntohs(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].srcport),
-	     ntohs(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dstport),
-	     readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].tos,
-	     ntohs(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].src_as),
-	     ntohs(readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].dst_as),
-	     readWriteGlobals->theV5Flow.flowRecord[readWriteGlobals->numFlows].tcp_flags);
-
+	     ntohs(worker->theV5Flow.flowRecord[worker->numFlows].srcport),
+	     ntohs(worker->theV5Flow.flowRecord[worker->numFlows].dstport),
+	     worker->theV5Flow.flowRecord[worker->numFlows].tos,
+	     ntohs(worker->theV5Flow.flowRecord[worker->numFlows].src_as),
+	     ntohs(worker->theV5Flow.flowRecord[worker->numFlows].dst_as),
+	     worker->theV5Flow.flowRecord[worker->numFlows].tcp_flags);
+
+    /* The database connection is shared by all the export threads */
+    pthread_rwlock_wrlock(&readWriteGlobals->exportRwLock);
     exec_sql_query(sql, 1);
+    pthread_rwlock_unlock(&readWriteGlobals->exportRwLock);
   }
 #endif
 
@@ -156,10 +163,19 @@ static int exportBucketToNetflowV5(FlowHashBucket *myBucket,
 
 /* ****************************************************** */
 
-static int exportBucketToNetflowV9(FlowHashBucket *myBucket,
+/* Flowset header + max padding */
+#define FLOWSET_OVERHEAD  (sizeof(V9FlowSet) + 3)
+
+static __inline__ u_int flowPacketHeaderLen(void) {
+  return((readOnlyGlobals.netFlowVersion == 9) ? sizeof(V9FlowHeader) : sizeof(IPFIXFlowHeader));
+}
+
+/* ****************************************************** */
+
+static int exportBucketToNetflowV9(ExportWorker *worker,
+				   FlowHashBucket *myBucket,
 				   FlowDirection direction) {
-  u_int flowBufBegin, flowBufMax, templateIndex;
-  int numElements;
+  u_int flowBufBegin, flowBufMax, templateIndex, flowsetOverhead;
   u_int8_t isV4Flow;
 #if defined(HAVE_MYSQL)
   char *the_buffer;
@@ -171,8 +187,8 @@ static int exportBucketToNetflowV9(FlowHashBucket *myBucket,
 
   head = myBucket->ext->plugin;
 
-  isV4Flow = ((!myBucket->core.tuple.key.is_ip_flow /* Non-IP traffic */)
-	      || (myBucket->core.tuple.key.k.ipKey.src.ipVersion == 4)
+  isV4Flow = ((!myBucket->ext->tuple.key.is_ip_flow /* Non-IP traffic */)
+	      || (myBucket->ext->tuple.key.k.ipKey.src.ipVersion == 4)
 	      || (readOnlyGlobals.templateBuffers[V6_TEMPLATE_INDEX].v9TemplateElementList[0] == NULL))
     ? 1 : 0;
 
@@ -182,18 +198,18 @@ static int exportBucketToNetflowV9(FlowHashBucket *myBucket,
   flowBufMax = readOnlyGlobals.maxNetFlowPacketPayloadLen;
 
   if(direction == src2dst_direction /* src -> dst */) {
-    if(myBucket->core.tuple.flowCounters.pktSent == 0) return(0); /* Nothing to export */
+    if(myBucket->core.flowCounters.pktSent == 0) return(0); /* Nothing to export */
 
-    readWriteGlobals->flowExportStats.totExportedFlowBytes += myBucket->core.tuple.flowCounters.bytesSent;
-    readWriteGlobals->flowExportStats.totExportedFlowPkts  += myBucket->core.tuple.flowCounters.pktSent;
+    worker->pendingFlowBytes += myBucket->core.flowCounters.bytesSent;
+    worker->pendingFlowPkts  += myBucket->core.flowCounters.pktSent;
   } else {
-    if(myBucket->core.tuple.flowCounters.pktRcvd == 0) return(0); /* Nothing to export */
+    if(myBucket->core.flowCounters.pktRcvd == 0) return(0); /* Nothing to export */
 
-    readWriteGlobals->flowExportStats.totExportedFlowBytes += myBucket->core.tuple.flowCounters.bytesRcvd;
-    readWriteGlobals->flowExportStats.totExportedFlowPkts  += myBucket->core.tuple.flowCounters.pktRcvd;
+    worker->pendingFlowBytes += myBucket->core.flowCounters.bytesRcvd;
+    worker->pendingFlowPkts  += myBucket->core.flowCounters.pktRcvd;
   }
 
-  readWriteGlobals->flowExportStats.totExportedFlows++;
+  worker->pendingFlows++;
 
   /*
      templateIndex is the default template to use but in case there is a
@@ -209,58 +225,76 @@ static int exportBucketToNetflowV9(FlowHashBucket *myBucket,
       head = head->next;
   }
 
-  flowBufBegin = readOnlyGlobals.templateBuffers[templateIndex].bufferLen;
+  /* Send what we have if the longest record of this template could not fit the datagram */
+  flowsetOverhead = (worker->bufferLen[templateIndex] == 0) ? FLOWSET_OVERHEAD : 0;
+
+  if((worker->queuedDataToExport > 0)
+     && ((worker->queuedDataToExport + flowsetOverhead + readOnlyGlobals.templateBuffers[templateIndex].flowLen)
+	 > (readOnlyGlobals.maxNetFlowPacketPayloadLen - flowPacketHeaderLen()))) {
+    checkWorkerExport(worker, 1);
+    flowsetOverhead = FLOWSET_OVERHEAD;
+  }
+
+  flowBufBegin = worker->bufferLen[templateIndex];
 
   if(readOnlyGlobals.enable_debug) {
 #if 1
     traceEvent(TRACE_INFO, "Export flow using templateId=%u", readOnlyGlobals.idTemplate + templateIndex);
 #else
     traceEvent(TRACE_INFO, "--->>> To dump flow [templateIndex=%u][tot=%u][max=%u]",
-	       readOnlyGlobals.idTemplate + templateIndex, flowBufBegin, readOnlyGlobals.templateBuffers[templateIndex].bufferLen);
+	       readOnlyGlobals.idTemplate + templateIndex, flowBufBegin, worker->bufferLen[templateIndex]);
 #endif
   }
 
-  flowPrintf(readOnlyGlobals.templateBuffers[templateIndex].v9TemplateElementList,
-	     readOnlyGlobals.templateBuffers[templateIndex].templatePlugin,
-	     isV4Flow ? 1 /* IPv4 */ : 0 /* IPv6 */,
-	     readOnlyGlobals.templateBuffers[templateIndex].buffer,
-	     &flowBufBegin, &flowBufMax,
-	     &numElements, 0, myBucket, direction, 0, 0, 0 /* No JSON */);
+  /*
+    Plugin export callbacks have been written for a single export thread:
+    flows they handle are encoded one at a time
+  */
+  if(myBucket->ext->plugin != NULL) pthread_rwlock_wrlock(&readWriteGlobals->exportRwLock);
+
+  encodeFlowRecord(&readOnlyGlobals.templateBuffers[templateIndex],
+		   isV4Flow ? 1 /* IPv4 */ : 0 /* IPv6 */,
+		   worker->buffer[templateIndex],
+		   &flowBufBegin, &flowBufMax, myBucket, direction);
+
+  if(myBucket->ext->plugin != NULL) pthread_rwlock_unlock(&readWriteGlobals->exportRwLock);
 
 #if defined(HAVE_MYSQL)
-  the_buffer = &readOnlyGlobals.templateBuffers[templateIndex].buffer[readOnlyGlobals.templateBuffers[templateIndex].bufferLen];
-  the_len = flowBufBegin - readOnlyGlobals.templateBuffers[templateIndex].bufferLen;
+  the_buffer = &worker->buffer[templateIndex][worker->bufferLen[templateIndex]];
+  the_len = flowBufBegin - worker->bufferLen[templateIndex];
 
   if(readOnlyGlobals.enable_debug)
     traceEvent(TRACE_INFO, "--->>> Dumped flow [templateIndex=%u][the_len=%u][tot=%u][max=%u]",
 	       readOnlyGlobals.idTemplate + templateIndex, the_len, flowBufBegin,
-	       readOnlyGlobals.templateBuffers[templateIndex].bufferLen);
+	       worker->bufferLen[templateIndex]);
 #endif
 
 #ifdef HAVE_MYSQL
   if(readOnlyGlobals.enable_debug)
     traceEvent(TRACE_INFO, "Dumping data onto MySQL using template Id %u", readOnlyGlobals.idTemplate + templateIndex);
 
+  pthread_rwlock_wrlock(&readWriteGlobals->exportRwLock);
   dump_flow2db(readOnlyGlobals.templateBuffers[templateIndex].v9TemplateElementList, the_buffer, the_len);
+  pthread_rwlock_unlock(&readWriteGlobals->exportRwLock);
 #endif
 
-  readOnlyGlobals.templateBuffers[templateIndex].bufferLen = flowBufBegin;
-  readWriteGlobals->queuedDataToExport += flowBufBegin;
+  worker->queuedDataToExport += (flowBufBegin - worker->bufferLen[templateIndex]) + flowsetOverhead;
+  worker->bufferLen[templateIndex] = flowBufBegin, worker->bufferFlows[templateIndex]++;
 
   return(1);
 }
 
 /* ****************************************************** */
 
-#define HAVE_PORT(p,q) ((myBucket->core.tuple.key.k.ipKey.proto == q) && ((myBucket->core.tuple.key.k.ipKey.sport == p) || (myBucket->core.tuple.key.k.ipKey.dport == p)))
+#define HAVE_PORT(p,q) ((myBucket->ext->tuple.key.k.ipKey.proto == q) && ((myBucket->ext->tuple.key.k.ipKey.sport == p) || (myBucket->ext->tuple.key.k.ipKey.dport == p)))
 
 /* ****************************************************** */
 
 static void execBucketExpiracyActions(FlowHashBucket *myBucket) {
-  if((myBucket->core.l7.proto_type == NDPI_PROTO_TYPE)
-     && (myBucket->core.l7.proto.ndpi.ndpi_proto != NDPI_PROTOCOL_UNKNOWN))
+  if((myBucket->ext->cold.l7.proto_type == NDPI_PROTO_TYPE)
+     && (myBucket->ext->cold.l7.proto.ndpi.ndpi_proto != NDPI_PROTOCOL_UNKNOWN))
     add_to_lru_cache_num(&readWriteGlobals->l7Cache, getLRUCacheKey(myBucket),
-		     myBucket->core.l7.proto.ndpi.ndpi_proto);
+		     myBucket->ext->cold.l7.proto.ndpi.ndpi_proto);
 }
 
 /* ****************************************************** */
@@ -273,7 +307,8 @@ void setBucketExpired(FlowHashBucket *myBucket) {
 
 /* ****************************************************** */
 
-int exportBucketToNetflow(FlowHashBucket *myBucket,
+int exportBucketToNetflow(ExportWorker *worker,
+			  FlowHashBucket *myBucket,
 			  FlowDirection direction) {
   int rc = 0;
 
@@ -323,7 +358,7 @@ int exportBucketToNetflow(FlowHashBucket *myBucket,
   notifyFlow(myBucket, direction);
 #endif
 
-  if(myBucket->core.dont_export_flow)
+  if(myBucket->ext->cold.dont_export_flow)
     return(1);
 
   switch(readOnlyGlobals.biflowsExportPolicy) {
@@ -331,22 +366,22 @@ int exportBucketToNetflow(FlowHashBucket *myBucket,
     /* Nothing to do */
     break;
   case export_bidirectional_flows_only:
-    if((myBucket->core.tuple.flowCounters.pktSent == 0)
-       || (myBucket->core.tuple.flowCounters.pktRcvd == 0))
+    if((myBucket->core.flowCounters.pktSent == 0)
+       || (myBucket->core.flowCounters.pktRcvd == 0))
       return(1);
     break;
   case export_monodirectional_flows_only:
-    if((myBucket->core.tuple.flowCounters.pktSent > 0)
-       && (myBucket->core.tuple.flowCounters.pktRcvd > 0))
+    if((myBucket->core.flowCounters.pktSent > 0)
+       && (myBucket->core.flowCounters.pktRcvd > 0))
       return(1);
     break;
   }
 
   if(direction == src2dst_direction) {
-    if(myBucket->core.tuple.flowCounters.pktSent == 0)
+    if(myBucket->core.flowCounters.pktSent == 0)
       return(1);
   } else {
-    if(myBucket->core.tuple.flowCounters.pktRcvd == 0)
+    if(myBucket->core.flowCounters.pktRcvd == 0)
       return(1);
   }
 
@@ -368,8 +403,8 @@ int exportBucketToNetflow(FlowHashBucket *myBucket,
      || readOnlyGlobals.db_initialized
      ) {
     if(readOnlyGlobals.netFlowVersion == 5) {
-      if(myBucket->core.tuple.key.k.ipKey.src.ipVersion == 4)
-	rc = exportBucketToNetflowV5(myBucket, direction);
+      if(myBucket->ext->tuple.key.k.ipKey.src.ipVersion == 4)
+	rc = exportBucketToNetflowV5(worker, myBucket, direction);
       else {
 	static char msgPrinted = 0;
 
@@ -379,10 +414,12 @@ int exportBucketToNetflow(FlowHashBucket *myBucket,
 	}
       }
     } else
-      rc = exportBucketToNetflowV9(myBucket, direction);
+      rc = exportBucketToNetflowV9(worker, myBucket, direction);
   } else
     rc = 1;
 
+  /* Plugins, JSON exports and databases are not shared among export threads */
+  pthread_rwlock_wrlock(&readWriteGlobals->exportRwLock);
   checkDumpExport(myBucket, direction);
 
   if(rc) {
@@ -460,7 +497,7 @@ int exportBucketToNetflow(FlowHashBucket *myBucket,
 
 #ifdef HAVE_VOIP_EXTENSIONS
       if(readOnlyGlobals.hep.sock != -1) {
-	int rc = send_json_hepv3(myBucket, time(NULL),
+	int rc = send_json_hepv3(myBucket, coarseTime(),
 				 line_buffer, strlen(line_buffer));
 
 	if(rc > 0)
@@ -485,11 +522,11 @@ int exportBucketToNetflow(FlowHashBucket *myBucket,
       if(!readOnlyGlobals.simulateStorage) {
 	if(readOnlyGlobals.dumpFormat == binary_core_flow_format) {
 	  if(readWriteGlobals->flowFd) {
-	    int rc = fwrite(&myBucket->core.tuple, 1, sizeof(myBucket->core.tuple), readWriteGlobals->flowFd);
+	    int rc = fwrite(&myBucket->ext->tuple, 1, sizeof(myBucket->ext->tuple), readWriteGlobals->flowFd);
 
-	    if(rc != sizeof(myBucket->core.tuple))
+	    if(rc != sizeof(myBucket->ext->tuple))
 	      traceEvent(TRACE_WARNING, "Expected to send %d bytes, but sent only %d bytes",
-			 sizeof(myBucket->core.tuple), rc);
+			 sizeof(myBucket->ext->tuple), rc);
 	  }
 	} else {
 	  if((readOnlyGlobals.dumpFormat != binary_format)
@@ -508,115 +545,276 @@ int exportBucketToNetflow(FlowHashBucket *myBucket,
       pthread_rwlock_unlock(&readWriteGlobals->dumpFileLock);
     }
 
-    readWriteGlobals->numFlows++, readWriteGlobals->totFlows++,
-      readWriteGlobals->totFlowsRate++, readWriteGlobals->totFlowsSinceLastExport++;
+    pthread_rwlock_unlock(&readWriteGlobals->exportRwLock);
 
-    checkNetFlowExport(0);
-  }
+    worker->numFlows++;
+    checkWorkerExport(worker, 0);
+  } else
+    pthread_rwlock_unlock(&readWriteGlobals->exportRwLock);
 
   return(rc);
 }
 
 /* ****************************************************** */
 
-void checkNetFlowExport(int forceExport) {
+/* Adds the flows encoded since the last datagram to the global export stats */
+static void foldWorkerStats(ExportWorker *worker) {
+  if(worker->pendingFlows == 0) return;
+
+  pthread_rwlock_wrlock(&readWriteGlobals->exportStatsLock);
+  readWriteGlobals->flowExportStats.totExportedFlows += worker->pendingFlows;
+  readWriteGlobals->flowExportStats.totExportedFlowPkts += worker->pendingFlowPkts;
+  readWriteGlobals->flowExportStats.totExportedFlowBytes += worker->pendingFlowBytes;
+  readWriteGlobals->totFlows += worker->pendingFlows, readWriteGlobals->totFlowsRate += worker->pendingFlows;
+  pthread_rwlock_unlock(&readWriteGlobals->exportStatsLock);
+
+  worker->totExportedFlows += worker->pendingFlows;
+  worker->pendingFlows = 0, worker->pendingFlowPkts = 0, worker->pendingFlowBytes = 0;
+}
+
+/* ****************************************************** */
+
+/* The caller owns worker->lock (or is the worker thread itself) */
+static void checkWorkerExport(ExportWorker *worker, int forceExport) {
   int emitFlow, deltaFlows = 0, flowExpired = 0, sendTemplate = 0;
 
-  if(((readWriteGlobals->numFlows == 0)
+  foldWorkerStats(worker);
+
+  /* readWriteGlobals->actTime belongs to the capture and clock threads */
+  coarseTimeval(&worker->actTime);
+
+  if(((worker->numFlows == 0)
       || (readOnlyGlobals.numCollectors == 0))
      && (readOnlyGlobals.dumpFormat != binary_format)) {
     int i;
 
-    readWriteGlobals->numFlows = 0; /*
-				       Fake flow export so that everything works
-				       but flows are not exported
-				    */
+    worker->numFlows = 0; /*
+			     Fake flow export so that everything works
+			     but flows are not exported
+			  */
 
     for(i=0; i<readOnlyGlobals.numActiveTemplates; i++)
-      readOnlyGlobals.templateBuffers[i].bufferLen = 0;
+      worker->bufferLen[i] = 0, worker->bufferFlows[i] = 0;
 
+    worker->queuedDataToExport = 0;
     return;
   }
 
-  /*
-     We need to avoid that periodic flow export can interfere
-     with checkNetFlowExport() called after that a flow has been exported
-  */
-  pthread_rwlock_wrlock(&readWriteGlobals->checkExportLock);
-
 #ifdef DEBUG
-  traceEvent(TRACE_ERROR, "====> [queuedDataToExport=%u][templateFlowSize=%u]",
-	     readWriteGlobals->queuedDataToExport, readOnlyGlobals.templateFlowSize);
+  traceEvent(TRACE_ERROR, "====> [worker=%u][queuedDataToExport=%u][templateFlowSize=%u]",
+	     worker->worker_id, worker->queuedDataToExport, readOnlyGlobals.templateFlowSize);
 #endif
 
   if(((readOnlyGlobals.netFlowVersion == 9) || (readOnlyGlobals.netFlowVersion == 10))
      && (readOnlyGlobals.numCollectors > 1) && (!readOnlyGlobals.reflectorMode) /* Round-robin mode */
-     && (readOnlyGlobals.packetsBeforeSendingTemplates == 0) /* It's time to send the template */
+     && (worker->packetsBeforeSendingTemplates == 0) /* It's time to send the template */
      ) {
     if(readOnlyGlobals.netFlowVersion == 9) {
-      initNetFlowV9Header(&readWriteGlobals->theV9Header);
-      readWriteGlobals->theV9Header.count = htons(3);
+      initNetFlowV9Header(&worker->theV9Header);
+      worker->theV9Header.count = htons(3);
     } else
-      initIPFIXHeader(&readWriteGlobals->theIPFIXHeader);
+      initIPFIXHeader(&worker->theIPFIXHeader);
 
-    sendNetFlowV9V10(0, 1, 1);
+    sendNetFlowV9V10(worker, 0, 1, 1);
 
-    readOnlyGlobals.packetsBeforeSendingTemplates = readOnlyGlobals.numCollectors*readOnlyGlobals.templatePacketsDelta;
+    worker->packetsBeforeSendingTemplates = readOnlyGlobals.numCollectors*readOnlyGlobals.templatePacketsDelta;
   } else {
     if((readOnlyGlobals.netFlowVersion == 9 || readOnlyGlobals.netFlowVersion == 10)
-       && (readOnlyGlobals.packetsBeforeSendingTemplates == 0))
+       && (worker->packetsBeforeSendingTemplates == 0))
       deltaFlows = readOnlyGlobals.templateFlowSize, sendTemplate = 1;
   }
 
-  emitFlow = ((deltaFlows+readWriteGlobals->numFlows) >= readOnlyGlobals.minNumFlowsPerPacket)
+  emitFlow = ((deltaFlows+worker->numFlows) >= readOnlyGlobals.minNumFlowsPerPacket)
     || (forceExport && readWriteGlobals->shutdownInProgress)
     || sendTemplate /* || (pcapFile != NULL) */;
 
   if(!emitFlow) {
-    gettimeofday(&readWriteGlobals->actTime, NULL);
-
-    if(readWriteGlobals->lastExportTime.tv_sec == 0)
-      readWriteGlobals->lastExportTime.tv_sec = readWriteGlobals->actTime.tv_sec,
-	readWriteGlobals->lastExportTime.tv_usec = readWriteGlobals->actTime.tv_usec;
+    if(worker->lastExportTime.tv_sec == 0)
+      worker->lastExportTime.tv_sec = worker->actTime.tv_sec,
+	worker->lastExportTime.tv_usec = worker->actTime.tv_usec;
 
-    flowExpired = readWriteGlobals->lastExportTime.tv_sec
-      && (((time(NULL)-readWriteGlobals->lastExportTime.tv_sec) > readOnlyGlobals.sendTimeout)
-	  || (readWriteGlobals->actTime.tv_sec > (readWriteGlobals->lastExportTime.tv_sec+readOnlyGlobals.sendTimeout)));
+    flowExpired = worker->lastExportTime.tv_sec
+      && (((coarseTime()-worker->lastExportTime.tv_sec) > readOnlyGlobals.sendTimeout)
+	  || (worker->actTime.tv_sec > (worker->lastExportTime.tv_sec+readOnlyGlobals.sendTimeout)));
   }
 
   if(forceExport || emitFlow || flowExpired) {
     if(readOnlyGlobals.netFlowVersion == 5) {
-      initNetFlowV5Header(&readWriteGlobals->theV5Flow);
-      readWriteGlobals->theV5Flow.flowHeader.count = htons(readWriteGlobals->numFlows);
-      sendNetFlowV5(&readWriteGlobals->theV5Flow, 0);
+      initNetFlowV5Header(&worker->theV5Flow);
+      worker->theV5Flow.flowHeader.count = htons(worker->numFlows);
+      sendNetFlowV5(&worker->theV5Flow, 0);
+
+      if(worker->numFlows > 0)
+	worker->numDataPkts++, worker->numDataPktFlows += worker->numFlows,
+	  worker->numDataPktBytes += sizeof(struct flow_ver5_hdr) + worker->numFlows * sizeof(struct flow_ver5_rec);
     } else {
       if(readOnlyGlobals.netFlowVersion == 9) {
-	initNetFlowV9Header(&readWriteGlobals->theV9Header);
-	readWriteGlobals->theV9Header.count = (deltaFlows > 0) ? htons(4) : htons(1);
+	initNetFlowV9Header(&worker->theV9Header);
+	worker->theV9Header.count = (deltaFlows > 0) ? htons(4) : htons(1);
       } else {
-	initIPFIXHeader(&readWriteGlobals->theIPFIXHeader);
-	// readWriteGlobals->theIPFIXHeader.len = 0; /* To be filled later */
+	initIPFIXHeader(&worker->theIPFIXHeader);
+	// worker->theIPFIXHeader.len = 0; /* To be filled later */
       }
 
-      sendNetFlowV9V10(0, (deltaFlows > 0) ? 1 : 0, 0);
+      sendNetFlowV9V10(worker, 0, (deltaFlows > 0) ? 1 : 0, 0);
 
-      if(readOnlyGlobals.packetsBeforeSendingTemplates == 0)
-	readOnlyGlobals.packetsBeforeSendingTemplates = readOnlyGlobals.templatePacketsDelta;
+      if(worker->packetsBeforeSendingTemplates == 0)
+	worker->packetsBeforeSendingTemplates = readOnlyGlobals.templatePacketsDelta;
       else
-	readOnlyGlobals.packetsBeforeSendingTemplates--;
+	worker->packetsBeforeSendingTemplates--;
+    }
+
+    worker->numFlows = 0, worker->queuedDataToExport = 0;
+    worker->lastExportTime.tv_sec = worker->actTime.tv_sec,
+      worker->lastExportTime.tv_usec = worker->actTime.tv_usec;
+  }
+
+  if(worker->lastExportTime.tv_sec == 0) {
+    worker->lastExportTime.tv_sec = worker->actTime.tv_sec,
+      worker->lastExportTime.tv_usec = worker->actTime.tv_usec;
+  }
+}
+
+/* ****************************************************** */
+
+/* Flushes the datagrams being built by every export thread */
+void checkNetFlowExport(int forceExport) {
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+    ExportWorker *worker = &readWriteGlobals->exportWorkers[i];
+
+    /*
+       We need to avoid that periodic flow export can interfere
+       with checkWorkerExport() called after that a flow has been exported
+    */
+    pthread_rwlock_wrlock(&worker->lock);
+    checkWorkerExport(worker, forceExport);
+    pthread_rwlock_unlock(&worker->lock);
+  }
+
+  flushExportBatches(forceExport);
+}
+
+/* ****************************************************** */
+
+/* The template buffers are allocated by compileTemplates(): don't touch them here */
+void initExportWorkers(void) {
+  u_int32_t ring_len = readOnlyGlobals.maxExportQueueLen / readOnlyGlobals.numExportThreads;
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+    ExportWorker *worker = &readWriteGlobals->exportWorkers[i];
+
+    worker->worker_id = i;
+    pthread_rwlock_init(&worker->lock, NULL);
+
+#ifdef HAVE_GEOIP
+    if((readOnlyGlobals.geo_ip_asn_db != NULL) || (readOnlyGlobals.geo_ip_city_db != NULL))
+      worker->geoCache = createGeoCache();
+#endif
+
+    if(initMpscRing(&worker->ring, ring_len) != 0) {
+      traceEvent(TRACE_ERROR, "Unable to allocate the export queue of thread %d", i);
+      exit(-1);
+    }
+  }
+
+  traceEvent(TRACE_INFO, "Using %d export thread(s) [%u slots queue each]",
+	     readOnlyGlobals.numExportThreads, readWriteGlobals->exportWorkers[0].ring.size);
+}
+
+/* ****************************************************** */
+
+void termExportWorkers(void) {
+  int i, j;
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+    ExportWorker *worker = &readWriteGlobals->exportWorkers[i];
+    FlowHashBucket *bkt;
+
+    if(worker->ring.slots != NULL) {
+      while(mpscRingDequeue(&worker->ring, (void**)&bkt, 1) > 0)
+	purgeBucket(bkt);
+
+      termMpscRing(&worker->ring);
+      pthread_rwlock_destroy(&worker->lock);
+    }
+
+    for(j=0; j<MAX_NUM_TEMPLATES; j++) {
+      if(worker->buffer[j] != NULL) {
+	free(worker->buffer[j]);
+	worker->buffer[j] = NULL;
+      }
+    }
+
+    if(worker->packet != NULL) {
+      free(worker->packet);
+      worker->packet = NULL;
     }
 
-    readWriteGlobals->numFlows = 0;
-    readWriteGlobals->lastExportTime.tv_sec = readWriteGlobals->actTime.tv_sec,
-      readWriteGlobals->lastExportTime.tv_usec = readWriteGlobals->actTime.tv_usec;
+#ifdef HAVE_GEOIP
+    if(worker->geoCache != NULL) {
+      freeGeoCache(worker->geoCache);
+      worker->geoCache = NULL;
+    }
+#endif
   }
+}
+
+/* ****************************************************** */
+
+void wakeupExportWorkers(void) {
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++)
+    mpscRingWakeup(&readWriteGlobals->exportWorkers[i].ring);
+}
+
+/* ****************************************************** */
+
+u_int32_t getExportQueueLen(void) {
+  u_int32_t len = 0;
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++)
+    len += mpscRingLen(&readWriteGlobals->exportWorkers[i].ring);
+
+  return(len);
+}
+
+/* ****************************************************** */
+
+void dumpExportWorkerStats(u_int32_t nowDiff) {
+  u_int64_t numDataPkts = 0, numDataPktFlows = 0, numDataPktBytes = 0, numTemplatePkts = 0;
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+    ExportWorker *worker = &readWriteGlobals->exportWorkers[i];
 
-  if(readWriteGlobals->lastExportTime.tv_sec == 0) {
-    readWriteGlobals->lastExportTime.tv_sec = readWriteGlobals->actTime.tv_sec,
-      readWriteGlobals->lastExportTime.tv_usec = readWriteGlobals->actTime.tv_usec;
+    numDataPkts += worker->numDataPkts, numDataPktFlows += worker->numDataPktFlows;
+    numDataPktBytes += worker->numDataPktBytes, numTemplatePkts += worker->numTemplatePkts;
   }
 
-  pthread_rwlock_unlock(&readWriteGlobals->checkExportLock);
+  if(numDataPkts > 0)
+    traceEvent(TRACE_NORMAL, "Export datagrams: [%llu with flows][%.1f flows/datagram][%.0f bytes/datagram]"
+	       "[%llu with templates][max %u bytes]",
+	       (long long unsigned)numDataPkts, (float)numDataPktFlows / (float)numDataPkts,
+	       (float)numDataPktBytes / (float)numDataPkts, (long long unsigned)numTemplatePkts,
+	       readOnlyGlobals.maxNetFlowPacketPayloadLen);
+
+  if(readOnlyGlobals.numExportThreads < 2) return;
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+    ExportWorker *worker = &readWriteGlobals->exportWorkers[i];
+    u_int64_t diff = worker->totExportedFlows - worker->lastExportedFlows;
+
+    traceEvent(TRACE_NORMAL, "Export thread %d: [queue=%u/%u][ring full=%u][%.1f flows/sec]",
+	       i, mpscRingLen(&worker->ring), worker->ring.size, worker->ring.num_full,
+	       (nowDiff > 0) ? ((float)diff / (float)nowDiff) : 0);
+
+    worker->lastExportedFlows = worker->totExportedFlows;
+  }
 }
 
 /* ******************************************* */
@@ -646,6 +844,249 @@ static int send_buffer(int s, const void *msg, size_t len,
 
 /* ****************************************************** */
 
+/*
+  Only plain UDP collectors are batched: TCP/SCTP are streams, raw
+  sockets need a header per datagram and -e wants to pace each packet
+*/
+void initExportBatches(void) {
+  int i;
+
+  if(readOnlyGlobals.exportBatchLen < 2) return;
+
+  if(readOnlyGlobals.flowExportDelay > 0) {
+    traceEvent(TRACE_WARNING, "--export-batch is ignored when -e is used");
+    return;
+  }
+
+  for(i=0; i<readOnlyGlobals.numCollectors; i++) {
+    CollectorAddress *collector = &readOnlyGlobals.netFlowDest[i];
+    ExportBatch *batch;
+
+    if(collector->transport != TRANSPORT_UDP) continue;
+
+    if(((batch = (ExportBatch*)calloc(1, sizeof(ExportBatch))) == NULL)
+       || ((batch->slots = (char*)malloc(MAX_EXPORT_BATCH_LEN * readOnlyGlobals.exportBufferLen)) == NULL)) {
+      traceEvent(TRACE_WARNING, "Not enough memory: collector %d will not be batched", i);
+      if(batch) free(batch);
+      continue;
+    }
+
+    batch->slotLen = readOnlyGlobals.exportBufferLen;
+    collector->batch = batch;
+  }
+
+  traceEvent(TRACE_INFO, "Batching up to %u datagrams/%u msec per UDP collector",
+	     readOnlyGlobals.exportBatchLen, readOnlyGlobals.exportBatchTimeout);
+}
+
+/* ****************************************************** */
+
+void termExportBatches(void) {
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numCollectors; i++) {
+    CollectorAddress *collector = &readOnlyGlobals.netFlowDest[i];
+
+    if(collector->batch != NULL) {
+      free(collector->batch->slots);
+      free(collector->batch);
+      collector->batch = NULL;
+    }
+  }
+}
+
+/* ****************************************************** */
+
+/* The caller owns sendLock: same handling for single and batched sends */
+static void checkCollectorSendError(CollectorAddress *collector, int rc) {
+  if((rc == -1)
+     && ((errno == EPIPE /* Broken pipe */)
+	 || (errno == -1 /* Timeout */))) {
+    char msg[256], buf[64];
+
+    snprintf(msg, sizeof(msg), "Collector %s on socket %d %s [errno=%d/%s]",
+	     CollectorAddress2Str(collector, buf, sizeof(buf)),
+	     collector->sockFd,
+	     (errno == EPIPE) ? "disconnected" : "timed out: disconnecting it",
+	     errno, strerror(errno));
+    traceEvent(TRACE_WARNING, "%s", msg);
+
+    dumpLogEvent((errno == EPIPE) ? collector_disconnected : collector_too_slow, severity_warning, msg);
+    reopenSocket(collector);
+  }
+}
+
+/* ****************************************************** */
+
+/* The caller owns sendLock */
+static void flushExportBatch(CollectorAddress *collector) {
+  ExportBatch *batch = collector->batch;
+  u_int32_t num = batch->numDatagrams, sent = 0, numSyscalls = 0, i;
+
+  if(num == 0) return;
+
+  if(is_locked_send())
+    sent = num; /* Emulate successful send */
+  else {
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[MAX_EXPORT_BATCH_LEN];
+    struct iovec iov[MAX_EXPORT_BATCH_LEN];
+    u_int8_t retried = 0;
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * num);
+
+    for(i=0; i<num; i++) {
+      iov[i].iov_base = &batch->slots[i * batch->slotLen], iov[i].iov_len = batch->datagramLen[i];
+      msgs[i].msg_hdr.msg_iov = &iov[i], msgs[i].msg_hdr.msg_iovlen = 1;
+
+      if(!collector->isIPv6)
+	msgs[i].msg_hdr.msg_name = &collector->u.v4Address,
+	  msgs[i].msg_hdr.msg_namelen = sizeof(collector->u.v4Address);
+      else
+	msgs[i].msg_hdr.msg_name = &collector->u.v6Address,
+	  msgs[i].msg_hdr.msg_namelen = sizeof(collector->u.v6Address);
+    }
+
+    while(sent < num) {
+      int rc = sendmmsg(collector->sockFd, &msgs[sent], num - sent, MSG_DONTWAIT);
+
+      numSyscalls++;
+
+      if(rc > 0)
+	sent += rc;
+      else if((rc == -1) && (errno == EAGAIN) && (!retried))
+	retried = 1; /* Same as send_buffer(): try once more */
+      else
+	break;
+    }
+#else
+    for(i=0; i<num; i++) {
+      int rc;
+
+      if(!collector->isIPv6)
+	rc = send_buffer(collector->sockFd, &batch->slots[i * batch->slotLen], batch->datagramLen[i],
+			 0, (struct sockaddr *)&collector->u.v4Address, sizeof(collector->u.v4Address));
+      else
+	rc = send_buffer(collector->sockFd, &batch->slots[i * batch->slotLen], batch->datagramLen[i],
+			 0, (struct sockaddr *)&collector->u.v6Address, sizeof(collector->u.v6Address));
+
+      numSyscalls++;
+      if(rc == batch->datagramLen[i]) sent++;
+    }
+#endif
+  }
+
+  for(i=0; i<sent; i++)
+    readWriteGlobals->flowExportStats.totExportedBytes += batch->datagramLen[i];
+
+  readWriteGlobals->flowExportStats.totExportedPkts += sent;
+
+  batch->numFlushes++, batch->numSyscalls += numSyscalls, batch->numSentDatagrams += sent;
+  if(num > batch->maxBatchLen) batch->maxBatchLen = num;
+
+  if(num == 1)       batch->batchLenBins[0]++;
+  else if(num < 8)   batch->batchLenBins[1]++;
+  else if(num < 32)  batch->batchLenBins[2]++;
+  else               batch->batchLenBins[3]++;
+
+  batch->numDatagrams = 0;
+
+  if(sent < num) {
+    static u_char msgSent = 0;
+    int err = errno;
+
+    batch->numSendErrors += num - sent;
+
+    if((!msgSent) && (!readWriteGlobals->shutdownInProgress)) {
+      traceEvent(TRACE_WARNING, "Error while exporting flows (%s): %u/%u datagrams sent",
+		 strerror(err), sent, num);
+      msgSent = 1;
+    }
+
+    /* The datagrams not sent are dropped, as sendFlowData() does */
+    errno = err;
+    checkCollectorSendError(collector, -1);
+  }
+}
+
+/* ****************************************************** */
+
+/* The caller owns sendLock */
+static void batchDatagram(CollectorAddress *collector, char *buffer, int bufferLength,
+			  struct timeval *now) {
+  ExportBatch *batch = collector->batch;
+
+  if(batch->numDatagrams == 0)
+    memcpy(&batch->firstQueued, now, sizeof(struct timeval));
+
+  memcpy(&batch->slots[batch->numDatagrams * batch->slotLen], buffer, bufferLength);
+  batch->datagramLen[batch->numDatagrams++] = bufferLength;
+
+  if((batch->numDatagrams >= readOnlyGlobals.exportBatchLen)
+     || (msTimeDiff(now, &batch->firstQueued) >= readOnlyGlobals.exportBatchTimeout))
+    flushExportBatch(collector);
+}
+
+/* ****************************************************** */
+
+/* Sends the datagrams queued for longer than the batch timeout (all of them if forceFlush) */
+void flushExportBatches(u_char forceFlush) {
+  struct timeval now;
+  int i;
+
+  if(readOnlyGlobals.exportBatchLen < 2) return;
+
+  /* Called at every export tick: peek without the lock, the check is repeated below */
+  for(i=0; i<readOnlyGlobals.numCollectors; i++) {
+    CollectorAddress *collector = &readOnlyGlobals.netFlowDest[i];
+
+    if((collector->batch != NULL) && (collector->batch->numDatagrams > 0))
+      break;
+  }
+
+  if(i == readOnlyGlobals.numCollectors) return;
+
+  coarseTimeval(&now);
+  pthread_rwlock_wrlock(&readWriteGlobals->sendLock);
+
+  for(i=0; i<readOnlyGlobals.numCollectors; i++) {
+    CollectorAddress *collector = &readOnlyGlobals.netFlowDest[i];
+
+    if((collector->batch != NULL)
+       && (collector->batch->numDatagrams > 0)
+       && (forceFlush
+	   || (msTimeDiff(&now, &collector->batch->firstQueued) >= readOnlyGlobals.exportBatchTimeout)))
+      flushExportBatch(collector);
+  }
+
+  pthread_rwlock_unlock(&readWriteGlobals->sendLock);
+}
+
+/* ****************************************************** */
+
+void dumpExportBatchStats(void) {
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numCollectors; i++) {
+    ExportBatch *batch = readOnlyGlobals.netFlowDest[i].batch;
+    char buf[64];
+
+    if((batch == NULL) || (batch->numFlushes == 0)) continue;
+
+    traceEvent(TRACE_NORMAL, "Export batches [%s]: [%u datagrams in %u batches][avg %.1f/max %u]"
+	       "[syscalls saved=%u][batch len 1/2-7/8-31/32+: %u/%u/%u/%u][send errors=%u]",
+	       CollectorAddress2Str(&readOnlyGlobals.netFlowDest[i], buf, sizeof(buf)),
+	       batch->numSentDatagrams, batch->numFlushes,
+	       (float)(batch->numSentDatagrams + batch->numSendErrors) / (float)batch->numFlushes,
+	       batch->maxBatchLen,
+	       (batch->numSentDatagrams > batch->numSyscalls) ? (batch->numSentDatagrams - batch->numSyscalls) : 0,
+	       batch->batchLenBins[0], batch->batchLenBins[1], batch->batchLenBins[2], batch->batchLenBins[3],
+	       batch->numSendErrors);
+  }
+}
+
+/* ****************************************************** */
+
 #ifdef IP_HDRINCL
 
 #define BUFFER_SIZE 1500
@@ -765,7 +1206,7 @@ int is_locked_send(void) {
   static u_char show_message = 1;
   static time_t last_check = 0;
   static int last_returned_value = 0;
-  time_t now = time(NULL);
+  time_t now = coarseTime();
 
   /* Avoid checking the lock file too often */
   if((now-last_check) < MAX_LOCK_CHECK_FREQUENCY)
@@ -793,7 +1234,7 @@ int is_locked_send(void) {
 /* ****************************************************** */
 
 void reopenSocket(CollectorAddress *collector) {
-  int sockopt = 1;
+  int sockopt = 1, i;
 
   traceEvent(TRACE_WARNING,
 	     "Attempting to reopen the socket. Please wait....");
@@ -856,10 +1297,13 @@ void reopenSocket(CollectorAddress *collector) {
 	When a peer is reconnected the template should be resent
 	only to it. However in order to keep the code simple, the
 	template is resent to everyone.
+
+	We're called by sendFlowData() with the send lock held: the
+	templates go out with the next datagram of each export thread.
       */
       /* Force the probe to resend the template */
-      readOnlyGlobals.packetsBeforeSendingTemplates = 0;
-      sendNetFlowV9V10(0, 1, 1);
+      for(i=0; i<readOnlyGlobals.numExportThreads; i++)
+	readWriteGlobals->exportWorkers[i].packetsBeforeSendingTemplates = 0;
     }
   }
 
@@ -878,7 +1322,7 @@ static int sendFlowData(CollectorAddress *collector, char *buffer,
     traceEvent(TRACE_INFO, "Sending %d bytes packet", bufferLength);
 
   errno = 0;
-  gettimeofday(&now, NULL);
+  coarseTimeval(&now);
 
 #ifdef DEBUG
   traceEvent(TRACE_INFO, "sendFlowData: len=%d\n", bufferLength);
@@ -890,8 +1334,7 @@ static int sendFlowData(CollectorAddress *collector, char *buffer,
   */
 
 #if 0
-  traceEvent(TRACE_INFO, "**** flowSequence=%d [%d]",
-	     collector->flowSequence, readWriteGlobals->theIPFIXHeader.len);
+  traceEvent(TRACE_INFO, "**** flowSequence=%d", collector->flowSequence);
 #endif
 
   flow_sequence = htonl(collector->flowSequence);
@@ -937,6 +1380,13 @@ static int sendFlowData(CollectorAddress *collector, char *buffer,
   if((readOnlyGlobals.numCollectors == 0) || readOnlyGlobals.none_specified)
     return(bufferLength); /* Fake good send */
 
+  if((collector->batch != NULL) && (bufferLength <= collector->batch->slotLen)) {
+    /* Sent (and accounted) by flushExportBatch() */
+    batchDatagram(collector, buffer, bufferLength, &now);
+    collector->flowSequence += sequenceIncrement;
+    return(bufferLength);
+  }
+
   /*
     This delay is used to slow down export rate as some
     collectors might not be able to catch up with nProbe
@@ -1030,33 +1480,15 @@ static int sendFlowData(CollectorAddress *collector, char *buffer,
   /*
     Note that on NetFlow v9 the sequence number is
     incremented per NetFlow packet sent and not per
-    flow sent as for previous versions or in IPFIX.
+    flow sent as for previous versions or in IPFIX:
+    the caller passes the right increment.
   */
-  if(readOnlyGlobals.netFlowVersion == 10)
-    collector->flowSequence += readWriteGlobals->totFlowsSinceLastExport;
-  else
   collector->flowSequence += sequenceIncrement;
 
-  readWriteGlobals->totFlowsSinceLastExport = 0;
-
   if(readOnlyGlobals.flowExportDelay > 0)
     memcpy(&collector->lastExportTime, &now, sizeof(struct timeval));
 
-  if((rc == -1)
-     && ((errno == EPIPE /* Broken pipe */)
-	 || (errno == -1 /* Timeout */))) {
-    char msg[256], buf[64];
-
-    snprintf(msg, sizeof(msg), "Collector %s on socket %d %s [errno=%d/%s]",
-	     CollectorAddress2Str(collector, buf, sizeof(buf)),
-	     collector->sockFd,
-	     (errno == EPIPE) ? "disconnected" : "timed out: disconnecting it",
-	     errno, strerror(errno));
-    traceEvent(TRACE_WARNING, "%s", msg);
-
-    dumpLogEvent((errno == EPIPE) ? collector_disconnected : collector_too_slow, severity_warning, msg);
-    reopenSocket(collector);
-  }
+  checkCollectorSendError(collector, rc);
 
   if(rc == bufferLength) {
     /* Everything is ok */
@@ -1083,6 +1515,9 @@ void sendNetFlow(void *buffer, u_int32_t bufferLength,
      && (readOnlyGlobals.dumpFormat != binary_core_flow_format))
     return;
 
+  /* Export threads build datagrams in parallel but share sockets and sequence numbers */
+  pthread_rwlock_wrlock(&readWriteGlobals->sendLock);
+
   errno = 0;
 
   if(readOnlyGlobals.reflectorMode || broadcastToAllCollectors) {
@@ -1145,6 +1580,8 @@ void sendNetFlow(void *buffer, u_int32_t bufferLength,
       msgSent = 1;
     }
   }
+
+  pthread_rwlock_unlock(&readWriteGlobals->sendLock);
 }
 
 /* ****************************************************** */
@@ -1192,7 +1629,7 @@ void initNetFlowV9Header(V9FlowHeader *v9Header) {
   memset(v9Header, 0, sizeof(V9FlowHeader));
   v9Header->version        = htons(readOnlyGlobals.netFlowVersion);
   v9Header->sysUptime      = htonl(msTimeDiff(&readWriteGlobals->actTime, &readOnlyGlobals.initialSniffTime));
-  v9Header->unix_secs      = htonl((u_long)time(NULL));
+  v9Header->unix_secs      = htonl((u_long)coarseTime());
   v9Header->sourceId       = htonl((readOnlyGlobals.engineType << 8) + readOnlyGlobals.engineId);
 }
 
@@ -1218,11 +1655,12 @@ static int padding(int len) {
 
 /* ****************************************************** */
 
-static int sendFlowset(u_int16_t flowset_id, char *flowBuffer, u_int flowBufferLen, int *bufLen) {
+static int sendFlowset(ExportWorker *worker, u_int16_t flowset_id,
+		       char *flowBuffer, u_int flowBufferLen, int *bufLen) {
   int len, pad;
   V9FlowSet flowSet;
 
-  len = readOnlyGlobals.templateBuffers[flowset_id].bufferLen;
+  len = worker->bufferLen[flowset_id];
 
   if(len == 0) return(0); /* No flows to send */
 
@@ -1233,22 +1671,22 @@ static int sendFlowset(u_int16_t flowset_id, char *flowBuffer, u_int flowBufferL
   memcpy(&flowBuffer[(*bufLen)], &flowSet, sizeof(flowSet));
   (*bufLen) += sizeof(flowSet);
 
-  if(((*bufLen)+readOnlyGlobals.templateBuffers[flowset_id].bufferLen) >= flowBufferLen) {
+  if(((*bufLen)+worker->bufferLen[flowset_id]) >= flowBufferLen) {
     static u_char warning_sent = 0;
 
     if(!warning_sent) {
       traceEvent(TRACE_WARNING,
 		 "Internal error: too many NetFlow flows per packet (see -m) [%u/%u]",
-		 ((*bufLen)+readOnlyGlobals.templateBuffers[flowset_id].bufferLen),
+		 ((*bufLen)+worker->bufferLen[flowset_id]),
 		 flowBufferLen);
       warning_sent = 1;
     }
 
-    readOnlyGlobals.templateBuffers[flowset_id].bufferLen = flowBufferLen-(*bufLen)-1;
+    worker->bufferLen[flowset_id] = flowBufferLen-(*bufLen)-1;
   }
 
-  memcpy(&flowBuffer[(*bufLen)], readOnlyGlobals.templateBuffers[flowset_id].buffer, readOnlyGlobals.templateBuffers[flowset_id].bufferLen);
-  (*bufLen) += readOnlyGlobals.templateBuffers[flowset_id].bufferLen;
+  memcpy(&flowBuffer[(*bufLen)], worker->buffer[flowset_id], worker->bufferLen[flowset_id]);
+  (*bufLen) += worker->bufferLen[flowset_id];
   (*bufLen) += pad;
 
   return(1);
@@ -1256,47 +1694,79 @@ static int sendFlowset(u_int16_t flowset_id, char *flowBuffer, u_int flowBufferL
 
 /* ****************************************************** */
 
-void sendNetFlowV9V10(u_char lastFlow,
+/* Copies the v9/IPFIX header: flow_sequence will be filled by sendFlowData */
+static int initFlowPacket(ExportWorker *worker, char *flowBuffer) {
+  if(readOnlyGlobals.netFlowVersion == 9) {
+    memcpy(flowBuffer, &worker->theV9Header, sizeof(worker->theV9Header));
+    return(sizeof(worker->theV9Header));
+  } else {
+    /* IPFIX */
+    memcpy(flowBuffer, &worker->theIPFIXHeader, sizeof(worker->theIPFIXHeader));
+    return(sizeof(worker->theIPFIXHeader));
+  }
+}
+
+/* ****************************************************** */
+
+static void sendFlowPacket(char *flowBuffer, int bufLen, u_int numRecords,
+			   u_int numDataRecords, u_char broadcastToAllCollectors) {
+  u_int16_t len;
+
+  /* Fill in the record count (v9) or the message length (IPFIX) */
+  len = htons((readOnlyGlobals.netFlowVersion == 9) ? numRecords : bufLen);
+  memcpy(&flowBuffer[2], &len, 2);
+
+#ifdef DEBUG
+  traceEvent(TRACE_ERROR, "--->>> Sending %u bytes flow packet [%u records]", bufLen, numRecords);
+#endif
+
+  /* v9 sequence numbers count packets, IPFIX ones count data records */
+  sendNetFlow(flowBuffer, bufLen, 0,
+	      (readOnlyGlobals.netFlowVersion == 10) ? numDataRecords : 1,
+	      broadcastToAllCollectors);
+}
+
+/* ****************************************************** */
+
+/*
+  Templates and data flowsets are packed into datagrams of up to
+  maxNetFlowPacketPayloadLen bytes. When templates go to all the
+  collectors while flows are sent in round robin, templates need their
+  own datagrams; otherwise the last template datagram is filled with
+  flows too.
+*/
+void sendNetFlowV9V10(ExportWorker *worker,
+		      u_char lastFlow,
 		      u_char sendTemplate,
 		      u_char sendOnlyTheTemplate) {
-  char flowBuffer[JUMBO_MTU] = { 0 };
-  int bufLen = 0, /* len, */ num_extra_elems = 0, i;
+  char *flowBuffer = worker->packet;
+  u_int maxPktLen = readOnlyGlobals.maxNetFlowPacketPayloadLen, headerLen = flowPacketHeaderLen();
+  int bufLen = 0, num_extra_elems = 0, i;
+  u_int8_t mixTemplatesAndFlows = ((readOnlyGlobals.numCollectors <= 1) || readOnlyGlobals.reflectorMode) ? 1 : 0;
 
   /* traceEvent(TRACE_WARNING, "****** Sending templates... %d [%d]", sendTemplate, sendOnlyTheTemplate); */
 
-  /*
-    NOTE:
-    In order to keep things simple, whenever there are multiple
-    collectors in round robin and the template needs to be sent out
-    it is sent alone (i.e. without incuding flows) to all the collectors.
-
-    If there is just one collector, the template also contains flows
-    up to the MTU size.
-  */
   if(sendTemplate) {
     V9TemplateHeader templateHeader;
     V9TemplateDef templateDef;
     V9OptionTemplate optionTemplateDef;
     char tmpBuffer[256];
-    u_int flowBufBegin, flowBufMax, i, maxTemplatePktLen = 1200, beginIdx = 0, endIdx = 0, numTemplatesSent = 0;
+    u_int flowBufBegin, flowBufMax, i, maxTemplatePktLen, beginIdx = 0, endIdx = 0, numTemplatesSent = 0;
     int numElements, optionTemplateId = readOnlyGlobals.idTemplate + readOnlyGlobals.numActiveTemplates;
     V9FlowSet optionsFlowSet;
 
+    /* Leave room for the option template and its data record */
+    if(maxPktLen > (headerLen + 64 + readOnlyGlobals.optionTemplateBufBegin + 256))
+      maxTemplatePktLen = maxPktLen - headerLen - 64 - readOnlyGlobals.optionTemplateBufBegin;
+    else
+      maxTemplatePktLen = 256;
+
     while(numTemplatesSent < readOnlyGlobals.numActiveTemplates) {
       u_int16_t len;
       int pad;
 
-      bufLen = 0, num_extra_elems = 0;
-
-      /* NOTE: flow_sequence will be filled by sendFlowData */
-      if(readOnlyGlobals.netFlowVersion == 9) {
-	memcpy(&flowBuffer[bufLen], &readWriteGlobals->theV9Header, sizeof(readWriteGlobals->theV9Header));
-	bufLen += sizeof(readWriteGlobals->theV9Header);
-      } else {
-	/* IPFIX */
-	memcpy(&flowBuffer[bufLen], &readWriteGlobals->theIPFIXHeader, sizeof(readWriteGlobals->theIPFIXHeader));
-	bufLen += sizeof(readWriteGlobals->theIPFIXHeader);
-      }
+      num_extra_elems = 0;
+      bufLen = initFlowPacket(worker, flowBuffer);
 
       /* Header */
       num_extra_elems++;
@@ -1308,7 +1778,7 @@ void sendNetFlowV9V10(u_char lastFlow,
 
 	to_add = sizeof(V9TemplateDef) + readOnlyGlobals.templateBuffers[i].templateBufBegin;
 
-	if((len + to_add) > maxTemplatePktLen)
+	if(((len + to_add) > maxTemplatePktLen) && (i > beginIdx))
 	  break;
 
 	len += to_add;
@@ -1416,162 +1886,135 @@ void sendNetFlowV9V10(u_char lastFlow,
 	} /* Scope */
       }
 
-      /* Fill in the flow length */
-      switch(readOnlyGlobals.netFlowVersion) {
-      case 9:
-	len = htons(num_extra_elems);
-	memcpy(&flowBuffer[2], &len, 2);
-	break;
-
-      case 10:
-	len = htons(bufLen);
-	memcpy(&flowBuffer[2], &len, 2);
-      	break;
-      }
+      worker->numTemplatePkts++;
+      beginIdx = endIdx+1;
 
-#ifdef DEBUG
-      traceEvent(TRACE_ERROR, "--->>> Sending %u bytes template packet", bufLen);
-#endif
+      if((numTemplatesSent == readOnlyGlobals.numActiveTemplates)
+	 && mixTemplatesAndFlows && (!sendOnlyTheTemplate))
+	break; /* Flows will be appended to this datagram */
 
-      sendNetFlow(&flowBuffer, bufLen, 0, 1, 1);
-      beginIdx = endIdx+1;
+      sendFlowPacket(flowBuffer, bufLen, num_extra_elems, 0, 1);
+      bufLen = 0;
     } /* while */
   }
 
   if(!sendOnlyTheTemplate) {
-    u_int num, beginIdx, numTemplateFlowsSent = 0;
-
-    while(numTemplateFlowsSent < readOnlyGlobals.numActiveTemplates) {
-      bufLen = 0, num_extra_elems = 0, num = 0, beginIdx = 0;
+    u_int numRecords = num_extra_elems, numDataRecords = 0;
 
-      /* NOTE: flow_sequence will be filled by sendFlowData */
-      if(readOnlyGlobals.netFlowVersion == 9) {
-	memcpy(&flowBuffer[bufLen], &readWriteGlobals->theV9Header,
-	       sizeof(readWriteGlobals->theV9Header));
-	bufLen += sizeof(readWriteGlobals->theV9Header);
-      } else {
-	/* IPFIX */
-	memcpy(&flowBuffer[bufLen], &readWriteGlobals->theIPFIXHeader,
-	       sizeof(readWriteGlobals->theIPFIXHeader));
-	bufLen += sizeof(readWriteGlobals->theIPFIXHeader);
-      }
+    if(bufLen == 0) bufLen = initFlowPacket(worker, flowBuffer);
 
-      /* Send all buffered data */
-      for(i=beginIdx; i<readOnlyGlobals.numActiveTemplates; i++) {
-	int n;
+    /* Send all buffered data */
+    for(i=0; i<readOnlyGlobals.numActiveTemplates; i++) {
+      u_int flowsetLen;
 
-	n = sendFlowset(i, flowBuffer, sizeof(flowBuffer), &bufLen);
-	num += n;
+      if(worker->bufferLen[i] == 0) continue;
 
-#ifdef DEBUG
-	if(n > 0)
-	  traceEvent(TRACE_ERROR, "--->>> Sending flowset %u/%u [id=%d][len=%u][bufLen=%u][num=%u]",
-		     i, readOnlyGlobals.numActiveTemplates,
-		     readOnlyGlobals.idTemplate + i, n, bufLen, num);
-#endif
+      flowsetLen = sizeof(V9FlowSet) + worker->bufferLen[i] + padding(sizeof(V9FlowSet) + worker->bufferLen[i]);
 
-	numTemplateFlowsSent++;
+      if(((bufLen + flowsetLen) > maxPktLen) && (bufLen > (int)headerLen)) {
+	/* This flowset goes into the next datagram */
+	worker->numDataPkts++, worker->numDataPktFlows += numDataRecords, worker->numDataPktBytes += bufLen;
+	sendFlowPacket(flowBuffer, bufLen, numRecords, numDataRecords, 0);
 
-	if(bufLen > readOnlyGlobals.maxNetFlowPacketPayloadLen /* bytes */)
-	  break;
+	bufLen = initFlowPacket(worker, flowBuffer);
+	numRecords = 0, numDataRecords = 0;
       }
 
-      /* Fill in the flow length */
-      if(readOnlyGlobals.netFlowVersion == 9) {
-	u_int16_t len = htons(num+num_extra_elems);
-
-	memcpy(&flowBuffer[2], &len, 2);
-      } else if(readOnlyGlobals.netFlowVersion == 10) {
-	u_int16_t len = htons(bufLen);
-
-	memcpy(&flowBuffer[2], &len, 2);
-      }
-
-      sendNetFlow(flowBuffer, bufLen, 0, 1, 0);
+      if(sendFlowset(worker, i, flowBuffer, readOnlyGlobals.exportBufferLen, &bufLen) > 0)
+	numRecords += worker->bufferFlows[i], numDataRecords += worker->bufferFlows[i];
 
 #ifdef DEBUG
-      traceEvent(TRACE_ERROR, "--->>> Sending %u bytes flow packet", bufLen);
+      traceEvent(TRACE_ERROR, "--->>> Added flowset %u/%u [id=%d][bufLen=%u][records=%u]",
+		 i, readOnlyGlobals.numActiveTemplates,
+		 readOnlyGlobals.idTemplate + i, bufLen, numRecords);
 #endif
+    }
 
-      beginIdx = numTemplateFlowsSent+1;
-    } /* while */
+    if(bufLen > (int)headerLen) {
+      if(numDataRecords > 0)
+	worker->numDataPkts++, worker->numDataPktFlows += numDataRecords, worker->numDataPktBytes += bufLen;
+
+      sendFlowPacket(flowBuffer, bufLen, numRecords, numDataRecords, 0);
+    }
   }
 
   for(i=0; i<readOnlyGlobals.numActiveTemplates; i++)
-    readOnlyGlobals.templateBuffers[i].bufferLen = 0;
+    worker->bufferLen[i] = 0, worker->bufferFlows[i] = 0;
+
+  worker->queuedDataToExport = 0;
 }
 
 /* ****************************************************** */
 
 static void id2user(FlowHashBucket *bkt, char *keyname) {
-  if(!bkt->core.user.user_searched) {
-    char *user, key[64];
+  if(!bkt->ext->cold.user.user_searched) {
+    char *user, key[64], buf[256];
 
     snprintf(key, sizeof(key), "username.%s", keyname);
-    user = find_lru_cache_str(&readWriteGlobals->flowUsersCache, key);
+    user = find_lru_cache_str_copy(&readWriteGlobals->flowUsersCache, key, buf, sizeof(buf));
 
     if(user != NULL) {
       if(user[0] != '\0') {
-	bkt->core.user.username = strdup(user);
+	bkt->ext->cold.user.username = strdup(user);
       } else {
 	/* The cache said that we have no result yet (string is "") */
       }
 
-      bkt->core.user.user_searched = 1;
+      bkt->ext->cold.user.user_searched = 1;
       return;
     }
 
-    user = getHashCacheDataStrKey("", bkt->core.tuple.flow_hash % MAX_NUM_REDIS_CONNECTIONS,
+    user = getHashCacheDataStrKey("", bkt->core.flow_hash % MAX_NUM_REDIS_CONNECTIONS,
 				  keyname, "username");
 
     if(user != NULL) {
-      bkt->core.user.username = user;
+      bkt->ext->cold.user.username = user;
       add_to_lru_cache_str_timeout(&readWriteGlobals->flowUsersCache, key, user, 60 /* (sec) Positive expire time */);
     } else {
       add_to_lru_cache_str_timeout(&readWriteGlobals->flowUsersCache, key, "", 5 /* (sec) Negative expire time */);
     }
 
-    bkt->core.user.user_searched = 1;
+    bkt->ext->cold.user.user_searched = 1;
   }
 }
 
 /* ****************************************************** */
 
 void setServerName(FlowHashBucket *bkt, char *name) {
-  if((name != NULL) && (bkt->core.server.name == NULL)) {
-    if(bkt->core.server.name) free(bkt->core.server.name);
-    bkt->core.server.name = strdup(name), bkt->core.server.server_searched = 1;
+  if((name != NULL) && (bkt->ext->cold.server.name == NULL)) {
+    if(bkt->ext->cold.server.name) free(bkt->ext->cold.server.name);
+    bkt->ext->cold.server.name = strdup(name), bkt->ext->cold.server.server_searched = 1;
   }
 }
 
 /* ****************************************************** */
 
 void mapServerName(FlowHashBucket *bkt) {
-  if(!bkt->core.server.server_searched) {
+  if(!bkt->ext->cold.server.server_searched) {
     char *server_ip, buf[128];
 
-    server_ip = _intoa((bkt->core.tuple.key.k.ipKey.sport > bkt->core.tuple.key.k.ipKey.dport) ?
-		       bkt->core.tuple.key.k.ipKey.dst : bkt->core.tuple.key.k.ipKey.src,
+    server_ip = _intoa((bkt->ext->tuple.key.k.ipKey.sport > bkt->ext->tuple.key.k.ipKey.dport) ?
+		       bkt->ext->tuple.key.k.ipKey.dst : bkt->ext->tuple.key.k.ipKey.src,
 		       buf, sizeof(buf));
 
-    bkt->core.server.name = getCacheDataStrKey("dns.cache.", 0, server_ip);
-    bkt->core.server.server_searched = 1;
+    bkt->ext->cold.server.name = getCacheDataStrKey("dns.cache.", 0, server_ip);
+    bkt->ext->cold.server.server_searched = 1;
   }
 }
 
 /* ****************************************************** */
 
 void teid2user(FlowHashBucket *bkt, u_int32_t teid) {
-  if(!bkt->core.user.user_searched) {
-    char *user, key[64];
+  if(!bkt->ext->cold.user.user_searched) {
+    char *user, key[64], buf[256];
 
     snprintf(key, sizeof(key), "teid.%u", teid);
-    user = find_lru_cache_str(&readWriteGlobals->flowUsersCache, key);
+    user = find_lru_cache_str_copy(&readWriteGlobals->flowUsersCache, key, buf, sizeof(buf));
 
     if(user != NULL) {
       if(user[0] != '\0') {
-	bkt->core.user.username = strdup(user);
-	bkt->core.user.user_searched = 1;
+	bkt->ext->cold.user.username = strdup(user);
+	bkt->ext->cold.user.user_searched = 1;
       } else {
 	/* The cache said that we have no result yet (string is "") */
       }
@@ -1582,12 +2025,12 @@ void teid2user(FlowHashBucket *bkt, u_int32_t teid) {
     user = getCacheDataNumKey("teid.", 0, teid);
 
     if(user != NULL) {
-      bkt->core.user.username = user;
+      bkt->ext->cold.user.username = user;
       add_to_lru_cache_str_timeout(&readWriteGlobals->flowUsersCache, key, user, 60 /* (sec) Positive expire time */);
     } else
       add_to_lru_cache_str_timeout(&readWriteGlobals->flowUsersCache, key, "", 5 /* (sec) Negative expire time */);
 
-    bkt->core.user.user_searched = 1;
+    bkt->ext->cold.user.user_searched = 1;
   }
 }
 
@@ -1608,12 +2051,12 @@ static void accoutTrafficPerIMSI(FlowHashBucket *bkt) {
   u_int32_t bytes_up, bytes_down;
 
   if((!readOnlyGlobals.aggregateTrafficPerIMSI)
-     || (bkt->core.user.username == NULL))
+     || (bkt->ext->cold.user.username == NULL))
     return;
 
-  semicolumn = strrchr(bkt->core.user.username, ';');
+  semicolumn = strrchr(bkt->ext->cold.user.username, ';');
   if(!semicolumn) {
-    traceEvent(TRACE_WARNING, "Invalid IMSI format (%s)", bkt->core.user.username);
+    traceEvent(TRACE_WARNING, "Invalid IMSI format (%s)", bkt->ext->cold.user.username);
     return;
   } else
     client_ip = atol(&semicolumn[1]);
@@ -1622,35 +2065,35 @@ static void accoutTrafficPerIMSI(FlowHashBucket *bkt) {
     IMSI/NSAPI/LAC/CCI/CSAC/IPv4
     123460000026315;5;0;0;0;123456789
   */
-  snprintf(key, sizeof(key), "gtp.%s", bkt->core.user.username);
+  snprintf(key, sizeof(key), "gtp.%s", bkt->ext->cold.user.username);
   if(strlen(key) > 14) {
     semicolumn = strchr(&key[14], ';');
     semicolumn = strchr(&semicolumn[1], ';');
     semicolumn[0] = '\0';
   }
 
-  //traceEvent(TRACE_NORMAL, "==> %s", bkt->core.user.username ? bkt->core.user.username : "???");
+  //traceEvent(TRACE_NORMAL, "==> %s", bkt->ext->cold.user.username ? bkt->ext->cold.user.username : "???");
 
-  if(bkt->core.tuple.key.k.ipKey.src.ipType.ipv4 == client_ip)
-    bytes_up = bkt->core.tuple.flowCounters.bytesSent, bytes_down = bkt->core.tuple.flowCounters.bytesRcvd;
+  if(bkt->ext->tuple.key.k.ipKey.src.ipType.ipv4 == client_ip)
+    bytes_up = bkt->core.flowCounters.bytesSent, bytes_down = bkt->core.flowCounters.bytesRcvd;
   else
-    bytes_up = bkt->core.tuple.flowCounters.bytesRcvd, bytes_down = bkt->core.tuple.flowCounters.bytesSent;
+    bytes_up = bkt->core.flowCounters.bytesRcvd, bytes_down = bkt->core.flowCounters.bytesSent;
 
   id = bytes_up % MAX_NUM_REDIS_CONNECTIONS;
   incrHashCacheKeyValueNumber(key, id, "bytes.up", bytes_up);
   incrHashCacheKeyValueNumber(key, id, "bytes.down", bytes_down);
 
-  if(bkt->ext && (bkt->core.tuple.key.k.ipKey.proto == IPPROTO_TCP)) {
+  if(bkt->ext && (bkt->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP)) {
     u_int32_t retr_up, retr_down, retr;
 
-    if(bkt->core.tuple.key.k.ipKey.src.ipType.ipv4 == client_ip)
+    if(bkt->ext->tuple.key.k.ipKey.src.ipType.ipv4 == client_ip)
       retr_up  = bkt->ext->protoCounters.tcp.bytesSentRetransmitted, retr_down = bkt->ext->protoCounters.tcp.bytesRcvdRetransmitted;
     else
       retr_up  = bkt->ext->protoCounters.tcp.bytesRcvdRetransmitted, retr_down = bkt->ext->protoCounters.tcp.bytesSentRetransmitted;
 
     incrHashCacheKeyValueNumber(key, id, "bytes.tcp_noretr_up", bytes_up-retr_up);
     incrHashCacheKeyValueNumber(key, id, "bytes.tcp_noretr_down", bytes_down-retr_down);
-    incrHashCacheKeyValueNumber(key, id, "pkts.tcp",  bkt->core.tuple.flowCounters.pktSent+bkt->core.tuple.flowCounters.pktRcvd);
+    incrHashCacheKeyValueNumber(key, id, "pkts.tcp",  bkt->core.flowCounters.pktSent+bkt->core.flowCounters.pktRcvd);
 
     if((retr = bkt->ext->protoCounters.tcp.pktRcvdRetransmitted + bkt->ext->protoCounters.tcp.pktSentRetransmitted) > 0)
       incrHashCacheKeyValueNumber(key, id, "pkts.retr_tcp", retr);    
@@ -1660,13 +2103,13 @@ static void accoutTrafficPerIMSI(FlowHashBucket *bkt) {
 /* *********************************************** */
 
 void mapTrafficToUser(FlowHashBucket *bkt) {
-  if(bkt->core.user.user_searched) return;
+  if(bkt->ext->cold.user.user_searched) return;
 
   /* 1 - Search tunnels (if any) */
   if(bkt->ext != NULL) {
     if(bkt->ext->src2dst_tunnel_id != 0) {
       teid2user(bkt, bkt->ext->src2dst_tunnel_id);
-      if(bkt->core.user.user_searched /* Found */) {
+      if(bkt->ext->cold.user.user_searched /* Found */) {
 	accoutTrafficPerIMSI(bkt);
 	return;
       }
@@ -1674,7 +2117,7 @@ void mapTrafficToUser(FlowHashBucket *bkt) {
 
     if(bkt->ext->dst2src_tunnel_id != 0) {
       teid2user(bkt, bkt->ext->dst2src_tunnel_id);
-      if(bkt->core.user.user_searched /* Found */) {
+      if(bkt->ext->cold.user.user_searched /* Found */) {
 	accoutTrafficPerIMSI(bkt);
 	return;
       }
@@ -1684,19 +2127,19 @@ void mapTrafficToUser(FlowHashBucket *bkt) {
   if(readOnlyGlobals.enableRadiusPlugin
      || readOnlyGlobals.enableDiameterPlugin) {
     /* 2 - Search IPs */
-    if(bkt->core.tuple.key.k.ipKey.src.ipVersion == 4) {
+    if(bkt->ext->tuple.key.k.ipKey.src.ipVersion == 4) {
       /* We search only IPv4 */
       char buf[32];
 
       /* Try with the client first */
-      if(bkt->core.tuple.key.k.ipKey.sport < bkt->core.tuple.key.k.ipKey.dport) {
-	ip2user(bkt, bkt->core.tuple.key.k.ipKey.src.ipType.ipv4, buf, sizeof(buf));
-	if(bkt->core.user.user_searched /* Found */) return;
-	ip2user(bkt, bkt->core.tuple.key.k.ipKey.dst.ipType.ipv4, buf, sizeof(buf));
+      if(bkt->ext->tuple.key.k.ipKey.sport < bkt->ext->tuple.key.k.ipKey.dport) {
+	ip2user(bkt, bkt->ext->tuple.key.k.ipKey.src.ipType.ipv4, buf, sizeof(buf));
+	if(bkt->ext->cold.user.user_searched /* Found */) return;
+	ip2user(bkt, bkt->ext->tuple.key.k.ipKey.dst.ipType.ipv4, buf, sizeof(buf));
       } else {
-	ip2user(bkt, bkt->core.tuple.key.k.ipKey.dst.ipType.ipv4, buf, sizeof(buf));
-	if(bkt->core.user.user_searched /* Found */) return;
-	ip2user(bkt, bkt->core.tuple.key.k.ipKey.src.ipType.ipv4, buf, sizeof(buf));
+	ip2user(bkt, bkt->ext->tuple.key.k.ipKey.dst.ipType.ipv4, buf, sizeof(buf));
+	if(bkt->ext->cold.user.user_searched /* Found */) return;
+	ip2user(bkt, bkt->ext->tuple.key.k.ipKey.src.ipType.ipv4, buf, sizeof(buf));
       }
     }
   }
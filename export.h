@@ -27,15 +27,24 @@
 #include "plugins/hep.h"
 #endif
 
-extern int exportBucketToNetflow(FlowHashBucket *myBucket, FlowDirection direction);
+extern int exportBucketToNetflow(ExportWorker *worker, FlowHashBucket *myBucket, FlowDirection direction);
 extern void setBucketExpired(FlowHashBucket *myBucket);
 extern void checkNetFlowExport(int forceExport);
+extern void initExportWorkers(void);
+extern void termExportWorkers(void);
+extern void wakeupExportWorkers(void);
+extern u_int32_t getExportQueueLen(void);
+extern void dumpExportWorkerStats(u_int32_t nowDiff);
+extern void initExportBatches(void);
+extern void termExportBatches(void);
+extern void flushExportBatches(u_char forceFlush);
+extern void dumpExportBatchStats(void);
 
 extern void sendNetFlow(void *buffer, u_int32_t bufferLength,
 			u_char lastFlow, int sequenceIncrement,
 			u_char broadcastToAllCollectors);
 extern void sendNetFlowV5(NetFlow5Record *theV5Flow, u_char lastFlow);
-extern void sendNetFlowV9V10(u_char lastFlow, u_char sendTemplate,
+extern void sendNetFlowV9V10(ExportWorker *worker, u_char lastFlow, u_char sendTemplate,
 			     u_char sendOnlyTheTemplate);
 extern void setServerName(FlowHashBucket *bkt, char *name);
 extern void mapServerName(FlowHashBucket *bkt);
@@ -0,0 +1,485 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSE42_CRC32C
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_ARM_CRC32C
+#endif
+
+#define FLOW_HASH_SEED            0x9E3779B9
+#define CRC32C_POLY               0x82F63B78 /* Castagnoli, reflected */
+#define FLOW_HASH_TEST_MAX_QUEUES 64
+
+static u_int32_t crc32cTable[256];
+static u_int8_t crc32cHw;
+
+/* ****************************************************** */
+
+static u_int32_t additiveHash(const FlowHashKey *key) {
+  u_int32_t hash = 0, i;
+
+  /* Same values as the hash used before the hash became selectable */
+  if(key->type == FLOW_HASH_KEY_MAC) {
+    const u_int8_t *lo = (const u_int8_t*)key->lo, *hi = (const u_int8_t*)key->hi;
+
+    for(i=0; i<6; i++) hash += lo[i] + hi[i];
+  } else {
+    for(i=0; i<key->addr_words; i++) hash += key->lo[i] + key->hi[i];
+  }
+
+  if(key->type == FLOW_HASH_KEY_GTP)
+    return((key->subflow_id << 1) + key->subflow_id + hash);
+
+  return(hash + key->vlanId + key->proto + 3*(key->lo_port + key->hi_port)
+	 + key->tos + key->untunneled_proto + key->subflow_id);
+}
+
+/* ****************************************************** */
+
+static __inline__ u_int32_t rotl32(u_int32_t x, int r) {
+  return((x << r) | (x >> (32 - r)));
+}
+
+static __inline__ u_int32_t murmurStep(u_int32_t h, u_int32_t k) {
+  k *= 0xCC9E2D51, k = rotl32(k, 15), k *= 0x1B873593;
+  h ^= k, h = rotl32(h, 13);
+
+  return(h * 5 + 0xE6546B64);
+}
+
+/* MurmurHash3 (x86, 32 bit) on the key words */
+static u_int32_t murmurHash(const FlowHashKey *key) {
+  u_int32_t h = FLOW_HASH_SEED, tail[FLOW_HASH_KEY_TAIL_WORDS], i;
+
+  for(i=0; i<key->addr_words; i++) h = murmurStep(h, key->lo[i]);
+  for(i=0; i<key->addr_words; i++) h = murmurStep(h, key->hi[i]);
+
+  memcpy(tail, &key->lo_port, sizeof(tail));
+  for(i=0; i<FLOW_HASH_KEY_TAIL_WORDS; i++) h = murmurStep(h, tail[i]);
+
+  h ^= (2 * key->addr_words + FLOW_HASH_KEY_TAIL_WORDS) * 4;
+  h ^= h >> 16, h *= 0x85EBCA6B, h ^= h >> 13, h *= 0xC2B2AE35, h ^= h >> 16;
+
+  return(h);
+}
+
+/* ****************************************************** */
+
+static __inline__ u_int32_t crc32cSwWord(u_int32_t crc, u_int32_t w) {
+  u_int32_t i;
+
+  /* Low byte first, as the crc32 instruction does */
+  for(i=0; i<4; i++, w >>= 8)
+    crc = crc32cTable[(crc ^ w) & 0xFF] ^ (crc >> 8);
+
+  return(crc);
+}
+
+static u_int32_t crc32cSwHash(const FlowHashKey *key) {
+  u_int32_t crc = FLOW_HASH_SEED, tail[FLOW_HASH_KEY_TAIL_WORDS], i;
+
+  for(i=0; i<key->addr_words; i++) crc = crc32cSwWord(crc, key->lo[i]);
+  for(i=0; i<key->addr_words; i++) crc = crc32cSwWord(crc, key->hi[i]);
+
+  memcpy(tail, &key->lo_port, sizeof(tail));
+  for(i=0; i<FLOW_HASH_KEY_TAIL_WORDS; i++) crc = crc32cSwWord(crc, tail[i]);
+
+  return(~crc);
+}
+
+/* ****************************************************** */
+
+#if defined(HAVE_SSE42_CRC32C) || defined(HAVE_ARM_CRC32C)
+
+#ifdef HAVE_SSE42_CRC32C
+#define crc32cHwWord(crc, w) __builtin_ia32_crc32si(crc, w)
+__attribute__((target("sse4.2")))
+#else
+#define crc32cHwWord(crc, w) __crc32cw(crc, w)
+#endif
+static u_int32_t crc32cHwHash(const FlowHashKey *key) {
+  u_int32_t crc = FLOW_HASH_SEED, tail[FLOW_HASH_KEY_TAIL_WORDS], i;
+
+  for(i=0; i<key->addr_words; i++) crc = crc32cHwWord(crc, key->lo[i]);
+  for(i=0; i<key->addr_words; i++) crc = crc32cHwWord(crc, key->hi[i]);
+
+  memcpy(tail, &key->lo_port, sizeof(tail));
+  for(i=0; i<FLOW_HASH_KEY_TAIL_WORDS; i++) crc = crc32cHwWord(crc, tail[i]);
+
+  return(~crc);
+}
+#endif
+
+/* ****************************************************** */
+
+FlowHashFct getFlowHashFct(u_int8_t algorithm, const char **name) {
+  switch(algorithm) {
+  case FLOW_HASH_ADDITIVE:
+    *name = "additive";
+    return(additiveHash);
+
+  case FLOW_HASH_MURMUR:
+    *name = "murmur3";
+    return(murmurHash);
+
+  case FLOW_HASH_CRC32C:
+  default:
+#if defined(HAVE_SSE42_CRC32C) || defined(HAVE_ARM_CRC32C)
+    if(crc32cHw) {
+      *name = "crc32c (hardware)";
+      return(crc32cHwHash);
+    }
+#endif
+
+    if(algorithm == FLOW_HASH_CRC32C) {
+      *name = "crc32c (software)";
+      return(crc32cSwHash);
+    }
+
+    /* Without the instruction murmur is faster than a table driven crc */
+    *name = "murmur3";
+    return(murmurHash);
+  }
+}
+
+/* ****************************************************** */
+
+void initFlowHash(void) {
+  const char *name;
+  u_int32_t i, j;
+
+  for(i=0; i<256; i++) {
+    u_int32_t crc = i;
+
+    for(j=0; j<8; j++)
+      crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+
+    crc32cTable[i] = crc;
+  }
+
+#ifdef HAVE_SSE42_CRC32C
+  __builtin_cpu_init();
+  crc32cHw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#elif defined(HAVE_ARM_CRC32C)
+  crc32cHw = 1;
+#endif
+
+  readOnlyGlobals.flowHashFct = getFlowHashFct(readOnlyGlobals.flowHashAlgorithm, &name);
+  traceEvent(TRACE_INFO, "Flow hash: %s", name);
+}
+
+/* ****************************************************** */
+
+/*
+  Builds the flow key (when key != NULL) and the key used to pick the
+  processing thread, which only has the addresses and the protocol so
+  that all the fragments of a datagram go to the same thread.
+  Returns -1 when the packet cannot be parsed.
+*/
+int parseFlowHashKeys(int datalink, const u_char *p, u_int32_t caplen,
+		      FlowHashKey *key, FlowHashKey *steering) {
+  u_int32_t off = 0, l4 = 0;
+  u_int16_t eth_type = 0, vlanId = 0, sport = 0, dport = 0;
+  u_int8_t proto, tos, has_ports = 0;
+
+  switch(datalink) {
+  case DLT_EN10MB:
+    if(caplen < 14) return(-1);
+
+    eth_type = (p[12] << 8) + p[13], off = 14;
+    while(((eth_type == 0x8100 /* 802.1Q */) || (eth_type == 0x88A8 /* QinQ */)) && ((off + 4) <= caplen)) {
+      if(vlanId == 0) vlanId = ((p[off] << 8) + p[off+1]) & 0xFFF;
+      eth_type = (p[off+2] << 8) + p[off+3], off += 4;
+    }
+
+    if((eth_type != 0x0800) && (eth_type != 0x86DD)) {
+      /* Non-IP: same thread for both MAC addresses */
+      initFlowHashKey(steering, FLOW_HASH_KEY_MAC, &p[6], &p[0], 0, 0, 0, 0, 0, 0, 0);
+      if(key != NULL)
+	initFlowHashKey(key, FLOW_HASH_KEY_MAC, &p[6], &p[0], 0, 0, vlanId, 0, 0, 0, 0);
+      return(0);
+    }
+    break;
+
+#ifdef DLT_LINUX_SLL
+  case DLT_LINUX_SLL:
+    off = 16;
+    break;
+#endif
+
+  case DLT_RAW:
+    break;
+
+  default:
+    return(-1);
+  }
+
+  if(off >= caplen) return(-1);
+
+  if(((p[off] >> 4) == 4) && ((off + 20) <= caplen)) {
+    u_int32_t ihl = (p[off] & 0x0F) * 4, src, dst;
+
+    /* Host byte order as the engine keeps IPv4 addresses */
+    memcpy(&src, &p[off+12], 4), memcpy(&dst, &p[off+16], 4);
+    src = ntohl(src), dst = ntohl(dst);
+
+    proto = p[off+9], tos = p[off+1];
+    initFlowHashKey(steering, FLOW_HASH_KEY_IPV4, &src, &dst, 0, 0, 0, proto, 0, 0, 0);
+
+    /* Only the first fragment has the ports */
+    if((((p[off+6] << 8) + p[off+7]) & 0x1FFF) == 0)
+      l4 = off + ihl, has_ports = 1;
+
+    if(key == NULL) return(0);
+
+    if(has_ports && ((proto == IPPROTO_TCP) || (proto == IPPROTO_UDP) || (proto == 132 /* SCTP */))
+       && ((l4 + 4) <= caplen))
+      sport = (p[l4] << 8) + p[l4+1], dport = (p[l4+2] << 8) + p[l4+3];
+
+    initFlowHashKey(key, FLOW_HASH_KEY_IPV4, &src, &dst, sport, dport,
+		    vlanId, proto, tos, 0, 0);
+  } else if(((p[off] >> 4) == 6) && ((off + 40) <= caplen)) {
+    proto = p[off+6], tos = ((p[off] & 0x0F) << 4) + (p[off+1] >> 4);
+    initFlowHashKey(steering, FLOW_HASH_KEY_IPV6, &p[off+8], &p[off+24], 0, 0, 0, proto, 0, 0, 0);
+
+    if(key == NULL) return(0);
+
+    l4 = off + 40;
+    if(((proto == IPPROTO_TCP) || (proto == IPPROTO_UDP)) && ((l4 + 4) <= caplen))
+      sport = (p[l4] << 8) + p[l4+1], dport = (p[l4+2] << 8) + p[l4+3];
+
+    initFlowHashKey(key, FLOW_HASH_KEY_IPV6, &p[off+8], &p[off+24], sport, dport,
+		    vlanId, proto, tos, 0, 0);
+  } else
+    return(-1);
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+typedef struct {
+  FlowHashKey key, steering;
+  u_int32_t num_pkts;
+} FlowHashTestFlow;
+
+typedef struct {
+  FlowHashTestFlow *flows;
+  u_int32_t num_flows, max_flows;
+  u_int32_t *index, index_mask; /* Open addressing, flow id + 1 */
+} FlowHashTestSet;
+
+/* ****************************************************** */
+
+static int growFlowHashTestSet(FlowHashTestSet *set) {
+  u_int32_t new_size = set->index ? 2 * (set->index_mask + 1) : 65536, i;
+  u_int32_t *index = (u_int32_t*)calloc(new_size, sizeof(u_int32_t));
+  FlowHashTestFlow *flows = (FlowHashTestFlow*)realloc(set->flows, (new_size / 2) * sizeof(FlowHashTestFlow));
+
+  if((index == NULL) || (flows == NULL)) {
+    if(index) free(index);
+    if(flows) set->flows = flows;
+    return(-1);
+  }
+
+  set->flows = flows, set->max_flows = new_size / 2;
+
+  for(i=0; i<set->num_flows; i++) {
+    u_int32_t slot = murmurHash(&set->flows[i].key) & (new_size - 1);
+
+    while(index[slot] != 0) slot = (slot + 1) & (new_size - 1);
+    index[slot] = i + 1;
+  }
+
+  if(set->index) free(set->index);
+  set->index = index, set->index_mask = new_size - 1;
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+static int addFlowHashTestFlow(FlowHashTestSet *set, FlowHashKey *key, FlowHashKey *steering) {
+  u_int32_t slot;
+  FlowHashTestFlow *flow;
+
+  if((set->num_flows == set->max_flows) && (growFlowHashTestSet(set) != 0))
+    return(-1);
+
+  slot = murmurHash(key) & set->index_mask;
+
+  while(set->index[slot] != 0) {
+    flow = &set->flows[set->index[slot] - 1];
+
+    if(memcmp(&flow->key, key, sizeof(FlowHashKey)) == 0) {
+      flow->num_pkts++;
+      return(0);
+    }
+
+    slot = (slot + 1) & set->index_mask;
+  }
+
+  flow = &set->flows[set->num_flows];
+  memcpy(&flow->key, key, sizeof(FlowHashKey)), memcpy(&flow->steering, steering, sizeof(FlowHashKey));
+  flow->num_pkts = 1;
+  set->index[slot] = ++set->num_flows;
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+static void reportFlowHash(FlowHashTestSet *set, u_int64_t num_pkts, u_int8_t algorithm,
+			   u_int32_t num_buckets, u_int32_t num_queues) {
+  u_int32_t *chains = (u_int32_t*)calloc(num_buckets, sizeof(u_int32_t));
+  u_int64_t queue_pkts[FLOW_HASH_TEST_MAX_QUEUES] = { 0 }, max_queue = 0, depth = 0;
+  u_int32_t histo[9] = { 0 }, max_chain = 0, used_buckets = 0, i, loops;
+  struct timeval start, end;
+  volatile u_int32_t sink = 0;
+  FlowHashFct fct;
+  const char *name;
+  char buf[256];
+  float ns;
+
+  if(chains == NULL) {
+    traceEvent(TRACE_ERROR, "Not enough memory for %u buckets", num_buckets);
+    return;
+  }
+
+  fct = getFlowHashFct(algorithm, &name);
+
+  for(i=0; i<set->num_flows; i++) {
+    FlowHashTestFlow *flow = &set->flows[i];
+
+    chains[fct(&flow->key) % num_buckets]++;
+    queue_pkts[fct(&flow->steering) % num_queues] += flow->num_pkts;
+  }
+
+  for(i=0; i<num_buckets; i++) {
+    if(chains[i] == 0) continue;
+
+    used_buckets++, histo[min(chains[i], 8)]++;
+    if(chains[i] > max_chain) max_chain = chains[i];
+
+    /* Buckets visited by all the lookups of the flows of this chain */
+    depth += ((u_int64_t)chains[i] * (chains[i] + 1)) / 2;
+  }
+
+  for(i=0; i<num_queues; i++)
+    if(queue_pkts[i] > max_queue) max_queue = queue_pkts[i];
+
+  /* At least ~10M hashes for a stable figure */
+  loops = max(1, 10000000 / max(set->num_flows, 1));
+  gettimeofday(&start, NULL);
+  for(i=0; i<loops * set->num_flows; i++)
+    sink += fct(&set->flows[i % set->num_flows].key);
+  gettimeofday(&end, NULL);
+  ns = (timevalDiff(&end, &start) * 1000000000) / ((float)loops * set->num_flows);
+
+  traceEvent(TRACE_NORMAL, "Flow hash %-18s: [%.1f ns/hash][used buckets %u][max chain %u][avg lookup depth %.2f]",
+	     name, ns, used_buckets, max_chain,
+	     set->num_flows ? ((float)depth / (float)set->num_flows) : 0);
+
+  traceEvent(TRACE_NORMAL, "    Chain length: [1: %u][2: %u][3: %u][4: %u][5: %u][6: %u][7: %u][8+: %u]",
+	     histo[1], histo[2], histo[3], histo[4], histo[5], histo[6], histo[7], histo[8]);
+
+  for(i=0, buf[0] = '\0'; i<num_queues; i++) {
+    u_int len = strlen(buf);
+
+    snprintf(&buf[len], sizeof(buf)-len, "[%.1f%%]",
+	     num_pkts ? ((float)queue_pkts[i] * 100) / (float)num_pkts : 0);
+  }
+
+  traceEvent(TRACE_NORMAL, "    Queue balance (max/avg %.2f): %s",
+	     num_pkts ? ((float)max_queue * num_queues) / (float)num_pkts : 0, buf);
+
+  free(chains);
+}
+
+/* ****************************************************** */
+
+/* --flow-hash-test: compares the hash functions on the flows of a pcap file */
+void flowHashTest(char *pcap_path) {
+  u_int8_t algorithms[] = { FLOW_HASH_ADDITIVE, FLOW_HASH_MURMUR, FLOW_HASH_CRC32C };
+  u_int32_t num_queues = max(readOnlyGlobals.numProcessThreads, 4), num_mismatches = 0, i;
+  FlowHashTestSet set;
+  FlowHashFct crc32c;
+  const char *name;
+  u_int64_t num_pkts = 0, num_skipped = 0;
+  char ebuf[PCAP_ERRBUF_SIZE];
+  struct pcap_pkthdr *h;
+  const u_char *p;
+  pcap_t *pcap;
+  int datalink;
+
+  if((pcap = pcap_open_offline(pcap_path, ebuf)) == NULL) {
+    traceEvent(TRACE_ERROR, "Unable to open %s: %s", pcap_path, ebuf);
+    return;
+  }
+
+  memset(&set, 0, sizeof(set));
+  datalink = pcap_datalink(pcap);
+  num_queues = min(num_queues, FLOW_HASH_TEST_MAX_QUEUES);
+
+  while(pcap_next_ex(pcap, &h, &p) > 0) {
+    FlowHashKey key, steering;
+
+    if(parseFlowHashKeys(datalink, p, h->caplen, &key, &steering) != 0) {
+      num_skipped++;
+      continue;
+    }
+
+    if(addFlowHashTestFlow(&set, &key, &steering) != 0) {
+      traceEvent(TRACE_ERROR, "Not enough memory: stopping at %u flows", set.num_flows);
+      break;
+    }
+
+    num_pkts++;
+  }
+
+  pcap_close(pcap);
+
+  traceEvent(TRACE_NORMAL, "Flow hash test [%s]: [%llu packets][%llu skipped][%u flows][%u buckets][%u queues]",
+	     pcap_path, (long long unsigned)num_pkts, (long long unsigned)num_skipped,
+	     set.num_flows, readOnlyGlobals.flowHashSize, num_queues);
+
+  if(set.num_flows > 0) {
+    for(i=0; i<sizeof(algorithms)/sizeof(algorithms[0]); i++)
+      reportFlowHash(&set, num_pkts, algorithms[i], readOnlyGlobals.flowHashSize, num_queues);
+
+    /* The hardware and software crc must agree */
+    crc32c = getFlowHashFct(FLOW_HASH_CRC32C, &name);
+    for(i=0; i<set.num_flows; i++)
+      if(crc32cSwHash(&set.flows[i].key) != crc32c(&set.flows[i].key))
+	num_mismatches++;
+
+    if(num_mismatches > 0)
+      traceEvent(TRACE_ERROR, "crc32c: %u hardware/software mismatches", num_mismatches);
+  }
+
+  if(set.flows) free(set.flows);
+  if(set.index) free(set.index);
+}
@@ -0,0 +1,89 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _FLOWHASH_H_
+#define _FLOWHASH_H_
+
+/* ********************************** */
+
+#define FLOW_HASH_AUTO           0 /* crc32c if the CPU has it, murmur otherwise */
+#define FLOW_HASH_ADDITIVE       1 /* Legacy sum of the key fields */
+#define FLOW_HASH_MURMUR         2
+#define FLOW_HASH_CRC32C         3 /* Hardware when available, table driven otherwise */
+
+#define FLOW_HASH_KEY_IPV4       4
+#define FLOW_HASH_KEY_IPV6       6
+#define FLOW_HASH_KEY_MAC        7 /* Non-IP traffic */
+#define FLOW_HASH_KEY_GTP        8 /* GTP signalling: addresses + sequence number */
+
+/*
+  Both directions of a flow build the same key: the endpoint with the
+  lower address (port on ties) is always stored first. Hash functions
+  read addr_words words from lo[] and hi[], then the trailing words
+  from lo_port to subflow_id.
+*/
+typedef struct {
+  u_int32_t lo[4], hi[4];
+  u_int16_t lo_port, hi_port;
+  u_int16_t vlanId;
+  u_int8_t proto, tos;
+  u_int8_t untunneled_proto, type, addr_words, pad;
+  u_int32_t subflow_id;
+} FlowHashKey;
+
+#define FLOW_HASH_KEY_TAIL_WORDS 4
+
+typedef u_int32_t (*FlowHashFct)(const FlowHashKey *key);
+
+/* ********************************** */
+
+extern void initFlowHash(void);
+extern FlowHashFct getFlowHashFct(u_int8_t algorithm, const char **name);
+extern int parseFlowHashKeys(int datalink, const u_char *p, u_int32_t caplen,
+			     FlowHashKey *key, FlowHashKey *steering);
+extern void flowHashTest(char *pcap_path);
+
+/* src/dst point to 4 (IPv4, GTP), 16 (IPv6) or 6 (MAC) bytes */
+static __inline__ void initFlowHashKey(FlowHashKey *key, u_int8_t type,
+				       const void *src, const void *dst,
+				       u_int16_t sport, u_int16_t dport,
+				       u_int16_t vlanId, u_int8_t proto, u_int8_t tos,
+				       u_int8_t untunneled_proto, u_int32_t subflow_id) {
+  u_int32_t len = (type == FLOW_HASH_KEY_IPV6) ? 16 : ((type == FLOW_HASH_KEY_MAC) ? 6 : 4);
+  int cmp = memcmp(src, dst, len);
+
+  memset(key, 0, sizeof(FlowHashKey));
+
+  if((cmp < 0) || ((cmp == 0) && (sport <= dport)))
+    memcpy(key->lo, src, len), memcpy(key->hi, dst, len), key->lo_port = sport, key->hi_port = dport;
+  else
+    memcpy(key->lo, dst, len), memcpy(key->hi, src, len), key->lo_port = dport, key->hi_port = sport;
+
+  key->vlanId = vlanId, key->proto = proto, key->tos = tos;
+  key->untunneled_proto = untunneled_proto, key->type = type;
+  key->addr_words = (len + 3) / 4, key->subflow_id = subflow_id;
+}
+
+/* The function is chosen once at startup by initFlowHash() */
+#define computeFlowHash(key) readOnlyGlobals.flowHashFct(key)
+
+#endif /* _FLOWHASH_H_ */
@@ -0,0 +1,143 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+/* ****************************************************** */
+
+/* Sizes the table for num_entries flows at a max load of 7/8 */
+int allocFlowTable(FlowTable *table, u_int32_t num_entries) {
+  u_int32_t num_groups = 1, bits = 0;
+  u_int64_t needed = ((u_int64_t)num_entries * 8) / (7 * FLOW_TABLE_GROUP_SLOTS) + 1;
+
+  while(((num_groups < needed) || (bits < 4)) && (bits < 31))
+    num_groups <<= 1, bits++;
+
+  memset(table, 0, sizeof(FlowTable));
+
+  /* One extra group so that the groups can be aligned to the cache line */
+  if((table->mem = calloc(num_groups + 1, sizeof(FlowTableGroup))) == NULL)
+    return(-1);
+
+  table->groups = (FlowTableGroup*)(((size_t)table->mem + sizeof(FlowTableGroup) - 1)
+				    & ~(sizeof(FlowTableGroup) - 1));
+  table->num_groups = num_groups, table->mask = num_groups - 1;
+  table->shift = 32 - bits;
+  table->max_entries = (u_int32_t)(((u_int64_t)num_groups * FLOW_TABLE_GROUP_SLOTS * 7) / 8);
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+void freeFlowTable(FlowTable *table) {
+  if(table->mem != NULL) free(table->mem);
+  memset(table, 0, sizeof(FlowTable));
+}
+
+/* ****************************************************** */
+
+int flowTableAdd(FlowTable *table, u_int32_t fingerprint, FlowHashBucket *bkt) {
+  u_int32_t home = flowTableHomeGroup(table, fingerprint), group_idx = home, probes;
+
+  for(probes = 0; probes < table->num_groups; probes++) {
+    FlowTableGroup *group = &table->groups[group_idx];
+
+    if(group->occupied != FLOW_TABLE_GROUP_FULL) {
+      u_int32_t slot = flowTableFirstSlot(~group->occupied & FLOW_TABLE_GROUP_FULL);
+
+      group->fingerprint[slot] = fingerprint, group->bkt[slot] = bkt;
+      group->occupied |= (1 << slot);
+      bkt->ext->tuple.flow_idx = group_idx;
+
+      table->num_entries++;
+      if(probes > table->max_probes) table->max_probes = probes;
+      return(0);
+    }
+
+    /* Tell lookups that they need to look past this group */
+    if(group->overflow != FLOW_TABLE_MAX_OVERFLOW) group->overflow++;
+    group_idx = (group_idx + 1) & table->mask;
+  }
+
+  /* No room left: undo the overflow marks */
+  for(group_idx = home; probes > 0; probes--) {
+    if(table->groups[group_idx].overflow != FLOW_TABLE_MAX_OVERFLOW)
+      table->groups[group_idx].overflow--;
+    group_idx = (group_idx + 1) & table->mask;
+  }
+
+  table->num_full++;
+  bkt->ext->tuple.flow_idx = FLOW_TABLE_NOT_INDEXED;
+  return(-1);
+}
+
+/* ****************************************************** */
+
+void flowTableRemove(FlowTable *table, FlowHashBucket *bkt) {
+  u_int32_t group_idx = bkt->ext->tuple.flow_idx, slot, home;
+  FlowTableGroup *group;
+
+  if(group_idx == FLOW_TABLE_NOT_INDEXED) return;
+
+  group = &table->groups[group_idx];
+
+  for(slot = 0; slot < FLOW_TABLE_GROUP_SLOTS; slot++)
+    if((group->occupied & (1 << slot)) && (group->bkt[slot] == bkt))
+      break;
+
+  if(slot == FLOW_TABLE_GROUP_SLOTS) {
+    traceEvent(TRACE_WARNING, "Internal error: bucket not found in flow table group %u", group_idx);
+    return;
+  }
+
+  home = flowTableHomeGroup(table, group->fingerprint[slot]);
+  group->occupied &= ~(1 << slot), group->bkt[slot] = NULL;
+  bkt->ext->tuple.flow_idx = FLOW_TABLE_NOT_INDEXED;
+  table->num_entries--;
+
+  /* The groups we skipped while inserting can now stop lookups earlier */
+  while(home != group_idx) {
+    if(table->groups[home].overflow != FLOW_TABLE_MAX_OVERFLOW)
+      table->groups[home].overflow--;
+    home = (home + 1) & table->mask;
+  }
+}
+
+/* ****************************************************** */
+
+void dumpFlowTableStats(void) {
+  u_int32_t i;
+
+  if(readOnlyGlobals.flowTableMode != FLOW_TABLE_GROUPED) return;
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    FlowTable *table = &readWriteGlobals->flowTable[i];
+
+    if(table->groups == NULL) continue;
+
+    traceEvent(TRACE_NORMAL, "Flow table [thread %u]: [%u/%u slots][load %.1f %%][max probe: %u groups][table full: %u]",
+	       i, table->num_entries, table->num_groups * FLOW_TABLE_GROUP_SLOTS,
+	       ((float)table->num_entries * 100) / (float)(table->num_groups * FLOW_TABLE_GROUP_SLOTS),
+	       table->max_probes, table->num_full);
+  }
+}
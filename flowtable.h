@@ -0,0 +1,144 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _FLOWTABLE_H_
+#define _FLOWTABLE_H_
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* ********************************** */
+
+#define FLOW_TABLE_CHAINED           0 /* theFlowHash[] collision lists (default) */
+#define FLOW_TABLE_GROUPED           1 /* Open addressing on cache-line groups */
+
+#define FLOW_TABLE_GROUP_SLOTS       4
+#define FLOW_TABLE_GROUP_FULL      0xF
+#define FLOW_TABLE_MAX_OVERFLOW 0xFFFF
+#define FLOW_TABLE_NOT_INDEXED  ((u_int32_t)-1)
+
+/*
+  One group fits a cache line: the fingerprints (i.e. the flow_hash of
+  the buckets) are compared all at once, and bucket pointers are read
+  only for the slots whose fingerprint matches. Groups are probed
+  linearly; 'overflow' counts the entries that had to be stored past
+  this group so a lookup can stop at the first group where it is zero
+  and deletions do not need tombstones.
+*/
+typedef struct flowTableGroup {
+  u_int32_t fingerprint[FLOW_TABLE_GROUP_SLOTS];
+  FlowHashBucket *bkt[FLOW_TABLE_GROUP_SLOTS];
+  u_int16_t occupied; /* Bitmap of the slots in use */
+  u_int16_t overflow;
+} __attribute__((aligned(64))) FlowTableGroup;
+
+typedef struct flowTable {
+  void *mem;               /* As returned by calloc(): groups is aligned inside it */
+  FlowTableGroup *groups;
+  u_int32_t num_groups, mask, shift;
+  u_int32_t num_entries, max_entries;
+  u_int32_t max_probes, num_full;
+} FlowTable;
+
+typedef struct {
+  FlowTable *table;
+  u_int32_t fingerprint, group_idx, probes, matches;
+} FlowTableIterator;
+
+/* ********************************** */
+
+static __inline__ u_int32_t flowTableHomeGroup(FlowTable *table, u_int32_t fingerprint) {
+  /*
+    flow_hash comes from the --flow-hash function (crc32c or murmur by
+    default, the legacy additive sum on request): the Fibonacci multiply
+    folds all its bits into the top ones, used as the group index
+  */
+  return((fingerprint * 2654435769U) >> table->shift);
+}
+
+static __inline__ u_int32_t flowTableGroupMatch(FlowTableGroup *group, u_int32_t fingerprint) {
+#ifdef __SSE2__
+  __m128i cmp = _mm_cmpeq_epi32(_mm_load_si128((__m128i*)group->fingerprint),
+				_mm_set1_epi32((int)fingerprint));
+
+  return((u_int32_t)_mm_movemask_ps(_mm_castsi128_ps(cmp)) & group->occupied);
+#else
+  u_int32_t i, matches = 0;
+
+  for(i=0; i<FLOW_TABLE_GROUP_SLOTS; i++)
+    if(group->fingerprint[i] == fingerprint) matches |= (1 << i);
+
+  return(matches & group->occupied);
+#endif
+}
+
+static __inline__ u_int32_t flowTableFirstSlot(u_int32_t bitmap) {
+#ifdef __GNUC__
+  return(__builtin_ctz(bitmap));
+#else
+  u_int32_t slot = 0;
+
+  while(!(bitmap & (1 << slot))) slot++;
+  return(slot);
+#endif
+}
+
+/* Returns the next bucket whose fingerprint matches, NULL when the probe sequence ends */
+static __inline__ FlowHashBucket* flowTableNextMatch(FlowTableIterator *it) {
+  FlowTable *table = it->table;
+
+  while(1) {
+    if(it->matches) {
+      u_int32_t slot = flowTableFirstSlot(it->matches);
+
+      it->matches &= it->matches - 1;
+      return(table->groups[it->group_idx].bkt[slot]);
+    }
+
+    if((table->groups[it->group_idx].overflow == 0)
+       || (++it->probes >= table->num_groups))
+      return(NULL);
+
+    it->group_idx = (it->group_idx + 1) & table->mask;
+    it->matches = flowTableGroupMatch(&table->groups[it->group_idx], it->fingerprint);
+  }
+}
+
+static __inline__ FlowHashBucket* flowTableFirstMatch(FlowTable *table, u_int32_t fingerprint,
+						      FlowTableIterator *it) {
+  it->table = table, it->fingerprint = fingerprint, it->probes = 0;
+  it->group_idx = flowTableHomeGroup(table, fingerprint);
+  it->matches = flowTableGroupMatch(&table->groups[it->group_idx], fingerprint);
+
+  return(flowTableNextMatch(it));
+}
+
+/* ********************************** */
+
+extern int allocFlowTable(FlowTable *table, u_int32_t num_entries);
+extern void freeFlowTable(FlowTable *table);
+extern int flowTableAdd(FlowTable *table, u_int32_t fingerprint, FlowHashBucket *bkt);
+extern void flowTableRemove(FlowTable *table, FlowHashBucket *bkt);
+extern void dumpFlowTableStats(void);
+
+#endif /* _FLOWTABLE_H_ */
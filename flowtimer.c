@@ -0,0 +1,212 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "nprobe.h"
+
+/*
+  Hierarchical timing wheel in the style of the classic Linux timer
+  wheel: level 0 holds the next FLOW_TIMER_L0_SLOTS ticks, a slot of
+  level n holds a lap of level n-1 and is cascaded (re-added) into the
+  lower levels when that level wraps.
+*/
+
+#define FLOW_TIMER_L0_MASK      (FLOW_TIMER_L0_SLOTS - 1)
+#define FLOW_TIMER_LN_MASK      (FLOW_TIMER_LN_SLOTS - 1)
+#define FLOW_TIMER_LEVEL_BITS(l) (FLOW_TIMER_L0_BITS + ((l) - 1) * FLOW_TIMER_LN_BITS)
+#define FLOW_TIMER_LEVEL_BASE(l) (FLOW_TIMER_L0_SLOTS + ((l) - 1) * FLOW_TIMER_LN_SLOTS)
+
+/* ****************************************************** */
+
+void initFlowTimerWheel(FlowTimerWheel *w) {
+  memset(w, 0, sizeof(FlowTimerWheel));
+  pthread_rwlock_init(&w->lock, NULL);
+}
+
+/* ****************************************************** */
+
+void startFlowTimerWheel(FlowTimerWheel *w, u_int64_t now_msec) {
+  w->now_tick = flowTimerTick(now_msec), w->running = 1;
+}
+
+/* ****************************************************** */
+
+static void flowTimerLink(FlowTimerWheel *w, FlowHashBucket *bkt) {
+  u_int32_t delta, tick = bkt->ext->timer_tick, l;
+  u_int16_t slot;
+
+  /* Expired while waiting: run it at the next tick */
+  if((int32_t)(tick - w->now_tick) < 0)
+    bkt->ext->timer_tick = tick = w->now_tick;
+
+  delta = tick - w->now_tick;
+
+  if(delta > FLOW_TIMER_MAX_TICKS)
+    bkt->ext->timer_tick = tick = w->now_tick + FLOW_TIMER_MAX_TICKS, delta = FLOW_TIMER_MAX_TICKS;
+
+  if(delta < FLOW_TIMER_L0_SLOTS)
+    slot = tick & FLOW_TIMER_L0_MASK;
+  else {
+    for(l=1; l<FLOW_TIMER_NUM_LEVELS-1; l++)
+      if(delta < (1 << FLOW_TIMER_LEVEL_BITS(l+1)))
+	break;
+
+    slot = FLOW_TIMER_LEVEL_BASE(l) + ((tick >> FLOW_TIMER_LEVEL_BITS(l)) & FLOW_TIMER_LN_MASK);
+  }
+
+  bkt->ext->timer_slot = slot;
+  bkt->ext->timer.prev = NULL, bkt->ext->timer.next = w->slots[slot];
+  if(w->slots[slot] != NULL) w->slots[slot]->ext->timer.prev = bkt;
+  w->slots[slot] = bkt;
+}
+
+/* ****************************************************** */
+
+static void flowTimerUnlink(FlowTimerWheel *w, FlowHashBucket *bkt) {
+  if(bkt->ext->timer.prev != NULL)
+    bkt->ext->timer.prev->ext->timer.next = bkt->ext->timer.next;
+  else
+    w->slots[bkt->ext->timer_slot] = bkt->ext->timer.next;
+
+  if(bkt->ext->timer.next != NULL)
+    bkt->ext->timer.next->ext->timer.prev = bkt->ext->timer.prev;
+
+  bkt->ext->timer.prev = bkt->ext->timer.next = NULL;
+  bkt->ext->timer_slot = FLOW_TIMER_NOT_ARMED;
+}
+
+/* ****************************************************** */
+
+/* Arms (or moves) the bucket timer: deadlines already past run at the next tick */
+void flowTimerAdd(FlowTimerWheel *w, FlowHashBucket *bkt, u_int64_t deadline_msec) {
+  if(bkt->ext->timer_slot != FLOW_TIMER_NOT_ARMED)
+    flowTimerUnlink(w, bkt);
+  else
+    w->num_timers++;
+
+  bkt->ext->timer_tick = flowTimerTick(deadline_msec);
+  flowTimerLink(w, bkt);
+}
+
+/* ****************************************************** */
+
+/* Moves the timers of an upper level slot down. Returns the slot index within the level */
+static u_int32_t flowTimerCascade(FlowTimerWheel *w, u_int32_t level) {
+  u_int32_t idx = (w->now_tick >> FLOW_TIMER_LEVEL_BITS(level)) & FLOW_TIMER_LN_MASK;
+  FlowHashBucket *bkt = w->slots[FLOW_TIMER_LEVEL_BASE(level) + idx];
+
+  w->slots[FLOW_TIMER_LEVEL_BASE(level) + idx] = NULL;
+
+  while(bkt != NULL) {
+    FlowHashBucket *next = bkt->ext->timer.next;
+
+    flowTimerLink(w, bkt);
+    w->num_cascaded++;
+    bkt = next;
+  }
+
+  return(idx);
+}
+
+/* ****************************************************** */
+
+/*
+  Runs all the ticks up to now_msec. The timers due are detached from
+  the wheel and returned as a list linked through ext->timer.next
+*/
+FlowHashBucket* flowTimerAdvance(FlowTimerWheel *w, u_int64_t now_msec) {
+  u_int32_t target = flowTimerTick(now_msec);
+  FlowHashBucket *due = NULL;
+
+  if(w->num_timers == 0) {
+    /* Nothing to cascade: skip idle periods (e.g. gaps in a pcap file) at once */
+    if((int32_t)(target - w->now_tick) >= 0) w->now_tick = target + 1;
+    return(NULL);
+  }
+
+  while((int32_t)(target - w->now_tick) >= 0) {
+    u_int32_t idx = w->now_tick & FLOW_TIMER_L0_MASK, l;
+    FlowHashBucket *bkt;
+
+    if(idx == 0) {
+      for(l=1; l<FLOW_TIMER_NUM_LEVELS; l++)
+	if(flowTimerCascade(w, l) != 0)
+	  break;
+    }
+
+    bkt = w->slots[idx], w->slots[idx] = NULL;
+
+    while(bkt != NULL) {
+      FlowHashBucket *next = bkt->ext->timer.next;
+
+      bkt->ext->timer_slot = FLOW_TIMER_NOT_ARMED;
+      bkt->ext->timer.prev = NULL, bkt->ext->timer.next = due, due = bkt;
+      w->num_timers--, w->num_fired++;
+      bkt = next;
+    }
+
+    w->now_tick++;
+  }
+
+  return(due);
+}
+
+/* ****************************************************** */
+
+/* Detaches all the timers (flush): same list format as flowTimerAdvance() */
+FlowHashBucket* flowTimerDetachAll(FlowTimerWheel *w) {
+  FlowHashBucket *due = NULL;
+  u_int32_t i;
+
+  for(i=0; i<FLOW_TIMER_NUM_SLOTS; i++) {
+    FlowHashBucket *bkt = w->slots[i];
+
+    w->slots[i] = NULL;
+
+    while(bkt != NULL) {
+      FlowHashBucket *next = bkt->ext->timer.next;
+
+      bkt->ext->timer_slot = FLOW_TIMER_NOT_ARMED;
+      bkt->ext->timer.prev = NULL, bkt->ext->timer.next = due, due = bkt;
+      bkt = next;
+    }
+  }
+
+  w->num_timers = 0;
+  return(due);
+}
+
+/* ****************************************************** */
+
+void dumpFlowTimerStats(void) {
+  u_int32_t i;
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    FlowTimerWheel *w = &readWriteGlobals->flowTimers[i];
+
+    if(!w->running) continue;
+
+    traceEvent(TRACE_NORMAL, "Flow timers [thread %u]: [%u armed][%llu fired][%llu re-armed][%llu cascaded]",
+	       i, w->num_timers, (long long unsigned)w->num_fired,
+	       (long long unsigned)w->num_rearmed, (long long unsigned)w->num_cascaded);
+  }
+}
@@ -0,0 +1,79 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef _FLOWTIMER_H_
+#define _FLOWTIMER_H_
+
+/* ********************************** */
+
+#define FLOW_TIMER_TICK_MSEC       100
+#define FLOW_TIMER_L0_BITS           8 /* 256 ticks: 25.6 sec */
+#define FLOW_TIMER_LN_BITS           6 /* x64 per upper level: ~27 min, ~29 hours, ~77 days */
+#define FLOW_TIMER_L0_SLOTS         (1 << FLOW_TIMER_L0_BITS)
+#define FLOW_TIMER_LN_SLOTS         (1 << FLOW_TIMER_LN_BITS)
+#define FLOW_TIMER_NUM_LEVELS        4
+#define FLOW_TIMER_NUM_SLOTS        (FLOW_TIMER_L0_SLOTS + (FLOW_TIMER_NUM_LEVELS - 1) * FLOW_TIMER_LN_SLOTS)
+#define FLOW_TIMER_MAX_TICKS        ((1 << (FLOW_TIMER_L0_BITS + (FLOW_TIMER_NUM_LEVELS - 1) * FLOW_TIMER_LN_BITS)) - 1)
+#define FLOW_TIMER_NOT_ARMED        0xFFFF
+#define FLOW_TIMER_EXPORT_BATCH     RING_MAX_DEQUEUE_BATCH
+#define FLOW_TIMER_TCP_CLOSE_SEC    10 /* FIN seen both ways: expire when quiet for this long */
+
+/*
+  Per thread hierarchical timing wheel of the flow buckets. Level 0 has
+  one slot per tick, each upper level slot covers a whole lap of the
+  level below and is cascaded down when that level wraps. Slots are
+  lists linked through bucket->ext->timer, so adding and removing a
+  bucket are O(1). With locks enabled each wheel has a lock of its own:
+  threads arming new flows do not serialize on each other.
+
+  A bucket is armed with the earliest time it can expire. Packets only
+  push that time further, so the per-packet path does not touch the
+  wheel: when the slot fires the flow deadline is computed again and
+  the bucket is either expired or armed again (lazy rescheduling).
+*/
+typedef struct flowTimerWheel {
+  pthread_rwlock_t lock;
+  FlowHashBucket *slots[FLOW_TIMER_NUM_SLOTS];
+  u_int32_t now_tick; /* Next tick to run */
+  u_int8_t running;
+  u_int32_t num_timers;
+
+  u_int64_t num_fired, num_rearmed, num_cascaded;
+} FlowTimerWheel;
+
+/* ********************************** */
+
+static __inline__ u_int32_t flowTimerTick(u_int64_t msec) {
+  return((u_int32_t)(msec / FLOW_TIMER_TICK_MSEC));
+}
+
+/* ********************************** */
+
+extern void initFlowTimerWheel(FlowTimerWheel *w);
+extern void startFlowTimerWheel(FlowTimerWheel *w, u_int64_t now_msec);
+extern void flowTimerAdd(FlowTimerWheel *w, FlowHashBucket *bkt, u_int64_t deadline_msec);
+extern FlowHashBucket* flowTimerAdvance(FlowTimerWheel *w, u_int64_t now_msec);
+extern FlowHashBucket* flowTimerDetachAll(FlowTimerWheel *w);
+extern void dumpFlowTimerStats(void);
+
+#endif /* _FLOWTIMER_H_ */
@@ -0,0 +1,230 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+#ifdef HAVE_GEOIP
+
+/* ****************************************************** */
+
+static __inline__ u_int32_t geoCacheHash(IpAddress *addr) {
+  u_int32_t h;
+
+  if(addr->ipVersion == 4)
+    h = addr->ipType.ipv4;
+  else {
+    u_int32_t w[4];
+
+    memcpy(w, &addr->ipType.ipv6, sizeof(w));
+    h = w[0] ^ w[1] ^ w[2] ^ (w[3] * 0x85EBCA77);
+  }
+
+  return((h * 0x9E3779B1) >> (32 - GEO_CACHE_BITS));
+}
+
+/* ****************************************************** */
+
+static __inline__ u_int8_t sameAddress(IpAddress *a, IpAddress *b) {
+  if(a->ipVersion != b->ipVersion)
+    return(0);
+  else if(a->ipVersion == 4)
+    return(a->ipType.ipv4 == b->ipType.ipv4);
+  else
+    return(memcmp(&a->ipType.ipv6, &b->ipType.ipv6, sizeof(struct in6_addr)) == 0);
+}
+
+/* ****************************************************** */
+
+GeoCache* createGeoCache(void) {
+  GeoCache *cache = (GeoCache*)calloc(1, sizeof(GeoCache));
+
+  if(cache == NULL)
+    traceEvent(TRACE_ERROR, "Not enough memory: GeoIP lookups will not be cached");
+
+  return(cache);
+}
+
+/* ****************************************************** */
+
+void freeGeoCache(GeoCache *cache) {
+  u_int32_t i;
+
+  if(cache == NULL) return;
+
+  for(i=0; i<GEO_CACHE_SIZE; i++)
+    if(cache->entries[i].geo != NULL) GeoIPRecord_delete(cache->entries[i].geo);
+
+  free(cache);
+}
+
+/* ****************************************************** */
+
+/* Uncached lookup: "AS1234 Name" to 1234 */
+u_int32_t geoIpGetAS(IpAddress *addr) {
+  char *rsp = NULL;
+  u_int32_t as;
+
+  if(readOnlyGlobals.geo_ip_asn_db == NULL) return(0);
+
+#ifdef WIN32
+  if(addr->ipVersion == 6) return(0);
+#endif
+
+  pthread_rwlock_wrlock(&readWriteGlobals->geoipRwLock);
+  if(addr->ipVersion == 4)
+    rsp = GeoIP_name_by_ipnum(readOnlyGlobals.geo_ip_asn_db, addr->ipType.ipv4);
+  else {
+#ifdef HAVE_GEOIP_IPv6
+#ifndef WIN32
+    /* Invalid database type GeoIP ASNum Edition, expected GeoIP Organization Edition */
+    if(readOnlyGlobals.geo_ip_asn_db_v6)
+      rsp = GeoIP_name_by_ipnum_v6(readOnlyGlobals.geo_ip_asn_db_v6, addr->ipType.ipv6);
+#endif
+#endif
+  }
+  pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
+
+  as = rsp ? atoi(&rsp[2]) : 0;
+  free(rsp);
+  /* traceEvent(TRACE_WARNING, "--> %s (%d)", rsp, as); */
+  return(as);
+}
+
+/* ****************************************************** */
+
+/* Uncached lookup: the record is to be freed with GeoIPRecord_delete() */
+GeoIPRecord* geoIpGetRecord(IpAddress *addr) {
+  GeoIPRecord *geo = NULL;
+
+  if(readOnlyGlobals.geo_ip_city_db == NULL) return(NULL);
+
+  pthread_rwlock_wrlock(&readWriteGlobals->geoipRwLock);
+  if(addr->ipVersion == 4)
+    geo = GeoIP_record_by_ipnum(readOnlyGlobals.geo_ip_city_db, addr->ipType.ipv4);
+#ifdef HAVE_GEOIP_IPv6
+  else if((addr->ipVersion == 6) && readOnlyGlobals.geo_ip_city_db_v6)
+    geo = GeoIP_record_by_ipnum_v6(readOnlyGlobals.geo_ip_city_db_v6, addr->ipType.ipv6);
+#endif
+  pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
+
+  return(geo);
+}
+
+/* ****************************************************** */
+
+/*
+  A copy that GeoIPRecord_delete() can free: it frees the region, city
+  and postal code strings, the other strings are GeoIP static tables.
+*/
+static GeoIPRecord* dupGeoIPRecord(GeoIPRecord *geo) {
+  GeoIPRecord *copy = (GeoIPRecord*)malloc(sizeof(GeoIPRecord));
+
+  if(copy == NULL) return(NULL);
+
+  memcpy(copy, geo, sizeof(GeoIPRecord));
+  copy->region      = geo->region ? strdup(geo->region) : NULL;
+  copy->city        = geo->city ? strdup(geo->city) : NULL;
+  copy->postal_code = geo->postal_code ? strdup(geo->postal_code) : NULL;
+
+  return(copy);
+}
+
+/* ****************************************************** */
+
+/* The entry of addr, emptied if it held another address or expired */
+static GeoCacheEntry* geoCacheEntry(GeoCache *cache, IpAddress *addr) {
+  GeoCacheEntry *e = &cache->entries[geoCacheHash(addr)];
+  time_t now = readWriteGlobals->now;
+
+  if((!sameAddress(&e->addr, addr)) || (e->expire < now)) {
+    if(e->geo != NULL) GeoIPRecord_delete(e->geo);
+
+    memset(e, 0, sizeof(GeoCacheEntry));
+    e->addr.ipVersion = addr->ipVersion, e->addr.ipType = addr->ipType;
+    e->expire = now + GEO_CACHE_TTL;
+  }
+
+  return(e);
+}
+
+/* ****************************************************** */
+
+u_int32_t geoCacheGetAS(GeoCache *cache, IpAddress *addr) {
+  GeoCacheEntry *e = geoCacheEntry(cache, addr);
+
+  if(e->asnResolved) {
+    cache->num_hits++;
+    if(e->asn == 0) cache->num_negative_hits++;
+  } else {
+    cache->num_misses++;
+    e->asn = geoIpGetAS(addr), e->asnResolved = 1;
+  }
+
+  return(e->asn);
+}
+
+/* ****************************************************** */
+
+/* Returns a copy owned by the caller, NULL if addr is unknown */
+GeoIPRecord* geoCacheGetRecord(GeoCache *cache, IpAddress *addr) {
+  GeoCacheEntry *e = geoCacheEntry(cache, addr);
+
+  if(e->geoResolved) {
+    cache->num_hits++;
+    if(e->geo == NULL) cache->num_negative_hits++;
+  } else {
+    cache->num_misses++;
+    e->geo = geoIpGetRecord(addr), e->geoResolved = 1;
+  }
+
+  return((e->geo != NULL) ? dupGeoIPRecord(e->geo) : NULL);
+}
+
+/* ****************************************************** */
+
+void dumpGeoCacheStats(u_int timeDifference) {
+  u_int64_t hits = 0, negative_hits = 0, misses = 0, diff_hits = 0, diff_misses = 0;
+  int i;
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+    GeoCache *cache = readWriteGlobals->exportWorkers[i].geoCache;
+    u_int64_t h, m;
+
+    if(cache == NULL) continue;
+
+    h = cache->num_hits, m = cache->num_misses;
+    hits += h, misses += m, negative_hits += cache->num_negative_hits;
+    diff_hits += h - cache->last_hits, diff_misses += m - cache->last_misses;
+    cache->last_hits = h, cache->last_misses = m;
+  }
+
+  if((hits + misses) == 0) return;
+
+  traceEvent(TRACE_NORMAL, "GeoIP Cache [%.1f %% hits][%llu negative hits][%llu GeoIP lookups]"
+	     "[last %u sec: %.1f %% hits, %.1f GeoIP lookups/sec]",
+	     ((float)hits * 100) / (float)(hits + misses), (long long unsigned)negative_hits,
+	     (long long unsigned)misses, timeDifference,
+	     ((diff_hits + diff_misses) > 0) ? (((float)diff_hits * 100) / (float)(diff_hits + diff_misses)) : 0,
+	     (timeDifference > 0) ? ((float)diff_misses / (float)timeDifference) : 0);
+}
+
+#endif /* HAVE_GEOIP */
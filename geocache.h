@@ -0,0 +1,69 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _GEOCACHE_H_
+#define _GEOCACHE_H_
+
+/* ********************************** */
+
+#define GEO_CACHE_BITS             13 /* 8192 entries per export thread */
+#define GEO_CACHE_SIZE             (1 << GEO_CACHE_BITS)
+#define GEO_CACHE_TTL             300 /* sec: the GeoIP databases can be updated */
+
+struct geoCache;
+
+#ifdef HAVE_GEOIP
+typedef struct {
+  IpAddress addr;           /* ipVersion 0: empty */
+  u_int8_t asnResolved, geoResolved;
+  u_int32_t asn;            /* 0: not found */
+  time_t expire;
+  GeoIPRecord *geo;         /* NULL: not found */
+} GeoCacheEntry;
+
+/*
+  Address to ASN/city cache of one export thread: only that thread
+  reads and writes it, so there is no locking. Misses look up GeoIP
+  under geoipRwLock; the addresses GeoIP does not know are cached too.
+*/
+typedef struct geoCache {
+  GeoCacheEntry entries[GEO_CACHE_SIZE];
+
+  /* Stats */
+  u_int64_t num_hits, num_negative_hits, num_misses;
+  u_int64_t last_hits, last_misses;
+} GeoCache;
+
+/* ********************************** */
+
+extern GeoCache* createGeoCache(void);
+extern void freeGeoCache(GeoCache *cache);
+extern u_int32_t geoIpGetAS(IpAddress *addr);
+extern GeoIPRecord* geoIpGetRecord(IpAddress *addr);
+extern u_int32_t geoCacheGetAS(GeoCache *cache, IpAddress *addr);
+extern GeoIPRecord* geoCacheGetRecord(GeoCache *cache, IpAddress *addr);
+extern void dumpGeoCacheStats(u_int timeDifference);
+#endif
+
+extern u_int32_t getCachedAS(struct geoCache *cache, IpAddress *addr, HostInfo *bkt);
+
+#endif /* _GEOCACHE_H_ */
@@ -0,0 +1,682 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+#ifdef HAVE_BUILTIN_ATOMIC
+#define lpmBarrier() __sync_synchronize()
+#else
+#define lpmBarrier()
+#endif
+
+/* Replaced tables, freed by reclaimLpmTables() */
+static LpmTable *retiredLpmTables = NULL;
+
+/* ****************************************************** */
+
+static __inline__ u_int32_t v4Mask(u_int8_t bits) {
+  return((bits == 0) ? 0 : (0xFFFFFFFF << (32 - bits)));
+}
+
+/* ****************************************************** */
+
+static __inline__ void v6Split(struct in6_addr *addr, u_int64_t *hi, u_int64_t *lo) {
+  u_int32_t w[4];
+
+  memcpy(w, addr, 16);
+  *hi = ((u_int64_t)ntohl(w[0]) << 32) | ntohl(w[1]);
+  *lo = ((u_int64_t)ntohl(w[2]) << 32) | ntohl(w[3]);
+}
+
+/* ****************************************************** */
+
+static __inline__ void v6Mask(u_int64_t *hi, u_int64_t *lo, u_int8_t bits) {
+  if(bits == 0)
+    *hi = 0, *lo = 0;
+  else if(bits < 64)
+    *hi &= 0xFFFFFFFFFFFFFFFFULL << (64 - bits), *lo = 0;
+  else if(bits == 64)
+    *lo = 0;
+  else if(bits < 128)
+    *lo &= 0xFFFFFFFFFFFFFFFFULL << (128 - bits);
+}
+
+/* ****************************************************** */
+
+/* Bit i of the address, 0 being the most significant */
+static __inline__ u_int8_t v6Bit(u_int64_t hi, u_int64_t lo, u_int8_t i) {
+  return((i < 64) ? ((hi >> (63 - i)) & 1) : ((lo >> (127 - i)) & 1));
+}
+
+/* ****************************************************** */
+
+static __inline__ u_int8_t v6CommonBits(u_int64_t hi_a, u_int64_t lo_a, u_int64_t hi_b, u_int64_t lo_b) {
+  u_int64_t x;
+
+  if((x = hi_a ^ hi_b) != 0)
+    return(__builtin_clzll(x));
+  else if((x = lo_a ^ lo_b) != 0)
+    return(64 + __builtin_clzll(x));
+  else
+    return(128);
+}
+
+/* ****************************************************** */
+
+/* from: NULL for an empty table, or a table whose prefixes are copied (but not built) */
+LpmTable* createLpmTable(LpmTable *from) {
+  LpmTable *t = (LpmTable*)calloc(1, sizeof(LpmTable));
+
+  if(t == NULL) {
+    traceEvent(TRACE_ERROR, "Not enough memory");
+    return(NULL);
+  }
+
+  t->root = -1;
+
+  if((from != NULL) && (from->num_prefixes > 0)) {
+    if((t->prefixes = (LpmPrefix*)malloc(from->num_prefixes * sizeof(LpmPrefix))) == NULL) {
+      traceEvent(TRACE_ERROR, "Not enough memory");
+      free(t);
+      return(NULL);
+    }
+
+    memcpy(t->prefixes, from->prefixes, from->num_prefixes * sizeof(LpmPrefix));
+    t->num_prefixes = t->max_prefixes = from->num_prefixes;
+    t->num_ipv4 = from->num_ipv4, t->num_ipv6 = from->num_ipv6;
+  }
+
+  return(t);
+}
+
+/* ****************************************************** */
+
+/* addr: u_int32_t in host byte order (IPv4) or struct in6_addr (IPv6). Returns -1 on error */
+int lpmAddPrefix(LpmTable *t, u_int8_t ipVersion, void *addr, u_int8_t bits, u_int32_t value) {
+  LpmPrefix *p;
+
+  if(((ipVersion != 4) && (ipVersion != 6))
+     || (bits > ((ipVersion == 4) ? 32 : 128))
+     || (value > LPM_MAX_VALUE))
+    return(-1);
+
+  if(t->num_prefixes == t->max_prefixes) {
+    u_int32_t new_max = t->max_prefixes ? (2 * t->max_prefixes) : 64;
+    LpmPrefix *new_prefixes = (LpmPrefix*)realloc(t->prefixes, new_max * sizeof(LpmPrefix));
+
+    if(new_prefixes == NULL) {
+      traceEvent(TRACE_ERROR, "Not enough memory");
+      return(-1);
+    }
+
+    t->prefixes = new_prefixes, t->max_prefixes = new_max;
+  }
+
+  p = &t->prefixes[t->num_prefixes++];
+  memset(p, 0, sizeof(LpmPrefix));
+  p->ipVersion = ipVersion, p->bits = bits, p->value = value;
+
+  if(ipVersion == 4)
+    memcpy(&p->addr.ipv4, addr, 4), p->addr.ipv4 &= v4Mask(bits), t->num_ipv4++;
+  else
+    memcpy(&p->addr.ipv6, addr, 16), t->num_ipv6++;
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+/*
+  Adds "192.168.0.0/16", "192.168.0.0/255.255.0.0" or "2001:db8::/32";
+  without a mask the prefix is a host. Returns -1 if the prefix is
+  not valid.
+*/
+int lpmParsePrefix(LpmTable *t, char *prefix, u_int32_t value) {
+  char buf[64], *mask;
+  int bits, max_bits;
+  u_int8_t ipVersion;
+  u_int32_t ipv4;
+  struct in6_addr ipv6;
+
+  snprintf(buf, sizeof(buf), "%s", prefix);
+
+  if((mask = strchr(buf, '/')) != NULL)
+    *mask++ = '\0';
+
+  if(inet_pton(AF_INET, buf, &ipv4) == 1)
+    ipVersion = 4, max_bits = 32, ipv4 = ntohl(ipv4);
+  else if(inet_pton(AF_INET6, buf, &ipv6) == 1)
+    ipVersion = 6, max_bits = 128;
+  else {
+    traceEvent(TRACE_WARNING, "Invalid network '%s': ignored", prefix);
+    return(-1);
+  }
+
+  if(mask == NULL)
+    bits = max_bits;
+  else if((ipVersion == 4) && (strchr(mask, '.') != NULL)) {
+    u_int32_t m;
+
+    if(inet_pton(AF_INET, mask, &m) != 1) {
+      traceEvent(TRACE_WARNING, "Invalid netmask '%s': ignored", prefix);
+      return(-1);
+    }
+
+    m = ntohl(m), bits = (m == 0xFFFFFFFF) ? 32 : __builtin_clz(~m);
+
+    if(v4Mask(bits) != m) {
+      traceEvent(TRACE_WARNING, "Invalid netmask '%s': ignored", prefix);
+      return(-1);
+    }
+  } else
+    bits = atoi(mask);
+
+  if((bits < 0) || (bits > max_bits)) {
+    traceEvent(TRACE_WARNING, "Invalid netmask '%s': ignored", prefix);
+    return(-1);
+  }
+
+  if((ipVersion == 4) && ((ipv4 & v4Mask(bits)) != ipv4))
+    traceEvent(TRACE_WARNING, "%s is not a valid network - correcting mask", prefix);
+
+  return(lpmAddPrefix(t, ipVersion, (ipVersion == 4) ? (void*)&ipv4 : (void*)&ipv6, bits, value));
+}
+
+/* ****************************************************** */
+
+/* Returns the index of a new group filled with entry, or -1 */
+static int32_t newGroup(LpmTable *t, u_int32_t entry) {
+  u_int32_t i, *g;
+
+  if(t->num_groups == t->max_groups) {
+    u_int32_t new_max = t->max_groups ? (2 * t->max_groups) : 64;
+    u_int32_t *new_groups;
+
+    if(new_max > (LPM_GROUP - 1) / LPM_GROUP_LEN) return(-1);
+
+    if((new_groups = (u_int32_t*)realloc(t->groups, (size_t)new_max * LPM_GROUP_LEN * sizeof(u_int32_t))) == NULL)
+      return(-1);
+
+    t->groups = new_groups, t->max_groups = new_max;
+  }
+
+  g = &t->groups[(size_t)t->num_groups * LPM_GROUP_LEN];
+  for(i=0; i<LPM_GROUP_LEN; i++) g[i] = entry;
+
+  return(t->num_groups++);
+}
+
+/* ****************************************************** */
+
+/* Returns the group that *entry points to, making it first if needed */
+static u_int32_t* expandEntry(LpmTable *t, u_int32_t *base, u_int32_t idx) {
+  if(!(base[idx] & LPM_GROUP)) {
+    size_t base_off = (base == t->tbl16) ? 0 : (size_t)(base - t->groups);
+    int32_t g = newGroup(t, base[idx]);
+
+    if(g < 0) return(NULL);
+
+    /* newGroup() may have moved the groups */
+    if(base != t->tbl16) base = &t->groups[base_off];
+    base[idx] = LPM_GROUP | g;
+  }
+
+  return(&t->groups[(size_t)(base[idx] & ~LPM_GROUP) * LPM_GROUP_LEN]);
+}
+
+/* ****************************************************** */
+
+static int cmpPrefixBits(const void *_a, const void *_b) {
+  const LpmPrefix *a = *(const LpmPrefix**)_a, *b = *(const LpmPrefix**)_b;
+
+  if(a->bits != b->bits)
+    return((int)a->bits - (int)b->bits);
+
+  /* qsort() is not stable: keep the insertion order of equal lengths */
+  return((a < b) ? -1 : ((a > b) ? 1 : 0));
+}
+
+/* ****************************************************** */
+
+static int buildV4(LpmTable *t) {
+  LpmPrefix **sorted;
+  u_int32_t i, j, n = 0;
+
+  if((t->tbl16 = (u_int32_t*)calloc(65536, sizeof(u_int32_t))) == NULL)
+    return(-1);
+
+  if((sorted = (LpmPrefix**)malloc(t->num_ipv4 * sizeof(LpmPrefix*))) == NULL)
+    return(-1);
+
+  for(i=0; i<t->num_prefixes; i++)
+    if(t->prefixes[i].ipVersion == 4) sorted[n++] = &t->prefixes[i];
+
+  /*
+    Shorter prefixes first: a longer prefix overwrites the entries of
+    the shorter ones it is contained in, and the groups it creates
+    inherit the entry they replace. Equal prefixes: the last one added wins.
+  */
+  qsort(sorted, n, sizeof(LpmPrefix*), cmpPrefixBits);
+
+  for(i=0; i<n; i++) {
+    u_int32_t addr = sorted[i]->addr.ipv4, entry = sorted[i]->value + 1, *g1, *g2;
+    u_int8_t bits = sorted[i]->bits;
+
+    if(bits <= 16) {
+      u_int32_t first = addr >> 16, num = 1 << (16 - bits);
+
+      for(j=0; j<num; j++) t->tbl16[first + j] = entry;
+    } else if(bits <= 24) {
+      u_int32_t first = (addr >> 8) & 0xFF, num = 1 << (24 - bits);
+
+      if((g1 = expandEntry(t, t->tbl16, addr >> 16)) == NULL) goto no_memory;
+      for(j=0; j<num; j++) g1[first + j] = entry;
+    } else {
+      u_int32_t first = addr & 0xFF, num = 1 << (32 - bits);
+
+      if((g1 = expandEntry(t, t->tbl16, addr >> 16)) == NULL) goto no_memory;
+      if((g2 = expandEntry(t, g1, (addr >> 8) & 0xFF)) == NULL) goto no_memory;
+      for(j=0; j<num; j++) g2[first + j] = entry;
+    }
+  }
+
+  free(sorted);
+  return(0);
+
+ no_memory:
+  free(sorted);
+  return(-1);
+}
+
+/* ****************************************************** */
+
+static int32_t newNode(LpmTable *t, u_int64_t hi, u_int64_t lo, u_int8_t bits, u_int32_t value) {
+  LpmNode *n = &t->nodes[t->num_nodes]; /* The caller made room */
+
+  n->hi = hi, n->lo = lo, n->bits = bits, n->value = value;
+  n->child[0] = n->child[1] = -1;
+
+  return(t->num_nodes++);
+}
+
+/* ****************************************************** */
+
+static int insertV6(LpmTable *t, LpmPrefix *p) {
+  u_int64_t hi, lo;
+  int32_t *link = &t->root, n;
+  int32_t link_node = -1, link_side = 0; /* link is t->root or nodes[link_node].child[link_side] */
+
+  /* At most two nodes are added: make room now so that the pointers stay valid */
+  if((t->num_nodes + 2) > t->max_nodes) {
+    u_int32_t new_max = t->max_nodes ? (2 * t->max_nodes) : 64;
+    LpmNode *new_nodes = (LpmNode*)realloc(t->nodes, new_max * sizeof(LpmNode));
+
+    if(new_nodes == NULL) return(-1);
+    t->nodes = new_nodes, t->max_nodes = new_max;
+  }
+
+  v6Split(&p->addr.ipv6, &hi, &lo);
+  v6Mask(&hi, &lo, p->bits);
+
+  while((n = *link) != -1) {
+    LpmNode *node = &t->nodes[n];
+    u_int8_t common = v6CommonBits(hi, lo, node->hi, node->lo);
+
+    common = min(common, min(p->bits, node->bits));
+
+    if(common == node->bits) {
+      /* The node prefix contains the new one */
+      if(p->bits == node->bits) {
+	node->value = p->value;
+	return(0);
+      }
+
+      link_node = n, link_side = v6Bit(hi, lo, node->bits);
+      link = &node->child[link_side];
+    } else if(common == p->bits) {
+      /* The new prefix contains the node */
+      int32_t m = newNode(t, hi, lo, p->bits, p->value);
+
+      t->nodes[m].child[v6Bit(node->hi, node->lo, p->bits)] = n;
+      if(link_node == -1) t->root = m; else t->nodes[link_node].child[link_side] = m;
+      return(0);
+    } else {
+      /* They diverge at bit common: branch there */
+      u_int64_t b_hi = hi, b_lo = lo;
+      int32_t b, m;
+
+      v6Mask(&b_hi, &b_lo, common);
+      b = newNode(t, b_hi, b_lo, common, LPM_NO_MATCH);
+      m = newNode(t, hi, lo, p->bits, p->value);
+
+      t->nodes[b].child[v6Bit(hi, lo, common)] = m;
+      t->nodes[b].child[v6Bit(t->nodes[n].hi, t->nodes[n].lo, common)] = n;
+      if(link_node == -1) t->root = b; else t->nodes[link_node].child[link_side] = b;
+      return(0);
+    }
+  }
+
+  n = newNode(t, hi, lo, p->bits, p->value);
+  if(link_node == -1) t->root = n; else t->nodes[link_node].child[link_side] = n;
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+/* Compiles the prefixes added so far: the table must not be published yet */
+int lpmBuild(LpmTable *t) {
+  u_int32_t i;
+
+  if(t->tbl16) free(t->tbl16), t->tbl16 = NULL;
+  if(t->groups) free(t->groups), t->groups = NULL;
+  if(t->nodes) free(t->nodes), t->nodes = NULL;
+  t->num_groups = t->max_groups = t->num_nodes = t->max_nodes = 0, t->root = -1;
+
+  if((t->num_ipv4 > 0) && (buildV4(t) != 0)) {
+    traceEvent(TRACE_ERROR, "Not enough memory for %u IPv4 prefixes", t->num_ipv4);
+    return(-1);
+  }
+
+  for(i=0; i<t->num_prefixes; i++) {
+    if((t->prefixes[i].ipVersion == 6) && (insertV6(t, &t->prefixes[i]) != 0)) {
+      traceEvent(TRACE_ERROR, "Not enough memory for %u IPv6 prefixes", t->num_ipv6);
+      return(-1);
+    }
+  }
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+/* addr in host byte order */
+u_int32_t lpmLookupV4(LpmTable *t, u_int32_t addr) {
+  u_int32_t e;
+
+  if((t == NULL) || (t->tbl16 == NULL)) return(LPM_NO_MATCH);
+
+  e = t->tbl16[addr >> 16];
+
+  if(e & LPM_GROUP) {
+    e = t->groups[(size_t)(e & ~LPM_GROUP) * LPM_GROUP_LEN + ((addr >> 8) & 0xFF)];
+
+    if(e & LPM_GROUP)
+      e = t->groups[(size_t)(e & ~LPM_GROUP) * LPM_GROUP_LEN + (addr & 0xFF)];
+  }
+
+  return((e == 0) ? LPM_NO_MATCH : (e - 1));
+}
+
+/* ****************************************************** */
+
+u_int32_t lpmLookupV6(LpmTable *t, struct in6_addr *addr) {
+  u_int32_t best = LPM_NO_MATCH;
+  u_int64_t hi, lo;
+  int32_t n;
+
+  if((t == NULL) || (t->root == -1)) return(LPM_NO_MATCH);
+
+  v6Split(addr, &hi, &lo);
+
+  for(n = t->root; n != -1; ) {
+    LpmNode *node = &t->nodes[n];
+    u_int64_t m_hi = hi, m_lo = lo;
+
+    v6Mask(&m_hi, &m_lo, node->bits);
+    if((m_hi != node->hi) || (m_lo != node->lo))
+      break;
+
+    if(node->value != LPM_NO_MATCH) best = node->value;
+    if(node->bits == 128) break;
+
+    n = node->child[v6Bit(hi, lo, node->bits)];
+  }
+
+  return(best);
+}
+
+/* ****************************************************** */
+
+/* addr as in flow keys: IPv4 in host byte order */
+u_int32_t lpmLookup(LpmTable *t, IpAddress *addr) {
+  if(addr->ipVersion == 4)
+    return(lpmLookupV4(t, addr->ipType.ipv4));
+  else if(addr->ipVersion == 6)
+    return(lpmLookupV6(t, &addr->ipType.ipv6));
+  else
+    return(LPM_NO_MATCH);
+}
+
+/* ****************************************************** */
+
+/*
+  Replaces *where with t (built, or NULL for no prefixes). The readers
+  load *where once per lookup and do not announce themselves, so the
+  replaced table is retired and freed by reclaimLpmTables() only after
+  LPM_RETIRE_DELAY seconds, much longer than any lookup.
+*/
+void publishLpmTable(LpmTable **where, LpmTable *t) {
+  LpmTable *old = *where;
+
+  lpmBarrier();
+  *where = t;
+
+  if(old == NULL) return;
+
+  old->retired_at = coarseTime();
+
+#ifdef HAVE_BUILTIN_ATOMIC
+  do {
+    old->retired = retiredLpmTables;
+  } while(!__sync_bool_compare_and_swap(&retiredLpmTables, old->retired, old));
+#else
+  old->retired = retiredLpmTables, retiredLpmTables = old;
+#endif
+}
+
+/* ****************************************************** */
+
+/*
+  Called once a second by the stats thread (all = 0) and at shutdown
+  (all = 1). Without atomics publishLpmTable() can run concurrently
+  from a reload: the retired tables are then kept until shutdown.
+*/
+void reclaimLpmTables(u_int8_t all) {
+  LpmTable *t, *next, *keep = NULL;
+  time_t now = coarseTime();
+
+#ifdef HAVE_BUILTIN_ATOMIC
+  t = __sync_lock_test_and_set(&retiredLpmTables, NULL);
+#else
+  if(!all) return;
+  t = retiredLpmTables, retiredLpmTables = NULL;
+#endif
+
+  for(; t != NULL; t = next) {
+    next = t->retired, t->retired = NULL;
+
+    if(all || ((now - t->retired_at) >= LPM_RETIRE_DELAY))
+      freeLpmTable(t);
+    else
+      t->retired = keep, keep = t;
+  }
+
+  /* Put back what is too young, after what has been retired meanwhile */
+  while(keep != NULL) {
+    t = keep, keep = keep->retired;
+
+#ifdef HAVE_BUILTIN_ATOMIC
+    do {
+      t->retired = retiredLpmTables;
+    } while(!__sync_bool_compare_and_swap(&retiredLpmTables, t->retired, t));
+#else
+    t->retired = retiredLpmTables, retiredLpmTables = t;
+#endif
+  }
+}
+
+/* ****************************************************** */
+
+void freeLpmTable(LpmTable *t) {
+  if(t == NULL) return;
+
+  if(t->prefixes) free(t->prefixes);
+  if(t->tbl16) free(t->tbl16);
+  if(t->groups) free(t->groups);
+  if(t->nodes) free(t->nodes);
+  free(t);
+}
+
+/* ****************************************************** */
+
+static u_int32_t benchRandom(u_int64_t *seed) {
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return((u_int32_t)(*seed >> 32));
+}
+
+/* ****************************************************** */
+
+/* Reference: the longest of the prefixes of the table that contain addr */
+static u_int32_t linearLookupV4(LpmTable *t, u_int32_t addr, u_int32_t max_prefixes) {
+  u_int32_t i, best = LPM_NO_MATCH;
+  int best_bits = -1;
+
+  for(i=0; (i<t->num_prefixes) && (i<max_prefixes); i++) {
+    LpmPrefix *p = &t->prefixes[i];
+
+    if((p->ipVersion == 4) && ((addr & v4Mask(p->bits)) == p->addr.ipv4) && ((int)p->bits >= best_bits))
+      best = p->value, best_bits = p->bits;
+  }
+
+  return(best);
+}
+
+/* ****************************************************** */
+
+static float benchElapsed(struct timeval *begin) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return((now.tv_sec - begin->tv_sec) + ((float)now.tv_usec - (float)begin->tv_usec) / 1000000);
+}
+
+/* ****************************************************** */
+
+/*
+  --lpm-bench: builds a table of num_prefixes IPv4 prefixes (as many
+  /24s as in a BGP table, the rest between /8 and /32) and as many IPv6
+  ones (/32 to /64), checks the lookups against a linear scan and
+  reports the lookups/sec of both, the linear scan being done on
+  MAX_NUM_NETWORKS prefixes as the old -L/--black-list lists.
+*/
+void lpmBenchmark(u_int32_t num_prefixes) {
+  u_int32_t *addrs, i, num_errors = 0, sum = 0;
+  u_int64_t seed = 12345;
+  struct timeval begin;
+  float elapsed;
+  LpmTable *t;
+
+  if((t = createLpmTable(NULL)) == NULL) return;
+
+  if((addrs = (u_int32_t*)malloc(LPM_BENCH_LOOKUPS * sizeof(u_int32_t))) == NULL) {
+    traceEvent(TRACE_ERROR, "Not enough memory");
+    freeLpmTable(t);
+    return;
+  }
+
+  for(i=0; i<num_prefixes; i++) {
+    u_int32_t r = benchRandom(&seed) % 100, addr = benchRandom(&seed);
+    u_int8_t bits = (r < 55) ? 24 : ((r < 90) ? (16 + (r % 8)) : ((r < 95) ? (8 + (r % 8)) : (25 + (r % 8))));
+    struct in6_addr a6;
+    u_int32_t w[4];
+
+    lpmAddPrefix(t, 4, &addr, bits, i);
+
+    w[0] = htonl(0x20010000 | (benchRandom(&seed) & 0xFFFF)), w[1] = htonl(benchRandom(&seed));
+    w[2] = htonl(benchRandom(&seed)), w[3] = htonl(benchRandom(&seed));
+    memcpy(&a6, w, 16);
+    lpmAddPrefix(t, 6, &a6, 32 + (benchRandom(&seed) % 33), i);
+  }
+
+  gettimeofday(&begin, NULL);
+  if(lpmBuild(t) != 0) {
+    free(addrs);
+    freeLpmTable(t);
+    return;
+  }
+  elapsed = benchElapsed(&begin);
+
+  traceEvent(TRACE_NORMAL, "LPM benchmark: built %u IPv4 + %u IPv6 prefixes in %.3f sec "
+	     "[IPv4 %.1f MB: %u groups][IPv6 %.1f MB: %u nodes]",
+	     t->num_ipv4, t->num_ipv6, elapsed,
+	     (float)(65536 + (u_int64_t)t->num_groups * LPM_GROUP_LEN) * sizeof(u_int32_t) / (1024 * 1024), t->num_groups,
+	     (float)t->num_nodes * sizeof(LpmNode) / (1024 * 1024), t->num_nodes);
+
+  /* Half of the addresses inside a prefix, half random */
+  for(i=0; i<LPM_BENCH_LOOKUPS; i++) {
+    if(i & 1) {
+      LpmPrefix *p = &t->prefixes[2 * (benchRandom(&seed) % num_prefixes)];
+
+      addrs[i] = p->addr.ipv4 | (benchRandom(&seed) & ~v4Mask(p->bits));
+    } else
+      addrs[i] = benchRandom(&seed);
+  }
+
+  for(i=0; i<1000; i++)
+    if(lpmLookupV4(t, addrs[i]) != linearLookupV4(t, addrs[i], t->num_prefixes))
+      num_errors++;
+
+  if(num_errors > 0)
+    traceEvent(TRACE_ERROR, "LPM benchmark: %u/1000 IPv4 lookups differ from a linear scan", num_errors);
+
+  gettimeofday(&begin, NULL);
+  for(i=0; i<LPM_BENCH_LOOKUPS; i++) sum += lpmLookupV4(t, addrs[i]);
+  elapsed = benchElapsed(&begin);
+
+  traceEvent(TRACE_NORMAL, "LPM benchmark: [IPv4 %.1f M lookups/sec][%.1f ns/lookup]",
+	     (float)LPM_BENCH_LOOKUPS / (elapsed * 1000000), (elapsed * 1000000000) / LPM_BENCH_LOOKUPS);
+
+  gettimeofday(&begin, NULL);
+  for(i=0; i<LPM_BENCH_LOOKUPS; i++) {
+    struct in6_addr a6;
+    u_int32_t w[4];
+
+    w[0] = htonl(0x20010000 | (addrs[i] & 0xFFFF)), w[1] = htonl(addrs[i]), w[2] = w[3] = addrs[i];
+    memcpy(&a6, w, 16);
+    sum += lpmLookupV6(t, &a6);
+  }
+  elapsed = benchElapsed(&begin);
+
+  traceEvent(TRACE_NORMAL, "LPM benchmark: [IPv6 %.1f M lookups/sec][%.1f ns/lookup]",
+	     (float)LPM_BENCH_LOOKUPS / (elapsed * 1000000), (elapsed * 1000000000) / LPM_BENCH_LOOKUPS);
+
+  gettimeofday(&begin, NULL);
+  for(i=0; i<LPM_BENCH_LOOKUPS / 100; i++) sum += linearLookupV4(t, addrs[i], MAX_NUM_NETWORKS);
+  elapsed = benchElapsed(&begin);
+
+  traceEvent(TRACE_NORMAL, "LPM benchmark: [linear scan of %u IPv4 prefixes %.1f M lookups/sec][checksum %u]",
+	     MAX_NUM_NETWORKS, (float)(LPM_BENCH_LOOKUPS / 100) / (elapsed * 1000000), sum);
+
+  free(addrs);
+  freeLpmTable(t);
+}
@@ -0,0 +1,96 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _LPM_H_
+#define _LPM_H_
+
+/* ********************************** */
+
+#define LPM_NO_MATCH          0xFFFFFFFF /* lpmLookup(): no prefix contains the address */
+#define LPM_MAX_VALUE         0x7FFFFFFD
+#define LPM_GROUP             0x80000000 /* IPv4 entry: index of the next level group */
+#define LPM_GROUP_LEN                256 /* IPv4 second and third level entries (8 bits) */
+#define LPM_BENCH_PREFIXES        100000 /* --lpm-bench default */
+#define LPM_BENCH_LOOKUPS       10000000
+#define LPM_RETIRE_DELAY               5 /* sec: replaced tables are freed after this */
+
+typedef struct {
+  u_int8_t ipVersion, bits;
+  u_int32_t value;
+  union {
+    u_int32_t ipv4; /* Host byte order */
+    struct in6_addr ipv6;
+  } addr;
+} LpmPrefix;
+
+typedef struct {
+  u_int64_t hi, lo;         /* Prefix, host byte order */
+  u_int32_t value;          /* LPM_NO_MATCH for the branching nodes */
+  int32_t child[2];         /* -1: none */
+  u_int8_t bits;
+} LpmNode;
+
+/*
+  Longest prefix match of IPv4 and IPv6 addresses onto a 32 bit value
+  (interface index, netmask...). The prefixes are added first, then
+  lpmBuild() compiles them: afterwards the table is read-only and can
+  be looked up by any thread without locking. Reloads build a new
+  table and swap it with publishLpmTable().
+
+  IPv4 is a 16-8-8 multibit trie: a 64k entries first level points to
+  the 256 entries groups of the /16s (and then /24s) that have longer
+  prefixes, so a lookup is at most three reads. IPv6 is a path
+  compressed binary trie whose nodes sit in one array.
+*/
+typedef struct lpmTable {
+  /* Source prefixes, kept to build copies */
+  LpmPrefix *prefixes;
+  u_int32_t num_prefixes, max_prefixes, num_ipv4, num_ipv6;
+
+  /* IPv4 */
+  u_int32_t *tbl16, *groups;
+  u_int32_t num_groups, max_groups;
+
+  /* IPv6 */
+  LpmNode *nodes;
+  u_int32_t num_nodes, max_nodes;
+  int32_t root;
+
+  struct lpmTable *retired; /* Next in the list of the replaced tables */
+  time_t retired_at;
+} LpmTable;
+
+/* ********************************** */
+
+extern LpmTable* createLpmTable(LpmTable *from);
+extern int lpmAddPrefix(LpmTable *t, u_int8_t ipVersion, void *addr, u_int8_t bits, u_int32_t value);
+extern int lpmParsePrefix(LpmTable *t, char *prefix, u_int32_t value);
+extern int lpmBuild(LpmTable *t);
+extern u_int32_t lpmLookupV4(LpmTable *t, u_int32_t addr);
+extern u_int32_t lpmLookupV6(LpmTable *t, struct in6_addr *addr);
+extern u_int32_t lpmLookup(LpmTable *t, IpAddress *addr);
+extern void publishLpmTable(LpmTable **where, LpmTable *t);
+extern void reclaimLpmTables(u_int8_t all);
+extern void freeLpmTable(LpmTable *t);
+extern void lpmBenchmark(u_int32_t num_prefixes);
+
+#endif /* _LPM_H_ */
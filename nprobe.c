@@ -118,6 +118,9 @@ static const struct option _long_options[] = {
   { "biflows-export-policy",            required_argument,       NULL, 'N' },
   { "flows-intra-templ",                required_argument,       NULL, 'o' },
   { "num-threads",                      required_argument,       NULL, 'O' },
+#ifdef HAVE_AF_PACKET
+  { "afpacket-threads",                 required_argument,       NULL, 260 },
+#endif
   { "aggregation",                      required_argument,       NULL, 'p' },
   { "dump-path",                        required_argument,       NULL, 'P' },
 #ifdef IP_HDRINCL
@@ -203,6 +206,9 @@ static const struct option _long_options[] = {
 #ifdef HAVE_PTHREAD_SET_AFFINITY
   { "export-thread-affinity",           required_argument,       NULL, 230 },
 #endif
+  { "export-threads",                   required_argument,       NULL, 256 },
+  { "export-batch",                     required_argument,       NULL, 257 },
+  { "export-mtu",                       required_argument,       NULL, 258 },
   { "dump-bad-packets",                 required_argument,       NULL, 231 },
   { "lru-cache-size",                   required_argument,       NULL, 232 },
   { "enable-throughput-stats",          no_argument,             NULL, 233 },
@@ -226,10 +232,23 @@ static const struct option _long_options[] = {
   { "unprivileged-user",                required_argument,       NULL, 244 },
   { "disable-cache",                    no_argument,             NULL, 245 },
   { "fake-capture",                     no_argument,             NULL, 246 },
-  /* NOTE: 247 is free */
+  { "fake-capture-bench",               required_argument,       NULL, 229 },
+  { "encode-bench",                     required_argument,       NULL, 259 },
+  { "flow-table",                       required_argument,       NULL, 247 },
+  { "flow-hash",                        required_argument,       NULL, 261 },
+  { "flow-hash-test",                   required_argument,       NULL, 262 },
+  { "packet-batch",                     required_argument,       NULL, 263 },
+  { "replay-bench",                     no_argument,             NULL, 264 },
+  { "call-bench",                       required_argument,       NULL, 265 },
+  { "collector-reuseport",              no_argument,             NULL, 266 },
+  { "collector-blast",                  required_argument,       NULL, 267 },
+  { "collector-bench",                  required_argument,       NULL, 268 },
+  { "lpm-bench",                        required_argument,       NULL, 269 },
+  { "lru-bench",                        required_argument,       NULL, 270 },
   { "performance",                      no_argument,             NULL, 248 },
 #ifdef HAVE_REDIS
   { "redis-logging",                    required_argument,       NULL, 249 },
+  { "redis-bench",                      required_argument,       NULL, 271 },
 #endif
   /*
     Options for plugins. These options are not handled by the main
@@ -352,6 +371,11 @@ u_int32_t printPcapStats(pcap_t *pcapPtr) {
 
 /* Return the number of dropped packets since last call */
 static u_int32_t printCaptureStats(u_int8_t dump_stats_on_screen) {
+#ifdef HAVE_AF_PACKET
+  if(readOnlyGlobals.afPacketThreads > 0)
+    return(printAfPacketStats(dump_stats_on_screen));
+#endif
+
 #ifdef HAVE_PF_RING
   if(!readWriteGlobals->stopPacketCapture)
     return(printPfRingStats(dump_stats_on_screen));
@@ -503,8 +527,7 @@ static void* printThroughputStats(void* notUsed) {
 static void updateThreadPacketStats(u_short pktLen, u_short thread_id, struct timeval *ts) {
   pktLen += 24 /* 8 Preamble + 4 CRC + 12 IFG */;
 
-  readWriteGlobals->accumulateStats[thread_id].pkts++, readWriteGlobals->accumulateStats[thread_id].bytes += pktLen;
-  readWriteGlobals->currentPkts[thread_id]++, readWriteGlobals->currentBytes[thread_id] += pktLen;
+  readWriteGlobals->threadStats[thread_id].stats.pkts++, readWriteGlobals->threadStats[thread_id].stats.bytes += pktLen;
 
   if(unlikely(readOnlyGlobals.computeTrafficThroughput)) {
     pthread_rwlock_wrlock(&readWriteGlobals->trafficThroughputStats.trafficThroughputLock);
@@ -857,18 +880,26 @@ static void deepPacketDecode(u_short thread_id,
 	  proto = ipv6->ip6_nxt; /* next header (protocol) */
 	  payloadLen = h->caplen - ehshift - hlen;
 
-	  /* FIX: blacklist check for IPv6 */
+	  /* blacklist check */
+	  if(unlikely(readOnlyGlobals.numBlacklistNetworks > 0)) {
+	    if(isBlacklistedAddressV6(&ipv6->ip6_src)
+	       || isBlacklistedAddressV6(&ipv6->ip6_dst))
+	      return;
+	  }
 
-	  /* FIX: isLocalAddress doesn't work with IPv6 */
-	  if(unlikely(readOnlyGlobals.ignoreIP))
+	  memcpy(&src.ipType.ipv6, &ipv6->ip6_src, sizeof(struct in6_addr));
+	  if(unlikely(readOnlyGlobals.ignoreIP
+		      || (readOnlyGlobals.setAllNonLocalHostsToZero
+			  && (readOnlyGlobals.numLocalNetworks > 0)
+			  && (!isLocalIpAddress(&src)))))
 	    memset(&src.ipType.ipv6, 0, sizeof(struct in6_addr));
-	  else
-	    memcpy(&src.ipType.ipv6, &ipv6->ip6_src, sizeof(struct in6_addr));
 
-	  if(unlikely(readOnlyGlobals.ignoreIP))
+	  memcpy(&dst.ipType.ipv6, &ipv6->ip6_dst, sizeof(struct in6_addr));
+	  if(unlikely(readOnlyGlobals.ignoreIP
+		      || (readOnlyGlobals.setAllNonLocalHostsToZero
+			  && (readOnlyGlobals.numLocalNetworks > 0)
+			  && (!isLocalIpAddress(&dst)))))
 	    memset(&dst.ipType.ipv6, 0, sizeof(struct in6_addr));
-	  else
-	    memcpy(&dst.ipType.ipv6, &ipv6->ip6_dst, sizeof(struct in6_addr));
 
 	  if(proto == 0) {
 	    /* IPv6 hop-by-hop option */
@@ -1220,9 +1251,9 @@ static void deepPacketDecode(u_short thread_id,
 		 || (dport == 6343) /* sFlow (we hope) */) {
 		struct sockaddr_in fromHostV4;
 
-		dissectSflow((u_char*)&p[payload_shift], payloadLen, &fromHostV4); /* sFlow */
+		dissectSflow(thread_id, (u_char*)&p[payload_shift], payloadLen, &fromHostV4); /* sFlow */
 	      } else
-		dissectNetFlow(htonl(src.ipType.ipv4), (char*)&p[payload_shift], payloadLen);
+		dissectNetFlow(thread_id, htonl(src.ipType.ipv4), (char*)&p[payload_shift], payloadLen, IPPROTO_UDP);
 
 	      return;
 	    }
@@ -1437,14 +1468,13 @@ static void deepPacketDecode(u_short thread_id,
 	if(unlikely(readOnlyGlobals.tracePerformance)) {
 	  ticks diff = getticks() - when;
 
-	  pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
-	  readOnlyGlobals.decodeTicks += diff;
-	  pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
+	  readWriteGlobals->threadStats[thread_id].perf.decodeTicks += diff;
 	}
 
 	if(unlikely(numPkts == 0)) {
 	  traceEvent(TRACE_WARNING, "[%u] Internal error (zero packets)", pthread_self());
 	} else {
+	  DecodedPacket pkt;
 	  u_int8_t ttl;
 
 	  do_process:
@@ -1470,30 +1500,32 @@ static void deepPacketDecode(u_short thread_id,
 	  if(overwrite_packet_lenght)
 	    h->len = overwrite_packet_lenght;
 
-	  processFlowPacket(thread_id, packet_if_idx, direction,
-			    subflow_id, proto, numFragments, ip_offset, sampledPacket,
-			    numPkts,
-			    ip ? ip->ip_tos : 0, ttl,
-			    vlanId, tunnel_id, gtp_offset,
-			    ehdr, &src, sport, &dst, dport,
-			    untunneled_proto,
-			    &untunneled_src, untunneled_sport,
-			    &untunneled_dst, untunneled_dport,
-			    unlikely(readOnlyGlobals.accountL2Traffic) ? h->len : plen,
-			    tcpWin, tcpFlags, tcpSeqNum, tcpAckNum,
-			    tcpMss, tcpWinScale, icmp_type, icmp_code,
-			    numMplsLabels, mplsLabels,
-			    input_index, output_index,
-			    (struct pcap_pkthdr*)h, (u_char*)p,
-			    payload_shift, payloadLen,
-			    originalPayloadLen, 0,
-			    0, 0, 0, 0, flow_sender_ip,
-			    packet_hash,
-			    readOnlyGlobals.engineType,
-			    readOnlyGlobals.engineId,
-			    (osi_src[0] == 0) ? NULL : osi_src,
-			    (osi_dst[0] == 0) ? NULL : osi_dst,
-			    NULL);
+	  pkt.packet_if_idx = packet_if_idx, pkt.rx_packet = direction;
+	  pkt.subflow_id = subflow_id, pkt.proto = proto, pkt.numFragments = numFragments;
+	  pkt.ip_offset = ip_offset, pkt.sampledPacket = sampledPacket, pkt.numPkts = numPkts;
+	  pkt.tos = ip ? ip->ip_tos : 0, pkt.ttl = ttl;
+	  pkt.vlanId = vlanId, pkt.tunnel_id = tunnel_id, pkt.gtp_offset = gtp_offset;
+	  pkt.ehdr = ehdr, pkt.src = &src, pkt.sport = sport, pkt.dst = &dst, pkt.dport = dport;
+	  pkt.untunneled_proto = untunneled_proto;
+	  pkt.untunneled_src = &untunneled_src, pkt.untunneled_sport = untunneled_sport;
+	  pkt.untunneled_dst = &untunneled_dst, pkt.untunneled_dport = untunneled_dport;
+	  pkt.len = unlikely(readOnlyGlobals.accountL2Traffic) ? h->len : plen;
+	  pkt.tcpWin = tcpWin, pkt.tcpFlags = tcpFlags, pkt.tcpSeqNum = tcpSeqNum, pkt.tcpAckNum = tcpAckNum;
+	  pkt.tcpMaxSegmentSize = tcpMss, pkt.tcpWinScale = tcpWinScale;
+	  pkt.icmpType = icmp_type, pkt.icmpCode = icmp_code;
+	  pkt.numMplsLabels = numMplsLabels, pkt.mplsLabels = mplsLabels;
+	  pkt.if_input = input_index, pkt.if_output = output_index;
+	  pkt.h = (struct pcap_pkthdr*)h, pkt.p = (u_char*)p;
+	  pkt.payload_shift = payload_shift, pkt.payloadLen = payloadLen;
+	  pkt.originalPayloadLen = originalPayloadLen, pkt.firstSeen = 0;
+	  pkt.src_as = pkt.dst_as = 0, pkt.src_mask = pkt.dst_mask = 0;
+	  pkt.flow_sender_ip = flow_sender_ip, pkt.packet_hash = packet_hash;
+	  pkt.engine_type = readOnlyGlobals.engineType, pkt.engine_id = readOnlyGlobals.engineId;
+	  pkt.osi_src = (osi_src[0] == 0) ? NULL : osi_src;
+	  pkt.osi_dst = (osi_dst[0] == 0) ? NULL : osi_dst;
+	  pkt.record = NULL;
+
+	  processFlowPacket(thread_id, &pkt);
 	}
       }
       break;
@@ -1540,7 +1572,7 @@ static void deepPacketDecode(u_short thread_id,
 #ifdef DEBUG
 	traceEvent(TRACE_WARNING, "Unknown ethernet type: 0x%X (%d)", eth_type, eth_type);
 #endif
-	readWriteGlobals->discardedPkts[thread_id]++;
+	readWriteGlobals->threadStats[thread_id].discardedPkts++;
 
 #ifdef HAVE_PF_RING
 	if(readOnlyGlobals.enableL7BridgePlugin && (packet_if_idx != -1))
@@ -1554,26 +1586,11 @@ static void deepPacketDecode(u_short thread_id,
 
 /* ****************************************************** */
 
-static u_int8_t isPacketQueueFull(ItemsQueue *queue) {
-  QueuedPacket *pkt = &((QueuedPacket*)queue->queueSlots)[queue->insert_idx];
-
-  if(pkt->packet_ready && (queue->insert_idx == queue->remove_idx))
-    return(1);
-  else
-    return(0);
-}
-
-/* ****************************************************** */
-
-void decodePacket(u_short thread_id,
-		  int packet_if_idx /* -1 = unknown */,
-		  struct pcap_pkthdr *h, const u_char *p,
-		  u_int8_t sampledPacket, u_int8_t direction /* 1=RX, 0=TX */,
-		  u_int32_t numPkts, int input_index, int output_index,
-		  u_int32_t flow_sender_ip,
-		  u_int32_t packet_hash) {
-
-  /* Sanity check */
+/*
+  Sanity checks of a captured packet header: returns 0 when the packet
+  has to be ignored. A caplen above len is clamped instead.
+*/
+int checkPacketHeader(struct pcap_pkthdr *h) {
   if(unlikely((h->ts.tv_sec < 0) || (h->ts.tv_usec < 0))) {
     static u_int8_t shown_msg = 0;
 
@@ -1582,7 +1599,7 @@ void decodePacket(u_short thread_id,
       shown_msg = 1;
     }
 
-    return; /* We ignore this packet */
+    return(0); /* We ignore this packet */
   } else if(unlikely(h->caplen > h->len)) {
     static u_int8_t shown_msg = 0;
 
@@ -1598,29 +1615,37 @@ void decodePacket(u_short thread_id,
     h->caplen = min(h->caplen, h->len);
   }
 
-  if(packet_hash) {
-    if(unlikely(readOnlyGlobals.useLocks)) {
-      u_int queue_id = packet_hash >> 2; /* shuffle data a bit */
-      ItemsQueue *queue = &readWriteGlobals->packetQueues[queue_id % readOnlyGlobals.numProcessThreads];
-      QueuedPacket *slot;
+  return(1);
+}
 
-      while(isPacketQueueFull(queue)) {
-	if(thread_id > 0) traceEvent(TRACE_WARNING, "Queue %d is full [packet_hash=%u]", thread_id, packet_hash);
-	if(readWriteGlobals->shutdownInProgress)
-	  return;
-	else
-	  usleep(1);
-      }
+/* ****************************************************** */
 
-      /* Copy the packet in queue */
-      slot = &((QueuedPacket*)queue->queueSlots)[queue->insert_idx];
-      slot->packet_if_idx = packet_if_idx, slot->rx_direction = direction;
-      memcpy(&slot->h, h, sizeof(struct pcap_pkthdr)), memcpy(slot->p, p, h->caplen);
-      slot->packet_ready = 1, slot->packet_hash = packet_hash;
-      queue->insert_idx = (queue->insert_idx + 1) % DEFAULT_QUEUE_CAPACITY, queue->num_insert++;
-      signalCondvar(&queue->dequeue_condvar, 0);
+/* release (if any) is called once the packet is no longer used */
+static void _decodePacket(u_short thread_id,
+			  int packet_if_idx /* -1 = unknown */,
+			  struct pcap_pkthdr *h, const u_char *p,
+			  u_int8_t sampledPacket, u_int8_t direction /* 1=RX, 0=TX */,
+			  u_int32_t numPkts, int input_index, int output_index,
+			  u_int32_t flow_sender_ip,
+			  u_int32_t packet_hash,
+			  PacketReleaseFct release, void *release_arg) {
+
+  /* Sanity check */
+  if(!checkPacketHeader(h)) {
+    if(release != NULL) release(release_arg);
+    return;
+  }
+
+  if(unlikely(readOnlyGlobals.useLocks) && (readOnlyGlobals.numProcessThreads > 1)) {
+    /* A packet_hash from the capture layer is also used as flow hash */
+    u_int32_t queue_id = packet_hash ? (packet_hash >> 2 /* shuffle data a bit */) : packetSteeringHash(h, p);
+
+    if(queuePacket(thread_id, queue_id, packet_if_idx, h, p,
+		   sampledPacket, direction, numPkts, input_index, output_index,
+		   flow_sender_ip, packet_hash, release, release_arg) == 0)
       return;
-    }
+
+    /* Packet found by a processing thread inside another one: process it here */
   }
 
 #ifdef linux
@@ -1639,6 +1664,7 @@ void decodePacket(u_short thread_id,
     if(mprotect(readWriteGlobals->protect_mem, h->caplen, PROT_READ|PROT_WRITE) != 0)
       traceEvent(TRACE_WARNING, "mprotect(PROT_RW) failed [%u/%s]", errno, strerror(errno));
 
+    if(release != NULL) release(release_arg);
     return;
   }
 #endif
@@ -1650,6 +1676,8 @@ void decodePacket(u_short thread_id,
 		   numPkts, input_index, output_index,
 		   flow_sender_ip, packet_hash);
 
+  if(release != NULL) release(release_arg);
+
   if(unlikely(readOnlyGlobals.computeTrafficThroughput
 	      && (readOnlyGlobals.pcapFile != NULL)
 	      && (readWriteGlobals->now != readWriteGlobals->lastThroughputDump)))
@@ -1658,6 +1686,81 @@ void decodePacket(u_short thread_id,
 
 /* ****************************************************** */
 
+void decodePacket(u_short thread_id,
+		  int packet_if_idx /* -1 = unknown */,
+		  struct pcap_pkthdr *h, const u_char *p,
+		  u_int8_t sampledPacket, u_int8_t direction /* 1=RX, 0=TX */,
+		  u_int32_t numPkts, int input_index, int output_index,
+		  u_int32_t flow_sender_ip,
+		  u_int32_t packet_hash) {
+  _decodePacket(thread_id, packet_if_idx, h, p, sampledPacket, direction,
+		numPkts, input_index, output_index, flow_sender_ip, packet_hash,
+		NULL, NULL);
+}
+
+/* ****************************************************** */
+
+/*
+  Same as decodePacket() for packets that stay in capture memory: p is
+  not copied when the packet is handed to a processing thread, and
+  release(release_arg) is called once it has been processed.
+*/
+void decodePacketRef(u_short thread_id,
+		     int packet_if_idx /* -1 = unknown */,
+		     struct pcap_pkthdr *h, const u_char *p,
+		     u_int8_t sampledPacket, u_int8_t direction /* 1=RX, 0=TX */,
+		     u_int32_t packet_hash,
+		     PacketReleaseFct release, void *release_arg) {
+  _decodePacket(thread_id, packet_if_idx, h, p, sampledPacket, direction,
+		1 /* numPkts */, NO_INTERFACE_INDEX, NO_INTERFACE_INDEX,
+		0 /* flow_sender_ip */, packet_hash,
+		release, release_arg);
+}
+
+/* ****************************************************** */
+
+/*
+  Decodes a burst of packets already handed to this thread: the flow
+  hash of every packet is computed and its hash slot prefetched, then
+  the first bucket of each slot is prefetched, and only then the
+  packets are decoded one by one. By the time processFlowPacket() walks
+  the hash the memory has been fetched, instead of stalling on every
+  packet. The caller releases the packets.
+*/
+void decodePacketBatch(u_short thread_id, QueuedPacket **pkts, u_int32_t num) {
+  u_int32_t hash[PACKET_BATCH_MAX], i;
+
+  num = min(num, PACKET_BATCH_MAX);
+
+  if(num > 1) {
+    FlowHashKey key, steering;
+
+    for(i=0; i<num; i++) {
+      if(parseFlowHashKeys(readOnlyGlobals.datalink, pkts[i]->p, pkts[i]->h.caplen, &key, &steering) == 0) {
+	hash[i] = pkts[i]->packet_hash ? pkts[i]->packet_hash : computeFlowHash(&key);
+	prefetchFlowHashSlot(thread_id, hash[i]);
+      } else
+	hash[i] = 0;
+    }
+
+    for(i=0; i<num; i++)
+      if(hash[i] != 0) prefetchFlowBucket(thread_id, hash[i]);
+  }
+
+  for(i=0; i<num; i++)
+    deepPacketDecode(thread_id,
+		     pkts[i]->packet_if_idx,
+		     &pkts[i]->h, pkts[i]->p,
+		     pkts[i]->sampledPacket,
+		     pkts[i]->rx_direction /* Packet direction */,
+		     pkts[i]->numPkts,
+		     pkts[i]->input_index, pkts[i]->output_index,
+		     pkts[i]->flow_sender_ip,
+		     pkts[i]->packet_hash);
+}
+
+/* ****************************************************** */
+
 void freeHostHash(void) {
   if(readOnlyGlobals.enableHostStats) {
     traceEvent(TRACE_INFO, "MISSING implement freeHostHash()");
@@ -1889,6 +1992,15 @@ void usage(u_int8_t long_help) {
 	 "                                    | [default=%u]. Use 1 unless you know\n"
 	 "                                    | what you're doing.\n",
 	 readOnlyGlobals.numProcessThreads);
+  printf("--packet-batch <num>                | Packets decoded as a burst whose flow buckets are\n"
+	 "                                    | prefetched first [1..%u, default=%u].\n",
+	 PACKET_BATCH_MAX, DEFAULT_PACKET_BATCH);
+#ifdef HAVE_AF_PACKET
+  printf("--afpacket-threads <num>            | Capture from -i <device> with <num> AF_PACKET\n"
+	 "                                    | TPACKET_V3 sockets (at most -O) sharing the\n"
+	 "                                    | traffic with a fanout group. Packets are not\n"
+	 "                                    | copied into the processing threads.\n");
+#endif
   printf("[--dump-path|-P] <path>             | Directory where dump files will\n"
 	 "                                    | be stored.\n");
   printf("[--exec-cmd-dump|-R] <cmd>          | Execute the specified command for each\n"
@@ -1966,6 +2078,32 @@ void usage(u_int8_t long_help) {
   printf("--json-labels                       | In case JSON label is used (e.g. with ZMQ)\n"
 	 "                                    | labels instead of numbers are used as keys.\n");
   printf("--fake-capture                      | Fake packet capture (development only).\n");
+  printf("--fake-capture-bench <num flows>    | Fake packet capture cycling over <num flows> flows:\n"
+	 "                                    | reports pkts/sec and cache misses/pkt (development only).\n");
+  printf("--encode-bench <num flows>          | Encode <num flows> synthetic flows (0 = 10M) with the\n"
+	 "                                    | configured templates, report ns/flow and exit\n"
+	 "                                    | (development only).\n");
+  printf("--flow-hash-test <file.pcap>        | Report bucket chain lengths and processing thread\n"
+	 "                                    | balance of each flow hash on the flows of\n"
+	 "                                    | <file.pcap> and exit (development only).\n");
+  printf("--replay-bench                      | Replay the -i pcap file from memory with bursts of\n"
+	 "                                    | 1/8/32/64 packets, report pkts/sec and exit\n"
+	 "                                    | (development only).\n");
+  printf("--call-bench <num calls>            | Time <num calls> (0 = 10M) decoder to plugin calls\n"
+	 "                                    | through the flow engine, report ns/pkt and exit\n"
+	 "                                    | (development only).\n");
+  printf("--collector-blast <file.pcap>       | Send the UDP payloads of <file.pcap> to 127.0.0.1:<-3 port>\n"
+	 "                                    | from %d source ports for %d sec, report\n"
+	 "                                    | datagrams/sec and exit (development only).\n",
+	 COLLECTOR_BLAST_SOCKETS, COLLECTOR_BLAST_DURATION);
+  printf("--collector-bench <file.pcap>       | Dissect the NetFlow/IPFIX UDP payloads of <file.pcap>\n"
+	 "                                    | from memory with interpreted and compiled templates,\n"
+	 "                                    | report records/sec and exit (development only).\n");
+  printf("--lpm-bench <num prefixes>          | Build IPv4 and IPv6 prefix tables of <num prefixes>\n"
+	 "                                    | (0 = %d) random networks, report lookups/sec\n"
+	 "                                    | and exit (development only).\n", LPM_BENCH_PREFIXES);
+  printf("--lru-bench <num threads>           | Time LRU cache adds and finds from 1 up to <num threads>\n"
+	 "                                    | threads, report ops/sec and exit (development only).\n");
   printf("--drop-flow-no-plugin               | Drop flows that have not processed by a plugin.\n");
   printf("--dont-nest-dump-dirs               | Dump files won't be saved on nested dirs.\n");
   printf("--performance                       | Enable performance tracing (debug only).\n");
@@ -1978,6 +2116,12 @@ void usage(u_int8_t long_help) {
 #endif
   printf("[--hash-size|-w] <hash size>        | Flows hash size [default=%d]\n",
 	 readOnlyGlobals.flowHashSize);
+  printf("--flow-table <chained|grouped>      | Flow table layout. chained uses -w collision\n"
+	 "                                    | lists, grouped uses open addressing on\n"
+	 "                                    | cache-line groups sized from -M [default=chained]\n");
+  printf("--flow-hash <auto|crc32c|murmur|    | Flow hash. auto uses the CPU crc32c instruction\n"
+	 "             additive>              | if available, murmur otherwise. additive is the\n"
+	 "                                    | legacy field sum [default=auto]\n");
   printf("[--no-ipv6|-W]                      | IPv6 packets will not be accounted.\n");
   printf("[--flow-delay|-e] <flow delay>      | Delay (in ms) between two flow\n"
 	 "                                    | exports [default=%d]\n",
@@ -2068,6 +2212,11 @@ void usage(u_int8_t long_help) {
   printf("[--count|-2] <number>               | Capture a specified number of packets\n"
 	 "                                    | and quit (debug only)\n");
   printf("[--collector-port|-3] <port>        | NetFlow/IPFIX/sFlow collector flows port\n");
+#ifdef HAVE_COLLECTOR_REUSEPORT
+  printf("--collector-reuseport               | One UDP socket (SO_REUSEPORT) per collector thread (-O),\n"
+	 "                                    | read with recvmmsg(). Each thread dissects flows into\n"
+	 "                                    | its own flow table partition. SCTP is not collected.\n");
+#endif
 #ifdef linux
   printf("[--cpu-affinity|-4] <CPU/Core Id>   | Binds this process to the specified CPU/Core\n"
 	 "                                    | Note: the first available CPU corresponds to 0.\n");
@@ -2075,6 +2224,17 @@ void usage(u_int8_t long_help) {
 #ifdef HAVE_PTHREAD_SET_AFFINITY
   printf("--export-thread-affinity <core>     | Bind the export thread to the specified core (default: no bind)\n");
 #endif
+  printf("--export-threads <num>              | Number of threads that encode and send flows (default: 1, max %d).\n"
+	 "                                    | Flows are spread over the threads by flow hash\n", MAX_NUM_EXPORT_THREADS);
+  printf("--export-batch <num>[:<msec>]       | Send up to <num> (max %d) datagrams per UDP collector\n"
+	 "                                    | with one system call. Queued datagrams are sent\n"
+	 "                                    | at most <msec> (default: %d) after the first one.\n"
+	 "                                    | Ignored with -e.\n",
+	 MAX_EXPORT_BATCH_LEN, DEFAULT_EXPORT_BATCH_TIMEOUT);
+  printf("--export-mtu <bytes>                | Max NetFlow/IPFIX datagram size (default: interface\n"
+	 "                                    | MTU, see also -0). Up to %d for UDP collectors,\n"
+	 "                                    | %d for TCP/SCTP collectors\n",
+	 MAX_UDP_EXPORT_MTU, MAX_EXPORT_MTU);
   printf("[--tunnel|-5]                       | Compute flows on tunneled traffic rather than\n"
 	 "                                    | on the external envelope\n");
   printf("[--no-promisc|-6]                   | Capture packets in non-promiscuous mode\n");
@@ -2175,6 +2335,9 @@ void usage(u_int8_t long_help) {
 	 "                                    | Example --redis localhost\n");
   printf("--redis-logging <host>[:<port>]     | Log messages/flows to the specified redis instance\n"
 	 "                                    | Example --redis-logging localhost\n");
+  printf("--redis-bench <num commands>        | Send <num commands> (0 = %d) to the --redis server,\n"
+	 "                                    | report pipelined commands/sec and average pipeline\n"
+	 "                                    | depth and exit (development only).\n", REDIS_BENCH_COMMANDS);
   printf("--use-redis-proxy                   | Use a redis proxy (e.g.\n"
 	 "                                    | https://github.com/twitter/twemproxy)\n");
   printf("--ucloud                            | Enable the nProbe micro-cloud\n");
@@ -2247,8 +2410,8 @@ static void dumpStats(char *path) {
     long unsigned int tot_pkts = 0, tot_bytes = 0;
 
     for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
-      tot_pkts  += (unsigned long)readWriteGlobals->accumulateStats[i].pkts;
-      tot_bytes += (unsigned long)readWriteGlobals->accumulateStats[i].bytes;
+      tot_pkts  += (unsigned long)readWriteGlobals->threadStats[i].stats.pkts;
+      tot_bytes += (unsigned long)readWriteGlobals->threadStats[i].stats.bytes;
     }
 
     fprintf(fd,
@@ -2275,22 +2438,62 @@ static void printFragmentStats() {
 
 /* ****************************************************** */
 
+/* PerfTicks holds 64 bit counters only: walk them as an array */
+#define PERF_TICKS_NUM_COUNTERS (sizeof(PerfTicks) / sizeof(u_int64_t))
+
+static void sumPerfTicks(PerfTicks *tot) {
+  u_int64_t *dst = (u_int64_t*)tot, *src;
+  u_int i, j;
+
+  memset(tot, 0, sizeof(PerfTicks));
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    src = (u_int64_t*)&readWriteGlobals->threadStats[i].perf;
+    for(j=0; j<PERF_TICKS_NUM_COUNTERS; j++) dst[j] += src[j];
+  }
+
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+    src = (u_int64_t*)&readWriteGlobals->exportWorkers[i].perf;
+    for(j=0; j<PERF_TICKS_NUM_COUNTERS; j++) dst[j] += src[j];
+  }
+}
+
+/* ****************************************************** */
+
+static void subPerfTicks(PerfTicks *out, PerfTicks *a, PerfTicks *b) {
+  u_int64_t *o = (u_int64_t*)out, *x = (u_int64_t*)a, *y = (u_int64_t*)b;
+  u_int j;
+
+  for(j=0; j<PERF_TICKS_NUM_COUNTERS; j++) o[j] = x[j] - y[j];
+}
+
+/* ****************************************************** */
+
 static void printProcessingStats(void) {
   u_int32_t tot_pkts = 0, tot_bytes = 0;
-  u_int num_collected_pkts = 0, i;
+  u_int num_collected_pkts = 0, num_collected_flows = 0, i;
 
   for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
-    tot_pkts  += (unsigned long)readWriteGlobals->accumulateStats[i].pkts;
-    tot_bytes += (unsigned long)readWriteGlobals->accumulateStats[i].bytes;
+    tot_pkts  += (unsigned long)readWriteGlobals->threadStats[i].stats.pkts;
+    tot_bytes += (unsigned long)readWriteGlobals->threadStats[i].stats.bytes;
   }
 
-  for(i=0; i<readOnlyGlobals.numProcessThreads; i++)
-    num_collected_pkts += readWriteGlobals->collectedPkts[i];
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    num_collected_pkts += readWriteGlobals->threadStats[i].collectedPkts;
+    num_collected_flows += readWriteGlobals->threadStats[i].collectedFlows;
+  }
 
   traceEvent(TRACE_NORMAL, "Processed packets: %u (max bucket search: %d)",
 	     (unsigned long)tot_pkts, readWriteGlobals->maxBucketSearch);
 
   printFragmentStats();
+  if(readOnlyGlobals.useLocks) dumpPacketQueueStats();
+#ifdef HAVE_AF_PACKET
+  dumpAfPacketStats();
+#endif
+  dumpFlowBucketPoolStats();
+  dumpFlowTableStats();
+  dumpFlowTimerStats();
 
   if(readWriteGlobals->maxBucketSearch > 10)
     traceEvent(TRACE_WARNING, "Your bucket search is too slow (%d): expect drops",
@@ -2304,7 +2507,7 @@ static void printProcessingStats(void) {
 
   if(readOnlyGlobals.flowCollection.collectorInPort > 0)
     traceEvent(TRACE_NORMAL, "Flow collection: [collected pkts: %u][processed flows: %u]",
-	       num_collected_pkts, readWriteGlobals->collectionStats.num_flows_processed);
+	       num_collected_pkts, num_collected_flows);
 
   traceEvent(TRACE_NORMAL, "Flow drop stats:   [%u bytes/%u pkts][%u flows]",
 	     (unsigned long)readWriteGlobals->probeStats.totFlowBytesDropped,
@@ -2322,13 +2525,16 @@ static void printProcessingStats(void) {
 
   if(readOnlyGlobals.tracePerformance && (tot_pkts > 0)) {
     static unsigned long last_pkts = 0;
+    static PerfTicks last;
+    PerfTicks current, p;
     ticks tot;
 
-    pthread_rwlock_wrlock(&readOnlyGlobals.ticksLock);
+    /* Deltas since the previous call: the per thread counters are never reset */
+    sumPerfTicks(&current);
+    subPerfTicks(&p, &current, &last);
+    last = current;
 
-    tot = readOnlyGlobals.decodeTicks
-      + readOnlyGlobals.processingWithFlowCreationTicks
-      + readOnlyGlobals.processingWoFlowCreationTicks;
+    tot = p.decodeTicks + p.processingWithFlowCreationTicks + p.processingWoFlowCreationTicks;
 
     if(tot > 0) {
       if(last_pkts == 0) last_pkts = tot_pkts;
@@ -2337,34 +2543,34 @@ static void printProcessingStats(void) {
       if(last_pkts > 0) {
 	traceEvent(TRACE_NORMAL, "---------------------------------");
 	traceEvent(TRACE_NORMAL, "Decode ticks:     %.2f ticks/pkt [%.2f %%]",
-		   (float)readOnlyGlobals.decodeTicks / (float)last_pkts,
-		   (float)(readOnlyGlobals.decodeTicks*100)/(float)tot);
+		   (float)p.decodeTicks / (float)last_pkts,
+		   (float)(p.decodeTicks*100)/(float)tot);
 
-	if(readOnlyGlobals.num_pkts_without_flow_creation == 0) readOnlyGlobals.num_pkts_without_flow_creation = 1;
+	if(p.num_pkts_without_flow_creation == 0) p.num_pkts_without_flow_creation = 1;
 	traceEvent(TRACE_NORMAL, "Pkt Processing w/o Flow Creation: %.2f ticks/pkt [%.2f %%]",
-		   (float)readOnlyGlobals.processingWoFlowCreationTicks / (float)readOnlyGlobals.num_pkts_without_flow_creation,
-		   (float)(readOnlyGlobals.processingWoFlowCreationTicks*100) / (float)tot);
+		   (float)p.processingWoFlowCreationTicks / (float)p.num_pkts_without_flow_creation,
+		   (float)(p.processingWoFlowCreationTicks*100) / (float)tot);
 
-	if(readOnlyGlobals.num_pkts_with_flow_creation == 0) readOnlyGlobals.num_pkts_with_flow_creation = 1;
+	if(p.num_pkts_with_flow_creation == 0) p.num_pkts_with_flow_creation = 1;
 	traceEvent(TRACE_NORMAL, "Pkt Processing with Flow Creation: %.2f ticks/pkt [%.2f %%]",
-		   (float)readOnlyGlobals.processingWithFlowCreationTicks / (float)readOnlyGlobals.num_pkts_with_flow_creation,
-		   (float)(readOnlyGlobals.processingWithFlowCreationTicks*100) / (float)tot);
+		   (float)p.processingWithFlowCreationTicks / (float)p.num_pkts_with_flow_creation,
+		   (float)(p.processingWithFlowCreationTicks*100) / (float)tot);
 
-	if(readOnlyGlobals.num_allocated_buckets == 0) readOnlyGlobals.num_allocated_buckets = 1;
+	if(p.num_allocated_buckets == 0) p.num_allocated_buckets = 1;
 	traceEvent(TRACE_NORMAL, "Bucket Allocation: %.2f ticks/bkt",
-		   (float)readOnlyGlobals.bucketAllocationTicks / (float)readOnlyGlobals.num_allocated_buckets);
+		   (float)p.bucketAllocationTicks / (float)p.num_allocated_buckets);
 
-	if(readOnlyGlobals.num_malloced_buckets == 0) readOnlyGlobals.num_malloced_buckets = 1;
+	if(p.num_malloced_buckets == 0) p.num_malloced_buckets = 1;
 	traceEvent(TRACE_NORMAL, "Bucket Malloc: %.2f ticks/bkt",
-		   (float)readOnlyGlobals.bucketMallocTicks / (float)readOnlyGlobals.num_malloced_buckets);
+		   (float)p.bucketMallocTicks / (float)p.num_malloced_buckets);
 
-	if(readOnlyGlobals.num_exported_buckets == 0) readOnlyGlobals.num_exported_buckets = 1;
+	if(p.num_exported_buckets == 0) p.num_exported_buckets = 1;
 	traceEvent(TRACE_NORMAL, "Bucket Export: %.2f ticks/bkt",
-		   (float)readOnlyGlobals.bucketExportTicks / (float)readOnlyGlobals.num_exported_buckets);
+		   (float)p.bucketExportTicks / (float)p.num_exported_buckets);
 
-	if(readOnlyGlobals.num_purged_buckets == 0) readOnlyGlobals.num_purged_buckets = 1;
+	if(p.num_purged_buckets == 0) p.num_purged_buckets = 1;
 	traceEvent(TRACE_NORMAL, "Bucket Purge: %.2f ticks/bkt",
-		   (float)readOnlyGlobals.bucketPurgeTicks / (float)readOnlyGlobals.num_purged_buckets);
+		   (float)p.bucketPurgeTicks / (float)p.num_purged_buckets);
 
 	traceEvent(TRACE_NORMAL, "Total ticks:      %.2f ticks/pkt",
 		   (float)tot / (float)last_pkts);
@@ -2373,17 +2579,7 @@ static void printProcessingStats(void) {
 
     }
 
-    last_pkts = tot_pkts, readOnlyGlobals.decodeTicks = readOnlyGlobals.processingWithFlowCreationTicks
-      = readOnlyGlobals.processingWoFlowCreationTicks =
-      readOnlyGlobals.bucketAllocationTicks =
-      readOnlyGlobals.bucketMallocTicks =
-      readOnlyGlobals.bucketPurgeTicks  = readOnlyGlobals.bucketExportTicks = 0;
-    readOnlyGlobals.num_exported_buckets = readOnlyGlobals.num_purged_buckets =
-      readOnlyGlobals.num_allocated_buckets =
-      readOnlyGlobals.num_malloced_buckets =
-      readOnlyGlobals.num_pkts_without_flow_creation = readOnlyGlobals.num_pkts_with_flow_creation = 0;
-
-    pthread_rwlock_unlock(&readOnlyGlobals.ticksLock);
+    last_pkts = tot_pkts;
   }
 }
 
@@ -2394,6 +2590,7 @@ static void printStats() {
   char pktBuf[32], buf[1024] = { 0 };
   u_int i;
   Counter tot_pkts = 0, tot_bytes = 0, current_pkts = 0, current_bytes = 0;
+  static Counter last_pkts = 0, last_bytes = 0;
 
   readWriteGlobals->now = now;
   nowDiff = now-readOnlyGlobals.initialSniffTime.tv_sec;
@@ -2404,20 +2601,22 @@ static void printStats() {
   }
 
   for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
-    tot_pkts      += readWriteGlobals->accumulateStats[i].pkts;
-    tot_bytes     += readWriteGlobals->accumulateStats[i].bytes;
-    current_pkts  += readWriteGlobals->currentPkts[i];
-    current_bytes += readWriteGlobals->currentBytes[i];
+    ProbeStats stats = readWriteGlobals->threadStats[i].stats; /* Snapshot */
 
-    readWriteGlobals->currentPkts[i] = 0, readWriteGlobals->currentBytes[i] = 0;
+    tot_pkts  += stats.pkts;
+    tot_bytes += stats.bytes;
 
     if(unlikely(readOnlyGlobals.useLocks))
       traceEvent(TRACE_NORMAL, "Average traffic: [queue %u][%s pps][%s/sec]",
 		 i,
-		 formatPackets((float)readWriteGlobals->accumulateStats[i].pkts/nowDiff, pktBuf),
-		 formatTraffic((float)(8*readWriteGlobals->accumulateStats[i].bytes)/(float)nowDiff, 1, buf));
+		 formatPackets((float)stats.pkts/nowDiff, pktBuf),
+		 formatTraffic((float)(8*stats.bytes)/(float)nowDiff, 1, buf));
   }
 
+  /* Traffic since the previous call */
+  current_pkts = tot_pkts - last_pkts, current_bytes = tot_bytes - last_bytes;
+  last_pkts = tot_pkts, last_bytes = tot_bytes;
+
   if(readOnlyGlobals.traceMode && (nowDiff > 0)) {
     if(readOnlyGlobals.numProcessThreads == 1) traceEvent(TRACE_NORMAL, "---------------------------------");
     traceEvent(TRACE_NORMAL, "Average traffic: [%s pps][%s/sec]",
@@ -2440,30 +2639,51 @@ static void printStats() {
 	       readWriteGlobals->probeStats.totFlowDropped,
 	       readWriteGlobals->probeStats.droppedPktsTooManyFlows);
     readWriteGlobals->totFlowsRate = 0;
-    traceEvent(TRACE_NORMAL, "Export Queue: %u/%d [%.1f %%]",
-	       readWriteGlobals->exportBucketsLen,
-	       readOnlyGlobals.maxExportQueueLen,
-	       ((float)(readWriteGlobals->exportBucketsLen * 100))/(float)readOnlyGlobals.maxExportQueueLen);
+    {
+      u_int32_t queueLen = getExportQueueLen(), num_full = 0, num_dequeued = 0, num_batches = 0, num_sleeps = 0;
+
+      for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+	MpscRing *ring = &readWriteGlobals->exportWorkers[i].ring;
+
+	num_full += ring->num_full, num_dequeued += ring->num_dequeued;
+	num_batches += ring->num_batches, num_sleeps += ring->num_sleeps;
+      }
 
-    traceEvent(TRACE_NORMAL, "Flow Buckets: [active=%u][allocated=%u][toBeExported=%u]",
-	       getAtomic(&readWriteGlobals->bucketsAllocated)-readWriteGlobals->exportBucketsLen,
-	       getAtomic(&readWriteGlobals->bucketsAllocated), readWriteGlobals->exportBucketsLen);
+      traceEvent(TRACE_NORMAL, "Export Queue: %u/%d [%.1f %%][ring full=%u][dequeued=%u in %u batches][consumer sleeps=%u]",
+		 queueLen, readOnlyGlobals.maxExportQueueLen,
+		 ((float)(queueLen * 100))/(float)readOnlyGlobals.maxExportQueueLen,
+		 num_full, num_dequeued, num_batches, num_sleeps);
+
+      dumpExportWorkerStats(nowDiff);
+      dumpExportBatchStats();
+
+      u_int32_t num_buckets = getNumActiveBuckets();
+
+      traceEvent(TRACE_NORMAL, "Flow Buckets: [active=%u][allocated=%u][toBeExported=%u]",
+		 num_buckets-queueLen, num_buckets, queueLen);
+    }
 
     dumpCacheStats(nowDiff);
     dumpPluginStats(nowDiff);
 
     buf[0] = '\0';
     for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
-      if(readWriteGlobals->collectedPkts[i] > 0) {
+      if(readWriteGlobals->threadStats[i].collectedPkts > 0) {
 	u_int len = strlen(buf);
 
 	snprintf(&buf[len], sizeof(buf)-len, "[%lu pkts@%d] ",
-		 readWriteGlobals->collectedPkts[i], i);
+		 readWriteGlobals->threadStats[i].collectedPkts, i);
       }
     }
 
     if(buf[0] != '\0')
       traceEvent(TRACE_NORMAL, "Collector Threads: %s", buf);
+
+    if(readOnlyGlobals.collectorReusePort)
+      dumpCollectorSocketStats();
+
+    if(readOnlyGlobals.flowCollection.collectorInPort > 0)
+      dumpTemplateCacheStats();
   }
 
   if(readOnlyGlobals.traceMode) {
@@ -2795,6 +3015,8 @@ int initNetFlow(char* addr, int port) {
 void printHash(int idx) {
   u_int i;
 
+  if(readWriteGlobals->theFlowHash[idx] == NULL) return; /* --flow-table grouped */
+
   for(i = 0; i<readOnlyGlobals.flowHashSize; i++) {
     if(readWriteGlobals->theFlowHash[idx][i] != NULL)
       printf("readWriteGlobals->theFlowHash[%4d]\n", i);
@@ -2890,7 +3112,12 @@ static void readPcapFileList(const char * filename) {
 /* ****************************************************** */
 
 static void setupMTU(void) {
-  readOnlyGlobals.maxNetFlowPacketPayloadLen = readOnlyGlobals.minMTU - 42 /* Ethernet+IP+UDP header */;
+  if(readOnlyGlobals.exportMTU > 0)
+    readOnlyGlobals.maxNetFlowPacketPayloadLen = readOnlyGlobals.exportMTU;
+  else
+    readOnlyGlobals.maxNetFlowPacketPayloadLen = readOnlyGlobals.minMTU - 42 /* Ethernet+IP+UDP header */;
+
+  readOnlyGlobals.exportBufferLen = max(JUMBO_MTU, readOnlyGlobals.maxNetFlowPacketPayloadLen);
   readOnlyGlobals.num_v5flows_per_packet = min(DEFAULT_V5FLOWS_PER_PACKET, (readOnlyGlobals.maxNetFlowPacketPayloadLen - sizeof(struct flow_ver5_hdr)) / sizeof(struct flow_ver5_rec));
 
   readOnlyGlobals.templateBuffers[V4_TEMPLATE_INDEX].templateBufMax =
@@ -2949,6 +3176,7 @@ static void initDefaults(void) {
 #endif
   readOnlyGlobals.numCollectors = 0;
   readOnlyGlobals.flowHashSize = DEFAULT_HASH_SIZE;
+  readOnlyGlobals.flowTableMode = FLOW_TABLE_CHAINED;
   readOnlyGlobals.hostHashSize = readOnlyGlobals.flowHashSize/2;
   readOnlyGlobals.maxNumActiveFlows = DEFAULT_HASH_SIZE * 4; /* Avoid overflow */
   readOnlyGlobals.initialSniffTime.tv_sec = 0; /* Set it with the first incoming packet */
@@ -2967,6 +3195,7 @@ static void initDefaults(void) {
   readOnlyGlobals.minNumFlowsPerPacket = -1;
   readOnlyGlobals.pktSampleRate = 1;
   readOnlyGlobals.fakePktSampling = 0;
+  readOnlyGlobals.packetBatchSize = DEFAULT_PACKET_BATCH;
   readOnlyGlobals.flowSampleRate = 1;
   readOnlyGlobals.numInterfaceNetworks = 0;
   readOnlyGlobals.numBlacklistNetworks = 0;
@@ -2982,8 +3211,8 @@ static void initDefaults(void) {
   readOnlyGlobals.tcpsender.tcp_socket = -1;
   readOnlyGlobals.tcpsender.tcp_connect = 0;
   readOnlyGlobals.local_timezone = get_gmt_offset();
-  readWriteGlobals->numFlows = 0;
-  readWriteGlobals->lastExportTime.tv_sec = 0, readWriteGlobals->lastExportTime.tv_usec = 0;
+  readOnlyGlobals.numExportThreads = 1;
+  readOnlyGlobals.exportBatchLen = 0, readOnlyGlobals.exportBatchTimeout = DEFAULT_EXPORT_BATCH_TIMEOUT;
   readWriteGlobals->num_src_mac_export = 0;
 #ifdef HAVE_PF_RING
   readOnlyGlobals.cluster_id = -1;
@@ -4010,6 +4239,46 @@ static int parseOptions(int argc, char* argv[], u_int8_t reparse_options) {
       readOnlyGlobals.exportThreadAffinity = atoi(optarg);
       break;
 
+    case 256:
+      i = atoi(optarg);
+      if(i < 1)
+	i = 1;
+      else if(i > MAX_NUM_EXPORT_THREADS) {
+	traceEvent(TRACE_WARNING, "Too many export threads: using %d", MAX_NUM_EXPORT_THREADS);
+	i = MAX_NUM_EXPORT_THREADS;
+      }
+      readOnlyGlobals.numExportThreads = i;
+      break;
+
+    case 257:
+      {
+	u_int batch_len, batch_timeout = DEFAULT_EXPORT_BATCH_TIMEOUT;
+
+	if(sscanf(optarg, "%u:%u", &batch_len, &batch_timeout) < 1)
+	  batch_len = 0;
+
+	if(batch_len > MAX_EXPORT_BATCH_LEN) {
+	  traceEvent(TRACE_WARNING, "Export batch too long: using %d datagrams", MAX_EXPORT_BATCH_LEN);
+	  batch_len = MAX_EXPORT_BATCH_LEN;
+	}
+
+	readOnlyGlobals.exportBatchLen = batch_len, readOnlyGlobals.exportBatchTimeout = min(batch_timeout, 60000);
+      }
+      break;
+
+    case 258:
+      /* Checked against the collectors transport once all options are parsed */
+      readOnlyGlobals.exportMTU = max(min((u_int32_t)atoi(optarg), MAX_EXPORT_MTU), 512 /* min size */);
+      setupMTU();
+      break;
+
+#ifdef HAVE_AF_PACKET
+    case 260:
+      /* Checked against -O once all options are parsed */
+      readOnlyGlobals.afPacketThreads = min(max(atoi(optarg), 0), MAX_NUM_PCAP_THREADS);
+      break;
+#endif
+
     case 231:
       readOnlyGlobals.dumpBadPacketsPcap = pcap_dump_open(pcap_open_dead(DLT_EN10MB, 16384 /* MTU */), optarg);
       if(readOnlyGlobals.dumpBadPacketsPcap == NULL) {
@@ -4115,7 +4384,83 @@ static int parseOptions(int argc, char* argv[], u_int8_t reparse_options) {
       readOnlyGlobals.fakePacketCapture = 1;
       break;
 
-      /* NOTE 247 is free */
+    case 229:
+      readOnlyGlobals.fakePacketCapture = 1;
+      if((readOnlyGlobals.fakeCaptureBenchFlows = atoi(optarg)) == 0)
+	readOnlyGlobals.fakeCaptureBenchFlows = 1;
+      else if(readOnlyGlobals.fakeCaptureBenchFlows > 0xFFFFFF)
+	readOnlyGlobals.fakeCaptureBenchFlows = 0xFFFFFF; /* 3 address bytes */
+      break;
+
+    case 259:
+      if((readOnlyGlobals.encodeBenchFlows = atoi(optarg)) == 0)
+	readOnlyGlobals.encodeBenchFlows = 10000000;
+      break;
+
+    case 261:
+      if(!strcmp(optarg, "auto"))
+	readOnlyGlobals.flowHashAlgorithm = FLOW_HASH_AUTO;
+      else if(!strcmp(optarg, "crc32c"))
+	readOnlyGlobals.flowHashAlgorithm = FLOW_HASH_CRC32C;
+      else if(!strcmp(optarg, "murmur"))
+	readOnlyGlobals.flowHashAlgorithm = FLOW_HASH_MURMUR;
+      else if(!strcmp(optarg, "additive"))
+	readOnlyGlobals.flowHashAlgorithm = FLOW_HASH_ADDITIVE;
+      else
+	traceEvent(TRACE_WARNING, "Unknown --flow-hash '%s': using auto", optarg);
+      break;
+
+    case 262:
+      readOnlyGlobals.flowHashTestPcap = strdup(optarg);
+      break;
+
+    case 263:
+      readOnlyGlobals.packetBatchSize = max(1, min(atoi(optarg), PACKET_BATCH_MAX));
+      break;
+
+    case 264:
+      readOnlyGlobals.replayBench = 1;
+      break;
+
+    case 265:
+      if((readOnlyGlobals.callBenchCalls = atoi(optarg)) == 0)
+	readOnlyGlobals.callBenchCalls = 10000000;
+      break;
+
+    case 266:
+#ifdef HAVE_COLLECTOR_REUSEPORT
+      readOnlyGlobals.collectorReusePort = 1;
+#else
+      traceEvent(TRACE_WARNING, "--collector-reuseport is not supported on this platform: ignored");
+#endif
+      break;
+
+    case 267:
+      readOnlyGlobals.collectorBlastPcap = strdup(optarg);
+      break;
+
+    case 268:
+      readOnlyGlobals.collectorBenchPcap = strdup(optarg);
+      break;
+
+    case 269:
+      if((readOnlyGlobals.lpmBenchPrefixes = atoi(optarg)) == 0)
+	readOnlyGlobals.lpmBenchPrefixes = LPM_BENCH_PREFIXES;
+      break;
+
+    case 270:
+      if((readOnlyGlobals.lruBenchThreads = atoi(optarg)) == 0)
+	readOnlyGlobals.lruBenchThreads = 1;
+      break;
+
+    case 247:
+      if(!strcmp(optarg, "grouped"))
+	readOnlyGlobals.flowTableMode = FLOW_TABLE_GROUPED;
+      else if(!strcmp(optarg, "chained"))
+	readOnlyGlobals.flowTableMode = FLOW_TABLE_CHAINED;
+      else
+	traceEvent(TRACE_WARNING, "Unknown --flow-table '%s': using chained", optarg);
+      break;
 
     case 248:
       readOnlyGlobals.tracePerformance = 1;
@@ -4136,6 +4481,11 @@ static int parseOptions(int argc, char* argv[], u_int8_t reparse_options) {
 	  readOnlyGlobals.redis.logging_redis_port = 6379;
       }
       break;
+
+    case 271:
+      if((readOnlyGlobals.redisBenchCommands = atoi(optarg)) == 0)
+	readOnlyGlobals.redisBenchCommands = REDIS_BENCH_COMMANDS;
+      break;
   #endif
 
     case 250: /* --nfLitePlugin <low port>:<num ports> */
@@ -4229,6 +4579,30 @@ static int parseOptions(int argc, char* argv[], u_int8_t reparse_options) {
 
   if(readOnlyGlobals.useNetFlow == 0xFF) readOnlyGlobals.useNetFlow = 1;
 
+  if(readOnlyGlobals.exportMTU > 0) {
+    u_int32_t maxMTU = MAX_EXPORT_MTU;
+
+    for(i=0; i<readOnlyGlobals.numCollectors; i++) {
+      switch(readOnlyGlobals.netFlowDest[i].transport) {
+      case TRANSPORT_UDP:
+	maxMTU = min(maxMTU, MAX_UDP_EXPORT_MTU);
+	break;
+#ifdef IP_HDRINCL
+      case TRANSPORT_UDP_RAW:
+	maxMTU = min(maxMTU, 1500 - 28 /* IP+UDP */ - 1);
+	break;
+#endif
+      }
+    }
+
+    if(readOnlyGlobals.exportMTU > maxMTU) {
+      traceEvent(TRACE_WARNING, "--export-mtu %u is too large for the collectors transport: using %u",
+		 readOnlyGlobals.exportMTU, maxMTU);
+      readOnlyGlobals.exportMTU = maxMTU;
+      setupMTU();
+    }
+  }
+
   if(readOnlyGlobals.netFlowVersion == 5) {
     if(readOnlyGlobals.minNumFlowsPerPacket == (u_short)-1)
       readOnlyGlobals.minNumFlowsPerPacket = readOnlyGlobals.num_v5flows_per_packet; /* Default */
@@ -4423,17 +4797,17 @@ static void stopCaptureFlushAll(void) {
     walkHash(hash_idx, 1);
   }
 
-  if(readWriteGlobals->exportBucketsLen > 0) {
+  if(getExportQueueLen() > 0) {
     traceEvent(TRACE_INFO, "Waiting to export queued buckets... [queue len=%d]",
-	       readWriteGlobals->exportBucketsLen);
+	       getExportQueueLen());
 
-    while(readWriteGlobals->exportBucketsLen > 0) {
-      signalCondvar(&readWriteGlobals->exportQueueCondvar, 0);
+    while(getExportQueueLen() > 0) {
+      wakeupExportWorkers();
       ntop_sleep(1);
 
-      if(readWriteGlobals->exportBucketsLen > 0)
+      if(getExportQueueLen() > 0)
 	traceEvent(TRACE_NORMAL, "Still %d queued buckets to be exported...",
-		   readWriteGlobals->exportBucketsLen);
+		   getExportQueueLen());
     }
   }
 
@@ -4487,7 +4861,6 @@ void term_pcap(pcap_t **p) {
 
 void shutdown_nprobe(void) {
   static u_char once = 0;
-  FlowHashBucket *list;
   u_int i;
 
   if(once) return; else once = 1;
@@ -4495,16 +4868,23 @@ void shutdown_nprobe(void) {
   stopCaptureFlushAll();
 
   // ntop_sleep(1);
-  signalCondvar(&readWriteGlobals->exportQueueCondvar, 0);
+  wakeupExportWorkers();
+  wakeupPacketQueues();
 
-  if(readOnlyGlobals.dequeueBucketToExport_up)
-    waitCondvar(&readWriteGlobals->termCondvar); /* Wait until dequeueBucketToExport() ends */
+  for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+    if(readWriteGlobals->exportWorkers[i].running) {
+      waitCondvar(&readWriteGlobals->termCondvar); /* Wait until a dequeueBucketToExport() ends */
+      readWriteGlobals->exportWorkers[i].running = 0;
+    }
+  }
 
   traceEvent(TRACE_INFO, "Flushing queued flows...\n");
   checkNetFlowExport(1 /* force export */);
 
   traceEvent(TRACE_INFO, "Freeing memory...\n");
 
+  termExportBatches();
+
   for(i = 0; i<readOnlyGlobals.numCollectors; i++)
     close(readOnlyGlobals.netFlowDest[i].sockFd);
 
@@ -4521,32 +4901,24 @@ void shutdown_nprobe(void) {
     readOnlyGlobals.pcapPtr = NULL;
   }
 
-  for(i=0; i<readOnlyGlobals.numProcessThreads; i++)
-    free(readWriteGlobals->theFlowHash[i]);
+#ifdef HAVE_AF_PACKET
+  if(readOnlyGlobals.afPacketThreads > 0) {
+    printAfPacketStats(0);
+    closeAfPacketSockets();
+  }
+#endif
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    if(readWriteGlobals->theFlowHash[i]) free(readWriteGlobals->theFlowHash[i]);
+    freeFlowTable(&readWriteGlobals->flowTable[i]);
+  }
 
   freeHostHash();
   termL7Discovery();
 
   if(readOnlyGlobals.captureDev != NULL) free(readOnlyGlobals.captureDev);
 
-  for(i=0; i<readOnlyGlobals.numActiveTemplates; i++) {
-    if(readOnlyGlobals.templateBuffers[i].buffer)
-      free(readOnlyGlobals.templateBuffers[i].buffer);
-  }
-
-  list = readWriteGlobals->exportQueue;
-
-  while(list != NULL) {
-    FlowHashBucket *nextEntry = list->core.hash.next;
-
-    if(list->ext->extensions != NULL) {
-      if(list->ext->extensions->mplsInfo != NULL) free(list->ext->extensions->mplsInfo);
-      free(list->ext);
-    }
-
-    free(list);
-    list = nextEntry;
-  }
+  termExportWorkers();
 
   for(i=0; i<NUM_FRAGMENT_LISTS; i++) {
     IpV4Fragment *list = readWriteGlobals->fragmentsList[i];
@@ -4566,6 +4938,12 @@ void shutdown_nprobe(void) {
   termPlugins();
 
   freeCollectionFilters();
+  termTemplateCache();
+
+  freeLpmTable(readOnlyGlobals.interfaceNetworks);
+  freeLpmTable(readOnlyGlobals.blacklistNetworks);
+  freeLpmTable(readOnlyGlobals.localNetworks);
+  reclaimLpmTables(1);
 
   if(readOnlyGlobals.argv) {
     for(i=0; i<readOnlyGlobals.argc; i++)
@@ -4592,11 +4970,9 @@ void shutdown_nprobe(void) {
 #if 0
   traceEvent(TRACE_INFO, "Cleaning threads");
   pthread_exit(&readWriteGlobals->walkHashThread);
-  pthread_exit(&readWriteGlobals->dequeueThread);
 #endif
 
-  traceEvent(TRACE_INFO, "Still allocated %u hash buckets",
-	     getAtomic(&readWriteGlobals->bucketsAllocated));
+  traceEvent(TRACE_INFO, "Still allocated %u hash buckets", getNumActiveBuckets());
 
   printProcessingStats();
 
@@ -4622,6 +4998,8 @@ void shutdown_nprobe(void) {
   if(readOnlyGlobals.tracePerformance)
     printProcessingStats();
 
+  termFlowBucketPools();
+
 #ifndef WIN32
   if(readOnlyGlobals.pidPath) {
     int fd;
@@ -4636,6 +5014,7 @@ void shutdown_nprobe(void) {
   if(readOnlyGlobals.dumpBadPacketsPcap)
     pcap_dump_close(readOnlyGlobals.dumpBadPacketsPcap);
 
+  termCoarseClock();
   free(readWriteGlobals); /* Do not move it up as it's needed for logging */
 
 #ifndef WIN32
@@ -4785,6 +5164,11 @@ static int openDevice(char ebuf[], int printErrors, char *pcapFilePath) {
     return(0);
   }
 
+#ifdef HAVE_AF_PACKET
+  if((readOnlyGlobals.afPacketThreads > 0) && (pcapFilePath == NULL))
+    return(openAfPacketSockets(readOnlyGlobals.captureDev, ebuf));
+#endif
+
   if(attachToNetFilter() < 0) {
     if(readOnlyGlobals.captureDev != NULL) {
       /* Try if the passed device is instead a dump file */
@@ -4990,14 +5374,14 @@ static int next_pcap_packet(pcap_t *p, struct pcap_pkthdr *h, const u_char *pkt_
   if(unlikely(readOnlyGlobals.pcapFile != NULL)) {
     u_int32_t warning_threshold = readOnlyGlobals.maxExportQueueLen/2;
 
-    while(readWriteGlobals->exportBucketsLen > warning_threshold) {
+    while(getExportQueueLen() > warning_threshold) {
       traceEvent(TRACE_INFO, "Sleeping to avoid flow drops during export...");
       ntop_sleep(1);
     }
   }
 
   if(unlikely(readOnlyGlobals.enable_debug)) {
-    if(readWriteGlobals->currentPkts[0] > 0) {
+    if(readWriteGlobals->threadStats[0].stats.pkts > 0) {
       static struct timeval last;
 
       if(last.tv_sec != 0) {
@@ -5034,9 +5418,8 @@ static int next_pcap_packet(pcap_t *p, struct pcap_pkthdr *h, const u_char *pkt_
 
 static void* processPackets(void* _thid) {
   unsigned long thread_id = (unsigned long)_thid;
-  ItemsQueue *queue = &readWriteGlobals->packetQueues[thread_id];
-  QueuedPacket *slot;
-  u_int num_loops = 0;
+  QueuedPacket *pkts[PACKET_BATCH_MAX];
+  u_int32_t num_pkts, i;
 
   if(readOnlyGlobals.numProcessThreads == 1) {
     /* Sanity check */
@@ -5046,33 +5429,19 @@ static void* processPackets(void* _thid) {
 
   // setThreadAffinity(thread_id);
 
-  while(!readWriteGlobals->shutdownInProgress) {
-    if(queue->num_insert != queue->num_remove) {
-      slot = &((QueuedPacket*)queue->queueSlots)[queue->remove_idx];
-
-      if(slot->packet_ready) {
-	deepPacketDecode(thread_id,
-			 slot->packet_if_idx,
-			 &slot->h, slot->p,
-			 slot->rx_direction /* Packet direction */,
-			 0 /* sampledPacket */,
-			 1 /* numPkts */,
-			 NO_INTERFACE_INDEX, NO_INTERFACE_INDEX,
-			 0 /* flow_sender_ip */,
-			 slot->packet_hash);
-
-	slot->packet_ready = 0, queue->remove_idx = (queue->remove_idx + 1) % DEFAULT_QUEUE_CAPACITY, queue->num_remove++;
-	num_loops = 0;
-	continue;
-      }
-    }
+  setPacketProcessingThread();
 
-    // waitCondvar(&queue->dequeue_condvar);
-    usleep(1000);
-    if(++num_loops == 1000) {
+  while(!readWriteGlobals->shutdownInProgress) {
+    if((num_pkts = dequeuePackets(thread_id, pkts, readOnlyGlobals.packetBatchSize)) == 0) {
+      /* Nothing came in while sleeping */
       idleThreadTask(thread_id, 9); /* Run some idle task */
-      num_loops = 0;
+      continue;
     }
+
+    decodePacketBatch(thread_id, pkts, num_pkts);
+
+    for(i=0; i<num_pkts; i++)
+      releaseQueuedPacket(pkts[i]);
   }
 
   return(NULL);
@@ -5080,9 +5449,45 @@ static void* processPackets(void* _thid) {
 
 /* ****************************************************** */
 
+#ifdef linux
+/* Hardware cache miss counter of the calling thread: -1 if not available */
+static int openCacheMissCounter(void) {
+  struct perf_event_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE, attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.exclude_kernel = 1, attr.exclude_hv = 1;
+
+  fd = syscall(__NR_perf_event_open, &attr, 0 /* this thread */, -1 /* any cpu */, -1, 0);
+
+  if(fd < 0)
+    traceEvent(TRACE_WARNING, "Unable to read cache misses (%s): reporting pkts/sec only",
+	       strerror(errno));
+
+  return(fd);
+}
+
+static u_int64_t readCacheMissCounter(int fd) {
+  u_int64_t value;
+
+  if((fd < 0) || (read(fd, &value, sizeof(value)) != sizeof(value)))
+    return(0);
+
+  return(value);
+}
+#endif
+
+/* ****************************************************** */
+
 static void fakeCapture(unsigned long thread_id) {
   struct pcap_pkthdr h;
   u_int8_t a = 0, b = 0;
+  u_int32_t bench_flows = readOnlyGlobals.fakeCaptureBenchFlows, flow_id = 0;
+  u_int64_t num_pkts = 0, last_pkts = 0, last_misses = 0;
+  struct timeval last_report, now;
+  int miss_fd = -1;
   u_char pkt[] = {
     0x0, 0x1, 0x2, 0x3, 0x4, 0x5,
     0x6, 0x7, 0x8, 0x9, 0x0a, 0x0b,
@@ -5100,10 +5505,25 @@ static void fakeCapture(unsigned long thread_id) {
   h.len = h.caplen = sizeof(pkt);
   readOnlyGlobals.datalink = DLT_EN10MB;
 
+  if(bench_flows > 0) {
+#ifdef linux
+    miss_fd = openCacheMissCounter();
+#endif
+    gettimeofday(&last_report, NULL);
+    traceEvent(TRACE_NORMAL, "Fake capture benchmark [thread %lu]: cycling over %u flows",
+	       thread_id, bench_flows);
+  }
+
   while(!readWriteGlobals->shutdownInProgress) {
     h.ts.tv_sec = time(NULL);
 
-    pkt[29] = a++, pkt[30] = b;
+    if(bench_flows > 0) {
+      /* The flows are visited round robin so that they all stay active */
+      pkt[27] = (flow_id >> 16) & 0xFF, pkt[28] = (flow_id >> 8) & 0xFF, pkt[29] = flow_id & 0xFF;
+      if(++flow_id == bench_flows) flow_id = 0;
+    } else
+      pkt[29] = a++, pkt[30] = b;
+
     decodePacket(thread_id,
 		 -1 /* input interface id */,
 		 &h, pkt,
@@ -5112,10 +5532,184 @@ static void fakeCapture(unsigned long thread_id) {
 		 NO_INTERFACE_INDEX, NO_INTERFACE_INDEX,
 		 0 /* Unknown sender */, 0 /* packet hash */);
 
-    /* Rotating source IP */
-    if(a == 0)
-      b++;
+    if(bench_flows > 0) {
+      if((++num_pkts & 0xFFFF) == 0) {
+	float elapsed;
+
+	gettimeofday(&now, NULL);
+	elapsed = (float)msTimeDiff(&now, &last_report) / 1000;
+
+	if(elapsed >= 5) {
+	  u_int64_t misses = 0;
+
+#ifdef linux
+	  misses = readCacheMissCounter(miss_fd);
+#endif
+
+	  if(miss_fd >= 0)
+	    traceEvent(TRACE_NORMAL, "Fake capture benchmark [thread %lu]: [%.2f Kpps][%.2f cache misses/pkt]",
+		       thread_id, (float)(num_pkts - last_pkts) / (elapsed * 1000),
+		       (float)(misses - last_misses) / (float)(num_pkts - last_pkts));
+	  else
+	    traceEvent(TRACE_NORMAL, "Fake capture benchmark [thread %lu]: [%.2f Kpps]",
+		       thread_id, (float)(num_pkts - last_pkts) / (elapsed * 1000));
+
+	  last_pkts = num_pkts, last_misses = misses;
+	  memcpy(&last_report, &now, sizeof(now));
+	}
+      }
+    } else {
+      /* Rotating source IP */
+      if(a == 0)
+	b++;
+    }
+  }
+
+  if(miss_fd >= 0) close(miss_fd);
+}
+
+/* ****************************************************** */
+
+static void replayLap(QueuedPacket **pkts, u_int32_t num_pkts, u_int32_t burst) {
+  u_int32_t i;
+
+  for(i=0; i<num_pkts; i+=burst) {
+    readWriteGlobals->now = pkts[i]->h.ts.tv_sec;
+    decodePacketBatch(0, &pkts[i], min(burst, num_pkts - i));
+  }
+}
+
+/* ****************************************************** */
+
+/*
+  --replay-bench: loads the -i pcap file in memory and replays it on
+  thread 0 with bursts of 1, 8, 32 and 64 packets, reporting pkts/sec
+  (and cache misses/pkt when available) for each burst size. The first
+  lap creates the flows, so the bursts measure the update of existing
+  flows: use a pcap with many flows so that they do not fit the cache.
+*/
+static void replayBenchmark(void) {
+  u_int32_t bursts[] = { 1, 8, 32, 64 }, num_pkts = 0, max_pkts = 0, b, i;
+  u_int64_t data_len = 0, data_size = 0, *offsets = NULL;
+  QueuedPacket *descs = NULL, **pkts;
+  u_char *data = NULL;
+  struct pcap_pkthdr *h;
+  const u_char *p;
+  time_t lap_shift;
+  int miss_fd = -1;
+
+  if(readOnlyGlobals.pcapFile == NULL) {
+    traceEvent(TRACE_ERROR, "--replay-bench needs a pcap file (-i <file.pcap>)");
+    return;
+  }
+
+  while(pcap_next_ex(readOnlyGlobals.pcapPtr, &h, &p) > 0) {
+    u_int32_t caplen = min(h->caplen, readOnlyGlobals.snaplen);
+    QueuedPacket *pkt;
+
+    if(num_pkts == max_pkts) {
+      u_int32_t new_max = max_pkts ? (2 * max_pkts) : 65536;
+      QueuedPacket *new_descs = (QueuedPacket*)realloc(descs, new_max * sizeof(QueuedPacket));
+      u_int64_t *new_offsets;
+
+      if(new_descs != NULL) descs = new_descs;
+      new_offsets = (u_int64_t*)realloc(offsets, new_max * sizeof(u_int64_t));
+      if(new_offsets != NULL) offsets = new_offsets;
+
+      if((new_descs == NULL) || (new_offsets == NULL)) {
+	traceEvent(TRACE_WARNING, "Not enough memory: replaying the first %u packets only", num_pkts);
+	break;
+      }
+
+      max_pkts = new_max;
+    }
+
+    if((data_len + caplen) > data_size) {
+      u_int64_t new_size = max(2 * data_size, (u_int64_t)(1 << 24));
+      u_char *new_data = (u_char*)realloc(data, new_size);
+
+      if(new_data == NULL) {
+	traceEvent(TRACE_WARNING, "Not enough memory: replaying the first %u packets only", num_pkts);
+	break;
+      }
+
+      data = new_data, data_size = new_size;
+    }
+
+    memcpy(&data[data_len], p, caplen);
+
+    pkt = &descs[num_pkts];
+    memset(pkt, 0, sizeof(QueuedPacket));
+    memcpy(&pkt->h, h, sizeof(struct pcap_pkthdr));
+    pkt->h.caplen = caplen, pkt->packet_if_idx = -1, pkt->rx_direction = 1, pkt->numPkts = 1;
+    pkt->input_index = NO_INTERFACE_INDEX, pkt->output_index = NO_INTERFACE_INDEX;
+
+    offsets[num_pkts++] = data_len, data_len += caplen;
+  }
+
+  if((num_pkts == 0) || ((pkts = (QueuedPacket**)malloc(num_pkts * sizeof(QueuedPacket*))) == NULL)) {
+    traceEvent(TRACE_ERROR, "Replay benchmark: no packets to replay from %s", readOnlyGlobals.pcapFile);
+    if(descs) free(descs);
+    if(offsets) free(offsets);
+    if(data) free(data);
+    return;
+  }
+
+  for(i=0; i<num_pkts; i++)
+    descs[i].p = &data[offsets[i]], pkts[i] = &descs[i];
+
+  free(offsets);
+
+  /* Every lap is shifted past the previous one so that time keeps going forward */
+  lap_shift = max(descs[num_pkts-1].h.ts.tv_sec - descs[0].h.ts.tv_sec + 1, 1);
+
+  replayLap(pkts, num_pkts, 1);
+
+  traceEvent(TRACE_NORMAL, "Replay benchmark [%s]: [%u packets][%.1f MB][%u flows]",
+	     readOnlyGlobals.pcapFile, num_pkts, (float)data_len / (1024 * 1024),
+	     getNumActiveBuckets());
+
+#ifdef linux
+  miss_fd = openCacheMissCounter();
+#endif
+
+  for(b=0; b<sizeof(bursts)/sizeof(bursts[0]); b++) {
+    struct timeval begin, now;
+    u_int64_t num_replayed = 0, misses = 0, begin_misses = 0;
+    float elapsed;
+
+#ifdef linux
+    begin_misses = readCacheMissCounter(miss_fd);
+#endif
+    gettimeofday(&begin, NULL);
+
+    do {
+      for(i=0; i<num_pkts; i++) descs[i].h.ts.tv_sec += lap_shift;
+
+      replayLap(pkts, num_pkts, bursts[b]);
+      num_replayed += num_pkts;
+      gettimeofday(&now, NULL);
+    } while((msTimeDiff(&now, &begin) < REPLAY_BENCH_MIN_MSEC) && (!readWriteGlobals->shutdownInProgress));
+
+    elapsed = (float)msTimeDiff(&now, &begin) / 1000;
+
+#ifdef linux
+    misses = readCacheMissCounter(miss_fd) - begin_misses;
+#endif
+
+    if(miss_fd >= 0)
+      traceEvent(TRACE_NORMAL, "Replay benchmark [burst %2u]: [%.2f Kpps][%.2f cache misses/pkt]",
+		 bursts[b], (float)num_replayed / (elapsed * 1000), (float)misses / (float)num_replayed);
+    else
+      traceEvent(TRACE_NORMAL, "Replay benchmark [burst %2u]: [%.2f Kpps]",
+		 bursts[b], (float)num_replayed / (elapsed * 1000));
   }
+
+  if(miss_fd >= 0) close(miss_fd);
+
+  free(pkts);
+  free(descs);
+  free(data);
 }
 
 /* ****************************************************** */
@@ -5186,7 +5780,7 @@ static void* fetchPcapPackets(void* _thid) {
 	    if(n < m) {
 	      if(unlikely(readOnlyGlobals.enable_debug))
 		traceEvent(TRACE_INFO, "Sleeping %.3f sec @ packet id %u [delta %.3f sec]",
-			   ((float)(m-n))/1000, readWriteGlobals->accumulateStats[0].pkts, ((float)m)/1000);
+			   ((float)(m-n))/1000, readWriteGlobals->threadStats[0].stats.pkts, ((float)m)/1000);
 
 	      usleep((m - n)*1000);
 	    }
@@ -5306,6 +5900,7 @@ void init_globals(void) {
   }
 
   readWriteGlobals->flow_serial = 1; /* 0 as flow_serial means no serial */
+  updateCoarseClock(); /* Valid until the clock thread starts */
 
   /* 2 - Init readOnlyGlobals */
   memset(&readOnlyGlobals, 0, sizeof(readOnlyGlobals));
@@ -5424,7 +6019,7 @@ static void compileTemplates(u_int8_t reloadTemplate) {
     buildActivePluginsList(readOnlyGlobals.templateBuffers[V4_TEMPLATE_INDEX].v9TemplateElementList);
     readOnlyGlobals.computeInterfaceIndexes = 1;
   } else if(readOnlyGlobals.netFlowVersion == 9 || readOnlyGlobals.netFlowVersion == 10) {
-    u_int flowLen;
+    u_int flowLen, minFlowLen = 0;
 
     if(readOnlyGlobals.baseTemplateBufferV4 == NULL) {
       traceEvent(TRACE_WARNING, "You selected v9/IPFIX without specifying a template (-T).");
@@ -5773,6 +6368,11 @@ static void compileTemplates(u_int8_t reloadTemplate) {
 
 	if(tot > flowLen) flowLen = tot;
       }
+
+      readOnlyGlobals.templateBuffers[num_runs].flowLen = tot;
+      if((minFlowLen == 0) || (tot < minFlowLen)) minFlowLen = tot;
+
+      compileTemplateProgram(&readOnlyGlobals.templateBuffers[num_runs]);
     }
 
     if((readOnlyGlobals.userTemplateBuffer.v9TemplateElementList[0] == NULL)
@@ -5817,10 +6417,11 @@ static void compileTemplates(u_int8_t reloadTemplate) {
 
       if(readOnlyGlobals.minNumFlowsPerPacket == (u_short)-1) {
 	/*
-	  As with NetFlow v5, we suppose that a UDP packet can fit up to 1440
-	  bytes (alias NETFLOW_MAX_BUFFER_LEN) of payload for NetFlow flows.
+	  Datagrams are sent when the next record would not fit (see
+	  exportBucketToNetflowV9()): the flow count is only an upper bound
+	  so that datagrams can be filled with the shortest records.
 	*/
-	readOnlyGlobals.minNumFlowsPerPacket = max(1, (readOnlyGlobals.maxNetFlowPacketPayloadLen/flowLen)-1);
+	readOnlyGlobals.minNumFlowsPerPacket = max(1, readOnlyGlobals.maxNetFlowPacketPayloadLen/max(minFlowLen, 1));
 	traceEvent(TRACE_NORMAL, "Each flow is %d bytes long", flowLen);
 	traceEvent(TRACE_NORMAL, "The # packets per flow has been set to %d",
 		   readOnlyGlobals.minNumFlowsPerPacket);
@@ -5859,11 +6460,20 @@ static void compileTemplates(u_int8_t reloadTemplate) {
   }
 #endif
 
-  /* Allocate memory for template buffers */
+  /* Allocate memory for template buffers: each export thread builds its own packets */
   for(i=0; i<readOnlyGlobals.numActiveTemplates; i++) {
-    if((readOnlyGlobals.templateBuffers[i].buffer = (char*)malloc(JUMBO_MTU)) == NULL) {
-      traceEvent(TRACE_ERROR, "Not enough memory ?");
-      exit(0); /* If we don't have enough memory now, we better quit */
+    int w;
+
+    for(w=0; w<readOnlyGlobals.numExportThreads; w++) {
+      ExportWorker *worker = &readWriteGlobals->exportWorkers[w];
+
+      if(((worker->buffer[i] == NULL)
+	  && ((worker->buffer[i] = (char*)malloc(readOnlyGlobals.exportBufferLen)) == NULL))
+	 || ((worker->packet == NULL)
+	     && ((worker->packet = (char*)malloc(readOnlyGlobals.exportBufferLen)) == NULL))) {
+	traceEvent(TRACE_ERROR, "Not enough memory ?");
+	exit(0); /* If we don't have enough memory now, we better quit */
+      }
     }
   }
 
@@ -6020,6 +6630,12 @@ static void* printPeriodicStats(void* notUsed) {
       rc = 0;
 
     checkIntefaceDrops(rc);
+
+    if(readOnlyGlobals.flowCollection.collectorInPort > 0)
+      expireTemplateCache(time(NULL));
+
+    reclaimLpmTables(0);
+
     if(--to_sleep == 0) to_sleep = sleep_duration;
   }
 
@@ -6172,10 +6788,10 @@ main
   readWriteGlobals->shutdownInProgress = 0;
   readWriteGlobals->flowExportStats.totExportedBytes = 0;
   readWriteGlobals->flowExportStats.totExportedPkts = readWriteGlobals->flowExportStats.totExportedFlows = 0;
-  initAtomic(&readWriteGlobals->bucketsAllocated);
-  createCondvar(&readWriteGlobals->exportQueueCondvar);
+  for(i=0; i<MAX_NUM_PCAP_THREADS; i++)
+    initAtomic(&readWriteGlobals->threadStats[i].bucketsPurged);
   createCondvar(&readWriteGlobals->termCondvar);
-  pthread_rwlock_init(&readWriteGlobals->exportMutex, NULL);
+  initCoarseClock();
 
   for(i=0; i<NUM_FRAGMENT_LISTS; i++)
     pthread_rwlock_init(&readWriteGlobals->fragmentMutex[i], NULL);
@@ -6188,10 +6804,9 @@ main
   pthread_rwlock_init(&readWriteGlobals->exportRwLock, NULL);
   pthread_rwlock_init(&readWriteGlobals->rwGlobalsRwLock, NULL);
   pthread_rwlock_init(&readWriteGlobals->collectorRwLock, NULL);
-  pthread_rwlock_init(&readWriteGlobals->collectorCounterLock, NULL);
   pthread_rwlock_init(&readWriteGlobals->pcapLock, NULL);
-  pthread_rwlock_init(&readWriteGlobals->checkExportLock, NULL);
-  pthread_rwlock_init(&readWriteGlobals->expireListLock, NULL);
+  pthread_rwlock_init(&readWriteGlobals->exportStatsLock, NULL);
+  pthread_rwlock_init(&readWriteGlobals->sendLock, NULL);
   pthread_rwlock_init(&readWriteGlobals->trafficThroughputStats.trafficThroughputLock, NULL);
   pthread_rwlock_init(&readWriteGlobals->dumpFileLock, NULL);
 
@@ -6211,6 +6826,47 @@ main
   }
 
   compileTemplates(0);
+  initFlowHash();
+
+  if(readOnlyGlobals.encodeBenchFlows > 0) {
+    encodeBenchmark(readOnlyGlobals.encodeBenchFlows);
+    exit(0);
+  }
+
+  if(readOnlyGlobals.callBenchCalls > 0) {
+    callOverheadBenchmark(readOnlyGlobals.callBenchCalls);
+    exit(0);
+  }
+
+  if(readOnlyGlobals.flowHashTestPcap != NULL) {
+    flowHashTest(readOnlyGlobals.flowHashTestPcap);
+    exit(0);
+  }
+
+  if(readOnlyGlobals.collectorBlastPcap != NULL) {
+    collectorBlast(readOnlyGlobals.collectorBlastPcap, readOnlyGlobals.flowCollection.collectorInPort);
+    exit(0);
+  }
+
+  if(readOnlyGlobals.collectorBenchPcap != NULL) {
+    collectorBenchmark(readOnlyGlobals.collectorBenchPcap);
+    exit(0);
+  }
+
+  if(readOnlyGlobals.lpmBenchPrefixes > 0) {
+    lpmBenchmark(readOnlyGlobals.lpmBenchPrefixes);
+    exit(0);
+  }
+
+  if(readOnlyGlobals.lruBenchThreads > 0) {
+    testLRU(readOnlyGlobals.lruBenchThreads);
+    exit(0);
+  }
+
+  if(readOnlyGlobals.redisBenchCommands > 0) {
+    redisBenchmark(readOnlyGlobals.redisBenchCommands);
+    exit(0);
+  }
 
   if((readOnlyGlobals.netFlowVersion != 5) && readOnlyGlobals.ignoreIP)
     traceEvent(TRACE_WARNING, "Your template ignores IP addresses: your collector might ignore these flows.");
@@ -6249,6 +6905,9 @@ main
     if((openDevice(ebuf, 1, (readOnlyGlobals.pcapFileList ? readOnlyGlobals.pcapFileList->path : NULL)) == -1)
        || ((readOnlyGlobals.pcapPtr == NULL)
 	   && strcmp(readOnlyGlobals.captureDev, "none")
+#ifdef HAVE_AF_PACKET
+	   && (readOnlyGlobals.afPacketThreads == 0)
+#endif
 #ifdef HAVE_PF_RING
 	   && (readWriteGlobals->ring == NULL)
 #endif
@@ -6278,27 +6937,8 @@ main
     /* Use multiprocessing also outside PF_RING */
     if(1 || have_pf_ring) {
       /* We need to allocate per-thread packet queues */
-      for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
-	ItemsQueue *queue = &readWriteGlobals->packetQueues[i];
-	int j;
-
-	initQueue(queue);
-
-	queue->queueSlots = (QueuedPacket*)calloc(sizeof(QueuedPacket), DEFAULT_QUEUE_CAPACITY);
-	if(queue->queueSlots == NULL) {
-	  traceEvent(TRACE_ERROR, "Not enough memory");
-	  exit(-1);
-	}
-
-	for(j=0; j<DEFAULT_QUEUE_CAPACITY; j++) {
-	  QueuedPacket *pkt = &((QueuedPacket*)queue->queueSlots)[j];
-
-	  if((pkt->p = malloc(readOnlyGlobals.snaplen)) == NULL) {
-	    traceEvent(TRACE_ERROR, "Not enough memory");
-	    exit(-1);
-	  }
-	}
-      }
+      if(readOnlyGlobals.numProcessThreads > 1)
+	initPacketQueues();
     } else {
       traceEvent(TRACE_WARNING, "Multithreaded processing is supported only with PF_RING");
       traceEvent(TRACE_WARNING, "Switching back to single thread processing");
@@ -6315,11 +6955,8 @@ main
   for(idx=0; idx<readOnlyGlobals.numProcessThreads; idx++)
     allocateFlowHash(idx);
 
-  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
-    readWriteGlobals->accumulateStats[i].pkts = 0, readWriteGlobals->accumulateStats[i].bytes = 0,
-      readWriteGlobals->accumulateStats[i].tcpFlows = 0, readWriteGlobals->accumulateStats[i].udpFlows = 0;
-    readWriteGlobals->accumulateStats[i].icmpFlows = 0;
-  }
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++)
+    memset(&readWriteGlobals->threadStats[i].stats, 0, sizeof(ProbeStats));
 
   readWriteGlobals->lastSample = time(NULL);
 
@@ -6546,6 +7183,12 @@ main
       return(0);
     }
 
+    /* nDPI sizes and -M are known by now */
+    initFlowBucketPools();
+
+    initExportWorkers();
+    initExportBatches();
+
     if(readOnlyGlobals.flowCollection.collectorInPort > 0)
       createNetFlowListener(readOnlyGlobals.flowCollection.collectorInPort);
 
@@ -6570,7 +7213,12 @@ main
       readOnlyGlobals.needHashLock = 0;
 
     traceEvent(TRACE_INFO, "Starting %u packet fetch thread(s)", readOnlyGlobals.numProcessThreads);
-    pthread_create(&readWriteGlobals->dequeueThread, NULL, dequeueBucketToExport, NULL);
+    for(i=0; i<readOnlyGlobals.numExportThreads; i++) {
+      ExportWorker *worker = &readWriteGlobals->exportWorkers[i];
+
+      worker->running = 1;
+      pthread_create(&worker->thread, NULL, dequeueBucketToExport, worker);
+    }
 
     pthread_create(&readWriteGlobals->statsThread, NULL, printPeriodicStats, NULL);
 
@@ -6581,6 +7229,26 @@ main
 	readOnlyGlobals.reforgeTimestamps = 0;
     }
 
+    if(readOnlyGlobals.replayBench) {
+      replayBenchmark();
+      exit(0);
+    }
+
+    /* n process threads: they also process packets read from files or collected */
+    if(unlikely(readOnlyGlobals.useLocks) && (readOnlyGlobals.numProcessThreads > 1)) {
+      for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+	u_long thread_id = i;
+
+	pthread_create(&readOnlyGlobals.packetProcessThread[i],
+#if !defined(WIN32)
+		       &tattr,
+#else
+		       NULL,
+#endif
+		       processPackets, (void*)thread_id);
+      }
+    }
+
     if(readOnlyGlobals.pcapPtr
 #ifdef HAVE_PF_RING
        || readWriteGlobals->ring
@@ -6614,6 +7282,7 @@ main
 	} else {
 	  /* Spawn idleThreadTaskfetcher thread */
 	  u_long thread_id = 0;
+	  pthread_t fetcherThread;
 	  pthread_start_routine fetcher = NULL;
 
 #ifdef HAVE_NETFILTER
@@ -6628,29 +7297,21 @@ main
 #endif
 	  }
 
+#ifdef HAVE_AF_PACKET
+	  if(readOnlyGlobals.afPacketThreads > 0) {
+	    /* 1 receive thread per AF_PACKET socket */
+	    for(thread_id=0; thread_id<readOnlyGlobals.afPacketThreads; thread_id++)
+	      pthread_create(&fetcherThread, &tattr, fetchAfPacketPackets, (void*)thread_id);
+	  } else
+#endif
 	  /* 1 receive thread */
-	  pthread_create(&readOnlyGlobals.packetProcessThread[i],
+	  pthread_create(&fetcherThread,
 #if !defined(WIN32)
 			 &tattr,
 #else
 			 NULL,
 #endif
 			 fetcher, (void*)thread_id);
-
-	  /* n process threads */
-	  if(unlikely(readOnlyGlobals.useLocks)) {
-	    for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
-	      thread_id = i;
-
-	      pthread_create(&readOnlyGlobals.packetProcessThread[i],
-#if !defined(WIN32)
-			     &tattr,
-#else
-			     NULL,
-#endif
-			     processPackets, (void*)thread_id);
-	    }
-	  }
 	}
       }
     }
@@ -6663,8 +7324,12 @@ main
   if(readOnlyGlobals.pcapFile) {
     u_int32_t i, tot_pkts = 0, tot_bytes = 0;
 
+    /* Let the processing threads catch up with the file */
+    if(unlikely(readOnlyGlobals.useLocks) && (readOnlyGlobals.numProcessThreads > 1))
+      drainPacketQueues();
+
     for(i=0; i<readOnlyGlobals.numProcessThreads; i++)
-      tot_pkts += readWriteGlobals->accumulateStats[i].pkts;
+      tot_pkts += readWriteGlobals->threadStats[i].stats.pkts;
 
     traceEvent(TRACE_INFO, "No more packets to read. Sleeping...\n");
 
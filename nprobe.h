@@ -154,6 +154,13 @@
 #include <net/if.h>
 #include <netdb.h>
 
+#ifdef linux
+#include <sys/syscall.h>
+#include <linux/perf_event.h> /* --fake-capture-bench */
+#include <linux/futex.h>
+#include <linux/if_packet.h> /* --afpacket-threads */
+#endif
+
 #define PERFORMANCE
 
 #if defined(PERFORMANCE) \
@@ -726,10 +733,31 @@ typedef struct ipV4Fragment {
 #define IPPROTO_SCTP         132
 #endif
 
+#define MAX_EXPORT_BATCH_LEN         64 /* Datagrams per sendmmsg() */
+#define DEFAULT_EXPORT_BATCH_TIMEOUT 50 /* msec */
+#define NUM_EXPORT_BATCH_BINS         4 /* 1, 2-7, 8-31, 32+ datagrams */
+
+/*
+  --export-batch: complete datagrams (sequence number already set)
+  waiting to be sent to an UDP collector with a single sendmmsg().
+  Protected by sendLock as the rest of the collector state.
+*/
+typedef struct exportBatch {
+  u_int16_t numDatagrams, datagramLen[MAX_EXPORT_BATCH_LEN];
+  struct timeval firstQueued;
+  u_int32_t slotLen; /* readOnlyGlobals.exportBufferLen */
+  char *slots; /* MAX_EXPORT_BATCH_LEN * slotLen */
+
+  /* Stats */
+  u_int32_t numFlushes, numSyscalls, numSentDatagrams, numSendErrors, maxBatchLen;
+  u_int32_t batchLenBins[NUM_EXPORT_BATCH_BINS];
+} ExportBatch;
+
 typedef struct collectorAddress {
   u_int8_t isIPv6; /* 0=IPv4, 1=IPv6 or anything else (generic addrinfo) */
   u_int8_t transport; /* TRANSPORT_XXXX */
   u_int  flowSequence;
+  ExportBatch *batch; /* NULL = one send per datagram */
 
   union {
     struct sockaddr_in v4Address;
@@ -763,6 +791,7 @@ typedef struct conditionalVariable {
 extern int createCondvar(ConditionalVariable *condvarId);
 extern void deleteCondvar(ConditionalVariable *condvarId);
 extern int waitCondvar(ConditionalVariable *condvarId);
+extern int timedWaitCondvar(ConditionalVariable *condvarId, u_int msec);
 extern int signalCondvar(ConditionalVariable *condvarId, int broadcast);
 
 #define TEMP_PREFIX        ".temp"
@@ -1057,7 +1086,10 @@ typedef struct flowSetV9Ipfix {
   V9IpfixSimpleTemplate templateInfo;
   u_int16_t flowLen; /* Real flow length */
   V9V10TemplateField *fields;
-  struct flowSetV9Ipfix *next;
+  time_t lastSeen; /* Last time the exporter sent it */
+  u_int8_t transport; /* IPPROTO_UDP or IPPROTO_SCTP it was learnt over: only UDP templates expire */
+  struct flowSetV9Ipfix *next, *retired; /* Template cache bucket, retired list */
+  struct templateDecoder *decoder; /* NULL: the template is interpreted */
 } FlowSetV9Ipfix;
 
 #define STANDARD_ENTERPRISE_ID                0
@@ -1175,6 +1207,18 @@ typedef unsigned long long ticks;
 /* It must stay here as it needs the definition of v9 types */
 #include "engine.h"
 #include "util.h"
+#include "clock.h"
+#include "pool.h"
+#include "flowtable.h"
+#include "flowtimer.h"
+#include "ring.h"
+#include "pktqueue.h"
+#include "afpacket.h"
+#include "flowhash.h"
+#include "tmplcache.h"
+#include "tmpldecoder.h"
+#include "lpm.h"
+#include "geocache.h"
 
 #ifdef HAVE_PF_RING
 #include "pro/pf_ring.h"
@@ -1263,7 +1307,19 @@ struct udp_header {
 /* ************************************* */
 
 #define MAX_NUM_COLLECTORS            8
+#define MAX_UDP_EXPORT_MTU        65507 /* 65535 - IP - UDP headers */
+#define MAX_EXPORT_MTU            65535 /* v9/IPFIX length fields are 16 bit */
 #define MAX_NUM_COLLECTOR_THREADS  MAX_NUM_PCAP_THREADS
+#define COLLECTOR_MAX_DATAGRAM_LEN 65536 /* Largest UDP payload: jumbo IPFIX is not truncated */
+#define COLLECTOR_RECV_BATCH          32 /* --collector-reuseport: datagrams per recvmmsg() */
+#define COLLECTOR_POLL_TIMEOUT      1000 /* msec */
+#define COLLECTOR_BLAST_SOCKETS       64 /* --collector-blast: source ports the datagrams are spread on */
+#define COLLECTOR_BLAST_DURATION      10 /* sec */
+#define COLLECTOR_BENCH_DURATION       5 /* sec: --collector-bench, per decoding mode */
+
+#if defined(linux) && defined(SO_REUSEPORT) && defined(MSG_WAITFORONE)
+#define HAVE_COLLECTOR_REUSEPORT /* recvmmsg()/sendmmsg() are there too */
+#endif
 #define MAX_NUM_OPTIONS             128
 #define DISPLAY_TIME                 30
 #define DEFAULT_TEMPLATE_ID         257
@@ -1287,34 +1343,54 @@ typedef unsigned long long Counter;
 
 /* Least recently used cache */
 
+#define LRU_CACHE_SHARDS         16 /* Power of 2 */
+#define LRU_CACHE_WAYS            8 /* Entries per set */
+#define LRU_CACHE_INLINE_LEN     32 /* Longer keys and values (NUL included) are malloc()'d */
+#define LRU_BENCH_SIZE        65536 /* testLRU() */
+#define LRU_BENCH_DURATION        5 /* sec, per number of threads */
+
 struct LruCacheNumEntry {
   u_int64_t key;
   u_int32_t value;
 };
 
 struct LruCacheStrEntry {
-  char *key, *value;
-  time_t expire_time;
+  char *key, *value; /* The inline buffers or malloc()'d strings */
+  char inline_key[LRU_CACHE_INLINE_LEN], inline_value[LRU_CACHE_INLINE_LEN];
 };
 
 struct LruCacheEntry {
+  u_int32_t hash;                 /* 0: empty */
   u_int8_t numeric_node;
+  u_int8_t referenced;            /* CLOCK bit: set by lookups, cleared by the eviction hand */
+  time_t expire_time;             /* 0: never */
 
   union {
-    struct LruCacheNumEntry num; /* numeric_node == 1 */
-    struct LruCacheStrEntry str; /* numeric_node == 0 */
+    struct LruCacheNumEntry num;  /* numeric_node == 1 */
+    struct LruCacheStrEntry str;  /* numeric_node == 0 */
   } u;
-
-  struct LruCacheEntry *next; /* Hash collision list */
 };
 
+typedef struct lruCacheShard {
+  pthread_rwlock_t lock;          /* Lookups: read, adds: write */
+  struct LruCacheEntry *entries;  /* num_sets sets of LRU_CACHE_WAYS entries */
+  u_int8_t *hands;                /* CLOCK hand of each set */
+  u_int32_t num_entries, mem_size;
+  u_int32_t num_cache_add, num_cache_find, num_cache_misses, num_cache_evictions;
+} __attribute__((aligned(64))) LruCacheShard;
+
+/*
+  The hash picks the shard (and its lock) and, in the shard, a set of
+  LRU_CACHE_WAYS entries. Full sets evict with CLOCK, an approximate
+  LRU: lookups only set the referenced bit of the entry they find, so
+  they run in parallel under the shard read lock, and expired entries
+  are reused by the next add instead of being removed by the lookup.
+*/
 struct LruCache {
-  pthread_rwlock_t lruLock;
-  u_int32_t max_cache_node_len, hash_size, mem_size;
-  u_int32_t num_cache_add, num_cache_find, num_cache_misses;
+  void *mem;                      /* As returned by calloc(): shards is aligned inside it */
+  LruCacheShard *shards;
+  u_int32_t num_sets;             /* Per shard. 0: cache disabled */
   u_int32_t last_num_cache_add, last_num_cache_find, last_num_cache_misses;
-  u_int32_t *current_hash_size; /* Allocated dynamically */
-  struct LruCacheEntry **hash;   /* Allocated dynamically */
 };
 
 /* ********************************************* */
@@ -1329,11 +1405,6 @@ struct fileList {
   struct fileList *next;
 };
 
-typedef struct {
-  u_int32_t network, netmask, broadcast, netmask_v6;
-  u_int16_t interface_id;
-} NetworkInfo;
-
 typedef enum {
   vlan_disabled = 0,
   inner_vlan,
@@ -1347,13 +1418,46 @@ typedef enum {
 
 #define MAX_NUM_TEMPLATES   2 /* v4 + v6 */ + MAX_NUM_PLUGINS
 
+#define TEMPLATE_OP_ELEMENT        0 /* handleTemplate() with bounds checks */
+#define TEMPLATE_OP_RUN            1 /* Header of a run of unchecked instructions */
+#define TEMPLATE_OP_CORE8          2
+#define TEMPLATE_OP_CORE16         3
+#define TEMPLATE_OP_CORE32         4
+#define TEMPLATE_OP_EXT8           5
+#define TEMPLATE_OP_EXT32          6 /* Truncated to 16 bit when width is 2 */
+#define TEMPLATE_OP_IPV4           7
+#define TEMPLATE_OP_IPV6           8
+#define TEMPLATE_OP_TCP_FLAGS      9
+#define TEMPLATE_OP_NEXT_HOP      10
+#define TEMPLATE_OP_FIRST_SWITCHED 11
+#define TEMPLATE_OP_LAST_SWITCHED  12
+#define TEMPLATE_OP_TIME_MSEC      13
+#define TEMPLATE_OP_EXT16         14
+
+typedef struct {
+  u_int8_t op;       /* TEMPLATE_OP_* */
+  u_int16_t width;   /* Bytes written (TEMPLATE_OP_RUN: by the whole run) */
+  u_int32_t offset;  /* In the bucket or in its ext (TEMPLATE_OP_RUN: number of instructions) */
+  V9V10TemplateElementId *elem;
+} TemplateInstruction;
+
+/*
+  Template compiled for one flow direction: direction, version and field
+  widths are resolved once so that encoding a record does not need to
+  go through the handleTemplate() switch for the common fields.
+*/
+typedef struct {
+  u_int16_t numInstructions, numCompiledElements, numElements;
+  TemplateInstruction ins[2*TEMPLATE_LIST_LEN];
+} TemplateProgram;
+
 typedef struct {
   V9V10TemplateElementId *v9TemplateElementList[TEMPLATE_LIST_LEN];
   char templateBuffer[NETFLOW_MAX_BUFFER_LEN];
   u_int templateBufBegin, templateBufMax;
+  u_int flowLen; /* Longest data record of this template */
+  TemplateProgram program[2]; /* [0] src2dst_direction, [1] dst2src_direction */
   int numTemplateFieldElements;
-  char *buffer;
-  u_int32_t bufferLen;
   PluginEntryPoint *templatePlugin; /*
 				       Pointer to the plugin (if any) that handles
 				       fields not part of the base nProbe
@@ -1365,13 +1469,13 @@ typedef struct asList {
   struct asList *next;
 } ASlist;
 
-typedef struct netList {
-  u_int32_t net;
-  u_int32_t mask;
-  struct netList *next;
-} NetList;
-
 #define MAX_NUM_REDIS_CONNECTIONS        4
+#define REDIS_PIPELINE_DEPTH           256 /* Commands sent before reading their replies */
+#define REDIS_PIPELINE_FLUSH_MSEC        5 /* Max wait of a command for a fuller pipeline */
+#define REDIS_IDLE_WAIT_MSEC          1000 /* Sleep of a queue thread with nothing queued */
+#define REDIS_QUEUE_MAX_COMMANDS     16384 /* Per connection: further commands are dropped */
+#define REDIS_QUEUE_MAX_BYTES      (8*1024*1024)
+#define REDIS_BENCH_COMMANDS       1000000 /* --redis-bench default */
 #define DEFAULT_LRU_CACHE_SIZE       16384
 #define MAX_LRU_CACHE_SIZE          128000
 typedef struct {
@@ -1405,7 +1509,7 @@ typedef struct {
     int collectorInPort;
     u_int sampleRate;
     u_int8_t keepProbesUnmerged;
-    NetList *prefix_list, *not_prefix_list;
+    LpmTable *prefix_list, *not_prefix_list;
     ASlist *as_list, *not_as_list;
   } flowCollection;
 
@@ -1464,9 +1568,9 @@ typedef struct {
   u_int8_t netFlowVersion, bidirectionalFlows, aggregateGtpTunnels;
   u_short templatePacketsDelta, minNumFlowsPerPacket, initialPacketBytesToSkip;
   struct sockaddr_in sockIn;
-  u_short packetsBeforeSendingTemplates;
   u_int8_t num_v5flows_per_packet, useLocks;
   u_short numProcessThreads, minMTU, maxNetFlowPacketPayloadLen;
+  u_int32_t exportMTU /* --export-mtu */, exportBufferLen /* Bytes allocated for each datagram/flowset */;
   u_int8_t enableHostStats, enableTcpSeqStats, enableLatencyStats, enablePacketStats;
 
   /* V9 Templates */
@@ -1481,6 +1585,7 @@ typedef struct {
   V9V10TemplateElementId *v9OptionTemplateElementList[TEMPLATE_LIST_LEN];
   char optionTemplateBuffer[NETFLOW_MAX_BUFFER_LEN];
   u_int optionTemplateBufBegin, optionTemplateBufMax, flowHashSize;
+  u_int8_t flowTableMode; /* FLOW_TABLE_CHAINED or FLOW_TABLE_GROUPED */
   int numOptionTemplateFieldElements;
   /* approximate # of flows that the template takes up */
   u_short optionTemplateFlowSize;
@@ -1504,11 +1609,11 @@ typedef struct {
   u_int8_t engineType, engineId, accountL2Traffic;
 
   /* Networks mapping */
-  u_int32_t numInterfaceNetworks, numLocalNetworks;
-  NetworkInfo interfaceNetworks[MAX_NUM_NETWORKS], blacklistNetworks[MAX_NUM_NETWORKS],
-    localNetworks[MAX_NUM_NETWORKS];
+  u_int32_t numInterfaceNetworks, numLocalNetworks; /* Prefixes */
+  LpmTable *interfaceNetworks, *blacklistNetworks, *localNetworks;
   u_char hasSrcMacExport, srcMacExport[6];
   u_int32_t numBlacklistNetworks, maxExportQueueLen;
+  u_int16_t exportBatchLen, exportBatchTimeout; /* --export-batch */
   char *csv_separator;
   pthread_t *packetProcessThread;
 
@@ -1561,18 +1666,29 @@ typedef struct {
 #endif
 
   /* Status */
-  u_int8_t nprobe_up, dequeueBucketToExport_up, num_active_plugins;
+  u_int8_t nprobe_up, num_active_plugins, numExportThreads;
   u_int8_t fakePacketCapture, checkMemoryBoundaries, max_packet_ordering_queue;
+  u_int8_t afPacketThreads; /* --afpacket-threads: 0 = use libpcap */
+  u_int8_t flowHashAlgorithm; /* --flow-hash */
+  FlowHashFct flowHashFct;
+  char *flowHashTestPcap; /* --flow-hash-test */
+  u_int8_t packetBatchSize; /* --packet-batch */
+  u_int8_t collectorReusePort; /* --collector-reuseport */
+  char *collectorBlastPcap; /* --collector-blast */
+  char *collectorBenchPcap; /* --collector-bench */
+  u_int8_t interpretTemplates; /* Do not use the compiled template decoders */
+  u_int32_t lpmBenchPrefixes; /* --lpm-bench */
+  u_int8_t lruBenchThreads; /* --lru-bench */
+  u_int32_t redisBenchCommands; /* --redis-bench */
   u_int32_t maxLogLines;
 
   /* Performance test */
   u_int8_t tracePerformance;
-  pthread_rwlock_t ticksLock;
-  ticks decodeTicks, allInclusiveTicks,
-    processingWithFlowCreationTicks, processingWoFlowCreationTicks, bucketExportTicks,
-    bucketPurgeTicks, bucketAllocationTicks, bucketMallocTicks;
-  u_int64_t num_pkts_with_flow_creation, num_pkts_without_flow_creation, num_exported_buckets,
-    num_purged_buckets, num_allocated_buckets, num_malloced_buckets;
+  u_int32_t fakeCaptureBenchFlows; /* --fake-capture-bench: 0 = disabled */
+  u_int32_t encodeBenchFlows; /* --encode-bench: 0 = disabled */
+  u_int32_t callBenchCalls; /* --call-bench: 0 = disabled */
+  u_int8_t replayBench; /* --replay-bench */
+  pthread_rwlock_t ticksLock; /* Flow serial when atomics are not available */
 
   unsigned long nprobePid; /* 0 on Windows */
   BiflowsExportPolicy biflowsExportPolicy; /* default: export_all_flows */
@@ -1587,7 +1703,7 @@ typedef struct {
     struct event_base *base;
     redisContext *read_context, *write_context[MAX_NUM_REDIS_CONNECTIONS], *logging_context[MAX_NUM_REDIS_CONNECTIONS];
     pthread_rwlock_t lock_set_delete[MAX_NUM_REDIS_CONNECTIONS], lock_logging[MAX_NUM_REDIS_CONNECTIONS], lock_get;
-    pthread_t reply_loop, local_server_loop;
+    pthread_t reply_loop[MAX_NUM_REDIS_CONNECTIONS], local_server_loop;
     u_int8_t queue_thread_running[MAX_NUM_REDIS_CONNECTIONS], local_server_running, use_nutcracker;
   } redis;
 #endif
@@ -1659,6 +1775,71 @@ typedef struct {
   Counter tcpFlows, udpFlows, icmpFlows;
 } ProbeStats;
 
+#define STATS_CACHE_LINE_LEN      64
+#define ACTIVE_BUCKETS_REFRESH    64 /* New flows between two -M checks of all the threads */
+
+/* --trace-performance accounting: each thread sums into its own copy */
+typedef struct {
+  ticks decodeTicks, processingWithFlowCreationTicks, processingWoFlowCreationTicks,
+    bucketExportTicks, bucketPurgeTicks, bucketAllocationTicks, bucketMallocTicks;
+  u_int64_t num_pkts_with_flow_creation, num_pkts_without_flow_creation, num_exported_buckets,
+    num_purged_buckets, num_allocated_buckets, num_malloced_buckets;
+} PerfTicks;
+
+/*
+  Counters of a processing thread, written by that thread only: readers
+  sum the blocks of all threads without locking, and never reset them
+  (rates are computed against a previous snapshot). As in the bucket
+  pool, the counter other threads update (buckets purged by the export
+  threads) sits on a cache line of its own, and the padding keeps the
+  blocks of two threads off the same line.
+*/
+typedef struct {
+  char pad0[STATS_CACHE_LINE_LEN];
+
+  /* Owner thread */
+  ProbeStats stats;
+  Counter discardedPkts;
+  /*
+    Also written by the collector thread with the same index (and the
+    NetFlow of sniffed packets by the owner): use addSharedThreadStat()
+  */
+  u_long collectedPkts, collectedFlows;
+  u_int32_t dissectedFlowPkts; /* NetFlow datagrams, collected or sniffed */
+  u_int32_t bucketsAllocated;
+  u_int32_t activeBucketsSnapshot, allocsSinceSnapshot; /* -M check, see tooManyActiveFlows() */
+  PerfTicks perf;
+
+  /* Threads that purge the buckets of the owner */
+  char pad1[STATS_CACHE_LINE_LEN];
+  atomic_u_int32_t bucketsPurged;
+
+  char pad2[STATS_CACHE_LINE_LEN];
+} ThreadStats;
+
+#ifdef HAVE_BUILTIN_ATOMIC
+#define addSharedThreadStat(counter, value) __sync_fetch_and_add(&(counter), (value))
+#else
+#define addSharedThreadStat(counter, value) ((counter) += (value)) /* Approximate */
+#endif
+
+/*
+  --collector-reuseport: each collector thread owns a socket bound with
+  SO_REUSEPORT to the collector port, the kernel spreads the exporters
+  across them by source address/port. A thread dissects what it receives
+  into its own flow hash partition.
+*/
+typedef struct {
+  int socketv4, socketv6;
+
+  /* Receive thread */
+  u_int64_t num_dgrams, num_batches, num_truncated;
+  u_int32_t num_drops[2]; /* SO_RXQ_OVFL: cumulative socket drops (v4/v6) */
+
+  /* Stats thread */
+  u_int64_t last_dgrams, last_drops;
+} CollectorSocket;
+
 typedef struct selectorsList {
   u_int16_t selectorId, packet_offset;
   u_int32_t samplingPopulation;
@@ -1680,28 +1861,92 @@ struct forward_out_devs {
 
 #define MAX_NUM_CPUS   64
 
+#define MAX_NUM_EXPORT_THREADS  16
+
+#define FLOW_SERIAL_BLOCK     4096 /* Serials claimed at once from readWriteGlobals->flow_serial */
+
 typedef struct {
-  time_t now;
+  u_int32_t next, end; /* [next, end) not yet assigned */
+} FlowSerialBlock;
+
+/*
+  One dequeueBucketToExport() thread: it encodes the buckets queued on
+  its ring into its own flowset buffers and builds its own datagrams.
+  Only the collector sockets and sequence numbers are shared: sends are
+  serialized by sendNetFlow().
+*/
+typedef struct exportWorker {
+  u_int8_t worker_id, running;
+  pthread_t thread;
+  MpscRing ring;
+  pthread_rwlock_t lock; /* Bucket export vs checkNetFlowExport() flushes */
+
+  /* Flowsets being filled, one per template */
+  char *buffer[MAX_NUM_TEMPLATES];
+  u_int32_t bufferLen[MAX_NUM_TEMPLATES], bufferFlows[MAX_NUM_TEMPLATES];
+  char *packet; /* The v9/IPFIX datagram being sent */
+
+  NetFlow5Record theV5Flow;
+  V9FlowHeader theV9Header;
+  IPFIXFlowHeader theIPFIXHeader;
+  int numFlows;
+  u_short packetsBeforeSendingTemplates;
+  u_int queuedDataToExport;
   struct timeval lastExportTime;
+  struct timeval actTime; /* Set by this worker only */
+
+  /* Not yet added to readWriteGlobals->flowExportStats */
+  u_int32_t pendingFlows, pendingFlowPkts, pendingFlowBytes;
+
+  /* Stats */
+  u_int64_t totExportedFlows, lastExportedFlows;
+  u_int64_t numDataPkts, numDataPktFlows, numDataPktBytes, numTemplatePkts;
+  PerfTicks perf; /* Bucket export/purge */
+  FlowSerialBlock serials;
+  struct geoCache *geoCache; /* GeoIP lookups of the buckets it exports */
+} ExportWorker;
+
+#ifdef HAVE_REDIS
+typedef struct {
+  char *cmd;                      /* As formatted by redisFormatCommand() */
+  int len;
+} RedisCommand;
+
+/*
+  Commands of one Redis connection waiting for its redisAsyncLoop()
+  thread. Callers format the command and queue it holding only the
+  queue lock; the thread sends up to REDIS_PIPELINE_DEPTH commands at
+  once and then reads their replies, as soon as that many are queued or
+  the oldest one has waited REDIS_PIPELINE_FLUSH_MSEC. Once the queue
+  holds REDIS_QUEUE_MAX_COMMANDS commands or REDIS_QUEUE_MAX_BYTES,
+  further commands are dropped. When idle the thread sleeps on its
+  queueCondvar, signalled by the first command queued and by a full
+  pipeline. Commands left without a reply when the connection breaks
+  are counted as lost, not sent again.
+*/
+typedef struct {
+  pthread_rwlock_t lock;
+  RedisCommand *ring;             /* NULL: connection not in use */
+  u_int32_t head, num_queued, num_bytes;
+  struct timeval oldest;          /* Queue time of ring[head] (or earlier) */
+
+  /* Stats */
+  u_int64_t num_sent, num_pipelines, num_dropped, num_errors, num_lost;
+  u_int64_t last_sent, last_pipelines;
+} RedisQueue;
+#endif
+
+typedef struct {
+  time_t now;
   FILE *flowFd, *flowThroughputFd;
-  u_int totFlows, totFlowsRate, totFlowsSinceLastExport, queuedDataToExport;
+  u_int totFlows, totFlowsRate;
   u_int64_t totExports;
   u_int8_t shutdownInProgress:2, stopPacketCapture:1, nprobeStarted:1;
   u_int32_t flow_serial;
-  FlowHashBucket *exportQueue;
-  /* Export Options */
-  NetFlow5Record theV5Flow;
-  V9FlowHeader theV9Header;
-  IPFIXFlowHeader theIPFIXHeader;
-  int numFlows;
+  ExportWorker exportWorkers[MAX_NUM_EXPORT_THREADS];
   IpV4Fragment *fragmentsList[NUM_FRAGMENT_LISTS];
-  atomic_u_int32_t bucketsAllocated; /* We need to protect it as purgeBucket() decrements it,
-					and threads increment it as new buckets are allocated.
-					A sparse counter won't help as purgeBucket() asyncronously
-					decrements it
-				     */
 
-  u_int32_t exportBucketsLen, fragmentListLen[NUM_FRAGMENT_LISTS];
+  u_int32_t fragmentListLen[NUM_FRAGMENT_LISTS];
   u_short packetSentCount; /* packets sent before a delay */
   u_char num_src_mac_export;
 
@@ -1716,27 +1961,29 @@ typedef struct {
 } ipv4_deduplication;
 
   /* Threads */
-  pthread_rwlock_t exportMutex, fragmentMutex[NUM_FRAGMENT_LISTS];
-  pthread_rwlock_t rwGlobalsRwLock, exportRwLock, pcapLock, checkExportLock;
-  pthread_rwlock_t collectorRwLock, collectorCounterLock;
+  pthread_rwlock_t fragmentMutex[NUM_FRAGMENT_LISTS];
+  pthread_rwlock_t rwGlobalsRwLock, exportRwLock, pcapLock, exportStatsLock, sendLock;
+  pthread_rwlock_t collectorRwLock;
 #ifdef HAVE_GEOIP
   pthread_rwlock_t geoipRwLock;
 #endif
-  pthread_rwlock_t flowHashRwLock[MAX_NUM_PCAP_THREADS][MAX_HASH_MUTEXES], expireListLock, dumpFileLock;
-  ConditionalVariable exportQueueCondvar, termCondvar;
-  pthread_t dequeueThread, walkHashThread, statsThread;
+  pthread_rwlock_t flowHashRwLock[MAX_NUM_PCAP_THREADS][MAX_HASH_MUTEXES], dumpFileLock;
+  ConditionalVariable termCondvar;
+  pthread_t walkHashThread, statsThread;
+
+  CoarseClock clock;
 
   /* Stats */
   time_t lastSample;
-  Counter currentPkts[MAX_NUM_PCAP_THREADS], discardedPkts[MAX_NUM_PCAP_THREADS], currentBytes[MAX_NUM_PCAP_THREADS];
-  ProbeStats accumulateStats[MAX_NUM_PCAP_THREADS], lastMinStats;
+  ThreadStats threadStats[MAX_NUM_PCAP_THREADS]; /* Per processing thread */
+  ProbeStats lastMinStats;
 
   /* Collector */
   struct {
-    u_int32_t num_dissected_flow_packets, num_flows_unknown_template,
-      num_flows_processed, num_good_templates_received,
+    u_int32_t num_flows_unknown_template, num_good_templates_received,
       num_known_templates, num_bad_templates_received;
   } collectionStats;
+  CollectorSocket collectorSockets[MAX_NUM_COLLECTOR_THREADS]; /* --collector-reuseport */
 
   /* Probe */
   struct {
@@ -1749,7 +1996,7 @@ typedef struct {
       totExportedFlowPkts, totExportedFlowBytes, totJSONExports;
   } flowExportStats;
 
-  FlowSetV9Ipfix *v9_ipfix_templates;  /* Linked List */
+  TemplateCache templateCache; /* Collected V9/IPFIX templates */
   SelectorsList *selectors;
 
 #ifdef HAVE_SQLITE
@@ -1759,11 +2006,17 @@ typedef struct {
   u_int sql_row_idx;
   time_t idleTaskNextUpdate[MAX_NUM_PCAP_THREADS];
   FlowHashBucket **theFlowHash[MAX_NUM_PCAP_THREADS];
-  ItemsQueue packetQueues[MAX_NUM_PCAP_THREADS]; /* Packets waiting to be processed */
+  FlowTable flowTable[MAX_NUM_PCAP_THREADS]; /* Used with --flow-table grouped */
+  FlowBucketPool flowBucketPool[MAX_NUM_PCAP_THREADS];
+  MpscRing packetQueues[MAX_NUM_PCAP_THREADS]; /* Packets waiting to be processed */
+  PacketPool packetPools[MAX_NUM_PACKET_POOLS]; /* Per thread queueing packets */
+  u_int32_t numPacketPools;
+#ifdef HAVE_AF_PACKET
+  AfPacketSocket afPacket[MAX_NUM_PCAP_THREADS];
+#endif
 
-  /* Expire List */
-  FlowHashBucket *expireFlowListHead[MAX_NUM_PCAP_THREADS], *expireFlowListTail[MAX_NUM_PCAP_THREADS];
-  FlowHashBucket *idleFlowListHead[MAX_NUM_PCAP_THREADS], *idleFlowListTail[MAX_NUM_PCAP_THREADS];
+  /* Flow expiry: one timer wheel (and lock) per processing thread */
+  FlowTimerWheel flowTimers[MAX_NUM_PCAP_THREADS];
 
   u_int maxBucketSearch;
   struct timeval actTime;
@@ -1796,7 +2049,7 @@ typedef struct {
 #endif
 
   /* Stats */
-  u_long last_ps_recv, last_ps_drop, collectedPkts[MAX_NUM_COLLECTOR_THREADS];
+  u_long last_ps_recv, last_ps_drop;
   time_t lastThroughputDump;
 
 #ifdef HAVE_PF_RING
@@ -1816,6 +2069,8 @@ typedef struct {
       numLastGetCommands[MAX_NUM_REDIS_CONNECTIONS],
       numLastSetCommands[MAX_NUM_REDIS_CONNECTIONS],
       numLastLoggingCommands[MAX_NUM_REDIS_CONNECTIONS];
+    RedisQueue writeQueue[MAX_NUM_REDIS_CONNECTIONS], loggingQueue[MAX_NUM_REDIS_CONNECTIONS];
+    ConditionalVariable queueCondvar[MAX_NUM_REDIS_CONNECTIONS]; /* Wakes up redisAsyncLoop() */
   } redis;
 #endif
 
@@ -1871,10 +2126,13 @@ typedef struct {
 
 /* ********************************************* */
 
-extern void exportBucket(FlowHashBucket *myBucket, u_char free_memory);
+extern void exportBucket(ExportWorker *worker, FlowHashBucket *myBucket, u_char free_memory);
+extern u_int32_t getFlowSerial(FlowSerialBlock *block);
 extern void close_dump_file(void);
 
 /* nprobe.c */
+extern int checkPacketHeader(struct pcap_pkthdr *h);
+extern void decodePacketBatch(u_short thread_id, QueuedPacket **pkts, u_int32_t num);
 extern void decodePacket(u_short thread_id,
 			 int packet_if_idx /* -1 = unknown */,
 			 struct pcap_pkthdr *h, const u_char *p,
@@ -1884,6 +2142,13 @@ extern void decodePacket(u_short thread_id,
 			 int input_index, int output_index,
 			 u_int32_t flow_sender_ip,
 			 u_int32_t packet_hash);
+extern void decodePacketRef(u_short thread_id,
+			    int packet_if_idx /* -1 = unknown */,
+			    struct pcap_pkthdr *h, const u_char *p,
+			    u_int8_t sampledPacket,
+			    u_int8_t direction /* 1=RX, 0=TX */,
+			    u_int32_t packet_hash,
+			    PacketReleaseFct release, void *release_arg);
 extern void recycleBucket(FlowHashBucket *myBucket);
 extern void shutdown_nprobe(void);
 extern void initL7Discovery(void);
@@ -1911,7 +2176,7 @@ extern void oomTask(u_int8_t thread_id);
 extern void freenDPI(FlowHashBucket *myBucket);
 
 #ifdef HAVE_GEOIP
-extern void geoLocate(IpAddress *addr, HostInfo *bkt);
+extern void geoLocate(struct geoCache *cache, IpAddress *addr, HostInfo *bkt);
 #endif
 extern void timeval_diff(struct timeval *begin, struct timeval *end,
 			 struct timeval *result, u_short divide_by_two);
@@ -1919,10 +2184,21 @@ extern void timeval_diff(struct timeval *begin, struct timeval *end,
 /* collect.c */
 extern int createNetFlowListener(u_short collectorInPort);
 extern void closeNetFlowListener(void);
-extern void dissectNetFlow(u_int32_t netflow_device_ip, char *buffer, int bufferLen);
+extern void dissectNetFlow(u_short thread_id, u_int32_t netflow_device_ip, char *buffer, int bufferLen,
+			   u_int8_t transport /* IPPROTO_UDP or IPPROTO_SCTP */);
+extern void dumpCollectorSocketStats(void);
+extern void collectorBlast(char *pcap_path, u_int16_t port);
+extern void collectorBenchmark(char *pcap_path);
+extern u_int8_t dissectCustomField(struct generic_netflow_record *record,
+				   char *buffer, int bufferLen,
+				   u_int16_t displ, V9V10TemplateField *field,
+				   u_int32_t netflow_device_ip,
+				   u_int32_t *multiplier,
+				   u_int32_t *packet_offset,
+				   u_int8_t *skip_flow);
 
 /* sflow_collect.c */
-extern void dissectSflow(u_char *buffer, u_int buffer_len, struct sockaddr_in *fromHost);
+extern void dissectSflow(u_short thread_id, u_char *buffer, u_int buffer_len, struct sockaddr_in *fromHost);
 
 /* util.c */
 typedef u_int32_t (*ip_to_AS)(IpAddress ip);
@@ -1999,8 +2275,10 @@ extern int add_to_lru_cache_num(struct LruCache *cache, u_int64_t key, u_int32_t
 extern int add_to_lru_cache_str(struct LruCache *cache, char *key, char *value);
 extern char* find_lru_cache_str(struct LruCache *cache, char *key);
 extern int add_to_lru_cache_str_timeout(struct LruCache *cache, char *key, char *value, u_int32_t timeout);
+extern char* find_lru_cache_str_copy(struct LruCache *cache, char *key, char *buf, u_int buf_len);
 extern u_int32_t find_lru_cache_num(struct LruCache *cache, u_int64_t key);
-extern void test_lru_cache(struct LruCache *cache);
+extern void testLRU(u_int8_t num_threads);
+extern void redisBenchmark(u_int32_t num_commands);
 
 /* template.c */
 extern void printTemplateInfo(V9V10TemplateElementId *templates,
@@ -2024,6 +2302,12 @@ extern void flowPrintf(V9V10TemplateElementId **templateList,
 		       FlowHashBucket *theFlow, FlowDirection direction,
 		       int addTypeLen, int optionTemplate,
 		       u_int8_t json_mode);
+extern void compileTemplateProgram(TemplateBufferInfo *templateBuffer);
+extern void encodeFlowRecord(TemplateBufferInfo *templateBuffer,
+			     u_int8_t ipv4_template, char *outBuffer,
+			     u_int *outBufferBegin, u_int *outBufferMax,
+			     FlowHashBucket *theFlow, FlowDirection direction);
+extern void encodeBenchmark(u_int32_t num_flows);
 
 #ifdef WIN32
 extern char* nprobe_strdup(const char *str);
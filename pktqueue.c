@@ -0,0 +1,292 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+/*
+  Pool of the calling thread. Processing threads are given noPacketPool,
+  whose NULL descs tells queuePacket() to let them decode in place.
+*/
+static pthread_key_t packetPoolKey;
+static pthread_rwlock_t packetPoolsLock;
+static PacketPool noPacketPool;
+
+/* ****************************************************** */
+
+/* Called by the owner thread the first time it queues a packet */
+static int initPacketPool(PacketPool *pool, u_short pool_id) {
+  u_int32_t num = DEFAULT_QUEUE_CAPACITY * readOnlyGlobals.numProcessThreads, i;
+
+  if(initMpscRing(&pool->free_ring, num) != 0)
+    return(-1);
+
+  pool->descs = (QueuedPacket*)calloc(num, sizeof(QueuedPacket));
+  pool->bufs = (u_char*)malloc((size_t)num * readOnlyGlobals.snaplen);
+
+  if((pool->descs == NULL) || (pool->bufs == NULL)) {
+    traceEvent(TRACE_ERROR, "Not enough memory for packet pool %u", pool_id);
+    if(pool->descs) free(pool->descs);
+    if(pool->bufs) free(pool->bufs);
+    pool->descs = NULL, pool->bufs = NULL;
+    termMpscRing(&pool->free_ring);
+    return(-1);
+  }
+
+  pool->num_descs = num, pool->buf_len = readOnlyGlobals.snaplen;
+
+  for(i=0; i<num; i++) {
+    QueuedPacket *pkt = &pool->descs[i];
+
+    pkt->pool_id = pool_id, pkt->buf = &pool->bufs[(size_t)i * readOnlyGlobals.snaplen];
+    mpscRingEnqueue(&pool->free_ring, pkt);
+  }
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+void initPacketQueues(void) {
+  u_int32_t i;
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    /* Room for all the descriptors of a capture thread */
+    if(initMpscRing(&readWriteGlobals->packetQueues[i],
+		    DEFAULT_QUEUE_CAPACITY * readOnlyGlobals.numProcessThreads) != 0) {
+      traceEvent(TRACE_ERROR, "Not enough memory");
+      exit(-1);
+    }
+  }
+
+  /* Threads set up their pool when they queue their first packet */
+  pthread_key_create(&packetPoolKey, NULL);
+  pthread_rwlock_init(&packetPoolsLock, NULL);
+}
+
+/* ****************************************************** */
+
+/* Called by each processing thread before it dequeues packets */
+void setPacketProcessingThread(void) {
+  pthread_setspecific(packetPoolKey, &noPacketPool);
+}
+
+/* ****************************************************** */
+
+/*
+  Gives the calling thread a pool of its own. Decoding in place would
+  race with the processing thread of the same thread_id, so running out
+  of pools or memory is fatal as for the other startup allocations.
+*/
+static PacketPool* newPacketPool(void) {
+  PacketPool *pool;
+  u_int32_t pool_id;
+
+  pthread_rwlock_wrlock(&packetPoolsLock);
+  pool_id = readWriteGlobals->numPacketPools;
+  if(pool_id < MAX_NUM_PACKET_POOLS) readWriteGlobals->numPacketPools++;
+  pthread_rwlock_unlock(&packetPoolsLock);
+
+  if(pool_id >= MAX_NUM_PACKET_POOLS) {
+    traceEvent(TRACE_ERROR, "Too many threads queueing packets (max %u)", MAX_NUM_PACKET_POOLS);
+    exit(-1);
+  }
+
+  pool = &readWriteGlobals->packetPools[pool_id];
+
+  if(initPacketPool(pool, pool_id) != 0)
+    exit(-1);
+
+  pthread_setspecific(packetPoolKey, pool);
+  return(pool);
+}
+
+/* ****************************************************** */
+
+/*
+  Selects the processing thread of a packet. It only looks at addresses
+  and protocol, and it is symmetric: both directions of a flow, IP
+  fragments included, end up on the same thread.
+*/
+u_int32_t packetSteeringHash(struct pcap_pkthdr *h, const u_char *p) {
+  FlowHashKey steering;
+
+  if(parseFlowHashKeys(readOnlyGlobals.datalink, p, h->caplen, NULL, &steering) != 0)
+    return(0);
+
+  return(computeFlowHash(&steering));
+}
+
+/* ****************************************************** */
+
+/*
+  Hands the packet to processing thread (queue_id % numProcessThreads).
+  When release is NULL the packet is copied, otherwise p must stay valid
+  until release(release_arg) is called by the processing thread.
+
+  Returns -1 if the packet has not been queued, as the caller is a
+  processing thread: it has to process it (and release it) by itself.
+  thread_id is not used to pick the pool, the calling thread owns it.
+*/
+int queuePacket(u_short thread_id, u_int32_t queue_id,
+		int packet_if_idx,
+		struct pcap_pkthdr *h, const u_char *p,
+		u_int8_t sampledPacket, u_int8_t direction,
+		u_int32_t numPkts, int input_index, int output_index,
+		u_int32_t flow_sender_ip, u_int32_t packet_hash,
+		PacketReleaseFct release, void *release_arg) {
+  PacketPool *pool;
+  MpscRing *queue;
+  QueuedPacket *pkt;
+
+  if(unlikely((pool = (PacketPool*)pthread_getspecific(packetPoolKey)) == NULL))
+    pool = newPacketPool();
+
+  if(unlikely(pool->descs == NULL))
+    return(-1); /* noPacketPool */
+
+  while(pool->cache_len == 0) {
+    if((pool->cache_len = mpscRingDequeue(&pool->free_ring, pool->cache, RING_MAX_DEQUEUE_BATCH)) > 0)
+      break;
+
+    if(unlikely(readWriteGlobals->shutdownInProgress)) {
+      if(release != NULL) release(release_arg);
+      return(0);
+    }
+
+    /* All descriptors are in flight: wait until a processing thread hands one back */
+    pool->num_waits++;
+    mpscRingWait(&pool->free_ring);
+  }
+
+  pkt = (QueuedPacket*)pool->cache[--pool->cache_len];
+  pkt->packet_if_idx = packet_if_idx, pkt->packet_hash = packet_hash;
+  pkt->sampledPacket = sampledPacket, pkt->rx_direction = direction;
+  pkt->numPkts = numPkts, pkt->input_index = input_index, pkt->output_index = output_index;
+  pkt->flow_sender_ip = flow_sender_ip;
+  memcpy(&pkt->h, h, sizeof(struct pcap_pkthdr));
+  pkt->release = release, pkt->release_arg = release_arg;
+
+  if(release == NULL) {
+    pkt->h.caplen = min(h->caplen, pool->buf_len);
+    memcpy(pkt->buf, p, pkt->h.caplen);
+    pkt->p = pkt->buf, pool->num_copied++;
+  } else
+    pkt->p = p, pool->num_refs++;
+
+  queue = &readWriteGlobals->packetQueues[queue_id % readOnlyGlobals.numProcessThreads];
+
+  while(mpscRingEnqueue(queue, pkt) != 0) {
+    /* Several capture threads filled this queue */
+    if(unlikely(readWriteGlobals->shutdownInProgress)) {
+      releaseQueuedPacket(pkt);
+      return(0);
+    }
+
+    sched_yield();
+  }
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+/* Processing thread only: waits (spin, then sleep) when the queue is empty */
+u_int32_t dequeuePackets(u_short thread_id, QueuedPacket **pkts, u_int32_t max_pkts) {
+  MpscRing *queue = &readWriteGlobals->packetQueues[thread_id];
+  u_int32_t num;
+
+  if((num = mpscRingDequeue(queue, (void**)pkts, max_pkts)) == 0) {
+    mpscRingWait(queue);
+    num = mpscRingDequeue(queue, (void**)pkts, max_pkts);
+  }
+
+  return(num);
+}
+
+/* ****************************************************** */
+
+void releaseQueuedPacket(QueuedPacket *pkt) {
+  if(pkt->release != NULL) {
+    pkt->release(pkt->release_arg);
+    pkt->release = NULL;
+  }
+
+  /* The free ring can hold all the descriptors of the pool: this can't fail */
+  mpscRingEnqueue(&readWriteGlobals->packetPools[pkt->pool_id].free_ring, pkt);
+}
+
+/* ****************************************************** */
+
+/* Waits until the processing threads have released every queued packet */
+void drainPacketQueues(void) {
+  u_int32_t i;
+
+  for(i=0; i<readWriteGlobals->numPacketPools; i++) {
+    PacketPool *pool = &readWriteGlobals->packetPools[i];
+
+    if(pool->descs == NULL) continue;
+
+    /* Descriptors are back once they are in the free ring or in the owner cache */
+    while((!readWriteGlobals->shutdownInProgress)
+	  && ((mpscRingLen(&pool->free_ring) + pool->cache_len) < pool->num_descs))
+      usleep(1000);
+  }
+}
+
+/* ****************************************************** */
+
+void wakeupPacketQueues(void) {
+  u_int32_t i;
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++)
+    if(readWriteGlobals->packetQueues[i].slots != NULL)
+      mpscRingWakeup(&readWriteGlobals->packetQueues[i]);
+
+  for(i=0; i<readWriteGlobals->numPacketPools; i++)
+    if(readWriteGlobals->packetPools[i].descs != NULL)
+      mpscRingWakeup(&readWriteGlobals->packetPools[i].free_ring);
+}
+
+/* ****************************************************** */
+
+void dumpPacketQueueStats(void) {
+  u_int32_t i;
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    MpscRing *queue = &readWriteGlobals->packetQueues[i];
+
+    if(queue->slots == NULL) continue;
+
+    traceEvent(TRACE_NORMAL, "Packet queue [thread %u]: [%u queued][%u packets/%u batches][sleeps=%u][full=%u]",
+	       i, mpscRingLen(queue), queue->num_dequeued, queue->num_batches,
+	       queue->num_sleeps, queue->num_full);
+  }
+
+  for(i=0; i<readWriteGlobals->numPacketPools; i++) {
+    PacketPool *pool = &readWriteGlobals->packetPools[i];
+
+    if(pool->descs == NULL) continue;
+
+    traceEvent(TRACE_NORMAL, "Packet pool [%u]: [%u descriptors][copied=%u][zero copy=%u][waits=%u]",
+	       i, pool->num_descs, pool->num_copied, pool->num_refs, pool->num_waits);
+  }
+}
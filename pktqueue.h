@@ -0,0 +1,98 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _PKTQUEUE_H_
+#define _PKTQUEUE_H_
+
+/* ********************************** */
+
+#define DEFAULT_QUEUE_CAPACITY  1024
+#define PACKET_BATCH_MAX          64 /* --packet-batch */
+#define DEFAULT_PACKET_BATCH      RING_MAX_DEQUEUE_BATCH
+#define REPLAY_BENCH_MIN_MSEC   2000 /* --replay-bench: time spent on each burst size */
+#define MAX_NUM_PACKET_POOLS    (2 * MAX_NUM_PCAP_THREADS) /* Capture and collector threads */
+
+typedef void (*PacketReleaseFct)(void *release_arg);
+
+typedef struct queuedPacket {
+  u_int16_t pool_id;        /* Index of the pool owning the descriptor */
+  u_int8_t sampledPacket, rx_direction;
+  u_int32_t packet_hash, numPkts, flow_sender_ip;
+  int packet_if_idx /* -1 = unknown */, input_index, output_index;
+  struct pcap_pkthdr h;
+  const u_char *p;          /* Either buf or memory of the capture ring */
+  PacketReleaseFct release; /* NULL when p points to buf */
+  void *release_arg;
+  u_char *buf;              /* snaplen bytes */
+} QueuedPacket;
+
+/*
+  Packets are handed to the processing threads as QueuedPacket
+  descriptors queued on the MpscRing of the processing thread.
+
+  Each thread queueing packets (capture threads, collector threads
+  decoding sampled packets) owns a pool of descriptors, set up the first
+  time it queues and found through a thread specific key: the thread is
+  the only consumer of the free ring and the only user of the cache,
+  whatever thread_id it passes. The processing thread pushes a
+  descriptor back on the free ring of its pool once deepPacketDecode()
+  is over, calling its release function first when the packet still
+  lives in the capture ring (zero copy). Otherwise the packet has been
+  copied into the descriptor buffer. Both sides spin before sleeping on
+  a futex, so no syscall is issued while packets keep flowing.
+
+  Processing threads never queue (packets found inside packets, such as
+  sFlow samples, are decoded in place): they would wait for descriptors
+  sitting in their own queue.
+*/
+typedef struct packetPool {
+  QueuedPacket *descs;
+  u_char *bufs;
+  u_int32_t num_descs, buf_len;
+
+  /* Owner side */
+  void *cache[RING_MAX_DEQUEUE_BATCH];
+  u_int32_t cache_len;
+  u_int32_t num_copied, num_refs, num_waits;
+
+  MpscRing free_ring; /* Released descriptors */
+} PacketPool;
+
+/* ********************************** */
+
+extern void initPacketQueues(void);
+extern void setPacketProcessingThread(void);
+extern u_int32_t packetSteeringHash(struct pcap_pkthdr *h, const u_char *p);
+extern int queuePacket(u_short thread_id, u_int32_t queue_id,
+		       int packet_if_idx,
+		       struct pcap_pkthdr *h, const u_char *p,
+		       u_int8_t sampledPacket, u_int8_t direction,
+		       u_int32_t numPkts, int input_index, int output_index,
+		       u_int32_t flow_sender_ip, u_int32_t packet_hash,
+		       PacketReleaseFct release, void *release_arg);
+extern u_int32_t dequeuePackets(u_short thread_id, QueuedPacket **pkts, u_int32_t max_pkts);
+extern void releaseQueuedPacket(QueuedPacket *pkt);
+extern void drainPacketQueues(void);
+extern void wakeupPacketQueues(void);
+extern void dumpPacketQueueStats(void);
+
+#endif /* _PKTQUEUE_H_ */
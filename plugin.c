@@ -232,7 +232,7 @@ void initPlugins() {
       /* traceEvent(TRACE_INFO, "-> %s", readOnlyGlobals.all_plugins[i]->name); */
       if(readOnlyGlobals.all_plugins[i]->initFctn != NULL) readOnlyGlobals.all_plugins[i]->initFctn(readOnlyGlobals.argc, readOnlyGlobals.argv);
       if(readOnlyGlobals.all_plugins[i]->deleteFlowFctn != NULL) readOnlyGlobals.numDeleteFlowFctn++;
-      if(readOnlyGlobals.all_plugins[i]->packetFlowFctn != NULL) readOnlyGlobals.numPacketFlowFctn++;
+      if(hasPacketFlowFctn(readOnlyGlobals.all_plugins[i])) readOnlyGlobals.numPacketFlowFctn++;
     }
 
     i++;
@@ -345,22 +345,86 @@ void dumpPluginFamilies() {
 
 /* *********************************************** */
 
-void pluginCallback(u_char callbackType,
-		    int packet_if_idx /* -1 = unknown */,
-		    FlowHashBucket* bkt,
-		    FlowDirection direction,
-		    u_int16_t ip_offset, u_short proto, u_char isFragment,
-		    u_short numPkts, u_char tos,
-		    u_int8_t retransmitted_pkt,
-		    u_short vlanId, struct eth_header *ehdr,
-		    IpAddress *src, u_short sport,
-		    IpAddress *dst, u_short dport,
-		    u_int len, u_int8_t flags,
-		    u_int32_t tcpSeqNum, u_int8_t icmpType,
-		    u_short numMplsLabels,
-		    u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN],
-		    const struct pcap_pkthdr *h, const u_char *p,
-		    u_char *payload, int payloadLen) {
+/*
+  The descriptor callback is not part of PluginEntryPoint: binary plugins
+  built before it existed return a shorter structure. Plugins that want
+  it register it from their initFctn.
+*/
+static struct {
+  PluginEntryPoint *plugin;
+  PluginDecodedPacketFctn fctn;
+} decodedPacketFctns[MAX_NUM_PLUGINS];
+static u_int8_t numDecodedPacketFctns = 0;
+
+int registerDecodedPacketFctn(PluginEntryPoint *plugin, PluginDecodedPacketFctn fctn) {
+  int i;
+
+  for(i=0; i<numDecodedPacketFctns; i++)
+    if(decodedPacketFctns[i].plugin == plugin) {
+      decodedPacketFctns[i].fctn = fctn;
+      return(0);
+    }
+
+  if(numDecodedPacketFctns >= MAX_NUM_PLUGINS) {
+    traceEvent(TRACE_WARNING, "Too many plugin packet callbacks: %s ignored",
+	       plugin->name ? plugin->name : "");
+    return(-1);
+  }
+
+  decodedPacketFctns[numDecodedPacketFctns].plugin = plugin;
+  decodedPacketFctns[numDecodedPacketFctns].fctn = fctn;
+  numDecodedPacketFctns++;
+  return(0);
+}
+
+/* *********************************************** */
+
+PluginDecodedPacketFctn getDecodedPacketFctn(PluginEntryPoint *plugin) {
+  int i;
+
+  /*
+    Linear in the number of plugins that registered one (a handful at
+    most): when none did, as with legacy plugins, the loop does not run
+  */
+  for(i=0; i<numDecodedPacketFctns; i++)
+    if(decodedPacketFctns[i].plugin == plugin)
+      return(decodedPacketFctns[i].fctn);
+
+  return(NULL);
+}
+
+/* *********************************************** */
+
+/*
+  Plugins written against the original API get the descriptor unpacked
+  into the packetFlowFctn arguments: only they pay for them. Does nothing
+  for plugins with neither callback, so callers need not check
+  hasPacketFlowFctn() (and look the registration up twice) first.
+*/
+static void callPacketFlowFctn(PluginEntryPoint *plugin, u_char new_bucket, void *pluginData,
+			       FlowHashBucket *bkt, FlowDirection direction, DecodedPacket *pkt) {
+  PluginDecodedPacketFctn decodedPacketFctn = getDecodedPacketFctn(plugin);
+
+  if(decodedPacketFctn != NULL)
+    decodedPacketFctn(new_bucket, pluginData, bkt, direction, pkt);
+  else if(plugin->packetFlowFctn != NULL)
+    plugin->packetFlowFctn(new_bucket, pkt->packet_if_idx,
+			   pluginData, bkt, direction,
+			   pkt->ip_offset, pkt->proto, (pkt->numFragments > 0) ? 1 : 0,
+			   pkt->numPkts, pkt->tos, pkt->retransmitted_pkt,
+			   pkt->vlanId, pkt->ehdr,
+			   pkt->src, pkt->sport,
+			   pkt->dst, pkt->dport,
+			   pkt->len, pkt->tcpFlags, pkt->tcpSeqNum, pkt->icmpType,
+			   pkt->numMplsLabels, pkt->mplsLabels,
+			   pkt->h, pkt->p, pkt->payload, pkt->payloadLen);
+}
+
+/* *********************************************** */
+
+/* pkt is NULL for DELETE_FLOW_CALLBACK */
+void pluginCallback(u_char callbackType, FlowHashBucket* bkt,
+		    FlowDirection direction, DecodedPacket *pkt) {
   int i = 0;
 
   if(readOnlyGlobals.num_active_plugins == 0) return;
@@ -368,21 +432,9 @@ void pluginCallback(u_char callbackType,
   switch(callbackType) {
   case CREATE_FLOW_CALLBACK:
     while(readOnlyGlobals.all_active_plugins[i] != NULL) {
-      if((readOnlyGlobals.all_active_plugins[i]->enabled)
-	 && (readOnlyGlobals.all_active_plugins[i]->packetFlowFctn != NULL)) {
-	readOnlyGlobals.all_active_plugins[i]->packetFlowFctn(1 /* new flow */,
-							      packet_if_idx,
-							      NULL, bkt,
-							      direction,
-							      ip_offset, proto, isFragment,
-							      numPkts, tos, retransmitted_pkt,
-							      vlanId, ehdr,
-							      src, sport,
-							      dst, dport,
-							      len, flags, tcpSeqNum, icmpType,
-							      numMplsLabels,
-							      mplsLabels,
-							      h, p, payload, payloadLen);
+      if(readOnlyGlobals.all_active_plugins[i]->enabled) {
+	callPacketFlowFctn(readOnlyGlobals.all_active_plugins[i], 1 /* new flow */,
+			   NULL, bkt, direction, pkt);
       }
 
       i++;
@@ -418,21 +470,9 @@ void pluginCallback(u_char callbackType,
 	if(plugin->pluginPtr == NULL)
 	  break;
 	else if((plugin->plugin_used == 1)
-		&& (plugin->pluginPtr->packetFlowFctn != NULL)
 		&& plugin->pluginPtr->call_packetFlowFctn_for_each_packet) {
-	  plugin->pluginPtr->packetFlowFctn(0 /* existing flow */,
-					    packet_if_idx,
-					    plugin->pluginData,
-					    bkt, direction,
-					    ip_offset, proto, isFragment,
-					    numPkts, tos, retransmitted_pkt,
-					    vlanId, ehdr,
-					    src, sport,
-					    dst, dport,
-					    len, flags, tcpSeqNum, icmpType,
-					    numMplsLabels,
-					    mplsLabels,
-					    h, p, payload, payloadLen);
+	  callPacketFlowFctn(plugin->pluginPtr, 0 /* existing flow */,
+			     plugin->pluginData, bkt, direction, pkt);
 	}
 
 	/*
@@ -1065,3 +1105,165 @@ void pluginIdleThreadTask(void) {
     i++;
   }
 }
+
+/* ******************************************** */
+
+/*
+  --call-bench: cost of handing a packet from the decoder to a plugin
+  through the flow engine. The "argument list" chain reproduces the
+  former signatures (45 arguments to the engine, 27 to the plugin
+  callback and to the plugin); the "descriptor" chain passes a
+  DecodedPacket pointer, and the "shim" chain ends in a plugin that
+  only implements packetFlowFctn. The layers are not inlined so only
+  the calls are measured.
+*/
+
+static volatile u_int32_t callBenchSink;
+
+static void __attribute__((noinline))
+benchPacketFlowFctn(u_char new_bucket, int packet_if_idx, void *pluginData,
+		    FlowHashBucket *bkt, FlowDirection flow_direction,
+		    u_int16_t ip_offset, u_short proto, u_char isFragment,
+		    u_short numPkts, u_char tos, u_int8_t retransmitted_pkt,
+		    u_short vlanId, struct eth_header *ehdr,
+		    IpAddress *src, u_short sport, IpAddress *dst, u_short dport,
+		    u_int len, u_int8_t flags, u_int32_t tcpSeqNum,
+		    u_int8_t icmpType, u_short numMplsLabels,
+		    u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN],
+		    const struct pcap_pkthdr *h, const u_char *p,
+		    u_char *payload, int payloadLen) {
+  callBenchSink += sport + dport + len + payloadLen;
+}
+
+static void __attribute__((noinline))
+benchDecodedPacketFctn(u_char new_bucket, void *pluginData,
+		       FlowHashBucket *bkt, FlowDirection flow_direction,
+		       DecodedPacket *pkt) {
+  callBenchSink += pkt->sport + pkt->dport + pkt->len + pkt->payloadLen;
+}
+
+static void __attribute__((noinline))
+benchArgsCallback(PluginPacketFctn fctn, FlowHashBucket *bkt, FlowDirection direction,
+		  int packet_if_idx, u_int16_t ip_offset, u_short proto, u_char isFragment,
+		  u_short numPkts, u_char tos, u_int8_t retransmitted_pkt,
+		  u_short vlanId, struct eth_header *ehdr,
+		  IpAddress *src, u_short sport, IpAddress *dst, u_short dport,
+		  u_int len, u_int8_t flags, u_int32_t tcpSeqNum,
+		  u_int8_t icmpType, u_short numMplsLabels,
+		  u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN],
+		  const struct pcap_pkthdr *h, const u_char *p,
+		  u_char *payload, int payloadLen) {
+  fctn(0, packet_if_idx, NULL, bkt, direction, ip_offset, proto, isFragment,
+       numPkts, tos, retransmitted_pkt, vlanId, ehdr, src, sport, dst, dport,
+       len, flags, tcpSeqNum, icmpType, numMplsLabels, mplsLabels, h, p, payload, payloadLen);
+}
+
+static void __attribute__((noinline))
+benchArgsEngine(PluginPacketFctn fctn, FlowHashBucket *bkt,
+		int packet_if_idx, u_int8_t rx_packet,
+		u_int32_t subflow_id, u_int8_t proto, u_short numFragments,
+		u_int16_t ip_offset, u_int8_t sampledPacket,
+		u_short numPkts, u_int8_t tos, u_int8_t ttl,
+		u_short vlanId, u_int32_t tunnel_id, u_int16_t gtp_offset,
+		struct eth_header *ehdr,
+		IpAddress *src, u_short sport, IpAddress *dst, u_short dport,
+		u_int8_t untunneled_proto,
+		IpAddress *untunneled_src, u_short untunneled_sport,
+		IpAddress *untunneled_dst, u_short untunneled_dport,
+		u_int len, u_int16_t tcpWin, u_int8_t tcpFlags,
+		u_int32_t tcpSeqNum, u_int32_t tcpAckNum,
+		u_int16_t tcpMaxSegmentSize, u_int8_t tcpWinScale,
+		u_int8_t icmpType, u_int8_t icmpCode,
+		u_short numMplsLabels,
+		u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN],
+		u_int32_t if_input, u_int32_t if_output,
+		struct pcap_pkthdr *h, u_char *p,
+		u_int16_t payload_shift, u_int payloadLen,
+		u_int originalPayloadLen, time_t firstSeen,
+		u_int32_t src_as, u_int32_t dst_as,
+		u_int16_t src_mask, u_int16_t dst_mask,
+		u_int32_t flow_sender_ip, u_int32_t packet_hash,
+		u_int8_t engine_type, u_int8_t engine_id,
+		char *osi_src, char *osi_dst,
+		struct generic_netflow_record *record) {
+  benchArgsCallback(fctn, bkt, src2dst_direction, packet_if_idx, ip_offset, proto,
+		    (numFragments > 0) ? 1 : 0, numPkts, tos, 0, vlanId, ehdr,
+		    src, sport, dst, dport, len, tcpFlags, tcpSeqNum, icmpType,
+		    numMplsLabels, mplsLabels, h, p, &p[payload_shift], payloadLen);
+}
+
+static void __attribute__((noinline))
+benchDescriptorCallback(PluginEntryPoint *plugin, FlowHashBucket *bkt,
+			FlowDirection direction, DecodedPacket *pkt) {
+  callPacketFlowFctn(plugin, 0, NULL, bkt, direction, pkt);
+}
+
+static void __attribute__((noinline))
+benchDescriptorEngine(PluginEntryPoint *plugin, FlowHashBucket *bkt, DecodedPacket *pkt) {
+  pkt->payload = &pkt->p[pkt->payload_shift];
+  benchDescriptorCallback(plugin, bkt, src2dst_direction, pkt);
+}
+
+/* ******************************************** */
+
+void callOverheadBenchmark(u_int32_t num_calls) {
+  u_char mplsLabels[MAX_NUM_MPLS_LABELS][MPLS_LABEL_LEN], p[128];
+  PluginEntryPoint descriptorPlugin, legacyPlugin;
+  IpAddress src, dst, untunneled_src, untunneled_dst;
+  struct timeval start, end;
+  struct pcap_pkthdr h;
+  DecodedPacket pkt;
+  float args_ns, descriptor_ns, shim_ns;
+  u_int32_t i;
+
+  memset(mplsLabels, 0, sizeof(mplsLabels)), memset(p, 0, sizeof(p));
+  memset(&src, 0, sizeof(src)), memset(&dst, 0, sizeof(dst));
+  memset(&untunneled_src, 0, sizeof(untunneled_src)), memset(&untunneled_dst, 0, sizeof(untunneled_dst));
+  src.ipVersion = dst.ipVersion = 4, src.ipType.ipv4 = 0xC0A80001, dst.ipType.ipv4 = 0xC0A80002;
+  memset(&h, 0, sizeof(h));
+  gettimeofday(&h.ts, NULL), h.caplen = h.len = sizeof(p);
+
+  memset(&descriptorPlugin, 0, sizeof(descriptorPlugin)), memset(&legacyPlugin, 0, sizeof(legacyPlugin));
+  registerDecodedPacketFctn(&descriptorPlugin, benchDecodedPacketFctn);
+  legacyPlugin.packetFlowFctn = benchPacketFlowFctn;
+
+  gettimeofday(&start, NULL);
+  for(i=0; i<num_calls; i++)
+    benchArgsEngine(benchPacketFlowFctn, NULL, -1, 1, 0, IPPROTO_TCP, 0, 14, 0, 1, 0, 64,
+		    0, 0, 0, NULL, &src, 1024 + (i & 0xFF), &dst, 80, 0,
+		    &untunneled_src, 0, &untunneled_dst, 0,
+		    sizeof(p), 8192, 0x18, i, i, 1460, 7, 0, 0, 0, mplsLabels,
+		    NO_INTERFACE_INDEX, NO_INTERFACE_INDEX, &h, p, 54, sizeof(p) - 54, sizeof(p) - 54, 0,
+		    0, 0, 0, 0, 0, 0, 0, 0, NULL, NULL, NULL);
+  gettimeofday(&end, NULL);
+  args_ns = (timevalDiff(&end, &start) * 1000000000) / num_calls;
+
+  /* As filled by deepPacketDecode() */
+  memset(&pkt, 0, sizeof(pkt));
+  pkt.packet_if_idx = -1, pkt.rx_packet = 1, pkt.proto = IPPROTO_TCP, pkt.ip_offset = 14;
+  pkt.numPkts = 1, pkt.ttl = 64, pkt.src = &src, pkt.dst = &dst, pkt.dport = 80;
+  pkt.untunneled_src = &untunneled_src, pkt.untunneled_dst = &untunneled_dst;
+  pkt.len = sizeof(p), pkt.tcpWin = 8192, pkt.tcpFlags = 0x18, pkt.tcpMaxSegmentSize = 1460, pkt.tcpWinScale = 7;
+  pkt.mplsLabels = mplsLabels, pkt.if_input = pkt.if_output = NO_INTERFACE_INDEX;
+  pkt.h = &h, pkt.p = p, pkt.payload_shift = 54, pkt.payloadLen = pkt.originalPayloadLen = sizeof(p) - 54;
+
+  gettimeofday(&start, NULL);
+  for(i=0; i<num_calls; i++) {
+    pkt.sport = 1024 + (i & 0xFF), pkt.tcpSeqNum = pkt.tcpAckNum = i;
+    benchDescriptorEngine(&descriptorPlugin, NULL, &pkt);
+  }
+  gettimeofday(&end, NULL);
+  descriptor_ns = (timevalDiff(&end, &start) * 1000000000) / num_calls;
+
+  gettimeofday(&start, NULL);
+  for(i=0; i<num_calls; i++) {
+    pkt.sport = 1024 + (i & 0xFF), pkt.tcpSeqNum = pkt.tcpAckNum = i;
+    benchDescriptorEngine(&legacyPlugin, NULL, &pkt);
+  }
+  gettimeofday(&end, NULL);
+  shim_ns = (timevalDiff(&end, &start) * 1000000000) / num_calls;
+
+  traceEvent(TRACE_NORMAL, "Call benchmark [%u calls]: [argument list %.2f ns/pkt][descriptor %.2f ns/pkt]"
+	     "[descriptor to packetFlowFctn plugin %.2f ns/pkt]",
+	     num_calls, args_ns, descriptor_ns, shim_ns);
+}
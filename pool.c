@@ -0,0 +1,299 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+#ifndef WIN32
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
+
+/* ****************************************************** */
+
+static u_int32_t alignLen(u_int32_t len, u_int32_t align) {
+  return((len + align - 1) & ~(align - 1));
+}
+
+/* ****************************************************** */
+
+/*
+  The arena is reserved but not touched: blocks are handed out with a
+  bump index first so only the pages actually used are committed.
+*/
+static u_char* allocArena(u_int64_t len) {
+  u_char *arena;
+
+#ifndef WIN32
+  arena = (u_char*)mmap(NULL, len, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if(arena == (u_char*)MAP_FAILED) arena = NULL;
+#else
+  arena = (u_char*)malloc(len);
+#endif
+
+  return(arena);
+}
+
+/* ****************************************************** */
+
+static void freeArena(u_char *arena, u_int64_t len) {
+#ifndef WIN32
+  munmap(arena, len);
+#else
+  free(arena);
+#endif
+}
+
+/* ****************************************************** */
+
+/* Heap fallback: buckets are one cache line each and must not straddle two */
+FlowHashBucket* allocAlignedBucket(void) {
+  void *bkt;
+
+#ifndef WIN32
+  if(posix_memalign(&bkt, FLOW_BUCKET_LEN, sizeof(FlowHashBucket)) != 0)
+    return(NULL);
+#else
+  if((bkt = _aligned_malloc(sizeof(FlowHashBucket), FLOW_BUCKET_LEN)) == NULL)
+    return(NULL);
+#endif
+
+  memset(bkt, 0, sizeof(FlowHashBucket));
+  return((FlowHashBucket*)bkt);
+}
+
+/* ****************************************************** */
+
+void freeAlignedBucket(FlowHashBucket *bkt) {
+#ifndef WIN32
+  free(bkt);
+#else
+  _aligned_free(bkt);
+#endif
+}
+
+/* ****************************************************** */
+
+void initFlowBucketPools(void) {
+  u_int64_t max_flows = readOnlyGlobals.maxNumActiveFlows;
+  u_int32_t block_size, ext_offset, extensions_offset = 0;
+  u_int32_t ndpi_flow_offset = 0, ndpi_src_offset = 0, ndpi_dst_offset = 0;
+  u_int32_t num_blocks, i;
+  u_int8_t has_extensions = readOnlyGlobals.enableExtBucket ? 1 : 0;
+  u_int8_t has_ndpi = (readOnlyGlobals.enable_l7_protocol_discovery
+		       && (readOnlyGlobals.l7.flow_struct_size > 0)) ? 1 : 0;
+
+  if((max_flows == 0) || (max_flows == (u_int)-1))
+    max_flows = (u_int64_t)readOnlyGlobals.flowHashSize * 4;
+
+  num_blocks = (u_int32_t)(max_flows / readOnlyGlobals.numProcessThreads);
+  if(num_blocks < POOL_MIN_NUM_BLOCKS) num_blocks = POOL_MIN_NUM_BLOCKS;
+
+  /* Block layout: keep every part 16-byte aligned and blocks on cache line boundaries */
+  block_size = alignLen(sizeof(FlowHashBucket), POOL_CACHE_LINE_LEN);
+  ext_offset = block_size, block_size += alignLen(sizeof(FlowHashExtendedBucket), 16);
+
+  if(has_extensions)
+    extensions_offset = block_size, block_size += alignLen(sizeof(FlowHashBucketExtensions), 16);
+
+  if(has_ndpi) {
+    ndpi_flow_offset = block_size, block_size += alignLen(readOnlyGlobals.l7.flow_struct_size, 16);
+    ndpi_src_offset  = block_size, block_size += alignLen(readOnlyGlobals.l7.proto_size, 16);
+    ndpi_dst_offset  = block_size, block_size += alignLen(readOnlyGlobals.l7.proto_size, 16);
+  }
+
+  block_size = alignLen(block_size, POOL_CACHE_LINE_LEN);
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    FlowBucketPool *pool = &readWriteGlobals->flowBucketPool[i];
+    u_int32_t n = num_blocks;
+
+    memset(pool, 0, sizeof(FlowBucketPool));
+
+    /* Not enough address space/memory: shrink the arena and let the heap handle the rest */
+    while((pool->arena = allocArena((u_int64_t)n * block_size)) == NULL) {
+      if(n <= POOL_MIN_NUM_BLOCKS) break;
+      n /= 2;
+    }
+
+    if(pool->arena == NULL) {
+      traceEvent(TRACE_WARNING, "Unable to allocate flow bucket pool for thread %u: using heap", i);
+      continue;
+    }
+
+    pool->arena_len = (u_int64_t)n * block_size, pool->num_blocks = n, pool->block_size = block_size;
+    pool->ext_offset = ext_offset, pool->extensions_offset = extensions_offset;
+    pool->ndpi_flow_offset = ndpi_flow_offset, pool->ndpi_src_offset = ndpi_src_offset,
+      pool->ndpi_dst_offset = ndpi_dst_offset;
+    pool->has_extensions = has_extensions, pool->has_ndpi = has_ndpi;
+
+    /* Collector threads share the thread ids of the capture threads */
+    pool->shared_owner = (readOnlyGlobals.flowCollection.collectorInPort > 0) ? 1 : 0;
+    pthread_rwlock_init(&pool->owner_lock, NULL);
+#ifndef HAVE_BUILTIN_ATOMIC
+    pthread_rwlock_init(&pool->remote_lock, NULL);
+#endif
+
+    if(n < num_blocks)
+      traceEvent(TRACE_WARNING, "Flow bucket pool for thread %u shrunk to %u blocks", i, n);
+  }
+
+  traceEvent(TRACE_INFO, "Flow bucket pools: %u thread(s) x %u blocks [%u bytes/block]",
+	     readOnlyGlobals.numProcessThreads, num_blocks, block_size);
+}
+
+/* ****************************************************** */
+
+void termFlowBucketPools(void) {
+  u_int32_t i;
+
+  for(i=0; i<MAX_NUM_PCAP_THREADS; i++) {
+    FlowBucketPool *pool = &readWriteGlobals->flowBucketPool[i];
+
+    if(pool->arena == NULL) continue;
+
+    freeArena(pool->arena, pool->arena_len);
+    pool->arena = NULL, pool->num_blocks = 0;
+    pthread_rwlock_destroy(&pool->owner_lock);
+#ifndef HAVE_BUILTIN_ATOMIC
+    pthread_rwlock_destroy(&pool->remote_lock);
+#endif
+  }
+}
+
+/* ****************************************************** */
+
+/*
+  Returns a zeroed bucket whose ext, extensions and nDPI pointers point
+  inside the same block, or NULL when the caller has to use the heap.
+*/
+FlowHashBucket* poolAllocBucket(u_short thread_id) {
+  FlowBucketPool *pool;
+  FlowHashBucket *bkt;
+  u_char *block = NULL;
+
+  if(unlikely(thread_id >= MAX_NUM_PCAP_THREADS)) return(NULL);
+
+  pool = &readWriteGlobals->flowBucketPool[thread_id];
+  if(unlikely(pool->arena == NULL)) return(NULL);
+
+  /* The layout has been computed at startup: don't hand out blocks too small */
+  if(unlikely((readOnlyGlobals.enableExtBucket && (!pool->has_extensions))
+	      || (readOnlyGlobals.enable_l7_protocol_discovery && (!pool->has_ndpi)))) {
+    pool->num_heap_fallback++;
+    return(NULL);
+  }
+
+  if(unlikely(pool->shared_owner)) pthread_rwlock_wrlock(&pool->owner_lock);
+
+  if((pool->local_free == NULL) && (pool->remote_free != NULL)) {
+    /* Take the whole list of blocks released by other threads */
+#ifdef HAVE_BUILTIN_ATOMIC
+    pool->local_free = __sync_lock_test_and_set(&pool->remote_free, NULL);
+#else
+    pthread_rwlock_wrlock(&pool->remote_lock);
+    pool->local_free = pool->remote_free, pool->remote_free = NULL;
+    pthread_rwlock_unlock(&pool->remote_lock);
+#endif
+  }
+
+  if(pool->local_free != NULL) {
+    block = (u_char*)pool->local_free;
+    pool->local_free = *((void**)block);
+  } else if(pool->next_unused < pool->num_blocks)
+    block = &pool->arena[(u_int64_t)pool->next_unused++ * pool->block_size];
+
+  if(block != NULL)
+    pool->num_alloc++;
+  else
+    pool->num_heap_fallback++;
+
+  if(unlikely(pool->shared_owner)) pthread_rwlock_unlock(&pool->owner_lock);
+
+  if(block == NULL) return(NULL);
+
+  memset(block, 0, pool->block_size);
+
+  bkt = (FlowHashBucket*)block;
+  bkt->ext = (FlowHashExtendedBucket*)&block[pool->ext_offset];
+  bkt->ext->pool_id = thread_id + 1;
+
+  if(readOnlyGlobals.enableExtBucket)
+    bkt->ext->extensions = (FlowHashBucketExtensions*)&block[pool->extensions_offset];
+
+  if(readOnlyGlobals.enable_l7_protocol_discovery) {
+    bkt->ext->cold.l7.proto.ndpi.flow = (void*)&block[pool->ndpi_flow_offset];
+    bkt->ext->cold.l7.proto.ndpi.src  = (void*)&block[pool->ndpi_src_offset];
+    bkt->ext->cold.l7.proto.ndpi.dst  = (void*)&block[pool->ndpi_dst_offset];
+  }
+
+  return(bkt);
+}
+
+/* ****************************************************** */
+
+/* Can be called by any thread: the block goes back to the pool of its owner */
+void poolReleaseBucket(FlowHashBucket *bkt) {
+  FlowBucketPool *pool = &readWriteGlobals->flowBucketPool[bkt->ext->pool_id - 1];
+  void **block = (void**)bkt;
+
+#ifdef HAVE_BUILTIN_ATOMIC
+  void *head;
+
+  do {
+    head = pool->remote_free;
+    *block = head;
+  } while(!__sync_bool_compare_and_swap(&pool->remote_free, head, (void*)block));
+
+  __sync_fetch_and_add(&pool->num_returned, 1);
+#else
+  pthread_rwlock_wrlock(&pool->remote_lock);
+  *block = pool->remote_free, pool->remote_free = (void*)block;
+  pool->num_returned++;
+  pthread_rwlock_unlock(&pool->remote_lock);
+#endif
+}
+
+/* ****************************************************** */
+
+void dumpFlowBucketPoolStats(void) {
+  u_int32_t i;
+
+  for(i=0; i<readOnlyGlobals.numProcessThreads; i++) {
+    FlowBucketPool *pool = &readWriteGlobals->flowBucketPool[i];
+    u_int32_t in_use;
+
+    if(pool->arena == NULL) continue;
+
+    in_use = pool->num_alloc - pool->num_returned;
+
+    traceEvent(TRACE_NORMAL, "Flow bucket pool [thread %u]: [in use=%u/%u blocks][%.1f %%]"
+	       "[touched=%u][heap fallbacks=%u]",
+	       i, in_use, pool->num_blocks,
+	       ((float)in_use * 100)/(float)pool->num_blocks,
+	       pool->next_unused, pool->num_heap_fallback);
+  }
+}
@@ -0,0 +1,77 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/* ********************************** */
+
+#define POOL_CACHE_LINE_LEN        64
+#define POOL_MIN_NUM_BLOCKS      1024
+
+/*
+  A flow block holds, one after the other, everything allocFlowBucket()
+  used to calloc() separately:
+
+  [FlowHashBucket][FlowHashExtendedBucket][FlowHashBucketExtensions][nDPI flow][nDPI src][nDPI dst]
+
+  Optional parts (extensions, nDPI) are present only when enabled at
+  startup. Each capture thread owns an arena of such blocks: it is the
+  only one that allocates from it, whereas any thread (usually the export
+  thread) can hand a block back by pushing it on the lock-free
+  remote_free stack. The owner grabs the whole remote stack at once when
+  its local free list runs dry, so no ABA can happen.
+*/
+typedef struct flowBucketPool {
+  u_char *arena;
+  u_int64_t arena_len;
+  u_int32_t block_size, num_blocks;
+  u_int32_t ext_offset, extensions_offset;
+  u_int32_t ndpi_flow_offset, ndpi_src_offset, ndpi_dst_offset;
+  u_int8_t has_extensions, has_ndpi, shared_owner;
+
+  /* Owner side */
+  pthread_rwlock_t owner_lock; /* Used only when shared_owner is set */
+  u_int32_t next_unused;       /* Blocks above it have never been touched */
+  void *local_free;
+  u_int32_t num_alloc, num_heap_fallback;
+
+  /* Written by the threads that release blocks: keep it on its own cache line */
+  char pad[POOL_CACHE_LINE_LEN];
+  void *remote_free;
+  u_int32_t num_returned;
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_t remote_lock;
+#endif
+} FlowBucketPool;
+
+/* ********************************** */
+
+extern void initFlowBucketPools(void);
+extern void termFlowBucketPools(void);
+extern FlowHashBucket* poolAllocBucket(u_short thread_id);
+extern void poolReleaseBucket(FlowHashBucket *bkt);
+extern void dumpFlowBucketPoolStats(void);
+extern FlowHashBucket* allocAlignedBucket(void);
+extern void freeAlignedBucket(FlowHashBucket *bkt);
+
+#endif /* _POOL_H_ */
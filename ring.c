@@ -0,0 +1,319 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+#ifdef HAVE_BUILTIN_ATOMIC
+#define ringBarrier() __sync_synchronize()
+#else
+#define ringBarrier()
+#endif
+
+/* ****************************************************** */
+
+static __inline__ void cpuRelax(void) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  __asm__ __volatile__("pause" ::: "memory");
+#endif
+}
+
+/* ****************************************************** */
+
+#ifdef linux
+static void futexWait(volatile int *addr, int value, u_int32_t msec) {
+  struct timespec ts;
+
+  ts.tv_sec = msec / 1000, ts.tv_nsec = (msec % 1000) * 1000000;
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, &ts, NULL, 0);
+}
+
+/* ****************************************************** */
+
+static void futexWake(volatile int *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#endif
+
+/* ****************************************************** */
+
+int initMpscRing(MpscRing *r, u_int32_t min_size) {
+  u_int32_t size = 2, i;
+
+  while((size < min_size) && (size < 0x80000000))
+    size <<= 1;
+
+  memset(r, 0, sizeof(MpscRing));
+
+  if((r->slots = (RingSlot*)calloc(size, sizeof(RingSlot))) == NULL) {
+    traceEvent(TRACE_ERROR, "Not enough memory for a %u slots ring", size);
+    return(-1);
+  }
+
+  for(i=0; i<size; i++) r->slots[i].seq = i;
+
+  r->size = size, r->mask = size - 1;
+  r->spin_loops = RING_MIN_SPIN_LOOPS;
+
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_init(&r->lock, NULL);
+#endif
+#ifndef linux
+  createCondvar(&r->condvar);
+#endif
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+void termMpscRing(MpscRing *r) {
+  if(r->slots == NULL) return;
+
+  free(r->slots);
+  r->slots = NULL;
+
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_destroy(&r->lock);
+#endif
+#ifndef linux
+  deleteCondvar(&r->condvar);
+#endif
+}
+
+/* ****************************************************** */
+
+/* Returns -1 if the ring is full: the caller still owns the item */
+int mpscRingEnqueue(MpscRing *r, void *item) {
+  RingSlot *slot;
+  u_int32_t pos;
+
+#ifdef HAVE_BUILTIN_ATOMIC
+  while(1) {
+    int32_t diff;
+
+    pos = r->tail, slot = &r->slots[pos & r->mask];
+    diff = (int32_t)(slot->seq - pos);
+
+    if(diff == 0) {
+      if(__sync_bool_compare_and_swap(&r->tail, pos, pos + 1))
+	break;
+    } else if(diff < 0) {
+      r->num_full++;
+      return(-1);
+    }
+  }
+
+  slot->item = item;
+  ringBarrier();
+  slot->seq = pos + 1;
+
+  /* Pairs with the barrier in mpscRingWait(): either we see the flag or the consumer sees the item */
+  ringBarrier();
+  if(r->consumer_sleeping && __sync_bool_compare_and_swap(&r->consumer_sleeping, 1, 0))
+    mpscRingWakeup(r);
+#else
+  pthread_rwlock_wrlock(&r->lock);
+  pos = r->tail, slot = &r->slots[pos & r->mask];
+
+  if(slot->seq != pos) {
+    r->num_full++;
+    pthread_rwlock_unlock(&r->lock);
+    return(-1);
+  }
+
+  slot->item = item, slot->seq = pos + 1, r->tail++;
+
+  if(r->consumer_sleeping) {
+    r->consumer_sleeping = 0;
+    pthread_rwlock_unlock(&r->lock);
+    mpscRingWakeup(r);
+  } else
+    pthread_rwlock_unlock(&r->lock);
+#endif
+
+  return(0);
+}
+
+/* ****************************************************** */
+
+/*
+  Claims up to num consecutive positions with a single CAS and wakes the
+  consumer once. Slots are released by the consumer in order, so when the
+  last slot of the range is free all the slots before it are free too.
+  Returns the number of items enqueued: the caller still owns the rest.
+*/
+u_int32_t mpscRingEnqueueBatch(MpscRing *r, void **items, u_int32_t num) {
+  u_int32_t pos, n;
+
+  if(num == 0) return(0);
+
+#ifdef HAVE_BUILTIN_ATOMIC
+  u_int32_t i;
+
+  while(1) {
+    int32_t diff;
+
+    pos = r->tail, n = min(num, r->size);
+    diff = (int32_t)(r->slots[pos & r->mask].seq - pos);
+
+    if(diff < 0) {
+      r->num_full++;
+      return(0);
+    } else if(diff > 0)
+      continue; /* Another producer got there first */
+
+    while((n > 1) && (r->slots[(pos + n - 1) & r->mask].seq != (pos + n - 1)))
+      n >>= 1;
+
+    if(__sync_bool_compare_and_swap(&r->tail, pos, pos + n))
+      break;
+  }
+
+  for(i=0; i<n; i++)
+    r->slots[(pos + i) & r->mask].item = items[i];
+
+  ringBarrier();
+
+  /* The consumer stops at the first slot not yet published: publish in order */
+  for(i=0; i<n; i++)
+    r->slots[(pos + i) & r->mask].seq = pos + i + 1;
+
+  ringBarrier();
+  if(r->consumer_sleeping && __sync_bool_compare_and_swap(&r->consumer_sleeping, 1, 0))
+    mpscRingWakeup(r);
+#else
+  pthread_rwlock_wrlock(&r->lock);
+  pos = r->tail;
+
+  for(n=0; n<num; n++) {
+    RingSlot *slot = &r->slots[(pos + n) & r->mask];
+
+    if(slot->seq != (pos + n)) break;
+    slot->item = items[n], slot->seq = pos + n + 1;
+  }
+
+  r->tail += n;
+  if(n < num) r->num_full++;
+
+  if((n > 0) && r->consumer_sleeping) {
+    r->consumer_sleeping = 0;
+    pthread_rwlock_unlock(&r->lock);
+    mpscRingWakeup(r);
+  } else
+    pthread_rwlock_unlock(&r->lock);
+#endif
+
+  return(n);
+}
+
+/* ****************************************************** */
+
+/* Consumer only: moves up to max_items published items into items[] */
+u_int32_t mpscRingDequeue(MpscRing *r, void **items, u_int32_t max_items) {
+  u_int32_t num = 0, head = r->head;
+
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_wrlock(&r->lock);
+#endif
+
+  while(num < max_items) {
+    RingSlot *slot = &r->slots[head & r->mask];
+
+    if(slot->seq != (head + 1))
+      break; /* Empty, or the producer has not published it yet */
+
+    ringBarrier();
+    items[num++] = slot->item;
+    ringBarrier();
+    slot->seq = head + r->size, head++;
+  }
+
+  r->head = head;
+
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_unlock(&r->lock);
+#endif
+
+  if(num > 0) r->num_batches++, r->num_dequeued += num;
+
+  return(num);
+}
+
+/* ****************************************************** */
+
+static __inline__ u_int8_t mpscRingReady(MpscRing *r) {
+  return((r->slots[r->head & r->mask].seq == (r->head + 1)) ? 1 : 0);
+}
+
+/* ****************************************************** */
+
+/* Consumer only: returns when there is something to dequeue, on wakeup or after RING_SLEEP_TIMEOUT */
+void mpscRingWait(MpscRing *r) {
+  u_int32_t i;
+
+  for(i=0; i<r->spin_loops; i++) {
+    if(mpscRingReady(r)) {
+      /* Work shows up while spinning: spin a bit longer next time */
+      if(r->spin_loops < RING_MAX_SPIN_LOOPS) r->spin_loops <<= 1;
+      return;
+    }
+
+    cpuRelax();
+  }
+
+  if(r->spin_loops > RING_MIN_SPIN_LOOPS) r->spin_loops >>= 1;
+
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_wrlock(&r->lock);
+  r->consumer_sleeping = 1;
+  pthread_rwlock_unlock(&r->lock);
+#else
+  r->consumer_sleeping = 1;
+  ringBarrier();
+#endif
+
+  if(mpscRingReady(r)) {
+    r->consumer_sleeping = 0;
+    return;
+  }
+
+  r->num_sleeps++;
+
+#ifdef linux
+  futexWait(&r->consumer_sleeping, 1, RING_SLEEP_TIMEOUT);
+#else
+  waitCondvar(&r->condvar);
+#endif
+
+  r->consumer_sleeping = 0;
+}
+
+/* ****************************************************** */
+
+void mpscRingWakeup(MpscRing *r) {
+#ifdef linux
+  r->consumer_sleeping = 0;
+  futexWake(&r->consumer_sleeping);
+#else
+  signalCondvar(&r->condvar, 0);
+#endif
+}
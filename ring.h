@@ -0,0 +1,93 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+/* ********************************** */
+
+#define RING_CACHE_LINE_LEN        64
+#define RING_MIN_SPIN_LOOPS        16
+#define RING_MAX_SPIN_LOOPS      4096
+#define RING_MAX_DEQUEUE_BATCH     32
+#define RING_SLEEP_TIMEOUT       1000 /* msec */
+
+typedef struct {
+  volatile u_int32_t seq;
+  void *item;
+} RingSlot;
+
+/*
+  Bounded multi-producer/single-consumer ring of pointers.
+
+  Each slot carries a sequence number: producers claim a position with
+  a CAS on tail and publish the item by setting seq = pos + 1, the
+  consumer releases the slot for the next lap by setting seq = pos + size.
+  A full ring is reported to the producer, which decides what to drop.
+
+  When empty the consumer spins (the spin length adapts to whether work
+  showed up while spinning), then flags itself as sleeping and blocks on
+  a futex (a condvar where futexes are not available). Producers issue
+  a wakeup only when that flag is set.
+*/
+typedef struct mpscRing {
+  RingSlot *slots;
+  u_int32_t size, mask;
+
+  /* Producers */
+  char pad0[RING_CACHE_LINE_LEN];
+  volatile u_int32_t tail;
+  u_int32_t num_full;
+
+  /* Consumer */
+  char pad1[RING_CACHE_LINE_LEN];
+  volatile u_int32_t head;
+  volatile int consumer_sleeping;
+  u_int32_t spin_loops, num_sleeps, num_batches, num_dequeued;
+
+  char pad2[RING_CACHE_LINE_LEN];
+#ifndef HAVE_BUILTIN_ATOMIC
+  pthread_rwlock_t lock;
+#endif
+#ifndef linux
+  ConditionalVariable condvar;
+#endif
+} MpscRing;
+
+/* ********************************** */
+
+/* Number of queued items: may include items that are being published */
+static __inline__ u_int32_t mpscRingLen(MpscRing *r) {
+  return(r->tail - r->head);
+}
+
+/* ********************************** */
+
+extern int initMpscRing(MpscRing *r, u_int32_t min_size);
+extern void termMpscRing(MpscRing *r);
+extern int mpscRingEnqueue(MpscRing *r, void *item);
+extern u_int32_t mpscRingEnqueueBatch(MpscRing *r, void **items, u_int32_t num);
+extern u_int32_t mpscRingDequeue(MpscRing *r, void **items, u_int32_t max_items);
+extern void mpscRingWait(MpscRing *r);
+extern void mpscRingWakeup(MpscRing *r);
+
+#endif /* _RING_H_ */
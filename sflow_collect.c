@@ -1766,6 +1766,7 @@ typedef struct _SFSample {
   u_int32_t stripped;
 
   /* NTOP */
+  u_short thread_id; /* Flow hash partition the samples go to */
   u_char *pkt_header;
   int pkt_headerLen;
 
@@ -3782,7 +3783,7 @@ static void handleSflowSample(SFSample *sample, int deviceId) {
     readOnlyGlobals.datalink = DLT_EN10MB;
   }
 
-  decodePacket(0 /* dummy threadId */,
+  decodePacket(sample->thread_id,
 	       -1 /* unknown input idx */,
 	       &pkthdr, sample->pkt_header,
 	       1 /* RX packet */,
@@ -3901,10 +3902,11 @@ static void readSFlowDatagram(SFSample *sample, int deviceId)
 
 /* ****************************************** */
 
-void dissectSflow(u_char *buffer, uint buffer_len, struct sockaddr_in *fromHost) {
+void dissectSflow(u_short thread_id, u_char *buffer, uint buffer_len, struct sockaddr_in *fromHost) {
   SFSample sample;
 
   memset(&sample, 0, sizeof(sample));
+  sample.thread_id = thread_id;
   sample.rawSample = buffer;
   sample.rawSampleLen = buffer_len;
   sample.sourceIP = fromHost->sin_addr;
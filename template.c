@@ -520,41 +520,41 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
   
 	switch(theTemplateElement->templateElementId) {
 	case IN_BYTES:
-	  copyInt32(direction == dst2src_direction ? theFlow->core.tuple.flowCounters.bytesRcvd : theFlow->core.tuple.flowCounters.bytesSent,
+	  copyInt32(direction == dst2src_direction ? theFlow->core.flowCounters.bytesRcvd : theFlow->core.flowCounters.bytesSent,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case IN_PKTS:
-	  copyInt32(direction == dst2src_direction ? theFlow->core.tuple.flowCounters.pktRcvd : theFlow->core.tuple.flowCounters.pktSent,
+	  copyInt32(direction == dst2src_direction ? theFlow->core.flowCounters.pktRcvd : theFlow->core.flowCounters.pktSent,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case PROTOCOL:
-	  copyInt8((u_int8_t)theFlow->core.tuple.key.k.ipKey.proto, outBuffer, outBufferBegin, outBufferMax);
+	  copyInt8((u_int8_t)theFlow->ext->tuple.key.k.ipKey.proto, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case SRC_TOS:
-	  copyInt8((theFlow->ext == NULL) ? 0 : (direction == src2dst_direction ? theFlow->ext->src2dstTos : theFlow->ext->dst2srcTos),
+	  copyInt8((direction == src2dst_direction) ? theFlow->core.src2dstTos : theFlow->core.dst2srcTos,
 		   outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case TCP_FLAGS:
-	  copyInt8(((theFlow->core.tuple.key.k.ipKey.proto != IPPROTO_TCP) || (theFlow->ext == NULL)) ? 0 : 
+	  copyInt8((theFlow->ext->tuple.key.k.ipKey.proto != IPPROTO_TCP) ? 0 :
 		   ((direction == src2dst_direction) ? theFlow->ext->protoCounters.tcp.src2dstTcpFlags : theFlow->ext->protoCounters.tcp.dst2srcTcpFlags),
 		   outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case L4_SRC_PORT:
-	  copyInt16(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.sport : theFlow->core.tuple.key.k.ipKey.dport, outBuffer, outBufferBegin, outBufferMax);
+	  copyInt16(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.sport : theFlow->ext->tuple.key.k.ipKey.dport, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case IPV4_SRC_ADDR:
-	  if(theFlow->core.tuple.key.is_ip_flow && (theFlow->core.tuple.key.k.ipKey.src.ipVersion == 4) && (theFlow->core.tuple.key.k.ipKey.dst.ipVersion == 4))
-	    copyInt32(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.src.ipType.ipv4 : theFlow->core.tuple.key.k.ipKey.dst.ipType.ipv4,
+	  if(theFlow->ext->tuple.key.is_ip_flow && (theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 4) && (theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == 4))
+	    copyInt32(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.src.ipType.ipv4 : theFlow->ext->tuple.key.k.ipKey.dst.ipType.ipv4,
 		      outBuffer, outBufferBegin, outBufferMax);
 	  else
 	    copyInt32(0, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case IPV4_SRC_MASK:
-	  if((!theFlow->core.tuple.key.is_ip_flow) || (theFlow->ext == NULL))
+	  if(!theFlow->ext->tuple.key.is_ip_flow)
 	    copyInt8(0, outBuffer, outBufferBegin, outBufferMax);
 	  else
-	    copyInt8(((direction == src2dst_direction) ? ip2mask(&theFlow->core.tuple.key.k.ipKey.src, &theFlow->ext->srcInfo) :
-		      ip2mask(&theFlow->core.tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)),
+	    copyInt8(((direction == src2dst_direction) ? ip2mask(&theFlow->ext->tuple.key.k.ipKey.src, &theFlow->ext->srcInfo) :
+		      ip2mask(&theFlow->ext->tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)),
 		     outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case INPUT_SNMP:
@@ -564,21 +564,21 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	    copyInt16((theFlow->ext == NULL) ? 0 : ((direction == src2dst_direction) ? theFlow->ext->if_input : theFlow->ext->if_output), outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case L4_DST_PORT:
-	  copyInt16(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.dport : theFlow->core.tuple.key.k.ipKey.sport, outBuffer, outBufferBegin, outBufferMax);
+	  copyInt16(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.dport : theFlow->ext->tuple.key.k.ipKey.sport, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case IPV4_DST_ADDR:
-	  if(theFlow->core.tuple.key.is_ip_flow & (theFlow->core.tuple.key.k.ipKey.src.ipVersion == 4) && (theFlow->core.tuple.key.k.ipKey.dst.ipVersion == 4))
-	    copyInt32(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.dst.ipType.ipv4 : theFlow->core.tuple.key.k.ipKey.src.ipType.ipv4,
+	  if(theFlow->ext->tuple.key.is_ip_flow & (theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 4) && (theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == 4))
+	    copyInt32(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.dst.ipType.ipv4 : theFlow->ext->tuple.key.k.ipKey.src.ipType.ipv4,
 		      outBuffer, outBufferBegin, outBufferMax);
 	  else
 	    copyInt32(0, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case IPV4_DST_MASK:
-	  if(!theFlow->core.tuple.key.is_ip_flow)
+	  if(!theFlow->ext->tuple.key.is_ip_flow)
 	    copyInt8(0, outBuffer, outBufferBegin, outBufferMax);
 	  else
-	    copyInt8((theFlow->ext == NULL) ? 0 : ((direction == dst2src_direction) ? ip2mask(&theFlow->core.tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)
-						   : ip2mask(&theFlow->core.tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)),
+	    copyInt8((theFlow->ext == NULL) ? 0 : ((direction == dst2src_direction) ? ip2mask(&theFlow->ext->tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)
+						   : ip2mask(&theFlow->ext->tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)),
 		     outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case OUTPUT_SNMP:
@@ -592,13 +592,13 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case SRC_AS:
-	  copyInt32((theFlow->ext == NULL) ? 0 : (direction == src2dst_direction ? getAS(&theFlow->core.tuple.key.k.ipKey.src, &theFlow->ext->srcInfo) :
-						  getAS(&theFlow->core.tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)),
+	  copyInt32((theFlow->ext == NULL) ? 0 : (direction == src2dst_direction ? getAS(&theFlow->ext->tuple.key.k.ipKey.src, &theFlow->ext->srcInfo) :
+						  getAS(&theFlow->ext->tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)),
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case DST_AS:
-	  copyInt32((theFlow->ext == NULL) ? 0 : (direction == src2dst_direction ? getAS(&theFlow->core.tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo) :
-						  getAS(&theFlow->core.tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)),
+	  copyInt32((theFlow->ext == NULL) ? 0 : (direction == src2dst_direction ? getAS(&theFlow->ext->tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo) :
+						  getAS(&theFlow->ext->tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)),
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case LAST_SWITCHED:
@@ -610,17 +610,17 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case OUT_BYTES:
-	  copyInt32(direction == dst2src_direction ? theFlow->core.tuple.flowCounters.bytesSent : theFlow->core.tuple.flowCounters.bytesRcvd,
+	  copyInt32(direction == dst2src_direction ? theFlow->core.flowCounters.bytesSent : theFlow->core.flowCounters.bytesRcvd,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case OUT_PKTS:
-	  copyInt32(direction == src2dst_direction ? theFlow->core.tuple.flowCounters.pktRcvd : theFlow->core.tuple.flowCounters.pktSent,
+	  copyInt32(direction == src2dst_direction ? theFlow->core.flowCounters.pktRcvd : theFlow->core.flowCounters.pktSent,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case IPV6_SRC_ADDR:
-	  if(theFlow->core.tuple.key.is_ip_flow
-	     && (theFlow->core.tuple.key.k.ipKey.src.ipVersion == 6) && (theFlow->core.tuple.key.k.ipKey.dst.ipVersion == 6))
-	    copyIpV6(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.src.ipType.ipv6 : theFlow->core.tuple.key.k.ipKey.dst.ipType.ipv6,
+	  if(theFlow->ext->tuple.key.is_ip_flow
+	     && (theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 6) && (theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == 6))
+	    copyIpV6(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.src.ipType.ipv6 : theFlow->ext->tuple.key.k.ipKey.dst.ipType.ipv6,
 		     outBuffer, outBufferBegin, outBufferMax);
 	  else {
 	    struct in6_addr _ipv6;
@@ -630,9 +630,9 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  }
 	  break;
 	case IPV6_DST_ADDR:
-	  if((theFlow->core.tuple.key.k.ipKey.src.ipVersion == 6) && theFlow->core.tuple.key.is_ip_flow
-	     && (theFlow->core.tuple.key.k.ipKey.dst.ipVersion == 6))
-	    copyIpV6(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.dst.ipType.ipv6 : theFlow->core.tuple.key.k.ipKey.dst.ipType.ipv6,
+	  if((theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 6) && theFlow->ext->tuple.key.is_ip_flow
+	     && (theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == 6))
+	    copyIpV6(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.dst.ipType.ipv6 : theFlow->ext->tuple.key.k.ipKey.dst.ipType.ipv6,
 		     outBuffer, outBufferBegin, outBufferMax);
 	  else {
 	    struct in6_addr _ipv6;
@@ -663,10 +663,10 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  copyInt16(readOnlyGlobals.idleTimeout, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case ENGINE_TYPE:
-	  copyInt8(theFlow->core.engine_type, outBuffer, outBufferBegin, outBufferMax);
+	  copyInt8(theFlow->ext->cold.engine_type, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case ENGINE_ID:
-	  copyInt8(theFlow->core.engine_id, outBuffer, outBufferBegin, outBufferMax);
+	  copyInt8(theFlow->ext->cold.engine_id, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case TOTAL_BYTES_EXP:
 	  copyInt32(readWriteGlobals->flowExportStats.totExportedBytes, outBuffer, outBufferBegin, outBufferMax);
@@ -690,10 +690,10 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	case SRC_VLAN:
 	  /* no break */
 	case DST_VLAN:
-	  copyInt16(theFlow->core.tuple.key.vlanId, outBuffer, outBufferBegin, outBufferMax);
+	  copyInt16(theFlow->ext->tuple.key.vlanId, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case IP_PROTOCOL_VERSION:
-	  copyInt8((theFlow->core.tuple.key.k.ipKey.src.ipVersion == 4) && (theFlow->core.tuple.key.k.ipKey.dst.ipVersion == 4) ? 4 : 6, outBuffer, outBufferBegin, outBufferMax);
+	  copyInt8((theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 4) && (theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == 4) ? 4 : 6, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case DIRECTION: /* Flow Direction [ 0=RX, 1=TX ] */
 	  copyInt8(theFlow->core.rx_direction.src2dst == 1 /* RX */ ? 0 /* RX */: 1 /* TX */, outBuffer, outBufferBegin, outBufferMax);
@@ -746,7 +746,7 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 
 	case APPLICATION_ID:
 	  /* We need the check below as the NBAR and nDPI applicationIds are shared */
-	  copyInt32((theFlow->core.l7.proto_type != NDPI_PROTO_TYPE) ? theFlow->core.l7.proto.collected_application_id : 0,
+	  copyInt32((theFlow->ext->cold.l7.proto_type != NDPI_PROTO_TYPE) ? theFlow->ext->cold.l7.proto.collected_application_id : 0,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
@@ -764,32 +764,32 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  break;
 
 	case FLOW_ID:
-	  if(theFlow->core.tuple.flow_serial == 0) theFlow->core.tuple.flow_serial = get_flow_serial();
-	  copyInt32(theFlow->core.tuple.flow_serial, outBuffer, outBufferBegin, outBufferMax);
+	  if(theFlow->ext->tuple.flow_serial == 0) theFlow->ext->tuple.flow_serial = get_flow_serial();
+	  copyInt32(theFlow->ext->tuple.flow_serial, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	case FLOW_START_SEC:
 	  if(readOnlyGlobals.flowCollection.collectorInPort > 0)
 	    copyInt32(0, outBuffer, outBufferBegin, outBufferMax);
 	  else
-	    copyInt32(direction == src2dst_direction ? theFlow->core.tuple.flowTimers.firstSeenSent.tv_sec : theFlow->core.tuple.flowTimers.firstSeenRcvd.tv_sec,
+	    copyInt32(direction == src2dst_direction ? theFlow->ext->tuple.flowTimers.firstSeenSent.tv_sec : theFlow->ext->tuple.flowTimers.firstSeenRcvd.tv_sec,
 		      outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case FLOW_END_SEC:
 	  if(readOnlyGlobals.flowCollection.collectorInPort > 0)
 	    copyInt32(0, outBuffer, outBufferBegin, outBufferMax);
 	  else
-	    copyInt32(direction == src2dst_direction ? theFlow->core.tuple.flowTimers.lastSeenSent.tv_sec : theFlow->core.tuple.flowTimers.lastSeenRcvd.tv_sec,
+	    copyInt32(direction == src2dst_direction ? theFlow->ext->tuple.flowTimers.lastSeenSent.tv_sec : theFlow->ext->tuple.flowTimers.lastSeenRcvd.tv_sec,
 		      outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	case FLOW_START_MILLISECONDS:
-	  copyInt64(direction == src2dst_direction ? to_msec(&theFlow->core.tuple.flowTimers.firstSeenSent) : to_msec(&theFlow->core.tuple.flowTimers.firstSeenRcvd),
+	  copyInt64(direction == src2dst_direction ? to_msec(&theFlow->ext->tuple.flowTimers.firstSeenSent) : to_msec(&theFlow->ext->tuple.flowTimers.firstSeenRcvd),
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	case FLOW_END_MILLISECONDS:
-	  copyInt64(direction == src2dst_direction ? to_msec(&theFlow->core.tuple.flowTimers.lastSeenSent) : to_msec(&theFlow->core.tuple.flowTimers.lastSeenRcvd),
+	  copyInt64(direction == src2dst_direction ? to_msec(&theFlow->ext->tuple.flowTimers.lastSeenSent) : to_msec(&theFlow->ext->tuple.flowTimers.lastSeenRcvd),
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
@@ -995,42 +995,42 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  break;
 
 	case RETRANSMITTED_IN_BYTES:
-	  copyInt32((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) ?
+	  copyInt32((theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) ?
 		    (direction == dst2src_direction ? theFlow->ext->protoCounters.tcp.bytesRcvdRetransmitted : 
 		    theFlow->ext->protoCounters.tcp.bytesSentRetransmitted) : 0,
 		    outBuffer, outBufferBegin, outBufferMax); 
 	  break;
 
 	case RETRANSMITTED_IN_PKTS:
-	  copyInt32((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) ? 
+	  copyInt32((theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) ? 
 		    ((direction == dst2src_direction) ? theFlow->ext->protoCounters.tcp.pktRcvdRetransmitted : 
 		     theFlow->ext->protoCounters.tcp.pktSentRetransmitted) : 0,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	case RETRANSMITTED_OUT_BYTES:
-	  copyInt32((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) ?
+	  copyInt32((theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) ?
 		    (direction == src2dst_direction ? theFlow->ext->protoCounters.tcp.bytesRcvdRetransmitted : 
 		    theFlow->ext->protoCounters.tcp.bytesSentRetransmitted) : 0,
 		    outBuffer, outBufferBegin, outBufferMax); 
 	  break;
 
 	case RETRANSMITTED_OUT_PKTS:
-	  copyInt32((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) ?
+	  copyInt32((theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) ?
 		    ((direction == src2dst_direction) ? theFlow->ext->protoCounters.tcp.pktRcvdRetransmitted : 
 		     theFlow->ext->protoCounters.tcp.pktSentRetransmitted) : 0,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	case OOORDER_IN_PKTS:
-	  copyInt32((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) ? 
+	  copyInt32((theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) ? 
 		    ((direction == dst2src_direction) ? theFlow->ext->protoCounters.tcp.rcvdOOOrder : 
 		     theFlow->ext->protoCounters.tcp.sentOOOrder) : 0,
 		    outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	case OOORDER_OUT_PKTS:
-	  copyInt32((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) ? 
+	  copyInt32((theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) ? 
 		    ((direction == src2dst_direction) ? theFlow->ext->protoCounters.tcp.rcvdOOOrder : 
 		     theFlow->ext->protoCounters.tcp.sentOOOrder) : 0,
 		    outBuffer, outBufferBegin, outBufferMax);
@@ -1045,7 +1045,7 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  if(readOnlyGlobals.tunnel_mode 
 	     && (theFlow->ext != NULL)
 	     && (theFlow->ext->extensions != NULL)
-	     && theFlow->core.tuple.key.is_ip_flow
+	     && theFlow->ext->tuple.key.is_ip_flow
 	     && (theFlow->ext->extensions->untunneled.src.ipVersion == 4) 
 	     && (theFlow->ext->extensions->untunneled.dst.ipVersion == 4))
 	    copyInt32(direction == src2dst_direction ? theFlow->ext->extensions->untunneled.src.ipType.ipv4 : 
@@ -1069,7 +1069,7 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  if(readOnlyGlobals.tunnel_mode 
 	     && (theFlow->ext != NULL)
 	     && (theFlow->ext->extensions != NULL)
-	     && theFlow->core.tuple.key.is_ip_flow
+	     && theFlow->ext->tuple.key.is_ip_flow
 	     && (theFlow->ext->extensions->untunneled.src.ipVersion == 4) 
 	     && (theFlow->ext->extensions->untunneled.dst.ipVersion == 4))
 	    copyInt32(direction == src2dst_direction ? theFlow->ext->extensions->untunneled.dst.ipType.ipv4 
@@ -1089,14 +1089,14 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  break;
 
 	case L7_PROTO:
-	  copyInt16((theFlow->core.l7.proto_type == NDPI_PROTO_TYPE) ?
-		    theFlow->core.l7.proto.ndpi.ndpi_proto : 0, outBuffer, outBufferBegin, outBufferMax);
+	  copyInt16((theFlow->ext->cold.l7.proto_type == NDPI_PROTO_TYPE) ?
+		    theFlow->ext->cold.l7.proto.ndpi.ndpi_proto : 0, outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	case L7_PROTO_NAME:
 	  snprintf(proto_name, sizeof(proto_name)-1, "%s",
-		   (theFlow->core.l7.proto_type == NDPI_PROTO_TYPE) ?
-		   getProtoName(theFlow->core.l7.proto.ndpi.ndpi_proto) : 
+		   (theFlow->ext->cold.l7.proto_type == NDPI_PROTO_TYPE) ?
+		   getProtoName(theFlow->ext->cold.l7.proto.ndpi.ndpi_proto) : 
 		   getProtoName(NDPI_PROTOCOL_UNKNOWN));
 
 	  copyVariableLenString(theTemplateElement, proto_name,
@@ -1109,7 +1109,7 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 
 	case FLOW_USER_NAME:
 	  copyVariableLenString(theTemplateElement,
-				theFlow->core.user.username ? theFlow->core.user.username : "",
+				theFlow->ext->cold.user.username ? theFlow->ext->cold.user.username : "",
 				outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
@@ -1117,7 +1117,7 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  mapServerName(theFlow);
 
 	  copyVariableLenString(theTemplateElement,
-				theFlow->core.server.name ? theFlow->core.server.name : "",
+				theFlow->ext->cold.server.name ? theFlow->ext->cold.server.name : "",
 				outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
@@ -1200,28 +1200,28 @@ static void handleTemplate(V9V10TemplateElementId *theTemplateElement,
 	  break;
 
 	case DURATION_CLI_SRV:
- 	  copyInt32(msTimeDiff(&theFlow->core.tuple.flowTimers.lastSeenSent, &theFlow->core.tuple.flowTimers.firstSeenSent), outBuffer, outBufferBegin, outBufferMax);
+ 	  copyInt32(msTimeDiff(&theFlow->ext->tuple.flowTimers.lastSeenSent, &theFlow->ext->tuple.flowTimers.firstSeenSent), outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	case DURATION_SRV_CLI:
- 	  copyInt32(msTimeDiff(&theFlow->core.tuple.flowTimers.lastSeenRcvd, &theFlow->core.tuple.flowTimers.firstSeenRcvd), outBuffer, outBufferBegin, outBufferMax);
+ 	  copyInt32(msTimeDiff(&theFlow->ext->tuple.flowTimers.lastSeenRcvd, &theFlow->ext->tuple.flowTimers.firstSeenRcvd), outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
 	  /* Custom fields */
 	case PROTOCOL_MAP:
-	  snprintf((char*)custom_field, sizeof(custom_field), "%s", proto2name(theFlow->core.tuple.key.k.ipKey.proto));
+	  snprintf((char*)custom_field, sizeof(custom_field), "%s", proto2name(theFlow->ext->tuple.key.k.ipKey.proto));
 	  copyLen(custom_field, sizeof(custom_field), outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case L4_SRC_PORT_MAP:
 	  snprintf((char*)custom_field, sizeof(custom_field), "%s",
-		   port2name(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.sport
-			     : theFlow->core.tuple.key.k.ipKey.dport, theFlow->core.tuple.key.k.ipKey.proto));
+		   port2name(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.sport
+			     : theFlow->ext->tuple.key.k.ipKey.dport, theFlow->ext->tuple.key.k.ipKey.proto));
 	  copyLen(custom_field, sizeof(custom_field), outBuffer, outBufferBegin, outBufferMax);
 	  break;
 	case L4_DST_PORT_MAP:
 	  snprintf((char*)custom_field, sizeof(custom_field), "%s",
-		   port2name(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.dport
-			     : theFlow->core.tuple.key.k.ipKey.sport, theFlow->core.tuple.key.k.ipKey.proto));
+		   port2name(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.dport
+			     : theFlow->ext->tuple.key.k.ipKey.sport, theFlow->ext->tuple.key.k.ipKey.proto));
 	  copyLen(custom_field, sizeof(custom_field), outBuffer, outBufferBegin, outBufferMax);
 	  break;
 
@@ -1459,3 +1459,404 @@ void flowPrintf(V9V10TemplateElementId **templateList,
     idx++;
   }
 }
+
+/* ******************************************** */
+
+#define BUCKET_OFFSET(field) offsetof(FlowHashBucket, field)
+#define EXT_OFFSET(field)    offsetof(FlowHashExtendedBucket, field)
+
+/*
+  Returns 1 if the element can be encoded without going through
+  handleTemplate(): what is written must be exactly what the switch
+  there writes for the same element.
+*/
+static u_int8_t compileTemplateElement(V9V10TemplateElementId *el, FlowDirection direction,
+				       TemplateInstruction *ins) {
+  u_int8_t s2d = (direction == src2dst_direction) ? 1 : 0;
+
+  memset(ins, 0, sizeof(TemplateInstruction));
+  ins->op = TEMPLATE_OP_ELEMENT, ins->elem = el;
+
+  if(el->isOptionTemplate) return(0);
+
+  switch(el->templateElementId) {
+  case IN_BYTES:
+    ins->op = TEMPLATE_OP_CORE32, ins->width = 4;
+    ins->offset = s2d ? BUCKET_OFFSET(core.flowCounters.bytesSent) : BUCKET_OFFSET(core.flowCounters.bytesRcvd);
+    break;
+  case IN_PKTS:
+    ins->op = TEMPLATE_OP_CORE32, ins->width = 4;
+    ins->offset = s2d ? BUCKET_OFFSET(core.flowCounters.pktSent) : BUCKET_OFFSET(core.flowCounters.pktRcvd);
+    break;
+  case OUT_BYTES:
+    ins->op = TEMPLATE_OP_CORE32, ins->width = 4;
+    ins->offset = s2d ? BUCKET_OFFSET(core.flowCounters.bytesRcvd) : BUCKET_OFFSET(core.flowCounters.bytesSent);
+    break;
+  case OUT_PKTS:
+    ins->op = TEMPLATE_OP_CORE32, ins->width = 4;
+    ins->offset = s2d ? BUCKET_OFFSET(core.flowCounters.pktRcvd) : BUCKET_OFFSET(core.flowCounters.pktSent);
+    break;
+  case PROTOCOL:
+    ins->op = TEMPLATE_OP_EXT8, ins->width = 1;
+    ins->offset = EXT_OFFSET(tuple.key.k.ipKey.proto);
+    break;
+  case L4_SRC_PORT:
+    ins->op = TEMPLATE_OP_EXT16, ins->width = 2;
+    ins->offset = s2d ? EXT_OFFSET(tuple.key.k.ipKey.sport) : EXT_OFFSET(tuple.key.k.ipKey.dport);
+    break;
+  case L4_DST_PORT:
+    ins->op = TEMPLATE_OP_EXT16, ins->width = 2;
+    ins->offset = s2d ? EXT_OFFSET(tuple.key.k.ipKey.dport) : EXT_OFFSET(tuple.key.k.ipKey.sport);
+    break;
+  case IPV4_SRC_ADDR:
+    ins->op = TEMPLATE_OP_IPV4, ins->width = 4;
+    ins->offset = s2d ? EXT_OFFSET(tuple.key.k.ipKey.src.ipType.ipv4) : EXT_OFFSET(tuple.key.k.ipKey.dst.ipType.ipv4);
+    break;
+  case IPV4_DST_ADDR:
+    ins->op = TEMPLATE_OP_IPV4, ins->width = 4;
+    ins->offset = s2d ? EXT_OFFSET(tuple.key.k.ipKey.dst.ipType.ipv4) : EXT_OFFSET(tuple.key.k.ipKey.src.ipType.ipv4);
+    break;
+  case IPV6_SRC_ADDR:
+    ins->op = TEMPLATE_OP_IPV6, ins->width = 16;
+    ins->offset = s2d ? EXT_OFFSET(tuple.key.k.ipKey.src.ipType.ipv6) : EXT_OFFSET(tuple.key.k.ipKey.dst.ipType.ipv6);
+    break;
+  case IPV6_DST_ADDR:
+    /* handleTemplate() exports the dst address in both directions */
+    ins->op = TEMPLATE_OP_IPV6, ins->width = 16;
+    ins->offset = EXT_OFFSET(tuple.key.k.ipKey.dst.ipType.ipv6);
+    break;
+  case SRC_TOS:
+    ins->op = TEMPLATE_OP_CORE8, ins->width = 1;
+    ins->offset = s2d ? BUCKET_OFFSET(core.src2dstTos) : BUCKET_OFFSET(core.dst2srcTos);
+    break;
+  case TCP_FLAGS:
+    ins->op = TEMPLATE_OP_TCP_FLAGS, ins->width = 1;
+    ins->offset = s2d ? EXT_OFFSET(protoCounters.tcp.src2dstTcpFlags) : EXT_OFFSET(protoCounters.tcp.dst2srcTcpFlags);
+    break;
+  case INPUT_SNMP:
+    ins->op = TEMPLATE_OP_EXT32, ins->width = (readOnlyGlobals.netFlowVersion == 10) ? 4 : 2;
+    ins->offset = s2d ? EXT_OFFSET(if_input) : EXT_OFFSET(if_output);
+    break;
+  case OUTPUT_SNMP:
+    ins->op = TEMPLATE_OP_EXT32, ins->width = (readOnlyGlobals.netFlowVersion == 10) ? 4 : 2;
+    ins->offset = s2d ? EXT_OFFSET(if_output) : EXT_OFFSET(if_input);
+    break;
+  case IPV4_NEXT_HOP:
+    ins->op = TEMPLATE_OP_NEXT_HOP, ins->width = 4;
+    break;
+  case FIRST_SWITCHED:
+    ins->op = TEMPLATE_OP_FIRST_SWITCHED, ins->width = 4;
+    break;
+  case LAST_SWITCHED:
+    ins->op = TEMPLATE_OP_LAST_SWITCHED, ins->width = 4;
+    break;
+  case FLOW_START_MILLISECONDS:
+    ins->op = TEMPLATE_OP_TIME_MSEC, ins->width = 8;
+    ins->offset = s2d ? EXT_OFFSET(tuple.flowTimers.firstSeenSent) : EXT_OFFSET(tuple.flowTimers.firstSeenRcvd);
+    break;
+  case FLOW_END_MILLISECONDS:
+    ins->op = TEMPLATE_OP_TIME_MSEC, ins->width = 8;
+    ins->offset = s2d ? EXT_OFFSET(tuple.flowTimers.lastSeenSent) : EXT_OFFSET(tuple.flowTimers.lastSeenRcvd);
+    break;
+  default:
+    return(0);
+  }
+
+  /* Never change the record length computed by compileTemplates() */
+  if(el->templateElementLen != ins->width) {
+    ins->op = TEMPLATE_OP_ELEMENT, ins->width = 0, ins->offset = 0;
+    return(0);
+  }
+
+  return(1);
+}
+
+/* ******************************************** */
+
+/*
+  Consecutive compiled elements are grouped in runs: the room for the
+  whole run is checked once, then its instructions write without
+  further checks.
+*/
+void compileTemplateProgram(TemplateBufferInfo *templateBuffer) {
+  u_int8_t d;
+
+  for(d=0; d<2; d++) {
+    FlowDirection direction = (d == 0) ? src2dst_direction : dst2src_direction;
+    TemplateProgram *prog = &templateBuffer->program[d];
+    TemplateInstruction *run = NULL;
+    int i;
+
+    memset(prog, 0, sizeof(TemplateProgram));
+
+    for(i=0; (i<TEMPLATE_LIST_LEN) && (templateBuffer->v9TemplateElementList[i] != NULL); i++) {
+      TemplateInstruction ins;
+
+      prog->numElements++;
+
+      if(compileTemplateElement(templateBuffer->v9TemplateElementList[i], direction, &ins)) {
+	if(run == NULL) {
+	  run = &prog->ins[prog->numInstructions++];
+	  memset(run, 0, sizeof(TemplateInstruction));
+	  run->op = TEMPLATE_OP_RUN;
+	}
+
+	run->width += ins.width, run->offset++;
+	prog->numCompiledElements++;
+      } else
+	run = NULL;
+
+      memcpy(&prog->ins[prog->numInstructions++], &ins, sizeof(TemplateInstruction));
+    }
+  }
+
+  if(readOnlyGlobals.traceMode == 2)
+    traceEvent(TRACE_INFO, "Compiled %u/%u template fields [%u instructions]",
+	       templateBuffer->program[0].numCompiledElements,
+	       templateBuffer->program[0].numElements,
+	       templateBuffer->program[0].numInstructions);
+}
+
+/* ******************************************** */
+
+static __inline__ void putInt16(u_char *out, u_int16_t v) {
+  v = htons(v);
+  memcpy(out, &v, sizeof(v));
+}
+
+static __inline__ void putInt32(u_char *out, u_int32_t v) {
+  v = htonl(v);
+  memcpy(out, &v, sizeof(v));
+}
+
+static __inline__ void putInt64(u_char *out, u_int64_t v) {
+  v = _htonll(v);
+  memcpy(out, &v, sizeof(v));
+}
+
+/* ******************************************** */
+
+/* Same output as flowPrintf() for a data record */
+void encodeFlowRecord(TemplateBufferInfo *templateBuffer,
+		      u_int8_t ipv4_template, char *outBuffer,
+		      u_int *outBufferBegin, u_int *outBufferMax,
+		      FlowHashBucket *theFlow, FlowDirection direction) {
+  TemplateProgram *prog = &templateBuffer->program[(direction == dst2src_direction) ? 1 : 0];
+  TemplateInstruction *ins = prog->ins, *end = &prog->ins[prog->numInstructions];
+  u_char *bkt = (u_char*)theFlow, *ext = (u_char*)theFlow->ext;
+  int numElements = 0;
+
+  while(ins < end) {
+    u_int32_t n;
+    u_char *out;
+
+    if(ins->op == TEMPLATE_OP_ELEMENT) {
+      handleTemplate(ins->elem, templateBuffer->templatePlugin, ipv4_template,
+		     outBuffer, outBufferBegin, outBufferMax, 0, &numElements,
+		     theFlow, direction, 0, 0, 0 /* No JSON */);
+      ins++;
+      continue;
+    }
+
+    n = ins->offset;
+
+    if(unlikely(((*outBufferBegin) + ins->width) >= (*outBufferMax))) {
+      /* Not enough room: copy what the bounds checks let through */
+      for(ins++; n > 0; n--, ins++)
+	handleTemplate(ins->elem, templateBuffer->templatePlugin, ipv4_template,
+		       outBuffer, outBufferBegin, outBufferMax, 0, &numElements,
+		       theFlow, direction, 0, 0, 0 /* No JSON */);
+      continue;
+    }
+
+    out = (u_char*)&outBuffer[*outBufferBegin];
+    (*outBufferBegin) += ins->width;
+
+    for(ins++; n > 0; n--, ins++) {
+      switch(ins->op) {
+      case TEMPLATE_OP_CORE8:
+	out[0] = bkt[ins->offset];
+	break;
+      case TEMPLATE_OP_CORE16:
+	putInt16(out, *(u_int16_t*)&bkt[ins->offset]);
+	break;
+      case TEMPLATE_OP_CORE32:
+	putInt32(out, *(u_int32_t*)&bkt[ins->offset]);
+	break;
+      case TEMPLATE_OP_EXT8:
+	out[0] = (ext == NULL) ? 0 : ext[ins->offset];
+	break;
+      case TEMPLATE_OP_EXT16:
+	putInt16(out, (ext == NULL) ? 0 : *(u_int16_t*)&ext[ins->offset]);
+	break;
+      case TEMPLATE_OP_EXT32:
+	{
+	  u_int32_t v = (ext == NULL) ? 0 : *(u_int32_t*)&ext[ins->offset];
+
+	  if(ins->width == 4)
+	    putInt32(out, v);
+	  else
+	    putInt16(out, (u_int16_t)v);
+	}
+	break;
+      case TEMPLATE_OP_IPV4:
+	putInt32(out, (theFlow->ext->tuple.key.is_ip_flow
+		       && (theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 4)
+		       && (theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == 4)) ? *(u_int32_t*)&ext[ins->offset] : 0);
+	break;
+      case TEMPLATE_OP_IPV6:
+	if(theFlow->ext->tuple.key.is_ip_flow
+	   && (theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 6)
+	   && (theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == 6))
+	  memcpy(out, &ext[ins->offset], 16);
+	else
+	  memset(out, 0, 16);
+	break;
+      case TEMPLATE_OP_TCP_FLAGS:
+	out[0] = ((theFlow->ext->tuple.key.k.ipKey.proto != IPPROTO_TCP) || (ext == NULL)) ? 0
+	  : (u_int8_t)*(u_int16_t*)&ext[ins->offset];
+	break;
+      case TEMPLATE_OP_NEXT_HOP:
+	putInt32(out, (theFlow->ext && (theFlow->ext->nextHop.ipVersion == 4)) ? theFlow->ext->nextHop.ipType.ipv4 : 0);
+	break;
+      case TEMPLATE_OP_FIRST_SWITCHED:
+	putInt32(out, msTimeDiff(getFlowBeginTime(theFlow, direction), &readOnlyGlobals.initialSniffTime));
+	break;
+      case TEMPLATE_OP_LAST_SWITCHED:
+	putInt32(out, msTimeDiff(getFlowEndTime(theFlow, direction), &readOnlyGlobals.initialSniffTime));
+	break;
+      case TEMPLATE_OP_TIME_MSEC:
+	putInt64(out, to_msec((struct timeval*)&ext[ins->offset]));
+	break;
+      }
+
+      out += ins->width;
+    }
+  }
+}
+
+/* ******************************************** */
+
+#define ENCODE_BENCH_NUM_BUCKETS 16384
+
+static FlowHashBucket* allocBenchBuckets(u_int32_t num, u_int8_t ipv6) {
+  FlowHashBucket *bkts = NULL;
+  FlowHashExtendedBucket *exts = (FlowHashExtendedBucket*)calloc(num, sizeof(FlowHashExtendedBucket));
+  u_int32_t i;
+
+  if((exts == NULL) || (posix_memalign((void**)&bkts, FLOW_BUCKET_LEN, num * sizeof(FlowHashBucket)) != 0)) {
+    if(exts) free(exts);
+    return(NULL);
+  }
+
+  memset(bkts, 0, num * sizeof(FlowHashBucket));
+
+  for(i=0; i<num; i++) {
+    FlowHashBucket *b = &bkts[i];
+    IPKey *k;
+
+    b->ext = &exts[i], k = &b->ext->tuple.key.k.ipKey;
+    b->ext->tuple.key.is_ip_flow = 1;
+    k->proto = (i & 1) ? IPPROTO_TCP : IPPROTO_UDP;
+    k->sport = 1024 + (i & 0x7FFF), k->dport = (i & 2) ? 80 : 53;
+
+    if(ipv6) {
+      k->src.ipVersion = k->dst.ipVersion = 6;
+      k->src.ipType.ipv6.s6_addr[0] = 0x20, k->src.ipType.ipv6.s6_addr[1] = 0x01;
+      k->dst.ipType.ipv6.s6_addr[0] = 0x20, k->dst.ipType.ipv6.s6_addr[1] = 0x01;
+      memcpy(&k->src.ipType.ipv6.s6_addr[12], &i, sizeof(i));
+      k->dst.ipType.ipv6.s6_addr[15] = i & 0xFF;
+    } else {
+      k->src.ipVersion = k->dst.ipVersion = 4;
+      k->src.ipType.ipv4 = 0x0A000000 + i, k->dst.ipType.ipv4 = 0xC0A80000 + (i & 0xFFFF);
+    }
+
+    b->core.flowCounters.pktSent = 1 + (i % 100), b->core.flowCounters.bytesSent = 64 * (1 + (i % 100));
+    b->core.flowCounters.pktRcvd = i % 50, b->core.flowCounters.bytesRcvd = 1500 * (i % 50);
+    b->ext->tuple.flowTimers.firstSeenSent.tv_sec = readOnlyGlobals.initialSniffTime.tv_sec + (i % 60);
+    b->ext->tuple.flowTimers.lastSeenSent.tv_sec = b->ext->tuple.flowTimers.firstSeenSent.tv_sec + 1;
+    b->ext->tuple.flowTimers.firstSeenRcvd = b->ext->tuple.flowTimers.firstSeenSent;
+    b->ext->tuple.flowTimers.lastSeenRcvd = b->ext->tuple.flowTimers.lastSeenSent;
+    b->ext->if_input = i % 8, b->ext->if_output = 1 + (i % 8);
+    b->core.src2dstTos = i & 0xFC;
+    b->ext->protoCounters.tcp.src2dstTcpFlags = 0x1B, b->ext->protoCounters.tcp.dst2srcTcpFlags = 0x12;
+  }
+
+  return(bkts);
+}
+
+/* ******************************************** */
+
+/*
+  Encodes num_flows records with both the interpreted (flowPrintf) and
+  the compiled (encodeFlowRecord) encoder and reports ns/flow. The
+  synthetic buckets are encoded round robin.
+*/
+void encodeBenchmark(u_int32_t num_flows) {
+  static char bufA[NETFLOW_MAX_BUFFER_LEN], bufB[NETFLOW_MAX_BUFFER_LEN];
+  u_int32_t t;
+
+  if((readOnlyGlobals.netFlowVersion != 9) && (readOnlyGlobals.netFlowVersion != 10)) {
+    traceEvent(TRACE_ERROR, "The encode benchmark requires NetFlow v9 or IPFIX (-V 9/10)");
+    return;
+  }
+
+  if(readOnlyGlobals.initialSniffTime.tv_sec == 0)
+    gettimeofday(&readOnlyGlobals.initialSniffTime, NULL);
+
+  for(t=0; t<readOnlyGlobals.numActiveTemplates; t++) {
+    TemplateBufferInfo *tb = &readOnlyGlobals.templateBuffers[t];
+    u_int8_t ipv4 = (t == V6_TEMPLATE_INDEX) ? 0 : 1;
+    u_int32_t i, num_mismatches = 0, max = NETFLOW_MAX_BUFFER_LEN, begin;
+    FlowHashBucket *bkts;
+    struct timeval start, end;
+    float interpreted_ns, compiled_ns;
+    int numElements;
+
+    if((tb->v9TemplateElementList[0] == NULL) || (tb->flowLen == 0) || (tb->flowLen >= max)) continue;
+
+    if((bkts = allocBenchBuckets(ENCODE_BENCH_NUM_BUCKETS, ipv4 ? 0 : 1)) == NULL) {
+      traceEvent(TRACE_ERROR, "Not enough memory for the encode benchmark");
+      return;
+    }
+
+    /* Both encoders must produce the same records */
+    for(i=0; i<ENCODE_BENCH_NUM_BUCKETS; i++) {
+      FlowDirection direction = (i & 1) ? dst2src_direction : src2dst_direction;
+      u_int lenA = 0, lenB = 0;
+
+      flowPrintf(tb->v9TemplateElementList, tb->templatePlugin, ipv4, bufA, &lenA, &max,
+		 &numElements, 0, &bkts[i], direction, 0, 0, 0 /* No JSON */);
+      encodeFlowRecord(tb, ipv4, bufB, &lenB, &max, &bkts[i], direction);
+
+      if((lenA != lenB) || memcmp(bufA, bufB, lenA)) num_mismatches++;
+    }
+
+    gettimeofday(&start, NULL);
+    for(i=0, begin = 0; i<num_flows; i++) {
+      if((begin + tb->flowLen) >= max) begin = 0;
+      flowPrintf(tb->v9TemplateElementList, tb->templatePlugin, ipv4, bufA, &begin, &max,
+		 &numElements, 0, &bkts[i % ENCODE_BENCH_NUM_BUCKETS], src2dst_direction, 0, 0, 0 /* No JSON */);
+    }
+    gettimeofday(&end, NULL);
+    interpreted_ns = (timevalDiff(&end, &start) * 1000000) / num_flows;
+
+    gettimeofday(&start, NULL);
+    for(i=0, begin = 0; i<num_flows; i++) {
+      if((begin + tb->flowLen) >= max) begin = 0;
+      encodeFlowRecord(tb, ipv4, bufB, &begin, &max, &bkts[i % ENCODE_BENCH_NUM_BUCKETS], src2dst_direction);
+    }
+    gettimeofday(&end, NULL);
+    compiled_ns = (timevalDiff(&end, &start) * 1000000) / num_flows;
+
+    traceEvent(TRACE_NORMAL, "Encode benchmark [template %u][%u flows][%u bytes/flow][%u/%u fields compiled]: "
+	       "[interpreted %.1f ns/flow][compiled %.1f ns/flow][speedup %.2fx][mismatches: %u]",
+	       readOnlyGlobals.idTemplate + t, num_flows, tb->flowLen,
+	       tb->program[0].numCompiledElements, tb->program[0].numElements,
+	       interpreted_ns, compiled_ns, (compiled_ns > 0) ? (interpreted_ns / compiled_ns) : 0,
+	       num_mismatches);
+
+    free(bkts[0].ext);
+    free(bkts);
+  }
+}
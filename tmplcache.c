@@ -0,0 +1,426 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+#ifdef HAVE_BUILTIN_ATOMIC
+#define templateBarrier() __sync_synchronize()
+#else
+#define templateBarrier()
+#endif
+
+/* ****************************************************** */
+
+static __inline__ u_int32_t templateHash(u_int32_t netflow_device_ip,
+					 u_int32_t observation_domain_id,
+					 u_int16_t templateId) {
+  u_int32_t h = (netflow_device_ip * 0x9E3779B1) ^ (observation_domain_id * 0x85EBCA77) ^ (templateId * 0xC2B2AE3D);
+
+  h ^= h >> 16;
+  return(h & (TEMPLATE_CACHE_BUCKETS - 1));
+}
+
+/* ****************************************************** */
+
+static __inline__ u_int8_t templateMatch(FlowSetV9Ipfix *t, u_int8_t flowVersion,
+					 u_int32_t netflow_device_ip,
+					 u_int32_t observation_domain_id,
+					 u_int16_t templateId) {
+  return(((t->templateInfo.templateId == templateId)
+	  && (t->templateInfo.flowVersion == flowVersion)
+	  && (t->templateInfo.netflow_device_ip == netflow_device_ip)
+	  && (t->templateInfo.observation_domain_id_source_id == observation_domain_id)) ? 1 : 0);
+}
+
+/* ****************************************************** */
+
+static void freeTemplate(FlowSetV9Ipfix *t) {
+  if(t->fields) free(t->fields);
+  if(t->decoder) free(t->decoder);
+  free(t);
+}
+
+/* ****************************************************** */
+
+void initTemplateCache(void) {
+  memset(&readWriteGlobals->templateCache, 0, sizeof(TemplateCache));
+}
+
+/* ****************************************************** */
+
+/* Collector threads are gone */
+void termTemplateCache(void) {
+  TemplateCache *c = &readWriteGlobals->templateCache;
+  FlowSetV9Ipfix *t, *next;
+  u_int32_t i;
+
+  for(i=0; i<TEMPLATE_CACHE_BUCKETS; i++) {
+    for(t = c->buckets[i]; t != NULL; t = next)
+      next = t->next, freeTemplate(t);
+
+    c->buckets[i] = NULL;
+  }
+
+  for(t = c->retired_wait; t != NULL; t = next) next = t->retired, freeTemplate(t);
+  for(t = c->retired_next; t != NULL; t = next) next = t->retired, freeTemplate(t);
+
+  c->retired_wait = c->retired_next = NULL;
+  c->num_templates = c->num_option_templates = c->num_compiled = c->num_retired = 0;
+}
+
+/* ****************************************************** */
+
+void templateCacheReadLock(u_short thread_id) {
+#ifdef HAVE_BUILTIN_ATOMIC
+  /* Full barrier: the writer sees the reader, or the reader sees what the writer unlinked */
+  __sync_fetch_and_add(&readWriteGlobals->templateCache.readers[thread_id].active, 1);
+#else
+  pthread_rwlock_rdlock(&readWriteGlobals->collectorRwLock);
+#endif
+}
+
+/* ****************************************************** */
+
+void templateCacheReadUnlock(u_short thread_id) {
+#ifdef HAVE_BUILTIN_ATOMIC
+  __sync_fetch_and_sub(&readWriteGlobals->templateCache.readers[thread_id].active, 1);
+#else
+  pthread_rwlock_unlock(&readWriteGlobals->collectorRwLock);
+#endif
+}
+
+/* ****************************************************** */
+
+/* Between templateCacheReadLock() and templateCacheReadUnlock() */
+FlowSetV9Ipfix* lookupTemplate(u_int8_t flowVersion, u_int32_t netflow_device_ip,
+			       u_int32_t observation_domain_id, u_int16_t templateId) {
+  FlowSetV9Ipfix *t = readWriteGlobals->templateCache.buckets[templateHash(netflow_device_ip,
+									    observation_domain_id,
+									    templateId)];
+
+  while(t != NULL) {
+    if(templateMatch(t, flowVersion, netflow_device_ip, observation_domain_id, templateId))
+      return(t);
+
+    t = t->next;
+  }
+
+  return(NULL);
+}
+
+/* ****************************************************** */
+
+/*
+  Frees what the readers can no longer see. A grace period ends when
+  every reader slot has been seen idle since it began: the slots are
+  checked one at a time, so a busy collector thread only delays it.
+  Caller holds collectorRwLock.
+*/
+static void reclaimRetiredTemplates(TemplateCache *c) {
+  FlowSetV9Ipfix *t, *next;
+#ifdef HAVE_BUILTIN_ATOMIC
+  u_int32_t i;
+
+  if(c->retired_wait == NULL) {
+    if(c->retired_next == NULL) return;
+
+    /* Start a grace period for what was retired so far */
+    c->retired_wait = c->retired_next, c->retired_next = NULL;
+    for(i=0; i<MAX_NUM_PCAP_THREADS; i++) c->readers[i].quiescent = 0;
+  }
+
+  /* The templates were unlinked before the readers are checked */
+  templateBarrier();
+
+  for(i=0; i<MAX_NUM_PCAP_THREADS; i++) {
+    if(!c->readers[i].quiescent) {
+      if(c->readers[i].active != 0)
+	return; /* Try again later */
+
+      c->readers[i].quiescent = 1;
+    }
+  }
+
+  for(t = c->retired_wait; t != NULL; t = next)
+    next = t->retired, freeTemplate(t), c->num_retired--;
+
+  c->retired_wait = NULL;
+#else
+  /* Readers hold collectorRwLock too: nobody can see them */
+  for(t = c->retired_next; t != NULL; t = next)
+    next = t->retired, freeTemplate(t), c->num_retired--;
+
+  c->retired_next = NULL;
+#endif
+}
+
+/* ****************************************************** */
+
+static void retireTemplate(TemplateCache *c, FlowSetV9Ipfix *t) {
+  c->num_templates--;
+  if(t->templateInfo.isOptionTemplate) c->num_option_templates--;
+  if(t->decoder != NULL) c->num_compiled--;
+
+  /* t->next is left untouched: a reader may be walking through t */
+  t->retired = c->retired_next, c->retired_next = t;
+  c->num_retired++;
+}
+
+/* ****************************************************** */
+
+static u_int8_t sameTemplate(FlowSetV9Ipfix *t, V9IpfixSimpleTemplate *templateInfo,
+			     u_int16_t flowLen, V9V10TemplateField *fields) {
+  u_int32_t i;
+
+  if((t->templateInfo.fieldCount != templateInfo->fieldCount)
+     || (t->templateInfo.scopeFieldCount != templateInfo->scopeFieldCount)
+     || (t->templateInfo.v9ScopeLen != templateInfo->v9ScopeLen)
+     || (t->templateInfo.isOptionTemplate != templateInfo->isOptionTemplate)
+     || (t->templateInfo.flowsetLen != templateInfo->flowsetLen)
+     || (t->flowLen != flowLen))
+    return(0);
+
+  for(i=0; i<templateInfo->fieldCount; i++) {
+    if((t->fields[i].fieldId != fields[i].fieldId)
+       || (t->fields[i].fieldLen != fields[i].fieldLen)
+       || (t->fields[i].isPenField != fields[i].isPenField)
+       || (t->fields[i].enterpriseId != fields[i].enterpriseId))
+      return(0);
+  }
+
+  return(1);
+}
+
+/* ****************************************************** */
+
+/*
+  Takes ownership of fields. Returns 0 for a new template, 1 when the
+  exporter sent an already known template again, 2 when it redefined
+  it, -1 when out of memory. Caller holds collectorRwLock.
+*/
+int addTemplate(V9IpfixSimpleTemplate *templateInfo, u_int16_t flowLen,
+		V9V10TemplateField *fields, u_int8_t transport, time_t now) {
+  TemplateCache *c = &readWriteGlobals->templateCache;
+  FlowSetV9Ipfix **head = &c->buckets[templateHash(templateInfo->netflow_device_ip,
+						   templateInfo->observation_domain_id_source_id,
+						   templateInfo->templateId)];
+  FlowSetV9Ipfix **link = head, *old, *t;
+
+  for(old = *link; old != NULL; link = &old->next, old = old->next)
+    if(templateMatch(old, templateInfo->flowVersion, templateInfo->netflow_device_ip,
+		     templateInfo->observation_domain_id_source_id, templateInfo->templateId))
+      break;
+
+  /* Exporters send their templates over and over: most of the times nothing changes */
+  if((old != NULL) && sameTemplate(old, templateInfo, flowLen, fields)) {
+    old->lastSeen = now, old->transport = transport, c->num_refreshed++;
+    free(fields);
+    return(1);
+  }
+
+  if((t = (FlowSetV9Ipfix*)calloc(1, sizeof(FlowSetV9Ipfix))) == NULL) {
+    traceEvent(TRACE_WARNING, "Not enough memory");
+    free(fields);
+    return(-1);
+  }
+
+  memcpy(&t->templateInfo, templateInfo, sizeof(V9IpfixSimpleTemplate));
+  t->flowLen = flowLen, t->fields = fields, t->lastSeen = now, t->transport = transport;
+  t->decoder = compileTemplateDecoder(templateInfo, fields);
+  t->next = (old != NULL) ? old->next : *head;
+
+  /* Publish the template only once it is complete */
+  templateBarrier();
+
+  if(old != NULL) {
+    *link = t;
+    retireTemplate(c, old);
+    c->num_redefined++;
+  } else
+    *head = t, c->num_added++;
+
+  c->num_templates++;
+  if(t->templateInfo.isOptionTemplate) c->num_option_templates++;
+  if(t->decoder != NULL) c->num_compiled++;
+
+  reclaimRetiredTemplates(c);
+
+  return((old != NULL) ? 2 : 0);
+}
+
+/* ****************************************************** */
+
+/*
+  IPFIX template withdrawal (RFC 7011, 8.1): templateId is either a
+  single template or TEMPLATE_WITHDRAW_ALL for every template (or every
+  option template) of the exporter observation domain. Returns the
+  number of templates withdrawn. Caller holds collectorRwLock.
+*/
+u_int32_t withdrawTemplates(u_int8_t flowVersion, u_int32_t netflow_device_ip,
+			    u_int32_t observation_domain_id, u_int16_t templateId,
+			    u_int8_t isOptionTemplate) {
+  TemplateCache *c = &readWriteGlobals->templateCache;
+  u_int32_t num_withdrawn = 0, i, first, last;
+
+  if(templateId == TEMPLATE_WITHDRAW_ALL)
+    first = 0, last = TEMPLATE_CACHE_BUCKETS - 1;
+  else
+    first = last = templateHash(netflow_device_ip, observation_domain_id, templateId);
+
+  for(i=first; i<=last; i++) {
+    FlowSetV9Ipfix **link = &c->buckets[i], *t;
+
+    while((t = *link) != NULL) {
+      if((t->templateInfo.flowVersion == flowVersion)
+	 && (t->templateInfo.netflow_device_ip == netflow_device_ip)
+	 && (t->templateInfo.observation_domain_id_source_id == observation_domain_id)
+	 && ((templateId == TEMPLATE_WITHDRAW_ALL)
+	     ? (t->templateInfo.isOptionTemplate == isOptionTemplate)
+	     : (t->templateInfo.templateId == templateId))) {
+	*link = t->next;
+	retireTemplate(c, t);
+	num_withdrawn++;
+      } else
+	link = &t->next;
+    }
+  }
+
+  c->num_withdrawn += num_withdrawn;
+  reclaimRetiredTemplates(c);
+
+  return(num_withdrawn);
+}
+
+/* ****************************************************** */
+
+/*
+  Called every second by the stats thread. Exporters resend templates
+  over UDP only: over SCTP they are sent once per association (RFC 7011,
+  8.4), so those are never expired here.
+*/
+void expireTemplateCache(time_t now) {
+  TemplateCache *c = &readWriteGlobals->templateCache;
+  u_int32_t i;
+
+  pthread_rwlock_wrlock(&readWriteGlobals->collectorRwLock);
+
+  if(now >= c->next_expiry) {
+    for(i=0; i<TEMPLATE_CACHE_BUCKETS; i++) {
+      FlowSetV9Ipfix **link = &c->buckets[i], *t;
+
+      while((t = *link) != NULL) {
+	if((t->transport == IPPROTO_UDP) && ((t->lastSeen + TEMPLATE_CACHE_LIFETIME) < now)) {
+	  if(readOnlyGlobals.enable_debug)
+	    traceEvent(TRACE_INFO, "Expired template [id=%d][sourceId: %u]",
+		       t->templateInfo.templateId, t->templateInfo.observation_domain_id_source_id);
+
+	  *link = t->next;
+	  retireTemplate(c, t);
+	  c->num_expired++;
+	} else
+	  link = &t->next;
+      }
+    }
+
+    c->next_expiry = now + TEMPLATE_CACHE_EXPIRE_INTERVAL;
+  }
+
+  reclaimRetiredTemplates(c);
+
+  pthread_rwlock_unlock(&readWriteGlobals->collectorRwLock);
+}
+
+/* ****************************************************** */
+
+typedef struct {
+  u_int32_t netflow_device_ip, observation_domain_id;
+  u_int8_t flowVersion, isOptionTemplate;
+} TemplateExporter;
+
+static int cmpTemplateExporter(const void *_a, const void *_b) {
+  const TemplateExporter *a = (const TemplateExporter*)_a, *b = (const TemplateExporter*)_b;
+
+  if(a->netflow_device_ip != b->netflow_device_ip)
+    return((a->netflow_device_ip < b->netflow_device_ip) ? -1 : 1);
+  else if(a->observation_domain_id != b->observation_domain_id)
+    return((a->observation_domain_id < b->observation_domain_id) ? -1 : 1);
+  else
+    return((int)a->flowVersion - (int)b->flowVersion);
+}
+
+/* ****************************************************** */
+
+void dumpTemplateCacheStats(void) {
+  TemplateCache *c = &readWriteGlobals->templateCache;
+  TemplateExporter *exporters = NULL;
+  u_int32_t num = 0, num_exporters = 0, i, j;
+
+  pthread_rwlock_wrlock(&readWriteGlobals->collectorRwLock);
+
+  if((c->num_templates > 0)
+     && ((exporters = (TemplateExporter*)malloc(c->num_templates * sizeof(TemplateExporter))) != NULL)) {
+    for(i=0; i<TEMPLATE_CACHE_BUCKETS; i++) {
+      FlowSetV9Ipfix *t;
+
+      for(t = c->buckets[i]; (t != NULL) && (num < c->num_templates); t = t->next) {
+	exporters[num].netflow_device_ip = t->templateInfo.netflow_device_ip;
+	exporters[num].observation_domain_id = t->templateInfo.observation_domain_id_source_id;
+	exporters[num].flowVersion = t->templateInfo.flowVersion;
+	exporters[num].isOptionTemplate = t->templateInfo.isOptionTemplate;
+	num++;
+      }
+    }
+  }
+
+  traceEvent(TRACE_NORMAL, "Collected templates: [%u templates][%u option][%u compiled][%u retired]"
+	     "[%llu added][%llu redefined][%llu resent][%llu withdrawn][%llu expired]",
+	     c->num_templates, c->num_option_templates, c->num_compiled, c->num_retired,
+	     (long long unsigned)c->num_added, (long long unsigned)c->num_redefined,
+	     (long long unsigned)c->num_refreshed, (long long unsigned)c->num_withdrawn,
+	     (long long unsigned)c->num_expired);
+
+  pthread_rwlock_unlock(&readWriteGlobals->collectorRwLock);
+
+  if(exporters == NULL) return;
+
+  qsort(exporters, num, sizeof(TemplateExporter), cmpTemplateExporter);
+
+  /* One line per exporter observation domain */
+  for(i=0; i<num; i = j) {
+    u_int32_t num_option = 0;
+    char buf[32];
+
+    for(j=i; (j < num) && (cmpTemplateExporter(&exporters[i], &exporters[j]) == 0); j++)
+      if(exporters[j].isOptionTemplate) num_option++;
+
+    if(num_exporters++ < TEMPLATE_CACHE_MAX_DUMPED)
+      traceEvent(TRACE_NORMAL, "Templates [exporter %s][%s %u]: [%u templates][%u option]",
+		 _intoaV4(exporters[i].netflow_device_ip, buf, sizeof(buf)),
+		 (exporters[i].flowVersion == 10) ? "domain" : "source id",
+		 exporters[i].observation_domain_id, j - i - num_option, num_option);
+  }
+
+  if(num_exporters > TEMPLATE_CACHE_MAX_DUMPED)
+    traceEvent(TRACE_NORMAL, "Templates: %u more exporters not listed", num_exporters - TEMPLATE_CACHE_MAX_DUMPED);
+
+  free(exporters);
+}
@@ -0,0 +1,83 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _TMPLCACHE_H_
+#define _TMPLCACHE_H_
+
+/* ********************************** */
+
+#define TEMPLATE_CACHE_LINE_LEN          64
+#define TEMPLATE_CACHE_BUCKETS         4096 /* Power of 2 */
+#define TEMPLATE_CACHE_LIFETIME        1800 /* sec: UDP templates not sent again for this long are dropped */
+#define TEMPLATE_CACHE_EXPIRE_INTERVAL   60 /* sec */
+#define TEMPLATE_CACHE_MAX_DUMPED        32 /* Exporters listed by dumpTemplateCacheStats() */
+#define TEMPLATE_WITHDRAW_ALL             0 /* withdrawTemplates(): all the templates of the set */
+
+typedef struct {
+  volatile u_int32_t active; /* Readers of this thread inside templateCacheReadLock() */
+  u_int8_t quiescent;        /* Seen with no reader since the grace period began */
+  char pad[TEMPLATE_CACHE_LINE_LEN - sizeof(u_int32_t) - sizeof(u_int8_t)];
+} TemplateCacheReader;
+
+/*
+  Collected V9/IPFIX templates, hashed on exporter address, source id
+  (v9) or observation domain (IPFIX) and template id.
+
+  Writers (template sets, withdrawals, expiry) hold collectorRwLock.
+  Readers do not lock: a template is never changed once published, a
+  redefinition links a new copy in place of the old one. Templates
+  taken off the table are retired and freed only when every reader
+  slot has been seen outside templateCacheReadLock() after that, so a
+  dissector can go on using the template it found. Without atomics
+  readers take collectorRwLock and retired templates are freed at once.
+*/
+typedef struct {
+  FlowSetV9Ipfix *buckets[TEMPLATE_CACHE_BUCKETS];
+  u_int32_t num_templates, num_option_templates, num_compiled;
+  time_t next_expiry;
+
+  /* Waiting for the current grace period to end, retired after it began */
+  FlowSetV9Ipfix *retired_wait, *retired_next;
+  u_int32_t num_retired;
+
+  u_int64_t num_added, num_redefined, num_refreshed, num_withdrawn, num_expired;
+
+  TemplateCacheReader readers[MAX_NUM_PCAP_THREADS]; /* By collector thread id */
+} TemplateCache;
+
+/* ********************************** */
+
+extern void initTemplateCache(void);
+extern void termTemplateCache(void);
+extern void templateCacheReadLock(u_short thread_id);
+extern void templateCacheReadUnlock(u_short thread_id);
+extern FlowSetV9Ipfix* lookupTemplate(u_int8_t flowVersion, u_int32_t netflow_device_ip,
+				      u_int32_t observation_domain_id, u_int16_t templateId);
+extern int addTemplate(V9IpfixSimpleTemplate *templateInfo, u_int16_t flowLen,
+		       V9V10TemplateField *fields, u_int8_t transport, time_t now);
+extern u_int32_t withdrawTemplates(u_int8_t flowVersion, u_int32_t netflow_device_ip,
+				   u_int32_t observation_domain_id, u_int16_t templateId,
+				   u_int8_t isOptionTemplate);
+extern void expireTemplateCache(time_t now);
+extern void dumpTemplateCacheStats(void);
+
+#endif /* _TMPLCACHE_H_ */
@@ -0,0 +1,390 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "nprobe.h"
+
+#define recordMember(m)    offsetof(struct generic_netflow_record, m)
+
+/* ****************************************************** */
+
+/* Returns 0 when the field cannot be compiled with this length */
+static u_int8_t compileField(u_int8_t flowVersion, V9V10TemplateField *field, TemplateDecoderOp *op) {
+  u_int16_t len = field->fieldLen;
+
+  op->len = len;
+
+  if(field->isPenField || (field->fieldId >= NTOP_BASE_ID)
+     || (field->fieldId == 35998) || (field->fieldId == 35999)) {
+    /* Same ids as dissectCustomField(), that also sees raw 35998/35999 without PEN */
+    u_int32_t fieldId = field->fieldId;
+
+    if(field->enterpriseId == 3054 /* IXIA */)
+      fieldId += 35822;
+    else if(field->enterpriseId == 35632 /* ntop */)
+      fieldId += NTOP_BASE_ID;
+
+    /*
+      dissectCustomField() leaves them in network order for deEndianRecord():
+      compiled records skip it, so they are decoded here in host order
+    */
+    if(fieldId == 35998)
+      op->opcode = DECODE_COUNTER_RAW, op->dst = recordMember(rcvdOctets);
+    else if(fieldId == 35999)
+      op->opcode = DECODE_COUNTER_RAW, op->dst = recordMember(rcvdPkts);
+    else
+      goto custom_field;
+
+    return(((len == 4) || (len == 8)) ? 1 : 0);
+  }
+
+  /* Same fields as the interpreter in dissectNetFlow() */
+  switch(field->fieldId) {
+  case 1: /* IN_BYTES */
+  case 231: /* Initiator octets */
+    op->opcode = DECODE_COUNTER, op->dst = recordMember(sentOctets);
+    break;
+  case 2: /* IN_PKTS */
+    op->opcode = DECODE_COUNTER, op->dst = recordMember(sentPkts);
+    break;
+  case 23: /* OUT_BYTES */
+  case 232: /* Responder octets */
+    op->opcode = DECODE_COUNTER, op->dst = recordMember(rcvdOctets);
+    break;
+  case 24: /* OUT_PKTS */
+    op->opcode = DECODE_COUNTER, op->dst = recordMember(rcvdPkts);
+    break;
+  case 85: /* octetTotalCount */
+    op->opcode = (flowVersion == 9) ? DECODE_TOTAL_OCTETS : DECODE_COUNTER_RAW, op->dst = recordMember(rcvdOctets);
+    break;
+  case 86: /* packetTotalCount */
+    op->opcode = DECODE_COUNTER_RAW, op->dst = recordMember(rcvdPkts);
+    break;
+
+  case 4: /* PROT */
+    op->opcode = DECODE_U8, op->dst = recordMember(proto);
+    break;
+  case 5: /* TOS */
+    op->opcode = DECODE_U8, op->dst = recordMember(tos);
+    break;
+  case 6: /* TCP_FLAGS */
+    op->opcode = DECODE_U8, op->dst = recordMember(tcp_flags);
+    break;
+  case 9: /* IPV4_SRC_MASK */
+    op->opcode = DECODE_U8, op->dst = recordMember(src_mask);
+    break;
+  case 13: /* IPV4_DST_MASK */
+    op->opcode = DECODE_U8, op->dst = recordMember(dst_mask);
+    break;
+  case 38: /* ENGINE_TYPE */
+    op->opcode = DECODE_U8, op->dst = recordMember(engine_type);
+    break;
+  case 39: /* ENGINE_ID */
+    op->opcode = DECODE_U8, op->dst = recordMember(engine_id);
+    break;
+  case 52: /* MIN_TTL */
+    op->opcode = DECODE_U8, op->dst = recordMember(minTTL);
+    break;
+  case 53: /* MAX_TTL */
+    op->opcode = DECODE_U8, op->dst = recordMember(maxTTL);
+    break;
+
+  case 7: /* L4_SRC_PORT */
+  case TCP_SRC_PORT:
+    op->opcode = DECODE_U16, op->dst = recordMember(srcport);
+    break;
+  case 11: /* L4_DST_PORT */
+  case TCP_DST_PORT:
+    op->opcode = DECODE_U16, op->dst = recordMember(dstport);
+    break;
+  case 32: /* ICMP_TYPE */
+    op->opcode = DECODE_U16, op->dst = recordMember(icmpType);
+    break;
+  case 58: /* SRC_VLAN */
+  case 59: /* DST_VLAN */
+    op->opcode = DECODE_U16, op->dst = recordMember(vlanId);
+    break;
+  case 102:
+    op->opcode = DECODE_U16, op->dst = recordMember(cisco.packet_offset);
+    break;
+  case 103:
+    op->opcode = DECODE_U16, op->dst = recordMember(cisco.packet_len);
+    break;
+
+  case 10: /* INPUT_SNMP */
+    op->opcode = DECODE_IFINDEX, op->dst = recordMember(input);
+    break;
+  case 14: /* OUTPUT_SNMP */
+    op->opcode = DECODE_IFINDEX, op->dst = recordMember(output);
+    break;
+  case 16: /* SRC_AS */
+    op->opcode = DECODE_AS, op->dst = recordMember(src_as);
+    break;
+  case 17: /* DST_AS */
+    op->opcode = DECODE_AS, op->dst = recordMember(dst_as);
+    break;
+
+  case 8: /* IPV4_SRC_ADDR */
+    op->opcode = DECODE_IPV4, op->dst = recordMember(srcaddr);
+    break;
+  case 12: /* IPV4_DST_ADDR */
+    op->opcode = DECODE_IPV4, op->dst = recordMember(dstaddr);
+    break;
+  case 15: /* IPV4_NEXT_HOP */
+  case 18: /* BGP_NEXT_HOP */
+    op->opcode = DECODE_IPV4_HOP, op->dst = recordMember(nexthop);
+    break;
+  case 27: /* IPV6_SRC_ADDR */
+    op->opcode = DECODE_IPV6, op->dst = recordMember(srcaddr);
+    break;
+  case 28: /* IPV6_DST_ADDR */
+    op->opcode = DECODE_IPV6, op->dst = recordMember(dstaddr);
+    break;
+  case 62: /* IPV6_NEXT_HOP */
+    op->opcode = DECODE_IPV6_HOP, op->dst = recordMember(nexthop);
+    break;
+  case 60: /* IP_PROTOCOL_VERSION */
+    op->opcode = DECODE_IP_VERSION, op->dst = 0;
+    break;
+
+  case 21: /* LAST_SWITCHED */
+    op->opcode = DECODE_U32, op->dst = recordMember(last);
+    break;
+  case 22: /* FIRST_SWITCHED */
+    op->opcode = DECODE_U32, op->dst = recordMember(first);
+    break;
+  case 95: /* NBAR Application Id */
+    op->opcode = DECODE_U32, op->dst = recordMember(cisco.nbar2_application_id);
+    break;
+  case 150: /* flowStartSeconds */
+    op->opcode = DECODE_U32_RAW, op->dst = recordMember(firstEpoch);
+    break;
+  case 151: /* flowEndSeconds */
+    op->opcode = DECODE_U32_RAW, op->dst = recordMember(lastEpoch);
+    break;
+  case 152: /* flowStartMilliseconds */
+    op->opcode = DECODE_MSEC, op->dst = recordMember(firstEpoch);
+    break;
+  case 153: /* flowEndMilliSeconds */
+    op->opcode = DECODE_MSEC, op->dst = recordMember(lastEpoch);
+    break;
+
+  default:
+  custom_field:
+    op->opcode = DECODE_CUSTOM;
+    return(1);
+  }
+
+  switch(op->opcode) {
+  case DECODE_U8:
+  case DECODE_IP_VERSION:
+    return((len == 1) ? 1 : 0);
+  case DECODE_U16:
+    return((len == 2) ? 1 : 0);
+  case DECODE_U32:
+  case DECODE_U32_RAW:
+  case DECODE_IPV4:
+  case DECODE_IPV4_HOP:
+    return((len == 4) ? 1 : 0);
+  case DECODE_IPV6:
+  case DECODE_IPV6_HOP:
+    return((len == 16) ? 1 : 0);
+  case DECODE_IFINDEX:
+  case DECODE_AS:
+    return(((len == 2) || (len == 4)) ? 1 : 0);
+  default: /* Counters and timestamps */
+    return(((len == 4) || (len == 8)) ? 1 : 0);
+  }
+}
+
+/* ****************************************************** */
+
+/*
+  Returns NULL when the template has to be interpreted: variable length
+  fields, lengths the collector does not expect, option templates.
+*/
+TemplateDecoder* compileTemplateDecoder(V9IpfixSimpleTemplate *templateInfo,
+					V9V10TemplateField *fields) {
+  TemplateDecoderOp ops[128];
+  TemplateDecoder *decoder;
+  u_int32_t offset = 0, num_ops = 0, i;
+  u_int8_t flags = 0;
+
+  if(templateInfo->isOptionTemplate || (templateInfo->fieldCount > 128))
+    return(NULL);
+
+  for(i=0; i<templateInfo->fieldCount; i++) {
+    TemplateDecoderOp *op = &ops[num_ops];
+
+    if((fields[i].fieldLen == 0) || (fields[i].fieldLen == 65535 /* Variable length */))
+      return(NULL);
+
+    switch(fields[i].isPenField ? 0 : fields[i].fieldId) {
+    case 48: /* FLOW_SAMPLER_ID */
+    case 51: /* FLOW_CLASS */
+    case 61: /* DIRECTION */
+    case 104: /* SAMPLED_PACKET_ID */
+    case 278: /* ConnectionCountNew */
+    case 279: /* ConnectionSumDuration */
+      /* Not used: no op */
+      break;
+
+    default:
+      if(!compileField(templateInfo->flowVersion, &fields[i], op))
+	return(NULL);
+
+      op->offset = offset;
+
+      if(op->opcode == DECODE_CUSTOM)
+	op->dst = i, flags |= TEMPLATE_DECODER_FULL_RESET;
+      else if(op->dst >= recordMember(ntop))
+	flags |= TEMPLATE_DECODER_FULL_RESET;
+
+      num_ops++;
+    }
+
+    offset += fields[i].fieldLen;
+  }
+
+  if((offset == 0) || (offset > 65535)) return(NULL);
+
+  if((decoder = (TemplateDecoder*)malloc(sizeof(TemplateDecoder) + num_ops * sizeof(TemplateDecoderOp))) == NULL)
+    return(NULL);
+
+  decoder->recordLen = offset, decoder->numOps = num_ops, decoder->flags = flags;
+  decoder->ops = (TemplateDecoderOp*)&decoder[1];
+  memcpy(decoder->ops, ops, num_ops * sizeof(TemplateDecoderOp));
+
+  return(decoder);
+}
+
+/* ****************************************************** */
+
+static __inline__ u_int32_t loadCounter(char *p, u_int8_t len, u_int32_t divide_by) {
+  if(len == 4) {
+    u_int32_t val32;
+
+    memcpy(&val32, p, 4);
+    return(ntohl(val32));
+  } else {
+    u_int64_t val64;
+
+    memcpy(&val64, p, 8);
+    return((u_int32_t)(_ntohll(val64) / divide_by));
+  }
+}
+
+/* ****************************************************** */
+
+/*
+  Fills the record from the fixed length record at buffer[displ], that
+  the caller checked to be complete. Unlike the interpreter, numbers
+  are stored in host order right away, the same as deEndianRecord()
+  would leave them: the record must not go through it.
+*/
+void decodeTemplateRecord(TemplateDecoder *decoder, V9V10TemplateField *fields,
+			  char *buffer, int bufferLen, u_int16_t displ,
+			  u_int32_t netflow_device_ip,
+			  struct generic_netflow_record *record,
+			  u_int32_t *multiplier, u_int32_t *packet_offset,
+			  u_int8_t *skip_flow) {
+  TemplateDecoderOp *op = decoder->ops, *last = &decoder->ops[decoder->numOps];
+  char *rec = &buffer[displ], *base = (char*)record;
+
+  for(; op < last; op++) {
+    char *p = &rec[op->offset], *dst = &base[op->dst];
+    IpAddress *addr = (IpAddress*)dst;
+    u_int16_t v16;
+    u_int32_t v32;
+
+    switch(op->opcode) {
+    case DECODE_U8:
+      *(u_int8_t*)dst = *(u_int8_t*)p;
+      break;
+    case DECODE_U16:
+      memcpy(&v16, p, 2), v16 = ntohs(v16);
+      memcpy(dst, &v16, 2);
+      break;
+    case DECODE_U32:
+      memcpy(&v32, p, 4), v32 = ntohl(v32);
+      memcpy(dst, &v32, 4);
+      break;
+    case DECODE_U32_RAW:
+      memcpy(dst, p, 4);
+      break;
+    case DECODE_IFINDEX:
+      if(op->len == 4)
+	memcpy(&v32, p, 4), v16 = (u_int16_t)ntohl(v32);
+      else
+	memcpy(&v16, p, 2), v16 = ntohs(v16);
+      memcpy(dst, &v16, 2);
+      break;
+    case DECODE_AS:
+      if(op->len == 4)
+	memcpy(&v32, p, 4), v32 = ntohl(v32);
+      else
+	memcpy(&v16, p, 2), v32 = ntohs(v16);
+      memcpy(dst, &v32, 4);
+      break;
+    case DECODE_IPV4:
+      if(addr->ipVersion == 6) break;
+      /* Continue */
+    case DECODE_IPV4_HOP:
+      memcpy(&v32, p, 4);
+      addr->ipVersion = 4, addr->ipType.ipv4 = ntohl(v32);
+      break;
+    case DECODE_IPV6:
+      if(addr->ipVersion == 4) break;
+      /* Continue */
+    case DECODE_IPV6_HOP:
+      addr->ipVersion = 6, memcpy(&addr->ipType.ipv6, p, 16);
+      break;
+    case DECODE_IP_VERSION:
+      record->srcaddr.ipVersion = record->dstaddr.ipVersion = *(u_int8_t*)p;
+      break;
+    case DECODE_COUNTER:
+      v32 = loadCounter(p, op->len, 1) * readOnlyGlobals.flowCollection.sampleRate;
+      memcpy(dst, &v32, 4);
+      break;
+    case DECODE_COUNTER_RAW:
+      v32 = loadCounter(p, op->len, 1);
+      memcpy(dst, &v32, 4);
+      break;
+    case DECODE_TOTAL_OCTETS:
+      /* ASA does not send the packets: guess them (avg 512 bytes packet) */
+      record->rcvdOctets = loadCounter(p, op->len, 1);
+      record->rcvdPkts = 1 + (record->rcvdOctets / 512);
+      break;
+    case DECODE_MSEC:
+      if(op->len == 8) v32 = htonl(loadCounter(p, 8, 1000)); else memcpy(&v32, p, 4);
+      memcpy(dst, &v32, 4);
+      break;
+    case DECODE_CUSTOM:
+      dissectCustomField(record, buffer, bufferLen, displ + op->offset, &fields[op->dst],
+			 netflow_device_ip, multiplier, packet_offset, skip_flow);
+      break;
+    }
+  }
+
+  /* deEndianRecord() swaps the IPv4 next hop of IPv4 flows only: do the same */
+  if((record->nexthop.ipVersion == 4) && (record->srcaddr.ipVersion != 4))
+    record->nexthop.ipType.ipv4 = htonl(record->nexthop.ipType.ipv4);
+}
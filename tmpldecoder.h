@@ -0,0 +1,79 @@
+/*
+ *        nProbe - a Netflow v5/v9/IPFIX probe for IPv4/v6
+ *
+ *       Copyright (C) 2002-14 Luca Deri <deri@ntop.org>
+ *
+ *                     http://www.ntop.org/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _TMPLDECODER_H_
+#define _TMPLDECODER_H_
+
+/* ********************************** */
+
+typedef enum {
+  DECODE_U8 = 0,      /* 1 byte */
+  DECODE_U16,         /* 2 bytes to host order */
+  DECODE_U32,         /* 4 bytes to host order */
+  DECODE_U32_RAW,     /* 4 bytes left in network order */
+  DECODE_IFINDEX,     /* 2 or 4 bytes to a 16 bit host order index */
+  DECODE_AS,          /* 2 or 4 bytes to a 32 bit host order AS */
+  DECODE_IPV4,        /* Unless the address is already IPv6 */
+  DECODE_IPV4_HOP,
+  DECODE_IPV6,        /* Unless the address is already IPv4 */
+  DECODE_IPV6_HOP,
+  DECODE_IP_VERSION,
+  DECODE_COUNTER,     /* 4 or 8 bytes to 32 bit host order, scaled by the sample rate */
+  DECODE_COUNTER_RAW, /* 4 or 8 bytes to 32 bit host order */
+  DECODE_TOTAL_OCTETS,/* v9 ASA octetTotalCount: also guesses the packets */
+  DECODE_MSEC,        /* 8 bytes msec to network order sec, 4 bytes as they are */
+  DECODE_CUSTOM       /* dissectCustomField() */
+} TemplateDecoderOpcode;
+
+typedef struct {
+  u_int16_t offset;   /* Of the field in the template record */
+  u_int8_t  opcode, len;
+  u_int16_t dst;      /* offsetof() the record member, field index for DECODE_CUSTOM */
+} TemplateDecoderOp;
+
+#define TEMPLATE_DECODER_FULL_RESET  0x01 /* Writes past the v5/v9/IPFIX members of the record */
+
+/*
+  A template compiled when it is received: one op per field that the
+  collector uses, with the offset of the field in the record. Only
+  fixed length templates are compiled, as the offsets of the fields
+  after a variable length one change from record to record: the other
+  templates are still interpreted field by field.
+*/
+typedef struct templateDecoder {
+  u_int16_t recordLen, numOps;
+  u_int8_t flags;
+  TemplateDecoderOp *ops; /* Allocated with the decoder */
+} TemplateDecoder;
+
+/* ********************************** */
+
+extern TemplateDecoder* compileTemplateDecoder(V9IpfixSimpleTemplate *templateInfo,
+					       V9V10TemplateField *fields);
+extern void decodeTemplateRecord(TemplateDecoder *decoder, V9V10TemplateField *fields,
+				 char *buffer, int bufferLen, u_int16_t displ,
+				 u_int32_t netflow_device_ip,
+				 struct generic_netflow_record *record,
+				 u_int32_t *multiplier, u_int32_t *packet_offset,
+				 u_int8_t *skip_flow);
+
+#endif /* _TMPLDECODER_H_ */
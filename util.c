@@ -53,7 +53,7 @@ extern void sqlite_exec_sql(char* sql);
 #define GEOIP_DIR_NTOPNG "/usr/share/ntopng/httpdocs/geoip/%s"
 #endif
 
-static u_int8_t getIfIdx(struct in_addr *addr, u_int16_t *interface_id);
+static u_int8_t getIfIdx(IpAddress *addr, u_int16_t *interface_id);
 
 /* ********************** */
 
@@ -174,18 +174,14 @@ short isWinNT() { return(1); }
 
 u_int8_t ip2mask(IpAddress *addr, HostInfo *ip) {
   if(ip->mask != 0) return(ip->mask);
-  else if((readOnlyGlobals.numInterfaceNetworks == 0) || (addr->ipVersion != 4))
+  else if(readOnlyGlobals.numInterfaceNetworks == 0)
     return(0);
   else {
-    int i;
-    u_int32_t address = htonl(addr->ipType.ipv4);
+    u_int32_t value = lpmLookup(readOnlyGlobals.interfaceNetworks, addr);
 
-    for(i=0; i<readOnlyGlobals.numInterfaceNetworks; i++) {
-      if((address & readOnlyGlobals.interfaceNetworks[i].netmask) == readOnlyGlobals.interfaceNetworks[i].network) {
-	// traceEvent(TRACE_INFO, "--> %d", readOnlyGlobals.interfaceNetworks[i].netmask_v6);
-	ip->mask = readOnlyGlobals.interfaceNetworks[i].netmask_v6;
-	return(ip->mask);
-      }
+    if(value != LPM_NO_MATCH) {
+      ip->mask = value & 0xFF;
+      return(ip->mask);
     }
   }
 
@@ -217,39 +213,12 @@ void fillASInfo(FlowHashBucket *bkt) {
 
 /* ******************************************************************* */
 
-static u_int32_t _ip2AS(IpAddress *ip) {
-  char *rsp = NULL;
-  u_int32_t as;
-
+static u_int32_t _ip2AS(struct geoCache *cache, IpAddress *ip) {
   if((!readWriteGlobals->shutdownInProgress) && (_ip_to_AS != NULL))
     return(_ip_to_AS(*ip));
 
 #ifdef HAVE_GEOIP
-  if(readOnlyGlobals.geo_ip_asn_db == NULL) return(0);
-
-
-#ifdef WIN32
-  if(ip.ipVersion == 6) return(0);
-#endif
-
-  pthread_rwlock_wrlock(&readWriteGlobals->geoipRwLock);
-  if(ip->ipVersion == 4)
-    rsp = GeoIP_name_by_ipnum(readOnlyGlobals.geo_ip_asn_db, ip->ipType.ipv4);
-  else {
-#ifdef HAVE_GEOIP_IPv6
-#ifndef WIN32
-    /* Invalid database type GeoIP ASNum Edition, expected GeoIP Organization Edition */
-    if(readOnlyGlobals.geo_ip_asn_db_v6)
-      rsp = GeoIP_name_by_ipnum_v6(readOnlyGlobals.geo_ip_asn_db_v6, ip->ipType.ipv6);
-#endif
-#endif
-  }
-  pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
-
-  as = rsp ? atoi(&rsp[2]) : 0;
-  free(rsp);
-  /* traceEvent(TRACE_WARNING, "--> %s (%d)", rsp, as); */
-  return(as);
+  return((cache != NULL) ? geoCacheGetAS(cache, ip) : geoIpGetAS(ip));
 #else
   return(0);
 #endif
@@ -257,22 +226,36 @@ static u_int32_t _ip2AS(IpAddress *ip) {
 
 /* ************************************* */
 
-u_int32_t _getAS(IpAddress *addr, HostInfo *bkt) {
+static u_int32_t resolveAS(struct geoCache *cache, IpAddress *addr, HostInfo *bkt) {
   if(bkt->aspath && (bkt->aspath_len > 0)) {
     /* The last element is the host AS, the first one is our AS */
     bkt->asn = bkt->aspath[bkt->aspath_len-1];
   } else
-    bkt->asn = _ip2AS(addr);
+    bkt->asn = _ip2AS(cache, addr);
 
   /* traceEvent(TRACE_WARNING, "--> %u", ret);  */
 
+  bkt->asnResolved = 1; /* Even if unknown: the flow is not looked up again */
   return(bkt->asn);
 }
 
+/* ************************************* */
+
+u_int32_t _getAS(IpAddress *addr, HostInfo *bkt) {
+  return(resolveAS(NULL, addr, bkt));
+}
+
 /* ************************************ */
 
 u_int32_t getAS(IpAddress *addr, HostInfo *bkt) {
-  return((bkt->asn != 0) ? bkt->asn : _getAS(addr, bkt));
+  return(((bkt->asn != 0) || bkt->asnResolved) ? bkt->asn : _getAS(addr, bkt));
+}
+
+/* ************************************ */
+
+/* getAS() for the export threads: cache is their own GeoIP cache */
+u_int32_t getCachedAS(struct geoCache *cache, IpAddress *addr, HostInfo *bkt) {
+  return(((bkt->asn != 0) || bkt->asnResolved) ? bkt->asn : resolveAS(cache, addr, bkt));
 }
 
 /* ************************************ */
@@ -436,43 +419,40 @@ u_int16_t ifIdx(FlowHashBucket *myBucket,
 		int inputIfIdx /* 1=if_input, 0=if_output */) {
   u_char *mac;
   u_int16_t idx;
-  struct in_addr addr;
 
   if(readOnlyGlobals.use_vlanId_as_ifId != vlan_disabled) {
     switch(readOnlyGlobals.use_vlanId_as_ifId) {
     case single_vlan:
-      if(isEven(myBucket->core.tuple.key.vlanId)) {
+      if(isEven(myBucket->ext->tuple.key.vlanId)) {
 	/* Even VLAN Tag */
 
 	if(inputIfIdx) return(0);
-	else return(myBucket->core.tuple.key.vlanId);
+	else return(myBucket->ext->tuple.key.vlanId);
       } else {
 	/* Odd VLAN Tag */
 
-	if(inputIfIdx) return(myBucket->core.tuple.key.vlanId-1);
+	if(inputIfIdx) return(myBucket->ext->tuple.key.vlanId-1);
 	else return(0);
       }
       break;
     case double_vlan:
-      if(isEven(myBucket->core.tuple.key.vlanId)) {
+      if(isEven(myBucket->ext->tuple.key.vlanId)) {
 	/* Even VLAN Tag */
 
-	if(inputIfIdx) return(myBucket->core.tuple.key.vlanId+1);
-	else return(myBucket->core.tuple.key.vlanId);
+	if(inputIfIdx) return(myBucket->ext->tuple.key.vlanId+1);
+	else return(myBucket->ext->tuple.key.vlanId);
       } else {
 	/* Odd VLAN Tag */
 
-	if(inputIfIdx) return(myBucket->core.tuple.key.vlanId-1);
-	else return(myBucket->core.tuple.key.vlanId);
+	if(inputIfIdx) return(myBucket->ext->tuple.key.vlanId-1);
+	else return(myBucket->ext->tuple.key.vlanId);
       }
       break;
     default:
-      return(myBucket->core.tuple.key.vlanId);
+      return(myBucket->ext->tuple.key.vlanId);
     }
   }
-  addr.s_addr = inputIfIdx ? htonl(myBucket->core.tuple.key.k.ipKey.src.ipType.ipv4) : htonl(myBucket->core.tuple.key.k.ipKey.dst.ipType.ipv4);
-
-  if(getIfIdx(&addr, &idx))
+  if(getIfIdx(inputIfIdx ? &myBucket->ext->tuple.key.k.ipKey.src : &myBucket->ext->tuple.key.k.ipKey.dst, &idx))
     return(idx);
 
   if(readWriteGlobals->num_src_mac_export > 0) {
@@ -533,10 +513,10 @@ char* port2name(u_int16_t port, u_int8_t proto) {
 /* ******************************************** */
 
 u_int16_t getServerPort(FlowHashBucket *theFlow) {
-  switch(theFlow->core.tuple.key.k.ipKey.proto) {
+  switch(theFlow->ext->tuple.key.k.ipKey.proto) {
   case IPPROTO_TCP:
   case IPPROTO_UDP:
-    return((theFlow->core.tuple.key.k.ipKey.dport < theFlow->core.tuple.key.k.ipKey.sport) ? theFlow->core.tuple.key.k.ipKey.dport : theFlow->core.tuple.key.k.ipKey.sport);
+    return((theFlow->ext->tuple.key.k.ipKey.dport < theFlow->ext->tuple.key.k.ipKey.sport) ? theFlow->ext->tuple.key.k.ipKey.dport : theFlow->ext->tuple.key.k.ipKey.sport);
   default:
     return(0);
   }
@@ -630,20 +610,20 @@ u_int16_t port2ApplProtocol(u_int8_t proto, u_int16_t port) {
 
 u_int16_t getFlowApplProtocol(FlowHashBucket *theFlow) {
   u_int16_t value;
-  u_int16_t proto_sport = port2ApplProtocol(theFlow->core.tuple.key.k.ipKey.proto, theFlow->core.tuple.key.k.ipKey.sport);
-  u_int16_t proto_dport = port2ApplProtocol(theFlow->core.tuple.key.k.ipKey.proto, theFlow->core.tuple.key.k.ipKey.dport);
+  u_int16_t proto_sport = port2ApplProtocol(theFlow->ext->tuple.key.k.ipKey.proto, theFlow->ext->tuple.key.k.ipKey.sport);
+  u_int16_t proto_dport = port2ApplProtocol(theFlow->ext->tuple.key.k.ipKey.proto, theFlow->ext->tuple.key.k.ipKey.dport);
 
-  if((theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_TCP) || (theFlow->core.tuple.key.k.ipKey.proto == IPPROTO_UDP)) {
+  if((theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_TCP) || (theFlow->ext->tuple.key.k.ipKey.proto == IPPROTO_UDP)) {
     if(proto_sport == 0) value = proto_dport;
     else if(proto_dport == 0) value = proto_sport;
     else {
-      if(theFlow->core.tuple.key.k.ipKey.sport < theFlow->core.tuple.key.k.ipKey.dport) value = proto_sport;
+      if(theFlow->ext->tuple.key.k.ipKey.sport < theFlow->ext->tuple.key.k.ipKey.dport) value = proto_sport;
       else value = proto_dport;
     }
   } else
     value = 0;
 
-  // traceEvent(TRACE_ERROR, "[%u/%u] -> %u", theFlow->core.tuple.key.k.ipKey.sport, theFlow->core.tuple.key.k.ipKey.dport, value);
+  // traceEvent(TRACE_ERROR, "[%u/%u] -> %u", theFlow->ext->tuple.key.k.ipKey.sport, theFlow->ext->tuple.key.k.ipKey.dport, value);
 
   return(value);
 }
@@ -778,7 +758,7 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
   if(avail_len == 0) return(ret);
 
   if(json_mode) {
-    if(theFlow->core.tuple.key.k.ipKey.src.ipVersion == 6) {
+    if(theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 6) {
       if(teid == IPV4_SRC_ADDR)      teid = IPV6_SRC_ADDR;
       else if(teid == IPV4_DST_ADDR) teid = IPV6_DST_ADDR;
       else if(teid == IPV4_NEXT_HOP) return(ret);
@@ -805,21 +785,21 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
   switch(teid) {
   case IN_BYTES:
     i = snprintf(dst, avail_len, "%u",
-		 direction == dst2src_direction ? theFlow->core.tuple.flowCounters.bytesRcvd : theFlow->core.tuple.flowCounters.bytesSent);
+		 direction == dst2src_direction ? theFlow->core.flowCounters.bytesRcvd : theFlow->core.flowCounters.bytesSent);
     break;
   case IN_PKTS:
     i = snprintf(dst, avail_len, "%u",
-		 direction == dst2src_direction ? theFlow->core.tuple.flowCounters.pktRcvd : theFlow->core.tuple.flowCounters.pktSent);
+		 direction == dst2src_direction ? theFlow->core.flowCounters.pktRcvd : theFlow->core.flowCounters.pktSent);
     break;
   case PROTOCOL:
-    i = snprintf(dst, avail_len, "%d", theFlow->core.tuple.key.k.ipKey.proto);
+    i = snprintf(dst, avail_len, "%d", theFlow->ext->tuple.key.k.ipKey.proto);
     break;
   case PROTOCOL_MAP:
-    i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s", proto2name(theFlow->core.tuple.key.k.ipKey.proto));
+    i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s", proto2name(theFlow->ext->tuple.key.k.ipKey.proto));
     break;
   case SRC_TOS:
     i = snprintf(dst, avail_len, "%d",
-		 (theFlow->ext == NULL) ? 0 : ((direction == src2dst_direction) ? theFlow->ext->src2dstTos : theFlow->ext->dst2srcTos));
+		 (direction == src2dst_direction) ? theFlow->core.src2dstTos : theFlow->core.dst2srcTos);
     break;
   case TCP_FLAGS:
     i = snprintf(dst, avail_len, "%d",
@@ -828,20 +808,20 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
   case L4_SRC_PORT:
     i = snprintf(dst, avail_len, "%d",
-		 direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.sport : theFlow->core.tuple.key.k.ipKey.dport);
+		 direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.sport : theFlow->ext->tuple.key.k.ipKey.dport);
     break;
   case L4_SRC_PORT_MAP:
     i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s",
-		 port2name(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.sport : theFlow->core.tuple.key.k.ipKey.dport,
-			   theFlow->core.tuple.key.k.ipKey.proto));
+		 port2name(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.sport : theFlow->ext->tuple.key.k.ipKey.dport,
+			   theFlow->ext->tuple.key.k.ipKey.proto));
     break;
   case IPV4_SRC_ADDR:
   case IPV6_SRC_ADDR:
     {
       u_int8_t ip_v = (teid == IPV4_SRC_ADDR) ? 4 : 6;
-      if(theFlow->core.tuple.key.is_ip_flow && theFlow->core.tuple.key.k.ipKey.src.ipVersion == ip_v) {
+      if(theFlow->ext->tuple.key.is_ip_flow && theFlow->ext->tuple.key.k.ipKey.src.ipVersion == ip_v) {
         i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s",
-		     _intoa(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.src: theFlow->core.tuple.key.k.ipKey.dst, buf, sizeof(buf)));
+		     _intoa(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.src: theFlow->ext->tuple.key.k.ipKey.dst, buf, sizeof(buf)));
       } else {
         IpAddress addr;
         memset(&addr, 0, sizeof(addr));
@@ -852,9 +832,9 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
   case IPV4_SRC_MASK:
     i = snprintf(dst, avail_len, "%d",
-		 ((theFlow->ext == NULL) || (!theFlow->core.tuple.key.is_ip_flow)) ? 0 :
-		 ((direction == src2dst_direction) ? ip2mask(&theFlow->core.tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)
-		  : ip2mask(&theFlow->core.tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)));
+		 ((theFlow->ext == NULL) || (!theFlow->ext->tuple.key.is_ip_flow)) ? 0 :
+		 ((direction == src2dst_direction) ? ip2mask(&theFlow->ext->tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)
+		  : ip2mask(&theFlow->ext->tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)));
     break;
   case INPUT_SNMP:
     i = snprintf(dst, avail_len, "%d", (theFlow->ext == NULL) ? 0 :
@@ -862,12 +842,12 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
   case L4_DST_PORT:
     i = snprintf(dst, avail_len, "%d",
-		 direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.dport : theFlow->core.tuple.key.k.ipKey.sport);
+		 direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.dport : theFlow->ext->tuple.key.k.ipKey.sport);
     break;
   case L4_DST_PORT_MAP:
     i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s",
-		 port2name(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.dport : theFlow->core.tuple.key.k.ipKey.sport,
-			   theFlow->core.tuple.key.k.ipKey.proto));
+		 port2name(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.dport : theFlow->ext->tuple.key.k.ipKey.sport,
+			   theFlow->ext->tuple.key.k.ipKey.proto));
     break;
 
   case L4_SRV_PORT:
@@ -875,16 +855,16 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
 
   case L4_SRV_PORT_MAP:
-    i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s", port2name(getServerPort(theFlow), theFlow->core.tuple.key.k.ipKey.proto));
+    i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s", port2name(getServerPort(theFlow), theFlow->ext->tuple.key.k.ipKey.proto));
     break;
 
   case IPV4_DST_ADDR:
   case IPV6_DST_ADDR:
     {
       u_int8_t ip_v = (teid == IPV4_DST_ADDR) ? 4 : 6;
-      if(theFlow->core.tuple.key.is_ip_flow && theFlow->core.tuple.key.k.ipKey.dst.ipVersion == ip_v) {
+      if(theFlow->ext->tuple.key.is_ip_flow && theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == ip_v) {
         i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s",
-		     _intoa(direction == src2dst_direction ? theFlow->core.tuple.key.k.ipKey.dst: theFlow->core.tuple.key.k.ipKey.src, buf, sizeof(buf)));
+		     _intoa(direction == src2dst_direction ? theFlow->ext->tuple.key.k.ipKey.dst: theFlow->ext->tuple.key.k.ipKey.src, buf, sizeof(buf)));
       } else {
         IpAddress addr;
         memset(&addr, 0, sizeof(addr));
@@ -895,9 +875,9 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
   case IPV4_DST_MASK:
     i = snprintf(dst, avail_len, "%d",
-		 ((theFlow->ext == NULL) || (!theFlow->core.tuple.key.is_ip_flow)) ? 0 :
-		 ((direction == dst2src_direction) ? ip2mask(&theFlow->core.tuple.key.k.ipKey.src, &theFlow->ext->srcInfo) :
-		  ip2mask(&theFlow->core.tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)));
+		 ((theFlow->ext == NULL) || (!theFlow->ext->tuple.key.is_ip_flow)) ? 0 :
+		 ((direction == dst2src_direction) ? ip2mask(&theFlow->ext->tuple.key.k.ipKey.src, &theFlow->ext->srcInfo) :
+		  ip2mask(&theFlow->ext->tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)));
     break;
   case OUTPUT_SNMP:
     i = snprintf(dst, avail_len, "%d",
@@ -911,13 +891,13 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
   case SRC_AS:
     i = snprintf(dst, avail_len, "%d", (theFlow->ext == NULL) ? 0 :
-		 ((direction == src2dst_direction) ? getAS(&theFlow->core.tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)
-		  : getAS(&theFlow->core.tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)));
+		 ((direction == src2dst_direction) ? getAS(&theFlow->ext->tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)
+		  : getAS(&theFlow->ext->tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)));
     break;
   case DST_AS:
     i = snprintf(dst, avail_len, "%d", (theFlow->ext == NULL) ? 0 :
-		 ((direction == src2dst_direction) ? getAS(&theFlow->core.tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)
-		  : getAS(&theFlow->core.tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)));
+		 ((direction == src2dst_direction) ? getAS(&theFlow->ext->tuple.key.k.ipKey.dst, &theFlow->ext->dstInfo)
+		  : getAS(&theFlow->ext->tuple.key.k.ipKey.src, &theFlow->ext->srcInfo)));
     break;
   case LAST_SWITCHED:
   case FLOW_END_SEC:
@@ -937,11 +917,11 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
   case OUT_BYTES:
     i = snprintf(dst, avail_len, "%u",
-		 direction == dst2src_direction ? theFlow->core.tuple.flowCounters.bytesSent : theFlow->core.tuple.flowCounters.bytesRcvd);
+		 direction == dst2src_direction ? theFlow->core.flowCounters.bytesSent : theFlow->core.flowCounters.bytesRcvd);
     break;
   case OUT_PKTS:
     i = snprintf(dst, avail_len, "%u",
-		 direction == src2dst_direction ? theFlow->core.tuple.flowCounters.pktRcvd : theFlow->core.tuple.flowCounters.pktSent);
+		 direction == src2dst_direction ? theFlow->core.flowCounters.pktRcvd : theFlow->core.flowCounters.pktSent);
     break;
   case IPV6_SRC_MASK:
   case IPV6_DST_MASK:
@@ -969,11 +949,11 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
   case ENGINE_TYPE:
     i = snprintf(dst, avail_len, "%d",
-		 theFlow->core.engine_type);
+		 theFlow->ext->cold.engine_type);
     break;
   case ENGINE_ID:
     i = snprintf(dst, avail_len, "%d",
-		 theFlow->core.engine_id);
+		 theFlow->ext->cold.engine_id);
     break;
   case TOTAL_BYTES_EXP:
     i = snprintf(dst, avail_len, "%d",
@@ -1008,11 +988,11 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
   case SRC_VLAN:
   case DST_VLAN:
-    i = snprintf(dst, avail_len, "%d", theFlow->core.tuple.key.vlanId);
+    i = snprintf(dst, avail_len, "%d", theFlow->ext->tuple.key.vlanId);
     break;
   case IP_PROTOCOL_VERSION:
     i = snprintf(dst, avail_len, "%d",
-		 (theFlow->core.tuple.key.k.ipKey.src.ipVersion == 4) && (theFlow->core.tuple.key.k.ipKey.dst.ipVersion == 4) ? 4 : 6);
+		 (theFlow->ext->tuple.key.k.ipKey.src.ipVersion == 4) && (theFlow->ext->tuple.key.k.ipKey.dst.ipVersion == 4) ? 4 : 6);
     break;
   case DIRECTION: /* Flow Direction [ 0=RX, 1=TX ] */
     i = snprintf(dst, avail_len, "%d", theFlow->core.rx_direction.src2dst == 1 /* RX */ ? 0 /* RX */: 1 /* TX */);
@@ -1071,15 +1051,15 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
 
   case APPLICATION_ID:
-    if(theFlow->core.l7.proto_type == NBAR2_PROTO_TYPE) {
-      u_int8_t major_proto = (theFlow->core.l7.proto.collected_application_id & 0xFF000000) >> 24;
-      u_int32_t minor_proto = theFlow->core.l7.proto.collected_application_id & 0x00FFFFFF;
+    if(theFlow->ext->cold.l7.proto_type == NBAR2_PROTO_TYPE) {
+      u_int8_t major_proto = (theFlow->ext->cold.l7.proto.collected_application_id & 0xFF000000) >> 24;
+      u_int32_t minor_proto = theFlow->ext->cold.l7.proto.collected_application_id & 0x00FFFFFF;
 
       /* We need the check below as the NBAR and nDPI applicationIds are shared */
       i = snprintf(dst, avail_len, json_mode ? "\"%u:%u\"" : "%u:%u", major_proto, minor_proto);
-      } else if(theFlow->core.l7.proto_type == IXIA_PROTO_TYPE)
+      } else if(theFlow->ext->cold.l7.proto_type == IXIA_PROTO_TYPE)
       i = snprintf(dst, avail_len, json_mode ? "\"%u\"" : "%u",
-		   theFlow->core.l7.proto.collected_application_id);
+		   theFlow->ext->cold.l7.proto.collected_application_id);
     else
       i = snprintf(dst, avail_len, json_mode ? "\"%u\"" : "%u", 0);
     break;
@@ -1094,8 +1074,8 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
 
   case FLOW_ID:
-    if(theFlow->core.tuple.flow_serial == 0) theFlow->core.tuple.flow_serial = get_flow_serial();
-    i = snprintf(dst, avail_len, "%u", theFlow->core.tuple.flow_serial);
+    if(theFlow->ext->tuple.flow_serial == 0) theFlow->ext->tuple.flow_serial = get_flow_serial();
+    i = snprintf(dst, avail_len, "%u", theFlow->ext->tuple.flow_serial);
     break;
 
   case FLOW_START_MILLISECONDS:
@@ -1373,7 +1353,7 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
 		 ((readOnlyGlobals.tunnel_mode == 0)
 		  || (theFlow->ext == NULL)
 		  || (theFlow->ext->extensions == NULL)
-		  || (!theFlow->core.tuple.key.is_ip_flow)
+		  || (!theFlow->ext->tuple.key.is_ip_flow)
 		  || (theFlow->ext->extensions->untunneled.proto == 0)) ? "" :
 		 (_intoa(direction == src2dst_direction ? theFlow->ext->extensions->untunneled.src :
 			 theFlow->ext->extensions->untunneled.dst, buf, sizeof(buf))));
@@ -1384,7 +1364,7 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
 		 ((theFlow->ext == NULL)
 		  || (theFlow->ext->extensions == NULL)
 		  || (readOnlyGlobals.tunnel_mode == 0)
-		  || (!theFlow->core.tuple.key.is_ip_flow)) ? 0 :
+		  || (!theFlow->ext->tuple.key.is_ip_flow)) ? 0 :
 		 ((direction == src2dst_direction) ? theFlow->ext->extensions->untunneled.sport : theFlow->ext->extensions->untunneled.dport));
     break;
 
@@ -1393,7 +1373,7 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
 		 ((readOnlyGlobals.tunnel_mode == 0)
 		  || (theFlow->ext == NULL)
 		  || (theFlow->ext->extensions == NULL)
-		  || (!theFlow->core.tuple.key.is_ip_flow)
+		  || (!theFlow->ext->tuple.key.is_ip_flow)
 		  || (theFlow->ext->extensions->untunneled.proto == 0)) ? "" :
 		 (_intoa(direction == src2dst_direction ? theFlow->ext->extensions->untunneled.dst :
 			 theFlow->ext->extensions->untunneled.src, buf, sizeof(buf))));
@@ -1404,21 +1384,21 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
 		 ((readOnlyGlobals.tunnel_mode == 0)
 		  || (theFlow->ext == NULL)
 		  || (theFlow->ext->extensions == NULL)
-		  || (!theFlow->core.tuple.key.is_ip_flow)) ? 0 :
+		  || (!theFlow->ext->tuple.key.is_ip_flow)) ? 0 :
 		 (direction == src2dst_direction ? theFlow->ext->extensions->untunneled.dport :
 		  theFlow->ext->extensions->untunneled.sport));
     break;
 
   case L7_PROTO:
     i = snprintf(dst, avail_len, "%d",
-		 (theFlow->core.l7.proto_type == NDPI_PROTO_TYPE) ?
-		 theFlow->core.l7.proto.ndpi.ndpi_proto : 0);
+		 (theFlow->ext->cold.l7.proto_type == NDPI_PROTO_TYPE) ?
+		 theFlow->ext->cold.l7.proto.ndpi.ndpi_proto : 0);
     break;
 
   case L7_PROTO_NAME:
     i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s",
-		 (theFlow->core.l7.proto_type == NDPI_PROTO_TYPE) ?
-		 getProtoName(theFlow->core.l7.proto.ndpi.ndpi_proto) :
+		 (theFlow->ext->cold.l7.proto_type == NDPI_PROTO_TYPE) ?
+		 getProtoName(theFlow->ext->cold.l7.proto.ndpi.ndpi_proto) :
 		 getProtoName(NDPI_PROTOCOL_UNKNOWN));
     break;
 
@@ -1428,13 +1408,13 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
 
   case FLOW_USER_NAME:
     i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s",
-		 theFlow->core.user.username ? theFlow->core.user.username : "");
+		 theFlow->ext->cold.user.username ? theFlow->ext->cold.user.username : "");
     break;
 
   case FLOW_SERVER_NAME:
     mapServerName(theFlow);
     i = snprintf(dst, avail_len, json_mode ? "\"%s\"" : "%s",
-		 theFlow->core.server.name ? theFlow->core.server.name : "");
+		 theFlow->ext->cold.server.name ? theFlow->ext->cold.server.name : "");
     break;
 
   case PLUGIN_NAME:
@@ -1510,11 +1490,11 @@ static u_int printRecordWithTemplate(V9V10TemplateElementId *theTemplateElement,
     break;
 
   case DURATION_CLI_SRV:
-    i = snprintf(dst, avail_len, "%u", (unsigned int) msTimeDiff(&theFlow->core.tuple.flowTimers.lastSeenSent, &theFlow->core.tuple.flowTimers.firstSeenSent));
+    i = snprintf(dst, avail_len, "%u", (unsigned int) msTimeDiff(&theFlow->ext->tuple.flowTimers.lastSeenSent, &theFlow->ext->tuple.flowTimers.firstSeenSent));
     break;
 
   case DURATION_SRV_CLI:
-    i = snprintf(dst, avail_len, "%u", (unsigned int) msTimeDiff(&theFlow->core.tuple.flowTimers.lastSeenRcvd, &theFlow->core.tuple.flowTimers.firstSeenRcvd));
+    i = snprintf(dst, avail_len, "%u", (unsigned int) msTimeDiff(&theFlow->ext->tuple.flowTimers.lastSeenRcvd, &theFlow->ext->tuple.flowTimers.firstSeenRcvd));
     break;
 
   default:
@@ -1734,6 +1714,33 @@ int waitCondvar(ConditionalVariable *condvarId) {
 
   return rc;
 }
+
+/* ************************************ */
+
+/* As waitCondvar() but gives up after msec: returns ETIMEDOUT if not signalled */
+int timedWaitCondvar(ConditionalVariable *condvarId, u_int msec) {
+  struct timeval now;
+  struct timespec deadline;
+  int rc = 0;
+
+  gettimeofday(&now, NULL);
+  deadline.tv_sec = now.tv_sec + msec / 1000;
+  deadline.tv_nsec = (now.tv_usec + (msec % 1000) * 1000) * 1000;
+  if(deadline.tv_nsec >= 1000000000)
+    deadline.tv_sec++, deadline.tv_nsec -= 1000000000;
+
+  pthread_mutex_lock(&condvarId->mutex);
+
+  while((condvarId->predicate <= 0) && (rc == 0))
+    rc = pthread_cond_timedwait(&condvarId->condvar, &condvarId->mutex, &deadline);
+
+  if(condvarId->predicate > 0)
+    condvarId->predicate--, rc = 0;
+
+  pthread_mutex_unlock(&condvarId->mutex);
+
+  return rc;
+}
 /* ************************************ */
 
 int signalCondvar(ConditionalVariable *condvarId, int broadcast) {
@@ -1793,6 +1800,18 @@ int waitCondvar(ConditionalVariable *condvarId) {
 
 /* ************************************ */
 
+int timedWaitCondvar(ConditionalVariable *condvarId, u_int msec) {
+  int rc;
+
+  EnterCriticalSection(&condvarId->criticalSection);
+  rc = WaitForSingleObject(condvarId->condVar, msec);
+  LeaveCriticalSection(&condvarId->criticalSection);
+
+  return((rc == WAIT_TIMEOUT) ? ETIMEDOUT : 0);
+}
+
+/* ************************************ */
+
 /* NOTE: broadcast is currently ignored */
 int signalCondvar(ConditionalVariable *condvarId, int broadcast) {
 #ifdef DEBUG
@@ -1837,7 +1856,7 @@ FlowHashBucket* getListHead(FlowHashBucket **list) {
   if(bkt == NULL)
     traceEvent(TRACE_ERROR, "INTERNAL ERROR: getListHead is empty");
   else
-    (*list) = bkt->core.hash.next;
+    (*list) = bkt->core.hash_next;
 
   return(bkt);
 }
@@ -1846,12 +1865,12 @@ FlowHashBucket* getListHead(FlowHashBucket **list) {
 
 void addToList(FlowHashBucket *bkt, FlowHashBucket **list) {
   if(*list)
-    (*list)->core.hash.prev = bkt;
+    (*list)->ext->hash_prev = bkt;
 
   if(bkt == *list)
     traceEvent(TRACE_ERROR, "INTERNAL ERROR: loop detected");
 
-  bkt->core.hash.next = *list, bkt->core.hash.prev = NULL;
+  bkt->core.hash_next = *list, bkt->ext->hash_prev = NULL;
   (*list) = bkt;
 }
 
@@ -1922,197 +1941,89 @@ void daemonize(void) {
 
    **************************************** */
 
-static int int2bits(int number) {
-  int bits = 8;
-  int test;
-
-  if((number > 255) || (number < 0))
-    return(CONST_INVALIDNETMASK);
-  else {
-    test = ~number & 0xff;
-    while (test & 0x1)
-      {
-	bits --;
-	test = test >> 1;
-      }
-    if(number != ((~(0xff >> bits)) & 0xff))
-      return(CONST_INVALIDNETMASK);
-    else
-      return(bits);
-  }
-}
-
-/* ********************** */
-
-static int dotted2bits(char *mask) {
-  int		fields[4];
-  int		fields_num, field_bits;
-  int		bits = 0;
-  int		i;
-
-  fields_num = sscanf(mask, "%d.%d.%d.%d",
-		      &fields[0], &fields[1], &fields[2], &fields[3]);
-  if((fields_num == 1) && (fields[0] <= 32) && (fields[0] >= 0))
-    {
-#ifdef DEBUG
-      traceEvent(CONST_TRACE_INFO, "DEBUG: dotted2bits (%s) = %d", mask, fields[0]);
-#endif
-      return(fields[0]);
-    }
-  for (i=0; i < fields_num; i++)
-    {
-      /* We are in a dotted quad notation. */
-      field_bits = int2bits (fields[i]);
-      switch (field_bits)
-	{
-	case CONST_INVALIDNETMASK:
-	  return(CONST_INVALIDNETMASK);
-
-	case 0:
-	  /* whenever a 0 bits field is reached there are no more */
-	  /* fields to scan                                       */
-	  /* In this case we are in a bits (not dotted quad) notation */
-	  return(bits /* fields[0] - L.Deri 08/2001 */);
-
-	default:
-	  bits += field_bits;
-	}
-    }
-  return(bits);
-}
-
-/* ********************************* */
-
-static char* read_file(char* path, char* buf, uint buf_len) {
+/* Returns the lines of the file (but comments) separated by commas, to free() */
+static char* read_file(char* path) {
   FILE *fd = fopen(&path[1], "r");
 
   if(fd == NULL) {
     traceEvent(TRACE_WARNING, "Unable to read file %s", path);
     return(NULL);
   } else {
-    char line[256];
-    int idx = 0;
+    char line[256], *buf = NULL;
+    u_int idx = 0, buf_len = 0;
 
     while(!feof(fd) && (fgets(line, sizeof(line), fd) != NULL)) {
+      u_int len;
+
       if((line[0] == '#') || (line[0] == '\n')) continue;
       while(strlen(line) && (line[strlen(line)-1] == '\n')) {
 	line[strlen(line)-1] = '\0';
       }
 
-      snprintf(&buf[idx], buf_len-idx-2, "%s%s", (idx > 0) ? "," : "", line);
-      idx = strlen(buf);
+      len = strlen(line);
+      if((idx + len + 2) > buf_len) {
+	char *new_buf;
+
+	buf_len = 2 * (idx + len + 2);
+	if((new_buf = (char*)realloc(buf, buf_len)) == NULL) {
+	  traceEvent(TRACE_ERROR, "Not enough memory");
+	  break;
+	}
+
+	buf = new_buf;
+      }
+
+      idx += sprintf(&buf[idx], "%s%s", (idx > 0) ? "," : "", line);
     }
 
     fclose(fd);
-    return(buf);
+    return((buf != NULL) ? buf : strdup(""));
   }
 }
 
-/* ********************************* */
-
-static u_int8_t num_network_bits(u_int32_t addr) {
-  u_int8_t i, j, bits = 0, fields[4];
-
-  memcpy(fields, &addr, 4);
-
-  for(i = 8; i <= 8; i--)
-    for(j=0; j<4; j++)
-      if ((fields[j] & (1 << i)) != 0) bits++;
+/* ********************** */
 
-  return(bits);
+static char* readAddressList(char *_addresses) {
+  if(_addresses[0] == '@')
+    return(read_file(_addresses));
+  else
+    return(strdup(_addresses));
 }
 
 /* ********************** */
 
-typedef struct {
-  u_int32_t network;
-  u_int32_t networkMask;
-  u_int32_t broadcast;
-} netAddress_t;
-
-int parseAddress(char * address, netAddress_t * netaddress) {
-  u_int32_t network, networkMask, broadcast;
-  int bits, a, b, c, d;
-  char *mask = strchr(address, '/');
-
-  if(mask == NULL)
-    bits= 32;
-  else {
-    mask[0] = '\0';
-    mask++;
-    bits = dotted2bits (mask);
-  }
-
-  if(sscanf(address, "%d.%d.%d.%d", &a, &b, &c, &d) != 4)
-    return -1;
-
-  if(bits == CONST_INVALIDNETMASK) {
-    traceEvent(TRACE_WARNING, "netmask '%s' not valid - ignoring entry", mask);
-    /* malformed netmask specification */
-    return -1;
-  }
-
-  network = ((a & 0xff) << 24) + ((b & 0xff) << 16) + ((c & 0xff) << 8) + (d & 0xff);
-  /* Special case the /32 mask - yeah, we could probably do it with some fancy
-     u long long stuff, but this is simpler...
-     Burton Strauss <Burton@ntopsupport.com> Jun2002
-  */
-  if(bits == 32) {
-    networkMask = 0xffffffff;
-  } else {
-    networkMask = 0xffffffff >> bits;
-    networkMask = ~networkMask;
-  }
-
-  if((network & networkMask) != network)  {
-    /* malformed network specification */
-
-    traceEvent(TRACE_WARNING, "%d.%d.%d.%d/%d is not a valid network - correcting mask",
-	       a, b, c, d, bits);
-    /* correcting network numbers as specified in the netmask */
-    network &= networkMask;
-
-    /*
-      a = (int) ((network >> 24) & 0xff);
-      b = (int) ((network >> 16) & 0xff);
-      c = (int) ((network >>  8) & 0xff);
-      d = (int) ((network >>  0) & 0xff);
-
-      traceEvent(CONST_TRACE_NOISY, "Assuming %d.%d.%d.%d/%d [0x%08x/0x%08x]",
-      a, b, c, d, bits, network, networkMask);
-    */
+/*
+  The network lists are compiled into LPM tables (lpm.c). On reload
+  (SIGHUP) a new table is built and swapped in while the packet and
+  export threads go on looking up the previous one. An empty list
+  publishes no table, so a reload can remove all the networks; when
+  the list cannot be read the current table is kept.
+*/
+static void publishNetworkList(LpmTable **where, u_int32_t *num, LpmTable *t) {
+  if((t != NULL) && (lpmBuild(t) != 0)) {
+    freeLpmTable(t);
+    return;
   }
 
-  broadcast = network | (~networkMask);
-
-  a = (int) ((network >> 24) & 0xff);
-  b = (int) ((network >> 16) & 0xff);
-  c = (int) ((network >>  8) & 0xff);
-  d = (int) ((network >>  0) & 0xff);
-
-  traceEvent(TRACE_INFO, "Adding %d.%d.%d.%d/%d to the local network list",
-	     a, b, c, d, bits);
-
-  netaddress->network     = network;
-  netaddress->networkMask = networkMask;
-  netaddress->broadcast   = broadcast;
-
-  return 0;
+  publishLpmTable(where, t);
+  *num = t ? t->num_prefixes : 0;
 }
 
 /* ********************** */
 
 void parseLocalAddressLists(char* _addresses) {
-  char *address, *addresses, *strTokState = NULL, buf[2048];
+  char *address, *addresses, *strTokState = NULL;
+  LpmTable *t;
 
-  readOnlyGlobals.numLocalNetworks = 0;
-
-  if((_addresses == NULL) || (_addresses[0] == '\0'))
+  if((_addresses == NULL) || (_addresses[0] == '\0')) {
+    publishNetworkList(&readOnlyGlobals.localNetworks, &readOnlyGlobals.numLocalNetworks, NULL);
     return;
-  else if(_addresses[0] == '@') {
-    addresses = strdup(read_file(_addresses, buf, sizeof(buf)));
-  } else
-    addresses = strdup(_addresses);
+  } else if((addresses = readAddressList(_addresses)) == NULL)
+    return;
+  else if((t = createLpmTable(NULL)) == NULL) {
+    free(addresses);
+    return;
+  }
 
   address = strtok_r(addresses, ",", &strTokState);
 
@@ -2121,196 +2032,90 @@ void parseLocalAddressLists(char* _addresses) {
 
     if(mask == NULL) {
       traceEvent(TRACE_WARNING, "Empty mask '%s' - ignoring entry", address);
-    } else {
-      netAddress_t netaddress;
-
-      if(readOnlyGlobals.numLocalNetworks >= MAX_NUM_NETWORKS) {
-	traceEvent(TRACE_WARNING, "Too many networks defined (-L): skipping further networks");
-	break;
-      }
-
-      if(parseAddress(address, &netaddress)==-1) {
-	address = strtok_r(NULL, ",", &strTokState);
-	continue;
-      }
-
-      /* NOTE: entries are saved in network byte order for performance reasons */
-      readOnlyGlobals.localNetworks[readOnlyGlobals.numLocalNetworks].network    = htonl(netaddress.network);
-      readOnlyGlobals.localNetworks[readOnlyGlobals.numLocalNetworks].netmask    = htonl(netaddress.networkMask);
-      readOnlyGlobals.localNetworks[readOnlyGlobals.numLocalNetworks].broadcast  = htonl(netaddress.broadcast);
-      readOnlyGlobals.localNetworks[readOnlyGlobals.numLocalNetworks].netmask_v6 = num_network_bits(netaddress.networkMask); /* Host byte-order */
-      readOnlyGlobals.numLocalNetworks++;
-    }
+    } else if(lpmParsePrefix(t, address, 0) == 0)
+      traceEvent(TRACE_INFO, "Adding %s to the local network list", address);
 
     address = strtok_r(NULL, ",", &strTokState);
   }
 
   free(addresses);
-}
-
-/* ********************** */
-
-#define MAX_NUM_ENTRIES 256
-
-struct net_sort {
-  u_int mask;
-  char *network;
-};
-
-int cmpNet(const void *_a, const void *_b) {
-  struct net_sort *a = (struct net_sort*)_a;
-  struct net_sort *b = (struct net_sort*)_b;
-
-  if(a->mask == b->mask) return(0);
-  else if(a->mask > b->mask) return(-1);
-  else return(1);
-}
-
-/* ********************** */
-
-char *sortNetworks(char *_addresses) {
-  int num = 0, i, len = strlen(_addresses)+1;
-  char  *strTokState = NULL, *address;
-  struct net_sort nwsort[MAX_NUM_ENTRIES];
-
-  address = strtok_r(_addresses, ",", &strTokState);
-
-  while(address != NULL) {
-    if(num < MAX_NUM_ENTRIES) {
-      char *mask = strchr(address, '/');
-
-      if(mask != NULL) {
-	nwsort[num].mask = atoi(&mask[1]);
-	nwsort[num++].network = address;
-      } else {
-	/*
-	  This looks like a mac address or an IP
-	  address without a /mask
-	*/
-	nwsort[num].mask = 32; /* / 32 */
-	nwsort[num++].network = address;
-      }
-    }
-
-    address = strtok_r(NULL, ",", &strTokState);
-  }
-
-  qsort(nwsort, num, sizeof(struct net_sort), cmpNet);
-
-  address = (char*)malloc(len);
-  if(address == NULL) {
-    traceEvent(TRACE_ERROR, "Not enough memory");
-    return(_addresses);
-  } else
-    address[0] = '\0';
-
-  for(i=0; i<num; i++) {
-    // traceEvent(TRACE_WARNING, "%s => %d", nwsort[i].network, nwsort[i].mask);
-    sprintf(&address[strlen(address)], "%s%s", (i == 0) ? "" : ",", nwsort[i].network);
-  }
-
-  /* traceEvent(TRACE_WARNING, "<=> '%s'", address); */
-
-  return(address);
+  publishNetworkList(&readOnlyGlobals.localNetworks, &readOnlyGlobals.numLocalNetworks, t);
 }
 
 /* ********************** */
 
 void parseInterfaceAddressLists(char* _addresses) {
-  char *address, *addresses, *strTokState = NULL, buf[2048];
-
-  readOnlyGlobals.numInterfaceNetworks = 0;
+  char *address, *addresses, *strTokState = NULL;
+  LpmTable *t;
 
-  if((_addresses == NULL) || (_addresses[0] == '\0'))
+  if((_addresses == NULL) || (_addresses[0] == '\0')) {
+    publishNetworkList(&readOnlyGlobals.interfaceNetworks, &readOnlyGlobals.numInterfaceNetworks, NULL);
     return;
-  else if(_addresses[0] == '@') {
-    addresses = strdup(read_file(_addresses, buf, sizeof(buf)));
-  } else
-    addresses = strdup(_addresses);
-
-  addresses = sortNetworks(addresses);
+  } else if((addresses = readAddressList(_addresses)) == NULL)
+    return;
+  else if((t = createLpmTable(NULL)) == NULL) {
+    free(addresses);
+    return;
+  }
 
   address = strtok_r(addresses, ",", &strTokState);
 
   while(address != NULL) {
-    char *mask;
     char *at = strchr(address, '@');
     u_int a, b, c, d, e, f, ifIdx;
 
     /* traceEvent(TRACE_WARNING, "Parsing %s", address); */
 
-    mask = strchr(address, '/');
-
-    if((mask == NULL)
-       && (sscanf(address, "%d.%d.%d.%d@%d", &a, &b, &c, &d, &e) != 5) /* IP without /mask */) {
-      /* Maybe this is a MAC address */
-
-      if(sscanf(address, "%2X:%2X:%2X:%2X:%2X:%2X@%d", &a, &b, &c, &d, &e, &f, &ifIdx) != 7) {
-	traceEvent(TRACE_WARNING,
-		   "WARNING: Wrong MAC address/Interface specified (format AA:BB:CC:DD:EE:FF@4) "
-		   "with '-L': ignored");
+    if(at == NULL) {
+      traceEvent(TRACE_WARNING, "Invalid format for network %s: ignored", address);
+    } else if((strchr(address, '/') == NULL)
+	      && (sscanf(address, "%2X:%2X:%2X:%2X:%2X:%2X@%d", &a, &b, &c, &d, &e, &f, &ifIdx) == 7)) {
+      /* MAC address */
+      if(readWriteGlobals->num_src_mac_export >= NUM_MAC_INTERFACES) {
+	traceEvent(TRACE_ERROR, "Too many '-L' specified [max %u]. Ignored.", NUM_MAC_INTERFACES);
+	break;
       } else {
-	if(readWriteGlobals->num_src_mac_export >= NUM_MAC_INTERFACES) {
-	  traceEvent(TRACE_ERROR, "Too many '-L' specified [max %u]. Ignored.", NUM_MAC_INTERFACES);
-	  break;
-	} else {
-	  readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[0] = a,
-	    readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[1] = b,
-	    readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[2] = c,
-	    readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[3] = d,
-	    readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[4] = e,
-	    readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[5] = f,
-	    readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].interface_id = ifIdx;
-	  readWriteGlobals->num_src_mac_export++;
-	}
+	readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[0] = a,
+	  readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[1] = b,
+	  readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[2] = c,
+	  readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[3] = d,
+	  readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[4] = e,
+	  readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].mac_address[5] = f,
+	  readOnlyGlobals.mac_if_match[readWriteGlobals->num_src_mac_export].interface_id = ifIdx;
+	readWriteGlobals->num_src_mac_export++;
       }
     } else {
-      netAddress_t netaddress;
-
-      if(readOnlyGlobals.numInterfaceNetworks >= MAX_NUM_NETWORKS) {
-	traceEvent(TRACE_WARNING, "Too many networks defined (-L): skipping further networks [max %u]",
-		   MAX_NUM_NETWORKS);
-	break;
-      }
+      /* Network: the value is the interface index and the mask bits (ip2mask) */
+      at[0] = '\0', ifIdx = atoi(&at[1]);
 
-      if(at == NULL) {
-	traceEvent(TRACE_WARNING, "Invalid format for network %s: ignored", address);
-      } else {
-	at[0] = '\0';
-	if(parseAddress(address, &netaddress) == -1) {
-	  address = strtok_r(NULL, ",", &strTokState);
-	  continue;
-	}
-
-	/* NOTE: entries are saved in network byte order for performance reasons */
-	readOnlyGlobals.interfaceNetworks[readOnlyGlobals.numInterfaceNetworks].network    = htonl(netaddress.network);
-	readOnlyGlobals.interfaceNetworks[readOnlyGlobals.numInterfaceNetworks].netmask    = htonl(netaddress.networkMask);
-	readOnlyGlobals.interfaceNetworks[readOnlyGlobals.numInterfaceNetworks].broadcast  = htonl(netaddress.broadcast);
-	readOnlyGlobals.interfaceNetworks[readOnlyGlobals.numInterfaceNetworks].netmask_v6 = num_network_bits(netaddress.networkMask); /* Host byte-order */
-	readOnlyGlobals.interfaceNetworks[readOnlyGlobals.numInterfaceNetworks].interface_id = atoi(&at[1]);
-	readOnlyGlobals.numInterfaceNetworks++;
-      }
+      if(ifIdx > 0xFFFF)
+	traceEvent(TRACE_WARNING, "Invalid interface index for network %s: ignored", address);
+      else if(lpmParsePrefix(t, address, ifIdx << 8) == 0)
+	t->prefixes[t->num_prefixes-1].value |= t->prefixes[t->num_prefixes-1].bits;
     }
 
     address = strtok_r(NULL, ",", &strTokState);
   }
 
   free(addresses);
+  publishNetworkList(&readOnlyGlobals.interfaceNetworks, &readOnlyGlobals.numInterfaceNetworks, t);
 }
 
 /* ************************************************ */
 
 void parseBlacklistNetworks(char* _addresses) {
-  char *address, *addresses, buf[2048], *strTokState = NULL;
+  char *address, *addresses, *strTokState = NULL;
+  LpmTable *t;
 
-  readOnlyGlobals.numBlacklistNetworks = 0;
-
-  if((_addresses == NULL) || (_addresses[0] == '\0'))
+  if((_addresses == NULL) || (_addresses[0] == '\0')) {
+    publishNetworkList(&readOnlyGlobals.blacklistNetworks, &readOnlyGlobals.numBlacklistNetworks, NULL);
     return;
-  else if(_addresses[0] == '@') {
-    addresses = strdup(read_file(_addresses, buf, sizeof(buf)));
-  } else
-    addresses = strdup(_addresses);
+  } else if((addresses = readAddressList(_addresses)) == NULL)
+    return;
+  else if((t = createLpmTable(NULL)) == NULL) {
+    free(addresses);
+    return;
+  }
 
   address = strtok_r(addresses, ",", &strTokState);
 
@@ -2319,31 +2124,14 @@ void parseBlacklistNetworks(char* _addresses) {
 
     if(mask == NULL) {
       traceEvent(TRACE_WARNING, "Empty mask '%s' - ignoring entry", address);
-    } else {
-      netAddress_t netaddress;
-
-      if(readOnlyGlobals.numBlacklistNetworks >= MAX_NUM_NETWORKS) {
-	traceEvent(TRACE_WARNING, "Too many networks defined (--black-list): skipping further networks [max %u]", MAX_NUM_NETWORKS);
-	break;
-      }
-
-      if (parseAddress(address,&netaddress)==-1) {
-	address = strtok_r(NULL, ",", &strTokState);
-	continue;
-      }
-
-      /* NOTE: entries are saved in network byte order for performance reasons */
-      readOnlyGlobals.blacklistNetworks[readOnlyGlobals.numBlacklistNetworks].network    = htonl(netaddress.network);
-      readOnlyGlobals.blacklistNetworks[readOnlyGlobals.numBlacklistNetworks].netmask    = htonl(netaddress.networkMask);
-      readOnlyGlobals.blacklistNetworks[readOnlyGlobals.numBlacklistNetworks].broadcast  = htonl(netaddress.broadcast);
-      readOnlyGlobals.blacklistNetworks[readOnlyGlobals.numBlacklistNetworks].netmask_v6 = num_network_bits(netaddress.networkMask); /* Host byte-order */
-      readOnlyGlobals.numBlacklistNetworks++;
-    }
+    } else
+      lpmParsePrefix(t, address, 0);
 
     address = strtok_r(NULL, ",", &strTokState);
   }
 
   free(addresses);
+  publishNetworkList(&readOnlyGlobals.blacklistNetworks, &readOnlyGlobals.numBlacklistNetworks, t);
 }
 
 /* ************************************************ */
@@ -2351,62 +2139,55 @@ void parseBlacklistNetworks(char* _addresses) {
 //#define DEBUG
 #undef DEBUG
 
-static u_int8_t getIfIdx(struct in_addr *addr, u_int16_t *interface_id) {
-  int i;
+static u_int8_t getIfIdx(IpAddress *addr, u_int16_t *interface_id) {
+  u_int32_t value = lpmLookup(readOnlyGlobals.interfaceNetworks, addr);
 
-  if(readOnlyGlobals.numInterfaceNetworks == 0) return(0);
+  if(value == LPM_NO_MATCH) return(0);
 
-  for(i=0; i<readOnlyGlobals.numInterfaceNetworks; i++)
-    if((addr->s_addr & readOnlyGlobals.interfaceNetworks[i].netmask) == readOnlyGlobals.interfaceNetworks[i].network) {
-      *interface_id = readOnlyGlobals.interfaceNetworks[i].interface_id;
-      return(1);
-    }
+  *interface_id = value >> 8;
+  return(1);
+}
 
-  return(0);
+/* ************************************************ */
+
+u_int8_t isLocalIpAddress(IpAddress *addr) {
+  LpmTable *t = readOnlyGlobals.localNetworks;
+
+  /* If unset all the addresses are local */
+  if((t == NULL) || (t->num_prefixes == 0)) return(1);
+
+  return((lpmLookup(t, addr) == LPM_NO_MATCH) ? 0 : 1);
 }
 
 /* ************************************************ */
 
 unsigned short isLocalAddress(struct in_addr *addr) {
-  int i;
+  LpmTable *t = readOnlyGlobals.localNetworks;
 
   /* If unset all the addresses are local */
-  if(readOnlyGlobals.numLocalNetworks == 0) return(1);
+  if((t == NULL) || (t->num_prefixes == 0)) return(1);
 
-  for(i=0; i<readOnlyGlobals.numLocalNetworks; i++)
-    if((addr->s_addr & readOnlyGlobals.localNetworks[i].netmask) == readOnlyGlobals.localNetworks[i].network) {
-      return 1;
-    }
-
-  return(0);
+  return((lpmLookupV4(t, ntohl(addr->s_addr)) == LPM_NO_MATCH) ? 0 : 1);
 }
 
 /* ************************************************ */
 
 u_short isBlacklistedAddress(struct in_addr *addr) {
-  int i;
+  u_short rc = (lpmLookupV4(readOnlyGlobals.blacklistNetworks, ntohl(addr->s_addr)) == LPM_NO_MATCH) ? 0 : 1;
 #ifdef DEBUG
   char buf[64];
-#endif
 
-  /* If unset is not blacklisted */
-  if(readOnlyGlobals.numBlacklistNetworks == 0) return(0);
+  traceEvent(TRACE_INFO, "%s is %sblacklisted",
+	     _intoaV4(ntohl(addr->s_addr), buf, sizeof(buf)), rc ? "" : "NOT ");
+#endif
 
-  for(i=0; i<readOnlyGlobals.numBlacklistNetworks; i++)
-    if((addr->s_addr & readOnlyGlobals.blacklistNetworks[i].netmask) == readOnlyGlobals.blacklistNetworks[i].network) {
+  return(rc);
+}
 
-#ifdef DEBUG
-      traceEvent(TRACE_INFO, "%s is blacklisted",
-		 _intoaV4(ntohl(addr->s_addr), buf, sizeof(buf)));
-#endif
-      return 1;
-    }
+/* ************************************************ */
 
-#ifdef DEBUG
-  traceEvent(TRACE_INFO, "%s is NOT blacklisted",
-	     _intoaV4(ntohl(addr->s_addr), buf, sizeof(buf)));
-#endif
-  return(0);
+u_short isBlacklistedAddressV6(struct in6_addr *addr) {
+  return((lpmLookupV6(readOnlyGlobals.blacklistNetworks, addr) == LPM_NO_MATCH) ? 0 : 1);
 }
 
 /* ************************************************ */
@@ -2455,9 +2236,9 @@ char* etheraddr_string(const u_char *ep, char *buf) {
 
 void decrementLastPacket(FlowHashBucket *bkt, FlowDirection flow_direction, u_int len) {
   if(flow_direction == src2dst_direction /* src -> dst */)
-    bkt->core.tuple.flowCounters.bytesSent -= len, bkt->core.tuple.flowCounters.pktSent -= 1;
+    bkt->core.flowCounters.bytesSent -= len, bkt->core.flowCounters.pktSent -= 1;
   else
-    bkt->core.tuple.flowCounters.bytesRcvd -= len, bkt->core.tuple.flowCounters.pktRcvd -= 1;
+    bkt->core.flowCounters.bytesRcvd -= len, bkt->core.flowCounters.pktRcvd -= 1;
 }
 
 /* ************************************ */
@@ -2470,10 +2251,10 @@ void resetBucketStats(FlowHashBucket* bkt,
 		      u_char *payload, int payloadLen) {
   bkt->core.bucket_expired = 0; /* Not really necessary */
 
-  memset(&bkt->core.tuple.flowCounters, 0, sizeof(bkt->core.tuple.flowCounters));
+  memset(&bkt->core.flowCounters, 0, sizeof(bkt->core.flowCounters));
 
   if(bkt->ext != NULL) {
-    //memset(&bkt->core.tuple.flowTimers, 0, sizeof(bkt->core.tuple.flowTimers));
+    //memset(&bkt->ext->tuple.flowTimers, 0, sizeof(bkt->ext->tuple.flowTimers));
     if(bkt->ext->extensions != NULL) {
       //memset(&bkt->ext->extensions->clientNwLatency, 0, sizeof(bkt->ext->extensions->clientNwLatency));
       //memset(&bkt->ext->extensions->serverNwLatency, 0, sizeof(bkt->ext->extensions->serverNwLatency));
@@ -2485,26 +2266,26 @@ void resetBucketStats(FlowHashBucket* bkt,
   }
 
   if(direction == src2dst_direction /* src -> dst */) {
-    bkt->core.tuple.flowCounters.bytesSent = len, bkt->core.tuple.flowCounters.pktSent = 1, bkt->core.tuple.flowCounters.bytesRcvd = bkt->core.tuple.flowCounters.pktRcvd = 0;
-    memcpy(&bkt->core.tuple.flowTimers.firstSeenSent, &h->ts, sizeof(struct timeval));
-    memcpy(&bkt->core.tuple.flowTimers.lastSeenSent, &h->ts, sizeof(struct timeval));
+    bkt->core.flowCounters.bytesSent = len, bkt->core.flowCounters.pktSent = 1, bkt->core.flowCounters.bytesRcvd = bkt->core.flowCounters.pktRcvd = 0;
+    memcpy(&bkt->ext->tuple.flowTimers.firstSeenSent, &h->ts, sizeof(struct timeval));
+    memcpy(&bkt->ext->tuple.flowTimers.lastSeenSent, &h->ts, sizeof(struct timeval));
     /* Reset the opposite direction */
-    memset(&bkt->core.tuple.flowTimers.firstSeenRcvd, 0, sizeof(struct timeval));
-    memset(&bkt->core.tuple.flowTimers.lastSeenRcvd, 0, sizeof(struct timeval));
+    memset(&bkt->ext->tuple.flowTimers.firstSeenRcvd, 0, sizeof(struct timeval));
+    memset(&bkt->ext->tuple.flowTimers.lastSeenRcvd, 0, sizeof(struct timeval));
   } else {
-    bkt->core.tuple.flowCounters.bytesSent = bkt->core.tuple.flowCounters.pktSent = 0, bkt->core.tuple.flowCounters.bytesRcvd = len, bkt->core.tuple.flowCounters.pktRcvd = 1;
-    memcpy(&bkt->core.tuple.flowTimers.firstSeenRcvd, &h->ts, sizeof(struct timeval));
-    memcpy(&bkt->core.tuple.flowTimers.lastSeenRcvd, &h->ts, sizeof(struct timeval));
+    bkt->core.flowCounters.bytesSent = bkt->core.flowCounters.pktSent = 0, bkt->core.flowCounters.bytesRcvd = len, bkt->core.flowCounters.pktRcvd = 1;
+    memcpy(&bkt->ext->tuple.flowTimers.firstSeenRcvd, &h->ts, sizeof(struct timeval));
+    memcpy(&bkt->ext->tuple.flowTimers.lastSeenRcvd, &h->ts, sizeof(struct timeval));
     /* Reset the opposite direction */
-    memset(&bkt->core.tuple.flowTimers.firstSeenSent, 0, sizeof(struct timeval));
-    memset(&bkt->core.tuple.flowTimers.lastSeenSent, 0, sizeof(struct timeval));
+    memset(&bkt->ext->tuple.flowTimers.firstSeenSent, 0, sizeof(struct timeval));
+    memset(&bkt->ext->tuple.flowTimers.lastSeenSent, 0, sizeof(struct timeval));
   }
 
   /* NOTE: don't reset TOS as this is part of the flow key */
   bkt->ext->flags = 0;
 
   /* Don't reset the nDPI protocol as this is gonna be the same */
-  // bkt->core.l7.proto.ndpi_proto = NDPI_PROTOCOL_UNKNOWN;
+  // bkt->ext->cold.l7.proto.ndpi_proto = NDPI_PROTOCOL_UNKNOWN;
 
   if(payloadLen > 0)
     setPayload(bkt, h, p, ip_offset, payload, payloadLen, direction);
@@ -3371,19 +3152,6 @@ void dumpRfc822Info(struct rfc822_info *info) {
 
 /* *********************************************** */
 
-void initQueue(ItemsQueue *q) {
-  memset(q, 0, sizeof(ItemsQueue));
-  createCondvar(&q->dequeue_condvar);
-}
-
-/* *********************************************** */
-
-void deleteQueue(ItemsQueue *q) {
-  deleteCondvar(&q->dequeue_condvar);
-}
-
-/* *********************************************** */
-
 void initAtomic(atomic_u_int32_t *a) {
   a->value = 0;
 #ifndef HAVE_BUILTIN_ATOMIC
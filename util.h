@@ -54,23 +54,6 @@ struct rfc822_info {
   u_int8_t begin_data_cmd, email_header_processed, email_header_full;
 };
 
-typedef struct {
-  u_int8_t packet_ready, rx_direction;
-  u_int32_t packet_hash;
-  struct pcap_pkthdr h;
-  u_char *p;
-  int packet_if_idx /* -1 = unknown */;
-} QueuedPacket;
-
-#define DEFAULT_QUEUE_CAPACITY  1024
-
-typedef struct {
-  u_int16_t insert_idx, remove_idx;
-  u_int32_t num_insert, num_remove;
-  ConditionalVariable dequeue_condvar;
-  void *queueSlots;
-} ItemsQueue;
-
 typedef struct {
   u_int32_t value;
 #ifndef HAVE_BUILTIN_ATOMIC
@@ -132,6 +115,7 @@ extern void addToList(FlowHashBucket *bkt, FlowHashBucket **list);
 extern void parseInterfaceAddressLists(char* _addresses);
 extern void parseLocalAddressLists(char* _addresses);
 extern unsigned short isLocalAddress(struct in_addr *addr);
+extern u_int8_t isLocalIpAddress(IpAddress *addr);
 extern u_int32_t str2addr(char *address);
 extern char* etheraddr_string(const u_char *ep, char *buf);
 extern void fixTemplateToIPFIX(void);
@@ -173,6 +157,7 @@ extern void free_bitmask(bitmask_selector *selector);
 /* nprobe.c */
 extern void parseBlacklistNetworks(char* _addresses);
 extern u_short isBlacklistedAddress(struct in_addr *addr) ;
+extern u_short isBlacklistedAddressV6(struct in6_addr *addr);
 
 #ifndef min
 #define min(a, b) ((a > b) ? b : a)
@@ -228,8 +213,6 @@ extern void removeDoubleSpaces(char *str);
 extern char* strnstr(const char *s, const char *find, size_t slen);
 #endif
 
-extern void initQueue(ItemsQueue *q);
-extern void deleteQueue(ItemsQueue *q);
 
 /* ****************************************************** */
 